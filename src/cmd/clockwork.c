@@ -15,6 +15,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
 #include "../iiab/route.h"
 #include "../iiab/itree.h"
 #include "../iiab/tree.h"
@@ -28,6 +29,8 @@
 #include "../iiab/httpd.h"
 #include "../iiab/sig.h"
 #include "../iiab/runq.h"
+#include "../iiab/rt_rs.h"
+#include "../iiab/rs_mem.h"
 #include "../iiab/job.h"
 #include "../probe/probe.h"
 
@@ -153,7 +156,11 @@ int main(int argc, char **argv) {
      sig_init();
      meth_init(argc, argv, stopclock_meth);
      meth_add(&probe_cbinfo);
+     meth_configure(iiab_cf);	/* thread pool and methods to run in it */
      runq_init(time(NULL));
+     runq_usetimerfd();		/* dispatch from meth_relay(), not SIGALRM */
+     rt_rs_usemem(cf_defined(iiab_cf, RT_RS_CF_MEM) ? 
+		  cf_getint(iiab_cf, RT_RS_CF_MEM) : RS_MEM_NSAMPLES);
      job_init();
      clock_done_init++;
      if ( ! opt_f ) {
@@ -167,16 +174,34 @@ int main(int argc, char **argv) {
 	       /* start http server with the following services */
 	       httpd_init();
 	       httpd_addpath("/ping",     httpd_builtin_ping);
-	       httpd_addpath("/cf",       httpd_builtin_cf);
-	       httpd_addpath("/cftsv",    httpd_builtin_cf);
-	       httpd_addpath("/elog",     httpd_builtin_elog);
+	       httpd_addpath_inline("/cf",    httpd_builtin_cf);
+	       httpd_addpath_inline("/cftsv", httpd_builtin_cf);
+	       httpd_addpath_inline("/elog",  httpd_builtin_elog);
 	       httpd_addpath("/info",     httpd_builtin_info);
 	       httpd_addpath("/local/",   httpd_builtin_local);
 	       httpd_addpath("/localtsv/",httpd_builtin_local);
+	       httpd_addpath("/nmalloc",  httpd_builtin_nmalloc);
+	       httpd_addpath("/nmalloctsv",httpd_builtin_nmalloc);
 	       httpd_start();
 	  }
      }
 
+#if NMSAMPLE
+     /* periodically save the sampled memory profile if asked */
+     if (cf_defined(iiab_cf, NM_CFRING)) {
+	  char nmpurl[1024];
+	  int nmint;
+
+	  route_expand(nmpurl, cf_getstr(iiab_cf, NM_CFRING), "nmalloc", 0);
+	  nmint = cf_defined(iiab_cf, NM_CFINTERVAL) ? 
+	       cf_getint(iiab_cf, NM_CFINTERVAL) : NM_SAVEINTERVAL;
+	  if (nmint <= 0)
+	       nmint = NM_SAVEINTERVAL;
+	  runq_add(time(NULL), nmint, 0, 0, "nmalloc", NULL, nm_sample_save,
+		   NULL, NULL, xnstrdup(nmpurl), strlen(nmpurl)+1);
+     }
+#endif
+
      /* set up signal handlers */
      sig_setexit(stopclock_sig);
 
@@ -15,9 +15,14 @@
  * Callback functions are called in the order they were registered.
  * Events can be removed, in which case associated callbacks are removed.
  *
+ * Events may be raised from any thread. The callbacks of an event are 
+ * copied under a lock before being called, so a callback may register or
+ * remove others, which takes effect from the next raise.
+ *
  * Copyright System Garden Ltd 2001. All rights reserved.
  */
 
+#include <pthread.h>
 #include "callback.h"
 #include "tree.h"
 #include "ptree.h"
@@ -29,6 +34,7 @@
  * the function pointer cast to int, the value of the PTREE is NULL.
  */
 TREE *callback_events=0;
+pthread_mutex_t callback_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void callback_init()
 {
@@ -62,14 +68,18 @@ void callback_mkevent(char *e_name)
      char *name;
      PTREE *cbs;
 
-     if (tree_find(callback_events, e_name) != TREE_NOVAL)
+     pthread_mutex_lock(&callback_lock);
+     if (tree_find(callback_events, e_name) != TREE_NOVAL) {
+	  pthread_mutex_unlock(&callback_lock);
 	  return;
+     }
 
      name = xnstrdup(e_name);
      /* only need a linked list or dynamic array or addresses as the 
       * structure. Dont have that atm, so we use a PTREE */
      cbs = ptree_create();
      tree_add(callback_events, name, cbs);
+     pthread_mutex_unlock(&callback_lock);
 }
 
 
@@ -80,12 +90,16 @@ void callback_mkevent(char *e_name)
  */
 int  callback_rmevent(char *e_name)
 {
-     if (tree_find(callback_events, e_name) == TREE_NOVAL)
+     pthread_mutex_lock(&callback_lock);
+     if (tree_find(callback_events, e_name) == TREE_NOVAL) {
+	  pthread_mutex_unlock(&callback_lock);
 	  return 0;
+     }
 
      nfree( tree_getkey(callback_events) );
      ptree_destroy( (PTREE *) tree_get(callback_events) );
      tree_rm(callback_events);
+     pthread_mutex_unlock(&callback_lock);
 
      return 1;
 }
@@ -99,14 +113,13 @@ void callback_regcb(char *e_name, void(*cb)(void*,void*,void*,void*))
 {
      PTREE *cbs;
 
-     if (tree_find(callback_events, e_name) == TREE_NOVAL) {
-	  callback_mkevent(e_name);
-	  tree_find(callback_events, e_name);
-     }
-
+     callback_mkevent(e_name);		/* if it does not exist */
+     pthread_mutex_lock(&callback_lock);
+     tree_find(callback_events, e_name);
      cbs = tree_get(callback_events);
      if (ptree_find(cbs, cb) == PTREE_NOVAL)
-	  ptree_add(cbs, cb, NULL);
+	  ptree_add(cbs, cb, cb);	/* ptree_find() needs a value */
+     pthread_mutex_unlock(&callback_lock);
 }
 
 
@@ -117,17 +130,19 @@ void callback_regcb(char *e_name, void(*cb)(void*,void*,void*,void*))
 int  callback_unregcb(char *e_name, void(*cb)(void*,void*,void*,void*))
 {
      PTREE *cbs;
+     int r=0;
+
+     pthread_mutex_lock(&callback_lock);
+     if (tree_find(callback_events, e_name) != TREE_NOVAL) {
+	  cbs = tree_get(callback_events);
+	  if (ptree_find(cbs, cb) != PTREE_NOVAL) {
+	       ptree_rm(cbs);
+	       r = 1;
+	  }
+     }
+     pthread_mutex_unlock(&callback_lock);
 
-     if (tree_find(callback_events, e_name) == TREE_NOVAL)
-	  return 0;
-
-     cbs = tree_get(callback_events);
-     if (ptree_find(cbs, cb) == PTREE_NOVAL)
-	  return 0;
-
-     ptree_rm(cbs);
-
-     return 1;
+     return r;
 }
 
 
@@ -142,21 +157,28 @@ int  callback_raise(char *e_name, void *arg1, void *arg2, void *arg3,
 		    void *arg4)
 {
      PTREE *cbs;
-     void (*cb)(void*,void*,void*,void*) = 0;
-     int n=0;
+     void (*cb[CALLBACK_MAXCB])(void*,void*,void*,void*);
+     int i, n=0;
 
+     /* take a copy of the callbacks, to be called without the lock */
+     pthread_mutex_lock(&callback_lock);
      if (tree_find(callback_events, e_name) == TREE_NOVAL) {
+	  pthread_mutex_unlock(&callback_lock);
 	  elog_printf(DEBUG, "event %s not registered", e_name);
 	  return 0;
      }
-
      cbs = tree_get(callback_events);
      ptree_traverse(cbs) {
-	  cb = ptree_getkey(cbs);
+	  if (n == CALLBACK_MAXCB)
+	       break;
+	  cb[n++] = ptree_getkey(cbs);
+     }
+     pthread_mutex_unlock(&callback_lock);
+
+     for (i=0; i < n; i++) {
 	  elog_printf(DEBUG, "event %s raised -> calling %p", 
-		      e_name, cb);
-	  (*cb)(arg1, arg2, arg3, arg4);
-	  n++;
+		      e_name, cb[i]);
+	  (*cb[i])(arg1, arg2, arg3, arg4);
      }
 
      return n;
@@ -22,6 +22,8 @@
 #ifndef _CALLBACK_H_
 #define _CALLBACK_H_
 
+#define CALLBACK_MAXCB 64	/* most callbacks called for an event */
+
 void callback_init();
 void callback_fini();
 void callback_mkevent(char *e_name);
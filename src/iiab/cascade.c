@@ -11,12 +11,96 @@
 #include <stdio.h>
 #include <string.h>
 #include <float.h>
+#include <math.h>
+#include <pthread.h>
 #include "cascade.h"
 #include "elog.h"
 #include "tableset.h"
 #include "table.h"
 #include "route.h"
 #include "util.h"
+#include "hash.h"
+#include "nmalloc.h"
+#include "ptree.h"
+#include "callback.h"
+#include "runq.h"
+#include "rt_rs.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CASCADE_X86 1
+#include <immintrin.h>
+#else
+#define CASCADE_X86 0
+#endif
+
+#define CASCADE_NGROUPS   64	/* initial number of groups (power of 2) */
+#define CASCADE_MATSLACK  64	/* spare matrix cells before going row-wise */
+
+/* aggregation kernels, best first */
+struct cascade_kernel {
+     char *name;
+     void (*sum)(double *acc, double *v, int n);
+     void (*min)(double *acc, double *v, int n);
+     void (*max)(double *acc, double *v, int n);
+};
+
+/* a group's key paired with its index, sorted to report groups in order */
+struct cascade_keyord {
+     char *key;
+     int   group;
+};
+
+struct cascade_acc *cascade_priv_getacc(CASCADE *session, char *key);
+struct cascade_col *cascade_priv_addcol(CASCADE *session, char *colname, 
+					char *type);
+void cascade_priv_initval(struct cascade_val *val);
+void cascade_priv_foldval(enum cascade_fn func, struct cascade_val *val, 
+			  int slot, double v);
+void cascade_priv_reset(CASCADE *session);
+void cascade_priv_onwrite(char *file, char *ring, void *dur, void *unused);
+void cascade_priv_tickend();
+void cascade_priv_mkmutex();
+void cascade_priv_staterow(TABLE state, char *rec, char *key, char *col, 
+			   int n, struct cascade_val *val, char *str);
+double cascade_priv_statedbl(TABLE state, char *colname);
+int  cascade_priv_statematch(TABLE state, CASCADE *session);
+char *cascade_priv_keep(TABLE t, char *str);
+int  cascade_priv_group(TABLE dataset, char *keycol, int *grp, int *slot,
+			char ***keys, int **count);
+int  cascade_priv_keycmp(const void *a, const void *b);
+void cascade_priv_aggcol(enum cascade_fn func, ITREE *col, int ngroups,
+			 int nslots, int *grp, int *slot, int *count, 
+			 time_t tdiff, double *mat, double *res);
+int  cascade_priv_kernsupported(struct cascade_kernel *k);
+void cascade_priv_sum_scalar(double *acc, double *v, int n);
+void cascade_priv_min_scalar(double *acc, double *v, int n);
+void cascade_priv_max_scalar(double *acc, double *v, int n);
+#if CASCADE_X86
+void cascade_priv_sum_sse2(double *acc, double *v, int n);
+void cascade_priv_min_sse2(double *acc, double *v, int n);
+void cascade_priv_max_sse2(double *acc, double *v, int n);
+void cascade_priv_sum_avx(double *acc, double *v, int n);
+void cascade_priv_min_avx(double *acc, double *v, int n);
+void cascade_priv_max_avx(double *acc, double *v, int n);
+#endif
+
+struct cascade_kernel cascade_kernels[] = {
+#if CASCADE_X86
+     {"avx",    cascade_priv_sum_avx,    cascade_priv_min_avx,
+                cascade_priv_max_avx},
+     {"sse2",   cascade_priv_sum_sse2,   cascade_priv_min_sse2,
+                cascade_priv_max_sse2},
+#endif
+     {"scalar", cascade_priv_sum_scalar, cascade_priv_min_scalar,
+                cascade_priv_max_scalar},
+     {NULL,     NULL, NULL, NULL}
+};
+struct cascade_kernel *cascade_kern = NULL;	/* selected kernels */
+PTREE *cascade_sessions = NULL;			/* live sessions */
+pthread_mutex_t cascade_mutex;			/* see cascade_lock() */
+pthread_once_t  cascade_mutexonce = PTHREAD_ONCE_INIT;
+char *cascade_statecols[] = {"rec", "key", "col", "n", "sum", "min", "max",
+			     "first", "last", "str", NULL};
 
 
 /* 
@@ -32,6 +116,10 @@
  * start from that point. The position is then remembered for the duration
  * of the session. Each time the sample action is called it will catch up 
  * with all the intervening entries and write a summary to the output route. 
+ * Entries are folded into running values for each key and column as they
+ * are read, so each is read once; ringstore routes are read as they are
+ * written. The running values can be checkpointed to a ringstore so that
+ * a restarted session carries on where it stopped (cascade_resume()).
  * If there are no entries since last time, nothing is generated. 
  * If there is 1 entry since last time, that entry is echoed.
  * For 2 or more entries, the calculations are carried out and a single
@@ -86,6 +174,9 @@
  * Initialise a cascade session.
  * The route is opened now for monitoring, run cascade_sample() to
  * process changes from this point onwards.
+ * If the route is a ringstore (grs:), writes to its ring made in this
+ * process are noticed and folded into the session at the end of the 
+ * run queue dispatch that made them, rather than waiting for the sample.
  * Returns the type CASCADE if successful of NULL otherwise.
  */
 CASCADE *cascade_init(enum cascade_fn func,	/* cascading function */
@@ -94,15 +185,43 @@ CASCADE *cascade_init(enum cascade_fn func,	/* cascading function */
      struct cascade_info *session;
      int seq, size, r;
      time_t modt;
+     char *file, *ring, *dur;
 
      r = route_stat(monroute, NULL, &seq, &size, &modt);
 
      /* save all the details in session structure, the sequence
       * is that of the last one right now */
      session = nmalloc( sizeof(struct cascade_info) );
+     memset(session, 0, sizeof(struct cascade_info));
      session->fn   = func;
      session->purl = xnstrdup(monroute);
      session->seq  = r ? seq+1 : 0;
+     session->cols = tree_create();
+     session->accs = tree_create();
+
+     /* find the ring behind a ringstore route, so we can tell when it
+      * is written: grs:file,ring,dur[,...] */
+     if (strncmp(monroute, RT_RS_GDBM_PREFIX ":", 
+		 strlen(RT_RS_GDBM_PREFIX)+1) == 0) {
+	  file = xnstrdup(monroute + strlen(RT_RS_GDBM_PREFIX)+1);
+	  util_strtok_sc(file, ",");
+	  ring = util_strtok_sc(NULL, ",");
+	  dur  = util_strtok_sc(NULL, ",");
+	  if (ring && dur) {
+	       session->wfile = file;
+	       session->wring = xnstrdup(ring);
+	       session->wdur  = strtol(dur, NULL, 10);
+	  } else
+	       nfree(file);
+     }
+
+     if (cascade_sessions == NULL) {
+	  cascade_sessions = ptree_create();
+	  callback_init();
+	  callback_regcb(RT_RS_CB_WRITE, (void *) cascade_priv_onwrite);
+	  callback_regcb(RUNQ_CB_DISPATCH_END, (void *) cascade_priv_tickend);
+     }
+     ptree_add(cascade_sessions, session, session);
 
      elog_printf(DEBUG, "cascade type %d init on %s from seq %d", 
 		 func, monroute, seq+1);
@@ -113,10 +232,38 @@ CASCADE *cascade_init(enum cascade_fn func,	/* cascading function */
 
 /*
  * End the monitoring of the tablestore and free its referencies
+ * The state is checkpointed first if cascade_resume() gave a route for it.
  * You will not be able to use the CASCADE reference after this call.
  */
 void cascade_fini(CASCADE *session)
 {
+     if (session->cppurl)
+	  cascade_checkpoint(session);
+
+     if (cascade_sessions && 
+	 ptree_find(cascade_sessions, session) != PTREE_NOVAL) {
+	  ptree_rm(cascade_sessions);
+	  if (ptree_n(cascade_sessions) == 0) {
+	       callback_unregcb(RT_RS_CB_WRITE, 
+				(void *) cascade_priv_onwrite);
+	       callback_unregcb(RUNQ_CB_DISPATCH_END, 
+				(void *) cascade_priv_tickend);
+	       ptree_destroy(cascade_sessions);
+	       cascade_sessions = NULL;
+	  }
+     }
+
+     cascade_priv_reset(session);
+     tree_destroy(session->cols);
+     tree_destroy(session->accs);
+     if (session->rt)
+	  route_close(session->rt);
+     if (session->wfile)
+	  nfree(session->wfile);
+     if (session->wring)
+	  nfree(session->wring);
+     if (session->cppurl)
+	  nfree(session->cppurl);
      nfree(session->purl);
      nfree(session);
 }
@@ -125,6 +272,8 @@ void cascade_fini(CASCADE *session)
 /*
  * Sample the tablestore ring set up by cascade_init and described in CASCADE.
  * See the description above for how the thing works.
+ * Any data not yet folded into the session is read first, then the 
+ * accumulated result is emitted and the state starts again.
  * The computed table is sent to the output route and errors are sent to 
  * the error route. Returns 0 for success or -1 for failure.
  */
@@ -132,40 +281,21 @@ int cascade_sample(CASCADE *session,	/* cascade reference */
 		   ROUTE output,	/* output route */
 		   ROUTE error		/* error route */ )
 {
-     ROUTE rt;
-     int r, seq, size, ret=0;
-     time_t modt;
-     TABLE dataset, result;
-
-     /* attempt to read from the current point to the last */
-     rt = route_open(session->purl, NULL, NULL, 0);
-     if ( ! rt ) {
-          elog_printf(ERROR, "route does not exist %s", session->purl);
-          return -1;	/* monitored route does not exist (yet).
-			 * so return successfully so we can try again 
-			 * next time */
-     }
-     dataset = route_seektread(rt, session->seq, -1);
-     r = route_tell(rt, &seq, &size, &modt);
-     route_close(rt);
-     if ( ! dataset ) {
-          /* NULL dataset is not an error here, just an indicaton that we 
-	   * don't have any data to return and thus process */
+     int ret=0;
+     TABLE result;
+
+     /* catch up with the rows written since the last read */
+     if (cascade_catchup(session) == -1)
+          return -1;	/* monitored route does not exist (yet) */
+     if (session->nrows == 0) {
+          /* not an error, just an indicaton that we don't have any data 
+	   * to return and thus process */
           elog_printf(DIAG, "no data to cascade sample in %s", session->purl);
           return 0;	/* success */
      }
-     if ( table_nrows(dataset) == 0 ) {
-          /* Empty table means the same as above */
-          elog_printf(DIAG, "no rows to cascade sample in %s", session->purl);
-	  table_destroy(dataset);
-          return 0;	/* success */
-     }
 
-     /* update session sequence for next time */
-     session->seq = seq+1;
-
-     /* now carry out the aggregation on the table */
-     result = cascade_aggregate(session->fn, dataset);
+     /* produce the aggregation from the accumulated state */
+     result = cascade_emit(session);
 
      /* save the results */
      if ( result ) {
@@ -178,13 +308,796 @@ int cascade_sample(CASCADE *session,	/* cascade reference */
 	  elog_printf(ERROR, "no results produced from cascade");
 	  ret = -1;
      }
-     if (dataset)
-          table_destroy(dataset);
+
+     if (session->cppurl)
+	  cascade_checkpoint(session);
      
-     return ret;	/* success */
+     return ret;
+}
+
+
+/*
+ * Read any sequences of the monitored route that have not yet been 
+ * folded into the session and fold them in. The route is opened the 
+ * first time it is needed and then kept open.
+ * Returns the number of rows folded (0 if there was nothing new) or -1 
+ * if the route could not be opened.
+ */
+int cascade_catchup(CASCADE *session)
+{
+     int r, seq, size, n=0;
+     time_t modt;
+     TABLE dataset;
+
+     session->pending = 0;
+     if ( ! session->rt ) {
+	  session->rt = route_open(session->purl, NULL, NULL, 0);
+	  if ( ! session->rt ) {
+	       elog_printf(ERROR, "route does not exist %s", session->purl);
+	       return -1;
+	  }
+     }
+
+     dataset = route_seektread(session->rt, session->seq, -1);
+     if ( ! dataset )
+	  return 0;	/* nothing since last time */
+     r = route_tell(session->rt, &seq, &size, &modt);
+     if (table_nrows(dataset) > 0) {
+	  n = cascade_fold(session, dataset);
+	  if (r && n >= 0)
+	       session->seq = seq+1;
+     }
+     table_destroy(dataset);
+
+     return n < 0 ? 0 : n;
+}
+
+
+/*
+ * Fold the rows of dataset into the session's accumulators, in row 
+ * order. The table should have the same form as for cascade_aggregate().
+ * Folding a series of tables and then calling cascade_emit() gives the
+ * same result as cascade_aggregate() on all of their rows in one table.
+ * Returns the number of rows folded or -1 if the table can't be used.
+ */
+int cascade_fold(CASCADE *session, TABLE dataset)
+{
+     TREE *inforow, *colnames;
+     ITREE *col, *keys=NULL;
+     char *keycol=NULL, *key, *type, *cell, *tmpstr;
+     struct cascade_acc **accrow;
+     struct cascade_col *c;
+     struct cascade_val *val;
+     int nrows, i, *slot;
+     double v;
+
+     if ( ! dataset || table_nrows(dataset) == 0 )
+	  return 0;
+     if ( ! table_hascol(dataset, "_time")) {
+          tmpstr = table_outheader(dataset);
+          elog_printf(ERROR, "attempting to fold a table without _time "
+		      "column (columns: %s)", tmpstr);
+	  nfree(tmpstr);
+          return -1;
+     }
+     if (cascade_kern == NULL)
+	  cascade_setkernel(NULL);
+
+     /* the first rows of a result set the key, time span and form */
+     nrows = table_nrows(dataset);
+     table_first(dataset);
+     if (session->nrows == 0) {
+	  inforow = table_getinforow(dataset, CASCADE_INFOKEYROW);
+	  if (inforow) {
+	       keycol = tree_search(inforow, "1", 2);
+	       tree_destroy(inforow);
+	  }
+	  if (session->keycol)
+	       nfree(session->keycol);
+	  session->keycol = keycol ? xnstrdup(keycol) : NULL;
+	  if (table_hascol(dataset, "_dur"))
+	       session->dur1 = strtol(table_getcurrentcell(dataset, "_dur"),
+				      NULL, 10);
+	  else
+	       session->dur1 = 0;
+	  session->t1 = strtol(table_getcurrentcell(dataset, "_time"), 
+			       NULL, 10);
+	  if (session->donor == NULL)
+	       session->donor = table_create_fromdonor(dataset);
+     }
+     table_last(dataset);
+     session->t2 = strtol(table_getcurrentcell(dataset, "_time"), NULL, 10);
+
+     /* note any new columns */
+     colnames = table_getheader(dataset);
+     tree_traverse(colnames) {
+	  if (tree_find(session->cols, tree_getkey(colnames)) != TREE_NOVAL)
+	       continue;
+	  type = table_getinfocell(dataset, "type", tree_getkey(colnames));
+	  cascade_priv_addcol(session, tree_getkey(colnames), type);
+     }
+
+     /* find the accumulator of each row, creating those of new keys */
+     if (session->keycol && 
+	 tree_find(colnames, session->keycol) != TREE_NOVAL)
+	  keys = tree_get(colnames);
+     accrow = xnmalloc(sizeof(struct cascade_acc *) * nrows);
+     slot   = xnmalloc(sizeof(int) * nrows);
+     if (keys) {
+	  i = 0;
+	  itree_traverse(keys) {
+	       key = itree_get(keys);
+	       accrow[i] = key ? cascade_priv_getacc(session, key) : NULL;
+	       slot[i] = accrow[i] ? accrow[i]->n++ : 0;
+	       i++;
+	  }
+     } else if (session->keycol) {
+	  /* the key column is missing: like rows without keys */
+	  memset(accrow, 0, sizeof(struct cascade_acc *) * nrows);
+	  memset(slot,   0, sizeof(int) * nrows);
+     } else {
+	  for (i=0; i < nrows; i++) {
+	       accrow[i] = cascade_priv_getacc(session, "nokey");
+	       slot[i] = accrow[i]->n++;
+	  }
+     }
+
+     /* fold every known column; those missing from this table have empty
+      * cells, as they would if the tables had been joined */
+     tree_traverse(session->cols) {
+	  c = tree_get(session->cols);
+	  if (c->kind == CASCADE_COLSEQ)
+	       continue;
+	  if (tree_find(colnames, tree_getkey(session->cols)) != TREE_NOVAL) {
+	       col = tree_get(colnames);
+	       itree_first(col);
+	  } else
+	       col = NULL;
+	  for (i=0; i < nrows; i++) {
+	       cell = col ? itree_get(col) : NULL;
+	       if (col)
+		    itree_next(col);
+	       if ( ! accrow[i] )
+		    continue;
+	       val = &accrow[i]->vals[c->idx];
+	       if (c->kind == CASCADE_COLSTR) {
+		    if (val->str && cell && strcmp(val->str, cell) == 0)
+			 continue;
+		    if (val->str)
+			 nfree(val->str);
+		    val->str = cell ? xnstrdup(cell) : NULL;
+	       } else {
+		    v = cell ? atof(cell) : 0.0;
+		    cascade_priv_foldval(session->fn, val, slot[i], v);
+	       }
+	  }
+     }
+
+     session->nrows += nrows;
+     nfree(accrow);
+     nfree(slot);
+
+     return nrows;
+}
+
+
+/*
+ * Produce the result of the rows folded into the session since the last
+ * emit, in the same form as cascade_aggregate(), and start again.
+ * The caller should table_destroy() the result.
+ * Returns NULL if nothing has been folded.
+ */
+TABLE cascade_emit(CASCADE *session)
+{
+     TABLE result;
+     TREE *rowkeys;
+     struct cascade_acc *acc;
+     struct cascade_col *c;
+     struct cascade_val *val;
+     char *colname;
+     int rowkey;
+     time_t tdiff;
+     double res;
+
+     if (session->nrows == 0)
+	  return NULL;
+
+     tdiff = session->t2 - session->t1 + session->dur1;
+
+     /* a row for each key in key order */
+     result = table_create_fromdonor(session->donor);
+     table_addcol(result, "_seq", NULL);	/* make col before make row */
+     table_addcol(result, "_time", NULL);
+     table_addcol(result, "_dur", NULL);
+     rowkeys = tree_create();
+     tree_traverse(session->accs)
+	  tree_add(rowkeys, tree_getkey(session->accs), 
+		   (void *) (long) table_addemptyrow(result));
+
+     tree_traverse(session->cols) {
+	  colname = tree_getkey(session->cols);
+	  c = tree_get(session->cols);
+	  tree_first(rowkeys);
+	  tree_traverse(session->accs) {
+	       acc = tree_get(session->accs);
+	       val = &acc->vals[c->idx];
+	       rowkey = (long) tree_get(rowkeys);
+	       tree_next(rowkeys);
+	       if (c->kind == CASCADE_COLSEQ) {
+		    table_replacecell_noalloc(result, rowkey, "_seq", "0");
+	       } else if (c->kind == CASCADE_COLSTR) {
+		    if (val->str)
+			 table_replacecell_alloc(result, rowkey, colname, 
+						 val->str);
+	       } else {
+		    switch (session->fn) {
+		    case CASCADE_FIRST: res = val->first;                break;
+		    case CASCADE_LAST:  res = val->last;                 break;
+		    case CASCADE_DIFF:  res = val->last - val->first;    break;
+		    case CASCADE_RATE:  res = (val->last - val->first) / tdiff;
+			                                                 break;
+		    case CASCADE_MIN:   res = val->min;                  break;
+		    case CASCADE_MAX:   res = val->max;                  break;
+		    case CASCADE_AVG:   res = val->sum / acc->n;         break;
+		    case CASCADE_SUM:
+		    default:            res = val->sum;                  break;
+		    }
+		    table_replacecell_alloc(result, rowkey, colname, 
+					    util_ftoa(res));
+	       }
+	  }
+     }
+
+     /* make sure that there are values for the special columns */
+     tree_traverse(rowkeys) {
+	  rowkey = (long) tree_get(rowkeys);
+	  if (tree_find(session->cols, "_seq") == TREE_NOVAL)
+	       table_replacecell_noalloc(result, rowkey, "_seq", "0");
+	  if (tree_find(session->cols, "_dur") == TREE_NOVAL)
+	       table_replacecell_noalloc(result, rowkey, "_dur", "0");
+     }
+     tree_destroy(rowkeys);
+
+     cascade_priv_reset(session);
+
+     return result;
+}
+
+
+/*
+ * Save the session's position and accumulated state to its checkpoint
+ * route, as set by cascade_resume(), so that a restarted session can 
+ * carry on without reading the monitored route again.
+ * The state is written as a table with a row per record, the record
+ * type being in the column 'rec':-
+ *
+ *   meta  col is the name of a session value, str its value
+ *   iname key is an info name; in info row order
+ *   col   col is a column, n its kind; in column order
+ *   info  col is a column, key an info name, str the info value
+ *   key   key is a key value, n the rows folded for it
+ *   val   running values of col for key, n is 1 if str is set
+ *
+ * Returns 1 for success or 0 for failure.
+ */
+int cascade_checkpoint(CASCADE *session)
+{
+     TABLE state;
+     TREE *infonames, *info;
+     ITREE *infos, *colorder;
+     ROUTE rt;
+     struct cascade_acc *acc;
+     struct cascade_col *c;
+     struct cascade_val *val;
+     char *colname;
+     int r;
+
+     if ( ! session->cppurl )
+	  return 0;
+
+     state = table_create_a(cascade_statecols);
+     cascade_priv_staterow(state, "meta", "", "purl", 0, NULL,
+			   session->purl);
+     cascade_priv_staterow(state, "meta", "", "fn", 0, NULL,
+			   util_i32toa(session->fn));
+     cascade_priv_staterow(state, "meta", "", "seq", 0, NULL,
+			   util_i32toa(session->seq));
+     cascade_priv_staterow(state, "meta", "", "nrows", 0, NULL,
+			   util_i32toa(session->nrows));
+     cascade_priv_staterow(state, "meta", "", "t1", 0, NULL,
+			   util_i32toa(session->t1));
+     cascade_priv_staterow(state, "meta", "", "t2", 0, NULL,
+			   util_i32toa(session->t2));
+     cascade_priv_staterow(state, "meta", "", "dur1", 0, NULL,
+			   util_i32toa(session->dur1));
+     if (session->keycol)
+	  cascade_priv_staterow(state, "meta", "", "keycol", 0, NULL,
+				session->keycol);
+
+     if (session->nrows > 0) {
+	  /* info names in the order of their rows */
+	  infos = itree_create();
+	  infonames = table_getinfonames(session->donor);
+	  tree_traverse(infonames)
+	       itree_add(infos, (long) tree_get(infonames), 
+			 tree_getkey(infonames));
+	  itree_traverse(infos)
+	       cascade_priv_staterow(state, "iname", itree_get(infos), "", 0,
+				     NULL, NULL);
+	  itree_destroy(infos);
+
+	  /* columns in the order they were found, with kind and info */
+	  colorder = table_getcolorder(session->donor);
+	  itree_traverse(colorder) {
+	       colname = itree_get(colorder);
+	       if ((c = tree_find(session->cols, colname)) == TREE_NOVAL)
+		    continue;
+	       cascade_priv_staterow(state, "col", "", colname, c->kind,
+				     NULL, NULL);
+	       info = table_getinfocol(session->donor, colname);
+	       tree_traverse(info)
+		    cascade_priv_staterow(state, "info", tree_getkey(info),
+					  colname, 0, NULL, tree_get(info));
+	       tree_destroy(info);
+	  }
+
+	  /* keys and their values */
+	  tree_traverse(session->accs) {
+	       acc = tree_get(session->accs);
+	       cascade_priv_staterow(state, "key", tree_getkey(session->accs),
+				     "", acc->n, NULL, NULL);
+	       tree_traverse(session->cols) {
+		    c = tree_get(session->cols);
+		    if (c->kind == CASCADE_COLSEQ)
+			 continue;
+		    val = &acc->vals[c->idx];
+		    cascade_priv_staterow(state, "val", 
+					  tree_getkey(session->accs),
+					  tree_getkey(session->cols),
+					  val->str ? 1 : 0, 
+					  c->kind == CASCADE_COLNUM ? val : NULL,
+					  val->str);
+	       }
+	  }
+     }
+
+     /* write, creating the ring if needed */
+     rt = route_open(session->cppurl, "cascade state", NULL, 
+		     CASCADE_STATEKEEP);
+     if ( ! rt ) {
+	  elog_printf(ERROR, "unable to open cascade state route %s", 
+		      session->cppurl);
+	  table_destroy(state);
+	  return 0;
+     }
+     r = route_twrite(rt, state);
+     route_close(rt);
+     table_destroy(state);
+     if ( ! r )
+	  elog_printf(ERROR, "unable to write cascade state to %s",
+		      session->cppurl);
+
+     return r ? 1 : 0;
+}
+
+
+/*
+ * Set the route used to checkpoint the session and, if it holds a state
+ * for the same function and monitored route, carry on from it: the
+ * accumulated values are restored and reading starts after the last 
+ * sequence folded before the state was saved.
+ * Returns 1 if the state was restored or 0 if the session is unchanged.
+ */
+int cascade_resume(CASCADE *session, char *cppurl)
+{
+     TABLE state;
+     ROUTE rt;
+     char *rec, *key, *col, *str, *n;
+     struct cascade_acc *acc;
+     struct cascade_col *c;
+     struct cascade_val *val;
+     int seq, size, r;
+     time_t modt;
+
+     if (session->cppurl)
+	  nfree(session->cppurl);
+     session->cppurl = xnstrdup(cppurl);
+
+     /* fetch the most recent state */
+     if ( ! route_access(cppurl, NULL, 0) )
+	  return 0;
+     rt = route_open(cppurl, NULL, NULL, 0);
+     if ( ! rt )
+	  return 0;
+     state = NULL;
+     if (route_tell(rt, &seq, &size, &modt) && seq >= 0)
+	  state = route_seektread(rt, seq, -1);
+     route_close(rt);
+     if ( ! state )
+	  return 0;
+     if (table_nrows(state) == 0 || ! table_hascol(state, "rec") ||
+	 ! cascade_priv_statematch(state, session)) {
+	  elog_printf(DIAG, "cascade state in %s is not for %s, ignored",
+		      cppurl, session->purl);
+	  table_destroy(state);
+	  return 0;
+     }
+
+     /* replace any state we have */
+     cascade_priv_reset(session);
+     table_traverse(state) {
+	  rec = table_getcurrentcell(state, "rec");
+	  key = table_getcurrentcell(state, "key");
+	  col = table_getcurrentcell(state, "col");
+	  str = table_getcurrentcell(state, "str");
+	  n   = table_getcurrentcell(state, "n");
+	  if ( ! rec || ! col )
+	       continue;
+	  if (strcmp(rec, "meta") == 0) {
+	       r = str ? strtol(str, NULL, 10) : 0;
+	       if      (strcmp(col, "seq")    == 0) session->seq   = r;
+	       else if (strcmp(col, "nrows")  == 0) session->nrows = r;
+	       else if (strcmp(col, "t1")     == 0) session->t1    = r;
+	       else if (strcmp(col, "t2")     == 0) session->t2    = r;
+	       else if (strcmp(col, "dur1")   == 0) session->dur1  = r;
+	       else if (strcmp(col, "keycol") == 0 && str)
+		    session->keycol = xnstrdup(str);
+	  } else if (strcmp(rec, "iname") == 0 && key) {
+	       if ( ! session->donor )
+		    session->donor = table_create();
+	       table_addemptyinfo(session->donor, 
+				  cascade_priv_keep(session->donor, key));
+	  } else if (strcmp(rec, "col") == 0) {
+	       if ( ! session->donor )
+		    session->donor = table_create();
+	       c = cascade_priv_addcol(session, col, NULL);
+	       c->kind = n ? strtol(n, NULL, 10) : CASCADE_COLNUM;
+	  } else if (strcmp(rec, "info") == 0 && key && str) {
+	       if (session->donor)
+		    table_replaceinfocell(session->donor, key, col,
+					  cascade_priv_keep(session->donor, str));
+	  } else if (strcmp(rec, "key") == 0 && key) {
+	       acc = cascade_priv_getacc(session, key);
+	       acc->n = n ? strtol(n, NULL, 10) : 0;
+	  } else if (strcmp(rec, "val") == 0 && key) {
+	       if ((c = tree_find(session->cols, col)) == TREE_NOVAL)
+		    continue;
+	       acc = cascade_priv_getacc(session, key);
+	       val = &acc->vals[c->idx];
+	       val->sum   = cascade_priv_statedbl(state, "sum");
+	       val->min   = cascade_priv_statedbl(state, "min");
+	       val->max   = cascade_priv_statedbl(state, "max");
+	       val->first = cascade_priv_statedbl(state, "first");
+	       val->last  = cascade_priv_statedbl(state, "last");
+	       if (val->str)
+		    nfree(val->str);
+	       val->str = (n && *n == '1' && str) ? xnstrdup(str) : NULL;
+	  }
+     }
+     table_destroy(state);
+
+     elog_printf(DIAG, "cascade on %s resumed from %s at seq %d with %d "
+		 "rows", session->purl, cppurl, session->seq, session->nrows);
+
+     return 1;
+}
+
+
+/*
+ * Return the checkpoint route for a cascade writing to outpurl, which
+ * is a ring beside the output ring with the same duration, or NULL if 
+ * outpurl is not a ringstore. Free the returned string with nfree().
+ */
+char *cascade_statepurl(char *outpurl)
+{
+     char *base, *file, *ring, *dur, *purl;
+
+     if ( ! outpurl || strncmp(outpurl, RT_RS_GDBM_PREFIX ":", 
+			       strlen(RT_RS_GDBM_PREFIX)+1) != 0)
+	  return NULL;
+
+     base = xnstrdup(outpurl + strlen(RT_RS_GDBM_PREFIX)+1);
+     file = util_strtok_sc(base, ",");
+     ring = util_strtok_sc(NULL, ",");
+     dur  = util_strtok_sc(NULL, ",");
+     if ( ! (file && ring && dur) ) {
+	  nfree(base);
+	  return NULL;
+     }
+     purl = util_strjoin(RT_RS_GDBM_PREFIX ":", file, ",", ring, 
+			 CASCADE_STATESUFFIX ",", dur, NULL);
+     nfree(base);
+
+     return purl;
+}
+
+
+/*
+ * Serialise the use of cascade sessions between threads, such as when
+ * the sample method runs in a thread (meth_settype()). Callers of 
+ * cascade_init(), cascade_resume(), cascade_sample() and cascade_fini()
+ * that may run concurrently should hold it. The callbacks for early
+ * folding skip their work when it is held elsewhere, as cascade_sample()
+ * catches up anyway. The lock is recursive.
+ */
+void cascade_lock()
+{
+     pthread_once(&cascade_mutexonce, cascade_priv_mkmutex);
+     pthread_mutex_lock(&cascade_mutex);
+}
+
+void cascade_unlock()
+{
+     pthread_mutex_unlock(&cascade_mutex);
+}
+
+
+/* Private: callback when a ringstore is written, note the sessions 
+ * that monitor it */
+void cascade_priv_onwrite(char *file, char *ring, void *dur, void *unused)
+{
+     CASCADE *session;
+
+     pthread_once(&cascade_mutexonce, cascade_priv_mkmutex);
+     if (pthread_mutex_trylock(&cascade_mutex))
+	  return;
+     if (cascade_sessions) {
+	  ptree_traverse(cascade_sessions) {
+	       session = ptree_get(cascade_sessions);
+	       if (session->wfile && session->wdur == (long) dur &&
+		   strcmp(session->wring, ring) == 0 &&
+		   strcmp(session->wfile, file) == 0)
+		    session->pending++;
+	  }
+     }
+     pthread_mutex_unlock(&cascade_mutex);
+}
+
+
+/* Private: callback at the end of a run queue dispatch, fold in data 
+ * written to the monitored rings during it */
+void cascade_priv_tickend()
+{
+     CASCADE *session;
+
+     pthread_once(&cascade_mutexonce, cascade_priv_mkmutex);
+     if (pthread_mutex_trylock(&cascade_mutex))
+	  return;		/* pending sessions are left for later */
+     if (cascade_sessions) {
+	  ptree_traverse(cascade_sessions) {
+	       session = ptree_get(cascade_sessions);
+	       if (session->pending && cascade_catchup(session) > 0 && 
+		   session->cppurl)
+		    cascade_checkpoint(session);
+	  }
+     }
+     pthread_mutex_unlock(&cascade_mutex);
+}
+
+
+/* Private: create the recursive mutex used by cascade_lock() */
+void cascade_priv_mkmutex()
+{
+     pthread_mutexattr_t attr;
+
+     pthread_mutexattr_init(&attr);
+     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+     pthread_mutex_init(&cascade_mutex, &attr);
+     pthread_mutexattr_destroy(&attr);
+}
+
+
+/* Private: return the accumulator for key, creating it if needed */
+struct cascade_acc *cascade_priv_getacc(CASCADE *session, char *key)
+{
+     struct cascade_acc *acc;
+     int i;
+
+     if (tree_find(session->accs, key) != TREE_NOVAL)
+	  return tree_get(session->accs);
+
+     acc = xnmalloc(sizeof(struct cascade_acc));
+     acc->n     = 0;
+     acc->nvals = tree_n(session->cols);
+     acc->vals  = xnmalloc(sizeof(struct cascade_val) * (acc->nvals+1));
+     for (i=0; i < acc->nvals; i++)
+	  cascade_priv_initval(&acc->vals[i]);
+     tree_add(session->accs, xnstrdup(key), acc);
+
+     return acc;
+}
+
+
+/*
+ * Private: add a column to the session, of a kind decided by its name 
+ * and type, in the same way as cascade_aggregate(). Existing keys are 
+ * given values as if they had had empty cells in the column all along.
+ * Returns the new column.
+ */
+struct cascade_col *cascade_priv_addcol(CASCADE *session, char *colname, 
+					char *type)
+{
+     struct cascade_col *c;
+     struct cascade_acc *acc;
+     char *name;
+     int i;
+
+     c = xnmalloc(sizeof(struct cascade_col));
+     c->idx = tree_n(session->cols);
+     if (strcmp(colname, "_seq") == 0 && ! (type && strcmp(type, "str") == 0))
+	  c->kind = CASCADE_COLSEQ;
+     else if ((type && strcmp(type, "str") == 0) || 
+	      strcmp(colname, "_dur")  == 0 ||
+	      strcmp(colname, "_time") == 0)
+	  c->kind = CASCADE_COLSTR;
+     else
+	  c->kind = CASCADE_COLNUM;
+     tree_add(session->cols, xnstrdup(colname), c);
+
+     tree_traverse(session->accs) {
+	  acc = tree_get(session->accs);
+	  acc->vals = xnrealloc(acc->vals, sizeof(struct cascade_val) * 
+				(c->idx+2));
+	  acc->nvals = c->idx+1;
+	  cascade_priv_initval(&acc->vals[c->idx]);
+	  for (i=0; i < acc->n; i++)
+	       cascade_priv_foldval(session->fn, &acc->vals[c->idx], i, 0.0);
+     }
+
+     /* columns found after the first table are added to the result */
+     if (session->donor && ! table_hascol(session->donor, colname)) {
+	  name = xnstrdup(colname);
+	  table_addcol(session->donor, name, NULL);
+	  table_freeondestroy(session->donor, name);
+     }
+
+     return c;
+}
+
+
+/* Private: set the starting values of a column's accumulator */
+void cascade_priv_initval(struct cascade_val *val)
+{
+     val->sum   = 0.0;
+     val->min   = DBL_MAX;	/* as cascade_priv_aggcol() */
+     val->max   = DBL_MIN;
+     val->first = 0.0;
+     val->last  = 0.0;
+     val->str   = NULL;
 }
 
 
+/* Private: fold value v, which is the slot'th of its key, into val. 
+ * Only the running value needed by func is kept up to date, using the
+ * same kernels as cascade_aggregate() to get the same results */
+void cascade_priv_foldval(enum cascade_fn func, struct cascade_val *val, 
+			  int slot, double v)
+{
+     switch (func) {
+     case CASCADE_MIN:
+	  cascade_kern->min(&val->min, &v, 1);
+	  break;
+     case CASCADE_MAX:
+	  cascade_kern->max(&val->max, &v, 1);
+	  break;
+     case CASCADE_AVG:
+     case CASCADE_SUM:
+	  cascade_kern->sum(&val->sum, &v, 1);
+	  break;
+     default:
+	  break;
+     }
+     if (slot == 0)
+	  val->first = v;
+     val->last = v;
+}
+
+
+/* Private: throw away the accumulated state of the session, keeping its
+ * position and routes */
+void cascade_priv_reset(CASCADE *session)
+{
+     struct cascade_acc *acc;
+     int i;
+
+     tree_traverse(session->accs) {
+	  acc = tree_get(session->accs);
+	  for (i=0; i < acc->nvals; i++)
+	       if (acc->vals[i].str)
+		    nfree(acc->vals[i].str);
+	  nfree(acc->vals);
+	  nfree(acc);
+	  nfree(tree_getkey(session->accs));
+     }
+     tree_clearout(session->accs, NULL, NULL);
+     tree_traverse(session->cols) {
+	  nfree(tree_get(session->cols));
+	  nfree(tree_getkey(session->cols));
+     }
+     tree_clearout(session->cols, NULL, NULL);
+     if (session->donor)
+	  table_destroy(session->donor);
+     session->donor = NULL;
+     if (session->keycol)
+	  nfree(session->keycol);
+     session->keycol = NULL;
+     session->nrows  = 0;
+     session->t1 = session->t2 = 0;
+     session->dur1 = 0;
+}
+
+
+/* Private: append a row to the state table being checkpointed.
+ * str may be util_i32toa()'s buffer, so is stored before n */
+void cascade_priv_staterow(TABLE state, char *rec, char *key, char *col, 
+			   int n, struct cascade_val *val, char *str)
+{
+     char num[40];
+     int rowkey;
+
+     rowkey = table_addemptyrow(state);
+     table_replacecell_alloc(state, rowkey, "rec", rec);
+     table_replacecell_alloc(state, rowkey, "key", key);
+     table_replacecell_alloc(state, rowkey, "col", col);
+     table_replacecell_alloc(state, rowkey, "str", str ? str : "");
+     table_replacecell_alloc(state, rowkey, "n",   util_i32toa(n));
+     /* exact text for the doubles, so they read back bit for bit */
+     snprintf(num, 40, "%.17g", val ? val->sum   : 0.0);
+     table_replacecell_alloc(state, rowkey, "sum", num);
+     snprintf(num, 40, "%.17g", val ? val->min   : 0.0);
+     table_replacecell_alloc(state, rowkey, "min", num);
+     snprintf(num, 40, "%.17g", val ? val->max   : 0.0);
+     table_replacecell_alloc(state, rowkey, "max", num);
+     snprintf(num, 40, "%.17g", val ? val->first : 0.0);
+     table_replacecell_alloc(state, rowkey, "first", num);
+     snprintf(num, 40, "%.17g", val ? val->last  : 0.0);
+     table_replacecell_alloc(state, rowkey, "last", num);
+}
+
+
+/* Private: the double in colname of the current row of state */
+double cascade_priv_statedbl(TABLE state, char *colname)
+{
+     char *cell;
+
+     cell = table_getcurrentcell(state, colname);
+     return cell ? strtod(cell, NULL) : 0.0;
+}
+
+
+/* Private: return 1 if the checkpointed state was made by a session 
+ * with the same function and monitored route, or 0 otherwise */
+int cascade_priv_statematch(TABLE state, CASCADE *session)
+{
+     char *rec, *col, *str;
+     int purl=0, fn=0;
+
+     table_traverse(state) {
+	  rec = table_getcurrentcell(state, "rec");
+	  col = table_getcurrentcell(state, "col");
+	  str = table_getcurrentcell(state, "str");
+	  if ( ! (rec && col && str) || strcmp(rec, "meta") != 0)
+	       continue;
+	  if (strcmp(col, "purl") == 0)
+	       purl = (strcmp(str, session->purl) == 0);
+	  else if (strcmp(col, "fn") == 0)
+	       fn = (strtol(str, NULL, 10) == session->fn);
+     }
+
+     return purl && fn;
+}
+
+
+/* Private: return a copy of str that lasts as long as table t */
+char *cascade_priv_keep(TABLE t, char *str)
+{
+     char *s;
+
+     s = xnstrdup(str);
+     table_freeondestroy(t, s);
+     return s;
+}
+
 
 /*
  * Carry out aggregation on a complete data set held in a table
@@ -198,18 +1111,24 @@ int cascade_sample(CASCADE *session,	/* cascade reference */
  * needs to run table_destroy() to free its memory.
  * Returns NULL if there is an error, if dataset is NULL or if there
  * was insufficent data.
+ *
+ * Rows are grouped by key in a single hashed pass and each numeric 
+ * column is parsed once. Values are laid out by [sample][key] so that
+ * the kernels can work across all keys at once, while the values of 
+ * each key are still combined in their original order.
  */
 TABLE cascade_aggregate(enum cascade_fn func, 	/* aggregation function */
 			TABLE dataset		/* multi-sample, multi-key
 						 * dataset in a table */ )
 {
-     TREE *inforow, *keyvals, *databykey, *colnames;
-     char *keycol, *colname, *tmpstr, *type;
-     int duration, haskey=0;
-     TABLE itab, result;
-     TABSET tset;
+     TREE *inforow, *colnames;
+     char *keycol=NULL, *colname, *tmpstr, *type, **keys, **lastcell;
+     int duration, nrows, ngroups, nslots, i, g, *grp, *slot, *count;
+     int *rowkeys;
+     struct cascade_keyord *order;
+     TABLE result;
      ITREE *col;
-     double val, tmpval1, tmpval2;
+     double *res, *mat=NULL;
      time_t t1, t2, tdiff;
 
      /* assert special cases */
@@ -217,9 +1136,6 @@ TABLE cascade_aggregate(enum cascade_fn func, 	/* aggregation function */
           elog_printf(DIAG, "no dataset given to aggregate");
           return NULL;
      }
-     if (table_nrows(dataset) == 0) {
-          elog_printf(DIAG, "no rows to aggregate in dataset");
-     }
      if ( ! table_hascol(dataset, "_time")) {
           tmpstr = table_outheader(dataset);
           elog_printf(ERROR, "attempting to aggregate a table without _time "
@@ -227,39 +1143,36 @@ TABLE cascade_aggregate(enum cascade_fn func, 	/* aggregation function */
 	  nfree(tmpstr);
           return NULL;
      }
+     if (table_nrows(dataset) == 0) {
+          elog_printf(DIAG, "no rows to aggregate in dataset");
+	  return NULL;
+     }
 
      /* find any keys that might exist */
      inforow = table_getinforow(dataset, "key");
      if (inforow) {
           keycol = tree_search(inforow, "1", 2);
-	  if (keycol) {
-	       keyvals = table_uniqcolvals(dataset, keycol, NULL);
-	       if (keyvals) {
-		    /* separate the combined data set into ones of
-		     * separate keys */
-		    haskey++;
-		    databykey = tree_create();
-		    tset = tableset_create(dataset);
-		    tree_traverse(keyvals) {
-		         /* select out the data */
-		         tableset_reset(tset);
-			 tableset_where(tset, keycol, eq, 
-					tree_getkey(keyvals));
-			 itab = tableset_into(tset);
-		         tree_add(databykey, tree_getkey(keyvals), itab);
-		    }
-		    tableset_destroy(tset);
-	       }
-	       tree_destroy(keyvals);
-	  }
 	  tree_destroy(inforow);
      }
 
-     /* if there were no keys found, pretend that we have a single one */
-     if ( ! haskey ) {
-          databykey = tree_create();
-	  tree_add(databykey, "nokey", dataset);
+     /* assign every row to a group, one for each key value */
+     nrows = table_nrows(dataset);
+     grp   = xnmalloc(sizeof(int) * nrows);
+     slot  = xnmalloc(sizeof(int) * nrows);
+     ngroups = cascade_priv_group(dataset, keycol, grp, slot, &keys, &count);
+     nslots = 0;
+     for (g=0; g < ngroups; g++)
+	  if (count[g] > nslots)
+	       nslots = count[g];
+
+     /* groups are reported in key order */
+     order = xnmalloc(sizeof(struct cascade_keyord) * (ngroups+1));
+     for (g=0; g < ngroups; g++) {
+	  order[g].key   = keys[g];
+	  order[g].group = g;
      }
+     qsort(order, ngroups, sizeof(struct cascade_keyord), 
+	   cascade_priv_keycmp);
 
      /* find the time span and duration of the dataset */
      table_first(dataset);
@@ -272,131 +1185,438 @@ TABLE cascade_aggregate(enum cascade_fn func, 	/* aggregation function */
      t2 = strtol(table_getcurrentcell(dataset, "_time"), NULL, 10);
      tdiff = t2-t1+duration;
 
-     /* go over the keyed table and apply our operators to each column 
-      * in turn */
+     /* create the result with a row for each group */
      result = table_create_fromdonor(dataset);
      table_addcol(result, "_seq", NULL);	/* make col before make row */
      table_addcol(result, "_time", NULL);
      table_addcol(result, "_dur", NULL);
-     tree_traverse(databykey) {
-          table_addemptyrow(result);
-          itab = tree_get(databykey);
-	  colnames = table_getheader(itab);
-	  tree_traverse(colnames) {
-	       colname = tree_getkey(colnames);
-	       if ( ! table_hascol(result, colname)) {
-		     tmpstr = xnstrdup(colname);
-		     table_addcol(result, tmpstr, NULL);
-		     table_freeondestroy(result, tmpstr);
+     rowkeys = xnmalloc(sizeof(int) * (ngroups+1));
+     for (g=0; g < ngroups; g++)
+	  rowkeys[order[g].group] = table_addemptyrow(result);
+
+     /* The [sample][key] matrix is only worth it when the keys have 
+      * similar numbers of samples; otherwise work a row at a time */
+     if ((long) nslots * ngroups <= 2L * nrows + CASCADE_MATSLACK)
+	  mat = xnmalloc(sizeof(double) * nslots * ngroups + 1);
+     res      = xnmalloc(sizeof(double) * (ngroups+1));
+     lastcell = xnmalloc(sizeof(char *) * (ngroups+1));
+
+     /* go over the dataset and apply our operators to each column in turn,
+      * computing the values for all groups at once */
+     colnames = table_getheader(dataset);
+     tree_traverse(colnames) {
+	  colname = tree_getkey(colnames);
+	  col = tree_get(colnames);
+	  if ( ! table_hascol(result, colname)) {
+	       tmpstr = xnstrdup(colname);
+	       table_addcol(result, tmpstr, NULL);
+	       table_freeondestroy(result, tmpstr);
+	  }
+	  type = table_getinfocell(dataset, "type", colname);
+	  if (strcmp(colname, "_seq") == 0 &&
+	      ! (type && strcmp(type, "str") == 0)) {
+	       /* _seq: only one result is produced so must be 0 */
+	       for (g=0; g < ngroups; g++)
+		    table_replacecell_noalloc(result, rowkeys[g], "_seq", "0");
+	  } else if ((type && strcmp(type, "str") == 0) || 
+		     strcmp(colname, "_dur")  == 0 ||
+		     strcmp(colname, "_time") == 0) {
+	       /* string value, _dur or _time: report the last one */
+	       memset(lastcell, 0, sizeof(char *) * (ngroups+1));
+	       i = 0;
+	       itree_traverse(col) {
+		    if (grp[i] >= 0)
+			 lastcell[grp[i]] = itree_get(col);
+		    i++;
 	       }
-	       col = table_getcol(itab, colname);
-	       type = table_getinfocell(itab, "type", colname);
-	       if (type && strcmp(type, "str") == 0) {
-		    /* string value: report the last one */
-		    itree_last(col);
-		    table_replacecurrentcell(result, colname, itree_get(col));
-	       } else if (strcmp(colname, "_dur") == 0) {
-		    /* _dur: use the last value, can treat as string */
-		    itree_last(col);
-		    table_replacecurrentcell(result, "_dur", itree_get(col));
-	       } else if (strcmp(colname, "_seq") == 0) {
-		    /* _seq: only one result is produced so must be 0 */
-		    table_replacecurrentcell(result, "_seq", "0");
-	       } else if (strcmp(colname, "_time") == 0) {
-		    /* _time: use the last value, can treat as string */
-		    itree_last(col);
-		    table_replacecurrentcell(result, "_time", itree_get(col));
-	       } else {
-		    /* numeric value: treat as a float and report it */
-		    switch (func) {
-		    case CASCADE_AVG:
-		         /* average of column's values */
-		         val = 0.0;
-			 itree_traverse(col)
-			      val += atof( itree_get(col) );
-			 val = val / itree_n(col);
-			 break;
-		    case CASCADE_MIN:
-		         /* minimum of column's values */
-		         val = DBL_MAX;
-			 itree_traverse(col) {
-			      tmpval1 = atof( itree_get(col) );
-			      if (tmpval1 < val)
-				   val = tmpval1;
-			 }
-			 break;
-		    case CASCADE_MAX:
-		         /* maximum of column's values */
-		         val = DBL_MIN;
-			 itree_traverse(col) {
-			      tmpval1 = atof( itree_get(col) );
-			      if (tmpval1 > val)
-				   val = tmpval1;
-			 }
-			 break;
-		    case CASCADE_SUM:
-		         /* sum of column's values */
-		         val = 0.0;
-			 itree_traverse(col)
-			      val += atof( itree_get(col) );
-			 break;
-		    case CASCADE_LAST:
-		         /* last value */
-		         itree_last(col);
-			 val = atof( itree_get(col) );
-			 break;
-		    case CASCADE_FIRST:
-		         /* last value */
-		         itree_first(col);
-			 val = atof( itree_get(col) );
-			 break;
-		    case CASCADE_DIFF:
-		         /* the difference in values of first and last */
-		         itree_first(col);
-			 tmpval1 = atof( itree_get(col) );
-			 itree_last(col);
-			 tmpval2 = atof( itree_get(col) );
-			 val = tmpval2 - tmpval1;
-			 break;
-		    case CASCADE_RATE:
-		         /* difference in values (as CASCADE_DIFF) then 
-			  * divided by the number of seconds in the set  */
-		         itree_first(col);
-			 tmpval1 = atof( itree_get(col) );
-			 itree_last(col);
-			 tmpval2 = atof( itree_get(col) );
-			 val = tmpval2 - tmpval1;
-			 val = val / tdiff;
-			 break;
+	       for (g=0; g < ngroups; g++)
+		    if (lastcell[g])
+			 table_replacecell_alloc(result, rowkeys[g], colname,
+						 lastcell[g]);
+	  } else {
+	       /* numeric value: treat as a float and report it */
+	       cascade_priv_aggcol(func, col, ngroups, nslots, grp, slot,
+				   count, tdiff, mat, res);
+	       for (g=0; g < ngroups; g++)
+		    table_replacecell_alloc(result, rowkeys[g], colname,
+					    util_ftoa(res[g]));
+	  }
+     }
+
+     /* make sure that there are values for the special columns */
+     for (g=0; g < ngroups; g++) {
+	  if ( ! table_hascol(dataset, "_seq"))
+	       table_replacecell_noalloc(result, rowkeys[g], "_seq", "0");
+	  if ( ! table_hascol(dataset, "_dur"))
+	       table_replacecell_noalloc(result, rowkeys[g], "_dur", "0");
+     }
+
+     /* clear up */
+     if (mat)
+	  nfree(mat);
+     nfree(res);
+     nfree(lastcell);
+     nfree(rowkeys);
+     nfree(order);
+     nfree(keys);
+     nfree(count);
+     nfree(grp);
+     nfree(slot);
+
+     return result;
+}
+
+
+/*
+ * Choose the aggregation kernels by name ("avx", "sse2" or "scalar").
+ * If name is NULL, the best kernels supported by this processor are
+ * used, which is also what happens if this is never called.
+ * Returns the name of the kernels selected or NULL if the named ones
+ * are unknown or not supported by the processor, in which case the 
+ * selection is unchanged.
+ */
+char *cascade_setkernel(char *name)
+{
+     struct cascade_kernel *k;
+
+     for (k = cascade_kernels; k->name; k++) {
+	  if (name && strcmp(name, k->name) != 0)
+	       continue;
+	  if ( ! cascade_priv_kernsupported(k) ) {
+	       if (name)
+		    return NULL;
+	       continue;
+	  }
+	  cascade_kern = k;
+	  return k->name;
+     }
+
+     return NULL;
+}
+
+
+/*
+ * Private: assign each row in dataset to a group, identified by the 
+ * value in keycol, or all rows to a single group if keycol is NULL.
+ * Keys are found with a hash table, so this is one pass over the rows.
+ * On return, grp[] holds the group index of each row in row order (-1
+ * if the row has no key) and slot[] the row's position within its 
+ * group. *keys is set to an nmalloc()ed array of key values (pointing
+ * into dataset) and *count to an nmalloc()ed array of group sizes, both
+ * indexed by group. Returns the number of groups.
+ */
+int cascade_priv_group(TABLE dataset, char *keycol, int *grp, int *slot,
+		       char ***keys, int **count)
+{
+     ITREE *col;
+     int *htab, hsize, nalloc, ngroups, i, h, g;
+     unsigned int hval;
+     char *key, **k;
+     int *c;
+
+     if (keycol == NULL ||
+	 (col = tree_find(table_getheader(dataset), keycol)) == TREE_NOVAL) {
+	  /* no keys: one group */
+	  for (i=0; i < table_nrows(dataset); i++) {
+	       grp[i]  = 0;
+	       slot[i] = i;
+	  }
+	  *keys = xnmalloc(sizeof(char *));
+	  (*keys)[0] = "nokey";
+	  *count = xnmalloc(sizeof(int));
+	  (*count)[0] = table_nrows(dataset);
+	  return 1;
+     }
+
+     /* open addressed hash table of group indexes, kept under half full */
+     nalloc  = CASCADE_NGROUPS;
+     hsize   = nalloc * 2;
+     htab    = xnmalloc(sizeof(int) * hsize);
+     memset(htab, -1, sizeof(int) * hsize);
+     k       = xnmalloc(sizeof(char *) * nalloc);
+     c       = xnmalloc(sizeof(int) * nalloc);
+     ngroups = 0;
+
+     i = 0;
+     itree_traverse(col) {
+	  key = itree_get(col);
+	  if (key == NULL) {
+	       grp[i++] = -1;
+	       continue;
+	  }
+	  hval = hash_str(key);
+	  for (h = hval & (hsize-1); htab[h] != -1; h = (h+1) & (hsize-1))
+	       if (strcmp(k[htab[h]], key) == 0)
+		    break;
+	  if (htab[h] == -1) {
+	       /* new group */
+	       if (ngroups >= nalloc) {
+		    nalloc *= 2;
+		    k = xnrealloc(k, sizeof(char *) * nalloc);
+		    c = xnrealloc(c, sizeof(int) * nalloc);
+		    hsize = nalloc * 2;
+		    nfree(htab);
+		    htab = xnmalloc(sizeof(int) * hsize);
+		    memset(htab, -1, sizeof(int) * hsize);
+		    for (g=0; g < ngroups; g++) {
+			 for (h = hash_str(k[g]) & (hsize-1); htab[h] != -1; 
+			      h = (h+1) & (hsize-1))
+			      ;
+			 htab[h] = g;
 		    }
-		    /* save the floating point value */
-		    table_replacecurrentcell_alloc(result, colname, 
-						   util_ftoa(val));
+		    for (h = hval & (hsize-1); htab[h] != -1; 
+			 h = (h+1) & (hsize-1))
+			 ;
+	       }
+	       htab[h] = ngroups;
+	       k[ngroups] = key;
+	       c[ngroups] = 0;
+	       ngroups++;
+	  }
+	  g = htab[h];
+	  grp[i]  = g;
+	  slot[i] = c[g]++;
+	  i++;
+     }
+
+     nfree(htab);
+     *keys  = k;
+     *count = c;
+     return ngroups;
+}
+
+
+/* Private: qsort() comparison of struct cascade_keyord by key value */
+int cascade_priv_keycmp(const void *a, const void *b)
+{
+     return strcmp(((struct cascade_keyord *) a)->key, 
+		   ((struct cascade_keyord *) b)->key);
+}
+
+
+/*
+ * Private: compute func over the values of the numeric column col for
+ * each of ngroups groups, placing the results in res[]. Each value is 
+ * parsed once with atof(). If mat is not NULL, it has space for 
+ * nslots*ngroups values and is used to lay the values out by 
+ * [sample][group] so the kernels can run across the groups; otherwise 
+ * the values are combined row by row. Both give the same results.
+ */
+void cascade_priv_aggcol(enum cascade_fn func, ITREE *col, int ngroups,
+			 int nslots, int *grp, int *slot, int *count, 
+			 time_t tdiff, double *mat, double *res)
+{
+     int i, g, s, n;
+     double v, init, pad, *first;
+     char *cell;
+     void (*kern)(double *, double *, int);
+
+     if (cascade_kern == NULL)
+	  cascade_setkernel(NULL);
+
+     switch (func) {
+     case CASCADE_LAST:
+     case CASCADE_FIRST:
+     case CASCADE_DIFF:
+     case CASCADE_RATE:
+	  /* only the first and last values of each group are needed */
+	  first = xnmalloc(sizeof(double) * (ngroups+1));
+	  i = 0;
+	  itree_traverse(col) {
+	       g = grp[i];
+	       if (g >= 0) {
+		    cell = itree_get(col);
+		    v = cell ? atof(cell) : 0.0;
+		    if (slot[i] == 0)
+			 first[g] = v;
+		    res[g] = v;
 	       }
-	       itree_destroy(col);
+	       i++;
 	  }
-	  /* make sure that there are values for the special columns */
-	  if ( ! table_hascol(dataset, "_time"))
-	       table_replacecurrentcell(result, "_time", 
-					util_decdatetime(time(NULL)));
-	  if ( ! table_hascol(dataset, "_seq"))
-	       table_replacecurrentcell(result, "_seq", "0");
-	  if ( ! table_hascol(dataset, "_dur"))
-	       table_replacecurrentcell(result, "_dur", "0");
+	  for (g=0; g < ngroups; g++) {
+	       if (func == CASCADE_FIRST)
+		    res[g] = first[g];
+	       else if (func == CASCADE_DIFF)
+		    res[g] = res[g] - first[g];
+	       else if (func == CASCADE_RATE)
+		    res[g] = (res[g] - first[g]) / tdiff;
+	  }
+	  nfree(first);
+	  return;
+     case CASCADE_MIN:
+	  init = DBL_MAX;	/* matches a scan starting from the largest */
+	  pad  = HUGE_VAL;
+	  kern = cascade_kern->min;
+	  break;
+     case CASCADE_MAX:
+	  init = DBL_MIN;	/* historic: the smallest positive number */
+	  pad  = -HUGE_VAL;
+	  kern = cascade_kern->max;
+	  break;
+     case CASCADE_AVG:
+     case CASCADE_SUM:
+     default:
+	  init = 0.0;
+	  pad  = -0.0;		/* x + -0.0 == x for all x, including -0.0 */
+	  kern = cascade_kern->sum;
+	  break;
      }
 
-     /* clear up */
-     if (haskey) {
-          tree_traverse(databykey) {
-	       itab = tree_get(databykey);
-	       table_destroy(itab);
+     for (g=0; g < ngroups; g++)
+	  res[g] = init;
+
+     if (mat) {
+	  /* lay out by [sample][group] and run kernels across the groups */
+	  n = nslots * ngroups;
+	  for (i=0; i < n; i++)
+	       mat[i] = pad;
+	  i = 0;
+	  itree_traverse(col) {
+	       if (grp[i] >= 0) {
+		    cell = itree_get(col);
+		    mat[slot[i] * ngroups + grp[i]] = cell ? atof(cell) : 0.0;
+	       }
+	       i++;
+	  }
+	  for (s=0; s < nslots; s++)
+	       kern(res, mat + s * ngroups, ngroups);
+     } else {
+	  /* uneven groups: combine as we go */
+	  i = 0;
+	  itree_traverse(col) {
+	       g = grp[i++];
+	       if (g < 0)
+		    continue;
+	       cell = itree_get(col);
+	       v = cell ? atof(cell) : 0.0;
+	       kern(&res[g], &v, 1);
 	  }
      }
-     tree_destroy(databykey);
 
-     return result;
+     if (func == CASCADE_AVG)
+	  for (g=0; g < ngroups; g++)
+	       res[g] = res[g] / count[g];
+}
+
+
+/* Private: check the processor can run the kernels in k */
+int cascade_priv_kernsupported(struct cascade_kernel *k)
+{
+#if CASCADE_X86
+     __builtin_cpu_init();
+     if (strcmp(k->name, "avx") == 0)
+	  return __builtin_cpu_supports("avx");
+     if (strcmp(k->name, "sse2") == 0)
+	  return __builtin_cpu_supports("sse2");
+#endif
+     return 1;
+}
+
+
+/*
+ * Aggregation kernels. Each combines the n values in v into the n
+ * accumulators in acc, lane by lane: acc[i] = op(acc[i], v[i]).
+ * Min and max take v[i] only if it compares strictly less or greater,
+ * as MINPD/MAXPD do with v as the first operand, so NaNs are ignored 
+ * in the same way by every version.
+ */
+void cascade_priv_sum_scalar(double *acc, double *v, int n)
+{
+     int i;
+
+     for (i=0; i < n; i++)
+	  acc[i] += v[i];
+}
+
+void cascade_priv_min_scalar(double *acc, double *v, int n)
+{
+     int i;
+
+     for (i=0; i < n; i++)
+	  if (v[i] < acc[i])
+	       acc[i] = v[i];
+}
+
+void cascade_priv_max_scalar(double *acc, double *v, int n)
+{
+     int i;
+
+     for (i=0; i < n; i++)
+	  if (v[i] > acc[i])
+	       acc[i] = v[i];
+}
+
+#if CASCADE_X86
+
+__attribute__((target("sse2")))
+void cascade_priv_sum_sse2(double *acc, double *v, int n)
+{
+     int i;
+
+     for (i=0; i+2 <= n; i += 2)
+	  _mm_storeu_pd(acc+i, _mm_add_pd(_mm_loadu_pd(acc+i), 
+					  _mm_loadu_pd(v+i)));
+     for (; i < n; i++)
+	  acc[i] += v[i];
+}
+
+__attribute__((target("sse2")))
+void cascade_priv_min_sse2(double *acc, double *v, int n)
+{
+     int i;
+
+     for (i=0; i+2 <= n; i += 2)
+	  _mm_storeu_pd(acc+i, _mm_min_pd(_mm_loadu_pd(v+i), 
+					  _mm_loadu_pd(acc+i)));
+     cascade_priv_min_scalar(acc+i, v+i, n-i);
+}
+
+__attribute__((target("sse2")))
+void cascade_priv_max_sse2(double *acc, double *v, int n)
+{
+     int i;
+
+     for (i=0; i+2 <= n; i += 2)
+	  _mm_storeu_pd(acc+i, _mm_max_pd(_mm_loadu_pd(v+i), 
+					  _mm_loadu_pd(acc+i)));
+     cascade_priv_max_scalar(acc+i, v+i, n-i);
+}
+
+__attribute__((target("avx")))
+void cascade_priv_sum_avx(double *acc, double *v, int n)
+{
+     int i;
+
+     for (i=0; i+4 <= n; i += 4)
+	  _mm256_storeu_pd(acc+i, _mm256_add_pd(_mm256_loadu_pd(acc+i), 
+						_mm256_loadu_pd(v+i)));
+     for (; i < n; i++)
+	  acc[i] += v[i];
+}
+
+__attribute__((target("avx")))
+void cascade_priv_min_avx(double *acc, double *v, int n)
+{
+     int i;
+
+     for (i=0; i+4 <= n; i += 4)
+	  _mm256_storeu_pd(acc+i, _mm256_min_pd(_mm256_loadu_pd(v+i), 
+						_mm256_loadu_pd(acc+i)));
+     cascade_priv_min_scalar(acc+i, v+i, n-i);
+}
+
+__attribute__((target("avx")))
+void cascade_priv_max_avx(double *acc, double *v, int n)
+{
+     int i;
+
+     for (i=0; i+4 <= n; i += 4)
+	  _mm256_storeu_pd(acc+i, _mm256_max_pd(_mm256_loadu_pd(v+i), 
+						_mm256_loadu_pd(acc+i)));
+     cascade_priv_max_scalar(acc+i, v+i, n-i);
 }
 
+#endif /* CASCADE_X86 */
 
 
 
@@ -406,7 +1626,8 @@ TABLE cascade_aggregate(enum cascade_fn func, 	/* aggregation function */
 #include <unistd.h>
 #include "rt_file.h"
 #include "rt_std.h"
-#include "rt_grs.h"
+#include "rt_rs.h"
+#include <sys/time.h>
 
 #define TAB_SING        "_time\tcol1\tcol2\tcol3\n" \
                         "--\n" \
@@ -599,6 +1820,7 @@ TABLE cascade_aggregate(enum cascade_fn func, 	/* aggregation function */
 #define RS_RESFILE  "t.cascade.rs"
 #define RS_RESRING  "result"
 #define RS_RESPURL  "grs:" RS_RESFILE "," RS_RESRING ",0"
+#define RS_STATEPURL "grs:" RS_RESFILE "," RS_RESRING CASCADE_STATESUFFIX ",0"
 
 ROUTE err, out;
 
@@ -614,16 +1836,29 @@ void test_cascade(enum cascade_fn mode,
 		  char *result_singkey,
 		  char *result_mult,
 		  char *result_multkey);
+TABLE cascade_ref_aggregate(enum cascade_fn func, TABLE dataset);
+TABLE test_mkdataset(int nkeys, int nsamples, int skew);
+void  test_compare(TABLE dataset, char *label);
+void  test_fold(TABLE dataset, char *label, int chunk);
+void  test_bench(int nkeys, int nsamples);
 
-int main(int argc1, char *argv[])
+char *test_fnames[] = {"avg", "min", "max", "sum", "last", "first", "diff",
+		       "rate", NULL};
+char *test_kernels[] = {"scalar", "sse2", "avx", NULL};
+
+int main(int argc, char *argv[])
 {
+     TABLE tab1;
+
+     if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	  nm_deactivate();	/* time the code, not the leak checker */
      route_init(NULL, 0);
      route_register(&rt_filea_method);
      route_register(&rt_fileov_method);
      route_register(&rt_stdin_method);
      route_register(&rt_stdout_method);
      route_register(&rt_stderr_method);
-     route_register(&rt_rs_method);
+     route_register(&rt_grs_method);
      if ( ! elog_init(1, "cascade test", NULL))
 	  elog_die(FATAL, "didn't initialise elog\n");
      out = route_open("stdout", NULL, NULL, 0);
@@ -658,6 +1893,27 @@ int main(int argc1, char *argv[])
 		  RES_LASTSING, RES_LASTSINGKEY, RES_LASTMULT, 
 		  RES_LASTMULTKEY);
 
+     /* compare the grouped engine to the reference on larger datasets,
+      * with every kernel, evenly sampled and skewed */
+     tab1 = test_mkdataset(37, 9, 0);
+     test_compare(tab1, "even");
+     table_destroy(tab1);
+     tab1 = test_mkdataset(20, 3, 40);
+     test_compare(tab1, "skewed");
+     test_fold(tab1, "skewed", 7);
+     table_destroy(tab1);
+
+     /* fold in pieces, checkpointing and resuming half way */
+     tab1 = test_mkdataset(37, 9, 0);
+     test_fold(tab1, "even", 37);
+     test_fold(tab1, "even", 50);
+     table_destroy(tab1);
+
+     /* benchmark if asked: t.cascade bench [nkeys [nsamples]] */
+     if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	  test_bench(argc > 2 ? atoi(argv[2]) : 1000, 
+		     argc > 3 ? atoi(argv[3]) : 60);
+
      rs_fini();
      elog_fini();
      route_close(err);
@@ -1102,4 +2358,335 @@ void test_cascade(enum cascade_fn mode,
      route_close(samprt);
 }
 
+
+/*
+ * Create a keyed dataset of nsamples samples of nkeys keys, with
+ * numeric columns of mixed sign and string columns. If skew is set,
+ * the first key gets that many extra samples to make groups uneven.
+ */
+TABLE test_mkdataset(int nkeys, int nsamples, int skew)
+{
+     TABLE tab;
+     char *buf, *pt;
+     int s, k, nrows;
+
+     nrows = nkeys * nsamples + skew;
+     buf = pt = xnmalloc(200 + nrows * 100);
+     pt += sprintf(pt, "_seq\t_time\t_dur\tname\tv1\tv2\tlabel\n"
+		   "i32\ti32\ti32\tstr\tnano\tnano\tstr\ttype\n"
+		   "-\t-\t-\t1\t-\t-\t-\tkey\n--\n");
+     srand(1);
+     for (s=0; s < nsamples; s++)
+	  for (k=0; k < nkeys; k++)
+	       pt += sprintf(pt, "%d\t%d\t60\tkey%d\t%d.%02d\t-%d.%d\tl%d\n",
+			     s, 1000+s*60, (k*7919)%nkeys, rand()%5000, 
+			     rand()%100, rand()%300, rand()%10, s);
+     for (s=0; s < skew; s++)
+	  pt += sprintf(pt, "%d\t%d\t60\tkey0\t%d.5\t%d\tx%d\n",
+			nsamples+s, 1000+(nsamples+s)*60, rand()%900,
+			rand()%50-25, s);
+     tab = table_create();
+     table_scan(tab, buf, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		TABLE_HASRULER);
+     table_freeondestroy(tab, buf);
+
+     return tab;
+}
+
+
+/* aggregate dataset with all functions and kernels, checking the results 
+ * are identical to the reference implementation */
+void test_compare(TABLE dataset, char *label)
+{
+     TABLE want, got;
+     char *wantbuf, *gotbuf;
+     int f, k;
+
+     for (f=0; test_fnames[f]; f++) {
+	  want = cascade_ref_aggregate(f, dataset);
+	  wantbuf = table_outtable(want);
+	  for (k=0; test_kernels[k]; k++) {
+	       if ( ! cascade_setkernel(test_kernels[k]) )
+		    continue;	/* not on this processor */
+	       got = cascade_aggregate(f, dataset);
+	       gotbuf = table_outtable(got);
+	       if (strcmp(wantbuf, gotbuf))
+		    elog_die(FATAL, "[16] %s %s %s kernel differs:-\n"
+			     "--- want ---\n%s\n--- got ---\n%s", label, 
+			     test_fnames[f], test_kernels[k], wantbuf, gotbuf);
+	       nfree(gotbuf);
+	       table_destroy(got);
+	  }
+	  nfree(wantbuf);
+	  table_destroy(want);
+     }
+     cascade_setkernel(NULL);
+}
+
+
+/* fold dataset into a session chunk rows at a time, checkpointing and 
+ * resuming in a new session half way through, then check the emitted 
+ * result is identical to aggregating dataset in one go */
+void test_fold(TABLE dataset, char *label, int chunk)
+{
+     CASCADE *s1, *s2, *s;
+     TABLE want, got, part;
+     TREE *row;
+     char *wantbuf, *gotbuf, *statepurl;
+     int f, i, nrows;
+
+     statepurl = cascade_statepurl(RS_RESPURL);
+     if (strcmp(statepurl, RS_STATEPURL))
+	  elog_die(FATAL, "[17a] state purl %s, want %s", statepurl,
+		   RS_STATEPURL);
+     nfree(statepurl);
+
+     nrows = table_nrows(dataset);
+     for (f=0; test_fnames[f]; f++) {
+	  want = cascade_ref_aggregate(f, dataset);
+	  wantbuf = table_outtable(want);
+	  s1 = s = cascade_init(f, RS_SAMPPURL);
+	  s2 = NULL;
+	  cascade_resume(s1, RS_STATEPURL);
+	  part = NULL;
+	  i = 0;
+	  table_traverse(dataset) {
+	       if ( ! part )
+		    part = table_create_fromdonor(dataset);
+	       row = table_getcurrentrow(dataset);
+	       table_addrow_alloc(part, row);
+	       tree_destroy(row);
+	       if (++i % chunk && i < nrows)
+		    continue;
+	       if (cascade_fold(s, part) != table_nrows(part))
+		    elog_die(FATAL, "[17b] %s %s fold failed", label, 
+			     test_fnames[f]);
+	       table_destroy(part);
+	       part = NULL;
+	       if (s2 == NULL && i >= nrows / 2) {
+		    /* carry on in a new session from the checkpoint */
+		    if ( ! cascade_checkpoint(s1) )
+			 elog_die(FATAL, "[17c] %s %s checkpoint failed", 
+				  label, test_fnames[f]);
+		    s2 = s = cascade_init(f, RS_SAMPPURL);
+		    if ( ! cascade_resume(s2, RS_STATEPURL) )
+			 elog_die(FATAL, "[17d] %s %s not resumed", label, 
+				  test_fnames[f]);
+		    if (s2->nrows != s1->nrows || s2->seq != s1->seq)
+			 elog_die(FATAL, "[17e] %s %s resumed %d rows seq %d,"
+				  " want %d rows seq %d", label, 
+				  test_fnames[f], s2->nrows, s2->seq, 
+				  s1->nrows, s1->seq);
+		    cascade_fini(s1);
+	       }
+	  }
+	  got = cascade_emit(s);
+	  gotbuf = table_outtable(got);
+	  if (strcmp(wantbuf, gotbuf))
+	       elog_die(FATAL, "[17f] %s %s chunk %d fold differs:-\n"
+			"--- want ---\n%s\n--- got ---\n%s", label, 
+			test_fnames[f], chunk, wantbuf, gotbuf);
+	  if (s->nrows != 0 || cascade_emit(s) != NULL)
+	       elog_die(FATAL, "[17g] %s %s not reset after emit", label,
+			test_fnames[f]);
+	  cascade_fini(s);
+	  nfree(gotbuf);
+	  table_destroy(got);
+	  nfree(wantbuf);
+	  table_destroy(want);
+     }
+}
+
+
+/* time the reference and grouped aggregation for every function */
+void test_bench(int nkeys, int nsamples)
+{
+     TABLE dataset, res;
+     struct timeval t1, t2;
+     double secs;
+     int f, k;
+
+     dataset = test_mkdataset(nkeys, nsamples, 0);
+     printf("cascade_aggregate: %d keys x %d samples\n", nkeys, nsamples);
+     printf("%-6s %-10s %10s\n", "func", "path", "secs");
+     for (f=0; test_fnames[f]; f++) {
+	  gettimeofday(&t1, NULL);
+	  res = cascade_ref_aggregate(f, dataset);
+	  gettimeofday(&t2, NULL);
+	  table_destroy(res);
+	  secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+	  printf("%-6s %-10s %10.4f\n", test_fnames[f], "tableset", secs);
+	  for (k=0; test_kernels[k]; k++) {
+	       if ( ! cascade_setkernel(test_kernels[k]) )
+		    continue;
+	       gettimeofday(&t1, NULL);
+	       res = cascade_aggregate(f, dataset);
+	       gettimeofday(&t2, NULL);
+	       table_destroy(res);
+	       secs = (t2.tv_sec-t1.tv_sec) + (t2.tv_usec-t1.tv_usec) / 1e6;
+	       printf("%-6s %-10s %10.4f\n", test_fnames[f], test_kernels[k], 
+		      secs);
+	  }
+     }
+     cascade_setkernel(NULL);
+     table_destroy(dataset);
+}
+
+
+/*
+ * The previous implementation of cascade_aggregate(), which splits the
+ * dataset with a tableset pass for each key and parses cells as it goes.
+ * Kept as the reference for results and speed.
+ */
+TABLE cascade_ref_aggregate(enum cascade_fn func, TABLE dataset)
+{
+     TREE *inforow, *keyvals, *databykey, *colnames;
+     char *keycol, *colname, *tmpstr, *type;
+     int duration, haskey=0;
+     TABLE itab, result;
+     TABSET tset;
+     ITREE *col;
+     double val=0.0, tmpval1, tmpval2;
+     time_t t1, t2, tdiff;
+
+     inforow = table_getinforow(dataset, "key");
+     if (inforow) {
+          keycol = tree_search(inforow, "1", 2);
+	  if (keycol) {
+	       keyvals = table_uniqcolvals(dataset, keycol, NULL);
+	       if (keyvals) {
+		    haskey++;
+		    databykey = tree_create();
+		    tset = tableset_create(dataset);
+		    tree_traverse(keyvals) {
+		         tableset_reset(tset);
+			 tableset_where(tset, keycol, eq, 
+					tree_getkey(keyvals));
+			 itab = tableset_into(tset);
+		         tree_add(databykey, tree_getkey(keyvals), itab);
+		    }
+		    tableset_destroy(tset);
+	       }
+	       tree_destroy(keyvals);
+	  }
+	  tree_destroy(inforow);
+     }
+     if ( ! haskey ) {
+          databykey = tree_create();
+	  tree_add(databykey, "nokey", dataset);
+     }
+
+     table_first(dataset);
+     if (table_hascol(dataset, "_dur"))
+          duration = strtol(table_getcurrentcell(dataset, "_dur"), NULL, 10);
+     else
+          duration = 0;
+     t1 = strtol(table_getcurrentcell(dataset, "_time"), NULL, 10);
+     table_last(dataset);
+     t2 = strtol(table_getcurrentcell(dataset, "_time"), NULL, 10);
+     tdiff = t2-t1+duration;
+
+     result = table_create_fromdonor(dataset);
+     table_addcol(result, "_seq", NULL);
+     table_addcol(result, "_time", NULL);
+     table_addcol(result, "_dur", NULL);
+     tree_traverse(databykey) {
+          table_addemptyrow(result);
+          itab = tree_get(databykey);
+	  colnames = table_getheader(itab);
+	  tree_traverse(colnames) {
+	       colname = tree_getkey(colnames);
+	       if ( ! table_hascol(result, colname)) {
+		     tmpstr = xnstrdup(colname);
+		     table_addcol(result, tmpstr, NULL);
+		     table_freeondestroy(result, tmpstr);
+	       }
+	       col = table_getcol(itab, colname);
+	       type = table_getinfocell(itab, "type", colname);
+	       if (type && strcmp(type, "str") == 0) {
+		    itree_last(col);
+		    table_replacecurrentcell(result, colname, itree_get(col));
+	       } else if (strcmp(colname, "_dur") == 0) {
+		    itree_last(col);
+		    table_replacecurrentcell(result, "_dur", itree_get(col));
+	       } else if (strcmp(colname, "_seq") == 0) {
+		    table_replacecurrentcell(result, "_seq", "0");
+	       } else if (strcmp(colname, "_time") == 0) {
+		    itree_last(col);
+		    table_replacecurrentcell(result, "_time", itree_get(col));
+	       } else {
+		    switch (func) {
+		    case CASCADE_AVG:
+		         val = 0.0;
+			 itree_traverse(col)
+			      val += atof( itree_get(col) );
+			 val = val / itree_n(col);
+			 break;
+		    case CASCADE_MIN:
+		         val = DBL_MAX;
+			 itree_traverse(col) {
+			      tmpval1 = atof( itree_get(col) );
+			      if (tmpval1 < val)
+				   val = tmpval1;
+			 }
+			 break;
+		    case CASCADE_MAX:
+		         val = DBL_MIN;
+			 itree_traverse(col) {
+			      tmpval1 = atof( itree_get(col) );
+			      if (tmpval1 > val)
+				   val = tmpval1;
+			 }
+			 break;
+		    case CASCADE_SUM:
+		         val = 0.0;
+			 itree_traverse(col)
+			      val += atof( itree_get(col) );
+			 break;
+		    case CASCADE_LAST:
+		         itree_last(col);
+			 val = atof( itree_get(col) );
+			 break;
+		    case CASCADE_FIRST:
+		         itree_first(col);
+			 val = atof( itree_get(col) );
+			 break;
+		    case CASCADE_DIFF:
+		         itree_first(col);
+			 tmpval1 = atof( itree_get(col) );
+			 itree_last(col);
+			 tmpval2 = atof( itree_get(col) );
+			 val = tmpval2 - tmpval1;
+			 break;
+		    case CASCADE_RATE:
+		         itree_first(col);
+			 tmpval1 = atof( itree_get(col) );
+			 itree_last(col);
+			 tmpval2 = atof( itree_get(col) );
+			 val = tmpval2 - tmpval1;
+			 val = val / tdiff;
+			 break;
+		    }
+		    table_replacecurrentcell_alloc(result, colname, 
+						   util_ftoa(val));
+	       }
+	       itree_destroy(col);
+	  }
+	  if ( ! table_hascol(dataset, "_seq"))
+	       table_replacecurrentcell(result, "_seq", "0");
+	  if ( ! table_hascol(dataset, "_dur"))
+	       table_replacecurrentcell(result, "_dur", "0");
+     }
+
+     if (haskey) {
+          tree_traverse(databykey) {
+	       itab = tree_get(databykey);
+	       table_destroy(itab);
+	  }
+     }
+     tree_destroy(databykey);
+
+     return result;
+}
+
 #endif
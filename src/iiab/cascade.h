@@ -21,22 +21,80 @@ enum cascade_fn {
      CASCADE_RATE	/* Mean rate function */
 };
 
-/* Request structure for sample method (sample_tab) */ 
+/* Kinds of column, which decide how they are accumulated */
+enum cascade_colkind {
+     CASCADE_COLNUM,	/* numeric: the function is applied */
+     CASCADE_COLSTR,	/* string, _time or _dur: the last value is kept */
+     CASCADE_COLSEQ	/* _seq: reported as 0 */
+};
+
+/* Running value of one column for one key */
+struct cascade_val {
+     double sum;		/* sum of values */
+     double min;		/* smallest value */
+     double max;		/* largest value */
+     double first;		/* first value */
+     double last;		/* last value */
+     char  *str;		/* last string (nmalloc()ed) or NULL */
+};
+
+/* Running values for one key: vals is indexed by cascade_col.idx */
+struct cascade_acc {
+     int n;			/* rows folded in for this key */
+     int nvals;			/* number of vals allocated */
+     struct cascade_val *vals;
+};
+
+/* A column seen in the folded data */
+struct cascade_col {
+     int idx;			/* index into cascade_acc.vals */
+     enum cascade_colkind kind;
+};
+
+/* Request structure for sample method (sample_tab).
+ * Rows are folded into per-key accumulators as they are read, so the
+ * monitored route is only read from seq onwards and each row once */
 struct cascade_info {
      enum cascade_fn fn;	/* function to apply to data */
      char *purl;		/* opened, monitored route */
-     int seq;			/* last sequence read */
+     int seq;			/* next sequence to read */
+     ROUTE rt;			/* monitored route, kept open or NULL */
+     char *wfile;		/* ringstore file of purl (grs: only) */
+     char *wring;		/* ringstore ring of purl (grs: only) */
+     int wdur;			/* ringstore duration of purl (grs: only) */
+     int pending;		/* monitored ring written since last read */
+     char *cppurl;		/* checkpoint route or NULL */
+     /* state accumulated since the last result */
+     int nrows;			/* rows folded */
+     time_t t1;			/* _time of the first row */
+     time_t t2;			/* _time of the last row */
+     int dur1;			/* _dur of the first row */
+     char *keycol;		/* key column or NULL for a single key */
+     TABLE donor;		/* columns and info of folded data, no rows */
+     TREE *cols;		/* column name -> struct cascade_col */
+     TREE *accs;		/* key value -> struct cascade_acc */
 };
 
 typedef struct cascade_info CASCADE;
 
 #define METH_BUILTIN_SAMPLE_NTABS 200
 #define CASCADE_INFOKEYROW "key"
+#define CASCADE_STATESUFFIX "_cascade"	/* ring holding cascade state */
+#define CASCADE_STATEKEEP 1		/* states kept in the ring */
 
 CASCADE *cascade_init(enum cascade_fn func, char *monroute);
 void cascade_fini(CASCADE *sampent);
 int cascade_sample(CASCADE *sampent, ROUTE output, ROUTE error);
+int cascade_fold(CASCADE *session, TABLE dataset);
+TABLE cascade_emit(CASCADE *session);
+int cascade_catchup(CASCADE *session);
+int cascade_checkpoint(CASCADE *session);
+int cascade_resume(CASCADE *session, char *cppurl);
+char *cascade_statepurl(char *outpurl);
+void cascade_lock();
+void cascade_unlock();
 TABLE cascade_aggregate(enum cascade_fn func, TABLE dataset);
+char *cascade_setkernel(char *name);
 void cascade_finalsample(CASCADE *sampent, ROUTE output, ROUTE error,
 			 TABLE basetab,	TABLE sampletab, int nsamples,
 			 char *keycol, time_t base_t, time_t sample_t);
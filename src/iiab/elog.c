@@ -28,10 +28,15 @@
 #include <time.h>
 #include <string.h>
 #include <ctype.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
 #include "nmalloc.h"
 #include "elog.h"
 #include "route.h"
 #include "rt_std.h"
+#include "rt_none.h"
 #include "tree.h"
 #include "itree.h"
 #include "util.h"
@@ -52,6 +57,41 @@ struct elog_overridedat {
      enum elog_severity severity;	/* severity code */
 };
 int    elog_isinit=0;	/* has elog been initialised? */
+unsigned int elog_enabled = (1 << ELOG_NSEVERITIES) - 1;
+			/* severities not sent to none:, all until known */
+
+/* Timestamps of the last log, reused while logs arrive in the same
+ * second. Guarded by route_lock() */
+time_t elog_stamptime = -1;
+char   elog_stampdec[50], elog_stampunix[50], elog_stampshort[50];
+
+/* Asynchronous logging: a ring of elog_ringsz (a power of 2) records.
+ * Threads raising logs claim a record by advancing elog_ringhead, fill it
+ * and publish it with the record's seq, without locking. Records are taken
+ * in order from elog_ringtail with route_lock() held, sent and returned to
+ * the ring; normally by the flusher thread but also by elog_flush() */
+int    elog_async=0;	/* 1=send complete logs through the ring */
+struct elog_asyncrec *elog_ring=NULL;
+unsigned long elog_ringsz=0;
+unsigned long elog_ringhead=0;	/* next record to claim */
+unsigned long elog_ringtail=0;	/* next record to send */
+int    elog_ringdrain=0;	/* 1=records being sent */
+int    elog_ringstop=0;		/* 1=flusher to finish */
+sem_t  elog_ringsem;		/* posted for each record published */
+pthread_t elog_flusher;		/* flusher thread */
+int    elog_atforkset=0;	/* fork handler is registered */
+
+/* private functional prototypes */
+void  elog_priv_setenabled();
+int   elog_priv_startsend(enum elog_severity severity, char *file, int line, 
+			  const char *function, time_t logtime, 
+			  char *logtext);
+int   elog_priv_asyncput(enum elog_severity severity, char *file, int line, 
+			 const char *function, char *logtext);
+void  elog_priv_drain();
+void *elog_priv_flusher(void *arg);
+void  elog_priv_asyncstop();
+void  elog_priv_atforkchild();
 
 /* standard format strings */
 char *elog_stdfmt[] = {
@@ -145,6 +185,9 @@ void elog_fini() {
 
      elog_checkinit();
 
+     /* send anything still in the ring before the routes are closed */
+     elog_priv_asyncstop();
+
      /* close any open purls, that is severities for which elog_ opened
       * a route. Routes present in elog_opendest[] without purl values
       * were suplied externally and it is their responsibility to clear up! */
@@ -178,9 +221,11 @@ void elog_fini() {
 
      tree_clearoutandfree(elog_override);
      tree_destroy(elog_override);
+     elog_override = NULL;
      if (elog_origin)
           nfree(elog_origin);
      route_close(elog_errors);
+     elog_enabled = (1 << ELOG_NSEVERITIES) - 1;
 }
 
 /* set origin part of event message */
@@ -213,6 +258,9 @@ int elog_setsevroute(enum elog_severity severity,	/* severity level */
      if (severity >= ELOG_NSEVERITIES || severity < 0)
 	  return 0;
 
+     /* logs held for the old route must be sent before it changes */
+     elog_flush();
+
      /* Do we have to bother to clear up? */
      if (elog_opendest[severity].purl != NULL) {
           /* elog_ opened this routine with setsevpurl(); 
@@ -235,6 +283,7 @@ int elog_setsevroute(enum elog_severity severity,	/* severity level */
 noclose:
      elog_opendest[severity].purl = NULL;
      elog_opendest[severity].route = route;
+     elog_priv_setenabled();
 
      return 1;
 }
@@ -278,7 +327,9 @@ int elog_setsevpurl(enum elog_severity severity,	/* severity level */
 	  return 0;
      }
 
-     /* now close down the existing route for this severity */
+     /* now close down the existing route for this severity, sending
+      * any logs still held for it */
+     elog_flush();
      if (elog_opendest[severity].purl) {
 	  /* is there another severity with the same purl? */
 	  for (i=0; i < ELOG_NSEVERITIES; i++) {
@@ -303,6 +354,7 @@ noclose2:
      /* comit the allocation */
      elog_opendest[severity].purl = xnstrdup(purl);
      elog_opendest[severity].route = lroute;
+     elog_priv_setenabled();
 
      return 1;
 }
@@ -514,6 +566,7 @@ int elog_setoverride(enum elog_severity severity,	/* severity level */
 
      over->severity = severity;
      tree_add(elog_override, xnstrdup(re_pattern), over);
+     elog_priv_setenabled();
 
      return 1;
 }
@@ -534,6 +587,7 @@ int elog_rmoverride(char *re_pattern	/* regular expression pattern */ )
 	  nfree(over);
 	  nfree(tree_getkey(elog_override));
 	  tree_rm(elog_override);
+	  elog_priv_setenabled();
 
 	  return 1;
      }
@@ -552,6 +606,7 @@ int elog_rmoverride(char *re_pattern	/* regular expression pattern */ )
  *    elog.format    <severity> <format>
  *    elog.allformat <format>
  *    elog.pattern   <severity> <regexp> 
+ *    elog.async     <nrecs>
  * Routes are expanded [with cf_expand()] before using as a directve.
  * The configurations amend the current settings. Note that "elog" leading
  * the config ids is defined (and may be changed) by ELOG_CFPREFIX.
@@ -647,6 +702,9 @@ void elog_configure(CF_VALS cf)
 	  }
      }
 
+     if (cf_defined(cf, ELOG_CFPREFIX ".async"))
+	  elog_setasync(cf_getint(cf, ELOG_CFPREFIX ".async"));
+
      return;
 }
 
@@ -747,11 +805,6 @@ int elog_fstartsend(enum elog_severity severity,/* severity level */
 		    const char *function,	/* raised in function */
 		    char *logtext		/* log a string */ )
 {
-     int r;
-     time_t logtime;
-     char timestr[50];
-     struct tm timestruct;
-
      /* to stderr if uninitialised */
      if ( ! elog_isinit) {
 	  fprintf(stderr, "%s: %s (%s:%d:%s)", elog_sevstring[severity], 
@@ -759,11 +812,6 @@ int elog_fstartsend(enum elog_severity severity,/* severity level */
 	  return 1;
      }
 
-     /* get time, reenterent style */
-     logtime = time(NULL);
-     localtime_r(&logtime, &timestruct);
-     r = strftime(timestr, 50, "%c", &timestruct);
-
      /* severity in range? */
      if (severity >= ELOG_NSEVERITIES || severity < 0) {
 	  elog_printf(ERROR, "elog_fstartsend(): severity %d out of "
@@ -775,31 +823,11 @@ int elog_fstartsend(enum elog_severity severity,/* severity level */
 	  return 0;
      }
 
-     r = route_printf(elog_opendest[severity].route, 
-		         (elog_opendest[severity].format ? 
-			  elog_opendest[severity].format : ELOG_DEFFORMAT), 
-		      util_decdatetime(logtime),/* DEC datetime */
-		      timestr,			/* unix datetime */
-		      util_shortadaptdatetime(logtime),	/* short datetime */
-		      logtime,			/* epoch time */
-		      elog_sevstring[severity], /* severity string */
-		      elog_sevclower[severity], /* severity char low */
-		      elog_sevcupper[severity], /* severity char up */
-		      util_basename(elog_pname),/* short process name*/
-		      elog_pname,		/* long process name*/
-		      elog_pid,			/* process id */
-		      0, 			/* thread id */
-		      file,			/* file name */
-		      function,			/* function */
-		      line,			/* line number */
-		      util_nonull(elog_origin),	/* origin string */
-		      0,			/* code to log */
-		      util_nonull(logtext));	/* text to log */
-
-     if (r <= 0)
-	  return 0;
+     /* keep order with logs that are still being sent asynchronously */
+     elog_flush();
 
-     return 1;
+     return elog_priv_startsend(severity, file, line, function, time(NULL), 
+				logtext);
 }
 
 /* continue a log message enstablished by a _startsend or _startprintf() */
@@ -817,7 +845,9 @@ void elog_fcontsend(enum elog_severity severity, char *logtext)
 	  return;
      }
 
+     route_lock();
      route_printf(elog_opendest[severity].route, "%s", logtext);
+     route_unlock();
 }
 
 /* terminate a log message enstablished by a _startsend or _startprintf() */
@@ -835,6 +865,7 @@ void elog_fendsend(enum elog_severity severity, char *logtext)
 	  return;
      }
 
+     route_lock();
      route_printf(elog_opendest[severity].route, "%s\n", logtext);
      if ( route_flush(elog_opendest[severity].route) != 1)
           /* not a fatal failure, we may be able to send it again
@@ -842,11 +873,14 @@ void elog_fendsend(enum elog_severity severity, char *logtext)
 	   * infinite loop */
        fprintf(stderr, "elog_endsend(): route_flush() failed: %s: %s\n",
 	       elog_opendest[severity].purl, logtext);
+     route_unlock();
 }
 
 /*
  * As elog_pending(), but flushes the output. you do not need to call any
- * other other method to send the log
+ * other other method to send the log.
+ * When asynchronous (elog_setasync()), the log is held in a ring and 
+ * sent later by the flusher thread, which also formats the time.
  */
 int elog_fsend(enum elog_severity severity,	/* severity level */
 	       char *file,			/* raised in file */
@@ -856,8 +890,26 @@ int elog_fsend(enum elog_severity severity,	/* severity level */
 {
      int r;
 
-     r = elog_fstartsend(severity, file, line, function, logtext);
+     /* hand complete logs to the flusher when asynchronous, unless fatal
+      * or the ring is full */
+     if (elog_async && severity > NOELOG && severity < FATAL &&
+	 elog_priv_asyncput(severity, file, line, function, logtext))
+	  return 1;
+
+     if ( ! elog_isinit || severity >= ELOG_NSEVERITIES || severity < 0) {
+	  r = elog_fstartsend(severity, file, line, function, logtext);
+	  elog_fendsend(severity, "");
+	  return r;
+     }
+
+     /* keep the log whole and in order when other threads are logging */
+     route_lock();
+     elog_flush();
+     r = elog_priv_startsend(severity, file, line, function, time(NULL), 
+			     logtext);
      elog_fendsend(severity, "");
+     route_unlock();
+
      return r;
 }
 
@@ -988,7 +1040,8 @@ void elog_fdie(enum elog_severity severity, /* severity */
      n = vsnprintf(logtext, ELOG_STRLEN, format, ap);
      va_end(ap);
 
-     /* send the formatted message */
+     /* send the formatted message after everything before it */
+     elog_flush();
      elog_fsend(severity, file, line, function, logtext);
      if (n == -1)
           elog_send(severity, "...(error message truncated)");
@@ -1124,6 +1177,297 @@ char *elog_getpurl(enum elog_severity sev)
 }
 
 
+/*
+ * Send complete logs asynchronously through a ring of nrecs records
+ * (rounded up to a power of 2), emptied by a flusher thread.
+ * The caller still formats its text with elog_printf(), but the time 
+ * stamps, the log format and the writing to the route are done by the 
+ * flusher. Logs started with elog_startsend() or elog_startprintf() and
+ * FATAL logs are sent synchronously, after waiting for the ring to empty,
+ * as are logs raised when the ring is full.
+ * Set nrecs to 0 to send the logs remaining in the ring and go back to
+ * synchronous logging, which should be done when other threads are not
+ * logging. Forked children log synchronously.
+ * Returns 1 for success or 0 for failure.
+ */
+int elog_setasync(int nrecs)
+{
+     unsigned long sz, i;
+     sigset_t all, old;
+     int r;
+
+     elog_checkinit();
+
+     if (nrecs <= 0) {
+	  elog_priv_asyncstop();
+	  return 1;
+     }
+     if (elog_async)
+	  return 1;
+
+     for (sz=1; sz < nrecs; sz <<= 1)
+	  ;
+     elog_ring = xnmalloc(sizeof(struct elog_asyncrec) * sz);
+     for (i=0; i < sz; i++) {
+	  elog_ring[i].seq = i;
+	  elog_ring[i].longtext = NULL;
+     }
+     elog_ringsz = sz;
+     elog_ringhead = elog_ringtail = 0;
+     elog_ringstop = 0;
+     sem_init(&elog_ringsem, 0, 0);
+
+     /* signals are left to the main thread, except faults */
+     sigfillset(&all);
+     sigdelset(&all, SIGSEGV);
+     sigdelset(&all, SIGBUS);
+     sigdelset(&all, SIGFPE);
+     sigdelset(&all, SIGILL);
+     pthread_sigmask(SIG_BLOCK, &all, &old);
+     r = pthread_create(&elog_flusher, NULL, elog_priv_flusher, NULL);
+     pthread_sigmask(SIG_SETMASK, &old, NULL);
+     if (r) {
+	  sem_destroy(&elog_ringsem);
+	  nfree(elog_ring);
+	  elog_ring = NULL;
+	  elog_ringsz = 0;
+	  elog_printf(ERROR, "unable to create log flusher: %d %s", r, 
+		      strerror(r));
+	  return 0;
+     }
+
+     /* the flusher is not copied into a child */
+     if ( ! elog_atforkset ) {
+	  pthread_atfork(NULL, NULL, elog_priv_atforkchild);
+	  elog_atforkset++;
+     }
+
+     elog_async = 1;
+
+     return 1;
+}
+
+
+/* 
+ * Send the logs held for asynchronous sending, in the calling thread.
+ * Does nothing if logging is synchronous or if already sending them.
+ */
+void elog_flush()
+{
+     if ( ! elog_async )
+	  return;
+
+     route_lock();
+     if ( ! elog_ringdrain )
+	  elog_priv_drain();
+     route_unlock();
+}
+
+
+/* --------------- Private routines ----------------- */
+
+
+/* 
+ * Work out which severities are sent anywhere, so that the elog_ macros
+ * can skip those sent to none: without formatting their arguments.
+ * Overrides can change severity, so all are enabled while there are any.
+ */
+void elog_priv_setenabled()
+{
+     unsigned int enabled = 0;
+     int i;
+
+     for (i=0; i < ELOG_NSEVERITIES; i++)
+	  if ( ! elog_opendest[i].route || 
+	       elog_opendest[i].route->method->ll_magic() != RT_NONE_LLD_MAGIC)
+	       enabled |= 1 << i;
+     if (elog_override && tree_n(elog_override) > 0)
+	  enabled = (1 << ELOG_NSEVERITIES) - 1;
+
+     elog_enabled = enabled;
+}
+
+
+/* 
+ * Format and send the start of a log raised at logtime, which should be 
+ * in range. The time stamps are only formatted when the second changes.
+ * Returns 1 for success or 0 for failure.
+ */
+int elog_priv_startsend(enum elog_severity severity, char *file, int line, 
+			const char *function, time_t logtime, char *logtext)
+{
+     int r;
+     struct tm timestruct;
+
+     /* the severity routes are shared by threads */
+     route_lock();
+     if (logtime != elog_stamptime) {
+	  strncpy(elog_stampdec, util_decdatetime(logtime), 49);
+	  elog_stampdec[49] = '\0';
+	  localtime_r(&logtime, &timestruct);
+	  strftime(elog_stampunix, 50, "%c", &timestruct);
+	  strncpy(elog_stampshort, util_shortadaptdatetime(logtime), 49);
+	  elog_stampshort[49] = '\0';
+	  elog_stamptime = logtime;
+     }
+     r = route_printf(elog_opendest[severity].route, 
+		         (elog_opendest[severity].format ? 
+			  elog_opendest[severity].format : ELOG_DEFFORMAT), 
+		      elog_stampdec,		/* DEC datetime */
+		      elog_stampunix,		/* unix datetime */
+		      elog_stampshort,		/* short datetime */
+		      logtime,			/* epoch time */
+		      elog_sevstring[severity], /* severity string */
+		      elog_sevclower[severity], /* severity char low */
+		      elog_sevcupper[severity], /* severity char up */
+		      util_basename(elog_pname),/* short process name*/
+		      elog_pname,		/* long process name*/
+		      elog_pid,			/* process id */
+		      0, 			/* thread id */
+		      file,			/* file name */
+		      function,			/* function */
+		      line,			/* line number */
+		      util_nonull(elog_origin),	/* origin string */
+		      0,			/* code to log */
+		      util_nonull(logtext));	/* text to log */
+     route_unlock();
+
+     if (r <= 0)
+	  return 0;
+
+     return 1;
+}
+
+
+/*
+ * Place a complete log in the ring for the flusher, without locking.
+ * A record is claimed when its seq matches the head position and 
+ * published by setting seq to one past it.
+ * Returns 1 if held or 0 if the ring is full.
+ */
+int elog_priv_asyncput(enum elog_severity severity, char *file, int line, 
+		       const char *function, char *logtext)
+{
+     struct elog_asyncrec *rec;
+     unsigned long pos, seq;
+     long dif;
+     size_t len;
+
+     pos = __atomic_load_n(&elog_ringhead, __ATOMIC_RELAXED);
+     for (;;) {
+	  rec = &elog_ring[pos & (elog_ringsz-1)];
+	  seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+	  dif = (long) seq - (long) pos;
+	  if (dif == 0) {
+	       if (__atomic_compare_exchange_n(&elog_ringhead, &pos, pos+1, 0,
+					       __ATOMIC_RELAXED, 
+					       __ATOMIC_RELAXED))
+		    break;		/* claimed */
+	  } else if (dif < 0) {
+	       return 0;		/* full */
+	  } else {
+	       pos = __atomic_load_n(&elog_ringhead, __ATOMIC_RELAXED);
+	  }
+     }
+
+     rec->severity = severity;
+     rec->file     = file;
+     rec->line     = line;
+     rec->function = function;
+     rec->logtime  = time(NULL);
+     rec->longtext = NULL;
+     if ( ! logtext ) {
+	  rec->longtext = NULL;
+	  rec->text[0] = '\0';
+     } else if ((len = strlen(logtext)) < ELOG_ASYNCTEXT) {
+	  memcpy(rec->text, logtext, len+1);
+     } else {
+	  rec->longtext = xnstrdup(logtext);
+     }
+     __atomic_store_n(&rec->seq, pos+1, __ATOMIC_RELEASE);
+     sem_post(&elog_ringsem);
+
+     return 1;
+}
+
+
+/*
+ * Send the records claimed so far in order, waiting for any still being 
+ * filled. Call with route_lock() held.
+ */
+void elog_priv_drain()
+{
+     struct elog_asyncrec *rec;
+     unsigned long head;
+
+     elog_ringdrain = 1;
+     head = __atomic_load_n(&elog_ringhead, __ATOMIC_ACQUIRE);
+     while (elog_ringtail != head) {
+	  rec = &elog_ring[elog_ringtail & (elog_ringsz-1)];
+	  if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != elog_ringtail+1) {
+	       sched_yield();
+	       continue;
+	  }
+	  elog_priv_startsend(rec->severity, rec->file, rec->line, 
+			      rec->function, rec->logtime, 
+			      rec->longtext ? rec->longtext : rec->text);
+	  elog_fendsend(rec->severity, "");
+	  if (rec->longtext) {
+	       nfree(rec->longtext);
+	       rec->longtext = NULL;
+	  }
+	  __atomic_store_n(&rec->seq, elog_ringtail + elog_ringsz, 
+			   __ATOMIC_RELEASE);
+	  elog_ringtail++;
+     }
+     elog_ringdrain = 0;
+}
+
+
+/* Flusher thread: send logs from the ring until stopped */
+void *elog_priv_flusher(void *arg)
+{
+     int stop;
+
+     do {
+	  sem_wait(&elog_ringsem);
+	  stop = __atomic_load_n(&elog_ringstop, __ATOMIC_ACQUIRE);
+	  route_lock();
+	  if ( ! elog_ringdrain )
+	       elog_priv_drain();
+	  route_unlock();
+     } while ( ! stop );
+
+     return NULL;
+}
+
+
+/* Send the logs remaining in the ring, then stop the flusher */
+void elog_priv_asyncstop()
+{
+     if ( ! elog_async )
+	  return;
+
+     elog_async = 0;		/* new logs are synchronous */
+     __atomic_store_n(&elog_ringstop, 1, __ATOMIC_RELEASE);
+     sem_post(&elog_ringsem);
+     pthread_join(elog_flusher, NULL);
+     sem_destroy(&elog_ringsem);
+     nfree(elog_ring);
+     elog_ring = NULL;
+     elog_ringsz = elog_ringhead = elog_ringtail = 0;
+     elog_ringstop = 0;
+}
+
+
+/* The flusher does not run in a forked child, so log synchronously */
+void elog_priv_atforkchild()
+{
+     elog_async = 0;
+}
+
+
+
 
 #if TEST
 
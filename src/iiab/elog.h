@@ -20,6 +20,7 @@
 #ifndef _ELOG_H_
 #define _ELOG_H_
 
+#include <time.h>
 #include "cf.h"
 #include "route.h"
 #include "table.h"
@@ -38,6 +39,7 @@
 #define ELOG_FMT8 "%5$7s %12$-11s %14$4d %13$-18s %17$s"
 #define ELOG_DEFFORMAT ELOG_FMT4
 #define ELOG_MAXFMT 8
+#define ELOG_ASYNCTEXT 256	/* log text held in an async record */
 
 extern char *elog_stdfmt[];
 
@@ -61,6 +63,27 @@ struct elog_destination {
      char *format;
 } elog_opendest[ELOG_NSEVERITIES];
 
+/* Bit mask of severities whose destination is not a none: route, so that
+ * logs to disabled severities are discarded before their arguments are 
+ * evaluated or formatted. Maintained by elog and read by the macros below */
+extern unsigned int elog_enabled;
+#define elog_isenabled(s) ((unsigned) (s) >= ELOG_NSEVERITIES || \
+			   (elog_enabled & (1 << (s))))
+
+/* A log waiting in the asynchronous ring to be formatted and sent by
+ * the flusher thread. seq hands the record between the thread logging it
+ * and the flusher without locking */
+struct elog_asyncrec {
+     unsigned long seq;			/* ring position it is ready for */
+     enum elog_severity severity;
+     char *file;			/* raised in file (static string) */
+     int line;				/* raised from line number */
+     const char *function;		/* raised in function (static) */
+     time_t logtime;			/* time raised */
+     char *longtext;			/* nmalloc()ed text if too long */
+     char text[ELOG_ASYNCTEXT];		/* log text */
+};
+
 int elog_init(int debug, char *binname, CF_VALS cf);
 void elog_checkinit();
 void elog_fini();
@@ -77,6 +100,8 @@ int elog_setformat(enum elog_severity, char *format);
 int elog_setallformat(char *format);
 int elog_setoverride(enum elog_severity severity, char *pattern);
 int elog_rmoverride(char *pattern);
+int elog_setasync(int nrecs);
+void elog_flush();
 void  elog_configure(CF_VALS cf);
 enum  elog_severity elog_lettertosev(char sevletter);
 enum  elog_severity elog_strtosev(char *sevstring);
@@ -117,23 +142,30 @@ void elog_fdie(enum elog_severity severity, char *file, int line,
 void elog_fsafeprintf(enum elog_severity severity, char *file, int line, 
 		      const char *function, const char *format, ...);
 
-/* public calling points: macros to embed more information
+/* public calling points: macros to embed more information and to skip
+ * disabled severities, whose arguments are then not evaluated. 
+ * elog_die() is always raised.
  * WARNING: this is a gnu extension */
-#define elog_startsend(s,t) \
-	  elog_fstartsend(s,__FILE__,__LINE__,__PRETTY_FUNCTION__,t)
-#define elog_contsend(s,t) elog_fcontsend(s,t)
-#define elog_endsend(s,t) elog_fendsend(s,t)
-#define elog_send(s,t) \
-	  elog_fsend(s,__FILE__,__LINE__,__PRETTY_FUNCTION__,t)
-#define elog_startprintf(s,f,r...) \
-	  elog_fstartprintf(s,__FILE__,__LINE__,__PRETTY_FUNCTION__,f,## r)
-#define elog_contprintf(s,f,r...) elog_fcontprintf(s,f,## r)
-#define elog_endprintf(s,f,r...) elog_fendprintf(s,f,## r)
-#define elog_printf(s,f,r...) \
-	  elog_fprintf(s,__FILE__,__LINE__,__PRETTY_FUNCTION__,f,## r)
+#define elog_startsend(s,t) (elog_isenabled(s) ? \
+	  elog_fstartsend(s,__FILE__,__LINE__,__PRETTY_FUNCTION__,t) : 0)
+#define elog_contsend(s,t) (elog_isenabled(s) ? \
+	  elog_fcontsend(s,t) : (void) 0)
+#define elog_endsend(s,t) (elog_isenabled(s) ? \
+	  elog_fendsend(s,t) : (void) 0)
+#define elog_send(s,t) (elog_isenabled(s) ? \
+	  elog_fsend(s,__FILE__,__LINE__,__PRETTY_FUNCTION__,t) : 0)
+#define elog_startprintf(s,f,r...) (elog_isenabled(s) ? \
+	  elog_fstartprintf(s,__FILE__,__LINE__,__PRETTY_FUNCTION__,f,## r) : 0)
+#define elog_contprintf(s,f,r...) (elog_isenabled(s) ? \
+	  elog_fcontprintf(s,f,## r) : (void) 0)
+#define elog_endprintf(s,f,r...) (elog_isenabled(s) ? \
+	  elog_fendprintf(s,f,## r) : (void) 0)
+#define elog_printf(s,f,r...) (elog_isenabled(s) ? \
+	  elog_fprintf(s,__FILE__,__LINE__,__PRETTY_FUNCTION__,f,## r) : 0)
 #define elog_die(s,f,r...) \
 	  elog_fdie(s,__FILE__,__LINE__,__PRETTY_FUNCTION__,f,## r)
-#define elog_safeprintf(s,f,r...) \
-	  elog_fsafeprintf(s,__FILE__,__LINE__,__PRETTY_FUNCTION__,f,## r)
+#define elog_safeprintf(s,f,r...) (elog_isenabled(s) ? \
+	  elog_fsafeprintf(s,__FILE__,__LINE__,__PRETTY_FUNCTION__,f,## r) \
+	  : (void) 0)
 
 #endif /* _ELOG_H_ */
@@ -87,13 +87,11 @@ unsigned int hash_block(char *k, 		/* key */
 						 * arbitrary value */ )
 {
      unsigned int a,b,c,len;
-     char *orig_k;
 
      /* Set up the internal state */
      len = length;
      a = b = 0x9e3779b9;  /* the golden ratio; an arbitrary value */
      c = initval;         /* the previous hash value */
-     orig_k = k;
 
      /*--------------------- handle most of the key (set of 12 bytes) */
      while (len >= 12)
@@ -127,7 +125,6 @@ unsigned int hash_block(char *k, 		/* key */
 
      /*-------------------------------------------- report the result */
      /*elog_printf(DEBUG, "HASH %s => %u (0x%x)", orig_k, c, c);*/
-     elog_printf(DEBUG, "computed hash %u (0x%x)", c, c);
 
      return c;
 }
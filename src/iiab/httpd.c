@@ -1,7 +1,13 @@
 /*
  * HTTP class contains the server code necessary for to serve http
- * connections. All the code is single threaded and uses meth to handle
- * the central I/O select() statement.
+ * connections. Connections are non-blocking and driven by an epoll set,
+ * which is itself watched by meth, so that serving fits between the
+ * jobs of the main loop. HTTP/1.1 keep-alive and pipelined requests are
+ * supported; each connection has bounded buffers and large replies are
+ * sent with chunked transfer encoding.
+ * Path callbacks run in a small pool of threads, so that slow requests
+ * do not hold up job dispatch; those that read state owned by the main
+ * loop are registered with httpd_addpath_inline() to run there instead.
  * Based on mini_httpd.c from Jef Poskanzer (jef@acme.com)
  *
  * Nigel Stuckey, January-March 2001
@@ -14,6 +20,8 @@
 #include <string.h>
 #include <strings.h>
 #include <signal.h>
+#include <pthread.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -22,21 +30,45 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <sys/utsname.h>
+#if linux
+#include <sys/epoll.h>
+#endif
 #include "cf.h"
 #include "iiab.h"
 #include "util.h"
 #include "nmalloc.h"
 #include "tree.h"
+#include "itree.h"
 #include "callback.h"
 #include "meth.h"
+#include "route.h"
+#include "table.h"
+#include "tableset.h"
+#include "cascade.h"
 #include "httpd.h"
 
 char  *httpd_serve_interface;
 int    httpd_serve_port;
 char   httpd_hostname_buf[32];
-int    httpd_listen4_fd, httpd_listen6_fd;
+int    httpd_listen4_fd=-1, httpd_listen6_fd=-1;
 int    httpd_active=0;	/* connections accepted (1) or refused (0) */
-TREE  *httpd_paths;	/* list of accepted paths */
+TREE  *httpd_paths;	/* list of accepted paths; struct httpd_path by path */
+int    httpd_epfd=-1;	/* epoll set of listening sockets and connections */
+ITREE *httpd_conns;	/* open connections; struct httpd_conn by fd */
+time_t httpd_lastsweep;	/* time idle connections were last looked for */
+int    httpd_nthreads;	/* size of the worker pool */
+pthread_t *httpd_threads; /* running pool of workers or NULL */
+pthread_mutex_t httpd_thrlock = PTHREAD_MUTEX_INITIALIZER; /* guards below */
+pthread_cond_t  httpd_thrcond = PTHREAD_COND_INITIALIZER;  /* queue signal */
+struct httpd_job *httpd_thrqueue, *httpd_thrqueuelast; /* waiting requests */
+struct httpd_job *httpd_thrdone, *httpd_thrdonelast; /* finished requests */
+int    httpd_thrstop;	/* flag for workers to exit */
+int    httpd_thrpipe[2];/* written by workers to wake meth_relay() */
+TREE  *httpd_qcache;	/* reduced /local results; httpd_qcache_ent by query */
+unsigned long httpd_qtick; /* count of cache uses, to find the oldest */
+pthread_mutex_t httpd_qlock = PTHREAD_MUTEX_INITIALIZER; /* guards qcache */
+char  *httpd_query_fnames[] = {"avg", "min", "max", "sum", "last", "first",
+			       "diff", "rate", NULL}; /* as enum cascade_fn */
 char  *httpd_schema_nameval[] =  {"name", "value", NULL};
 struct httpd_status {
      int number;
@@ -103,14 +135,40 @@ void httpd_init()
      else
 	  httpd_serve_port = HTTPD_PORT_HTTP;
 
-     httpd_paths = tree_create();
+     if (cf_defined(iiab_cf, HTTPD_CF_THREADS))
+	  httpd_nthreads = cf_getint(iiab_cf, HTTPD_CF_THREADS);
+     else
+	  httpd_nthreads = HTTPD_THREADS;
+
+     httpd_paths        = tree_create();
+     httpd_conns        = itree_create();
+     httpd_lastsweep    = 0;
+     httpd_threads      = NULL;
+     httpd_thrqueue     = httpd_thrqueuelast = NULL;
+     httpd_thrdone      = httpd_thrdonelast  = NULL;
+     httpd_thrstop      = 0;
+     httpd_thrpipe[0]   = httpd_thrpipe[1]   = -1;
+     httpd_qcache       = tree_create();
+     httpd_qtick        = 0;
 }
 
 
 /* shutdown http class */
 void httpd_fini()
 {
+     struct httpd_qcache_ent *ent;
+
+     tree_traverse(httpd_paths)
+	  nfree(tree_get(httpd_paths));
      tree_destroy(httpd_paths);
+     itree_destroy(httpd_conns);
+     tree_traverse(httpd_qcache) {
+	  ent = tree_get(httpd_qcache);
+	  nfree(ent->key);
+	  nfree(ent->result);
+	  nfree(ent);
+     }
+     tree_destroy(httpd_qcache);
 }
 
 
@@ -119,7 +177,10 @@ void httpd_fini()
  * httpd_evaluate() will traverse the tree looking for a string subset match
  * starting from the begining of the strings. eg. adding "/tom" will
  * match a GET for /tom/dick/harry and will have the index set to 4.
- * 
+ * The callback is run in the pool of worker threads, so it may only
+ * share state with the main loop under locks (routes are already safe);
+ * use httpd_addpath_inline() otherwise.
+ *
  * The signature of the callback should be:-
  *   1. requested path (char *)
  *   2. length of path matched, use as an index on path to find
@@ -136,31 +197,65 @@ void httpd_fini()
 void httpd_addpath(char *path, char * (*cb)(char *, int, int, TREE *, char *,
 					    int *, TREE **, time_t *))
 {
-     tree_add(httpd_paths, path, cb);
+     httpd_priv_addpath(path, cb, 0);
+}
+
+
+/*
+ * Add a path and call back pair, as httpd_addpath(), but run the callback
+ * in the main loop. Use for quick callbacks that read state that is not
+ * safe to share between threads, such as the configuration.
+ */
+void httpd_addpath_inline(char *path, char * (*cb)(char *, int, int, TREE *,
+						   char *, int *, TREE **,
+						   time_t *))
+{
+     httpd_priv_addpath(path, cb, 1);
+}
+
+
+/* add or replace a path entry, inmain being set to run cb in the main loop */
+void httpd_priv_addpath(char *path, char * (*cb)(char *, int, int, TREE *,
+						 char *, int *, TREE **,
+						 time_t *), int inmain)
+{
+     struct httpd_path *p;
+
+     p = xnmalloc(sizeof(struct httpd_path));
+     p->cb     = cb;
+     p->inmain = inmain;
+     if (tree_find(httpd_paths, path) != TREE_NOVAL) {
+	  nfree(tree_get(httpd_paths));
+	  tree_put(httpd_paths, p);
+     } else
+	  tree_add(httpd_paths, path, p);
 }
 
 
 /* remove the callback entry defined by path */
 void httpd_rmpath(char *path)
 {
-     if (tree_find(httpd_paths, path) != TREE_NOVAL)
+     if (tree_find(httpd_paths, path) != TREE_NOVAL) {
+	  nfree(tree_get(httpd_paths));
 	  tree_rm(httpd_paths);
+     }
 }
 
 
 /*
  * Sets up a method of serving HTTP and HTTPS requests by
  * 1. seting up and listening on the appropreate sockets
- * 2. establishing a callback with meth to serve requests.
+ * 2. placing them in an epoll set, which meth is asked to watch
+ * 3. starting the pool of workers that run path callbacks.
  * When this routine finishes, subsequent meth_relay() calls will
- * pickup pending HTTP/HTTPS requests and will emit callback events.
- * meth_accept() handles the callback events for both types, 
- * accepts the connection and handles the requests.
+ * pickup pending HTTP/HTTPS requests and will emit callback events,
+ * which httpd_relay() handles by accepting connections and serving
+ * their requests.
  * Stop the service with httpd_stop().
  * This routine is not called by httpd_init(), as servers are optional.
  * meth_init() should have been called before this is called.
  * Returns 1 for successful, 0 for failure.
- */ 
+ */
 int httpd_start()
 {
      httpd_usockaddr host_addr4;
@@ -173,6 +268,18 @@ int httpd_start()
 	  return 0;
      }
 
+#if linux
+     httpd_epfd = epoll_create1(EPOLL_CLOEXEC);
+     if (httpd_epfd == -1) {
+	  elog_printf(ERROR, "unable to create epoll set: %d %s", errno,
+		      strerror(errno));
+	  return 0;
+     }
+#else
+     elog_printf(ERROR, "http serving needs epoll, which is not available");
+     return 0;
+#endif
+
      /* Look up hostname. */
      httpd_lookup_if(&host_addr4, sizeof(host_addr4), &gotv4,
 		     &host_addr6, sizeof(host_addr6), &gotv6 );
@@ -184,12 +291,14 @@ int httpd_start()
      if ( ! ( gotv4 || gotv6 ) )
      {
 	  elog_printf(ERROR, "can't find any valid address" );
+	  close(httpd_epfd);
+	  httpd_epfd = -1;
 	  return 0;
      }
 
      /*
       * Initialize listen sockets.
-      * Try v6 first because of a Linux peculiarity: unlike other systems, 
+      * Try v6 first because of a Linux peculiarity: unlike other systems,
       * it has magical v6 sockets that also listen for v4,
       * but if you bind a v4 socket first then the v6 bind fails.
       */
@@ -205,6 +314,8 @@ int httpd_start()
      if ( httpd_listen4_fd == -1 && httpd_listen6_fd == -1 )
      {
 	  elog_printf(ERROR, "can't bind to any address");
+	  close(httpd_epfd);
+	  httpd_epfd = -1;
 	  return 0;
      }
 
@@ -214,9 +325,9 @@ int httpd_start()
 	  SSLeay_add_ssl_algorithms();
 	  SSL_load_error_strings();
 	  ssl_ctx = SSL_CTX_new( SSLv23_server_method() );
-	  if ( SSL_CTX_use_certificate_file( ssl_ctx, CERT_FILE, 
+	  if ( SSL_CTX_use_certificate_file( ssl_ctx, CERT_FILE,
 					     SSL_FILETYPE_PEM ) == 0 ||
-	       SSL_CTX_use_PrivateKey_file( ssl_ctx, KEY_FILE, 
+	       SSL_CTX_use_PrivateKey_file( ssl_ctx, KEY_FILE,
 					    SSL_FILETYPE_PEM ) == 0 ||
 	       SSL_CTX_check_private_key( ssl_ctx ) == 0 )
 	  {
@@ -226,18 +337,26 @@ int httpd_start()
      }
 #endif /* USE_SSL */
 
-     /* establish callback event and tell meth to monitor the socket */
-     callback_regcb(HTTPD_CB_ACCEPT, (void *) httpd_accept);
-     if (gotv6)
-	  meth_add_fdcallback(httpd_listen6_fd, HTTPD_CB_ACCEPT);
-     else
-	  meth_add_fdcallback(httpd_listen4_fd, HTTPD_CB_ACCEPT);
+     /* workers for the path callbacks; without them, callbacks are run
+      * in the main loop */
+     if (httpd_threadstart() == -1)
+	  elog_printf(WARNING, "no http worker threads, serving requests "
+		      "in the main loop");
+
+     /* establish callback event and tell meth to monitor the epoll set,
+      * which becomes readable when any of its sockets has an event */
+     if (httpd_listen6_fd != -1)
+	  httpd_watch(httpd_listen6_fd, HTTPD_EV_IN, 1);
+     if (httpd_listen4_fd != -1)
+	  httpd_watch(httpd_listen4_fd, HTTPD_EV_IN, 1);
+     callback_regcb(HTTPD_CB_EVENT, (void *) httpd_relay);
+     meth_add_fdcallback(httpd_epfd, HTTPD_CB_EVENT);
 
      httpd_active = 1;	/* accept connections */
 
      /* tell everybody */
-     elog_printf(DIAG, "Listening for HTTP requests on interface %s port %d", 
-		 httpd_serve_interface==NULL ? "(null)" : httpd_serve_interface, 
+     elog_printf(DIAG, "Listening for HTTP requests on interface %s port %d",
+		 httpd_serve_interface==NULL ? "(null)" : httpd_serve_interface,
 		 httpd_serve_port);
 
      return 1;
@@ -247,155 +366,778 @@ int httpd_start()
 
 /*
  * Shut down the ability to handle HTTP/HTTPD requests.
- * The callback remains in place to sync any outstanding connection
- * requests, but a flag is set to ensure that nothing is done about
- * them
+ * The workers are stopped once their current request is finished,
+ * then all connections and the listening sockets are closed.
  */
 void httpd_stop()
 {
+     ITREE *all;
+
      /* disable work */
      httpd_active = 0;
+     if (httpd_epfd == -1)
+	  return;
 
-     /* close socket and tell meth to ignore it */
-     if (httpd_listen4_fd == -1) {
+     /* tell meth to ignore us */
+     meth_rm_fdcallback(httpd_epfd);
+     callback_unregcb(HTTPD_CB_EVENT, (void *) httpd_relay);
+
+     /* requests in the pool are discarded and their connections closed */
+     httpd_threadstop();
+     all = itree_create();
+     itree_traverse(httpd_conns)
+	  itree_append(all, itree_get(httpd_conns));
+     itree_traverse(all)
+	  httpd_conn_close(itree_get(all));
+     itree_destroy(all);
+
+     /* close sockets */
+     if (httpd_listen6_fd != -1)
 	  close(httpd_listen6_fd);
-	  meth_rm_fdcallback(httpd_listen6_fd);
-     } else {
-	  close(httpd_listen6_fd);
-	  meth_rm_fdcallback(httpd_listen4_fd);
+     if (httpd_listen4_fd != -1)
+	  close(httpd_listen4_fd);
+     httpd_listen4_fd = httpd_listen6_fd = -1;
+     close(httpd_epfd);
+     httpd_epfd = -1;
+}
+
+
+
+/*
+ * Callback from meth_relay() when the epoll set is readable.
+ * Collects the pending events without waiting, accepting connections on
+ * the listening sockets and moving each connection on: reading requests
+ * when it is waiting for them and writing replies when they are being
+ * sent. Finally, idle connections are closed.
+ * The first argument is the epoll descriptor, the remainder are unused.
+ */
+void httpd_relay(void *fd /* would be an int */)
+{
+#if linux
+     struct epoll_event events[HTTPD_MAXEVENTS];
+     struct httpd_conn *c;
+     int i, n, cfd;
+
+     n = epoll_wait(httpd_epfd, events, HTTPD_MAXEVENTS, 0);
+     if (n == -1) {
+	  if (errno != EINTR)
+	       elog_printf(ERROR, "epoll_wait() error %d %s", errno,
+			   strerror(errno));
+	  return;
+     }
+
+     for (i=0; i < n; i++) {
+	  cfd = events[i].data.fd;
+	  if (cfd == httpd_listen4_fd || cfd == httpd_listen6_fd) {
+	       httpd_accept(cfd);
+	       continue;
+	  }
+	  if ( (c = itree_find(httpd_conns, cfd)) == ITREE_NOVAL )
+	       continue;
+	  switch (c->state) {
+	  case HTTPD_CONN_READ:
+	       httpd_conn_read(c);
+	       break;
+	  case HTTPD_CONN_WRITE:
+	       httpd_conn_serve(c);
+	       break;
+	  case HTTPD_CONN_BUSY:
+	       /* not watched, but errors are always reported */
+	       if (events[i].events & (EPOLLERR | EPOLLHUP))
+		    httpd_conn_close(c);
+	       break;
+	  }
      }
+#endif
+
+     httpd_sweep();
 }
 
 
 
 /*
- * Accept connections for an HTTP request.
- * The routine is written to handle events from the callback class (hence
- * the void* casts as an argument when we really want an int). 
- * The first argument is the file descriptor to read, the remainder are unused.
- * Returns nothing.
+ * Accept connections waiting on the listening socket fd, adding them
+ * to the epoll set to wait for their requests. Connections beyond
+ * HTTPD_MAXCONN are closed straight away.
  */
-void httpd_accept(void *fd /* would be an int */)
+void httpd_accept(int fd)
 {
      httpd_usockaddr usa;
-     int conn_fd, totbytes=0, bytes=0, method;
+     struct httpd_conn *c;
+     int conn_fd;
      socklen_t sz;
-     char buf[10000], *request=NULL;
-     char *path, *reqdata=NULL, *datablock=NULL;
-     TREE *headers;
-     int content_length, datalen, r;
 
-     /* establish a connection to recieve data */
-     if ( (int) (long) fd == -1 ) {
-	  elog_send(ERROR, "unable to accept");
-	  return /*0*/;
-     } else {
+     for (;;) {
+	  /* establish a connection to recieve data */
 	  sz = sizeof(usa);
-	  conn_fd = accept( (int) (long) fd, &usa.sa, &sz );
+	  conn_fd = accept( fd, &usa.sa, &sz );
+	  if (conn_fd < 0) {
+	       if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+		   || errno == ECONNABORTED)
+		    return;
+	       if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+		   errno == ENOMEM) {
+		    elog_printf(WARNING, "unable to accept HTTP connection: %s",
+				strerror(errno));
+		    return;
+	       }
+	       elog_printf(ERROR, "stopping HTTP service - accept %d error: %s",
+			   fd, strerror(errno));
+	       httpd_stop();
+	       return;
+	  }
+
+	  /* if we are in an inactive state or full, close the connection */
+	  if ( ! httpd_active || itree_n(httpd_conns) >= HTTPD_MAXCONN ) {
+	       elog_printf(DIAG, "refusing HTTP connection, %d open",
+			   itree_n(httpd_conns));
+	       close(conn_fd);
+	       continue;
+	  }
+
+#ifdef USE_SSL
+	  if ( do_ssl ) {
+	       ssl = SSL_new( ssl_ctx );
+	       SSL_set_fd( ssl, conn_fd );
+	       if ( SSL_accept( ssl ) == 0 ) {
+		    ERR_print_errors_fp( stderr );
+		    exit( 1 );
+	       }
+	  }
+#endif /* USE_SSL */
+
+	  fcntl(conn_fd, F_SETFL, O_NONBLOCK);
+	  fcntl(conn_fd, F_SETFD, FD_CLOEXEC);
+
+	  /* buffers are allocated once for the life of the connection */
+	  c = xnmalloc(sizeof(struct httpd_conn));
+	  memset(c, 0, sizeof(struct httpd_conn));
+	  c->fd    = conn_fd;
+	  c->state = HTTPD_CONN_READ;
+	  c->last  = time(NULL);
+	  c->in    = xnmalloc(HTTPD_INMAX+1);
+	  c->out   = xnmalloc(HTTPD_OUTMAX);
+	  itree_add(httpd_conns, conn_fd, c);
+	  c->events = HTTPD_EV_IN;
+	  httpd_watch(conn_fd, HTTPD_EV_IN, 1);
      }
+}
 
-     if (conn_fd < 0) {
-	  if (errno != EINTR) {
-	       elog_printf(ERROR, "stopping HTTP service - accept %d error: %s", 
-			   (int) (long) fd, strerror(errno));
-	       httpd_stop();
+
+
+/*
+ * Change the events watched for connection c to events, which may be 0
+ * while its request is with a worker.
+ */
+void httpd_conn_watch(struct httpd_conn *c, int events)
+{
+     if (c->events == events)
+	  return;
+     c->events = events;
+     httpd_watch(c->fd, events, 0);
+}
+
+
+
+/*
+ * Add fd to the epoll set when add is set, otherwise change the events
+ * it is watched for. events is a mask of HTTPD_EV_IN and HTTPD_EV_OUT.
+ */
+void httpd_watch(int fd, int events, int add)
+{
+#if linux
+     struct epoll_event ev;
+
+     ev.events  = (events & HTTPD_EV_IN  ? EPOLLIN  : 0) |
+		  (events & HTTPD_EV_OUT ? EPOLLOUT : 0);
+     ev.data.fd = fd;
+     if (epoll_ctl(httpd_epfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd,
+		   &ev) == -1)
+	  elog_printf(ERROR, "unable to watch http fd %d: %d %s", fd, errno,
+		      strerror(errno));
+#endif
+}
+
+
+
+/*
+ * Close the connection c and free its storage.
+ * If a worker is running its request, c is only taken out of the epoll
+ * set and marked dead, to be closed by httpd_done() when the worker
+ * returns; the descriptor is kept open until then so that it can't be
+ * reused by another connection.
+ */
+void httpd_conn_close(struct httpd_conn *c)
+{
+#if linux
+     struct epoll_event ev;	/* ignored, but may not be NULL */
+
+     epoll_ctl(httpd_epfd, EPOLL_CTL_DEL, c->fd, &ev);
+#endif
+     if (c->state == HTTPD_CONN_BUSY) {
+	  c->state = HTTPD_CONN_DEAD;
+	  return;
+     }
+
+     close(c->fd);
+     if (itree_find(httpd_conns, c->fd) != ITREE_NOVAL)
+	  itree_rm(httpd_conns);
+     if (c->body)
+	  nfree(c->body);
+     nfree(c->in);
+     nfree(c->out);
+     nfree(c);
+}
+
+
+
+/*
+ * Read what is waiting on connection c into its input buffer and serve
+ * any requests that are now complete.
+ */
+void httpd_conn_read(struct httpd_conn *c)
+{
+     int r;
+
+     if (c->inlen < HTTPD_INMAX) {
+	  r = recv(c->fd, c->in + c->inlen, HTTPD_INMAX - c->inlen, 0);
+	  if (r == -1) {
+	       if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		    return;
+	       elog_printf(DEBUG, "HTTP read error on fd %d: %s", c->fd,
+			   strerror(errno));
+	       httpd_conn_close(c);
+	       return;
 	  }
-	  return /*0*/;
+	  if (r == 0)
+	       c->eof = 1;	/* requests already read are still served */
+	  c->inlen += r;
+	  c->last = time(NULL);
      }
 
-     /* if we are in an inactive state, close the connection */
-     if ( ! httpd_active ) {
-	  close((int) (long) fd);
+     httpd_conn_serve(c);
+}
+
+
+
+/*
+ * Move connection c on as far as it can go without waiting: send the
+ * reply in progress, then start the requests pipelined behind it until
+ * one has to wait for the client or for a worker.
+ * c may be closed and freed on return.
+ */
+void httpd_conn_serve(struct httpd_conn *c)
+{
+     while (1) {
+	  if (c->state == HTTPD_CONN_WRITE) {
+	       if (httpd_conn_write(c) <= 0)
+		    return;
+	       if ( ! c->keepalive ) {
+		    httpd_conn_close(c);
+		    return;
+	       }
+	       c->state = HTTPD_CONN_READ;
+	  }
+	  if (c->state != HTTPD_CONN_READ)
+	       return;
+	  if (httpd_conn_next(c) <= 0)
+	       return;
+     }
+}
+
+
+
+/*
+ * Send the reply queued on connection c, which is made of the headers or
+ * chunk framing in c->out and the body in c->body. Chunks are framed one
+ * at a time, so c->out never holds more than HTTPD_OUTMAX.
+ * Returns 1 if the reply has been sent, 0 if the socket is full and
+ * the rest will be sent when it is writable, or -1 if the connection
+ * failed and has been closed.
+ */
+int httpd_conn_write(struct httpd_conn *c)
+{
+     char *pt;
+     int n, r;
+
+     while (1) {
+	  /* send the buffered headers or chunk, then any unframed body */
+	  if (c->outoff < c->outlen) {
+	       pt = c->out  + c->outoff;
+	       n  = c->outlen - c->outoff;
+	  } else if (c->body && ! c->chunked && c->bodyoff < c->bodylen) {
+	       pt = c->body + c->bodyoff;
+	       n  = c->bodylen - c->bodyoff;
+	  } else if (c->body && c->chunked) {
+	       /* frame the next chunk; the last is empty */
+	       n = c->bodylen - c->bodyoff;
+	       if (n > HTTPD_CHUNKSZ)
+		    n = HTTPD_CHUNKSZ;
+	       c->outoff = 0;
+	       c->outlen = sprintf(c->out, "%x\r\n", n);
+	       memcpy(c->out + c->outlen, c->body + c->bodyoff, n);
+	       c->outlen += n;
+	       c->outlen += sprintf(c->out + c->outlen, "\r\n");
+	       c->bodyoff += n;
+	       if (n == 0) {
+		    nfree(c->body);
+		    c->body = NULL;
+	       }
+	       continue;
+	  } else
+	       break;
+
+	  r = send(c->fd, pt, n, MSG_NOSIGNAL);
+	  if (r == -1) {
+	       if (errno == EINTR)
+		    continue;
+	       if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		    httpd_conn_watch(c, HTTPD_EV_OUT);
+		    return 0;
+	       }
+	       elog_printf(DEBUG, "HTTP write error on fd %d: %s", c->fd,
+			   strerror(errno));
+	       httpd_conn_close(c);
+	       return -1;
+	  }
+	  if (c->outoff < c->outlen)
+	       c->outoff += r;
+	  else
+	       c->bodyoff += r;
+	  c->last = time(NULL);
+     }
+
+     /* all sent */
+     c->outoff = c->outlen = 0;
+     if (c->body) {
+	  nfree(c->body);
+	  c->body = NULL;
+     }
+
+     return 1;
+}
+
+
+
+/*
+ * Start the next request held in the input buffer of connection c.
+ * The request is taken out of the buffer, scanned and matched against
+ * the paths; its callback is either given to the worker pool or run
+ * here. Requests may be no larger than HTTPD_INMAX, headers and body.
+ * Returns 1 if a reply has been queued and c is ready to write, 0 if
+ * c is waiting for more input or for a worker, or -1 if c has been
+ * closed.
+ */
+int httpd_conn_next(struct httpd_conn *c)
+{
+     struct httpd_job *j;
+     struct httpd_path *p;
+     char *end, *request, *path, *val;
+     int hdrlen, datalen, method, skip;
+     TREE *headers;
+
+     /* pipelined requests may be separated by blank lines */
+     for (skip=0; skip < c->inlen && (c->in[skip] == '\r' ||
+				      c->in[skip] == '\n'); skip++)
+	  ;
+     httpd_conn_consume(c, skip);
+
+     /* check for the end of client's headers: a blank line */
+     c->in[c->inlen] = '\0';
+     hdrlen = 0;
+     if ( (end = strstr(c->in, "\r\n\r\n")) )
+	  hdrlen = end - c->in + 4;
+     if ( (end = strstr(c->in, "\n\n")) && (! hdrlen ||
+					    end - c->in + 2 < hdrlen) )
+	  hdrlen = end - c->in + 2;
+     if ( ! hdrlen ) {
+	  if (c->inlen >= HTTPD_INMAX) {
+	       httpd_conn_consume(c, c->inlen);
+	       c->keepalive = 0;
+	       httpd_error_send(c, 413, "Request headers too large");
+	       return 1;
+	  }
+	  if (c->eof) {
+	       httpd_conn_close(c);
+	       return -1;
+	  }
+	  httpd_conn_watch(c, HTTPD_EV_IN);
+	  return 0;
+     }
+
+     /* break the headers down into important parts, in a copy as
+      * scanning alters the text */
+     request = xnmemdup(c->in, hdrlen+1);
+     request[hdrlen] = '\0';
+     method = httpd_request_scan(c, request, &path, &headers);
+     if (method == HTTPD_METHOD_FAIL) {
+	  /* an error has been queued and the connection will close */
+	  httpd_conn_consume(c, c->inlen);
+	  if (headers)
+	       tree_destroy(headers);
+	  nfree(request);
+	  return 1;
+     }
+
+     /* the body follows, its size given by the Content-length header */
+     datalen = 0;
+     if ( (val = httpd_header_find(headers, "Content-length")) )
+	  datalen = strtol(val, NULL, 10);
+     if (httpd_header_find(headers, "Transfer-encoding") || datalen < 0 ||
+	 hdrlen + datalen > HTTPD_INMAX) {
+	  httpd_conn_consume(c, c->inlen);
+	  tree_destroy(headers);
+	  nfree(request);
+	  c->keepalive = 0;
+	  httpd_error_send(c, datalen < 0 ? 400 : 413,
+			   "Request data missing a length or too large");
+	  return 1;
+     }
+     if (hdrlen + datalen > c->inlen) {
+	  /* wait for the rest, the headers are scanned again then */
+	  tree_destroy(headers);
+	  nfree(request);
+	  if (c->eof) {
+	       httpd_conn_close(c);
+	       return -1;
+	  }
+	  httpd_conn_watch(c, HTTPD_EV_IN);
+	  return 0;
+     }
+
+     elog_printf(DEBUG, "HTTP request %s %s", request, path);
+
+     j = xnmalloc(sizeof(struct httpd_job));
+     memset(j, 0, sizeof(struct httpd_job));
+     j->conn    = c;
+     j->request = request;
+     j->path    = path;
+     j->method  = method;
+     j->headers = headers;
+     j->data    = xnmemdup(c->in + hdrlen, datalen+1);
+     j->data[datalen] = '\0';
+     httpd_conn_consume(c, hdrlen + datalen);
+
+     /* find the longest registered path that prefixes the request */
+     p = NULL;
+     tree_traverse(httpd_paths) {
+	  val = tree_getkey(httpd_paths);
+	  if (strncmp(path, val, strlen(val)) == 0) {
+	       p = tree_get(httpd_paths);
+	       j->match = strlen(val);
+	  }
+     }
+     if ( ! p ) {
+	  httpd_job_free(j);
+	  httpd_error_send(c, 404, "can't find that thing for you");
+	  return 1;
+     }
+     j->cb = p->cb;
+
+     if (p->inmain || ! httpd_threads) {
+	  httpd_job_run(j);
+	  httpd_job_reply(j);
+	  return 1;
+     }
+
+     /* hand to the workers, input is not read until the reply is sent */
+     c->state = HTTPD_CONN_BUSY;
+     httpd_conn_watch(c, 0);
+     pthread_mutex_lock(&httpd_thrlock);
+     j->next = NULL;
+     if (httpd_thrqueuelast)
+	  httpd_thrqueuelast->next = j;
+     else
+	  httpd_thrqueue = j;
+     httpd_thrqueuelast = j;
+     pthread_cond_signal(&httpd_thrcond);
+     pthread_mutex_unlock(&httpd_thrlock);
+
+     return 0;
+}
+
+
+
+/* remove the first n bytes from the input buffer of connection c */
+void httpd_conn_consume(struct httpd_conn *c, int n)
+{
+     if (n <= 0)
 	  return;
+     memmove(c->in, c->in + n, c->inlen - n);
+     c->inlen -= n;
+}
+
+
+
+/* run the callback of request j, saving its output in j */
+void httpd_job_run(struct httpd_job *j)
+{
+     j->result = j->cb(j->path, j->match, j->method, j->headers, j->data,
+		       &j->rlen, &j->rheaders, &j->modt);
+}
+
+
+
+/*
+ * Queue the reply to the request j on its connection and free j.
+ * The connection is left ready to write.
+ */
+void httpd_job_reply(struct httpd_job *j)
+{
+     struct httpd_conn *c;
+
+     c = j->conn;
+     if ( ! j->result ) {
+	  httpd_error_send(c, 500, "no result for that");
+     } else {
+	  /* rheaders ignored for now and not freed */
+	  httpd_header_send(c, j->rheaders, 200, "text/html", j->rlen,
+			    j->modt);
+	  if (j->method == HTTPD_METHOD_HEAD) {
+	       nfree(j->result);
+	  } else {
+	       c->body    = j->result;
+	       c->bodylen = j->rlen;
+	       c->bodyoff = 0;
+	  }
+	  j->result = NULL;
+	  c->state = HTTPD_CONN_WRITE;
      }
+     httpd_job_free(j);
+}
 
-#ifdef USE_SSL
-    if ( do_ssl )
-	{
-	ssl = SSL_new( ssl_ctx );
-	SSL_set_fd( ssl, conn_fd );
-	if ( SSL_accept( ssl ) == 0 )
-	    {
-		 ERR_print_errors_fp( stderr );
-		 exit( 1 );
-	    }
-	}
-#endif /* USE_SSL */
 
-    /* collect the data into an nmalloc()ed buffer */
-    for (;;) {
-	 bytes = read( conn_fd, buf, sizeof(buf) );
-	 if (bytes <= 0)
-	      break;
-	 request = xnrealloc(request, totbytes + bytes +1);
-	 strncpy(request + totbytes, buf, bytes);
-	 totbytes += bytes;
-	 request[totbytes] = '\0';
-
-	 /* check for the end of client's headers: a blank line */
-	 if ( (reqdata = strstr( request, "\r\n\r\n" )) != NULL ) {
-	      memset(reqdata, 0, 4);	/* terminate headers */
-	      reqdata += 4;
-	      break;
-	 }
-	 if ( (reqdata = strstr( request, "\n\n" )) != NULL ) {
-	      memset(reqdata, 0, 2);	/* terminate headers */
-	      reqdata += 2;
-	      break;
-	 }
-    }
-
-    /* At this stage, we have all the headers in request and any data
-     * from the request in data. We do nothing with reqdata now, just 
-     * process the headers */
-    if (httpd_active) {
-	 /* break code down into important parts */
-	 method = httpd_request_scan(conn_fd, request, &path, &headers);
-	 if (method == HTTPD_METHOD_FAIL)
-	      goto close_connection;
-
-	 elog_printf(DEBUG, "HTTP request %s %s", request, path);
-	 /*tree_strdump(headers, "");*/
-
-	 /* consume reqdata depending on the Content-length header */
-	 if (tree_find(headers, "Content-length") != TREE_NOVAL) {
-	      /* do we need to get more data from the socket? */
-	      content_length = strtol(tree_get(headers), NULL, 10);
-	      datalen = totbytes - (reqdata - buf);
-	      if (content_length > datalen) {
-		   /* we need more data that we have collected in the 
-		    * header block.  Copy it to a data block so
-		    * we leave the header pointers intact and 
-		    * continue to fetch data */
-		   datablock = xnmalloc(content_length+1);
-		   strncpy(datablock, reqdata, datalen);
-		   if (datalen < content_length) {
-			r = read(conn_fd, datablock+datalen, 
-				 content_length - datalen);
-			if (r == 0 || r <= 0) {
-			     /* I dont want to deal with slow, large 
-			      * transfers, so abort this request. 
-			      * Sorry but I'm not a web server!! */
-			     goto close_connection;
-			}
-		   }
-		   datablock[content_length] = '\0';
-		   reqdata = datablock;	   
-	      }
-	 }
-
-	 /* evaluate and send back a response */
-	 httpd_response_evaluate(conn_fd, method, path, headers, reqdata);
-    }
-
- close_connection:
-    if (datablock)
-	 nfree(datablock);
-    close(conn_fd);
-    nfree(request);
-    tree_destroy(headers);
-
-    return /*1*/;
+
+/* free request j and the remains of its result */
+void httpd_job_free(struct httpd_job *j)
+{
+     if (j->headers)
+	  tree_destroy(j->headers);
+     if (j->result)
+	  nfree(j->result);
+     nfree(j->request);
+     nfree(j->data);
+     nfree(j);
+}
+
+
+
+/*
+ * Close connections that have been waiting for their client for more
+ * than HTTPD_IDLESEC seconds, either for a request or to accept the
+ * reply. Looked for at most once a second, as events arrive.
+ */
+void httpd_sweep()
+{
+     struct httpd_conn *c;
+     ITREE *idle;
+     time_t now;
+
+     now = time(NULL);
+     if (now == httpd_lastsweep)
+	  return;
+     httpd_lastsweep = now;
+
+     idle = itree_create();
+     itree_traverse(httpd_conns) {
+	  c = itree_get(httpd_conns);
+	  if ((c->state == HTTPD_CONN_READ || c->state == HTTPD_CONN_WRITE) &&
+	      c->last + HTTPD_IDLESEC < now)
+	       itree_append(idle, c);
+     }
+     itree_traverse(idle) {
+	  c = itree_get(idle);
+	  elog_printf(DEBUG, "closing idle HTTP connection fd %d", c->fd);
+	  httpd_conn_close(c);
+     }
+     itree_destroy(idle);
+}
+
+
+
+/*
+ * Start the pool of workers that run path callbacks, together with the
+ * pipe that they use to wake meth_relay() when requests are finished.
+ * The workers block all signals, leaving them to the main thread.
+ * Returns 0 for success or -1 if the pool could not be started or its
+ * size is 0.
+ */
+int httpd_threadstart()
+{
+     sigset_t all, old;
+     int i, r;
+
+     if (httpd_threads)
+	  return 0;
+     if (httpd_nthreads < 1)
+	  return -1;
+
+     if (pipe(httpd_thrpipe) == -1) {
+	  elog_printf(ERROR, "unable to create http thread pipe: %d %s",
+		      errno, strerror(errno));
+	  return -1;
+     }
+     fcntl(httpd_thrpipe[0], F_SETFL, O_NONBLOCK);
+     fcntl(httpd_thrpipe[1], F_SETFL, O_NONBLOCK);
+     fcntl(httpd_thrpipe[0], F_SETFD, FD_CLOEXEC);
+     fcntl(httpd_thrpipe[1], F_SETFD, FD_CLOEXEC);
+     meth_add_fdcallback(httpd_thrpipe[0], HTTPD_CB_DONE);
+     callback_regcb(HTTPD_CB_DONE, (void *) httpd_done);
+
+     httpd_thrstop = 0;
+     httpd_threads = xnmalloc(sizeof(pthread_t) * httpd_nthreads);
+     sigfillset(&all);		/* except faults, which must still be caught */
+     sigdelset(&all, SIGSEGV);
+     sigdelset(&all, SIGBUS);
+     sigdelset(&all, SIGFPE);
+     sigdelset(&all, SIGILL);
+     pthread_sigmask(SIG_BLOCK, &all, &old);
+     for (i=0; i < httpd_nthreads; i++) {
+	  r = pthread_create(&httpd_threads[i], NULL, httpd_thread, NULL);
+	  if (r) {
+	       elog_printf(ERROR, "unable to create http thread %d: %d %s",
+			   i, r, strerror(r));
+	       break;
+	  }
+     }
+     pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+     if (i == 0) {
+	  /* no threads at all */
+	  nfree(httpd_threads);
+	  httpd_threads = NULL;
+	  httpd_threadstop();
+	  return -1;
+     }
+     httpd_nthreads = i;
+     elog_printf(DEBUG, "started %d http threads", httpd_nthreads);
+
+     return 0;
+}
+
+
+
+/*
+ * Stop the pool of workers, waiting for the running callbacks to finish.
+ * Requests that are queued or not yet collected by httpd_done() are
+ * discarded and their connections marked dead, to be closed by the
+ * caller.
+ */
+void httpd_threadstop()
+{
+     struct httpd_job *j, *lists[2];
+     int i;
+
+     if (httpd_threads) {
+	  pthread_mutex_lock(&httpd_thrlock);
+	  httpd_thrstop = 1;
+	  pthread_cond_broadcast(&httpd_thrcond);
+	  pthread_mutex_unlock(&httpd_thrlock);
+	  for (i=0; i < httpd_nthreads; i++)
+	       pthread_join(httpd_threads[i], NULL);
+	  nfree(httpd_threads);
+	  httpd_threads = NULL;
+     }
+
+     lists[0] = httpd_thrqueue;
+     lists[1] = httpd_thrdone;
+     for (i=0; i < 2; i++) {
+	  while ( (j = lists[i]) ) {
+	       lists[i] = j->next;
+	       j->conn->state = HTTPD_CONN_DEAD;
+	       httpd_job_free(j);
+	  }
+     }
+     httpd_thrqueue = httpd_thrqueuelast = NULL;
+     httpd_thrdone  = httpd_thrdonelast  = NULL;
+
+     if (httpd_thrpipe[0] != -1) {
+	  callback_unregcb(HTTPD_CB_DONE, (void *) httpd_done);
+	  meth_rm_fdcallback(httpd_thrpipe[0]);
+	  close(httpd_thrpipe[0]);
+	  close(httpd_thrpipe[1]);
+	  httpd_thrpipe[0] = httpd_thrpipe[1] = -1;
+     }
+}
+
+
+
+/*
+ * Body of each worker: run the callbacks of queued requests, passing
+ * them to the done list and writing to the thread pipe as each finishes
+ */
+void *httpd_thread(void *unused)
+{
+     struct httpd_job *j;
+
+     pthread_mutex_lock(&httpd_thrlock);
+     while (1) {
+	  while ( ! httpd_thrstop && ! httpd_thrqueue )
+	       pthread_cond_wait(&httpd_thrcond, &httpd_thrlock);
+	  if (httpd_thrstop)
+	       break;
+
+	  /* take the oldest request */
+	  j = httpd_thrqueue;
+	  httpd_thrqueue = j->next;
+	  if ( ! httpd_thrqueue )
+	       httpd_thrqueuelast = NULL;
+	  pthread_mutex_unlock(&httpd_thrlock);
+
+	  httpd_job_run(j);
+
+	  /* hand back to the main loop */
+	  pthread_mutex_lock(&httpd_thrlock);
+	  j->next = NULL;
+	  if (httpd_thrdonelast)
+	       httpd_thrdonelast->next = j;
+	  else
+	       httpd_thrdone = j;
+	  httpd_thrdonelast = j;
+	  if (write(httpd_thrpipe[1], "", 1) == -1 && errno != EAGAIN)
+	       elog_printf(ERROR, "unable to write http thread pipe: %d %s",
+			   errno, strerror(errno));
+     }
+     pthread_mutex_unlock(&httpd_thrlock);
+
+     return NULL;
+}
+
+
+
+/*
+ * Callback from meth_relay() when the thread pipe is written.
+ * Collects the requests finished by workers and starts sending their
+ * replies, or closes their connections if the clients have gone.
+ */
+void httpd_done()
+{
+     struct httpd_job *j, *done;
+     struct httpd_conn *c;
+     char buf[PIPE_BUF];
+
+     /* drain the pipe before taking the list, so that later requests
+      * write it again */
+     while (read(httpd_thrpipe[0], buf, PIPE_BUF) > 0)
+	  ;
+     pthread_mutex_lock(&httpd_thrlock);
+     done = httpd_thrdone;
+     httpd_thrdone = httpd_thrdonelast = NULL;
+     pthread_mutex_unlock(&httpd_thrlock);
+
+     while ( (j = done) ) {
+	  done = j->next;
+	  c = j->conn;
+	  if (c->state == HTTPD_CONN_DEAD) {
+	       httpd_job_free(j);
+	       httpd_conn_close(c);
+	  } else {
+	       httpd_job_reply(j);
+	       httpd_conn_serve(c);
+	  }
+     }
+
+     httpd_sweep();
 }
 
 
@@ -405,18 +1147,24 @@ void httpd_accept(void *fd /* would be an int */)
  * path    - path text
  * headers - Returned TREE containing the header tokens in key, their
  *           strings in value.
+ * The protocol version and whether the connection should be kept open
+ * after the reply are set in c.
  * Returns the HTTP method or -1 (HTTPD_METHOD_FAIL) for failure, in which
  * case none of the outputs are valid. If an error is returned, a suitable
- * message will have been sent to fd.
- * When finished with the outputs, call util_freescan() on headers.
+ * message will have been queued on c, which will be closed after it is
+ * sent.
+ * When finished with the outputs, call tree_destroy() on headers.
  * All other data is provided by request. Warning, request will be altered.
  */
-int httpd_request_scan(int fd, char *request, char **path, TREE **headers)
+int httpd_request_scan(struct httpd_conn *c, char *request, char **path,
+		       TREE **headers)
 {
-     ITREE *lines, *cols;
-     char *pt, *tok, *start, *hdr;
-     int method, r;
+     char *pt, *tok, *start, *hdr, *next;
+     int method;
 
+     *headers = NULL;
+     c->keepalive = 0;
+     c->http11 = 0;
      if (!request)
           return HTTPD_METHOD_FAIL;
 
@@ -428,18 +1176,31 @@ int httpd_request_scan(int fd, char *request, char **path, TREE **headers)
      /* remove leading whitespace */
      for (start = request; isspace(*start); start++)
 	  ;
-     
-     /* split the start line from the headers */
-     hdr = strchr(start, '\n');
-     *hdr = '\0';
-     hdr++;
+
+     /* split the start line from the headers, which may be absent */
+     if ( (hdr = strchr(start, '\n')) )
+	  *hdr++ = '\0';
+     else
+	  hdr = start + strlen(start);
 
      /* match: <method> <path> <protocol> */
      tok = strchr(start, ' ');		/* path */
+     if ( ! tok ) {
+	  httpd_error_send(c, 400, "Bad request line");
+	  return HTTPD_METHOD_FAIL;
+     }
      *tok = '\0';
      tok++;
-     pt = strchr(tok, ' ');		/* protocol */
-     *pt = '\0';
+     while (*tok == ' ')
+	  tok++;
+     if ( (pt = strchr(tok, ' ')) ) {	/* protocol */
+	  *pt = '\0';
+	  pt++;
+	  while (*pt == ' ')
+	       pt++;
+	  if (strncmp(pt, "HTTP/1.", 7) == 0 && pt[7] >= '1' && pt[7] <= '9')
+	       c->http11 = 1;
+     }
 
      /* parse method */
      if (strcmp(start, "GET") == 0) {
@@ -450,74 +1211,61 @@ int httpd_request_scan(int fd, char *request, char **path, TREE **headers)
 	  method = HTTPD_METHOD_HEAD;
      } else {
 	  method = HTTPD_METHOD_FAIL;
-	  httpd_error_send(fd, 501, "Method not implemented");
+	  httpd_error_send(c, 501, "Method not implemented");
 	  return method;
      }
 
      /* decode the path */
      util_strdecode(tok, tok);
      if ( *tok != '/' ) {
-	  httpd_error_send(fd, 400, "Bad path" );
+	  httpd_error_send(c, 400, "Bad path" );
 	  return HTTPD_METHOD_FAIL;
      }
      *path = tok;
 
-     /* scan the request headers into columns and rows, split column on 
-      * colon, which means we capture spaces!! */
-     r = util_scantext(hdr, ":", UTIL_MULTISEP, &lines);
-     if (r <= 0)
-	  return HTTPD_METHOD_FAIL;
-
-     /* ignore the rest of the start line and scan the headers */
+     /* scan the request headers, splitting each line on its first colon
+      * and stripping the spaces around the value */
      *headers = tree_create();
-     itree_traverse(lines) {
-	  cols = itree_get(lines);
-	  if (itree_n(cols) < 2)
+     for (pt = hdr; *pt; pt = next) {
+	  if ( (next = strchr(pt, '\n')) )
+	       *next++ = '\0';
+	  else
+	       next = pt + strlen(pt);
+	  if ( ! (tok = strchr(pt, ':')) )
 	       continue;		/* not enough tokens */
-
-	  itree_first(cols);		/* token name */
-	  tok = itree_get(cols);
-	  itree_next(cols);		/* token value (strip leading ws) */
-	  pt = itree_get(cols);
-	  while (isspace(*pt))
-	       pt++;
-	  tree_add(*headers, tok, pt);
+	  *tok++ = '\0';
+	  while (isspace(*tok))
+	       tok++;
+	  start = tok + strlen(tok);
+	  while (start > tok && isspace(*(start-1)))
+	       *--start = '\0';
+	  tree_add(*headers, pt, tok);
      }
 
+     /* HTTP/1.1 connections persist unless asked not to, HTTP/1.0 ones
+      * only if asked to */
+     pt = httpd_header_find(*headers, "Connection");
+     if (c->http11)
+	  c->keepalive = ! (pt && strcasecmp(pt, "close") == 0);
+     else
+	  c->keepalive = pt && strcasecmp(pt, "keep-alive") == 0;
+
      return method;
 }
 
 
 
 /*
- * Evaluate the request and send back a response for it.
+ * Return the value of the header name in headers, which is matched
+ * without regard to case, or NULL if it is not there
  */
-void httpd_response_evaluate(int fd, int method, char *path, TREE *headers, 
-			     char *data)
+char *httpd_header_find(TREE *headers, char *name)
 {
-     char *key;
-     int len, rlen;
-     char *(*cb)();
-     char *result;
-     TREE *rheaders;
-     time_t modt;
-
-     tree_traverse(httpd_paths) {
-	  key = tree_getkey(httpd_paths);
-	  len = strlen(key);
-	  if (strncmp(path, key, len) == 0) {
-	       cb = tree_get(httpd_paths);
-	       result = cb(path, len, method, headers, data, &rlen, &rheaders, 
-			   &modt);
-	       httpd_header_send(fd, rheaders, 200, "text/html", rlen, modt);
-	       write(fd, result, rlen);
-	       nfree(result);
-	       /* rheaders ignored for now and not freed */
-	       return;
-	  }
-     }
+     tree_traverse(headers)
+	  if (strcasecmp(tree_getkey(headers), name) == 0)
+	       return tree_get(headers);
 
-     httpd_error_send(fd, 404, "can't find that thing for you");
+     return NULL;
 }
 
 
@@ -543,16 +1291,15 @@ char *httpd_status_title(int status)
 
 
 /*
- * Send an error message back to the expetant requestor using 
- * file descriptor fd.
+ * Queue an error message to the expetant requestor on connection c,
+ * which is left ready to write.
  * Errnum is the standard HTTP error codes (see RFC2616)
- * Extra_headers is text to fill with returned headers
  * Text is more specific information
  */
-void httpd_error_send(int fd, int errnum, char *text)
+void httpd_error_send(struct httpd_conn *c, int errnum, char *text)
 {
      char buf[2048];
-     int n, idx, i;
+     int n, i;
      char *status;
 
      status = httpd_status_title(errnum);
@@ -564,44 +1311,51 @@ void httpd_error_send(int fd, int errnum, char *text)
 		  "<font color=#003366>h a b i t a t</font></b></font>"
 		  "<br><br><br><H4>%d %s</H4>\n%s\n<!--",
 		  errnum, status, errnum, status, text);
-     
+
      for (i=0; i<6; i++) {
 	  n += snprintf(buf+n, sizeof(buf)-n, "Padding so that MSIE deigns "
 			"to show this error instead of its own canned one.\n");
      }
      n += snprintf(buf+n, sizeof(buf)-n, "-->\n<HR>\n<ADDRESS><A HREF=\"%s\">"
-		   "%s</A></ADDRESS>\n</BODY></HTML>\n", 
+		   "%s</A></ADDRESS>\n</BODY></HTML>\n",
 		   HTTPD_SOFTWARE, HTTPD_URL);
 
-     idx = httpd_header_send(fd, NULL, errnum, "text/html", n, 0);
-     write(fd, buf, n);
+     httpd_header_send(c, NULL, errnum, "text/html", n, 0);
+     if (c->body)
+	  nfree(c->body);
+     c->body    = xnmemdup(buf, n);
+     c->bodylen = n;
+     c->bodyoff = 0;
+     c->state   = HTTPD_CONN_WRITE;
 
      return;
 }
 
 
 /*
- * Send headers back to the requestor using file descriptor fd.
+ * Format headers for the reply into the output buffer of connection c.
  * The header Status will override the status value.
  * headers may be NULL, status should always exist,
  * mime_type may be NULL, content_length may be 0 and so can last_modified.
+ * Bodies longer than HTTPD_CHUNKSZ are marked to be sent in chunks to
+ * HTTP/1.1 clients.
  * Reutrns an index into httpd_status_text that corresponds to the
  * the appropreate status
  */
-int httpd_header_send(int fd, TREE *headers, int user_status, char *mime_type, 
-		      int content_length, time_t last_modified)
+int httpd_header_send(struct httpd_conn *c, TREE *headers, int user_status,
+		      char *mime_type, int content_length,
+		      time_t last_modified)
 {
      time_t now;
      int status, n;
-     char buf[2048], nowstr[50], modstr[50], *title;
+     char nowstr[50], modstr[50], *title, *buf;
      char *rfc1123_fmt = "%a, %d %b %Y %H:%M:%S GMT";
+     struct tm tm;
 
      /* format dates */
      now = time(NULL);
-     strftime(nowstr, 50, rfc1123_fmt, gmtime(&now));
-     strftime(modstr, 50, rfc1123_fmt, gmtime(&last_modified));
-/*     cftime(nowstr, rfc1123_fmt, &now);
-       cftime(modstr, rfc1123_fmt, &last_modified);*/
+     strftime(nowstr, 50, rfc1123_fmt, gmtime_r(&now, &tm));
+     strftime(modstr, 50, rfc1123_fmt, gmtime_r(&last_modified, &tm));
 
      /* get the status response */
      status = user_status;
@@ -615,35 +1369,46 @@ int httpd_header_send(int fd, TREE *headers, int user_status, char *mime_type,
      title = httpd_status_title(status);
 
      /* write status */
-     n = snprintf(buf, sizeof(buf), "HTTP/1.0 %d %s\r\n", status, title);
+     buf = c->out;
+     n = snprintf(buf, HTTPD_OUTMAX, "HTTP/1.1 %d %s\r\n", status, title);
 
-     /* write additional_headers */
+     /* write additional_headers, leaving room for the standard ones */
      if (headers)
-	  tree_traverse(headers)	  
-	       n += snprintf(buf+n, sizeof(buf)-n, "%s: %s\r\n", 
+	  tree_traverse(headers) {
+	       if (n + strlen(tree_getkey(headers)) +
+		   strlen(tree_get(headers)) + 4 > HTTPD_OUTMAX - 512)
+		    break;
+	       n += snprintf(buf+n, HTTPD_OUTMAX-n, "%s: %s\r\n",
 			     tree_getkey(headers), (char *) tree_get(headers));
+	  }
 
      /* write standard headers */
-     n += snprintf(buf+n, sizeof(buf)-n, 
+     n += snprintf(buf+n, HTTPD_OUTMAX-n,
 		   "Server: %s\r\n"
 		   "Date: %s\r\n",
 		   HTTPD_SOFTWARE, nowstr);
      if (mime_type && *mime_type)
-	  n += snprintf(buf+n, sizeof(buf)-n, "Content-type: %s\r\n", 
+	  n += snprintf(buf+n, HTTPD_OUTMAX-n, "Content-type: %s\r\n",
 			mime_type);
-     if (content_length > 0)
-	  n += snprintf(buf+n, sizeof(buf)-n, "Content-length: %d\r\n",
+     c->chunked = c->http11 && content_length > HTTPD_CHUNKSZ;
+     if (c->chunked)
+	  n += snprintf(buf+n, HTTPD_OUTMAX-n,
+			"Transfer-encoding: chunked\r\n");
+     else
+	  n += snprintf(buf+n, HTTPD_OUTMAX-n, "Content-length: %d\r\n",
 			content_length);
      if (last_modified > 0)
-	  n += snprintf(buf+n, sizeof(buf)-n, "Last-modified: %s\r\n", modstr);
-     n += snprintf(buf+n, sizeof(buf)-n, "Connection: close\r\n\r\n");
+	  n += snprintf(buf+n, HTTPD_OUTMAX-n, "Last-modified: %s\r\n",
+			modstr);
+     n += snprintf(buf+n, HTTPD_OUTMAX-n, "Connection: %s\r\n\r\n",
+		   c->keepalive ? "keep-alive" : "close");
 
-     write(fd, buf, strlen(buf));
+     c->outlen = n;
+     c->outoff = 0;
 
      return status;
 }
 
-
 /*
  * Supports both v4 and v6 IP adresses
  * Returns 1 for successful or 0 otherwise
@@ -804,6 +1569,9 @@ int httpd_listen( httpd_usockaddr* usaP )
      /* keep open over exec call */
      fcntl( listen_fd, F_SETFD, 1 );
 
+     /* connections are accepted until there are no more waiting */
+     fcntl( listen_fd, F_SETFL, O_NONBLOCK );
+
      i = 1;
      if ( setsockopt( listen_fd, SOL_SOCKET, SO_REUSEADDR, (char*) &i, 
 		      sizeof(i) ) < 0 ) {
@@ -949,6 +1717,36 @@ char *httpd_builtin_info(char *path, int match, int method, TREE *headers_in,
 }
 
 
+
+/* memory allocated by call site, as estimated by the sampling profiler.
+ * A path ending in tsv gives tab separated values, otherwise html */
+char *httpd_builtin_nmalloc(char *path, int match, int method, 
+			    TREE *headers_in, char *data_in, int *length_out, 
+			    TREE **headers_out, time_t *modt_out) {
+     char *r;
+#if NMSAMPLE
+     TABLE t;
+     int tsv = 0;
+
+     if (strlen(path) > 3 && strncmp(path+strlen(path)-3, "tsv", 3) == 0)
+	  tsv++;
+
+     t = nm_sample_table();
+     if (tsv)
+          r = table_outtable(t);
+     else
+          r = table_html(t, -1, -1, NULL);
+     table_destroy(t);
+#else
+     r = xnstrdup("Error\nAllocation sampling is not compiled in "
+		  "(build with NMSAMPLE)\n");
+#endif
+     *length_out = strlen(r);
+     *headers_out = NULL;
+     *modt_out = time(NULL);
+     return r;
+}
+
 /* access to local data
  * This is the consolidated view of short term memory stores and the 
  * consolidated on-disk ringstore
@@ -960,13 +1758,20 @@ char *httpd_builtin_info(char *path, int match, int method, TREE *headers_in,
  * Duration may be 'cons' for consolidated and all the meta operators
  * also work (?info, ?linfo, ?cinfo, ?lcinfo).
  * A leading comma (,) before ring in the path is silently ignored
+ * The data may be reduced before it is sent by a query of name=value 
+ * pairs, joined by '&' (see httpd_query_scan()), eg. 
+ * /localtsv/sys,60?step=300&fn=max&cols=_time,load1
+ * Reduced results are cached until the ring is next written.
  */
 char *httpd_builtin_local(char *path, int match, int method, TREE *headers_in, 
 			  char *data_in, int *length_out, TREE **headers_out, 
 			  time_t *modt_out) {
      TABLE t;
-     char *r, *rspath, *rspath_t;
-     int rspathlen, tsv=0;
+     char *r, *addr=NULL, *query, *qtext=NULL, *rspath, *rspath_t;
+     char *qkey=NULL;
+     int rspathlen, tsv=0, seq, size;
+     time_t youngest;
+     struct httpd_query q;
 
      /* take the partial ringstore address out of path.
       * its starts from the second slash (/) onwards and will be
@@ -991,32 +1796,77 @@ char *httpd_builtin_local(char *path, int match, int method, TREE *headers_in,
 					       "tsv", 3) == 0)
 	  tsv++;
 
+     /* split off the query, which unlike the meta operators is made of
+      * name=value pairs */
+     addr = xnstrdup(r);
+     if ( (query = strrchr(addr, '?')) && strchr(query, '=') )
+	  *query++ = '\0';
+     else
+	  query = NULL;
+     if (query)
+	  qtext = xnstrdup(query);	/* scanned in place, kept for q */
+     if ( ! httpd_query_scan(qtext, &q) ) {
+	  r = util_strjoin("Error\nUnable to understand query ", query, 
+			   "\n", NULL);
+	  goto local_prep_ret;
+     }
+
      /* work out the file to open */
      /* TODO: This needs work. we are hard coding the driver [grs:] but
       * we should be working this out dynamically */
      rspath    = util_strjoin("grs:", iiab_dir_var, "/%h.grs", 
-			      *r=='?' ? "": ",", r, NULL);
+			      *addr=='?' ? "": ",", addr, NULL);
      rspathlen = strlen(rspath);
      rspath_t  = xnmalloc(rspathlen+100);
      route_expand(rspath_t, rspath, "NOJOB", 0);
+     nfree(rspath);
+
+     /* a reduced result stays good while the ring's youngest sequence
+      * is the same. The ring is looked at before it is read, so a write 
+      * in between only makes the cached result newer than it need be. 
+      * Consolidated and meta routes have no sequence and are not cached */
+     if (query) {
+	  if (route_stat(rspath_t, NULL, &seq, &size, &youngest) && 
+	      youngest > 0) {
+	       qkey = util_strjoin(rspath_t, "?", query, tsv ? " tsv" : "",
+				   NULL);
+	       if ( (r = httpd_qcache_get(qkey, seq, youngest)) ) {
+		    elog_printf(DEBUG, "cached result for %s", qkey);
+		    nfree(qkey);
+		    nfree(rspath_t);
+		    goto local_prep_ret;
+	       }
+	  }
+     }
 
-     /* while I want to give them the memrs, its not ready -- 
-      * just give them the ringstore */
+     /* inside clockwork, grs: routes hold their recent samples in memory
+      * (rt_rs_usemem()), so the recent window is read without the disk */
      elog_printf(DIAG, "asked to deliver: %s, sending %s", path, rspath_t);
      t = route_tread(rspath_t, NULL);
+     nfree(rspath_t);
      if (!t) {
 	  r = xnstrdup("Error\nUnable to open object\n");
+	  if (qkey)
+	       nfree(qkey);
 	  goto local_prep_ret;
      }
-     if ( tsv )
+     if (query) {
+	  r = httpd_query_eval(t, &q, tsv);
+	  if (qkey) {
+	       httpd_qcache_put(qkey, seq, youngest, r);
+	       nfree(qkey);
+	  }
+     } else if ( tsv )
 	  r = table_outtable(t);
      else
 	  r = table_html(t, -1, -1, NULL);
      table_destroy(t);
-     nfree(rspath_t);
-     nfree(rspath);
 
 local_prep_ret:
+     if (addr)
+	  nfree(addr);
+     if (qtext)
+	  nfree(qtext);
      *length_out = strlen(r);
      *headers_out = NULL;
      *modt_out = time(NULL);
@@ -1024,35 +1874,590 @@ local_prep_ret:
 }
 
 
+/*
+ * Scan the query text of a /local request into q, which holds pointers
+ * into text. The query is made of name=value pairs joined by '&':-
+ *   step=<secs>   aggregate rows into periods of <secs> seconds, each
+ *                 reported at its start; alone, fn is avg
+ *   fn=<func>     aggregate with avg, min, max, sum, last, first, diff or 
+ *                 rate (see cascade_aggregate()); alone, over all rows
+ *   cols=<c1,c2>  only send these columns, in this order
+ *   key=<value>   only use rows whose key column has this value
+ * text may be NULL for no query. text is altered by the scan.
+ * Returns 1 for success or 0 if the query is not understood.
+ */
+int httpd_query_scan(char *text, struct httpd_query *q)
+{
+     char *name, *val, *pos, *end;
+     int i;
+
+     q->step = 0;
+     q->fn   = -1;
+     q->cols = NULL;
+     q->key  = NULL;
+     if ( ! text )
+	  return 1;
+
+     for (name = strtok_r(text, "&", &pos); name; 
+	  name = strtok_r(NULL, "&", &pos)) {
+	  if ( ! (val = strchr(name, '=')) )
+	       return 0;
+	  *val++ = '\0';
+	  if (strcmp(name, "step") == 0) {
+	       q->step = strtol(val, &end, 10);
+	       if (*end || q->step <= 0)
+		    return 0;
+	  } else if (strcmp(name, "fn") == 0) {
+	       for (i=0; httpd_query_fnames[i]; i++)
+		    if (strcmp(httpd_query_fnames[i], val) == 0)
+			 break;
+	       if ( ! httpd_query_fnames[i] )
+		    return 0;
+	       q->fn = i;
+	  } else if (strcmp(name, "cols") == 0) {
+	       /* tableset wants the columns separated by spaces */
+	       for (end = val; *end; end++)
+		    if (*end == ',')
+			 *end = ' ';
+	       q->cols = val;
+	  } else if (strcmp(name, "key") == 0) {
+	       q->key = val;
+	  } else
+	       return 0;
+     }
+     if (q->step && q->fn == -1)
+	  q->fn = CASCADE_AVG;
+
+     return 1;
+}
+
+
+/*
+ * Reduce the table t using the query q and return it formatted as tab 
+ * separated values if tsv is set or html otherwise, in an nmalloc()ed 
+ * string. Rows are chosen by key, aggregated by period and then the
+ * columns are chosen. t is not altered.
+ */
+char *httpd_query_eval(TABLE t, struct httpd_query *q, int tsv)
+{
+     TABSET keyset=NULL, colset=NULL;
+     TABLE data, keyed=NULL, agg=NULL, period, proj=NULL;
+     TREE *inforow, *row;
+     char *keycol=NULL, *r;
+     time_t when, start=0;
+     int inperiod=0;
+
+     data = t;
+
+     /* key filter */
+     if (q->key) {
+	  inforow = table_getinforow(t, "key");
+	  if (inforow) {
+	       keycol = tree_search(inforow, "1", 2);
+	       tree_destroy(inforow);
+	  }
+	  if ( ! keycol )
+	       return xnstrdup("Error\nNo key column to choose from\n");
+	  keyset = tableset_create(t);
+	  tableset_where(keyset, keycol, eq, q->key);
+	  data = keyed = tableset_into(keyset);
+     }
+
+     /* aggregate each period, or everything if there is no step. Rows
+      * are in time order, so each period is a run of rows */
+     if (q->fn != -1) {
+	  if ( ! table_hascol(data, "_time") ) {
+	       r = xnstrdup("Error\nNo _time column to aggregate\n");
+	       goto query_eval_ret;
+	  }
+	  agg    = table_create_fromdonor(data);
+	  period = table_create_fromdonor(data);
+	  cascade_lock();	/* cascade_aggregate() is not reentrant */
+	  table_traverse(data) {
+	       if (q->step) {
+		    when = strtol(table_getcurrentcell(data, "_time"), NULL, 10);
+		    when -= when % q->step;
+	       } else
+		    when = 0;
+	       if (inperiod && when != start) {
+		    httpd_query_period(agg, period, q, start);
+		    table_destroy(period);
+		    period = table_create_fromdonor(data);
+	       }
+	       start = when;
+	       inperiod = 1;
+	       row = table_getcurrentrow(data);
+	       table_addrow_noalloc(period, row);
+	       tree_destroy(row);
+	  }
+	  if (inperiod)
+	       httpd_query_period(agg, period, q, start);
+	  cascade_unlock();
+	  table_destroy(period);
+	  data = agg;
+     }
+
+     /* column projection */
+     if (q->cols) {
+	  colset = tableset_create(data);
+	  tableset_selectt(colset, q->cols);
+	  data = proj = tableset_into(colset);
+     }
+
+     if (tsv)
+	  r = table_outtable(data);
+     else
+	  r = table_html(data, -1, -1, NULL);
+     if ( ! r )
+	  r = xnstrdup("");	/* nothing was chosen */
+
+ query_eval_ret:
+     if (proj)
+	  table_destroy(proj);
+     if (colset)
+	  tableset_destroy(colset);
+     if (agg)
+	  table_destroy(agg);
+     if (keyed)
+	  table_destroy(keyed);
+     if (keyset)
+	  tableset_destroy(keyset);
+
+     return r;
+}
+
+
+/*
+ * Aggregate the rows of period with the function in q and append the 
+ * result to agg. With a step, the result is given the start time 
+ * of the period and the step as its duration. Call with cascade_lock().
+ */
+void httpd_query_period(TABLE agg, TABLE period, struct httpd_query *q, 
+			time_t start)
+{
+     TABLE res;
+     char num[24];
+
+     res = cascade_aggregate(q->fn, period);
+     if ( ! res )
+	  return;
+     if (q->step) {
+	  table_traverse(res) {
+	       snprintf(num, sizeof(num), "%ld", (long) start);
+	       table_replacecurrentcell_alloc(res, "_time", num);
+	       snprintf(num, sizeof(num), "%d", q->step);
+	       table_replacecurrentcell_alloc(res, "_dur", num);
+	  }
+     }
+     table_addtable(agg, res, 1);
+     table_destroy(res);
+}
+
+
+/*
+ * Return an nmalloc()ed copy of the result cached under key, if it was 
+ * made when the ring's youngest sequence was seq at time youngest, 
+ * otherwise NULL. Safe to call from the workers.
+ */
+char *httpd_qcache_get(char *key, int seq, time_t youngest)
+{
+     struct httpd_qcache_ent *ent;
+     char *r = NULL;
+
+     pthread_mutex_lock(&httpd_qlock);
+     ent = tree_find(httpd_qcache, key);
+     if (ent != TREE_NOVAL && ent->seq == seq && ent->youngest == youngest) {
+	  ent->used = ++httpd_qtick;
+	  r = xnstrdup(ent->result);
+     }
+     pthread_mutex_unlock(&httpd_qlock);
+
+     return r;
+}
+
+
+/*
+ * Cache a copy of result under key, made when the ring's youngest 
+ * sequence was seq at time youngest, replacing any older result. 
+ * When there are HTTPD_QCACHEMAX results, the least recently used 
+ * one is dropped. Safe to call from the workers.
+ */
+void httpd_qcache_put(char *key, int seq, time_t youngest, char *result)
+{
+     struct httpd_qcache_ent *ent, *lru;
+
+     pthread_mutex_lock(&httpd_qlock);
+     ent = tree_find(httpd_qcache, key);
+     if (ent == TREE_NOVAL) {
+	  if (tree_n(httpd_qcache) >= HTTPD_QCACHEMAX) {
+	       lru = NULL;
+	       tree_traverse(httpd_qcache) {
+		    ent = tree_get(httpd_qcache);
+		    if ( ! lru || ent->used < lru->used )
+			 lru = ent;
+	       }
+	       tree_find(httpd_qcache, lru->key);
+	       tree_rm(httpd_qcache);
+	       nfree(lru->key);
+	       nfree(lru->result);
+	       nfree(lru);
+	  }
+	  ent = xnmalloc(sizeof(struct httpd_qcache_ent));
+	  ent->key = xnstrdup(key);
+	  tree_add(httpd_qcache, ent->key, ent);
+     } else
+	  nfree(ent->result);
+     ent->seq      = seq;
+     ent->youngest = youngest;
+     ent->used     = ++httpd_qtick;
+     ent->result   = xnstrdup(result);
+     pthread_mutex_unlock(&httpd_qlock);
+}
+
+
 #if TEST
 
+#include <arpa/inet.h>
 #include "sig.h"
 
+#define TEST_RING "t.httpd,0"
+#define TEST_QUERY(q) "GET /localtsv/" TEST_RING ",t=0-?" q \
+                      " HTTP/1.1\r\nHost: test\r\n\r\n"
+#define TEST_BIGSZ (HTTPD_CHUNKSZ*2+100)	/* sent in three chunks */
+#define TEST_MAXREPLY 4
+
+/* a client run in its own thread while the main loop serves it */
+struct test_client {
+     char *send;		/* requests, sent in one write */
+     int   nreplies;		/* replies expected for send */
+     char *then;		/* request sent after the replies or NULL */
+     int   status[TEST_MAXREPLY];	/* status of each reply or -1 */
+     int   keepalive[TEST_MAXREPLY];	/* 1 if the reply kept the conn */
+     int   chunked[TEST_MAXREPLY];	/* 1 if the reply was chunked */
+     char *body[TEST_MAXREPLY];	/* nmalloc()ed body of each reply */
+     char  buf[HTTPD_INMAX];	/* input not yet taken as a reply */
+     int   len;			/* bytes held in buf */
+     int   done;		/* set when finished */
+};
+
+char *test_big(char *path, int match, int method, TREE *headers_in, 
+	       char *data_in, int *length_out, TREE **headers_out, 
+	       time_t *modt_out);
+void  test_exchange(struct test_client *cl, char *send, int nreplies, 
+		    char *then);
+void *test_client_run(void *arg);
+int   test_client_fill(struct test_client *cl, int fd);
+int   test_client_reply(struct test_client *cl, int fd, int i);
+void  test_client_free(struct test_client *cl);
+void  test_ringwrite(ROUTE rt, char *val);
+int   test_maxconns;
+
 int main(int argc, char **argv)
 {
-     iiab_start("", argc, argv, "", NULL);
+     struct test_client cl;
+     struct httpd_qcache_ent *ent;
+     ROUTE rt;
+     char *big, *purl, purl_t[PATH_MAX];
+     int i;
+
+     iiab_start("", argc, argv, "", HTTPD_CF_PORT " " HTTPD_PORT_HTTP_STR);
 
      /* initialise job classes over those setup by iiab_start */
      sig_init();
-     meth_init();
+     meth_init(argc, argv, NULL);
      httpd_init();
      httpd_addpath("/ping",     httpd_builtin_ping);
-     httpd_addpath("/cf",       httpd_builtin_cf);
-     httpd_addpath("/elog",     httpd_builtin_elog);
+     httpd_addpath_inline("/cf",   httpd_builtin_cf);
+     httpd_addpath_inline("/elog", httpd_builtin_elog);
      httpd_addpath("/local/",   httpd_builtin_local);
      httpd_addpath("/localtsv/",httpd_builtin_local);
-     httpd_start();
-
-     printf("press ^C to end\n");
+     httpd_addpath("/big",      test_big);
+     if ( ! httpd_start() )
+	  elog_die(FATAL, "unable to start serving");
+
+     /* serve until killed when asked, for testing by hand */
+     if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+	  printf("press ^C to end\n");
+	  while(1)
+	       elog_printf(DEBUG, "relay returns %d", meth_relay());
+     }
 
-     /* run jobs */
-     while(1) {
-          elog_printf(DEBUG,  0, "relay returns %d", meth_relay());
-	  /*runq_dump();*/
+     /* test 1: two pipelined requests in one write, the second with a
+      * chunked reply, then a third request on the same connection */
+     test_exchange(&cl,
+		   "GET /ping HTTP/1.1\r\nHost: test\r\n\r\n"
+		   "GET /big HTTP/1.1\r\nHost: test\r\n\r\n", 2,
+		   "GET /ping HTTP/1.1\r\nHost: test\r\n\r\n");
+     for (i=0; i<3; i++) {
+	  if (cl.status[i] != 200)
+	       elog_die(FATAL, "[1] reply %d status %d not 200", i, 
+			cl.status[i]);
+	  if ( ! cl.keepalive[i] )
+	       elog_die(FATAL, "[1] reply %d did not keep the connection",i);
      }
+     if (strcmp(cl.body[0], "hello, world\n") || cl.chunked[0])
+	  elog_die(FATAL, "[1] first reply wrong: %s", cl.body[0]);
+     big = test_big(NULL, 0, 0, NULL, NULL, &i, NULL, NULL);
+     if ( ! cl.chunked[1] || strcmp(cl.body[1], big) )
+	  elog_die(FATAL, "[1] second reply not chunked or wrong (%d)", 
+		   (int) strlen(cl.body[1]));
+     nfree(big);
+     if (strcmp(cl.body[2], "hello, world\n"))
+	  elog_die(FATAL, "[1] third reply wrong: %s", cl.body[2]);
+     if (test_maxconns != 1)
+	  elog_die(FATAL, "[1] %d connections open, not 1", test_maxconns);
+     test_client_free(&cl);
+
+     /* test 2: a missing path errors without closing the connection,
+      * while HTTP/1.0 closes after its reply */
+     test_exchange(&cl, "GET /missing HTTP/1.1\r\nHost: test\r\n\r\n", 1,
+		   "GET /ping HTTP/1.0\r\n\r\n");
+     if (cl.status[0] != 404 || ! cl.keepalive[0])
+	  elog_die(FATAL, "[2] missing path status %d keepalive %d", 
+		   cl.status[0], cl.keepalive[0]);
+     if (cl.status[1] != 200 || cl.keepalive[1])
+	  elog_die(FATAL, "[2] HTTP/1.0 status %d keepalive %d", 
+		   cl.status[1], cl.keepalive[1]);
+     test_client_free(&cl);
+
+     /* test 3: a query is cached until the ring is written. The cached
+      * result is altered to show that it is the one sent */
+     purl = util_strjoin("grs:", iiab_dir_var, "/%h.grs,", TEST_RING, NULL);
+     route_expand(purl_t, purl, "NOJOB", 0);
+     nfree(purl);
+     rt = route_open(purl_t, "httpd test", NULL, 10);
+     if ( ! rt )
+	  elog_die(FATAL, "[3] unable to open %s", purl_t);
+     test_ringwrite(rt, "1.5");
+     test_exchange(&cl, TEST_QUERY("fn=max&cols=load1"), 1, NULL);
+     if (cl.status[0] != 200 || strncmp(cl.body[0], "Error", 5) == 0)
+	  elog_die(FATAL, "[3] query failed: %d %s", cl.status[0], 
+		   cl.body[0]);
+     test_client_free(&cl);
+     if (tree_n(httpd_qcache) != 1)
+	  elog_die(FATAL, "[3] %d cached results, not 1", 
+		   tree_n(httpd_qcache));
+     tree_first(httpd_qcache);
+     ent = tree_get(httpd_qcache);
+     nfree(ent->result);
+     ent->result = xnstrdup("cached\n");
+
+     test_exchange(&cl, TEST_QUERY("fn=max&cols=load1"), 1, NULL);
+     if (strcmp(cl.body[0], "cached\n"))
+	  elog_die(FATAL, "[3] repeated query not from cache: %s", 
+		   cl.body[0]);
+     test_client_free(&cl);
+
+     /* test 4: writing to the ring invalidates the cached result */
+     test_ringwrite(rt, "999.5");
+     test_exchange(&cl, TEST_QUERY("fn=max&cols=load1"), 1, NULL);
+     if (strcmp(cl.body[0], "cached\n") == 0)
+	  elog_die(FATAL, "[4] stale cached result after ring write");
+     if ( ! strstr(cl.body[0], "999.5") )
+	  elog_die(FATAL, "[4] new maximum not in result: %s", cl.body[0]);
+     test_client_free(&cl);
+     route_close(rt);
+
+     /* test 5: malformed queries are refused and not cached */
+     test_exchange(&cl, TEST_QUERY("step=x") TEST_QUERY("colour=red"), 2, 
+		   NULL);
+     for (i=0; i<2; i++)
+	  if (strncmp(cl.body[i], "Error\nUnable to understand query", 32))
+	       elog_die(FATAL, "[5] bad query %d not an error: %s", i, 
+			cl.body[i]);
+     test_client_free(&cl);
+     if (tree_n(httpd_qcache) != 1)
+	  elog_die(FATAL, "[5] %d cached results, not 1", 
+		   tree_n(httpd_qcache));
 
      httpd_stop();
+     elog_printf(INFO, "all tests successfully completed");
      iiab_stop();
+     exit(0);
+}
+
+/* path callback giving a reply large enough to be chunked */
+char *test_big(char *path, int match, int method, TREE *headers_in, 
+	       char *data_in, int *length_out, TREE **headers_out, 
+	       time_t *modt_out) {
+     char *r;
+     int i;
+
+     r = xnmalloc(TEST_BIGSZ+1);
+     for (i=0; i<TEST_BIGSZ; i++)
+	  r[i] = 'a' + i % 26;
+     r[TEST_BIGSZ] = '\0';
+     *length_out = TEST_BIGSZ;
+     if (headers_out)
+	  *headers_out = NULL;
+     if (modt_out)
+	  *modt_out = time(NULL);
+     return r;
+}
+
+/* write a row with the value val to the ring */
+void test_ringwrite(ROUTE rt, char *val)
+{
+     TABLE tab;
+     char *cols[] = {"load1", NULL};
+
+     tab = table_create_a(cols);
+     table_addemptyrow(tab);
+     table_replacecurrentcell_alloc(tab, "load1", val);
+     if ( ! route_twrite(rt, tab) )
+	  elog_die(FATAL, "unable to write %s to ring", val);
+     table_destroy(tab);
+}
+
+/* 
+ * Run a client over loopback that sends send and reads nreplies, then
+ * sends then and reads one more on the same connection, while serving
+ * it from this thread. The most connections open at once is left in 
+ * test_maxconns.
+ */
+void test_exchange(struct test_client *cl, char *send, int nreplies, 
+		   char *then)
+{
+     pthread_t thread;
+
+     memset(cl, 0, sizeof(struct test_client));
+     cl->send     = send;
+     cl->nreplies = nreplies;
+     cl->then     = then;
+     test_maxconns = 0;
+     if (pthread_create(&thread, NULL, test_client_run, cl))
+	  elog_die(FATAL, "unable to start client thread");
+     while ( ! cl->done ) {
+	  meth_relay();
+	  if (itree_n(httpd_conns) > test_maxconns)
+	       test_maxconns = itree_n(httpd_conns);
+     }
+     pthread_join(thread, NULL);
+}
+
+/* client thread: statuses of replies that were not read are -1 */
+void *test_client_run(void *arg)
+{
+     struct test_client *cl = arg;
+     struct sockaddr_in sa;
+     int fd, i, n;
+
+     for (i=0; i<TEST_MAXREPLY; i++)
+	  cl->status[i] = -1;
+     fd = socket(AF_INET, SOCK_STREAM, 0);
+     memset(&sa, 0, sizeof(sa));
+     sa.sin_family = AF_INET;
+     sa.sin_port = htons(httpd_serve_port);
+     sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+     if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) == -1)
+	  goto client_ret;
+
+     n = cl->nreplies;
+     if (send(fd, cl->send, strlen(cl->send), 0) == -1)
+	  goto client_ret;
+     for (i=0; i<n; i++)
+	  if ( ! test_client_reply(cl, fd, i) )
+	       goto client_ret;
+     if (cl->then) {
+	  if (send(fd, cl->then, strlen(cl->then), 0) == -1)
+	       goto client_ret;
+	  test_client_reply(cl, fd, n);
+     }
+
+ client_ret:
+     cl->done = 1;		/* before close, which wakes the server */
+     close(fd);
+     return NULL;
+}
+
+/* read more of the reply into cl's buffer; returns 0 at end or error */
+int test_client_fill(struct test_client *cl, int fd)
+{
+     int r;
+
+     if (cl->len >= HTTPD_INMAX-1)
+	  return 0;
+     r = recv(fd, cl->buf + cl->len, HTTPD_INMAX-1 - cl->len, 0);
+     if (r <= 0)
+	  return 0;
+     cl->len += r;
+     cl->buf[cl->len] = '\0';
+     return 1;
+}
+
+/* 
+ * Read reply i, removing the chunk framing from its body.
+ * Returns 1 for success or 0 for failure.
+ */
+int test_client_reply(struct test_client *cl, int fd, int i)
+{
+     char *end, *val;
+     int hdrlen, len, body=0, chunk;
+
+     cl->buf[cl->len] = '\0';
+     while ( ! (end = strstr(cl->buf, "\r\n\r\n")) )
+	  if ( ! test_client_fill(cl, fd) )
+	       return 0;
+     hdrlen = end - cl->buf + 4;
+     *end = '\0';
+     if (sscanf(cl->buf, "HTTP/1.1 %d", &cl->status[i]) != 1)
+	  return 0;
+     cl->keepalive[i] = strstr(cl->buf, "Connection: keep-alive") != NULL;
+     cl->chunked[i]   = strstr(cl->buf, "Transfer-encoding: chunked")!=NULL;
+     len = 0;
+     if ( (val = strstr(cl->buf, "Content-length: ")) )
+	  len = strtol(val+16, NULL, 10);
+     memmove(cl->buf, cl->buf + hdrlen, cl->len - hdrlen + 1);
+     cl->len -= hdrlen;
+
+     if ( ! cl->chunked[i] ) {
+	  while (cl->len < len)
+	       if ( ! test_client_fill(cl, fd) )
+		    return 0;
+	  cl->body[i] = xnmemdup(cl->buf, len+1);
+	  cl->body[i][len] = '\0';
+	  memmove(cl->buf, cl->buf + len, cl->len - len + 1);
+	  cl->len -= len;
+	  return 1;
+     }
+
+     /* each chunk is a hex size line, the data and a line end; the
+      * body is gathered at the front of the buffer, ahead of the
+      * chunk being read */
+     while (1) {
+	  while ( ! (end = strstr(cl->buf + body, "\r\n")) )
+	       if ( ! test_client_fill(cl, fd) )
+		    return 0;
+	  chunk = strtol(cl->buf + body, NULL, 16);
+	  hdrlen = end - (cl->buf + body) + 2;
+	  while (cl->len < body + hdrlen + chunk + 2)
+	       if ( ! test_client_fill(cl, fd) )
+		    return 0;
+	  memmove(cl->buf + body, cl->buf + body + hdrlen, 
+		  cl->len - body - hdrlen + 1);
+	  cl->len -= hdrlen;
+	  body += chunk;
+	  memmove(cl->buf + body, cl->buf + body + 2, cl->len - body - 1);
+	  cl->len -= 2;
+	  if (chunk == 0)
+	       break;
+     }
+     cl->body[i] = xnmemdup(cl->buf, body+1);
+     cl->body[i][body] = '\0';
+     memmove(cl->buf, cl->buf + body, cl->len - body + 1);
+     cl->len -= body;
+
+     return 1;
+}
+
+/* free the reply bodies held by cl */
+void test_client_free(struct test_client *cl)
+{
+     int i;
+
+     for (i=0; i<TEST_MAXREPLY; i++)
+	  if (cl->body[i])
+	       nfree(cl->body[i]);
 }
 
 #endif /* TEST */
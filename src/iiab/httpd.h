@@ -1,7 +1,7 @@
 /*
  * HTTP class contains the server code necessary for to serve http
- * connections. All the code is single threaded and uses meth to handle
- * the central I/O select() statement.
+ * connections. Connections are non-blocking and driven from meth's
+ * relay, path callbacks run in a pool of worker threads.
  * Based on mini_httpd.c from Jef Poskanzer (jef@acme.com)
  *
  * Nigel Stuckey, January-February 2001
@@ -16,6 +16,7 @@
 #include <arpa/inet.h>
 #include <time.h>
 #include "tree.h"
+#include "table.h"
 
 /* A multi-family sockaddr. */
 typedef union {
@@ -29,21 +30,108 @@ typedef union {
 #endif /* HAVE_SOCKADDR_STORAGE */
 } httpd_usockaddr;
 
+/* a registered path */
+struct httpd_path {
+     char * (*cb)(char *, int, int, TREE *, char *, int *, TREE **, 
+		  time_t *);	/* callback to make the reply */
+     int   inmain;		/* 1 to run cb in the main loop, not a worker */
+};
+
+/* a client connection, only used by the main loop */
+struct httpd_conn {
+     int    fd;			/* connected socket */
+     int    state;		/* HTTPD_CONN_READ, _BUSY, _WRITE or _DEAD */
+     int    events;		/* HTTPD_EV_ events being watched */
+     int    http11;		/* 1 if the client speaks HTTP/1.1 */
+     int    keepalive;		/* 1 to read more requests after the reply */
+     int    eof;		/* 1 when the client has finished sending */
+     time_t last;		/* time of last activity */
+     char  *in;			/* input buffer, HTTPD_INMAX+1 bytes */
+     int    inlen;		/* bytes held in in */
+     char  *out;		/* headers or chunk framing, HTTPD_OUTMAX bytes */
+     int    outlen;		/* bytes held in out */
+     int    outoff;		/* bytes of out sent */
+     char  *body;		/* nmalloc()ed reply body or NULL */
+     int    bodylen;		/* length of body */
+     int    bodyoff;		/* bytes of body sent or framed */
+     int    chunked;		/* 1 if body is sent in chunks */
+};
+
+/* a request, passed to the worker pool and back */
+struct httpd_job {
+     struct httpd_conn *conn;	/* connection to reply on */
+     char * (*cb)(char *, int, int, TREE *, char *, int *, TREE **, 
+		  time_t *);	/* callback to run */
+     char  *request;		/* nmalloc()ed headers, holding path and 
+				 * the strings of headers */
+     char  *path;		/* requested path */
+     int    match;		/* length of path matched */
+     int    method;		/* HTTPD_METHOD_ */
+     TREE  *headers;		/* request headers */
+     char  *data;		/* nmalloc()ed request body */
+     char  *result;		/* nmalloc()ed reply from cb */
+     int    rlen;		/* length of result */
+     TREE  *rheaders;		/* reply headers from cb */
+     time_t modt;		/* modification time from cb */
+     struct httpd_job *next;	/* next in queue */
+};
+
+/* A query reducing /local data, pointing into the query text */
+struct httpd_query {
+     int    step;		/* aggregation period in secs or 0 for all */
+     int    fn;			/* enum cascade_fn or -1 for none */
+     char  *cols;		/* space separated columns or NULL for all */
+     char  *key;		/* key value to choose or NULL for all */
+};
+
+/* A reduced /local result, good while the ring's youngest is the same */
+struct httpd_qcache_ent {
+     char  *key;		/* nmalloc()ed route and query */
+     int    seq;		/* youngest sequence when made */
+     time_t youngest;		/* time of youngest sequence */
+     char  *result;		/* nmalloc()ed formatted result */
+     unsigned long used;	/* httpd_qtick when last used */
+};
+
 void httpd_init();
 void httpd_fini();
 void httpd_addpath(char *path, char * (*cb)(char *, int, int, TREE *, char *,
 					    int *, TREE **, time_t *));
+void httpd_addpath_inline(char *path, char * (*cb)(char *, int, int, TREE *,
+						   char *, int *, TREE **,
+						   time_t *));
+void httpd_priv_addpath(char *path, char * (*cb)(char *, int, int, TREE *,
+						 char *, int *, TREE **,
+						 time_t *), int inmain);
 void httpd_rmpath(char *path);
 int  httpd_start();
 void httpd_stop();
-void httpd_accept(void *fd);
-int  httpd_request_scan(int fd, char *request, char **path, TREE **headers);
-void httpd_response_evaluate(int fd, int method, char *path, TREE *headers, 
-			     char *data);
+void httpd_relay(void *fd);
+void httpd_accept(int fd);
+void httpd_conn_watch(struct httpd_conn *c, int events);
+void httpd_watch(int fd, int events, int add);
+void httpd_conn_close(struct httpd_conn *c);
+void httpd_conn_read(struct httpd_conn *c);
+void httpd_conn_serve(struct httpd_conn *c);
+int  httpd_conn_write(struct httpd_conn *c);
+int  httpd_conn_next(struct httpd_conn *c);
+void httpd_conn_consume(struct httpd_conn *c, int n);
+void httpd_job_run(struct httpd_job *j);
+void httpd_job_reply(struct httpd_job *j);
+void httpd_job_free(struct httpd_job *j);
+void httpd_sweep();
+int  httpd_threadstart();
+void httpd_threadstop();
+void *httpd_thread(void *unused);
+void httpd_done();
+int  httpd_request_scan(struct httpd_conn *c, char *request, char **path, 
+			TREE **headers);
+char *httpd_header_find(TREE *headers, char *name);
 char *httpd_status_title(int status);
-void httpd_error_send(int fd, int errnum, char *text);
-int  httpd_header_send(int fd, TREE *headers, int user_status, char *mime_type, 
-		       int content_length, time_t last_modified);
+void httpd_error_send(struct httpd_conn *c, int errnum, char *text);
+int  httpd_header_send(struct httpd_conn *c, TREE *headers, int user_status, 
+		       char *mime_type, int content_length, 
+		       time_t last_modified);
 int  httpd_lookup_if(httpd_usockaddr* usa4P, size_t sa4_len, int* gotv4P,
 		     httpd_usockaddr* usa6P, size_t sa6_len, int* gotv6P);
 size_t httpd_sockaddr_len(httpd_usockaddr* usaP);
@@ -63,15 +151,40 @@ char *httpd_builtin_info(char *path, int match, int method, TREE *headers_in,
 char *httpd_builtin_local(char *path, int match, int method, TREE *headers_in, 
 			 char *data_in, int *length_out, TREE **headers_out, 
 			 time_t *modt_out);
+char *httpd_builtin_nmalloc(char *path, int match, int method, 
+			    TREE *headers_in, char *data_in, int *length_out, 
+			    TREE **headers_out, time_t *modt_out);
+int   httpd_query_scan(char *text, struct httpd_query *q);
+char *httpd_query_eval(TABLE t, struct httpd_query *q, int tsv);
+void  httpd_query_period(TABLE agg, TABLE period, struct httpd_query *q, 
+			 time_t start);
+char *httpd_qcache_get(char *key, int seq, time_t youngest);
+void  httpd_qcache_put(char *key, int seq, time_t youngest, char *result);
 
 #define HTTPD_CF_DISABLE "httpd.disable"
 #define HTTPD_CF_INTERFACE "httpd.interface"
 #define HTTPD_CF_PORT "httpd.port"
+#define HTTPD_CF_THREADS "httpd.threads"
 #define HTTPD_PORT_HTTP 8096
 #define HTTPD_PORT_HTTPS 8097
 #define HTTPD_PORT_HTTP_STR "8096"
 #define HTTPD_PORT_HTTPS_STR "8097"
-#define HTTPD_CB_ACCEPT "httpd_server_accept"
+#define HTTPD_CB_EVENT "httpd_server_event"
+#define HTTPD_CB_DONE "httpd_server_done"
+#define HTTPD_THREADS 2		/* default size of the worker pool */
+#define HTTPD_INMAX 65536	/* largest request, headers and body */
+#define HTTPD_CHUNKSZ 16384	/* replies larger than this are chunked */
+#define HTTPD_OUTMAX (HTTPD_CHUNKSZ+32)	/* headers or a framed chunk */
+#define HTTPD_MAXCONN 256	/* most connections open at once */
+#define HTTPD_IDLESEC 30	/* idle connections closed after this */
+#define HTTPD_MAXEVENTS 64	/* events taken from epoll at once */
+#define HTTPD_QCACHEMAX 64	/* reduced /local results cached */
+#define HTTPD_EV_IN  1
+#define HTTPD_EV_OUT 2
+#define HTTPD_CONN_READ  0	/* waiting for a request */
+#define HTTPD_CONN_BUSY  1	/* request being run by a worker */
+#define HTTPD_CONN_WRITE 2	/* sending a reply */
+#define HTTPD_CONN_DEAD  3	/* busy, but to close when the worker ends */
 #define HTTPD_METHOD_FAIL -1
 #define HTTPD_METHOD_GET   1
 #define HTTPD_METHOD_POST  2
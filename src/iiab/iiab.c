@@ -31,6 +31,7 @@
 #include "httpd.h"
 #include "sig.h"
 #include "rt_none.h"
+#include "rt_mem.h"
 #include "rt_file.h"
 #include "rt_std.h"
 #include "rt_http.h"
@@ -153,6 +154,11 @@ void iiab_start(char *opts,	/* Command line option string as getopts(3) */
      if ( !cf_defined(iiab_cf, NM_CFNAME) ||
 	  cf_getint(iiab_cf, NM_CFNAME) == 0 )
 	  nm_deactivate();
+#if NMSAMPLE
+     /* sampling profiler: mean bytes between samples or 0 to turn off */
+     if (cf_defined(iiab_cf, NM_CFSAMPLE))
+	  nm_sample_setmean(cf_getint(iiab_cf, NM_CFSAMPLE));
+#endif
 
      /* command line switches (excluding -c and -C) */
 
@@ -301,6 +307,7 @@ void iiab_daemonise()
 void iiab_init_routes() {
      route_init(iiab_cf, 0);
      route_register(&rt_none_method);
+     route_register(&rt_mem_method);
      route_register(&rt_filea_method);
      route_register(&rt_fileov_method);
      route_register(&rt_stdin_method);
@@ -537,7 +544,7 @@ void iiab_cf_load(CF_VALS cf,		/* destination config */
  */
 char *iiab_getbinpath(char *argv0)
 {
-     char swd[PATH_MAX], cwd[PATH_MAX], *path, *binpath, *dir;
+     char swd[PATH_MAX], cwd[PATH_MAX], *path, *binpath, *dir, *tokpos;
      struct stat statbuf;
      int len;
 
@@ -573,7 +580,7 @@ char *iiab_getbinpath(char *argv0)
 	   * in any dir in $PATH */
           getcwd(cwd, PATH_MAX);
 	  path = xnstrdup(getenv("PATH"));
-	  dir = strtok(path, ":");
+	  dir = strtok_r(path, ":", &tokpos);
 	  while (dir) {
 	       if (dir[0] == '/') {
 		    binpath = util_strjoin( dir, "/", argv0, NULL );
@@ -594,7 +601,7 @@ char *iiab_getbinpath(char *argv0)
 		    }
 	       }
 	       nfree(binpath);
-	       dir = strtok(NULL, ":");
+	       dir = strtok_r(NULL, ":", &tokpos);
 	  }
 	  nfree(path);
 
@@ -29,8 +29,7 @@ ITREE *itree_really_create(char *rfile, int rline, const char *rfunc) {
 	 * ITREE top level allocation as a first class object, showing 
 	 * the actuall caller */
 	t = malloc(sizeof(ITREE));
-	if (nm_active)
-	     nm_add(NM_ITREE, t, sizeof(ITREE), rfile, rline, rfunc);
+	nm_track(NM_ITREE, t, sizeof(ITREE), rfile, rline, rfunc);
 
 	t->node = t->root = make_rb();
 	if (t->node)
@@ -52,8 +51,7 @@ void itree_really_destroy(ITREE *t, char *rfile, int rline, const char *rfunc) {
 	rb_free_tree(t->root);
 
 	/* free from special tracking */
-	if (nm_active)
-	     nm_rm(NM_ITREE, t, rfile, rline, rfunc);
+	nm_untrack(NM_ITREE, t, rfile, rline, rfunc);
 	free(t);
 }
 
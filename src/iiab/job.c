@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include "nmalloc.h"
 #include "itree.h"
 #include "runq.h"
@@ -92,11 +93,43 @@ int job_add(long start,		/* time job should start following
 	    int keep, 		/* keep most recent number of datum */
 	    char *method,	/* String representation of method */
 	    char *command	/* Command for method */ )
+{
+     struct timespec intervalt;
+
+     intervalt.tv_sec  = interval;
+     intervalt.tv_nsec = 0;
+
+     return job_addt(start, &intervalt, RUNQ_SKIP, phase, count, key, 
+		     origin, result, error, keep, method, command);
+}
+
+
+/*
+ * As job_add(), but with the interval given to the nanosecond, so that 
+ * jobs may run more often than once a second, and with the runq policy
+ * for times that are missed when a run overruns.
+ * Returns as job_add().
+ */
+int job_addt(long start,	/* time job should start following 
+				 * job_init() (may be negative) */
+	     struct timespec *interval,	/* time in between jobs */
+	     enum runq_policy policy,	/* RUNQ_SKIP or RUNQ_CATCHUP */
+	     long phase,	/* execution order at each time point */
+	     long count,	/* number of times to run job or 0 to
+				 * repeat indefinately */
+	     char *key, 	/* job identification string */
+	     char *origin, 	/* origin of job */
+	     char *result, 	/* route for results (p-url spec) */
+	     char *error, 	/* route for errors (p-url spec) */
+	     int keep, 		/* keep most recent number of datum */
+	     char *method,	/* String representation of method */
+	     char *command	/* Command for method */ )
 {
      struct job_work *work;
      int r, klen, clen, rlen, elen;
      METHID meth;
      struct meth_invoke *runarg;
+     struct timespec startt;
      char *mem;
 
      /* The job class does its stuff by calling meth_run() at times 
@@ -135,14 +168,18 @@ int job_add(long start,		/* time job should start following
      runarg->keep = keep;
 
      /* Debug the call */
-     elog_printf(DEBUG, "job added: %d %d %d %d %s %s %s %s %d %8s %s", 
-		 start, interval, phase, count, key, origin, result, error, 
-		 keep, method, command);
+     elog_printf(DEBUG, "job added: %ld %ld.%09ld%s %ld %ld %s %s %s %s "
+		 "%d %8s %s", start, (long) interval->tv_sec, 
+		 interval->tv_nsec, policy == RUNQ_CATCHUP ? "+" : "", 
+		 phase, count, key, origin, result, error, keep, method, 
+		 command);
 
      /* Add the work */
-     r = runq_add(job_start_t+start, interval, phase, count, key, 
-		  meth_startrun_s, meth_execute_s, meth_isrunning_s, 
-		  meth_endrun_s, runarg, sizeof(struct meth_invoke));
+     startt.tv_sec  = job_start_t+start;
+     startt.tv_nsec = 0;
+     r = runq_addt(&startt, interval, phase, count, key, 
+		   meth_startrun_s, meth_execute_s, meth_isrunning_s, 
+		   meth_endrun_s, runarg, sizeof(struct meth_invoke));
      if (r == -1 || r == -2) {
 	  if (r == -1) {
 	       elog_printf(ERROR, "bad parameter in job %s", key);
@@ -150,6 +187,7 @@ int job_add(long start,		/* time job should start following
 	  } else
 	       return -2;
      }
+     runq_setpolicy(r, policy);
 
      /* Save the information for ourselves */
      work = xnmalloc(sizeof(struct job_work));
@@ -252,6 +290,45 @@ void job_runqexpired(void *ikey)
 
 
 
+/*
+ * Parse a job interval of the form <secs>[.<fraction>][+] into interval,
+ * so that jobs may be scheduled at intervals of less than a second, 
+ * such as 0.25. The fraction is taken to nanosecond precision. A 
+ * trailing '+' sets policy to RUNQ_CATCHUP, so that runs missed because
+ * an earlier one overran are made up in turn; otherwise it is RUNQ_SKIP.
+ * Returns 1 if the text was valid or 0 otherwise.
+ */
+int job_parseinterval(char *text, 		/* interval text */
+		      struct timespec *interval,/* returned interval */
+		      enum runq_policy *policy	/* returned policy */ )
+{
+     char *pt;
+     long secs, nsecs, unit;
+
+     secs = strtol(text, &pt, 10);
+     if (pt == text || secs < 0 || secs == LONG_MAX)
+	  return 0;
+
+     nsecs = 0;
+     if (*pt == '.') {
+	  for (pt++, unit = RUNQ_NSEC/10; isdigit((int) *pt); pt++, unit /= 10)
+	       nsecs += (*pt - '0') * unit;
+     }
+
+     *policy = RUNQ_SKIP;
+     if (*pt == '+') {
+	  *policy = RUNQ_CATCHUP;
+	  pt++;
+     }
+     if (*pt != '\0')
+	  return 0;
+
+     interval->tv_sec  = secs;
+     interval->tv_nsec = nsecs;
+     return 1;
+}
+
+
 /*
  * Read in job definitions from the pseudo-url and add them to the
  * job class. If there is a problem with a job definition, it will not
@@ -260,7 +337,9 @@ void job_runqexpired(void *ikey)
  * File format: one line per job. magic string of 'job 1' at top
  * Fields/columns match the job_add() spec and are:
  * 1. start time (seconds)
- * 2. interval (currently seconds, but ought to have weekly or monthly based
+ * 2. interval (seconds, which may be fractional down to nanoseconds; 
+ *    append '+' to catch up runs missed by an overrun, see 
+ *    job_parseinterval(). Ought to have weekly or monthly based
  *    intervals as well)
  * 3. phase (int; job order at each scheduled point)
  * 4. count (int; how many times to run; 0=indefinately)
@@ -281,7 +360,9 @@ void job_runqexpired(void *ikey)
  */
 int job_loadroute(char *purl 	/* p-url location of file */ )
 {
-     long start, interval, phase, count, keep;
+     long start, phase, count, keep;
+     struct timespec interval;
+     enum runq_policy policy;
      char *key, *origin, *result, *error, *method, *command;
      char *endint;
      ITREE *jobdefs, *job;
@@ -325,9 +406,7 @@ int job_loadroute(char *purl 	/* p-url location of file */ )
 
 	  /* column 2: interval */
 	  itree_find(job, 1);
-	  interval = strtol( itree_get(job), &endint, 10 );
-	  if (interval == LONG_MIN || interval == LONG_MAX ||
-	      itree_get(job) == endint) {
+	  if ( ! job_parseinterval(itree_get(job), &interval, &policy) ) {
 	       elog_printf(ERROR, "%s row %d interval (column 2) is "
 			   "incorrect: '%s'; skipping", 
 			   purl, itree_getkey(jobdefs), itree_get(job));
@@ -359,7 +438,7 @@ int job_loadroute(char *purl 	/* p-url location of file */ )
 	  /* column 5: key */
 	  itree_find(job, 4);
 	  key = itree_get(job);
-	  if (route_expand(key_t, key, key, interval) != -1)
+	  if (route_expand(key_t, key, key, interval.tv_sec) != -1)
 	       key = key_t;
 
 	  /* column 6: origin  */
@@ -369,13 +448,13 @@ int job_loadroute(char *purl 	/* p-url location of file */ )
 	  /* column 7: result  */
 	  itree_find(job, 6);
 	  result = itree_get(job);
-	  if (route_expand(result_t, result, key, interval) != -1)
+	  if (route_expand(result_t, result, key, interval.tv_sec) != -1)
 	       result = result_t;
 
 	  /* column 8: error  */
 	  itree_find(job, 7);
 	  error = itree_get(job);
-	  if (route_expand(error_t, error, key, interval) != -1)
+	  if (route_expand(error_t, error, key, interval.tv_sec) != -1)
 	       error = error_t;
 
 	  /* column 9: keep */
@@ -396,14 +475,16 @@ int job_loadroute(char *purl 	/* p-url location of file */ )
 	  /* column 11: command  */
 	  itree_find(job, 10);
 	  command = itree_get(job);
-	  if (route_expand(command_t, command, key, interval) != -1)
+	  if (route_expand(command_t, command, key, interval.tv_sec) != -1)
 	       command = command_t;
 
-	  elog_printf(DEBUG, "%s row %d read: start=%ld interval=%ld phase=%ld "
-		      "count=%ld key=%s origin=%s result=%s error=%s keep=%ld "
-		      "method=%s command=%s", purl, itree_getkey(jobdefs), 
-		      start, interval, phase, count, key, origin, result, 
-		      error, keep, method, command);
+	  elog_printf(DEBUG, "%s row %d read: start=%ld interval=%ld.%09ld%s "
+		      "phase=%ld count=%ld key=%s origin=%s result=%s "
+		      "error=%s keep=%ld method=%s command=%s", purl, 
+		      itree_getkey(jobdefs), start, (long) interval.tv_sec, 
+		      interval.tv_nsec, policy == RUNQ_CATCHUP ? "+" : "", 
+		      phase, count, key, origin, result, error, keep, method, 
+		      command);
 
 	  if (meth_check(method)) {
 	       elog_printf(ERROR, "%s row %d method %s not loaded; skipping",
@@ -412,8 +493,8 @@ int job_loadroute(char *purl 	/* p-url location of file */ )
 	  }
 
 	  /* insert into job class */
-	  r = job_add(start, interval, phase, count, key, origin, result, 
-		      error, keep, method, command);
+	  r = job_addt(start, &interval, policy, phase, count, key, origin, 
+		       result, error, keep, method, command);
 	  if (r == -1)
 	       elog_printf(ERROR, "%s row %d unable to add job; skipping",
 			   purl, itree_getkey(jobdefs));
@@ -467,12 +548,14 @@ TABLE job_scanintotable(char *jobtext)
 #include "rt_std.h"
 
 extern ITREE *runq_tab;
-extern ITREE *runq_event;
 
 char tmsg1[] = "echo \"hello, world\n\"";
 
 int main(int argc, char **argv) {
      time_t now;
+     int ev;
+     struct timespec interval;
+     enum runq_policy policy;
 
      /* Initialise route, runq and job classes */
      now = time(NULL);
@@ -505,15 +588,14 @@ int main(int argc, char **argv) {
 	  elog_die(FATAL, "[1a] Can't add\n");
      }
 				/* Attention: some white box testing */
-     itree_first(runq_event);
-     if (itree_getkey(runq_event) != now+5) {
+     if (runq_duesec(runq_getevent(0)) != now+5) {
 	  elog_die(FATAL, "[1a] Queued at an incorrect time\n");
      }
      job_clear();
-     if (!itree_empty(runq_event) || !itree_empty(runq_tab)) {
+     if (runq_nevent() || !itree_empty(runq_tab)) {
 	  elog_die(FATAL, 
 		  "[1a] Trees not emptied. runq_events=%d, runq_tab=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab));
+		  runq_nevent(), itree_n(runq_tab));
      }
      now = time(NULL);
      
@@ -528,19 +610,17 @@ int main(int argc, char **argv) {
      {
 	  elog_die(FATAL, "[1b] Can't add second\n");
      }
-     itree_first(runq_event);
-     if (itree_getkey(runq_event) != now+5) {
+     if (runq_duesec(runq_getevent(0)) != now+5) {
 	  elog_die(FATAL, "[1b] First queued at an incorrect time\n");
      }
-     itree_next(runq_event);
-     if (itree_getkey(runq_event) != now+5) {
+     if (runq_duesec(runq_getevent(1)) != now+5) {
 	  elog_die(FATAL, "[1b] Second queued at an incorrect time\n");
      }
      job_clear();
-     if (!itree_empty(runq_event) || !itree_empty(runq_tab)) {
+     if (runq_nevent() || !itree_empty(runq_tab)) {
 	  elog_die(FATAL, 
 		  "[1b] Trees not emptied. runq_events=%d, runq_tab=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab));
+		  runq_nevent(), itree_n(runq_tab));
      }
      now = time(NULL);
 
@@ -550,24 +630,22 @@ int main(int argc, char **argv) {
      {
 	  elog_die(FATAL, "[1c] Can't add first\n");
      }
-     if (job_add(now+5, 5, 0, 1, "test1c2", "internal_test", "stdout",
+     if (job_add(5, 5, 0, 1, "test1c2", "internal_test", "stdout",
 		  "stderr", 100, "exec", "echo \"Hello, world\"") == -1)
      {
 	  elog_die(FATAL, "[1c] Can't add second\n");
      }
-     itree_first(runq_event);
-     if (itree_getkey(runq_event) != now+5) {
+     if (runq_duesec(runq_getevent(0)) != now+5) {
 	  elog_die(FATAL, "[1c] First queued at an incorrect time\n");
      }
-     itree_next(runq_event);
-     if (itree_getkey(runq_event) != now+6) {
+     if (runq_duesec(runq_getevent(1)) != now+6) {
 	  elog_die(FATAL, "[1c] Second queued at an incorrect time\n");
      }
      job_clear();
-     if (!itree_empty(runq_event) || !itree_empty(runq_tab)) {
+     if (runq_nevent() || !itree_empty(runq_tab)) {
 	  elog_die(FATAL, 
 		  "[1c] Trees not emptied. runq_events=%d, runq_tab=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab));
+		  runq_nevent(), itree_n(runq_tab));
      }
      now = time(NULL);
      
@@ -578,17 +656,16 @@ int main(int argc, char **argv) {
      {
 	  elog_die(FATAL, "[1d] Can't add\n");
      }
-     itree_first(runq_event);
-     if (itree_getkey(runq_event) != now+3) {
+     if (runq_duesec(runq_getevent(0)) != now+3) {
 	  elog_die(FATAL, 
-		  "[1d] Event queued at an incorrect time: bad=%d good=%ld\n", 
-		  itree_getkey(runq_event), now+3);
+		  "[1d] Event queued at an incorrect time: bad=%ld good=%ld\n", 
+		  (long) runq_duesec(runq_getevent(0)), now+3);
      }
      job_clear();
      if (runq_nsched() > 0) {
 	  elog_die(FATAL, "[1d] Still active work scheduled. runq_events=%d, "
 		  "runq_tab=%d runq_nsched()=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab), runq_nsched());
+		  runq_nevent(), itree_n(runq_tab), runq_nsched());
 	  runq_dump();
      }
      now = time(NULL);
@@ -605,23 +682,23 @@ int main(int argc, char **argv) {
      {
 	  elog_die(FATAL, "[1e] Can't add second\n");
      }
-     itree_first(runq_event);
-     while (((struct runq_work*) itree_get(runq_event))->expired)
-	  itree_next(runq_event);
-     if (itree_getkey(runq_event) != now+2) {
+     ev = 0;
+     while (runq_getevent(ev)->expired)
+	  ev++;
+     if (runq_duesec(runq_getevent(ev)) != now+2) {
 	  elog_die(FATAL, "[1e] First queued at an incorrect time\n");
      }
-     itree_next(runq_event);
-     while (((struct runq_work*) itree_get(runq_event))->expired)
-	  itree_next(runq_event);
-     if (itree_getkey(runq_event) != now+4) {
+     ev++;
+     while (runq_getevent(ev)->expired)
+	  ev++;
+     if (runq_duesec(runq_getevent(ev)) != now+4) {
 	  elog_die(FATAL, "[1e] Second queued at an incorrect time\n");
      }
      job_clear();
      if (runq_nsched() > 0) {
 	  elog_die(FATAL, "[1e] Still active work scheduled. runq_events=%d, "
 		  "runq_tab=%d runq_nsched()=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab), runq_nsched());
+		  runq_nevent(), itree_n(runq_tab), runq_nsched());
 	  runq_dump();
      }
      now = time(NULL);
@@ -639,23 +716,23 @@ int main(int argc, char **argv) {
 	  elog_die(FATAL, "[1f] Can't add second\n");
      }
 
-     itree_first(runq_event);
-     while (((struct runq_work*) itree_get(runq_event))->expired)
-	  itree_next(runq_event);
-     if (itree_getkey(runq_event) != now+2) {
+     ev = 0;
+     while (runq_getevent(ev)->expired)
+	  ev++;
+     if (runq_duesec(runq_getevent(ev)) != now+2) {
 	  elog_die(FATAL, "[1f] First queued at an incorrect time\n");
      }
-     itree_next(runq_event);
-     while (((struct runq_work*) itree_get(runq_event))->expired)
-	  itree_next(runq_event);
-     if (itree_getkey(runq_event) != now+5) {
+     ev++;
+     while (runq_getevent(ev)->expired)
+	  ev++;
+     if (runq_duesec(runq_getevent(ev)) != now+5) {
 	  elog_die(FATAL, "[1f] Second queued at an incorrect time\n");
      }
      job_clear();
      if (runq_nsched() > 0) {
 	  elog_die(FATAL, "[1f] Still active work scheduled. runq_events=%d, "
 		  "runq_tab=%d runq_nsched()=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab), runq_nsched());
+		  runq_nevent(), itree_n(runq_tab), runq_nsched());
 	  runq_dump();
      }
      now = time(NULL);
@@ -675,22 +752,25 @@ int main(int argc, char **argv) {
      if (runq_nsched() > 0) {
 	  elog_die(FATAL, "[1g] Still active work scheduled. runq_events=%d, "
 		  "runq_tab=%d runq_nsched()=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab), runq_nsched());
+		  runq_nevent(), itree_n(runq_tab), runq_nsched());
 	  runq_dump();
      }
      job_clear();
      now = time(NULL);
 
      /* Two five run tests, starting at different times in the past,
-      * five runs each wittth different periods; they should both
-      * run now */
-     if (job_add(-24, 6, 0, 5, "test1h1", "internal_test", "stdout",
-		  "stderr", 100, "exec", "echo \"Hello, world\"") == -1)
+      * five runs each wittth different periods; their last runs are 
+      * due in a second (times are in nanoseconds, so a run due at the
+      * start of this second has already passed) */
+     if (job_add(now-job_start_t-23, 6, 0, 5, "test1h1", "internal_test", 
+		 "stdout", "stderr", 100, "exec", "echo \"Hello, world\"") 
+	 == -1)
      {
 	  elog_die(FATAL, "[1h] Can't add first\n");
      }
-     if (job_add(-20, 5, 0, 5, "test1h2", "internal_test", "stdout",
-		  "stderr", 100, "exec", "echo \"Hello, world\"") == -1)
+     if (job_add(now-job_start_t-19, 5, 0, 5, "test1h2", "internal_test", 
+		 "stdout", "stderr", 100, "exec", "echo \"Hello, world\"") 
+	 == -1)
      {
 	  elog_die(FATAL, "[1h] Can't add second\n");
      }
@@ -708,18 +788,57 @@ int main(int argc, char **argv) {
      if (runq_nsched() > 0) {
 	  elog_die(FATAL, "[1h] Still active work scheduled. runq_events=%d, "
 		  "runq_tab=%d runq_nsched()=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab), runq_nsched());
+		  runq_nevent(), itree_n(runq_tab), runq_nsched());
 	  runq_dump();
      }
 
      job_clear();
+     now = time(NULL);
+
+     /* Interval column: whole and fractional seconds, catch up suffix */
+     if ( ! job_parseinterval("60", &interval, &policy) ||
+	  interval.tv_sec != 60 || interval.tv_nsec != 0 || 
+	  policy != RUNQ_SKIP) {
+	  elog_die(FATAL, "[2a] Whole interval parsed incorrectly\n");
+     }
+     if ( ! job_parseinterval("0.25+", &interval, &policy) ||
+	  interval.tv_sec != 0 || interval.tv_nsec != RUNQ_NSEC/4 || 
+	  policy != RUNQ_CATCHUP) {
+	  elog_die(FATAL, "[2a] Fractional interval parsed incorrectly\n");
+     }
+     if ( ! job_parseinterval("1.5", &interval, &policy) ||
+	  interval.tv_sec != 1 || interval.tv_nsec != RUNQ_NSEC/2 ||
+	  policy != RUNQ_SKIP) {
+	  elog_die(FATAL, "[2a] Mixed interval parsed incorrectly\n");
+     }
+     if (job_parseinterval("x", &interval, &policy) ||
+	 job_parseinterval("-1", &interval, &policy) ||
+	 job_parseinterval("0.1x", &interval, &policy)) {
+	  elog_die(FATAL, "[2a] Bad intervals should not parse\n");
+     }
+
+     /* A job every 250ms that catches up, starting in five seconds; 
+      * never to run */
+     job_parseinterval("0.25+", &interval, &policy);
+     if (job_addt(5, &interval, policy, 0, 0, "test2b", "internal_test", 
+		  "stdout", "stderr", 100, "exec", 
+		  "echo \"Hello, world\"") == -1)
+     {
+	  elog_die(FATAL, "[2b] Can't add\n");
+     }
+     if (runq_getevent(0)->due != (job_start_t+5) * RUNQ_NSEC ||
+	 runq_getevent(0)->intervalns != RUNQ_NSEC/4 ||
+	 runq_getevent(0)->policy != RUNQ_CATCHUP) {
+	  elog_die(FATAL, "[2b] Queued incorrectly\n");
+     }
+     job_clear();
 
 #if 0
      /* check all tables/lists are empty */
-     if (!itree_empty(runq_event) || !itree_empty(runq_tab)) {
+     if (runq_nevent() || !itree_empty(runq_tab)) {
 	  elog_die(FATAL, "[1i] Still entries in tables. runq_events=%d, "
 		  "runq_tab=%d runq_nsched()=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab), runq_nsched());
+		  runq_nevent(), itree_n(runq_tab), runq_nsched());
 	  runq_dump();
      }
 #endif
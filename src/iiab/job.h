@@ -12,6 +12,7 @@
 
 #include <time.h>
 #include "meth.h"
+#include "runq.h"
 #include "table.h"
 
 #define JOB_TMPBUF 100
@@ -29,9 +30,15 @@ void  job_dump();
 int   job_add(long start, long interval, long phase, long count, 
 	      char *key, char *origin, char *result, char *error, 
 	      int keep, char *method, char *command);
+int   job_addt(long start, struct timespec *interval, 
+	       enum runq_policy policy, long phase, long count, 
+	       char *key, char *origin, char *result, char *error, 
+	       int keep, char *method, char *command);
 int   job_rm(int ikey);
 void  job_clear();
 void  job_runqexpired(void *ikey);
+int   job_parseinterval(char *text, struct timespec *interval, 
+			enum runq_policy *policy);
 int   job_loadroute(char *purl);
 TABLE job_scanintotable(char *jobtext);
 
@@ -39,8 +39,20 @@
  * user supplied key.
  *
  * Once jobs have been set up, meth_relay() should be used to implement
- * non native i/o, specifically the timestore route. It implements
- * select() and should be used during idle times.
+ * non native i/o, specifically the timestore route. It waits on the
+ * jobs' pipes and any callback descriptors and should be used during 
+ * idle times. On Linux, descriptors are kept in a persistent epoll set,
+ * so there is no limit on their number and the cost of waiting does not
+ * grow with the number of jobs; elsewhere select() is used.
+ *
+ * Methods of type METH_THREAD, and those switched to it with 
+ * meth_settype(), run their action() in a bounded pool of threads, 
+ * started when first needed (meth_setthreads() sets its size). Their
+ * output is held in memory routes (rt_mem.c) and replayed to the job's
+ * routes by meth_threaddone() in the main loop, which then raises
+ * METH_CB_FINISHED just as meth_exitchildren() does for processes.
+ * A threaded action must only share state with other code under locks;
+ * routes, callbacks and elog are already safe to use.
  *
  * The caller may know that an individual method run is part of series, in
  * which case I/O efficiency can be increased by keeping the I/O channels 
@@ -64,6 +76,11 @@
 #include <limits.h>
 #include <errno.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#if linux
+#include <sys/epoll.h>
+#endif
 #include "nmalloc.h"
 #include "sig.h"
 #include "itree.h"
@@ -72,6 +89,7 @@
 #include "meth.h"
 #include "meth_b.h"
 #include "callback.h"
+#include "rt_mem.h"
 
 TREE    *meth_methods;	/* loaded methods; tree of meth_info index by name */
 TREE    *meth_rsetbykey;/* open routes indexed by work key */
@@ -80,12 +98,31 @@ ITREE   *meth_procbypid;/* running method processes;
 ITREE   *meth_exitbypid;/* exited processes; tree of pids (in key) populated
 			 * by meth_sigchild() and consumed by meth_child() */
 ITREE   *meth_cbbyfd;	/* callback by file descriptor */
+ITREE   *meth_procbyfd;	/* running method processes indexed by their 
+			 * result and error pipes */
+int      meth_epfd;	/* epoll set of relayed descriptors (linux) */
 int   meth_restartselect; /* set by meth_child() for meth_relay() to restart
 			   * its select() as the results may not be correct */
 int      meth_argc;	  /* saved argc used by restart method */
 char   **meth_argv;	  /* saved argv used by restart method */
 void *meth_shutdown_func; /* shutdown function used by restart and shutdown
 			   * built-in methods */
+TREE    *meth_typebyname; /* execution types overridden by meth_settype() */
+int      meth_nthreads;	  /* size of the thread pool */
+pthread_t *meth_threads;  /* running pool of threads or NULL */
+pthread_mutex_t meth_thrlock = PTHREAD_MUTEX_INITIALIZER; /* guards below */
+pthread_cond_t  meth_thrcond = PTHREAD_COND_INITIALIZER;  /* queue signal */
+struct meth_runthrinfo *meth_thrqueue, *meth_thrqueuelast; /* waiting jobs */
+struct meth_runthrinfo *meth_thrdone, *meth_thrdonelast; /* finished jobs */
+int      meth_thrstop;	  /* flag for threads to exit */
+int      meth_thrpipe[2]; /* written by threads to wake meth_relay() */
+TREE    *meth_coprocbykey;/* running co-processes; tree of meth_runprocinfo
+			   * indexed by job key, which is owned by the 
+			   * meth_runprocinfo */
+
+/* private functional prototypes */
+void meth_priv_coprocwrite(struct meth_runprocinfo *rp, 
+			   struct meth_runset *rset, int len, int used);
 
 /* Initialise method structures
  * Arguments are argc and argv to recreate the process on restart and
@@ -106,10 +143,25 @@ void meth_init(int argc, char *argv[],		/* used for restart built-in */
      meth_procbypid     = itree_create();
      meth_exitbypid     = itree_create();
      meth_cbbyfd        = itree_create();
+     meth_procbyfd      = itree_create();
      meth_restartselect = 0;
      meth_shutdown_func = this_shutdown_func;
      meth_argc          = argc;
      meth_argv          = argv;
+     meth_typebyname    = tree_create();
+     meth_nthreads      = METH_THREADS;
+     meth_threads       = NULL;
+     meth_thrqueue      = meth_thrqueuelast = NULL;
+     meth_thrdone       = meth_thrdonelast  = NULL;
+     meth_thrstop       = 0;
+     meth_thrpipe[0]    = meth_thrpipe[1]   = -1;
+     meth_coprocbykey   = tree_create();
+#if linux
+     meth_epfd          = epoll_create1(EPOLL_CLOEXEC);
+     if (meth_epfd == -1)
+	  elog_die(FATAL, "unable to create epoll set: %d %s", errno, 
+		   strerror(errno));
+#endif
 
      for (i=0; meth_builtins[i].name; i++)
 	  /* Add to tree with the method's id name as key */
@@ -129,7 +181,10 @@ void meth_fini()
      /* All plain sailing apart from running processes which potentially 
       * have outstanding I/O, but we don't care about them. So the only
       * thing we want to do is to prevent ourselves from being interrupted
-      * then tear down the structures */
+      * then tear down the structures. Threads are different, as they
+      * use the run sets, so they are stopped first */
+     meth_threadstop();
+
      /* close open routes & destroy its tree */
      while ( ! tree_empty(meth_rsetbykey) ) {
 	  tree_first(meth_rsetbykey);
@@ -167,6 +222,8 @@ void meth_fini()
 	  itree_first(meth_procbypid);
 	  rp = itree_get(meth_procbypid);
 	  itree_rm(meth_procbypid);
+	  if (rp->relaybuf)
+	       nfree(rp->relaybuf);
 	  nfree(rp->key);
 	  nfree(rp);
      }
@@ -192,8 +249,19 @@ void meth_fini()
      /* remove running process tree */
      itree_destroy(meth_procbypid);
 
-     /* remove callback tree */
+     /* co-processes were stopped at the end of their runs above */
+     tree_destroy(meth_coprocbykey);
+
+     /* remove execution type overrides */
+     tree_clearout(meth_typebyname, tree_infreemem, NULL);
+     tree_destroy(meth_typebyname);
+
+     /* remove callback tree and relay set */
      itree_destroy(meth_cbbyfd);
+     itree_destroy(meth_procbyfd);
+#if linux
+     close(meth_epfd);
+#endif
 }
 
 
@@ -217,10 +285,12 @@ void meth_dump() {
      i = 1;
      itree_traverse(meth_procbypid) {
 	  p = itree_get(meth_procbypid);
-	  elog_contprintf(DEBUG, "    %2d pid %5d started %8d\n", 
-			i, p->pid, p->start);
+	  elog_contprintf(DEBUG, "    %2d pid %5d started %8d%s\n", 
+			i, p->pid, p->start, p->coproc ? " co-process" : "");
 	  i++;
      }
+     elog_startprintf(DEBUG, "Thread pool: %d threads %s\n", meth_nthreads,
+		      meth_threads ? "running" : "not started");
      elog_endsend(DEBUG,  "-------------------------------------------------------------------");
 }
 
@@ -293,11 +363,10 @@ int meth_load(char *fname /* filename of shared object (.so) */) {
      }
      switch ((*type)()) {			/* Check type is OK */
      case METH_FORK:
+     case METH_THREAD:
      case METH_SOURCE:
+     case METH_COPROC:
 	  break;
-     case METH_THREAD:
-	  elog_printf(ERROR, "threaded methods unsupported");
-	  return -1;
      default: 	  elog_printf(ERROR, "unknown method type (%d)", (*type)());
 	  return -1;
      }
@@ -387,17 +456,20 @@ METHID meth_lookup(char *name /* name of method */) {
  */
 void meth_add_fdcallback(int fd, char *cb_name)
 {
-     if (itree_find(meth_cbbyfd, fd) == ITREE_NOVAL)
+     if (itree_find(meth_cbbyfd, fd) == ITREE_NOVAL) {
 	  itree_add(meth_cbbyfd, fd, cb_name);
-     else
+	  meth_relay_watch(fd, 0);
+     } else
 	  itree_put(meth_cbbyfd, cb_name);
 }
 
 /* Remove a file descriptor from the sock I/O list */
 void meth_rm_fdcallback(int fd)
 {
-     if (itree_find(meth_cbbyfd, fd) != ITREE_NOVAL)
+     if (itree_find(meth_cbbyfd, fd) != ITREE_NOVAL) {
 	  itree_rm(meth_cbbyfd);
+	  meth_relay_unwatch(fd);
+     }
 }
 
 
@@ -491,6 +563,7 @@ int meth_execute_s(struct meth_invoke *args,	/* Argument structure */
  *    (1) the main thread (discouraged as it may take lots of time)
  *    (2) a new thread
  *    (3) a new process
+ *    (4) a co-process, started on the first run and kept for later ones
  * The method is passed the command as its argument
  * The I/O should have been setup before execution.
  * Returns 0 for success, non-0 otherwise.
@@ -503,6 +576,7 @@ int meth_execute(char *key,		/* name identifing job/process  */
 		 long keep		/* number of recent data to keep */ )
 {
      struct meth_runprocinfo *rp;
+     struct meth_runthrinfo *tp;
      struct meth_runset *rset;
      int pid, r, respipefd[2] = {-1,-1}, errpipefd[2] = {-1,-1};
 
@@ -532,7 +606,7 @@ int meth_execute(char *key,		/* name identifing job/process  */
 	       elog_printf(ERROR, "job %s preaction() returns %d", key, r);
      }
 
-     switch((*run->type)()) {
+     switch(meth_type(run)) {
      case METH_FORK:		/* Use fork() to spawn the method */
 	  /* Initialise a run process structure for meth_child() to
 	   * collect, clean up and report */
@@ -541,6 +615,10 @@ int meth_execute(char *key,		/* name identifing job/process  */
 	  rp->start = time(NULL);
 	  rp->resfd = -1;
 	  rp->errfd = -1;
+	  rp->relaybuf = NULL;
+	  rp->nkills = 0;
+	  rp->coproc = 0;
+	  rp->cmdfd = -1;
 
 	  /*
 	   * Currently, there is a problem with too many writers
@@ -580,10 +658,10 @@ int meth_execute(char *key,		/* name identifing job/process  */
 		    meth_endrun(key,run,command,res_purl,err_purl,keep);
 	       nfree(rp);
 	       return 3;
-	       /*}*/
-	       fcntl(errpipefd[0], F_SETFL, O_NONBLOCK);
-	       rp->errfd = errpipefd[0];	/* 0 is the reading end */
 	  }
+	  fcntl(errpipefd[0], F_SETFL, O_NONBLOCK);
+	  rp->errfd = errpipefd[0];	/* 0 is the reading end */
+	  /*}*/
 
 	  elog_printf(DEBUG, "fork job %s stdout fd %d stderr fd %d", 
 		      key, rp->resfd, rp->errfd);
@@ -618,6 +696,13 @@ int meth_execute(char *key,		/* name identifing job/process  */
 	       close(respipefd[1]);
 	       close(errpipefd[1]);
 
+	       /* relay the reading ends from now until meth_exitchildren()
+		* collects the process */
+	       itree_add(meth_procbyfd, rp->resfd, rp);
+	       itree_add(meth_procbyfd, rp->errfd, rp);
+	       meth_relay_watch(rp->resfd, 1);
+	       meth_relay_watch(rp->errfd, 1);
+
 	  } else {
 
 	       /*  =====  child  =====  */
@@ -658,9 +743,49 @@ int meth_execute(char *key,		/* name identifing job/process  */
 
 	  break;
      case METH_THREAD:
-	  /* Use thread primatives */
-          elog_send(ERROR, "thread method not supported");
-	  return 1;
+	  /* Queue for the thread pool. The action's output is held in 
+	   * memory routes and replayed to rset by meth_threaddone() in the
+	   * main loop, so the job's routes are never used by the thread */
+	  if (meth_threadstart() == -1) {
+	       if (rset->oneshot)
+		    meth_endrun(key,run,command,res_purl,err_purl,keep);
+	       return 1;
+	  }
+	  tp = xnmalloc(sizeof(struct meth_runthrinfo));
+	  tp->res = route_open("mem:results", NULL, NULL, 0);
+	  tp->err = route_open("mem:errors",  NULL, NULL, 0);
+	  if ( ! tp->res || ! tp->err ) {
+	       elog_printf(ERROR, "job %s: unable to open memory routes "
+			   "for thread; abandon", key);
+	       if (tp->res)
+		    route_close(tp->res);
+	       if (tp->err)
+		    route_close(tp->err);
+	       nfree(tp);
+	       if (rset->oneshot)
+		    meth_endrun(key,run,command,res_purl,err_purl,keep);
+	       return 1;
+	  }
+	  tp->key     = xnstrdup(key);
+	  tp->run     = run;
+	  tp->command = xnstrdup(command);
+	  tp->rset    = rset;
+	  tp->ret     = 0;
+	  tp->start   = time(NULL);
+	  tp->next    = NULL;
+	  rset->pid   = METH_PID_THREAD;
+
+	  pthread_mutex_lock(&meth_thrlock);
+	  if (meth_thrqueuelast)
+	       meth_thrqueuelast->next = tp;
+	  else
+	       meth_thrqueue = tp;
+	  meth_thrqueuelast = tp;
+	  pthread_cond_signal(&meth_thrcond);
+	  pthread_mutex_unlock(&meth_thrlock);
+
+	  elog_printf(DEBUG, "thread job %s queued", key);
+	  return 0;
      case METH_SOURCE:
 	  /* run inside this thread and process. 'in-proc' */
 #if 0
@@ -684,6 +809,37 @@ int meth_execute(char *key,		/* name identifing job/process  */
 	       meth_endrun(key,run,command,res_purl,err_purl,keep);
 
 	  return r;
+     case METH_COPROC:
+	  /* The action runs in a process that is started once and kept.
+	   * Each run is triggered by a line on its stdin and ends when the
+	   * result is followed by a METH_COPROC_EOR line, so there is no
+	   * fork() and no method setup for each run. A co-process that 
+	   * has died is started again on the following run */
+	  rp = tree_find(meth_coprocbykey, key);
+	  if (rp == TREE_NOVAL) {
+	       rp = meth_coprocstart(key, run, command, rset);
+	       if ( ! rp ) {
+		    if (rset->oneshot)
+			 meth_endrun(key,run,command,res_purl,err_purl,keep);
+		    return 1;
+	       }
+	  } else if (rp->busy) {
+	       /* still working on the last run: it has hung, so restart
+		* it by killing, or butchering if that was not enough */
+	       elog_printf(WARNING, "coproc job %s (pid %d) has not ended "
+			   "run %d after %.0fs; restarting", key, rp->pid, 
+			   rp->nruns, difftime(time(NULL), rp->trigger));
+	       if (rp->nkills)
+		    meth_butcher(rp);
+	       else
+		    meth_kill(rp);
+	       return 1;
+	  }
+
+	  r = meth_coproctrigger(rp, rset);
+	  if (r && rset->oneshot)
+	       meth_endrun(key,run,command,res_purl,err_purl,keep);
+	  return r;
      case METH_NONE:
 	  /* no method defined */
 	  elog_printf(DEBUG, "no method for job %s", key);
@@ -763,6 +919,7 @@ int  meth_endrun(char *key, METHID run, char *command, char *res_purl,
 		  char *err_purl, long keep)
 {
      struct meth_runset *rset;
+     struct meth_runprocinfo *rp;
      int ret;
 
      /* Debug: log close of io */
@@ -789,6 +946,11 @@ int  meth_endrun(char *key, METHID run, char *command, char *res_purl,
      } else
 	  ret = 0;
 
+     /* the job's co-process, if it has one, is no longer needed */
+     rp = tree_find(meth_coprocbykey, key);
+     if (rp != TREE_NOVAL)
+	  meth_coprocstop(rp);
+
      /* remove rset structure, close the IO and free memory */
      elog_printf(DEBUG, "closing routes for job key "
 		 "%s after %d seconds res %s err %s", key, 
@@ -873,8 +1035,7 @@ void meth_sigchild(int sig /* signal vector */) {
  * and debug.
  */
 void meth_exitchildren() {
-     int pid, status, r;
-     char pipebuf[PIPE_BUF];
+     int pid, status;
      struct meth_runprocinfo *rp;
      struct meth_runset *rset;
 
@@ -887,7 +1048,17 @@ void meth_exitchildren() {
       meth_restartselect++;		/* select args may have changed */
 
 	  /* Process the child's death */
-	  if (itree_find(meth_procbypid, pid) != ITREE_NOVAL) {
+	  if (itree_find(meth_procbypid, pid) != ITREE_NOVAL &&
+	      ((struct meth_runprocinfo *) itree_get(meth_procbypid))->coproc){
+	       /* co-processes have their own life cycle */
+	       rp = itree_get(meth_procbypid);
+	       itree_rm(meth_procbypid);
+	       meth_coprocexit(rp, status);
+	       if (rp->relaybuf)
+		    nfree(rp->relaybuf);
+	       nfree(rp->key);
+	       nfree(rp);
+	  } else if (itree_find(meth_procbypid, pid) != ITREE_NOVAL) {
 	       rp = itree_get(meth_procbypid);
 	       rset = tree_find(meth_rsetbykey, rp->key);
 	       if (rset == ITREE_NOVAL)
@@ -907,36 +1078,17 @@ void meth_exitchildren() {
 	       elog_endprintf(INFO, " took=%.0fs", difftime(time(NULL), 
 							    rp->start));
 
-	       /* close off i/o that the parent may have for the child */
-
-	       /* Empty the result pipe containing data */
+	       /* close off i/o that the parent may have for the child,
+		* relaying whatever is left in the result and error pipes */
 	       if (rp->resfd != -1) {
-		    r = read(rp->resfd, pipebuf, PIPE_BUF);
-		    if (r == -1)
-		         elog_printf(ERROR, "result read() error: %d %s",
-				     errno, strerror(errno));
-		    if (r > 0)
-		         if (route_write(rset->res, pipebuf, r) < 0)
-			      elog_die(FATAL, "res route problem: "
-				       "key %s, start %d res %s err %s",
-				       rp->key, rp->start,
-				       rset->res_purl, rset->err_purl);
-		    close(rp->resfd);
+		    meth_relayfd(rp, rset, rp->resfd);
+		    if (rp->resfd != -1)
+			 meth_relayclose(rp, rp->resfd);
 	       }
-
-	       /* Empty the error pipe containing data */
 	       if (rp->errfd != -1) {
-		    r = read(rp->errfd, pipebuf, PIPE_BUF);
-		    if (r == -1)
-		         elog_printf(ERROR, "error read() error: %d %s", 
-				     errno, strerror(errno));
-		    if (r > 0)
-		         if (route_write(rset->err, pipebuf, r) < 0)
-			   elog_die(FATAL, "err route problem: "
-				    "key %s, start %d res %s err %s",
-				    rp->key, rp->start,
-				    rset->res_purl, rset->err_purl);
-		    close(rp->errfd);
+		    meth_relayfd(rp, rset, rp->errfd);
+		    if (rp->errfd != -1)
+			 meth_relayclose(rp, rp->errfd);
 	       }
 	       
 	       route_flush(rset->res);
@@ -955,6 +1107,8 @@ void meth_exitchildren() {
 	       callback_raise(METH_CB_FINISHED, rp->key, NULL, NULL, NULL);
 
 	       /* clear the storage */
+	       if (rp->relaybuf)
+		    nfree(rp->relaybuf);
 	       nfree(rp->key);
 	       nfree(rp);
 
@@ -1140,6 +1294,71 @@ void meth_child(int sig /* signal vector */) {
  * interrupted I/O. Otherwise, the number of relays carried out is returned.
  * Should be run in a loop.
  */
+#if linux
+int meth_relay() {
+     struct epoll_event events[METH_RELAY_MAXEVENTS];
+     struct meth_runprocinfo *rp;
+     struct meth_runset *rset;
+     int i, fd, n;
+     char *cb_name;
+
+     /* job pipes are registered by meth_execute() and callback fds by 
+      * meth_add_fdcallback(), so there is nothing to build here */
+     sig_on();
+
+     /* a child that exited while signals were off has just been 
+      * collected by meth_sigchild() and would not wake us */
+     n = epoll_wait(meth_epfd, events, METH_RELAY_MAXEVENTS, 
+		    tree_empty(meth_exitbypid) ? 
+		    METH_RELAY_TOSEC * 1000 + METH_RELAY_TOUSEC / 1000 : 0);
+
+     sig_off();
+
+     if (n == -1) {
+          if (errno == EINTR)
+	       elog_printf(DEBUG, "epoll_wait() error %d %s", 
+			   errno, strerror(errno));
+	  else
+	       elog_printf(ERROR, "epoll_wait() error %d %s", 
+			   errno, strerror(errno));
+	  return n;
+     }
+
+     /* process the child exit codes, which relays the remaining output 
+      * of finished jobs and closes their pipes */
+     meth_exitchildren();
+
+     /*
+      * Unlike select(), the events can't be thrown away if meth_child()
+      * has been called, as job pipes are edge triggered and would not 
+      * be reported again. Instead, each event is checked against the
+      * current state: pipes closed by meth_exitchildren() have left
+      * meth_procbyfd and their events are dropped.
+      */
+     for (i=0; i < n; i++) {
+	  fd = events[i].data.fd;
+	  if ( (rp = itree_find(meth_procbyfd, fd)) != ITREE_NOVAL ) {
+	       /* job result or error pipe */
+	       rset = tree_find(meth_rsetbykey, rp->key);
+	       if (rset == TREE_NOVAL)
+		    elog_die(FATAL, "key %s not in meth_rsetbykey", rp->key);
+	       meth_relayfd(rp, rset, fd);
+	  } else if ( (cb_name = itree_find(meth_cbbyfd, fd)) != ITREE_NOVAL ) {
+	       /* externally notified file descriptor */
+	       callback_raise(cb_name, (void *) (long) fd, NULL, NULL, NULL);
+	  } else {
+	       elog_printf(DEBUG, "dropping event on closed fd %d", fd);
+	  }
+     }
+
+     if (meth_restartselect) {
+          meth_restartselect = 0;
+	  return -1;			/* needs to be restarted */
+     }
+
+     return n;
+}
+#else
 int meth_relay() {
      struct meth_runprocinfo *rp;
      struct meth_runset *rset;
@@ -1249,45 +1468,13 @@ int meth_relay() {
 	       /* read from result (stdout) pipe */
 	       FD_CLR(rp->resfd, &fds);
 	       avail--;
-	       r = read(rp->resfd, pipebuf, PIPE_BUF);
-	       elog_printf(DEBUG, "read job %s result fd %d nchars %d", 
-			   rp->key, rp->resfd, r);
-	       if (r == -1) {
-		    elog_printf(ERROR, "read() error %d %s", errno, 
-				strerror(errno));
-	       } if (r == 0) {
-		    elog_printf(DEBUG, "closing job %s result fd %d", 
-				rp->key, rp->resfd);
-		    close(rp->resfd);
-		    rp->resfd = -1;
-	       } else {
-		    if (route_write(rset->res, pipebuf, r) < 0)
-		         elog_die(FATAL, "route problem from "
-				  "res: key %s, start %d res %s err %s",
-				  rp->key,rp->start,rset->res_purl,rset->err_purl);
-               }
+	       meth_relayfd(rp, rset, rp->resfd);
 	  }
 	  if (rp->errfd != -1 && FD_ISSET(rp->errfd, &fds)) {
 	       /* read from error (stderr) pipe */
 	       FD_CLR(rp->errfd, &fds);
 	       avail--;
-	       r = read(rp->errfd, pipebuf, PIPE_BUF);
-	       elog_printf(DEBUG, "read job %s error fd %d nchars %d", 
-			   rp->key, rp->errfd, r);
-	       if (r == -1) {
-		    elog_printf(ERROR, "read() error %d %s", errno, 
-				strerror(errno));
-	       } if (r == 0) {
-		    elog_printf(DEBUG, "closing job %s error fd %d", 
-				rp->key, rp->errfd);
-		    close(rp->errfd);
-		    rp->errfd = -1;
-	       } else {
-		    if (route_write(rset->err, pipebuf, r) < 0)
-		         elog_die(FATAL, "route problem from err: "
-				  "key %s, start %d res %s err %s",
-				  rp->key,rp->start,rset->res_purl,rset->err_purl);
-               }
+	       meth_relayfd(rp, rset, rp->errfd);
 	  }
      }
      if (avail > 0) {
@@ -1318,13 +1505,119 @@ int meth_relay() {
 
      return handled;
 }
+#endif /* linux */
+
+
+/*
+ * Relay the output waiting on fd, the result or error pipe of the 
+ * running job rp, to the job's result or error route in rset.
+ * The pipe is read until it would block, as it is watched edge 
+ * triggered, collecting data in the job's relay buffer and writing it 
+ * to the route whenever the buffer fills or the pipe is drained. This
+ * makes a few large route writes where there used to be one for every
+ * PIPE_BUF. The pipe is closed at end of file.
+ * Returns the number of characters relayed or -1 for a read error.
+ */
+int meth_relayfd(struct meth_runprocinfo *rp, struct meth_runset *rset,
+		 int fd)
+{
+     int r, len=0, total=0;
+     ROUTE out;
+
+     if (rp->coproc && fd == rp->resfd)
+	  return meth_relaycoproc(rp, rset);	/* results are framed */
+     out = (fd == rp->resfd) ? rset->res : rset->err;
+     if (rp->relaybuf == NULL)
+	  rp->relaybuf = xnmalloc(METH_RELAYBUFSZ);
+
+     do {
+	  r = read(fd, rp->relaybuf + len, METH_RELAYBUFSZ - len);
+	  if (r == -1 && errno == EINTR)
+	       continue;
+	  if (r > 0)
+	       len += r;
+	  if (len > 0 && (r <= 0 || len == METH_RELAYBUFSZ)) {
+	       /* full, drained or finished: pass on what we have */
+	       if (route_write(out, rp->relaybuf, len) < 0)
+		    elog_die(FATAL, "route problem from %s: key %s, "
+			     "start %d res %s err %s", 
+			     out == rset->res ? "res" : "err", rp->key, 
+			     rp->start, rset->res_purl, rset->err_purl);
+	       total += len;
+	       len = 0;
+	  }
+     } while (r > 0 || (r == -1 && errno == EINTR));
+
+     elog_printf(DEBUG, "read job %s fd %d nchars %d", rp->key, fd, total);
+     if (r == 0) {
+	  elog_printf(DEBUG, "closing job %s fd %d", rp->key, fd);
+	  meth_relayclose(rp, fd);
+     } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+	  elog_printf(ERROR, "read() error %d %s", errno, strerror(errno));
+	  return -1;
+     }
+
+     return total;
+}
+
+
+/* Stop relaying fd, a pipe from job rp, and close it */
+void meth_relayclose(struct meth_runprocinfo *rp, int fd)
+{
+     meth_relay_unwatch(fd);
+     if (itree_find(meth_procbyfd, fd) != ITREE_NOVAL)
+	  itree_rm(meth_procbyfd);
+     close(fd);
+     if (rp->resfd == fd)
+	  rp->resfd = -1;
+     if (rp->errfd == fd)
+	  rp->errfd = -1;
+}
+
+
+/*
+ * Add fd to the descriptors that meth_relay() waits on for input.
+ * If edge is set, it is only reported when new data arrives and
+ * must be drained each time. Does nothing where select() is used, as
+ * the set is built on each call.
+ */
+void meth_relay_watch(int fd, int edge)
+{
+#if linux
+     struct epoll_event ev;
+
+     ev.events  = EPOLLIN | (edge ? EPOLLET : 0);
+     ev.data.fd = fd;
+     if (epoll_ctl(meth_epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	  elog_printf(ERROR, "unable to relay fd %d: %d %s", fd, errno, 
+		      strerror(errno));
+#endif
+}
+
+
+/*
+ * Remove fd from the descriptors that meth_relay() waits on. 
+ * Should be called before fd is closed, as a copy inherited by another 
+ * process would otherwise keep it in the set
+ */
+void meth_relay_unwatch(int fd)
+{
+#if linux
+     struct epoll_event ev;	/* ignored, but may not be NULL */
+
+     epoll_ctl(meth_epfd, EPOLL_CTL_DEL, fd, &ev);
+#endif
+}
+
 
 /*
  * Send a kill signal to a process spawned by meth_ and let it handle
- * its own shutdown.
+ * its own shutdown. Signals are counted in rp->nkills, so that a hung
+ * co-process that ignores this can be butchered when it is restarted.
  */
 void meth_kill(struct meth_runprocinfo *rp) {
      elog_printf(INFO, "shutting down job %s (pid %d)", rp->key, rp->pid);
+     rp->nkills++;
 
      if (kill(rp->pid, METH_SIG_KILL) < 0)
 	  /* failure to kill, leave it */
@@ -1338,6 +1631,7 @@ void meth_kill(struct meth_runprocinfo *rp) {
  */
 void meth_butcher(struct meth_runprocinfo *rp) {
      elog_printf(WARNING, "aborting job %s (pid %d)", rp->key, rp->pid);
+     rp->nkills++;
      if (kill(rp->pid, METH_SIG_BUTCHER) < 0)
 	  /* failure to kill, leave it */
           elog_printf(ERROR, "unable to kill pid %d, error %d %s", 
@@ -1428,14 +1722,670 @@ int meth_shutdown() {
 }
 
 
+/*
+ * Configure the method class from cf:-
+ *   meth.threads  number of threads to run METH_THREAD jobs
+ *   meth.thread   names of the methods to run in threads instead of
+ *                 in the dispatcher, such as probe or sample
+ */
+void meth_configure(CF_VALS cf	/* configuration */)
+{
+     ITREE *names;
+
+     if (cf_defined(cf, METH_CF_THREADS))
+	  meth_setthreads(cf_getint(cf, METH_CF_THREADS));
+
+     if ( ! cf_defined(cf, METH_CF_THREAD) )
+	  return;
+     names = cf_getvec(cf, METH_CF_THREAD);
+     if (names) {
+	  itree_traverse(names)
+	       meth_settype(itree_get(names), METH_THREAD);
+     } else {
+	  meth_settype(cf_getstr(cf, METH_CF_THREAD), METH_THREAD);
+     }
+}
+
+
+/*
+ * Set the number of threads that run METH_THREAD jobs. Takes effect
+ * when the pool is started by the first threaded job.
+ * Returns 0 for success or -1 if the number is invalid or the pool
+ * has already started.
+ */
+int meth_setthreads(int nthreads	/* number of threads */)
+{
+     if (nthreads < 1) {
+	  elog_printf(ERROR, "thread pool size must be 1 or more, not %d", 
+		      nthreads);
+	  return -1;
+     }
+     if (meth_threads) {
+	  elog_printf(ERROR, "thread pool already running with %d threads",
+		      meth_nthreads);
+	  return -1;
+     }
+     meth_nthreads = nthreads;
+
+     return 0;
+}
+
+
+/*
+ * Change the way the method name is run to type, overriding the type()
+ * of the method. Only methods that run in the dispatcher (METH_SOURCE) 
+ * may be moved to the thread pool (METH_THREAD) and back, as others 
+ * depend on having their own process.
+ * Returns 0 for success or -1 if the method does not exist or can't
+ * be run that way.
+ */
+int meth_settype(char *name,		/* name of method */
+		 enum exectype type	/* new execution type */)
+{
+     METHID run;
+     enum exectype own;
+
+     run = meth_lookup(name);
+     if (run == TREE_NOVAL) {
+	  elog_printf(ERROR, "unable to set type of unknown method %s", 
+		      name);
+	  return -1;
+     }
+     own = (*run->type)();
+     if (type != own && 
+	 ! ((type == METH_THREAD || type == METH_SOURCE) &&
+	    (own  == METH_THREAD || own  == METH_SOURCE))) {
+	  elog_printf(ERROR, "method %s type %d can't be run as type %d",
+		      name, own, type);
+	  return -1;
+     }
+
+     if (tree_find(meth_typebyname, name) == TREE_NOVAL)
+	  tree_add(meth_typebyname, xnstrdup(name), (void *) (long) type);
+     else
+	  tree_put(meth_typebyname, (void *) (long) type);
+     elog_printf(DEBUG, "method %s set to run as type %d", name, type);
+
+     return 0;
+}
+
+
+/* Return the way that the method run is executed */
+enum exectype meth_type(METHID run	/* method specification */)
+{
+     void *type;
+
+     if ( ! tree_empty(meth_typebyname) ) {
+	  type = tree_find(meth_typebyname, meth_name(run));
+	  if (type != TREE_NOVAL)
+	       return (enum exectype) (long) type;
+     }
+
+     return (*run->type)();
+}
+
+
+/*
+ * Start the thread pool if it is not already running, together with 
+ * the pipe that threads use to wake meth_relay() when jobs finish.
+ * The threads block all signals, leaving them to the main thread.
+ * Returns 0 for success or -1 if the pool could not be started.
+ */
+int meth_threadstart()
+{
+     sigset_t all, old;
+     int i, r;
+
+     if (meth_threads)
+	  return 0;
+
+     if (pipe(meth_thrpipe) == -1) {
+	  elog_printf(ERROR, "unable to create thread pipe: %d %s", 
+		      errno, strerror(errno));
+	  return -1;
+     }
+     fcntl(meth_thrpipe[0], F_SETFL, O_NONBLOCK);
+     fcntl(meth_thrpipe[1], F_SETFL, O_NONBLOCK);
+     fcntl(meth_thrpipe[0], F_SETFD, FD_CLOEXEC);
+     fcntl(meth_thrpipe[1], F_SETFD, FD_CLOEXEC);
+     meth_add_fdcallback(meth_thrpipe[0], METH_CB_THREADDONE);
+     callback_regcb(METH_CB_THREADDONE, (void *) meth_threaddone);
+
+     meth_thrstop = 0;
+     meth_threads = xnmalloc(sizeof(pthread_t) * meth_nthreads);
+     sigfillset(&all);		/* except faults, which must still be caught */
+     sigdelset(&all, SIGSEGV);
+     sigdelset(&all, SIGBUS);
+     sigdelset(&all, SIGFPE);
+     sigdelset(&all, SIGILL);
+     pthread_sigmask(SIG_BLOCK, &all, &old);
+     for (i=0; i < meth_nthreads; i++) {
+	  r = pthread_create(&meth_threads[i], NULL, meth_thread, NULL);
+	  if (r) {
+	       elog_printf(ERROR, "unable to create thread %d: %d %s", 
+			   i, r, strerror(r));
+	       break;
+	  }
+     }
+     pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+     if (i == 0) {
+	  /* no threads at all */
+	  nfree(meth_threads);
+	  meth_threads = NULL;
+	  meth_threadstop();
+	  return -1;
+     }
+     meth_nthreads = i;
+     elog_printf(DEBUG, "started %d threads", meth_nthreads);
+
+     return 0;
+}
+
+
+/*
+ * Stop the thread pool, waiting for the running actions to finish.
+ * Jobs that are queued or not yet collected by meth_threaddone() are 
+ * discarded, so their run sets remain marked as running.
+ */
+void meth_threadstop()
+{
+     struct meth_runthrinfo *tp, *lists[2];
+     int i;
+
+     if (meth_threads) {
+	  pthread_mutex_lock(&meth_thrlock);
+	  meth_thrstop = 1;
+	  pthread_cond_broadcast(&meth_thrcond);
+	  pthread_mutex_unlock(&meth_thrlock);
+	  for (i=0; i < meth_nthreads; i++)
+	       pthread_join(meth_threads[i], NULL);
+	  nfree(meth_threads);
+	  meth_threads = NULL;
+     }
+
+     lists[0] = meth_thrqueue;
+     lists[1] = meth_thrdone;
+     for (i=0; i < 2; i++) {
+	  while ( (tp = lists[i]) ) {
+	       lists[i] = tp->next;
+	       elog_printf(INFO, "discarding thread job %s", tp->key);
+	       route_close(tp->res);
+	       route_close(tp->err);
+	       nfree(tp->key);
+	       nfree(tp->command);
+	       nfree(tp);
+	  }
+     }
+     meth_thrqueue = meth_thrqueuelast = NULL;
+     meth_thrdone  = meth_thrdonelast  = NULL;
+
+     if (meth_thrpipe[0] != -1) {
+	  callback_unregcb(METH_CB_THREADDONE, (void *) meth_threaddone);
+	  meth_rm_fdcallback(meth_thrpipe[0]);
+	  close(meth_thrpipe[0]);
+	  close(meth_thrpipe[1]);
+	  meth_thrpipe[0] = meth_thrpipe[1] = -1;
+     }
+}
+
+
+/*
+ * Body of each pooled thread: run queued jobs, passing them to the done
+ * list and writing to the thread pipe as each finishes
+ */
+void *meth_thread(void *unused)
+{
+     struct meth_runthrinfo *tp;
+
+     pthread_mutex_lock(&meth_thrlock);
+     while (1) {
+	  while ( ! meth_thrstop && ! meth_thrqueue )
+	       pthread_cond_wait(&meth_thrcond, &meth_thrlock);
+	  if (meth_thrstop)
+	       break;
+
+	  /* take the oldest job */
+	  tp = meth_thrqueue;
+	  meth_thrqueue = tp->next;
+	  if ( ! meth_thrqueue )
+	       meth_thrqueuelast = NULL;
+	  pthread_mutex_unlock(&meth_thrlock);
+
+	  tp->ret = (*tp->run->action)(tp->command, tp->res, tp->err, 
+				       tp->rset);
+	  route_flush(tp->res);
+	  route_flush(tp->err);
+
+	  /* hand back to the main loop */
+	  pthread_mutex_lock(&meth_thrlock);
+	  tp->next = NULL;
+	  if (meth_thrdonelast)
+	       meth_thrdonelast->next = tp;
+	  else
+	       meth_thrdone = tp;
+	  meth_thrdonelast = tp;
+	  if (write(meth_thrpipe[1], "", 1) == -1 && errno != EAGAIN)
+	       elog_printf(ERROR, "unable to write thread pipe: %d %s", 
+			   errno, strerror(errno));
+     }
+     pthread_mutex_unlock(&meth_thrlock);
+
+     return NULL;
+}
+
+
+/*
+ * Callback from meth_relay() when the thread pipe is written.
+ * Collects the jobs finished by threads, writes their held output to
+ * their routes, logs the result, closes oneshot routes and raises 
+ * METH_CB_FINISHED with the job key, as meth_exitchildren() for 
+ * processes.
+ */
+void meth_threaddone()
+{
+     struct meth_runthrinfo *tp, *done;
+     struct meth_runset *rset;
+     char buf[PIPE_BUF];
+
+     /* drain the pipe before taking the list, so that later jobs write
+      * it again */
+     while (read(meth_thrpipe[0], buf, PIPE_BUF) > 0)
+	  ;
+     pthread_mutex_lock(&meth_thrlock);
+     done = meth_thrdone;
+     meth_thrdone = meth_thrdonelast = NULL;
+     pthread_mutex_unlock(&meth_thrlock);
+
+     while ( (tp = done) ) {
+	  done = tp->next;
+	  rset = tp->rset;
+
+	  /* log the return */
+	  if (tp->ret)
+	       elog_printf(ERROR, "thread job %-10s failure (%d) took=%.0fs",
+			   tp->key, tp->ret, difftime(time(NULL), tp->start));
+	  else
+	       elog_printf(INFO,  "thread job %-10s success (%d) took=%.0fs",
+			   tp->key, tp->ret, difftime(time(NULL), tp->start));
+
+	  /* write the held output to the job's routes */
+	  if (rt_mem_replay(tp->res, rset->res) == -1)
+	       elog_printf(ERROR, "job %s: unable to write results to %s", 
+			   tp->key, rset->res_purl);
+	  if (rt_mem_replay(tp->err, rset->err) == -1)
+	       elog_printf(ERROR, "job %s: unable to write errors to %s", 
+			   tp->key, rset->err_purl);
+	  route_close(tp->res);
+	  route_close(tp->err);
+
+	  /* no longer running, so the routes can be closed if need be */
+	  rset->pid = -1;
+	  if (rset->oneshot)
+	       meth_endrun(tp->key, tp->run, tp->command, rset->res_purl, 
+			   rset->err_purl, 0);
+
+	  /* propagate the completion to anyone listening on the 
+	   * METH_CB_FINISHED event and pass the method name key */
+	  callback_raise(METH_CB_FINISHED, tp->key, NULL, NULL, NULL);
+
+	  nfree(tp->key);
+	  nfree(tp->command);
+	  nfree(tp);
+     }
+}
+
+
+/*
+ * Start a co-process for job key, which runs the action of method run
+ * with command in a child process. Its stdin is a socket on which a line
+ * is sent to trigger each run (see meth_coproctrigger()) and its stdout
+ * and stderr are relayed to the routes in rset, as a METH_FORK job.
+ * The co-process is kept in meth_procbypid, so it is signalled by 
+ * meth_shutdown(), and in meth_coprocbykey until it dies or is stopped.
+ * Returns the process's details or NULL if it could not be started.
+ */
+struct meth_runprocinfo *meth_coprocstart(char *key,	/* job key */
+					  METHID run,	/* method */
+					  char *command,/* command string */
+					  struct meth_runset *rset /*routes*/)
+{
+     struct meth_runprocinfo *rp;
+     int i, pid, cmdfd[2] = {-1,-1}, respipefd[2] = {-1,-1}, 
+	  errpipefd[2] = {-1,-1};
+     sigset_t none;
+
+     /* a socket is used for stdin so that triggering a process that has 
+      * died returns an error with send() rather than raising SIGPIPE */
+     if (socketpair(AF_UNIX, SOCK_STREAM, 0, cmdfd) == -1 ||
+	 pipe(respipefd) == -1 || pipe(errpipefd) == -1 || 
+	 (pid = fork()) == -1) {
+	  elog_printf(ERROR, "job %s: unable to start co-process: %d %s; "
+		      "abandon", key, errno, strerror(errno));
+	  for (i=0; i < 2; i++) {
+	       if (cmdfd[i] != -1)
+		    close(cmdfd[i]);
+	       if (respipefd[i] != -1)
+		    close(respipefd[i]);
+	       if (errpipefd[i] != -1)
+		    close(errpipefd[i]);
+	  }
+	  return NULL;
+     }
+
+     if (pid == 0) {
+
+	  /*  =====  child  =====  */
+
+	  if (dup2(cmdfd[1], 0) != 0 || dup2(respipefd[1], 1) != 1 || 
+	      dup2(errpipefd[1], 2) != 2)
+	       elog_die(FATAL, "METH_COPROC can't dup2() stdio command "
+			"`%s' %d %s", command, errno, strerror(errno));
+	  for (i=0; i < 2; i++) {
+	       close(cmdfd[i]);
+	       close(respipefd[i]);
+	       close(errpipefd[i]);
+	  }
+
+	  /* the dispatcher's signals are blocked but the co-process 
+	   * outlives this run, so it must be able to answer meth_kill() */
+	  sigemptyset(&none);
+	  sigprocmask(SIG_SETMASK, &none, NULL);
+
+	  /* the action should loop, reading a line and writing a result
+	   * for each; its return is the exit code, as METH_FORK */
+	  _exit((*run->action)(command, rset->res, rset->err, rset));
+     }
+
+     /*  =====  parent  =====  */
+
+     close(cmdfd[1]);
+     close(respipefd[1]);
+     close(errpipefd[1]);
+     fcntl(cmdfd[0],     F_SETFD, FD_CLOEXEC);
+     fcntl(respipefd[0], F_SETFD, FD_CLOEXEC);
+     fcntl(errpipefd[0], F_SETFD, FD_CLOEXEC);
+     fcntl(respipefd[0], F_SETFL, O_NONBLOCK);
+     fcntl(errpipefd[0], F_SETFL, O_NONBLOCK);
+
+     rp = xnmalloc(sizeof(struct meth_runprocinfo));
+     rp->key      = xnstrdup(key);
+     rp->pid      = pid;
+     rp->start    = time(NULL);
+     rp->resfd    = respipefd[0];
+     rp->errfd    = errpipefd[0];
+     rp->relaybuf = NULL;
+     rp->nkills   = 0;
+     rp->coproc   = 1;
+     rp->cmdfd    = cmdfd[0];
+     rp->nruns    = 0;
+     rp->busy     = 0;
+     rp->trigger  = 0;
+     rp->relaylen = 0;
+     rp->midline  = 0;
+
+     itree_add(meth_procbypid, pid, rp);
+     tree_add(meth_coprocbykey, rp->key, rp);
+     itree_add(meth_procbyfd, rp->resfd, rp);
+     itree_add(meth_procbyfd, rp->errfd, rp);
+     meth_relay_watch(rp->resfd, 1);
+     meth_relay_watch(rp->errfd, 1);
+
+     elog_printf(INFO, "coproc job %-10s started pid %d", key, pid);
+
+     return rp;
+}
+
+
+/*
+ * Trigger a run of the co-process rp by sending it a line containing 
+ * the number of the run. The run ends when the co-process writes
+ * a line containing only METH_COPROC_EOR after its result and until 
+ * then the job is running (rset->pid is set).
+ * Returns 0 for success or 1 if the co-process could not be triggered,
+ * in which case it is killed to be restarted by the next run.
+ */
+int meth_coproctrigger(struct meth_runprocinfo *rp,	/* co-process */
+		       struct meth_runset *rset		/* job's routes */)
+{
+     char line[24];
+     int len;
+
+     len = snprintf(line, 24, "%d\n", rp->nruns + 1);
+     if (send(rp->cmdfd, line, len, MSG_NOSIGNAL|MSG_DONTWAIT) != len) {
+	  elog_printf(ERROR, "coproc job %s (pid %d): unable to trigger "
+		      "run: %d %s; restarting", rp->key, rp->pid, errno, 
+		      strerror(errno));
+	  meth_kill(rp);
+	  return 1;
+     }
+
+     rp->nruns++;
+     rp->busy = 1;
+     rp->trigger = time(NULL);
+     rset->pid = rp->pid;
+     elog_printf(DEBUG, "coproc job %s pid %d run %d triggered", rp->key,
+		 rp->pid, rp->nruns);
+
+     return 0;
+}
+
+
+/*
+ * Relay the result pipe of co-process rp to its job's result route, 
+ * as meth_relayfd(). Complete lines are passed on as they arrive 
+ * except a METH_COPROC_EOR line, which ends the current run with 
+ * meth_coprocdone(). An incomplete line is held in the relay buffer
+ * until its end arrives, in case it is the end of the run.
+ * Returns the number of characters read or -1 for a read error.
+ */
+int meth_relaycoproc(struct meth_runprocinfo *rp,	/* co-process */
+		     struct meth_runset *rset		/* job's routes */)
+{
+     int r, i, line, eorlen, total=0;
+
+     if (rp->relaybuf == NULL)
+	  rp->relaybuf = xnmalloc(METH_RELAYBUFSZ);
+     eorlen = strlen(METH_COPROC_EOR);
+
+     while (1) {
+	  r = read(rp->resfd, rp->relaybuf + rp->relaylen, 
+		   METH_RELAYBUFSZ - rp->relaylen);
+	  if (r == -1 && errno == EINTR)
+	       continue;
+	  if (r <= 0)
+	       break;
+	  rp->relaylen += r;
+	  total += r;
+
+	  /* find the ends of runs and pass on the results before them */
+	  line = 0;
+	  for (i=0; i < rp->relaylen; i++) {
+	       if (rp->relaybuf[i] != '\n')
+		    continue;
+	       if ( ! rp->midline && i - line == eorlen &&
+		    strncmp(rp->relaybuf + line, METH_COPROC_EOR, 
+			    eorlen) == 0 ) {
+		    meth_priv_coprocwrite(rp, rset, line, i+1);
+		    meth_coprocdone(rp, rset);
+		    if (rp->resfd == -1)
+			 return total;	/* stopped at the end of the run */
+		    i = -1;
+		    line = 0;
+		    continue;
+	       }
+	       rp->midline = 0;
+	       line = i+1;
+	  }
+
+	  /* pass on complete lines, holding back the last if it is 
+	   * incomplete, unless it fills the buffer */
+	  if (line == 0 && rp->relaylen == METH_RELAYBUFSZ) {
+	       line = rp->relaylen;
+	       rp->midline = 1;
+	  }
+	  if (line > 0)
+	       meth_priv_coprocwrite(rp, rset, line, line);
+     }
+
+     elog_printf(DEBUG, "read job %s fd %d nchars %d", rp->key, rp->resfd, 
+		 total);
+     if (r == 0) {
+	  elog_printf(DEBUG, "closing job %s fd %d", rp->key, rp->resfd);
+	  meth_relayclose(rp, rp->resfd);
+     } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+	  elog_printf(ERROR, "read() error %d %s", errno, strerror(errno));
+	  return -1;
+     }
+
+     return total;
+}
+
+
+/*
+ * End the current run of co-process rp, which has written its result.
+ * The job's routes are flushed, closed if it was a oneshot job 
+ * and METH_CB_FINISHED is raised, as for the death of a METH_FORK job.
+ */
+void meth_coprocdone(struct meth_runprocinfo *rp,	/* co-process */
+		     struct meth_runset *rset		/* job's routes */)
+{
+     route_flush(rset->res);
+     route_flush(rset->err);
+     if ( ! rp->busy ) {
+	  elog_printf(WARNING, "coproc job %s (pid %d) ended a run that "
+		      "was not triggered", rp->key, rp->pid);
+	  return;
+     }
+
+     elog_printf(INFO, "coproc job %-10s pid %d run %d took=%.0fs", 
+		 rp->key, rp->pid, rp->nruns, 
+		 difftime(time(NULL), rp->trigger));
+     rp->busy = 0;
+     rset->pid = -1;
+     if (rset->oneshot)
+	  meth_endrun(rp->key, 0, "unknown", rset->res_purl, 
+		      rset->err_purl, 0);
+     callback_raise(METH_CB_FINISHED, rp->key, NULL, NULL, NULL);
+}
+
+
+/*
+ * Process the death of co-process rp, which has been removed from
+ * meth_procbypid by meth_exitchildren(), with its wait() status. 
+ * Unless it was stopped, it is forgotten so that the job's next 
+ * run starts a new one. If it died during a run, what was written is 
+ * relayed and the run ends as a failure. The caller frees rp.
+ */
+void meth_coprocexit(struct meth_runprocinfo *rp,	/* co-process */
+		     int status				/* wait() status */)
+{
+     struct meth_runset *rset;
+
+     /* log the death */
+     elog_startprintf(INFO, "coproc job %-10s pid %d: ", rp->key, rp->pid);
+     if (WIFEXITED(status))
+	  elog_contprintf(INFO, " exit=%d ", WEXITSTATUS(status));
+     else if (WIFSIGNALED(status))
+	  elog_contprintf(INFO, " signal=%d %s ", WTERMSIG(status),
+			  strsignal(WTERMSIG(status)));
+     else
+	  elog_contprintf(INFO, " UNKNOWN KILL ");
+     elog_endprintf(INFO, " runs=%d took=%.0fs", rp->nruns, 
+		    difftime(time(NULL), rp->start));
+
+     /* meth_coprocstop() has already let go of it */
+     if (tree_find(meth_coprocbykey, rp->key) != rp)
+	  return;
+
+     /* forget it first, as the job may run again from the callbacks */
+     tree_rm(meth_coprocbykey);
+     close(rp->cmdfd);
+     rp->cmdfd = -1;
+     rset = tree_find(meth_rsetbykey, rp->key);
+     if (rset == TREE_NOVAL)
+	  elog_die(FATAL, "method key %s not in meth_rsetbykey", rp->key);
+
+     /* relay what is left in the pipes, which may end the run */
+     if (rp->errfd != -1) {
+	  meth_relayfd(rp, rset, rp->errfd);
+	  if (rp->errfd != -1)
+	       meth_relayclose(rp, rp->errfd);
+     }
+     if (rp->resfd != -1) {
+	  meth_relayfd(rp, rset, rp->resfd);
+	  if (rp->resfd != -1)
+	       meth_relayclose(rp, rp->resfd);
+     }
+     if ( ! rp->busy )
+	  return;
+
+     /* died during a run, which has not ended, so rset is still open */
+     elog_printf(ERROR, "coproc job %s died during run %d; restarting on "
+		 "the next run", rp->key, rp->nruns);
+     if (rp->relaylen)
+	  meth_priv_coprocwrite(rp, rset, rp->relaylen, rp->relaylen);
+     route_flush(rset->res);
+     route_flush(rset->err);
+     rp->busy = 0;
+     rset->pid = -1;
+     if (rset->oneshot)
+	  meth_endrun(rp->key, 0, "unknown", rset->res_purl, 
+		      rset->err_purl, 0);
+     callback_raise(METH_CB_FINISHED, rp->key, NULL, NULL, NULL);
+}
+
+
+/*
+ * Stop co-process rp at the end of its job's runs. Closing stdin 
+ * asks it to finish and meth_kill() makes sure; any further output is
+ * discarded. Its death is collected by meth_exitchildren() as usual.
+ */
+void meth_coprocstop(struct meth_runprocinfo *rp	/* co-process */)
+{
+     if (tree_find(meth_coprocbykey, rp->key) == rp)
+	  tree_rm(meth_coprocbykey);
+     close(rp->cmdfd);
+     rp->cmdfd = -1;
+     if (rp->resfd != -1)
+	  meth_relayclose(rp, rp->resfd);
+     if (rp->errfd != -1)
+	  meth_relayclose(rp, rp->errfd);
+     rp->relaylen = 0;
+     meth_kill(rp);
+}
+
+
+/* Write the first len characters held in the relay buffer of co-process
+ * rp to the job's results, then discard the first used characters */
+void meth_priv_coprocwrite(struct meth_runprocinfo *rp, 
+			   struct meth_runset *rset, int len, int used)
+{
+     if (len > 0 && route_write(rset->res, rp->relaybuf, len) < 0)
+	  elog_die(FATAL, "route problem from res: key %s, start %d "
+		   "res %s err %s", rp->key, rp->start, rset->res_purl, 
+		   rset->err_purl);
+     memmove(rp->relaybuf, rp->relaybuf + used, rp->relaylen - used);
+     rp->relaylen -= used;
+}
+
+
 #if TEST
 #include "rt_file.h"
 #include "rt_std.h"
+#define TSNAPIN  "t.meth.in"
+#define TSNAPOUT "t.meth.out"
+#define TNTHREADJOBS 6
+#define TCOPROCSH  "t.meth.coproc.sh"
+#define TCOPROCOUT "t.meth.coproc.out"
+#define TCOPROCCMD "sh " TCOPROCSH
 
 int main(int argc, char **argv) {
      struct meth_info *runthis;
-     int r;
-     ROUTE err;
+     struct meth_runprocinfo *rp;
+     int r, i, len, pid=0;
+     ROUTE err, in;
+     char key[20], purl[40], *data;
 
      route_init(NULL, 0);
      route_register(&rt_filea_method);
@@ -1448,6 +2398,106 @@ int main(int argc, char **argv) {
      err = route_open("stderr:", NULL, NULL, 0);
      sig_init();
      callback_init();
+     meth_init(argc, argv, NULL);
+     route_register(&rt_mem_method);
+
+     /* threaded test: only methods that run in the dispatcher can be
+      * moved to threads */
+     if (meth_settype("exec", METH_THREAD) != -1) {
+	  fprintf(stderr, "exec should not run in a thread\n");
+	  exit(1);
+     }
+     if (meth_settype("snap", METH_THREAD) || meth_setthreads(4)) {
+	  fprintf(stderr, "Can't set snap to run in threads\n");
+	  exit(1);
+     }
+
+     /* run more snap jobs than threads, each copying a file to its own
+      * output, then wait for them all to finish */
+     in = route_open("fileov:" TSNAPIN, NULL, NULL, 1);
+     route_printf(in, "snapped by a thread\n");
+     route_close(in);
+     runthis = meth_lookup("snap");
+     for (i=0; i < TNTHREADJOBS; i++) {
+	  sprintf(key, "thread%d", i);
+	  sprintf(purl, "fileov:" TSNAPOUT "%d", i);
+	  r = meth_execute(key, runthis, "file:" TSNAPIN, purl, "stderr:", 
+			   10);
+	  if (r) {
+	       fprintf(stderr, "thread job %d returned %d\n", i, r);
+	       exit(1);
+	  }
+	  if ( ! meth_isrunning(key) ) {
+	       fprintf(stderr, "thread job %d not running\n", i);
+	       exit(1);
+	  }
+     }
+     for (i=0; i < TNTHREADJOBS; i++) {
+	  sprintf(key, "thread%d", i);
+	  while (meth_isrunning(key))
+	       meth_relay();
+	  sprintf(purl, "file:" TSNAPOUT "%d", i);
+	  data = route_read(purl, NULL, &len);
+	  if ( ! data || len != 20 || 
+	       strncmp(data, "snapped by a thread\n", 20) != 0) {
+	       fprintf(stderr, "thread job %d output wrong: %s\n", i, 
+		       data ? data : "(none)");
+	       exit(1);
+	  }
+	  nfree(data);
+	  unlink(purl + 5);
+     }
+     unlink(TSNAPIN);
+     if (meth_setthreads(2) != -1) {
+	  fprintf(stderr, "pool size should be fixed once started\n");
+	  exit(1);
+     }
+
+     /* co-process test: runs are triggered in the same process, which
+      * is started again on the next run if it dies */
+     in = route_open("fileov:" TCOPROCSH, NULL, NULL, 1);
+     route_printf(in, "while read n; do echo \"run $n\"; echo .; done\n");
+     route_close(in);
+     unlink(TCOPROCOUT);
+     runthis = meth_lookup("coproc");
+     meth_startrun("coproc", runthis, TCOPROCCMD, "file:" TCOPROCOUT, 
+		   "stderr:", 10);
+     for (i=1; i <= 4; i++) {
+	  if (i == 4) {
+	       kill(pid, SIGKILL);
+	       while (tree_find(meth_coprocbykey, "coproc") != TREE_NOVAL)
+		    meth_relay();
+	  }
+	  r = meth_execute("coproc", runthis, TCOPROCCMD, 
+			   "file:" TCOPROCOUT, "stderr:", 10);
+	  if (r || ! meth_isrunning("coproc")) {
+	       fprintf(stderr, "coproc run %d returned %d\n", i, r);
+	       exit(1);
+	  }
+	  while (meth_isrunning("coproc"))
+	       meth_relay();
+	  rp = tree_find(meth_coprocbykey, "coproc");
+	  if (rp == TREE_NOVAL || (i > 1 && i < 4 && rp->pid != pid) ||
+	      (i == 4 && rp->pid == pid)) {
+	       fprintf(stderr, "coproc run %d in the wrong process\n", i);
+	       exit(1);
+	  }
+	  pid = rp->pid;
+     }
+     meth_endrun("coproc", runthis, TCOPROCCMD, "file:" TCOPROCOUT, 
+		 "stderr:", 10);
+     if (tree_find(meth_coprocbykey, "coproc") != TREE_NOVAL) {
+	  fprintf(stderr, "coproc not stopped\n");
+	  exit(1);
+     }
+     data = route_read("file:" TCOPROCOUT, NULL, &len);
+     if ( ! data || strcmp(data, "run 1\nrun 2\nrun 3\nrun 1\n") != 0) {
+	  fprintf(stderr, "coproc output wrong: %s\n", data ? data : "(none)");
+	  exit(1);
+     }
+     nfree(data);
+     unlink(TCOPROCSH);
+     unlink(TCOPROCOUT);
 
      /* Simple test is to load the default `exec' action then run it! */
      if (meth_load("./t.meth.exec.so")) {
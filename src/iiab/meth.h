@@ -12,10 +12,15 @@
 #include <time.h>
 #include "tree.h"
 #include "route.h"
+#include "cf.h"
 
 /* five seconds time out in the relay or standby function */
 #define METH_RELAY_TOSEC 30
 #define METH_RELAY_TOUSEC 0
+/* size of each job's buffer for relaying its output to routes */
+#define METH_RELAYBUFSZ 65536
+/* most events collected by each relay */
+#define METH_RELAY_MAXEVENTS 64
 /* maximum length of descriptions */
 #define METH_DESC_LEN 64
 /* signals with which to abort jobs */
@@ -28,6 +33,17 @@
 #define METH_SHUT_BUTCHERUSEC 0
 /* callback identifier */
 #define METH_CB_FINISHED "meth_finished"
+/* default number of threads running METH_THREAD jobs */
+#define METH_THREADS 4
+/* pid given to a job running in a thread */
+#define METH_PID_THREAD -2
+/* callback raised when threads have finished jobs */
+#define METH_CB_THREADDONE "meth_threaddone"
+/* configuration: size of the thread pool and methods to run in it */
+#define METH_CF_THREADS "meth.threads"
+#define METH_CF_THREAD  "meth.thread"
+/* line sent by a co-process (METH_COPROC) to end each run's result */
+#define METH_COPROC_EOR "."
 
 extern TREE *meth_methods;	/* Loaded methods; tree of meth_info by name */
 
@@ -76,12 +92,37 @@ struct meth_runprocinfo {
      time_t start;	/* time proccess was started */
      int resfd;		/* per-run file descriptor for incomming results */
      int errfd;		/* per-run file descriptor for incomming errors */
+     char *relaybuf;	/* METH_RELAYBUFSZ buffer used to relay output 
+			 * from resfd & errfd to routes, NULL until used */
+     int nkills;	/* number of meth_kill() & meth_butcher() signals */
+     /* the following are only used by co-processes (METH_COPROC) */
+     int coproc;	/* 1 if a co-process, 0 if a METH_FORK process */
+     int cmdfd;		/* trigger channel to the process's stdin or -1 */
+     int nruns;		/* number of runs triggered */
+     int busy;		/* 1 if a run has been triggered but not ended */
+     time_t trigger;	/* time the last run was triggered */
+     int relaylen;	/* characters of result held in relaybuf */
+     int midline;	/* relaybuf starts part way through a line */
+};
+
+/* per job structure for methods run in the thread pool (METH_THREAD) */
+struct meth_runthrinfo {
+     char *key;		/* job key or identifier */
+     METHID run;	/* method specification */
+     char *command;	/* command string */
+     struct meth_runset *rset;	/* job's routes, written on completion */
+     ROUTE res;		/* memory route holding results until finished */
+     ROUTE err;		/* memory route holding errors until finished */
+     int ret;		/* return code from action() */
+     time_t start;	/* time job was queued */
+     struct meth_runthrinfo *next;	/* next in queue or done list */
 };
 
 
 /* Functional prototypes */
 void meth_init();
 void meth_fini();
+void meth_configure(CF_VALS cf);
 void meth_add(struct meth_info *newm);
 int  meth_load(char *fname);
 void meth_dump();
@@ -108,7 +149,28 @@ void meth_butcher(struct meth_runprocinfo *rp);
 void meth_sigchild(int signum);
 void meth_exitchildren();
 int  meth_relay();
+int  meth_relayfd(struct meth_runprocinfo *rp, struct meth_runset *rset, 
+		  int fd);
+void meth_relayclose(struct meth_runprocinfo *rp, int fd);
+void meth_relay_watch(int fd, int edge);
+void meth_relay_unwatch(int fd);
 int  meth_shutdown();
+int  meth_setthreads(int nthreads);
+int  meth_settype(char *name, enum exectype type);
+enum exectype meth_type(METHID run);
+int  meth_threadstart();
+void meth_threadstop();
+void *meth_thread(void *unused);
+void meth_threaddone();
+struct meth_runprocinfo *meth_coprocstart(char *key, METHID run, 
+					  char *command, 
+					  struct meth_runset *rset);
+int  meth_coproctrigger(struct meth_runprocinfo *rp, 
+			struct meth_runset *rset);
+int  meth_relaycoproc(struct meth_runprocinfo *rp, struct meth_runset *rset);
+void meth_coprocdone(struct meth_runprocinfo *rp, struct meth_runset *rset);
+void meth_coprocexit(struct meth_runprocinfo *rp, int status);
+void meth_coprocstop(struct meth_runprocinfo *rp);
 
 /* Macros */
 	/* Return name as a string */
@@ -122,8 +184,11 @@ int  meth_shutdown();
 enum exectype {	METH_NONE,	/* no method */
 		METH_FORK,	/* fork() before running (*action)() */
 		METH_THREAD,	/* run (*action)() in a thread */
-		METH_SOURCE	/* run (*action)() in the same process 
+		METH_SOURCE,	/* run (*action)() in the same process 
 				 * as the dispatcher */
+		METH_COPROC	/* fork() once to run (*action)() as a 
+				 * co-process, then trigger each run with
+				 * a line on its stdin */
 	      };
 
 /* Generic functional prototypes for loadable modules */
@@ -16,6 +16,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include "nmalloc.h"
+#include "ptree.h"
 #include "cf.h"
 #include "iiab.h"
 #include "meth_b.h"
@@ -46,6 +47,15 @@ struct meth_info meth_builtins[]= {
        meth_builtin_sh_action,		/* action - JFDI!*/
        NULL,				/* end of run finalisation */
        NULL				/* name of shared library */ },
+     /* co-process method */
+     { meth_builtin_coproc_id,		/* method id */
+       meth_builtin_coproc_info,	/* text description */
+       meth_builtin_coproc_type,	/* one of METH_{SOURCE,FORK,THREAD} */
+       NULL,				/* start of run initialisation */
+       NULL,				/* pre-action call */
+       meth_builtin_exec_action,	/* action - exec(2) once */
+       NULL,				/* end of run finalisation */
+       NULL				/* name of shared library */ },
      /* snapshot method */
      { meth_builtin_snap_id,		/* method id */
        meth_builtin_snap_info,		/* text description */
@@ -153,7 +163,7 @@ enum exectype meth_builtin_exec_type() { return METH_FORK; }
  */
 int meth_builtin_exec_action(char *command, ROUTE output, ROUTE error, 
 			     struct meth_runset *rset) {
-	char **argv;
+	char **argv, *tokpos;
 	char *args;
 	int i;
 
@@ -168,8 +178,8 @@ int meth_builtin_exec_action(char *command, ROUTE output, ROUTE error,
 	args = xnstrdup(command);
 	argv = xnmalloc(100 * sizeof(char *));	/* Assume max of 100 args */
 	i = 0;
-	argv[i++] = strtok(args, " ");
-	while((argv[i] = strtok(NULL, " ")) != NULL) {
+	argv[i++] = strtok_r(args, " ", &tokpos);
+	while((argv[i] = strtok_r(NULL, " ", &tokpos)) != NULL) {
 	     /*printf("arg[%d] = %s", i, argv[i]);*/
 	     i++;
 	}
@@ -199,6 +209,19 @@ int meth_builtin_sh_action(char *command) {
 }
 
 
+/* ----- builtin coproc (co-process) method ----- */
+char *meth_builtin_coproc_id() { return "coproc"; }
+char *meth_builtin_coproc_info() { return "Persistent exec(2), line per run"; }
+enum exectype meth_builtin_coproc_type() { return METH_COPROC; }
+
+/*
+ * The command is run by meth_builtin_exec_action() when the job first
+ * runs and is kept running for later ones. Each run sends it a line on
+ * stdin, to which it should reply with its result on stdout followed
+ * by a line containing only METH_COPROC_EOR (`.'). See meth_coprocstart().
+ */
+
+
 /* ----- builtin snap (snapshot) method ----- */
 char *meth_builtin_snap_id() { return "snap"; }
 char *meth_builtin_snap_info() { return "Take a snapshot of a route"; }
@@ -259,7 +282,9 @@ int meth_builtin_tstamp_action(char *command, ROUTE output, ROUTE error) {
 
 
 /* ----- builtin sample method ----- */
-PTREE *cascade_tab=NULL;	/* table of CASCADE, keyed by output route */
+PTREE *cascade_tab=NULL;	/* table of CASCADE, keyed by output route,
+				 * guarded by cascade_lock() so that sample
+				 * may run in threads */
 char *meth_builtin_sample_id() { return "sample"; }
 char *meth_builtin_sample_info() { return "Sample tables from a timestore "
 					"and produce a single table"; }
@@ -290,7 +315,7 @@ enum exectype meth_builtin_sample_type() { return METH_SOURCE; }
 int meth_builtin_sample_init(char *command, ROUTE output, ROUTE error, 
 			     struct meth_runset *rset)
 {
-     char *fntxt, *intxt;
+     char *fntxt, *intxt, *statepurl;
      int spn1, spn2;
      enum cascade_fn fn;
      CASCADE *sampinfo;
@@ -343,15 +368,25 @@ int meth_builtin_sample_init(char *command, ROUTE output, ROUTE error,
      }
 
      /* initialise this cascade */
+     cascade_lock();
      sampinfo = cascade_init(fn, intxt);
      if ( ! sampinfo )
 	  route_printf(error, "unable to sample - method: %s, "
 		      "command: %s\n", "sample", command);
 
+     /* keep the running state beside a ringstore output, so that a 
+      * restart carries on without reading the input again */
+     statepurl = sampinfo ? cascade_statepurl(route_getpurl(output)) : NULL;
+     if (statepurl) {
+	  cascade_resume(sampinfo, statepurl);
+	  nfree(statepurl);
+     }
+
      /* save the returned details in cascade_tab */
      if (cascade_tab == NULL)
 	  cascade_tab = ptree_create();
      ptree_add(cascade_tab, rset, sampinfo);
+     cascade_unlock();
 
      return 0;
 }
@@ -360,6 +395,7 @@ int meth_builtin_sample_action(char *command, ROUTE output, ROUTE error,
 			       struct meth_runset *rset)
 {
      CASCADE *sampent;
+     int r;
 
      if (command == NULL) {
 	  route_printf(error, "no command supplied - probe: %s, "
@@ -367,7 +403,9 @@ int meth_builtin_sample_action(char *command, ROUTE output, ROUTE error,
 	  return -1;
      }
 
+     cascade_lock();
      if (cascade_tab == NULL) {
+	  cascade_unlock();
 	  route_printf(error, "not successfully initialised - probe: %s, "
 		       "output: %s\n", "sample", route_getpurl(output));
 	  return -1;
@@ -376,12 +414,16 @@ int meth_builtin_sample_action(char *command, ROUTE output, ROUTE error,
      /* fetch sample entry */
      sampent = ptree_find(cascade_tab, rset);
      if (sampent == PTREE_NOVAL) {
+	  cascade_unlock();
 	  route_printf(error, "can't find details - probe: %s, "
 		      "command: %s\n", "sample", command);
 	  return -1;
      }
 
-     return cascade_sample(sampent, output, error);
+     r = cascade_sample(sampent, output, error);
+     cascade_unlock();
+
+     return r;
 }
 
 int meth_builtin_sample_fini(char *command, ROUTE output, ROUTE error,
@@ -393,8 +435,10 @@ int meth_builtin_sample_fini(char *command, ROUTE output, ROUTE error,
      	  return -1;
 
      /* fetch sample entry */
+     cascade_lock();
      sampent = ptree_find(cascade_tab, rset);
      if (sampent == ITREE_NOVAL) {
+	  cascade_unlock();
 	  route_printf(error, "can't find details - probe: %s, "
 		      "command: %s\n", "sample", command);
 	  return -1;
@@ -403,6 +447,7 @@ int meth_builtin_sample_fini(char *command, ROUTE output, ROUTE error,
      /* close open resources and free storage */
      cascade_fini(sampent);
      ptree_rm(cascade_tab);
+     cascade_unlock();
 
      return 0;
 }
@@ -780,6 +825,7 @@ enum exectype meth_builtin_rep_type() { return METH_FORK; }
 int meth_builtin_rep_action(char *command, 
 			    ROUTE output, ROUTE error,
 			    struct meth_runset *rset) {
+     char *tokpos;
      char *invar, *outvar, *state, *cmd, *errfld, *val1, *val2,
 	  *inval=NULL, *outval=NULL, *expstate=NULL;
      int r;
@@ -794,9 +840,9 @@ int meth_builtin_rep_action(char *command,
 
      /* copy and separate arguments, raise an error if anything is missing */
      cmd = xnstrdup(command);
-     invar  = strtok(cmd, " \t");
-     outvar = strtok(NULL, " \t");
-     state  = strtok(NULL, " \t");
+     invar  = strtok_r(cmd, " \t", &tokpos);
+     outvar = strtok_r(NULL, " \t", &tokpos);
+     state  = strtok_r(NULL, " \t", &tokpos);
 
      errfld = NULL;
      if (invar == NULL)
@@ -823,10 +869,10 @@ int meth_builtin_rep_action(char *command,
      if (val1) {
 	  inval = xnmalloc((strlen(val1)*4)+100);	/* enough space */
 	  route_expand(inval, val1, "NOJOB", 0);
-	  val2 = strtok(inval, ";");
+	  val2 = strtok_r(inval, ";", &tokpos);
 	  while (val2) {
 	       itree_append(inlist, val2);
-	       val2 = strtok(NULL, ";");
+	       val2 = strtok_r(NULL, ";", &tokpos);
 	  }
      }
 
@@ -841,10 +887,10 @@ int meth_builtin_rep_action(char *command,
      if (val1) {
 	  outval = xnmalloc((strlen(val1)*4)+100);	/* enough space */
 	  route_expand(outval, val1, "NOJOB", 0);
-	  val2 = strtok(outval, ";");
+	  val2 = strtok_r(outval, ";", &tokpos);
 	  while (val2) {
 	       itree_append(outlist, val2);
-	       val2 = strtok(NULL, ";");
+	       val2 = strtok_r(NULL, ";", &tokpos);
 	  }
      }
 
@@ -21,6 +21,9 @@ char         *meth_builtin_sh_id();
 char         *meth_builtin_sh_info();
 enum exectype meth_builtin_sh_type();
 int           meth_builtin_sh_action(char *command);
+char         *meth_builtin_coproc_id();
+char         *meth_builtin_coproc_info();
+enum exectype meth_builtin_coproc_type();
 char         *meth_builtin_snap_id();
 char         *meth_builtin_snap_info();
 enum exectype meth_builtin_snap_type();
@@ -16,9 +16,10 @@
 
 #if NMALLOC
 /* This code implements the definitions for leak checking in nmalloc.
- * WARNING! non-reenterent */
+ * WARNING! non-reenterent; threads are serialised by nm_lock */
 #include <execinfo.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "ptree.h"
 #include "cf.h"
 #include "iiab.h"
@@ -36,6 +37,8 @@ int nm_active = 1;	/* if nmalloc checking has been activated from
 			 * by default so the first call goes through
 			 * to initialise the class */
 void *nm_backtrace[NM_BACKTRACE_SZ];
+pthread_mutex_t nm_lock = PTHREAD_MUTEX_INITIALIZER; /* guards nm_used and
+						       * nm_backtrace */
 
 /* special version of ptree_create for nmalloc only that only uses malloc
  * rather than our own nmalloc that causes dependency problems at run time.
@@ -80,6 +83,7 @@ void nm_add(enum nm_origin meth, void *aloc, size_t sz, char *rfile,
 	    int rline, const char *rfunc) {
      struct nm_userec *log;
 
+     pthread_mutex_lock(&nm_lock);
      if ( nm_used ) {
           if ( (log = ptree_find(nm_used, aloc)) != PTREE_NOVAL)
 	       fprintf(stderr, "nm_add() allocation already in table\n"
@@ -114,6 +118,7 @@ void nm_add(enum nm_origin meth, void *aloc, size_t sz, char *rfile,
      log->backtrace = backtrace_symbols(nm_backtrace, log->n_backtrace);
 
      ptree_add(nm_used, aloc, log);
+     pthread_mutex_unlock(&nm_lock);
 }
 
 /* remove an allocation entry from the table */
@@ -121,6 +126,7 @@ void nm_rm(enum nm_origin meth, void *aloc, char *rfile, int rline,
 	   const char *rfunc) {
      struct nm_userec *log;
 
+     pthread_mutex_lock(&nm_lock);
      if ( ! nm_used ) {
           fprintf(stderr, "nm_rm() table does not exist - %s %p %s:%d:%s\n",
 		  nm_names[meth], aloc, rfile, rline, rfunc);
@@ -133,6 +139,7 @@ void nm_rm(enum nm_origin meth, void *aloc, char *rfile, int rline,
      }
 
      ptree_rm(nm_used);
+     pthread_mutex_unlock(&nm_lock);
      free(log->reqfile);
      free(log->reqfunc);
      if (log->backtrace)
@@ -144,6 +151,8 @@ void nm_rm(enum nm_origin meth, void *aloc, char *rfile, int rline,
 int nm_isalloc(void *aloc)
 {
 #if NMALLOC
+     int r;
+
      if ( ! nm_active )
 	  return 0;
 
@@ -152,10 +161,11 @@ int nm_isalloc(void *aloc)
 	  return 0;
      }
 
-     if (ptree_find(nm_used, aloc) == PTREE_NOVAL)
-	  return 0;
-     else
-	  return 1;
+     pthread_mutex_lock(&nm_lock);
+     r = ptree_find(nm_used, aloc) != PTREE_NOVAL;
+     pthread_mutex_unlock(&nm_lock);
+
+     return r;
 #else
      return 0;
 #endif		/* NMALLOC */
@@ -196,9 +206,260 @@ void nm_rpt() {
      }
 }
 
+#else
+
+/* leak checking is only carried out in NMALLOC builds */
+void nm_deactivate() {}
+int  nm_isalloc(void *aloc) { return 0; }
+void nm_rpt() {}
+
 #endif /* NMALLOC */
 
 
+#if NMSAMPLE
+/* This code implements the sampling profiler in nmalloc.
+ * Reentrant and lock free, using gcc atomic builtins */
+#include <math.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include "table.h"
+#include "route.h"
+#include "util.h"
+
+#define NM_TOMB ((void *) 1)	/* sample slot that has been freed */
+
+/* a live sampled allocation */
+struct nm_sample {
+     void * volatile addr;	/* allocation, NULL if empty or NM_TOMB */
+     int   site;		/* index into nm_sites */
+     long long weight;		/* estimated bytes represented */
+};
+
+struct nm_site   nm_sites[NM_SITES];	/* call sites, hashed by file & line */
+struct nm_sample nm_samples[NM_SAMPLED];/* live samples, hashed by address */
+long nm_sample_mean = NM_SAMPLEMEAN;	/* mean bytes between samples, 0=off */
+volatile long nm_sample_nlive;		/* number of live samples */
+volatile long nm_sample_dropped;	/* samples not held as tables full */
+volatile int  nm_sample_gen = 1;	/* changes when the mean changes */
+__thread long long nm_sample_left;	/* bytes until this thread samples */
+__thread int  nm_sample_thrgen;		/* gen when nm_sample_left drawn */
+__thread unsigned long long nm_sample_rand; /* thread's random state */
+
+/* Set the mean number of bytes allocated between samples; 0 turns 
+ * sampling off. Applies to every thread at its next sample */
+void nm_sample_setmean(long mean)
+{
+     nm_sample_mean = mean < 0 ? 0 : mean;
+     __sync_fetch_and_add(&nm_sample_gen, 1);
+     nm_sample_left = 0;
+}
+
+/* Return the mean number of bytes between samples, or 0 if off */
+long nm_sample_getmean()
+{
+     return nm_sample_mean;
+}
+
+/* Draw the number of bytes until this thread's next sample from an 
+ * exponential distribution, giving a Poisson process over bytes */
+long long nm_sample_next()
+{
+     double u;
+
+     nm_sample_thrgen = nm_sample_gen;
+     if (nm_sample_mean == 0)
+	  return LLONG_MAX;
+
+     /* xorshift64*, seeded per thread */
+     if (nm_sample_rand == 0)
+	  nm_sample_rand = ((unsigned long long) (long) &nm_sample_rand) ^ 
+	       ((unsigned long long) time(NULL) << 20) ^ 0x9e3779b97f4a7c15ULL;
+     nm_sample_rand ^= nm_sample_rand >> 12;
+     nm_sample_rand ^= nm_sample_rand << 25;
+     nm_sample_rand ^= nm_sample_rand >> 27;
+     u = ((nm_sample_rand * 2685821657736338717ULL >> 11) + 1) / 
+	  9007199254740992.0;		/* (0,1] */
+
+     return (long long) (-log(u) * nm_sample_mean);
+}
+
+/* Find or claim the slot for a call site, returning its index or -1 if
+ * the site table is full */
+int nm_sample_site(char *rfile, int rline, const char *rfunc)
+{
+     struct nm_site *st;
+     int i, n;
+
+     i = (((unsigned long) rfile >> 3) * 31 + rline) & (NM_SITES-1);
+     for (n=0; n < NM_SITES; n++, i = (i+1) & (NM_SITES-1)) {
+	  st = &nm_sites[i];
+	  if (st->state == 0 && __sync_bool_compare_and_swap(&st->state,0,1)){
+	       st->file = rfile;
+	       st->line = rline;
+	       st->func = rfunc;
+	       __sync_synchronize();
+	       st->state = 2;
+	       return i;
+	  }
+	  while (st->state == 1)
+	       ;			/* another thread is filling it */
+	  if (st->line == rline && (st->file == rfile || 
+				    strcmp(st->file, rfile) == 0))
+	       return i;
+     }
+
+     return -1;
+}
+
+/* Sample the allocation aloc of sz bytes made at rfile:rline, which is
+ * called when the thread's byte count to its next sample runs out */
+void nm_sample_add(void *aloc, size_t sz, char *rfile, int rline, 
+		   const char *rfunc)
+{
+     struct nm_site *st;
+     long long weight, live, peak;
+     int site, i, n;
+
+     if (nm_sample_thrgen != nm_sample_gen) {
+	  /* first allocation in this thread or the mean has changed: 
+	   * start counting without sampling */
+	  nm_sample_left = nm_sample_next();
+	  return;
+     }
+     nm_sample_left = nm_sample_next();
+     if (sz == 0)
+	  return;
+
+     /* each sample stands for sz / P(sampled), an unbiased estimate */
+     weight = (long long) (sz / (1.0 - exp(-(double) sz / nm_sample_mean)));
+
+     site = nm_sample_site(rfile, rline, rfunc);
+     if (site == -1) {
+	  __sync_fetch_and_add(&nm_sample_dropped, 1);
+	  return;
+     }
+
+     /* remember the sample so that its free can be accounted */
+     i = ((unsigned long) aloc >> 4) & (NM_SAMPLED-1);
+     for (n=0; n < NM_PROBEMAX; n++, i = (i+1) & (NM_SAMPLED-1)) {
+	  if ((nm_samples[i].addr == NULL && 
+	       __sync_bool_compare_and_swap(&nm_samples[i].addr, NULL, aloc))
+	      || (nm_samples[i].addr == NM_TOMB && 
+	       __sync_bool_compare_and_swap(&nm_samples[i].addr, NM_TOMB, 
+					    aloc)))
+	       break;
+     }
+     if (n == NM_PROBEMAX) {
+	  __sync_fetch_and_add(&nm_sample_dropped, 1);
+	  return;
+     }
+     nm_samples[i].site   = site;
+     nm_samples[i].weight = weight;
+     __sync_fetch_and_add(&nm_sample_nlive, 1);
+
+     /* account against the site */
+     st = &nm_sites[site];
+     __sync_fetch_and_add(&st->samples, 1);
+     __sync_fetch_and_add(&st->total, weight);
+     live = __sync_add_and_fetch(&st->live, weight);
+     while ((peak = st->peak) < live && 
+	    ! __sync_bool_compare_and_swap(&st->peak, peak, live))
+	  ;
+}
+
+/* Forget aloc if it was sampled, as it is about to be freed */
+void nm_sample_rm(void *aloc)
+{
+     struct nm_site *st;
+     void *addr;
+     int i, n;
+
+     i = ((unsigned long) aloc >> 4) & (NM_SAMPLED-1);
+     for (n=0; n < NM_PROBEMAX; n++, i = (i+1) & (NM_SAMPLED-1)) {
+	  addr = nm_samples[i].addr;
+	  if (addr == NULL)
+	       return;
+	  if (addr == aloc) {
+	       st = &nm_sites[nm_samples[i].site];
+	       __sync_fetch_and_add(&st->freed, 1);
+	       __sync_fetch_and_sub(&st->live, nm_samples[i].weight);
+	       __sync_fetch_and_sub(&nm_sample_nlive, 1);
+	       nm_samples[i].addr = NM_TOMB;
+	       return;
+	  }
+     }
+}
+
+/* 
+ * Return a TABLE of the sampled call sites, with estimated live, peak and
+ * total bytes allocated by each, largest live first.
+ * The table should be table_destroy()ed after use.
+ */
+TABLE nm_sample_table()
+{
+     char *cols[] = {"site", "func", "samples", "freed", "live", "peak", 
+		     "total", NULL};
+     char name[1024];
+     struct nm_site *st, *order[NM_SITES];
+     int i, j, n=0;
+     TABLE tab;
+
+     /* snapshot the sites in use, ordered by live bytes */
+     for (i=0; i < NM_SITES; i++) {
+	  if (nm_sites[i].state != 2)
+	       continue;
+	  st = &nm_sites[i];
+	  for (j=n++; j > 0 && order[j-1]->live < st->live; j--)
+	       order[j] = order[j-1];
+	  order[j] = st;
+     }
+
+     tab = table_create_a(cols);
+     table_usearena(tab, 0);
+     for (i=0; i < n; i++) {
+	  st = order[i];
+	  table_addemptyrow(tab);
+	  snprintf(name, 1024, "%s:%d", st->file, st->line);
+	  table_replacecurrentcell_alloc(tab, "site", name);
+	  table_replacecurrentcell_alloc(tab, "func", (char *) st->func);
+	  table_replacecurrentcell_alloc(tab, "samples", 
+					 util_i32toa(st->samples));
+	  table_replacecurrentcell_alloc(tab, "freed", util_i32toa(st->freed));
+	  table_replacecurrentcell_alloc(tab, "live", util_i64toa(st->live));
+	  table_replacecurrentcell_alloc(tab, "peak", util_i64toa(st->peak));
+	  table_replacecurrentcell_alloc(tab, "total", util_i64toa(st->total));
+     }
+
+     return tab;
+}
+
+/* Append the sampled call sites to the route purl, such as a ring.
+ * Prototyped to be run as runq work. Returns 0 for success or -1 */
+int nm_sample_save(char *purl, int len)
+{
+     ROUTE rt;
+     TABLE tab;
+     int r;
+
+     rt = route_open(purl, "memory allocation by call site (sampled)", 
+		     NULL, 100);
+     if ( ! rt ) {
+	  elog_printf(ERROR, "unable to open %s to save allocation sites", 
+		      purl);
+	  return -1;
+     }
+     tab = nm_sample_table();
+     r = route_twrite(rt, tab);
+     table_destroy(tab);
+     route_close(rt);
+
+     return r == -1 ? -1 : 0;
+}
+
+#endif /* NMSAMPLE */
+
+
 /* As malloc(3) but with parameter checking and leak safeguards */
 void *nm_nmalloc(size_t n, char *rfile, int rline, const char *rfunc) {
 	char *q;
@@ -209,10 +470,7 @@ void *nm_nmalloc(size_t n, char *rfile, int rline, const char *rfunc) {
 
 	q = malloc(n);
 
-#if NMALLOC
-	if (nm_active)
-	     nm_add(NM_NMALLOC, q, n, rfile, rline, rfunc);
-#endif
+	nm_track(NM_NMALLOC, q, n, rfile, rline, rfunc);
 
 	return q;
 }
@@ -230,10 +488,7 @@ void *nm_xnmalloc(size_t n, char *rfile, int rline, const char *rfunc) {
 	     elog_die(FATAL, "malloc failed (%d) at %s:%d:%s",
 		      n, rfile, rline, rfunc);;
 
-#if NMALLOC
-	if (nm_active)
-	     nm_add(NM_XNMALLOC, q, n, rfile, rline, rfunc);
-#endif
+	nm_track(NM_XNMALLOC, q, n, rfile, rline, rfunc);
 
 	return q;
 }
@@ -250,17 +505,11 @@ void *nm_nrealloc(void *p, size_t n, char *rfile, int rline,
 	if (p == NULL) {
 		q = malloc(n);
 	} else {
-#if NMALLOC
-	     if (nm_active)
-		  nm_rm(NM_NREALLOC, p, rfile, rline, rfunc);
-#endif
+	     nm_untrack(NM_NREALLOC, p, rfile, rline, rfunc);
 	     q = realloc(p, n);
 	}
 
-#if NMALLOC
-	if (nm_active)
-	     nm_add(NM_NREALLOC, q, n, rfile, rline, rfunc);
-#endif
+	nm_track(NM_NREALLOC, q, n, rfile, rline, rfunc);
 
 	return q;
 }
@@ -277,10 +526,7 @@ void *nm_xnrealloc(void *p, size_t n, char *rfile, int rline,
 	if (p == NULL) {
 		q = malloc(n);
 	} else {
-#if NMALLOC
-	     if (nm_active)
-		  nm_rm(NM_NREALLOC, p, rfile, rline, rfunc);
-#endif
+	     nm_untrack(NM_NREALLOC, p, rfile, rline, rfunc);
 	     q = realloc(p, n);
 	}
 	if (q == NULL)
@@ -288,10 +534,7 @@ void *nm_xnrealloc(void *p, size_t n, char *rfile, int rline,
 		      "realloc failed (%d -> %d) at %s:%d:%s",
 		      p, n, rfile, rline, rfunc);
 
-#if NMALLOC
-	if (nm_active)
-	     nm_add(NM_XNREALLOC, q, n, rfile, rline, rfunc);
-#endif
+	nm_track(NM_XNREALLOC, q, n, rfile, rline, rfunc);
 
 	return q;
 }
@@ -301,10 +544,7 @@ void nm_nfree(void *p, char *rfile, int rline, const char *rfunc) {
 	if (p == NULL)
 	     return;
 
-#if NMALLOC
-	if (nm_active)
-	     nm_rm(NM_NFREE, p, rfile, rline, rfunc);
-#endif
+	nm_untrack(NM_NFREE, p, rfile, rline, rfunc);
 
 	free(p);
 }
@@ -314,10 +554,7 @@ void nm_xnfree(void *p, char *rfile, int rline, const char *rfunc) {
      if (p == NULL)
           return;
 
-#if NMALLOC
-     if (nm_active)
-	  nm_rm(NM_XNFREE, p, rfile, rline, rfunc);
-#endif
+     nm_untrack(NM_XNFREE, p, rfile, rline, rfunc);
 
      free(p);
 }
@@ -331,10 +568,7 @@ char *nm_nstrdup(const char *s, char *rfile, int rline, const char *rfunc) {
 		      rfile, rline, rfunc);
 
 	p = strdup(s);
-#if NMALLOC
-	if (nm_active)
-	     nm_add(NM_NSTRDUP, p, strlen(s)+1, rfile, rline, rfunc);
-#endif
+	nm_track(NM_NSTRDUP, p, strlen(s)+1, rfile, rline, rfunc);
 	return p;
 }
 
@@ -382,10 +616,7 @@ char *nm_xnstrdup(const char *s, char *rfile, int rline, const char *rfunc) {
 	     elog_die(FATAL, "strdup failed at %s:%d:%s",
 		      rfile, rline, rfunc);
 
-#if NMALLOC
-	if (nm_active)
-	     nm_add(NM_XNSTRDUP, p, strlen(s)+1, rfile, rline, rfunc);
-#endif
+	nm_track(NM_XNSTRDUP, p, strlen(s)+1, rfile, rline, rfunc);
 	return p;
 }
 
@@ -405,10 +636,7 @@ void *nm_nmemdup(const void *p, size_t n, char *rfile, int rline,
 	q = malloc(n);
 	if (q != NULL)
 		memcpy(q, p, n);
-#if NMALLOC
-	if (nm_active)
-	     nm_add(NM_NMEMDUP, q, n, rfile, rline, rfunc);
-#endif
+	nm_track(NM_NMEMDUP, q, n, rfile, rline, rfunc);
 	return q;
 }
 
@@ -429,10 +657,7 @@ void *nm_xnmemdup(const void *p, size_t n, char *rfile, int rline,
 	     elog_die(FATAL, "malloc failed");
 	else
 		memcpy(q, p, n);
-#if NMALLOC
-	if (nm_active)
-	     nm_add(NM_XNMEMDUP, q, n, rfile, rline, rfunc);
-#endif
+	nm_track(NM_XNMEMDUP, q, n, rfile, rline, rfunc);
 	return q;
 }
 
@@ -481,16 +706,92 @@ void *nm_xmemdup(const void *p, size_t n, char *rfile, int rline,
 /* forget a location that may have been allocated in the past. 
  * If the location is not present, don't complain! */
 void  nm_forget(void *p, char *rfile, int rline, const char *rfunc) {
-#if NMALLOC
-	if (p && nm_active)
-	     nm_rm(NM_FORGET, p, rfile, rline, rfunc);
-#endif
+	if (p)
+	     nm_untrack(NM_FORGET, p, rfile, rline, rfunc);
 }
 
 /* adopt malloc()'ed into the nm table as if it was our own */
 void  nm_adopt(void *p, char *rfile, int rline, const char *rfunc) {
-#if NMALLOC
-	if (p && nm_active)
-	     nm_add(NM_ADOPT, p, 0, rfile, rline, rfunc);
+	if (p)
+	     nm_track(NM_ADOPT, p, 0, rfile, rline, rfunc);
+}
+
+
+#if TEST
+
+#include <stdio.h>
+#include "table.h"
+
+#define TEST_NALLOC 20000
+#define TEST_SZ     256
+
+int main(int argc, char **argv)
+{
+     char *p, *blocks[TEST_NALLOC];
+     int i;
+#if NMSAMPLE
+     TABLE tab;
+     char *cell, site[1024];
+     int line;
+     long long live, want;
+#endif
+
+     /* test 1: allocate and free */
+     p = xnmalloc(10);
+     strcpy(p, "123456789");
+     p = xnrealloc(p, 100);
+     if (strcmp(p, "123456789"))
+	  elog_die(FATAL, "[1] realloc lost contents");
+     nfree(p);
+
+#if NMSAMPLE
+     /* test 2: sample one site and check the estimate of live bytes */
+     nm_sample_setmean(4096);
+     line = __LINE__ + 2;
+     for (i=0; i < TEST_NALLOC; i++)
+	  blocks[i] = xnmalloc(TEST_SZ);
+     snprintf(site, 1024, "%s:%d", __FILE__, line);
+     want = (long long) TEST_NALLOC * TEST_SZ;
+     tab = nm_sample_table();
+     if (table_search(tab, "site", site) == -1)
+	  elog_die(FATAL, "[2] site %s not sampled", site);
+     live = strtoll(table_getcurrentcell(tab, "live"), NULL, 10);
+     if (live < want * 0.85 || live > want * 1.15)
+	  elog_die(FATAL, "[2] live estimate %lld not near %lld", live, want);
+     cell = table_getcurrentcell(tab, "peak");
+     if (strtoll(cell, NULL, 10) < live)
+	  elog_die(FATAL, "[2] peak %s < live %lld", cell, live);
+     table_destroy(tab);
+
+     /* test 3: free the site's memory and check nothing is live */
+     for (i=0; i < TEST_NALLOC; i++)
+	  nfree(blocks[i]);
+     tab = nm_sample_table();
+     if (table_search(tab, "site", site) == -1)
+	  elog_die(FATAL, "[3] site %s lost", site);
+     cell = table_getcurrentcell(tab, "live");
+     if (strcmp(cell, "0") != 0)
+	  elog_die(FATAL, "[3] live %s != 0 after free", cell);
+     table_destroy(tab);
+
+     /* test 4: turn off sampling */
+     nm_sample_setmean(0);
+     for (i=0; i < TEST_NALLOC; i++)
+	  blocks[i] = xnmalloc(TEST_SZ);
+     for (i=0; i < TEST_NALLOC; i++)
+	  nfree(blocks[i]);
+     if (nm_sample_nlive < 0)
+	  elog_die(FATAL, "[4] %ld live samples", nm_sample_nlive);
+#else
+     /* test 2: many allocations */
+     for (i=0; i < TEST_NALLOC; i++)
+	  blocks[i] = xnmalloc(TEST_SZ);
+     for (i=0; i < TEST_NALLOC; i++)
+	  nfree(blocks[i]);
 #endif
+
+     printf("tests finished successfully\n");
+     exit(0);
 }
+
+#endif /* TEST */
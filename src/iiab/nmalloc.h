@@ -4,6 +4,10 @@
  * memory leaks
  * Based on the public alloc routes.
  *
+ * Compile with NMALLOC for full tracking of every allocation, which is 
+ * for debug builds, or with NMSAMPLE for a low overhead sampling profile
+ * of live and peak memory by call site, suitable for production.
+ *
  * Nigel Stuckey, March 99
  * Copyright System Garden Limited 1999-2001. All rights reserved.
  */
@@ -13,6 +17,12 @@
 
 #include <stddef.h>		/* need size_t */
 
+#define NM_CFNAME     "nmalloc"		 /* config: leak check if !0 */
+#define NM_CFSAMPLE   "nmalloc.sample"	 /* config: mean bytes per sample */
+#define NM_CFRING     "nmalloc.ring"	 /* config: route to save sites to */
+#define NM_CFINTERVAL "nmalloc.interval"/* config: secs between saves */
+#define NM_SAVEINTERVAL 60		 /* default secs between saves */
+
 #if NMALLOC
 
 #include <time.h>
@@ -38,7 +48,6 @@ enum nm_origin {
 	NM_ANON		/* orgin is anonymous */
 };
 
-#define NM_CFNAME "nmalloc"
 #define NM_BACKTRACE_SZ 100
 
 struct nm_userec {
@@ -56,14 +65,76 @@ struct nm_userec {
 extern int nm_active;
 
 PTREE *ptree_createnocheck();
-void nm_deactivate();
 void nm_add(enum nm_origin meth, void *aloc, size_t sz, char *rfile, 
 	    int rline, const char *rfunc);
 void nm_rm(enum nm_origin meth, void *aloc, char *rfile, int rline, 
 	   const char *rfunc);
+
+/* record and forget allocations in the used table */
+#define nm_track(meth,p,sz,rfile,rline,rfunc) \
+     do { if (nm_active) nm_add(meth,p,sz,rfile,rline,rfunc); } while (0)
+#define nm_untrack(meth,p,rfile,rline,rfunc) \
+     do { if (nm_active) nm_rm(meth,p,rfile,rline,rfunc); } while (0)
+
+#elif NMSAMPLE
+
+/*
+ * Sampling profiler. Allocations are sampled as a Poisson process over
+ * the bytes allocated, with a mean of nm_sample_mean bytes between 
+ * samples, so large allocations are more likely to be seen. Each sample 
+ * is weighted to estimate the bytes it represents, and the estimates are 
+ * accumulated against the call site (rfile:rline) that made it.
+ * Unsampled allocations cost a thread local subtraction and unsampled 
+ * frees a test of the number of live samples or a short probe.
+ * Call sites and live samples are held in fixed size, lock free hash
+ * tables so the profiler never allocates and may be used from threads.
+ */
+#define NM_SAMPLEMEAN	524288	/* default mean bytes between samples */
+#define NM_SITES	1024	/* call sites held, power of 2 */
+#define NM_SAMPLED	8192	/* live samples held, power of 2 */
+#define NM_PROBEMAX	32	/* most slots probed for a live sample */
+
+struct nm_site {
+     volatile int state;	/* 0=empty, 1=being claimed, 2=in use */
+     char *file;		/* file of call site (from __FILE__) */
+     int   line;		/* line of call site */
+     const char *func;		/* function of call site */
+     long  samples;		/* number of allocations sampled */
+     long  freed;		/* number of samples freed */
+     long long live;		/* estimated bytes allocated and not freed */
+     long long peak;		/* highest estimate of live */
+     long long total;		/* estimated bytes ever allocated */
+};
+
+extern __thread long long nm_sample_left; /* bytes until next sample */
+extern volatile long nm_sample_nlive;	  /* number of live samples */
+
+void nm_sample_add(void *aloc, size_t sz, char *rfile, int rline, 
+		   const char *rfunc);
+void nm_sample_rm(void *aloc);
+void nm_sample_setmean(long mean);
+long nm_sample_getmean();
+struct table_info *nm_sample_table();
+int  nm_sample_save(char *purl, int len);
+
+/* sample allocations and forget samples when freed */
+#define nm_track(meth,p,sz,rfile,rline,rfunc) \
+     do { if ((nm_sample_left -= (long long) (sz)) < 0 && (p)) \
+	       nm_sample_add(p,sz,rfile,rline,rfunc); } while (0)
+#define nm_untrack(meth,p,rfile,rline,rfunc) \
+     do { if (nm_sample_nlive) nm_sample_rm(p); } while (0)
+
+#else
+
+#define nm_track(meth,p,sz,rfile,rline,rfunc) do { } while (0)
+#define nm_untrack(meth,p,rfile,rline,rfunc) do { } while (0)
+
+#endif /* NMALLOC */
+
+/* leak checking control, which does nothing unless NMALLOC is set */
+void nm_deactivate();
 int  nm_isalloc(void *aloc);
 void nm_rpt();
-#endif /* NMALLOC */
 
 /* underlying function prototypes */
 void *nm_nmalloc(size_t, char *rfile, int rline, const char *rfunc);
@@ -16,6 +16,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 #include "nmalloc.h"
 #include "http.h"
 #include "cf.h"
@@ -27,9 +28,15 @@
 TREE *  route_drivers=NULL;	/* key=prefix, val=ROUTE_METHOD */
 int     route_debug;		/* additional debug flag */
 CF_VALS route_cf;		/* Configuration tree, used to expand purls */
+pthread_mutex_t route_mutex;	/* serialises drivers between threads */
+pthread_once_t  route_mutexonce = PTHREAD_ONCE_INIT;
 
 /* Private functional prototypes */
 ROUTE_METHOD route_priv_get_driver(char *p_url, char **suffix);
+void         route_priv_freechunks(ROUTE rt, int keepfirst);
+char *       route_priv_coalesce(ROUTE rt);
+int          route_priv_flushv(ROUTE rt);
+void         route_priv_mkmutex();
 
 /*
  * Initialise the route class.
@@ -65,12 +72,14 @@ void route_fini()
  */
 void route_register(ROUTE_METHOD meth	/* driver's set of methods */)
 {
+     route_lock();
      if ( tree_find(route_drivers, meth->ll_prefix()) == TREE_NOVAL )
           tree_add(route_drivers, meth->ll_prefix(), (void *) meth);
      else
           tree_put(route_drivers, (void *) meth);
 
      meth->ll_init(route_cf, route_debug);
+     route_unlock();
 }
 
 /*
@@ -80,12 +89,16 @@ void route_register(ROUTE_METHOD meth	/* driver's set of methods */)
  */
 int route_unregister(char *prefix	/* dirver's prefix name */)
 {
-     if ( tree_find(route_drivers, prefix) == TREE_NOVAL ) {
-          return 0;
-     } else {
+     int r=0;
+
+     route_lock();
+     if ( tree_find(route_drivers, prefix) != TREE_NOVAL ) {
           tree_rm(route_drivers);
-	  return 1;
+	  r = 1;
      }
+     route_unlock();
+
+     return r;
 }
 
 /*
@@ -105,6 +118,7 @@ TREE * route_registered()
  * prefix ends, unless suffix is NULL.
  * Requires p-url address to be of the form <prefix>:<suffix>
  * Returns NULL if the driver does not exist
+ * Call with route_lock() held.
  */
 ROUTE_METHOD route_priv_get_driver(char *p_url,  /* pseudo-url */
 				   char **suffix /* p-url after prefix */ ) 
@@ -161,13 +175,19 @@ int route_access(char *p_url,	/* Pseduo-url */
 {
      ROUTE_METHOD meth;
      char *base;
+     int r;
 
+     route_lock();
      meth = route_priv_get_driver(p_url, &base);
      if (!meth) {
+	  route_unlock();
 	  elog_printf(DIAG, "no known driver in %s", p_url);
 	  return 0;
      }
-     return meth->ll_access(p_url, password, base, flags);
+     r = meth->ll_access(p_url, password, base, flags);
+     route_unlock();
+
+     return r;
 }
 
 /*
@@ -198,13 +218,16 @@ ROUTE route_open(char *p_url,	/* Pseduo-url */
      /* drivers must have a copy of purl constant and valid between
       * their open and close callc */
      purl = xnstrdup(p_url);
+     route_lock();
      meth = route_priv_get_driver(purl, &base);
      if (! meth) {
+	  route_unlock();
 	  nfree(purl);
 	  return NULL;
      }
 
      lld  = meth->ll_open(purl, comment, password, keep, base);
+     route_unlock();
      if (lld) {
 	  rt = nmalloc(sizeof(struct route_handle));
 	  rt->p_url  = purl;
@@ -212,6 +235,8 @@ ROUTE route_open(char *p_url,	/* Pseduo-url */
 	  rt->handle = lld;
 	  rt->unsent.buflen = 0;
 	  rt->unsent.buffer = NULL;
+	  rt->unsent.first  = NULL;
+	  rt->unsent.last   = NULL;
 	  return rt;
      } else {
 	  nfree(purl);
@@ -234,9 +259,14 @@ ROUTE route_open_t(char *p_url,		/* Pseduo-url */
 		   int   interval	/* Interval in seconds */ )
 {
      char buf[1000];		/* Compose buffer */
-     
+     ROUTE rt;
+
+     route_lock();
      route_expand(buf, p_url, jobname, interval);
-     return route_open(buf, comment, password, keep);
+     rt = route_open(buf, comment, password, keep);
+     route_unlock();
+
+     return rt;
 }
 
 /*
@@ -360,6 +390,7 @@ int route_expand(char *dst,	/* Destination (expanded) string */
  */
 int route_flush(ROUTE rt /* open, valid route */) {
      int r, ret;
+     char *text;
 
      /* special case: initialising, always success */
      if ( ! rt)
@@ -369,42 +400,60 @@ int route_flush(ROUTE rt /* open, valid route */) {
 	  return 1;	/* nothing to write */
 
      /* debug info for flushing */
+     text = rt->unsent.buffer ? rt->unsent.buffer : 
+	  route_chunktext(rt->unsent.first);
      if (route_debug)
 	  fprintf(stderr, "flushing %s len=%d text=`%.30s'%s\n", 
-		  rt->p_url, rt->unsent.buflen, (char *) rt->unsent.buffer,
+		  rt->p_url, rt->unsent.buflen, text,
 		  (rt->unsent.buflen > 30) ? "...(trunc)" : "");
 
-     /* flush the buffer */
-     if (rt->unsent.buffer) {
-	  r = rt->method->ll_write(rt->handle, rt->unsent.buffer, 
-				   rt->unsent.buflen);
-	  if (r < rt->unsent.buflen) {
-	       fprintf(stderr, "can't write to %s, "
-		       "discarding len=%d text='%.20s'%s", rt->p_url, 
-		       rt->unsent.buflen, rt->unsent.buffer,
-		       (rt->unsent.buflen>20)?"...(truncated)":"");
-	       ret = 0;	/* failure */
-	  } else {
-	       ret = 1;	/* success */
-	  }
-	  nfree(rt->unsent.buffer);
-	  rt->unsent.buffer=NULL;
-	  rt->unsent.buflen=0;
+     /* flush the buffer: chains of chunks go as they are to drivers 
+      * that can write vectors, otherwise drivers are given a single
+      * block, which only needs to be made if there are several chunks */
+     route_lock();
+     if (rt->unsent.buffer == NULL && rt->unsent.first->next && 
+	 rt->method->ll_writev) {
+	  r = route_priv_flushv(rt);
+     } else {
+	  if (rt->unsent.buffer == NULL && rt->unsent.first->next)
+	       text = route_priv_coalesce(rt);
+	  r = rt->method->ll_write(rt->handle, text, rt->unsent.buflen);
+     }
+     route_unlock();
+     if (r < rt->unsent.buflen) {
+	  fprintf(stderr, "can't write to %s, "
+		  "discarding len=%d text='%.20s'%s", rt->p_url, 
+		  rt->unsent.buflen, text,
+		  (rt->unsent.buflen>20)?"...(truncated)":"");
+	  ret = 0;	/* failure */
+     } else {
+	  ret = 1;	/* success */
      }
 
+     /* empty the buffer, keeping the first chunk for the next writes 
+      * if it is of the standard size */
+     if (rt->unsent.buffer)
+	  nfree(rt->unsent.buffer);
+     rt->unsent.buffer=NULL;
+     route_priv_freechunks(rt, 1);
+
      return ret;
 }
 
 
 /*
  * Return a pointer to the buffer of pending characters in the route 
- * and its length
+ * and its length. The characters are made into a single block if they
+ * are not already one, which may be taken over by the caller with 
+ * route_killbuffer(rt, 0).
  */
 char *route_buffer(ROUTE rt,	/* open, valid route */
 		   int *buflen	/* length of buffer */ )
 {
      if (buflen)
-	  *buflen = rt->unsent.buflen=0;
+	  *buflen = rt->unsent.buflen;
+     if (rt->unsent.buffer == NULL && rt->unsent.buflen > 0)
+	  route_priv_coalesce(rt);
      return rt->unsent.buffer;
 }
 
@@ -418,7 +467,7 @@ void route_killbuffer(ROUTE rt,	/* open, valid route */
      if (freealloc && rt->unsent.buffer)
 	  nfree(rt->unsent.buffer);
      rt->unsent.buffer=NULL;
-     rt->unsent.buflen=0;
+     route_priv_freechunks(rt, 0);
 }
 
 
@@ -431,11 +480,14 @@ void route_close(ROUTE rt /* open, valid route */) {
      if (rt == NULL)
 	  return;
 
+     route_lock();
      route_flush(rt);
      rt->method->ll_close(rt->handle);
+     route_unlock();
      nfree(rt->p_url);
      if (rt->unsent.buffer)
 	  nfree(rt->unsent.buffer);
+     route_priv_freechunks(rt, 0);
      nfree(rt);
 }
 
@@ -448,7 +500,9 @@ int route_write(ROUTE rt,		/* Open valid route */
 		const void *buf,	/* Data to send to route */
 		int buflen		/* Length of data to send */ )
 {
+     struct route_chunk *c;
      void *newbuf;
+     int n, size, left;
 
      if ( ! rt)
 	  return -1;
@@ -461,17 +515,54 @@ int route_write(ROUTE rt,		/* Open valid route */
 	  return -1;
      }
 
-     /* Append data to buffer, make sure to append a terminating NULL */
      if (route_debug)
           /* use stderr to avoid loops */
 	  fprintf(stderr, "enlarge %s buffer by %d: %d -> %d\n",
 		  rt->p_url, buflen, rt->unsent.buflen, 
 		  rt->unsent.buflen+buflen);
-     newbuf = xnrealloc(rt->unsent.buffer, rt->unsent.buflen + buflen +1);
-     memcpy(newbuf + rt->unsent.buflen, buf, buflen);
+
+     if (rt->unsent.buffer) {
+	  /* already made into a single block by route_buffer(): 
+	   * append to it, with a terminating NULL */
+	  newbuf = xnrealloc(rt->unsent.buffer, rt->unsent.buflen+buflen+1);
+	  memcpy(newbuf + rt->unsent.buflen, buf, buflen);
+	  rt->unsent.buflen += buflen;
+	  rt->unsent.buffer = newbuf;
+	  ((char *)rt->unsent.buffer)[rt->unsent.buflen] = '\0';
+	  return buflen;
+     }
+
+     /* Fill the space in the last chunk, then add a chunk for the rest.
+      * Chunks double in size from ROUTE_BUFSZ to ROUTE_CHUNKMAX, unless 
+      * a larger one is needed, so the data is copied only once */
+     left = buflen;
+     c = rt->unsent.last;
+     while (left > 0) {
+	  if (c == NULL || c->len == c->size) {
+	       size = c ? c->size * 2 : ROUTE_BUFSZ;
+	       if (size > ROUTE_CHUNKMAX)
+		    size = ROUTE_CHUNKMAX;
+	       if (size < left)
+		    size = left;
+	       c = xnmalloc(sizeof(struct route_chunk) + size + 1);
+	       c->next = NULL;
+	       c->len  = 0;
+	       c->size = size;
+	       if (rt->unsent.last)
+		    rt->unsent.last->next = c;
+	       else
+		    rt->unsent.first = c;
+	       rt->unsent.last = c;
+	  }
+	  n = c->size - c->len;
+	  if (n > left)
+	       n = left;
+	  memcpy(route_chunktext(c) + c->len, buf + (buflen - left), n);
+	  c->len += n;
+	  route_chunktext(c)[c->len] = '\0';
+	  left -= n;
+     }
      rt->unsent.buflen += buflen;
-     rt->unsent.buffer = newbuf;
-     ((char *)rt->unsent.buffer)[rt->unsent.buflen] = '\0';
 
      return buflen;
 }
@@ -486,6 +577,8 @@ int route_write(ROUTE rt,		/* Open valid route */
 int route_twrite(ROUTE rt,		/* Open valid route */
 		 TABLE tab		/* Data in table to send */ )
 {
+     int r;
+
      if ( ! rt)
 	  return 0;	/* failure */
      if ( ! tab)
@@ -493,7 +586,11 @@ int route_twrite(ROUTE rt,		/* Open valid route */
 
      if (!route_flush(rt))
 	  return 0;
-     return rt->method->ll_twrite(rt->handle, tab);
+     route_lock();
+     r = rt->method->ll_twrite(rt->handle, tab);
+     route_unlock();
+
+     return r;
 }
 
 
@@ -589,7 +686,7 @@ char *route_read(char *p_url,		/* pseudo url */
 	  route_close(rt);
 	  return NULL;
      }
-     chain = rt->method->ll_read(rt->handle, seq, 0);
+     chain = route_seekread(rt, seq, 0);
      if (!chain) {
 	  route_close(rt);
 	  return NULL;
@@ -636,7 +733,7 @@ TABLE route_tread(char *p_url,		/* pseudo url */
 	  route_close(rt);
 	  return NULL;
      }
-     tab = rt->method->ll_tread(rt->handle, seq, 0);
+     tab = route_seektread(rt, seq, 0);
      route_close(rt);
      return tab;
 }
@@ -667,7 +764,9 @@ int route_tell(ROUTE rt,	/* opened route */
      if (!rt)
 	  return 0;
 
+     route_lock();
      ret = rt->method->ll_tell(rt->handle, seq, size, modt);
+     route_unlock();
 
      if (route_debug)
           /* use stderr to avoid loops */
@@ -734,10 +833,16 @@ ITREE *route_seekread(ROUTE rt,		/* route */
 		      int seq,		/* read from sequence onwards */
 		      int offset	/* read from offset */ )
 {
+     ITREE *chain;
+
      if (!rt)
 	  return NULL;
      
-     return rt->method->ll_read(rt->handle, seq, offset);
+     route_lock();
+     chain = rt->method->ll_read(rt->handle, seq, offset);
+     route_unlock();
+
+     return chain;
 }
 
 
@@ -758,10 +863,16 @@ TABLE route_seektread(ROUTE rt,		/* route */
 		      int seq,		/* read from sequence onwards */
 		      int offset	/* read from offset */ )
 {
+     TABLE tab;
+
      if (!rt)
 	  return NULL;
      
-     return rt->method->ll_tread(rt->handle, seq, offset);
+     route_lock();
+     tab = rt->method->ll_tread(rt->handle, seq, offset);
+     route_unlock();
+
+     return tab;
 }
 
 
@@ -789,7 +900,9 @@ char *route_getpurl(ROUTE rt) { return rt->p_url; }
  * Returned data status and info are nmalloc()ed and should be nfree()'ed
  * by the caller */
 void route_getstatus(ROUTE rt, char **status, char **info) {
-     return rt->method->ll_status(rt->handle, status, info);
+     route_lock();
+     rt->method->ll_status(rt->handle, status, info);
+     route_unlock();
 }
 
 
@@ -803,10 +916,134 @@ void route_getstatus(ROUTE rt, char **status, char **info) {
  */
 int route_checkpoint(ROUTE rt		/* route */ )
 {
+     int r;
+
      if (!rt)
 	  return 0;
      
-     return rt->method->ll_checkpoint(rt->handle);
+     route_lock();
+     r = rt->method->ll_checkpoint(rt->handle);
+     route_unlock();
+
+     return r;
+}
+
+
+/*
+ * Serialise the use of drivers and route wide state between threads.
+ * Drivers, and the storage they use, are not thread safe, so route takes 
+ * this lock whenever it calls them. Other classes that use routes or the 
+ * drivers' state outside of route calls (such as elog and driver 
+ * callbacks) may hold it for longer. The lock is recursive.
+ */
+void route_lock()
+{
+     pthread_once(&route_mutexonce, route_priv_mkmutex);
+     pthread_mutex_lock(&route_mutex);
+}
+
+void route_unlock()
+{
+     pthread_mutex_unlock(&route_mutex);
+}
+
+/* create the recursive mutex used by route_lock() */
+void route_priv_mkmutex()
+{
+     pthread_mutexattr_t attr;
+
+     pthread_mutexattr_init(&attr);
+     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+     pthread_mutex_init(&route_mutex, &attr);
+     pthread_mutexattr_destroy(&attr);
+}
+
+
+
+/*
+ * Free the chunks buffered in the route. If keepfirst is set and the 
+ * first chunk is of the standard size ROUTE_BUFSZ, it is emptied and kept 
+ * to be reused by the next write; larger chunks, made for a single big 
+ * write, are freed so that long lived routes don't hold on to them.
+ */
+void route_priv_freechunks(ROUTE rt, int keepfirst)
+{
+     struct route_chunk *c, *next;
+
+     c = rt->unsent.first;
+     if (c && keepfirst && c->size == ROUTE_BUFSZ) {
+	  c->len = 0;
+	  *route_chunktext(c) = '\0';
+	  rt->unsent.last = c;
+	  next = c->next;
+	  c->next = NULL;
+	  c = next;
+     } else {
+	  rt->unsent.first = rt->unsent.last = NULL;
+     }
+     while (c) {
+	  next = c->next;
+	  nfree(c);
+	  c = next;
+     }
+     rt->unsent.buflen = 0;
+}
+
+
+/*
+ * Copy the chain of chunks into a single, NULL terminated block, held 
+ * as rt->unsent.buffer, and free the chunks.
+ * Returns the block.
+ */
+char *route_priv_coalesce(ROUTE rt)
+{
+     struct route_chunk *c;
+     char *pt;
+     int len;
+
+     len = rt->unsent.buflen;
+     pt = rt->unsent.buffer = xnmalloc(len + 1);
+     for (c = rt->unsent.first; c; c = c->next) {
+	  memcpy(pt, route_chunktext(c), c->len);
+	  pt += c->len;
+     }
+     *pt = '\0';
+     route_priv_freechunks(rt, 0);
+     rt->unsent.buflen = len;
+
+     return rt->unsent.buffer;
+}
+
+
+/*
+ * Write the chain of chunks with the driver's vectored write, 
+ * ROUTE_IOVMAX chunks at a time.
+ * Returns the number of characters written, less than the length of the
+ * buffer if there was an error.
+ */
+int route_priv_flushv(ROUTE rt)
+{
+     struct iovec iov[ROUTE_IOVMAX];
+     struct route_chunk *c;
+     int n, r, len, total=0;
+
+     c = rt->unsent.first;
+     while (c) {
+	  len = 0;
+	  for (n=0; c && n < ROUTE_IOVMAX; c = c->next) {
+	       if (c->len == 0)
+		    continue;
+	       iov[n].iov_base = route_chunktext(c);
+	       iov[n++].iov_len = c->len;
+	       len += c->len;
+	  }
+	  r = rt->method->ll_writev(rt->handle, iov, n);
+	  if (r < len)
+	       return r < 0 ? total : total + r;
+	  total += r;
+     }
+
+     return total;
 }
 
 
@@ -842,11 +1079,11 @@ int main(int argc, char **argv) {
      elog_init(0, "route test", NULL);
 
      /* test 1 */
-     r = route_open("stdout", NULL, NULL, 0);
+     r = route_open("stdout:", NULL, NULL, 0);
      route_printf(r, "hello\n");
      purl = route_getpurl(r);
-     if (strcmp("stdout", purl))
-	  elog_die(ERROR, "[1] getpurl()==%s not stdout", purl);
+     if (strcmp("stdout:", purl))
+	  elog_die(ERROR, "[1] getpurl()==%s not stdout:", purl);
      route_close(r);
 
      /* test 2 */
@@ -969,6 +1206,30 @@ int main(int argc, char **argv) {
      route_close(r);
 #endif
 
+     /* test 7 buffer reuse: only a standard sized first chunk is kept 
+      * after a flush, a large one made by a big write is freed */
+     route_register(&rt_fileov_method);
+     unlink(TFILE1);
+     r = route_open("fileov:" TFILE1, NULL, NULL, 10);
+     if ( ! r )
+          elog_die(ERROR, "[7] unable to open");
+     data = xnmalloc(ROUTE_BUFSZ * 4);
+     memset(data, 'x', ROUTE_BUFSZ * 4);
+     route_write(r, data, ROUTE_BUFSZ * 4);
+     if ( ! route_flush(r) )
+          elog_die(ERROR, "[7a] unable to flush");
+     if (r->unsent.first)
+          elog_die(ERROR, "[7a] large chunk of %d kept after flush", 
+		   r->unsent.first->size);
+     route_printf(r, "hello\n");
+     if ( ! route_flush(r) )
+          elog_die(ERROR, "[7b] unable to flush");
+     if ( ! r->unsent.first || r->unsent.first->size != ROUTE_BUFSZ )
+          elog_die(ERROR, "[7b] standard chunk not kept after flush");
+     route_close(r);
+     nfree(data);
+     unlink(TFILE1);
+
      /* shutdown for memory check */
      elog_fini();
      route_fini();
@@ -9,12 +9,15 @@
 #define _ROUTE_H_
 
 #include <time.h>
+#include <sys/uio.h>
 #include "cf.h"
 #include "itree.h"
 #include "table.h"
 
 /* General definitions */
 #define ROUTE_BUFSZ 4096
+#define ROUTE_CHUNKMAX 65536	/* largest size of a buffer chunk */
+#define ROUTE_IOVMAX 64		/* most chunks passed to each ll_writev() */
 #define ROUTE_PURLLEN 1024
 #define ROUTE_HOSTNAMELEN 32
 #define ROUTE_READOK 1
@@ -43,12 +46,26 @@ typedef const struct route_lowlevel {
      TABLE  (*ll_tread) (RT_LLD lld, int  seq, int  offset);
      void   (*ll_status)(RT_LLD lld, char **status, char **info);
      int    (*ll_checkpoint)(RT_LLD lld);
+     int    (*ll_writev)(RT_LLD lld, const struct iovec *iov, int iovcnt);
+					/* optional, may be NULL */
 } *ROUTE_METHOD;
 
-/* buffer structure */
+/* A piece of buffered data, with its text following this header.
+ * Text is always followed by '\0' */
+struct route_chunk {
+     struct route_chunk *next;	/* next chunk or NULL */
+     int len;			/* characters used */
+     int size;			/* space for characters, excluding '\0' */
+};
+#define route_chunktext(c) ((char *) ((c)+1))
+
+/* buffer structure: data is queued in a chain of chunks, so that each
+ * write is copied once, until route_buffer() asks for a single block */
 typedef struct route_buffer {
      int buflen;	/* Length of buffer */
-     char *buffer;	/* Buffer */
+     char *buffer;	/* Buffer made by route_buffer() or NULL */
+     struct route_chunk *first;	/* chain of buffered chunks or NULL */
+     struct route_chunk *last;	/* last chunk in the chain */
 } ROUTE_BUF;
 
 /*
@@ -93,5 +110,7 @@ void   route_free_routebuf(ITREE *buflist);
 char * route_getpurl  (ROUTE rt);
 void   route_getstatus(ROUTE rt, char **status, char **info);
 int    route_checkpoint(ROUTE rt);
+void   route_lock    ();
+void   route_unlock  ();
 
 #endif /* _ROUTE_H_ */
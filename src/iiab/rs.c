@@ -80,6 +80,8 @@ char *rs_info_header_hds[] = {"key", "header", NULL};
 /* globals */
 TREE *rs_dblock_cache;		/* dblock cache: blocks indexed by their
 				 * storage key */
+TREE *rs_lld_shares;		/* shared low level descriptors indexed 
+				 * by file name */
 
 /* private structures */
 struct rs_priv_dblock_index {
@@ -89,11 +91,25 @@ struct rs_priv_dblock_index {
 
 /* private functional prototypes */
 ITREE *rs_priv_table_to_dblock(TABLE tab, unsigned long hash);
+void   rs_priv_dblock_body(RS_DBLOCK d, TABLE tab);
 TABLE  rs_priv_dblock_to_table(ITREE *db,RS ring,
 			       char *(hash_lookup)(RS, unsigned long),
 			       TABLE existing_tab, int musthave_seq,
 			       int musthave_time, int musthave_dur);
 int    rs_priv_load_index(RS ring, TABLE *index);
+int    rs_priv_load_ends(RS ring);
+int    rs_priv_index_ends(RS_METHOD method, RS_LLD lld, int ringid,
+			  RS_IDXENT oldest, RS_IDXENT youngest);
+int    rs_priv_load_tcache(RS ring);
+struct rs_lld_share *rs_priv_share_open(RS_METHOD method, char *filename,
+					int filemode, int flags);
+void   rs_priv_share_close(struct rs_lld_share *share);
+int    rs_priv_lock(struct rs_lld_share *share, enum rs_db_lock rw, 
+		    char *where);
+void   rs_priv_unlock(struct rs_lld_share *share);
+void   rs_priv_tcache_append(RS ring, RS_IDXENT ents, int n);
+int    rs_priv_tcache_byseq(RS ring, int seq);
+int    rs_priv_tcache_bytime(RS ring, time_t time);
 unsigned long rs_priv_header_to_hash(RS ring, char *header);
 char * rs_priv_hash_to_header(RS ring, unsigned long hdhash);
 
@@ -105,6 +121,7 @@ char * rs_priv_hash_to_header(RS ring, unsigned long hdhash);
 void  rs_init()
 {
      rs_dblock_cache =  tree_create();
+     rs_lld_shares   =  tree_create();
 }
 
 
@@ -114,13 +131,15 @@ void  rs_init()
 void  rs_fini()
 {
      tree_destroy (rs_dblock_cache);
+     tree_destroy (rs_lld_shares);
 }
 
 
 /*
  * Open a ring within a ringstore. 
  * Method should by the type of ringstore to open. 
- * Currently, the supported types are rs_gdbm_method for GDBM and 
+ * Currently, the supported types are rs_gdbm_method for GDBM, 
+ * rs_mem_method for GDBM with its recent data held in memory and
  * rs_berk_method for Berkley DB.
  * If the ringstore file does not exist and flags contain RS_CREATE 
  * as part of its bitmask, then the file `filename' will be created
@@ -133,6 +152,9 @@ void  rs_fini()
  * If `nslots' is 0, then the ring will be unlimited in length.
  * If there is a regular timing to each element, then duration should be 
  * set to the interval in seconds or 0 if irregular. 
+ * If flags contain RS_PERSIST, the method is asked to keep its datastore
+ * open between operations, which suits long lived handles that make
+ * many small reads or writes.
  * Unless specified by the route, the initial current position will be 
  * set to the oldest.
  * Returns a descriptor if successful or NULL for failure 
@@ -146,37 +168,40 @@ RS    rs_open(RS_METHOD method	/* method vectors */,
 	      char *description	/* text description */, 
 	      int   nslots	/* length of ring or 0 for unlimited */,
 	      int   duration	/* seconds between samples or 0 irregular */,
-	      int   flags	/* mask of RS_CREATE, 0 otherwise */)
+	      int   flags	/* mask of RS_CREATE|RS_PERSIST or 0 */)
 {
      struct rs_session *ring;
-     RS_LLD lld;
+     struct rs_lld_share *share;
      TABLE ringdir;
      int rowindex;
      RS_SUPER super;
 
-     /* attempt to initialise the method and open the datastore */
+     /* attempt to initialise the method and open the datastore, or
+      * share one that is already open */
      method->ll_init();
-     lld = method->ll_open(filename, filemode, flags);
+     share = rs_priv_share_open(method, filename, filemode, flags);
 
      /* return if failed */
-     if ( ! lld ) {
+     if ( ! share ) {
 	  elog_printf(ERROR, "Unable to open %s", filename);
 	  return NULL;
      }
 
      /* lock up your datastores for READING */
-     if ( ! method->ll_lock(lld, RS_RDLOCK, "rs_open") ) {
+     if ( ! rs_priv_lock(share, RS_RDLOCK, "rs_open") ) {
 	  /* if we can't lock at the begining of this process, 
 	   * we should fail the entire call */
-	  method->ll_close(lld);
+	  rs_priv_share_close(share);
 	  elog_printf(ERROR, "Unable to lock %s", filename);
 	  return NULL;
      }
 
      /* allocate structures */
      ring = xnmalloc(sizeof(struct rs_session));
-     ring->handle = lld;
+     ring->handle = share->handle;
      ring->method = method;
+     ring->share  = share;
+     ring->intxn  = 0;
 
      /*
       * The database is ours!
@@ -188,16 +213,17 @@ RS    rs_open(RS_METHOD method	/* method vectors */,
      if (rowindex == -1) {
 	  if ((flags & RS_CREATE) == 0) {
 	       /* can't create new ring */
-	       ring->method->ll_close(ring->handle);
+	       rs_priv_unlock(share);
+	       rs_priv_share_close(share);
 	       table_destroy(ringdir);
 	       nfree(ring);
 	       return NULL;
 	  }
 	  /* This is a new ring; escalate the lock to a write */
-	  if ( ! method->ll_lock(ring->handle, RS_WRLOCK, "rs_open") ) {
+	  if ( ! rs_priv_lock(share, RS_WRLOCK, "rs_open") ) {
 	       elog_printf(ERROR, "unable to create ring; "
 			   "it may work if you try again");
-	       ring->method->ll_close(ring->handle);
+	       rs_priv_share_close(share);
 	       table_destroy(ringdir);
 	       nfree(ring);
 	       return NULL;
@@ -218,8 +244,8 @@ RS    rs_open(RS_METHOD method	/* method vectors */,
 	  if ( ! ring->method->ll_write_rings(ring->handle, ringdir)) {
 	       /* no damage done and we should close and return */
 	       elog_printf(ERROR, "unable to write ringdir");
-	       ring->method->ll_unlock(ring->handle);
-	       ring->method->ll_close (ring->handle);
+	       rs_priv_unlock(share);
+	       rs_priv_share_close(share);
 	       table_destroy(ringdir);
 	       nfree(ring);
 	       return NULL;
@@ -236,8 +262,8 @@ RS    rs_open(RS_METHOD method	/* method vectors */,
 			   "datastore needs repair");
 	       ring->method->ll_write_value(ring->handle, "DAMAGED", 
 					    "superbock", 10);
-	       ring->method->ll_unlock(ring->handle);
-	       ring->method->ll_close (ring->handle);
+	       rs_priv_unlock(share);
+	       rs_priv_share_close(share);
 	       table_destroy(ringdir);
 	       rs_free_superblock(super);
 	       nfree(ring);
@@ -250,7 +276,7 @@ RS    rs_open(RS_METHOD method	/* method vectors */,
      }
 
      /* unlock */
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
 
      /* 
       * The datastore has our ring in it and we have a current ring
@@ -275,6 +301,9 @@ RS    rs_open(RS_METHOD method	/* method vectors */,
      ring->duration      = strtol(table_getcurrentcell(ringdir, "dur"), 
 				  (char**)NULL, 10);
      ring->hdcache       = itree_create();
+     ring->tcache        = NULL;	/* loaded on first time search */
+     ring->tcache_n      = 0;
+     ring->tcache_alloc  = 0;
      table_destroy(ringdir);
      rs_free_superblock(super);
 
@@ -292,10 +321,17 @@ void  rs_close(RS ring	/* ring descriptor */)
      if (ring->ringid == -1)
 	  elog_printf(ERROR, "using killed ring");
 
-     ring->method->ll_close (ring->handle);
+     if (ring->intxn) {
+	  elog_printf(DIAG, "committing transaction on %s before close",
+		      ring->ringname);
+	  rs_txn_commit(ring);
+     }
+     rs_priv_share_close(ring->share);
      xnfree(ring->ringname);
      itree_clearoutandfree(ring->hdcache);
      itree_destroy(ring->hdcache);
+     if (ring->tcache)
+	  nfree(ring->tcache);
      xnfree(ring);
 }
 
@@ -311,9 +347,10 @@ int   rs_destroy(RS_METHOD method	/* method vectors */,
 		 char *ringname		/* name of ring */)
 {
      RS_LLD lld;
-     TABLE ringdir, ringindex;
-     int rowindex, ringid, from_seq, to_seq;
+     TABLE ringdir;
+     int rowindex, ringid, n;
      RS_SUPER super;
+     struct rs_index_entry oldest, youngest;
 
      /* open (filename,ringname) conventionally if it exists 
       * and lock for writing */
@@ -373,27 +410,20 @@ int   rs_destroy(RS_METHOD method	/* method vectors */,
 	  }
      }
 
-     /* read the ring's index into memory but delete from disk */
-     ringindex = method->ll_read_index(lld, ringid);
+     /* find the extent of the ring's index but delete from disk */
+     n = rs_priv_index_ends(method, lld, ringid, &oldest, &youngest);
      if ( ! method->ll_rm_index(lld, ringid) )
 	  /* Can't remove the index, flag as error and continue */
 	  elog_printf(DEBUG, "remove index failed");
 
      /* expire all the data elements from the ring's index table */
-     if ( ! ringindex ) {
+     if (n < 0) {
 	  /* Can't remove the index, flag as error and continue */
 	  elog_printf(ERROR, "unable to remove ring elements as "
 		      "there is no index; datastore needs cleaning");
-     } else {
+     } else if (n > 0) {
 	  /* purge all the ring's elements */
-	  table_first(ringindex);
-	  from_seq = strtol(table_getcurrentcell(ringindex, "seq"),
-			    (char**)NULL, 10);
-	  table_last(ringindex);
-	  to_seq = strtol(table_getcurrentcell(ringindex, "seq"),
-			  (char**)NULL, 10);
-	  method->ll_expire_dblock(lld, ringid, from_seq, to_seq);
-	  table_destroy(ringindex);
+	  method->ll_expire_dblock(lld, ringid, oldest.seq, youngest.seq);
      }
 
      /* unlock, free data structures and return */
@@ -424,11 +454,11 @@ int   rs_destroy(RS_METHOD method	/* method vectors */,
 int   rs_put(RS    ring	/* ring descriptor */, 
 	     TABLE data	/* data contained in a table */)
 {
-     char *headtxt, *infotxt, *head_and_info;
+     struct table_outbuf headtxt;
      unsigned long hash;
      ITREE *dblock;
      int r, seq, old_oldest;
-     TABLE index;
+     TABLE index = NULL;
      RS_DBLOCK d;
 
      if (ring->ringid == -1) {
@@ -439,54 +469,67 @@ int   rs_put(RS    ring	/* ring descriptor */,
 	  return 1;	/* success -- no work to do */
 
      /* get write lock & load ring's index */
-     if ( ! ring->method->ll_lock(ring->handle, RS_WRLOCK, "rs_put") ) {
+     if ( ! rs_priv_lock(ring->share, RS_WRLOCK, "rs_put") ) {
        elog_printf(DIAG, "Unable to get read/write lock for %s", 
 		   rs_ringname(ring));
 	  return 0;
      }
-     if ( ! rs_priv_load_index(ring, &index) ) {
+     if (ring->method->ll_append_index)
+	  r = rs_priv_load_ends(ring);
+     else
+	  r = rs_priv_load_index(ring, &index);
+     if ( ! r ) {
 	  elog_printf(ERROR, "Unable to load ring index, possibly it may not exist");
+	  rs_priv_unlock(ring->share);
 	  return 0;
      }
 
      /* hunt the correct hash and generate a datablock list from the table */
-     headtxt = table_outheader(data);
-     infotxt = table_outinfo(data);
-     if (infotxt) {
-          head_and_info = util_strjoin(headtxt, "\n", infotxt, NULL);
-	  hash    = rs_priv_header_to_hash(ring, head_and_info);
-     } else {
-	  hash    = rs_priv_header_to_hash(ring, headtxt);
-     }
+     table_outbuf_init(&headtxt, 0);
+     table_outheader_buf(data, &headtxt);
+     table_outbuf_add(&headtxt, "\n", 1);
+     if (table_outinfo_buf(data, &headtxt) == 0) {
+	  /* no info: header only */
+	  headtxt.buf[--headtxt.len] = '\0';
+     }
+     hash    = rs_priv_header_to_hash(ring, table_outbuf_text(&headtxt));
      dblock  = rs_priv_table_to_dblock(data, hash);
-     nfree(headtxt);
-     if (infotxt) {
-          nfree(infotxt);
-	  nfree(head_and_info);
-     }
+     table_outbuf_free(&headtxt);
 
      /* store dblocks in cache ? */
 
      /* append the dblocks to the sequence of them on disk */
-     if (table_nrows(index)) {
-	  table_last(index);
-	  seq = strtol(table_getcurrentcell(index, "seq"),
-		       (char**)NULL, 10) + 1;
+     if (index) {
+	  if (table_nrows(index)) {
+	       table_last(index);
+	       seq = strtol(table_getcurrentcell(index, "seq"),
+			    (char**)NULL, 10) + 1;
+	  } else {
+	       seq = 0;
+	  }
      } else {
-	  seq = 0;
+	  seq = ring->youngest + 1;	/* -1 if empty */
      }
      r = ring->method->ll_append_dblock(ring->handle, ring->ringid, seq, 
 					dblock);
 
 
      /* append the details of the new dblocks to the ring index */
-     itree_traverse(dblock) {
-	  d = itree_get(dblock);
-	  table_addemptyrow(index);
-	  table_replacecurrentcell_alloc(index, "seq", util_i32toa(seq++));
-	  table_replacecurrentcell_alloc(index, "time",util_i32toa(d->time));
-	  table_replacecurrentcell_alloc(index, "hd_hash", 
-					 util_u32toa(d->hd_hashkey));
+     if (index) {
+	  itree_traverse(dblock) {
+	       d = itree_get(dblock);
+	       table_addemptyrow(index);
+	       table_replacecurrentcell_alloc(index, "seq", 
+					      util_i32toa(seq++));
+	       table_replacecurrentcell_alloc(index, "time",
+					      util_i32toa(d->time));
+	       table_replacecurrentcell_alloc(index, "hd_hash", 
+					      util_u32toa(d->hd_hashkey));
+	  }
+     } else {
+	  r = ring->method->ll_append_index(ring->handle, ring->ringid, seq,
+					    dblock);
+	  seq += itree_n(dblock);
      }
 
      /* calculate the new ring endpoints and expire data and index 
@@ -503,13 +546,18 @@ int   rs_put(RS    ring	/* ring descriptor */,
 	  ring->oldest = ring->youngest - ring->nslots + 1;
 
 	  /* purge the index of any expired dblocks */
-	  table_first(index);
-	  while ( ! table_isbeyondend(index) ) {
-	       if (strtol(table_getcurrentcell(index, "seq"),
-			  (char**)NULL, 10) < ring->oldest)
-		    table_rmcurrentrow(index);
-	       else
-		    table_next(index);
+	  if (index) {
+	       table_first(index);
+	       while ( ! table_isbeyondend(index) ) {
+		    if (strtol(table_getcurrentcell(index, "seq"),
+			       (char**)NULL, 10) < ring->oldest)
+			 table_rmcurrentrow(index);
+		    else
+			 table_next(index);
+	       }
+	  } else {
+	       ring->method->ll_expire_index(ring->handle, ring->ringid, 
+					     ring->oldest-1);
 	  }
 
 	  /* purge the ring of any expired dblocks */
@@ -520,18 +568,108 @@ int   rs_put(RS    ring	/* ring descriptor */,
 		 ring->youngest, ring->current);
 
      /* store the updated index and header (and cache?) */
-     r = ring->method->ll_write_index(ring->handle, ring->ringid, index);
+     if (index)
+	  r = ring->method->ll_write_index(ring->handle, ring->ringid, index);
 
      /* unlock */
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
 
      /* free and return */
-     table_destroy(index);
+     if (index)
+	  table_destroy(index);
      rs_free_dblock(dblock);
      return 1;	/* success */
 }
 
 
+/*
+ * Put a TABLE of data to each of several rings, where data[i] is put to
+ * rings[i]. Rings that share a file (having been opened with RS_PERSIST)
+ * are written under a single write lock, one file at a time.
+ * Returns the number of TABLEs successfully put.
+ */
+int   rs_put_batch(RS   *rings	/* array of ring descriptors */, 
+		   TABLE *data	/* array of data tables */, 
+		   int    n	/* number of rings and tables */)
+{
+     int i, j, nput=0;
+     char *done;
+
+     if (n <= 0)
+	  return 0;
+     done = xnmalloc(n);
+     memset(done, 0, n);
+     for (i=0; i < n; i++) {
+	  if (done[i])
+	       continue;
+
+	  /* put all the rings that share this ring's file */
+	  if ( ! rs_txn_begin(rings[i]) )
+	       continue;
+	  for (j=i; j < n; j++) {
+	       if (done[j] || rings[j]->share != rings[i]->share)
+		    continue;
+	       done[j]++;
+	       if (rs_put(rings[j], data[j]))
+		    nput++;
+	  }
+	  rs_txn_commit(rings[i]);
+     }
+     nfree(done);
+
+     return nput;
+}
+
+
+/*
+ * Begin a transaction on the ring's file, taking a write lock that is 
+ * held until rs_txn_commit(). In the meantime, rs_put() and the other
+ * calls on this ring, or other rings sharing its file, are made without 
+ * locking. Rings opened with RS_PERSIST on the same file share the 
+ * transaction, and the lock is released when the last one commits.
+ * A transaction should be short, as it excludes all other processes 
+ * from the file.
+ * Returns 1 for success or 0 for failure.
+ */
+int   rs_txn_begin(RS ring	/* ring descriptor */)
+{
+     if (ring->ringid == -1) {
+	  elog_printf(ERROR, "using killed ring");
+	  return 0;
+     }
+     if (ring->intxn)
+	  return 1;	/* already in one */
+
+     if ( ! rs_priv_lock(ring->share, RS_WRLOCK, "rs_txn_begin") ) {
+	  elog_printf(DIAG, "Unable to get write lock for %s", 
+		      rs_ringname(ring));
+	  return 0;
+     }
+     ring->share->txn++;
+     ring->intxn = 1;
+
+     return 1;
+}
+
+
+/*
+ * Commit the transaction started by rs_txn_begin(), releasing the write 
+ * lock if no other ring sharing the file is in a transaction.
+ * Returns 1 for success or 0 if the ring was not in a transaction.
+ */
+int   rs_txn_commit(RS ring	/* ring descriptor */)
+{
+     if ( ! ring->intxn )
+	  return 0;
+
+     ring->intxn = 0;
+     ring->share->txn--;
+     rs_priv_unlock(ring->share);
+
+     return 1;
+}
+
+
 /*
  * Get the data sample at the current reading position of the ring and 
  * advance the position to the next data set. 
@@ -544,7 +682,7 @@ int   rs_put(RS    ring	/* ring descriptor */,
 TABLE rs_get(RS ring,		/* ring descriptor */
 	     int musthave_meta	/* include _seq, _time & _dur */)
 {
-     TABLE index, data;
+     TABLE data;
      ITREE *dblist;
 
      if (ring->ringid == -1) {
@@ -566,12 +704,12 @@ elog_printf(DEBUG, "get -- o %d y %d c %d ==> ",
       * without without reading index, ring directory or the superblock.
       * Its faster!!
       */
-     if ( ! ring->method->ll_lock(ring->handle, RS_RDLOCK, "rs_get") )
+     if ( ! rs_priv_lock(ring->share, RS_RDLOCK, "rs_get") )
 	  return NULL;
      dblist = ring->method->ll_read_dblock(ring->handle, ring->ringid, 
 					   ring->current, 1);
      if (!dblist) {
-	  ring->method->ll_unlock(ring->handle);
+	  rs_priv_unlock(ring->share);
 	  return NULL;
      }
 
@@ -581,7 +719,7 @@ elog_printf(DEBUG, "get -- o %d y %d c %d ==> ",
 	  /* waiting for next sequence, don't bother to get the index
 	   * for speed. just return NULL */
 	  if (ring->current == ring->youngest+1) {
-	       ring->method->ll_unlock(ring->handle);
+	       rs_priv_unlock(ring->share);
 elog_printf(DEBUG, "o %d y %d c %d (NULL returned)", ring->oldest, 
 	    ring->youngest, ring->current);
 	       return NULL;
@@ -593,9 +731,9 @@ elog_printf(DEBUG, "o %d y %d c %d (NULL returned)", ring->oldest,
 	   * indexes...
 	   */
 
-	  if ( ! rs_priv_load_index(ring, &index) ) {
+	  if ( ! rs_priv_load_ends(ring) ) {
 	       elog_printf(DIAG, "ring %s has been removed", ring);
-	       ring->method->ll_unlock(ring->handle);
+	       rs_priv_unlock(ring->share);
 	       ring->ringid = -1;	/* invalidate ring */
 	       return NULL;
 	  }
@@ -603,11 +741,10 @@ elog_printf(DEBUG, "o %d y %d c %d (NULL returned)", ring->oldest,
 	  /* if the block was not there, we always move to the
 	   * oldest in the sequence and re-get the block */
 	  ring->current = ring->oldest;
-	  table_destroy(index);
 	  dblist = ring->method->ll_read_dblock(ring->handle, ring->ringid, 
 						ring->current, 1);
 	  if (!dblist || itree_empty(dblist)) {
-	       ring->method->ll_unlock(ring->handle);
+	       rs_priv_unlock(ring->share);
 	       if (dblist)
 		    rs_free_dblock(dblist);
 elog_printf(DEBUG, "o %d y %d c %d (NULL returned)", ring->oldest, 
@@ -639,7 +776,7 @@ elog_printf(DEBUG, "after: o %d y %d c %d", ring->oldest,
      if (!data)
 	  elog_printf(ERROR, "unable to reconstruct data");
      rs_free_dblock(dblist);
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
 
      return data;
 }
@@ -773,12 +910,12 @@ int rs_checkpoint(RS ring		/* ring descriptor */ )
      }
 
      /* get write lock */
-     if ( ! ring->method->ll_lock(ring->handle, RS_WRLOCK, "rs_checkpoint") ) {
+     if ( ! rs_priv_lock(ring->share, RS_WRLOCK, "rs_checkpoint") ) {
 	  return 0;
      }
 
      r = ring->method->ll_checkpoint(ring->handle);
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
 
      return r;
 }
@@ -821,7 +958,6 @@ int   rs_youngest (RS ring		/* ring descriptor */,
 		   time_t *time		/* RETURN: insertion time */)
 {
      int r;
-     TABLE index;
 
      if (ring->ringid == -1) {
 	  elog_printf(ERROR, "using killed ring");
@@ -829,16 +965,15 @@ int   rs_youngest (RS ring		/* ring descriptor */,
      }
 
      /* force an index load to make sure the data is accurate */
-     if ( ! ring->method->ll_lock(ring->handle, RS_RDLOCK, "rs_youngest") )
+     if ( ! rs_priv_lock(ring->share, RS_RDLOCK, "rs_youngest") )
 	  return -1;
-     r = rs_priv_load_index(ring, &index);
-     ring->method->ll_unlock(ring->handle);
+     r = rs_priv_load_ends(ring);
+     rs_priv_unlock(ring->share);
      if ( ! r ) {
 	  elog_printf(DIAG, "ring %s has been removed", ring);
 	  ring->ringid = -1;	/* invalidate ring */
 	  return -1;
      }
-     table_destroy(index);
 
      *sequence = ring->youngest;
      *time     = ring->youngest_t;
@@ -858,7 +993,6 @@ int   rs_oldest   (RS ring		/* ring descriptor */,
 		   int *sequence	/* RETURN: sequence number */, 
 		   time_t *time		/* RETURN: insertion time */)
 {
-     TABLE index;
      int r;
 
      if (ring->ringid == -1) {
@@ -867,16 +1001,15 @@ int   rs_oldest   (RS ring		/* ring descriptor */,
      }
 
      /* force an index load to make sure the data is accurate */
-     if ( ! ring->method->ll_lock(ring->handle, RS_RDLOCK, "rs_youngest") )
+     if ( ! rs_priv_lock(ring->share, RS_RDLOCK, "rs_youngest") )
 	  return -1;
-     r = rs_priv_load_index(ring, &index);
-     ring->method->ll_unlock(ring->handle);
+     r = rs_priv_load_ends(ring);
+     rs_priv_unlock(ring->share);
      if ( ! r ) {
 	  elog_printf(DIAG, "ring %s has been removed", ring);
 	  ring->ringid = -1;	/* invalidate ring */
 	  return -1;
      }
-     table_destroy(index);
 
      *sequence = ring->oldest;
      *time     = ring->oldest_t;
@@ -892,7 +1025,6 @@ int   rs_oldest   (RS ring		/* ring descriptor */,
 int   rs_rewind   (RS ring		/* ring descriptor */, 
 		   int nsequences	/* move back these slots */)
 {
-     TABLE index;
      int r, oldseq;
 
      if (ring->ringid == -1) {
@@ -906,16 +1038,15 @@ int   rs_rewind   (RS ring		/* ring descriptor */,
 	  return 0;
 
      /* force an index load to make sure the data is accurate */
-     if ( ! ring->method->ll_lock(ring->handle, RS_RDLOCK, "rs_youngest") )
+     if ( ! rs_priv_lock(ring->share, RS_RDLOCK, "rs_youngest") )
 	  return -1;
-     r = rs_priv_load_index(ring, &index);
-     ring->method->ll_unlock(ring->handle);
+     r = rs_priv_load_ends(ring);
+     rs_priv_unlock(ring->share);
      if ( ! r ) {
 	  elog_printf(DIAG, "ring %s has been removed", ring);
 	  ring->ringid = -1;	/* invalidate ring */
 	  return -1;
      }
-     table_destroy(index);
 
      oldseq = ring->current;
      ring->current -= nsequences;
@@ -935,7 +1066,6 @@ int   rs_rewind   (RS ring		/* ring descriptor */,
 int   rs_forward  (RS ring		/* ring deswcriptor*/, 
 		   int nsequences	/* move forward these slots */)
 {
-     TABLE index;
      int r, oldseq;
 
      if (ring->ringid == -1) {
@@ -949,16 +1079,15 @@ int   rs_forward  (RS ring		/* ring deswcriptor*/,
 	  return 0;
 
      /* force an index load to make sure the data is accurate */
-     if ( ! ring->method->ll_lock(ring->handle, RS_RDLOCK, "rs_youngest") )
+     if ( ! rs_priv_lock(ring->share, RS_RDLOCK, "rs_youngest") )
 	  return -1;
-     r = rs_priv_load_index(ring, &index);
-     ring->method->ll_unlock(ring->handle);
+     r = rs_priv_load_ends(ring);
+     rs_priv_unlock(ring->share);
      if ( ! r ) {
 	  elog_printf(DIAG, "ring %s has been removed", ring);
 	  ring->ringid = -1;	/* invalidate ring */
 	  return -1;
      }
-     table_destroy(index);
 
      oldseq = ring->current;
      ring->current += nsequences;
@@ -978,7 +1107,6 @@ int   rs_forward  (RS ring		/* ring deswcriptor*/,
 int   rs_goto_seq (RS ring	/* ring descriptor */, 
 		   int sequence	/* goto this sequence */)
 {
-     TABLE index;
      int r;
 
      if (ring->ringid == -1) {
@@ -987,16 +1115,15 @@ int   rs_goto_seq (RS ring	/* ring descriptor */,
      }
 
      /* force an index load to make sure the data is accurate */
-     if ( ! ring->method->ll_lock(ring->handle, RS_RDLOCK, "rs_goto_seq") )
+     if ( ! rs_priv_lock(ring->share, RS_RDLOCK, "rs_goto_seq") )
 	  return -1;
-     r = rs_priv_load_index(ring, &index);
-     ring->method->ll_unlock(ring->handle);
+     r = rs_priv_load_ends(ring);
+     rs_priv_unlock(ring->share);
      if ( ! r ) {
 	  elog_printf(DIAG, "ring %s has been removed", ring);
 	  ring->ringid = -1;	/* invalidate ring */
 	  return -1;
      }
-     table_destroy(index);
 
      if (sequence < ring->oldest)
 	  ring->current = ring->oldest;
@@ -1011,40 +1138,41 @@ int   rs_goto_seq (RS ring	/* ring descriptor */,
 
 /*
  * Set the current reading position to the data whose insertion time 
- * is on or before time.
+ * is on or before time. If all the data is younger than time, the 
+ * oldest data is chosen.
  * Returns the sequence number is successful or -1 otherwise
  */
 int   rs_goto_time(RS ring	/* ring descriptor */, 
 		   time_t time	/* youngest data time */)
 {
-     TABLE index;
-     int r;
+     int r, i;
 
      if (ring->ringid == -1) {
 	  elog_printf(ERROR, "using killed ring");
 	  return -1;
      }
 
-     /* force an index load to make sure the data is accurate */
-     if ( ! ring->method->ll_lock(ring->handle, RS_RDLOCK, "rs_goto_time") )
+     /* bring the time cache up to date to make sure the data is accurate */
+     if ( ! rs_priv_lock(ring->share, RS_RDLOCK, "rs_goto_time") )
 	  return -1;
-     r = rs_priv_load_index(ring, &index);
-     ring->method->ll_unlock(ring->handle);
+     r = rs_priv_load_tcache(ring);
+     rs_priv_unlock(ring->share);
      if ( ! r ) {
-	  elog_printf(DIAG, "ring %s has been removed", ring);
+	  elog_printf(DIAG, "ring %s has been removed", ring->ringname);
 	  ring->ringid = -1;	/* invalidate ring */
 	  return -1;
      }
-     table_destroy(index);
+     if (ring->tcache_n == 0)
+	  return -1;
 
-     /* seach for the time in the index, either for an exact match or 
-      * for the first time that is greater than asked for. */
-     table_traverse(index) {
-             if (strtol(table_getcurrentcell(index, "time"),
-			(char**)NULL, 10) > time)
-	       break; 
-     }
-     return table_getcurrentrowkey(index);
+     /* bisect for the first time that is greater than asked for, then
+      * step back to the one on or before it */
+     i = rs_priv_tcache_bytime(ring, time+1) - 1;
+     if (i < 0)
+	  i = 0;
+     ring->current = ring->tcache[i].seq;
+
+     return ring->current;
 }
 
 
@@ -1069,60 +1197,56 @@ TABLE rs_mget_range (RS  ring		/* ring descriptor */,
 		     time_t from_time	/* oldest/starting time */, 
 		     time_t to_time	/* oldest/ending time */ )
 {
-     TABLE index, data, myindex;
-     TABSET myset;
+     TABLE data;
      ITREE *dblist;
-     int first, last;
+     int first, last, i;
 
      if (ring->ringid == -1) {
 	  elog_printf(ERROR, "using killed ring");
 	  return NULL;
      }
 
-     /* lock ring and read the index */
-     if ( ! ring->method->ll_lock(ring->handle, RS_RDLOCK, "rs_mget_range") )
+     /* lock ring and bring the time cache up to date */
+     if ( ! rs_priv_lock(ring->share, RS_RDLOCK, "rs_mget_range") )
 	  return NULL;
-     if ( ! rs_priv_load_index(ring, &index) ) {
-          elog_printf(DIAG, "ring %s has been removed", ring);
-	  ring->method->ll_unlock(ring->handle);
+     if ( ! rs_priv_load_tcache(ring) ) {
+          elog_printf(DIAG, "ring %s has been removed", ring->ringname);
+	  rs_priv_unlock(ring->share);
 	  ring->ringid = -1;	/* invalidate ring */
 	  return NULL;
      }
 
-     /* process the index, finding matching sequences first, then matching 
-	times */
-     myset = tableset_create(index);
+     /* bisect the cache, narrowing by sequence first, then by time */
+     first = 0;
+     last  = ring->tcache_n-1;
      if (from_seq != -1)
-          tableset_where(myset, "seq",  ge, util_u32toa(from_seq));
-     if (from_time != -1)
-          tableset_where(myset, "time", ge, util_u32toa(from_time));
+          first = rs_priv_tcache_byseq(ring, from_seq);
      if (to_seq != -1)
-          tableset_where(myset, "seq",  le, util_u32toa(to_seq));
-     if (to_time != -1)
-          tableset_where(myset, "time", le, util_u32toa(to_time));
-     myindex = tableset_into(myset);
+          last  = rs_priv_tcache_byseq(ring, to_seq+1) - 1;
+     if (from_time != -1) {
+          i = rs_priv_tcache_bytime(ring, from_time);
+	  if (i > first)
+	       first = i;
+     }
+     if (to_time != -1) {
+          i = rs_priv_tcache_bytime(ring, to_time+1) - 1;
+	  if (i < last)
+	       last = i;
+     }
 
      /* now find the sequences that remain */
-     if (table_nrows(myindex) < 1) {
-          ring->method->ll_unlock(ring->handle);
-          table_destroy(index);
-	  table_destroy(myindex);
-	  tableset_destroy(myset);
+     if (first > last) {
+          rs_priv_unlock(ring->share);
           return NULL;
      }
-     table_first(myindex);
-     first = strtol(table_getcurrentcell(myindex, "seq"), (char**)NULL, 10);
-     table_last(myindex);
-     last = strtol(table_getcurrentcell(myindex, "seq"), (char**)NULL, 10);
-     table_destroy(index);
-     table_destroy(myindex);
-     tableset_destroy(myset);
+     first = ring->tcache[first].seq;
+     last  = ring->tcache[last].seq;
 
      /* load the data bound by the sequences */
      dblist = ring->method->ll_read_dblock(ring->handle, ring->ringid, 
 					   first, last-first+1);
      if (!dblist || itree_empty(dblist)) {
-          ring->method->ll_unlock(ring->handle);
+          rs_priv_unlock(ring->share);
 	  if (dblist)
 	       rs_free_dblock(dblist);
 elog_printf(DEBUG, "NULL returned");
@@ -1135,7 +1259,7 @@ elog_printf(DEBUG, "NULL returned");
      if (!data)
 	  elog_printf(ERROR, "unable to reconstruct data");
      rs_free_dblock(dblist);
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
 
      return data;
 }
@@ -1386,7 +1510,7 @@ int   rs_resize(RS ring		/* ring descriptor */,
      }
 
      /* get write lock */
-     if ( ! ring->method->ll_lock(ring->handle, RS_WRLOCK, "rs_resize") )
+     if ( ! rs_priv_lock(ring->share, RS_WRLOCK, "rs_resize") )
 	  return 0;
 
      /* Read the ring directory, amend the ring and write out */
@@ -1398,7 +1522,7 @@ int   rs_resize(RS ring		/* ring descriptor */,
      if (rowindex == -1) {
 	  elog_printf(ERROR, "ring %s,%s does not exist", 
 		      ring->ringname, duration);
-	  ring->method->ll_unlock(ring->handle);
+	  rs_priv_unlock(ring->share);
 	  table_destroy(ringdir);
 	  nfree(duration);
 	  return 0;
@@ -1409,7 +1533,7 @@ int   rs_resize(RS ring		/* ring descriptor */,
      r = ring->method->ll_write_rings(ring->handle, ringdir);
 
      /* unlock file and free ring table */
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
      table_destroy(ringdir);
      nfree(duration);
      nfree(newslots_str);
@@ -1450,8 +1574,9 @@ int   rs_purge(RS ring		/* ring descriptor */,
 	       int nkill	/* number of slots to remove data */)
 {
      int actual_data, actual_kill, purge_from, purge_to, removed, r;
-     TABLE index, newindex;
-     TABSET newset;
+     int youngest;
+     TABLE index=NULL, newindex=NULL;
+     TABSET newset=NULL;
 
      if (nkill <= 0)
           return 0;
@@ -1462,11 +1587,15 @@ int   rs_purge(RS ring		/* ring descriptor */,
      }
 
      /* lock ring and read the index for this ring */
-     if ( ! ring->method->ll_lock(ring->handle, RS_RDLOCK, "rs_purge") )
+     if ( ! rs_priv_lock(ring->share, RS_WRLOCK, "rs_purge") )
 	  return 0;
-     if ( ! rs_priv_load_index(ring, &index) ) {
+     if (ring->method->ll_expire_index)
+	  r = rs_priv_load_ends(ring);
+     else
+	  r = rs_priv_load_index(ring, &index);
+     if ( ! r ) {
           elog_printf(DIAG, "ring %s has been removed", ring);
-	  ring->method->ll_unlock(ring->handle);
+	  rs_priv_unlock(ring->share);
 	  ring->ringid = -1;	/* invalidate ring */
 	  return 0;
      }
@@ -1485,13 +1614,28 @@ int   rs_purge(RS ring		/* ring descriptor */,
 		      actual_kill, removed);
 
      /* removed purged rows from the index & save */
-     newset = tableset_create(index);
-     tableset_where(newset, "seq",  gt, util_u32toa(purge_to));
-     newindex = tableset_into(newset);
-     r = ring->method->ll_write_index(ring->handle, ring->ringid, newindex);
+     if (index) {
+	  newset = tableset_create(index);
+	  tableset_where(newset, "seq",  gt, util_u32toa(purge_to));
+	  newindex = tableset_into(newset);
+	  r = ring->method->ll_write_index(ring->handle, ring->ringid, 
+					   newindex);
+     } else {
+	  r = ring->method->ll_expire_index(ring->handle, ring->ringid, 
+					    purge_to);
+	  if (r != actual_kill)
+	       elog_printf(ERROR, "discrepancy between index removal "
+			   "quantities %d vs %d", actual_kill, r);
+
+	  /* pick up the new oldest time and hash while locked, but keep 
+	   * our youngest sequence if the ring has been emptied */
+	  youngest = ring->youngest;
+	  rs_priv_load_ends(ring);
+	  ring->youngest = youngest;
+     }
 
      /* unlock */
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
 
      /* change pointers and potentially reset sequences */
      ring->oldest = purge_to + 1;
@@ -1499,26 +1643,34 @@ int   rs_purge(RS ring		/* ring descriptor */,
           /* ring->oldest = ring->youngest = */ ring->current = -1;
      else if (ring->current < ring->oldest)
           ring->current = ring->oldest;
-     if (table_nrows(newindex) > 0) {
-          table_first(newindex);
-	  ring->oldest_t    = strtol(table_getcurrentcell(newindex, "time"),
-				     (char**)NULL, 10);
-	  ring->oldest_hash = strtol(table_getcurrentcell(newindex, "hd_hash"),
-				     (char**)NULL, 10);
-	  table_last(newindex);
-	  ring->youngest_t   = strtol(table_getcurrentcell(newindex, "time"),
-				      (char**)NULL, 10);
-	  ring->youngest_hash= strtol(table_getcurrentcell(newindex,"hd_hash"),
-				      (char**)NULL, 10);
-     } else {  
-          ring->youngest_t    = ring->oldest_t    = 0;
+     if (index) {
+	  if (table_nrows(newindex) > 0) {
+	       table_first(newindex);
+	       ring->oldest_t    = strtol(table_getcurrentcell(newindex, 
+								"time"),
+					  (char**)NULL, 10);
+	       ring->oldest_hash = strtol(table_getcurrentcell(newindex, 
+								"hd_hash"),
+					  (char**)NULL, 10);
+	       table_last(newindex);
+	       ring->youngest_t   = strtol(table_getcurrentcell(newindex, 
+								 "time"),
+					   (char**)NULL, 10);
+	       ring->youngest_hash= strtol(table_getcurrentcell(newindex,
+								 "hd_hash"),
+					   (char**)NULL, 10);
+	  } else {  
+	       ring->youngest_t    = ring->oldest_t    = 0;
+	       ring->youngest_hash = ring->oldest_hash = 0;
+	  }
+	  table_destroy(index);
+	  table_destroy(newindex);
+	  tableset_destroy(newset);
+     } else if (ring->oldest > ring->youngest) {
+	  ring->youngest_t    = ring->oldest_t    = 0;
 	  ring->youngest_hash = ring->oldest_hash = 0;
      }
 
-     table_destroy(index);
-     table_destroy(newindex);
-     tableset_destroy(newset);
-
      return actual_kill;
 }
 
@@ -1544,7 +1696,6 @@ int   rs_stat(RS ring			/* ring descriptor */,
 	      )
 
 {
-     TABLE index;
      int r;
 
      if (ring->ringid == -1) {
@@ -1553,10 +1704,10 @@ int   rs_stat(RS ring			/* ring descriptor */,
      }
 
      /* fetch up-to-date ring and ring directory structure */
-     if ( ! ring->method->ll_lock(ring->handle, RS_RDLOCK, "rs_stat") )
+     if ( ! rs_priv_lock(ring->share, RS_RDLOCK, "rs_stat") )
 	  return 0;
-     r = rs_priv_load_index(ring, &index);
-     ring->method->ll_unlock(ring->handle);
+     r = rs_priv_load_ends(ring);
+     rs_priv_unlock(ring->share);
      if ( ! r ) {
 	  elog_printf(DIAG, "ring %s has been removed", ring);
 	  ring->ringid = -1;	/* invalidate ring */
@@ -1574,8 +1725,6 @@ int   rs_stat(RS ring			/* ring descriptor */,
      *ret_youngest_hash = ring->youngest_hash;
      *ret_current       = ring->current;
 
-     table_destroy(index);
-
      return (1);
 }
 
@@ -1689,8 +1838,9 @@ TABLE rs_inforings(RS_METHOD method	/* method vectors */,
 		   char *filename	/* file name of ringstore */)
 {
      RS_LLD lld;
-     TABLE rings, index;
+     TABLE rings;
      int ringid;
+     struct rs_index_entry oldest, youngest;
 
      /* open file read only and grab a read lock */
      method->ll_init();
@@ -1712,26 +1862,22 @@ TABLE rs_inforings(RS_METHOD method	/* method vectors */,
           table_traverse(rings) {
 	       ringid = strtol(table_getcurrentcell(rings, "id"),
 			       (char**)NULL, 10);
-	       index    = method->ll_read_index(lld, ringid);
-	       if (index && table_nrows(index) > 0) {
-		    table_first(index);
+	       if (rs_priv_index_ends(method, lld, ringid, 
+				      &oldest, &youngest) > 0) {
 		    table_replacecurrentcell_alloc(rings, "oseq", 
-					table_getcurrentcell(index, "seq"));
+					util_i32toa(oldest.seq));
 		    table_replacecurrentcell_alloc(rings, "otime", 
-					table_getcurrentcell(index, "time"));
-		    table_last(index);
+					util_i32toa(oldest.time));
 		    table_replacecurrentcell_alloc(rings, "yseq", 
-					table_getcurrentcell(index, "seq"));
+					util_i32toa(youngest.seq));
 		    table_replacecurrentcell_alloc(rings, "ytime", 
-					table_getcurrentcell(index, "time"));
+					util_i32toa(youngest.time));
 	       } else {
 		    table_replacecurrentcell_alloc(rings, "oseq",  "-1");
 		    table_replacecurrentcell_alloc(rings, "otime", "0");
 		    table_replacecurrentcell_alloc(rings, "yseq",  "-1");
 		    table_replacecurrentcell_alloc(rings, "ytime", "0");
 	       }
-	       if (index)
-		    table_destroy(index);
 	  }
      }
 
@@ -1755,11 +1901,12 @@ TABLE rs_infoconsrings(RS_METHOD method	/* method vectors */,
 		       char *filename	/* file name of ringstore */)
 {
      RS_LLD lld;
-     TABLE rings, index;
+     TABLE rings;
      TREE *oldest, *youngest;
      char *name;
      time_t otime, ytime;
      int ringid;
+     struct rs_index_entry o_ent, y_ent;
 
      /* open file read only and grab a read lock */
      method->ll_init();
@@ -1790,19 +1937,9 @@ TABLE rs_infoconsrings(RS_METHOD method	/* method vectors */,
           name   = table_getcurrentcell(rings, "name");
           ringid = strtol(table_getcurrentcell(rings, "id"),
 			  (char**)NULL, 10);
-	  index  = method->ll_read_index(lld, ringid);
-	  if (index) {
-	       if (table_nrows(index)) {
-		    table_first(index);
-		    otime = strtol(table_getcurrentcell(index, "time"),
-				   (char**)NULL, 10);
-		    table_last(index);
-		    ytime = strtol(table_getcurrentcell(index, "time"),
-				   (char**)NULL, 10);
-	       } else {
-		    otime = ytime = 0;
-	       }
-	       table_destroy(index);
+	  if (rs_priv_index_ends(method, lld, ringid, &o_ent, &y_ent) > 0) {
+	       otime = o_ent.time;
+	       ytime = y_ent.time;
 	  } else {
 	       otime = ytime = 0;
 	  }
@@ -1925,7 +2062,7 @@ int   rs_change_ringname(RS ring, char *newname)
      }
 
      /* get write lock */
-     if ( ! ring->method->ll_lock(ring->handle, RS_WRLOCK, 
+     if ( ! rs_priv_lock(ring->share, RS_WRLOCK, 
 				  "rs_change_ringname") )
 	  return 0;
 
@@ -1941,7 +2078,7 @@ int   rs_change_ringname(RS ring, char *newname)
 	  elog_printf(ERROR, "can't over write an existing ring %s,%s", 
 		      newname, duration);
 	  nfree(duration);
-	  ring->method->ll_unlock(ring->handle);
+	  rs_priv_unlock(ring->share);
 	  table_destroy(ringdir);
 	  return 0;
      }
@@ -1951,7 +2088,7 @@ int   rs_change_ringname(RS ring, char *newname)
      if (rowindex == -1) {
 	  elog_printf(ERROR, "ring %s,%s does not exist", 
 		      ring->ringname, duration);
-	  ring->method->ll_unlock(ring->handle);
+	  rs_priv_unlock(ring->share);
 	  table_destroy(ringdir);
 	  nfree(duration);
 	  return 0;
@@ -1960,7 +2097,7 @@ int   rs_change_ringname(RS ring, char *newname)
      r = ring->method->ll_write_rings(ring->handle, ringdir);
 
      /* unlock file and free ring table */
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
      table_destroy(ringdir);
      nfree(duration);
 
@@ -1990,7 +2127,7 @@ int   rs_change_duration(RS ring, int newdur)
      }
 
      /* get write lock */
-     if ( ! ring->method->ll_lock(ring->handle, RS_WRLOCK, 
+     if ( ! rs_priv_lock(ring->share, RS_WRLOCK, 
 				  "rs_change_duration") )
 	  return 0;
 
@@ -2008,7 +2145,7 @@ int   rs_change_duration(RS ring, int newdur)
 		      ring->ringname, newduration);
 	  nfree(duration);
 	  nfree(newduration);
-	  ring->method->ll_unlock(ring->handle);
+	  rs_priv_unlock(ring->share);
 	  table_destroy(ringdir);
 	  return 0;
      }
@@ -2018,7 +2155,7 @@ int   rs_change_duration(RS ring, int newdur)
      if (rowindex == -1) {
 	  elog_printf(ERROR, "ring %s,%s does not exist", 
 		      ring->ringname, duration);
-	  ring->method->ll_unlock(ring->handle);
+	  rs_priv_unlock(ring->share);
 	  table_destroy(ringdir);
 	  nfree(duration);
 	  nfree(newduration);
@@ -2028,7 +2165,7 @@ int   rs_change_duration(RS ring, int newdur)
      r = ring->method->ll_write_rings(ring->handle, ringdir);
 
      /* unlock file and free ring table */
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
      table_destroy(ringdir);
      nfree(duration);
      nfree(newduration);
@@ -2058,7 +2195,7 @@ int   rs_change_longname(RS ring, char *newlong)
      }
 
      /* get write lock */
-     if ( ! ring->method->ll_lock(ring->handle, RS_WRLOCK, 
+     if ( ! rs_priv_lock(ring->share, RS_WRLOCK, 
 				  "rs_change_longname") )
 	  return 0;
 
@@ -2071,7 +2208,7 @@ int   rs_change_longname(RS ring, char *newlong)
      if (rowindex == -1) {
 	  elog_printf(ERROR, "ring %s,%s does not exist", 
 		      ring->ringname, duration);
-	  ring->method->ll_unlock(ring->handle);
+	  rs_priv_unlock(ring->share);
 	  table_destroy(ringdir);
 	  nfree(duration);
 	  return 0;
@@ -2080,7 +2217,7 @@ int   rs_change_longname(RS ring, char *newlong)
      r = ring->method->ll_write_rings(ring->handle, ringdir);
 
      /* unlock file and free ring table */
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
      table_destroy(ringdir);
      nfree(duration);
 
@@ -2106,7 +2243,7 @@ int   rs_change_comment (RS ring, char *newcomment)
      }
 
      /* get write lock */
-     if ( ! ring->method->ll_lock(ring->handle, RS_WRLOCK, 
+     if ( ! rs_priv_lock(ring->share, RS_WRLOCK, 
 				  "rs_change_comment") )
 	  return 0;
 
@@ -2119,7 +2256,7 @@ int   rs_change_comment (RS ring, char *newcomment)
      if (rowindex == -1) {
 	  elog_printf(ERROR, "ring %s,%s does not exist", 
 		      ring->ringname, duration);
-	  ring->method->ll_unlock(ring->handle);
+	  rs_priv_unlock(ring->share);
 	  table_destroy(ringdir);
 	  nfree(duration);
 	  return 0;
@@ -2128,7 +2265,7 @@ int   rs_change_comment (RS ring, char *newcomment)
      r = ring->method->ll_write_rings(ring->handle, ringdir);
 
      /* unlock file and free ring table */
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
      table_destroy(ringdir);
      nfree(duration);
 
@@ -2292,11 +2429,11 @@ TABLE rs_info_ring(RS ring)
 	  return NULL;
      }
 
-     if ( ! ring->method->ll_lock(ring->handle, RS_RDLOCK, "rs_info_ring") ) {
+     if ( ! rs_priv_lock(ring->share, RS_RDLOCK, "rs_info_ring") ) {
 	  return NULL;
      }
      tab = ring->method->ll_read_rings(ring->handle);
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
 
      return tab;
 }
@@ -2311,13 +2448,13 @@ TABLE rs_info_header(RS ring)
 	  return NULL;
      }
 
-     if ( ! ring->method->ll_lock(ring->handle, RS_RDLOCK, "rs_info_header")) {
+     if ( ! rs_priv_lock(ring->share, RS_RDLOCK, "rs_info_header")) {
 	  return NULL;
      }
 
      /* update the header cache */
      newheaders = ring->method->ll_read_headers(ring->handle);
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
      if (newheaders) {
 	  if (ring->hdcache) {
 	       itree_clearoutandfree(ring->hdcache);
@@ -2348,11 +2485,11 @@ TABLE rs_info_index(RS ring)
 	  return NULL;
      }
 
-     if ( ! ring->method->ll_lock(ring->handle, RS_RDLOCK, "rs_info_index") ) {
+     if ( ! rs_priv_lock(ring->share, RS_RDLOCK, "rs_info_index") ) {
 	  return NULL;
      }
      rs_priv_load_index(ring, &tab);
-     ring->method->ll_unlock(ring->handle);
+     rs_priv_unlock(ring->share);
 
      return tab;
 }
@@ -2407,8 +2544,7 @@ ITREE *rs_priv_table_to_dblock(TABLE tab,	  /* table containing data */
 	       table_rmcol(itab, "_time");
 	       table_rmcol(itab, "_dur");
 	       d->hd_hashkey = hash;
-	       d->data = table_outbody(itab);
-	       d->__priv_alloc_mem = d->data;
+	       rs_priv_dblock_body(d, itab);
 	       itree_add(dblocks, ikey, d);
 	       table_destroy(itab);
 	  }
@@ -2429,6 +2565,8 @@ ITREE *rs_priv_table_to_dblock(TABLE tab,	  /* table containing data */
 	       d->time = ikey;
 	       d->hd_hashkey = hash;
 	       d->data = str;
+	       d->datalen = -1;
+	       d->headroom = 0;
 	       d->__priv_alloc_mem = d->data;
 	       itree_add(dblocks, ikey, d);
 	       /*table_destroy(itab);*/
@@ -2442,8 +2580,7 @@ ITREE *rs_priv_table_to_dblock(TABLE tab,	  /* table containing data */
 	  d = xnmalloc(sizeof(struct rs_data_block));
 	  d->time = time(NULL);
 	  d->hd_hashkey = hash;
-	  d->data = table_outbody(itab);
-	  d->__priv_alloc_mem = d->data;
+	  rs_priv_dblock_body(d, itab);
 	  itree_append(dblocks, d);
 	  table_destroy(itab);
      }
@@ -2454,6 +2591,25 @@ ITREE *rs_priv_table_to_dblock(TABLE tab,	  /* table containing data */
 }
 
 
+/*
+ * Serialise the body of tab as the data of d, with RS_DBLOCK_HEADROOM
+ * bytes before it so that the low level storage can prefix the data 
+ * with its own fields and write it without making a copy.
+ * The data is freed with the block by rs_free_dblock()
+ */
+void   rs_priv_dblock_body(RS_DBLOCK d, TABLE tab)
+{
+     struct table_outbuf out;
+
+     table_outbuf_init(&out, RS_DBLOCK_HEADROOM);
+     table_outbody_buf(tab, &out);
+     d->data     = table_outbuf_text(&out);
+     d->datalen  = table_outbuf_len(&out);
+     d->headroom = RS_DBLOCK_HEADROOM;
+     d->__priv_alloc_mem = out.buf;
+}
+
+
 /*
  * Take a list of RS_DBLOCKs and create a single TABLE, which may 
  * contain multiple sequences.
@@ -2478,10 +2634,12 @@ TABLE rs_priv_dblock_to_table(ITREE *db,	/* list of dblocks */
      TREE *row;
      int hasseq, hastime, hasdur, rowkey;
 
-     if (existing_tab)
+     if (existing_tab) {
 	  tab = existing_tab;
-     else
+     } else {
 	  tab = table_create();
+	  table_usearena(tab, 0);
+     }
      
      /* if we must have meta data in final table, make sure we have 
       * the right columns */
@@ -2529,8 +2687,8 @@ TABLE rs_priv_dblock_to_table(ITREE *db,	/* list of dblocks */
 	  table_rmcol(loadtab, "_dur");
 	  table_rmcol(loadtab, "_time");
 	  table_rmcol(loadtab, "_seq");
-	  data = xnstrdup(dblock->data);
-	  table_freeondestroy(loadtab, data);
+	  table_usearena(loadtab, 0);
+	  data = table_strdup(loadtab, dblock->data);
 	  table_scan(loadtab, data, RS_VALSEP, TABLE_SINGLESEP, 
 		     TABLE_NOCOLNAMES, TABLE_NORULER);
 
@@ -2621,6 +2779,290 @@ int    rs_priv_load_index(RS ring, TABLE *index)
 }
 
 
+/*
+ * Validate the ring exists and update the ring buffer sequence pointers 
+ * in the ring descriptor, like rs_priv_load_index() but without 
+ * loading the whole index when the low level method can give us
+ * just its ends. Requires a read or write lock.
+ * Returns 1 for success or 0 for failure.
+ */
+int    rs_priv_load_ends(RS ring)
+{
+     struct rs_index_entry oldest, youngest;
+     int n;
+
+     n = rs_priv_index_ends(ring->method, ring->handle, ring->ringid, 
+			    &oldest, &youngest);
+     if (n < 0)
+	  return 0;	/* failure */
+     if (n > 0) {
+	  ring->oldest        = oldest.seq;
+	  ring->oldest_t      = oldest.time;
+	  ring->oldest_hash   = oldest.hd_hash;
+	  ring->youngest      = youngest.seq;
+	  ring->youngest_t    = youngest.time;
+	  ring->youngest_hash = youngest.hd_hash;
+     } else {
+	  ring->oldest      = ring->youngest      = -1;
+	  ring->oldest_t    = ring->youngest_t    = -1;
+	  ring->oldest_hash = ring->youngest_hash = 0;
+     }
+     if (ring->current < ring->oldest)
+	  ring->current      = ring->oldest;
+
+     return 1;		/* success */
+}
+
+
+/*
+ * Find the oldest and youngest entries of a ring's index using the 
+ * ll_index_ends() vector if the method has one, or by reading the 
+ * whole index if not. Requires a read or write lock.
+ * Returns the number of entries in the index or -1 for failure.
+ */
+int    rs_priv_index_ends(RS_METHOD method, RS_LLD lld, int ringid,
+			  RS_IDXENT oldest, RS_IDXENT youngest)
+{
+     TABLE it;
+     int n;
+
+     if (method->ll_index_ends)
+	  return method->ll_index_ends(lld, ringid, oldest, youngest);
+
+     it = method->ll_read_index(lld, ringid);
+     if ( ! it )
+	  return -1;	/* failure */
+     n = table_nrows(it);
+     if (n) {
+	  table_first(it);
+	  oldest->seq       = strtol(table_getcurrentcell(it, "seq"),
+				     (char**)NULL, 10);
+	  oldest->time      = strtol(table_getcurrentcell(it, "time"), 
+				     (char**)NULL, 10);
+	  oldest->hd_hash   = strtoul(table_getcurrentcell(it, "hd_hash"), 
+				      (char**)NULL, 10);
+	  table_last(it);
+	  youngest->seq     = strtol(table_getcurrentcell(it, "seq"),
+				     (char**)NULL, 10);
+	  youngest->time    = strtol(table_getcurrentcell(it, "time"), 
+				     (char**)NULL, 10);
+	  youngest->hd_hash = strtoul(table_getcurrentcell(it, "hd_hash"), 
+				      (char**)NULL, 10);
+     }
+     table_destroy(it);
+
+     return n;
+}
+
+
+/*
+ * Open a low level descriptor for filename. If flags contain RS_PERSIST
+ * and the file is already open with RS_PERSIST, that descriptor is 
+ * shared, otherwise a new one is opened. 
+ * Returns the share or NULL if unable to open.
+ */
+struct rs_lld_share *rs_priv_share_open(RS_METHOD method, char *filename,
+					int filemode, int flags)
+{
+     struct rs_lld_share *share;
+     RS_LLD lld;
+
+     if (flags & RS_PERSIST) {
+	  share = tree_find(rs_lld_shares, filename);
+	  if (share != TREE_NOVAL && share->method == method) {
+	       share->nref++;
+	       return share;
+	  }
+     }
+
+     lld = method->ll_open(filename, filemode, flags);
+     if ( ! lld )
+	  return NULL;
+
+     share = xnmalloc(sizeof(struct rs_lld_share));
+     share->method   = method;
+     share->handle   = lld;
+     share->filename = xnstrdup(filename);
+     share->nref     = 1;
+     share->txn      = 0;
+     if ((flags & RS_PERSIST) && 
+	 tree_find(rs_lld_shares, filename) == TREE_NOVAL)
+	  tree_add(rs_lld_shares, share->filename, share);
+
+     return share;
+}
+
+
+/* Release a share, closing the low level descriptor if it is the last */
+void   rs_priv_share_close(struct rs_lld_share *share)
+{
+     if (--share->nref > 0)
+	  return;
+
+     if (tree_find(rs_lld_shares, share->filename) == share)
+	  tree_rm(rs_lld_shares);
+     share->method->ll_close(share->handle);
+     nfree(share->filename);
+     nfree(share);
+}
+
+
+/*
+ * Lock the low level descriptor, unless a transaction is in progress,
+ * in which case it is already write locked.
+ * Returns 1 for success or 0 for failure.
+ */
+int    rs_priv_lock(struct rs_lld_share *share, enum rs_db_lock rw, 
+		    char *where)
+{
+     if (share->txn)
+	  return 1;
+     return share->method->ll_lock(share->handle, rw, where);
+}
+
+
+/* Unlock the low level descriptor, unless a transaction is in progress */
+void   rs_priv_unlock(struct rs_lld_share *share)
+{
+     if (share->txn)
+	  return;
+     share->method->ll_unlock(share->handle);
+}
+
+
+/*
+ * Validate the ring exists, update the ring buffer sequence pointers and 
+ * bring the ring's cache of index entries (tcache) up to date. 
+ * Entries that have expired since the last call are dropped from the 
+ * oldest end and only entries younger than those held are read, so
+ * in a ring that is just being added to the cost of a call is small.
+ * Requires a read or write lock.
+ * Returns 1 for success or 0 for failure (like the ring does not 
+ * exist anymore)
+ */
+int    rs_priv_load_tcache(RS ring)
+{
+     TABLE it;
+     RS_IDXENT ents;
+     struct rs_index_entry ent;
+     int i, n, from;
+
+     if ( ! rs_priv_load_ends(ring) )
+	  return 0;	/* failure */
+
+     /* an empty ring, or a cache that is ahead of the ring, is reset */
+     if (ring->youngest == -1 || (ring->tcache_n && 
+			  ring->tcache[ring->tcache_n-1].seq > ring->youngest))
+	  ring->tcache_n = 0;
+     if (ring->youngest == -1)
+	  return 1;
+
+     /* drop expired entries */
+     i = rs_priv_tcache_byseq(ring, ring->oldest);
+     if (i > 0) {
+	  ring->tcache_n -= i;
+	  memmove(ring->tcache, ring->tcache + i, 
+		  ring->tcache_n * sizeof(struct rs_index_entry));
+     }
+
+     /* append entries that are new since the last call */
+     if (ring->tcache_n)
+	  from = ring->tcache[ring->tcache_n-1].seq + 1;
+     else
+	  from = ring->oldest;
+     if (from > ring->youngest)
+	  return 1;	/* up to date */
+     if (ring->method->ll_read_index_range) {
+	  n = ring->method->ll_read_index_range(ring->handle, ring->ringid,
+						from, -1, &ents);
+	  if (n < 0)
+	       return 0;	/* failure */
+	  if (n > 0) {
+	       rs_priv_tcache_append(ring, ents, n);
+	       nfree(ents);
+	  }
+     } else {
+	  it = ring->method->ll_read_index(ring->handle, ring->ringid);
+	  if ( ! it )
+	       return 0;	/* failure */
+	  table_traverse(it) {
+	       ent.seq     = strtol(table_getcurrentcell(it, "seq"),
+				    (char**)NULL, 10);
+	       if (ent.seq < from)
+		    continue;
+	       ent.time    = strtol(table_getcurrentcell(it, "time"), 
+				    (char**)NULL, 10);
+	       ent.hd_hash = strtoul(table_getcurrentcell(it, "hd_hash"), 
+				     (char**)NULL, 10);
+	       rs_priv_tcache_append(ring, &ent, 1);
+	  }
+	  table_destroy(it);
+     }
+
+     return 1;		/* success */
+}
+
+
+/* Append n index entries to the ring's tcache, growing it as needed */
+void   rs_priv_tcache_append(RS ring, RS_IDXENT ents, int n)
+{
+     if (ring->tcache_n + n > ring->tcache_alloc) {
+	  ring->tcache_alloc = (ring->tcache_n + n) * 2;
+	  ring->tcache = xnrealloc(ring->tcache, ring->tcache_alloc * 
+				   sizeof(struct rs_index_entry));
+     }
+     memcpy(ring->tcache + ring->tcache_n, ents, 
+	    n * sizeof(struct rs_index_entry));
+     ring->tcache_n += n;
+}
+
+
+/*
+ * Bisect the ring's tcache for the first entry whose sequence is the same
+ * or younger than seq. Returns its position in the cache, which will be 
+ * tcache_n if there is none.
+ */
+int    rs_priv_tcache_byseq(RS ring, int seq)
+{
+     int lo, hi, mid;
+
+     lo = 0;
+     hi = ring->tcache_n;
+     while (lo < hi) {
+	  mid = (lo + hi) / 2;
+	  if (ring->tcache[mid].seq < seq)
+	       lo = mid + 1;
+	  else
+	       hi = mid;
+     }
+     return lo;
+}
+
+
+/*
+ * Bisect the ring's tcache for the first entry whose insertion time is 
+ * the same or later than time. Times are expected to ascend with 
+ * sequence, as they do when data is stored as it is sampled.
+ * Returns its position in the cache, which will be tcache_n if there 
+ * is none.
+ */
+int    rs_priv_tcache_bytime(RS ring, time_t time)
+{
+     int lo, hi, mid;
+
+     lo = 0;
+     hi = ring->tcache_n;
+     while (lo < hi) {
+	  mid = (lo + hi) / 2;
+	  if (ring->tcache[mid].time < time)
+	       lo = mid + 1;
+	  else
+	       hi = mid;
+     }
+     return lo;
+}
+
+
 /*
  * Cache aware storage helper function. Given a header string, its 
  * corresponding unique value is returned and the association will have 
@@ -2716,6 +3158,8 @@ char * rs_priv_hash_to_header(RS ring, unsigned long hdhash)
 #define RSFILE1  "t.rs.1.rs"
 #define RSRING1  "ring1"
 #define RSRINGL1 "ring 1 long name"
+#define RSRING2  "ring2"
+#define RSRINGL2 "ring 2 long name"
 #define RSHEADER1 "tom\tdick\tharry"
 #define RSTEXT1 RSHEADER1 "\n--\n1\t2\t3"
 #define RSTEXT2 "tom\tdick\tharry\t_seq\n--\n1\t2\t3\t0\n2\t3\t4\t1\n3\t4\t5\t2\n"
@@ -2725,8 +3169,9 @@ char * rs_priv_hash_to_header(RS ring, unsigned long hdhash)
 #define RSTEXT5 RSHEADER5 "\n--\n1\0012\0013"
 
 int main() {
-     RS rs1;
-     TABLE tab1,  tab2,  tab3,  tab4,  tab5;
+     RS rs1, rs2, rings[3];
+     time_t t1;
+     TABLE tab1,  tab2,  tab3,  tab4,  tab5, tabs[3];
      char *buf1, *buf2, *buf3, *buf4, *buf5;
      int r;
      ITREE *dblock1;
@@ -3067,6 +3512,113 @@ int main() {
      table_destroy(tab4);
      table_destroy(tab5);
 
+     /* test 6: find samples by time from the time cache, keeping it 
+      * up to date as the ring grows and expires */
+     rs1 = rs_open(&rs_gdbm_method, RSFILE1, 0644, RSRING2, RSRINGL2,
+		   "Timed test ring", 10, 10, RS_CREATE);
+     if (!rs1)
+	  elog_die(FATAL, "[6a] Can't create ringstore");
+     for (r=0; r < 15; r++) {
+	  tab1 = table_create();
+	  table_addcol(tab1, "tom", NULL);
+	  table_addcol(tab1, "_time", NULL);
+	  table_addemptyrow(tab1);
+	  table_replacecurrentcell_alloc(tab1, "tom", util_i32toa(r));
+	  table_replacecurrentcell_alloc(tab1, "_time", 
+					 util_i32toa(1000+r*10));
+	  if (!rs_put(rs1, tab1))
+	       elog_die(FATAL, "[6a] Didn't save table %d", r);
+	  table_destroy(tab1);
+     }
+     if ((r = rs_goto_time(rs1, 1055)) != 5)
+	  elog_die(FATAL, "[6b] goto 1055 gave %d not 5", r);
+     if ((r = rs_goto_time(rs1, 500)) != 5)
+	  elog_die(FATAL, "[6c] goto before oldest gave %d not 5", r);
+     if ((r = rs_goto_time(rs1, 1130)) != 13)
+	  elog_die(FATAL, "[6d] goto 1130 gave %d not 13", r);
+     if ((r = rs_goto_time(rs1, 5000)) != 14)
+	  elog_die(FATAL, "[6e] goto after youngest gave %d not 14", r);
+     tab5 = rs_mget_range(rs1, -1, -1, 1095, 1120);
+     if (!tab5 || table_nrows(tab5) != 3)
+	  elog_die(FATAL, "[6f] time range should give 3 rows");
+     table_first(tab5);
+     if (strcmp(table_getcurrentcell(tab5, "tom"), "10") != 0)
+	  elog_die(FATAL, "[6f] time range starts at %s not 10",
+		   table_getcurrentcell(tab5, "tom"));
+     table_destroy(tab5);
+     tab5 = rs_mget_range(rs1, 7, 12, 1100, -1);
+     if (!tab5 || table_nrows(tab5) != 3)
+	  elog_die(FATAL, "[6g] sequence and time range should give 3 rows");
+     table_destroy(tab5);
+     if (rs_mget_range(rs1, -1, -1, 2000, -1))
+	  elog_die(FATAL, "[6h] time range after youngest should be empty");
+     tab1 = table_create();
+     table_addcol(tab1, "tom", NULL);
+     table_addcol(tab1, "_time", NULL);
+     table_addemptyrow(tab1);
+     table_replacecurrentcell_alloc(tab1, "tom", "15");
+     table_replacecurrentcell_alloc(tab1, "_time", "1150");
+     if (!rs_put(rs1, tab1))
+	  elog_die(FATAL, "[6i] Didn't save table");
+     table_destroy(tab1);
+     if ((r = rs_goto_time(rs1, 1000)) != 6)
+	  elog_die(FATAL, "[6j] goto after expiry gave %d not 6", r);
+     if (rs1->tcache_n != 10 || rs1->tcache[0].seq != 6 || 
+	 rs1->tcache[9].time != 1150)
+	  elog_die(FATAL, "[6j] cache not refreshed incrementally");
+     rs_close(rs1);
+
+     /* test 7: persistent rings share a descriptor and are put in batches
+      * and transactions under one lock */
+     rs1 = rs_open(&rs_gdbm_method, RSFILE1, 0644, RSRING1, RSRINGL1,
+		   "Initial test ring", 5, 5, RS_CREATE|RS_PERSIST);
+     rs2 = rs_open(&rs_gdbm_method, RSFILE1, 0644, RSRING2, RSRINGL2,
+		   "Timed test ring", 10, 10, RS_CREATE|RS_PERSIST);
+     if (!rs1 || !rs2)
+	  elog_die(FATAL, "[7a] Can't open persistent rings");
+     if (rs1->share != rs2->share || rs1->share->nref != 2)
+	  elog_die(FATAL, "[7a] persistent rings do not share");
+     rings[0] = rs1;
+     rings[1] = rs2;
+     rings[2] = rs1;
+     tabs[0] = tabs[2] = table_create();
+     table_addcol(tabs[0], "tom", NULL);
+     table_addemptyrow(tabs[0]);
+     table_replacecurrentcell(tabs[0], "tom", "batch");
+     tabs[1] = table_create();
+     table_addcol(tabs[1], "tom", NULL);
+     table_addcol(tabs[1], "_time", NULL);
+     table_addemptyrow(tabs[1]);
+     table_replacecurrentcell(tabs[1], "tom", "batch");
+     table_replacecurrentcell(tabs[1], "_time", "1160");
+     if ((r = rs_put_batch(rings, tabs, 3)) != 3)
+	  elog_die(FATAL, "[7b] batch put %d not 3", r);
+     if (rs1->share->txn || rs1->intxn || rs2->intxn)
+	  elog_die(FATAL, "[7b] batch left a transaction open");
+     rs_youngest(rs2, &r, &t1);
+     if (r != 16)
+	  elog_die(FATAL, "[7c] youngest after batch %d not 16", r);
+     if ( ! rs_txn_begin(rs1) || ! rs_txn_begin(rs2) )
+	  elog_die(FATAL, "[7d] unable to begin transactions");
+     if (rs1->share->txn != 2)
+	  elog_die(FATAL, "[7d] transactions not shared");
+     if ( ! rs_put(rs1, tabs[0]) || ! rs_put(rs2, tabs[1]) )
+	  elog_die(FATAL, "[7e] unable to put in transaction");
+     rs_txn_commit(rs1);
+     if (rs1->share->txn != 1)
+	  elog_die(FATAL, "[7f] first commit should leave one");
+     rs_txn_commit(rs2);
+     if (rs_txn_commit(rs2))
+	  elog_die(FATAL, "[7f] committed when not in transaction");
+     tab5 = rs_mget_range(rs2, 16, 17, -1, -1);
+     if (!tab5 || table_nrows(tab5) != 2)
+	  elog_die(FATAL, "[7g] rows put in transaction not read");
+     table_destroy(tab5);
+     table_destroy(tabs[0]);
+     table_destroy(tabs[1]);
+     rs_close(rs1);
+     rs_close(rs2);
+
      elog_printf(INFO, "all tests successfully completed");
 
      rs_fini();
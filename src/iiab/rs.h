@@ -67,7 +67,10 @@
 /* ------ declarations ------ */
 #define RS_SUPER_VERSION	2
 #define RS_CREATE		1
+#define RS_PERSIST		2	/* keep datastore open between locks and
+					 * share it between rings */
 #define RS_VALSEP		"\t"
+#define RS_DBLOCK_HEADROOM	48	/* space for "time|hash|" before data */
 
 
 /* ------ enumerations ------ */
@@ -88,7 +91,8 @@ enum rs_db_lock {
 enum rs_lld_type {
      RS_LLD_TYPE_NONE,	/* no descriptor */
      RS_LLD_TYPE_GDBM,	/* GDBM descriptor */
-     RS_LLD_TYPE_BERK	/* Berkley DB descriptor */
+     RS_LLD_TYPE_BERK,	/* Berkley DB descriptor */
+     RS_LLD_TYPE_MEM	/* memory cached GDBM descriptor */
 };
 
 
@@ -101,6 +105,18 @@ extern char *rs_ringidx_hds[];
 /* low level descriptor */
 typedef void * RS_LLD;
 
+/* A low level descriptor and the sessions that use it. Rings opened
+ * with RS_PERSIST on the same file share one of these; other rings
+ * have their own. It also holds the state of transactions, during 
+ * which the descriptor is kept write locked */
+struct rs_lld_share {
+     const struct rs_lowlevel *method;/* method vectors */
+     RS_LLD handle;		/* method descriptor */
+     char *filename;		/* file opened, key in share list */
+     int   nref;		/* number of sessions using handle */
+     int   txn;			/* number of sessions in a transaction */
+};
+
 /* This structure is the handle for ringstore operations and is created
  * by rs_open(). It is used by all public facing interfaces */
 struct rs_session {
@@ -121,6 +137,11 @@ struct rs_session {
      int   current;		/* current sequence in ring (next to read) */
      int   duration;		/* duration in seconds */
      ITREE *hdcache;		/* cached headers keyed by hash value */
+     struct rs_index_entry *tcache;/* cached index, oldest first */
+     int   tcache_n;		/* number of entries in tcache */
+     int   tcache_alloc;	/* number of entries allocated in tcache */
+     struct rs_lld_share *share;/* shared descriptor, handle is a copy */
+     int   intxn;		/* 1 if in a transaction */
 };
 typedef struct rs_session * RS;
 
@@ -148,10 +169,22 @@ struct rs_data_block {
      time_t time;
      unsigned long hd_hashkey;
      char *data;
+     int   datalen;		/* length of data or -1 if not known */
+     int   headroom;		/* bytes before data that low level storage
+				 * may overwrite to prefix it without a
+				 * copy, RS_DBLOCK_HEADROOM or 0 if none */
      void *__priv_alloc_mem;	/* ignore */
 };
 typedef struct rs_data_block * RS_DBLOCK;
 
+/* index entry of a single sample for low level storage */
+struct rs_index_entry {
+     int seq;
+     time_t time;
+     unsigned long hd_hash;
+};
+typedef struct rs_index_entry * RS_IDXENT;
+
 /* Call vectors to the low level storage */
 struct rs_lowlevel {
      void   (*ll_init)         ();
@@ -181,6 +214,15 @@ struct rs_lowlevel {
      int    (*ll_footprint)    (RS_LLD);
      int    (*ll_dumpdb)       (RS_LLD);
      void   (*ll_errstat)      (RS_LLD, int *errnum, char **errstr);
+     /* incremental index access, optional: if NULL, the whole index
+      * is passed as a TABLE with ll_read_index() and ll_write_index() */
+     int    (*ll_index_ends)   (RS_LLD, int ringid, RS_IDXENT oldest,
+				RS_IDXENT youngest);
+     int    (*ll_read_index_range)(RS_LLD, int ringid, int from_seq,
+				   int to_seq, RS_IDXENT *entries);
+     int    (*ll_append_index) (RS_LLD, int ringid, int start_seq,
+				ITREE *dblock);
+     int    (*ll_expire_index) (RS_LLD, int ringid, int to_seq);
 };
 typedef const struct rs_lowlevel * RS_METHOD;
 
@@ -197,6 +239,9 @@ int   rs_destroy(RS_METHOD method, char *filename, char *ringname);
 
 /* stateful TABLE oriented transfer */
 int   rs_put(RS ring, TABLE data);
+int   rs_put_batch(RS *rings, TABLE *data, int n);
+int   rs_txn_begin(RS ring);
+int   rs_txn_commit(RS ring);
 TABLE rs_get(RS ring, int musthave_meta);
 int   rs_replace(RS ring, TABLE data);
 TABLE rs_mget_nseq(RS ring, int nsequences);
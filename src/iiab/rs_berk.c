@@ -723,7 +723,7 @@ int    rs_berk_write_rings (RS_LLD lld, /* RS generic low level descriptor */
  */
 ITREE *rs_berk_read_headers (RS_LLD lld	/* RS generic low level descriptor */)
 {
-     char *headstr, *hd_val, *tok;
+     char *headstr, *hd_val, *tok, *tokpos;
      int length;
      unsigned int hd_hash;
      ITREE *hds;
@@ -745,12 +745,12 @@ ITREE *rs_berk_read_headers (RS_LLD lld	/* RS generic low level descriptor */)
      hds = itree_create();
      if (headstr) {
 	  /* fast, simple list reader for <hd_hash>|<hd_val>\001 */
-          hd_hash = strtoul(strtok(headstr, "|"), NULL, 10);
-	  hd_val = strtok(NULL, "\001");
+          hd_hash = strtoul(strtok_r(headstr, "|", &tokpos), NULL, 10);
+	  hd_val = strtok_r(NULL, "\001", &tokpos);
 	  itree_add(hds, hd_hash, xnstrdup(hd_val));
-	  while ((tok = strtok(NULL, "|"))) {
+	  while ((tok = strtok_r(NULL, "|", &tokpos))) {
 	       hd_hash = strtoul(tok, NULL, 10);
-	       hd_val = strtok(NULL, "\001");
+	       hd_val = strtok_r(NULL, "\001", &tokpos);
 	       itree_add(hds, hd_hash, xnstrdup(hd_val));
 	  }
 	  nfree(headstr);
@@ -938,10 +938,10 @@ int    rs_berk_append_dblock(RS_LLD lld,	/* low level descriptor */
 			     int start_seq, 	/* starting sequence */
 			     ITREE *dblock	/* list of RS_DBLOCK */)
 {
-     int length, r, seq, num_written=0;
+     int length, plen, r, seq, num_written=0;
      RS_BERKD rs;
      RS_DBLOCK d;
-     char key[RS_BERK_DATAKEYLEN];
+     char key[RS_BERK_DATAKEYLEN], prefix[RS_DBLOCK_HEADROOM];
      char *value;
 
      /* param checking and conversion */
@@ -962,11 +962,19 @@ int    rs_berk_append_dblock(RS_LLD lld,	/* low level descriptor */
 	  d = itree_get(dblock);
 	  snprintf(key, RS_BERK_DATAKEYLEN, "%s%d_%d", RS_BERK_DATANAME, 
 		   ringid, seq);
-	  length = strlen(d->data);
-	  value = xnmalloc(length + 25);	/* space for time & hd key */
-	  length = snprintf(value, length+25, "%ld|%lu|%s", 
-			    d->time, d->hd_hashkey, d->data);
-	  length++;	/* include \0 */
+	  length = d->datalen >= 0 ? d->datalen : strlen(d->data);
+	  plen = snprintf(prefix, RS_DBLOCK_HEADROOM, "%ld|%lu|", 
+			  d->time, d->hd_hashkey);
+	  if (d->headroom >= plen) {
+	       /* prefix the data in place */
+	       value = d->data - plen;
+	       memcpy(value, prefix, plen);
+	  } else {
+	       value = xnmalloc(plen + length + 1);
+	       memcpy(value, prefix, plen);
+	       memcpy(value + plen, d->data, length + 1);
+	  }
+	  length += plen + 1;	/* include \0 */
 
 	  /* write the composed block of data */
 	  r = rs_berk_dbreplace(rs, key, value, length);
@@ -976,7 +984,8 @@ int    rs_berk_append_dblock(RS_LLD lld,	/* low level descriptor */
 	       num_written++;
 
 	  /* loop */
-	  nfree(value);
+	  if (d->headroom < plen)
+	       nfree(value);
 	  seq++;
      }
 
@@ -1003,7 +1012,7 @@ ITREE *rs_berk_read_dblock(RS_LLD lld,	  /* low level descriptor */
      RS_BERKD rs;
      RS_DBLOCK d;
      ITREE *dlist;
-     char key[RS_BERK_DATAKEYLEN], *value;
+     char key[RS_BERK_DATAKEYLEN], *value, *tokpos;
      int length, i;
 
      /* param checking and conversion */
@@ -1041,9 +1050,11 @@ ITREE *rs_berk_read_dblock(RS_LLD lld,	  /* low level descriptor */
 	   * hold a reference to it so that mem can be released
 	   * with rs_free_dblock() */
 	  d = xnmalloc(sizeof(struct rs_data_block));
-	  d->time = strtol(strtok(value, "|"), NULL, 10);
-	  d->hd_hashkey = strtoul(strtok(NULL, "|"), NULL, 10);
-	  d->data = strtok(NULL, "|");
+	  d->time = strtol(strtok_r(value, "|", &tokpos), NULL, 10);
+	  d->hd_hashkey = strtoul(strtok_r(NULL, "|", &tokpos), NULL, 10);
+	  d->data = strtok_r(NULL, "|", &tokpos);
+	  d->datalen = -1;
+	  d->headroom = 0;
 	  d->__priv_alloc_mem = value;
 	  itree_add(dlist, start_seq+i, d);
      }
@@ -1876,14 +1887,20 @@ int main()
      data1.time = time(NULL);
      data1.hd_hashkey = 6783365;
      data1.data = "tom";
+     data1.datalen = -1;
+     data1.headroom = 0;
      itree_append(dlist, &data1);
      data2.time = time(NULL);
      data2.hd_hashkey = 6783365;
      data2.data = "dick";
+     data2.datalen = -1;
+     data2.headroom = 0;
      itree_append(dlist, &data2);
      data3.time = time(NULL);
      data3.hd_hashkey = 6783365;
      data3.data = "harry";
+     data3.datalen = -1;
+     data3.headroom = 0;
      itree_append(dlist, &data3);
      if ( ! rs_berk_lock(rs, RS_WRLOCK, "test")) {
 	  fprintf(stderr, "[5] Unable to lock rs_berk for writing\n");
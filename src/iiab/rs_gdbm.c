@@ -18,6 +18,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/file.h>
 #include "nmalloc.h"
 #include "elog.h"
 #include "util.h"
@@ -35,7 +37,8 @@ const struct rs_lowlevel rs_gdbm_method = {
      rs_gdbm_rm_index,      rs_gdbm_append_dblock, rs_gdbm_read_dblock, 
      rs_gdbm_expire_dblock, rs_gdbm_read_substr,   rs_gdbm_read_value,
      rs_gdbm_write_value,   rs_gdbm_checkpoint,    rs_gdbm_footprint,
-     rs_gdbm_dumpdb,        rs_gdbm_errstat
+     rs_gdbm_dumpdb,        rs_gdbm_errstat,       rs_gdbm_index_ends,
+     rs_gdbm_read_index_range, rs_gdbm_append_index, rs_gdbm_expire_index
 };
 
 /* statics */
@@ -58,19 +61,24 @@ void   rs_gdbm_fini         ()
 
 /*
  * Open the gdbm file to support the ringstore low level interface.
- * If create is set, call GDBM with the filename and the mode and create
- * if not already there. Otherwise, just attempt to open the file for
- * reading.
- * Because of the way GDBM works, the file is not kept open and this call
- * only opens the file to check for or write the superblock. The details are
- * held in the low level descriptor so that calls to rs_gdbm_lock()
- * actually open the GDBM file for work with the appropreate lock
- * which is completed with rs_gdbm_unlock().
+ * If RS_CREATE is set in flags, call GDBM with the filename and the mode 
+ * and create if not already there. Otherwise, just attempt to open the 
+ * file for reading.
+ * Because of the way GDBM works, the file is not normally kept open and 
+ * this call only opens the file to check for or write the superblock. 
+ * The details are held in the low level descriptor so that calls to 
+ * rs_gdbm_lock() actually open the GDBM file for work with the 
+ * appropreate lock which is completed with rs_gdbm_unlock().
+ * If RS_PERSIST is set in flags, the GDBM file is opened by the first 
+ * lock and then kept open until rs_gdbm_close(). Exclusion is provided 
+ * by a sidecar lock file (filename.lock) instead of GDBM's own locks, 
+ * which also carries a generation count of writes so that a stale 
+ * handle can be reopened when another process has changed the file.
  * Returns the low level descriptor if successful or NULL otherwise.
  */
 RS_LLD rs_gdbm_open         (char *filename,	/* name of GDBM file */
 			     mode_t perm, 	/* unix file creation perms */
-			     int create		/* 1=create */ )
+			     int flags		/* RS_CREATE|RS_PERSIST */ )
 {
      GDBM_FILE gdbm;
      RS_GDBMD rs;
@@ -90,7 +98,7 @@ RS_LLD rs_gdbm_open         (char *filename,	/* name of GDBM file */
 	  }
 
 	  /* readers go no further */
-	  if ( ! create ) {
+	  if ( ! (flags & RS_CREATE) ) {
 	       /* file does not exist and won't create it */
 	       elog_printf(DIAG, "db file %s does not exist", filename);
 	       return NULL;
@@ -134,6 +142,20 @@ RS_LLD rs_gdbm_open         (char *filename,	/* name of GDBM file */
      rs->lastkey = NULL;		/* no traversal */
      rs->lock = RS_UNLOCK;		/* unlocked */
      rs->inhibitlock = 0;		/* inhibit lock flag */
+     rs->persist = 0;			/* open and close with each lock */
+     rs->refmode = RS_UNLOCK;		/* not opened */
+     rs->lockname = util_strjoin(filename, RS_GDBM_LOCKSUFFIX, NULL);
+     rs->lockfd = -1;			/* no sidecar lock */
+     rs->gen = 0;			/* no writes seen */
+
+     /* The sidecar lock excludes other processes, whatever mode they 
+      * work in. If we can't have one, then GDBM's own locking is used and
+      * the file can't be kept open */
+     if (rs_gdbm_sideopen(rs))
+	  rs->persist = (flags & RS_PERSIST) ? 1 : 0;
+     else if (flags & RS_PERSIST)
+	  elog_printf(DIAG, "unable to open lock file %s, so %s will not "
+		      "be kept open", rs->lockname, filename);
 
      return rs;
 }
@@ -147,6 +169,11 @@ void   rs_gdbm_close        (RS_LLD lld	/* RS generic low level descriptor */)
      rs = rs_gdbmd_from_lld(lld);
      if (rs->lock != RS_UNLOCK)			/* unlock if needed */
 	  rs_gdbm_unlock(rs);
+     if (rs->ref)				/* persistent handle */
+	  rs_gdbm_dbclose(rs);
+     if (rs->lockfd != -1)
+	  close(rs->lockfd);
+     nfree(rs->lockname);
      nfree(rs->name);
      rs_free_superblock(rs->super);
      nfree(rs);
@@ -202,6 +229,11 @@ int    rs_gdbm_exists       (char *filename, enum rs_db_writable todo)
  * In reality, the lock calls gdbm_open with the required flag, so even
  * though the RS_GDBMD descriptor may be in the 'open' state, the
  * underlying GDBM file stays firmly closed.
+ * When a sidecar lock file is available, it is locked first (shared for 
+ * reading, exclusive for writing). Persistent descriptors rely on this 
+ * alone and only reopen GDBM if the sidecar's generation has changed 
+ * since they opened it (another process has written) or if a write 
+ * is needed and GDBM was opened for reading.
  * Lock conversion (from RD to RW) is supperted but does nothing
  * magical: it unlocks before locking for RW. If the lock fails, then
  * your original read lock will be lost.
@@ -212,6 +244,7 @@ int    rs_gdbm_lock(RS_LLD lld,		/* RS generic low level descriptor */
 		    char *where		/* caller id */)
 {
      RS_GDBMD rs;
+     unsigned long gen;
 
      /* param checking */
      if (lld == NULL) {
@@ -238,11 +271,37 @@ int    rs_gdbm_lock(RS_LLD lld,		/* RS generic low level descriptor */
 	   * close first, then wee can wait in line to open the file.
 	   * If we fail, then the underlying GDBM will always be
 	   * closed.*/
-	  rs_gdbm_dbclose(rs);
+	  if ( ! rs->persist )
+	       rs_gdbm_dbclose(rs);
+	  rs_gdbm_sideunlock(rs);
+	  rs->lock = RS_UNLOCK;
+     }
+
+     /* exclude other processes with the sidecar, which a reader may
+      * find has been created by a writer since it was opened */
+     if (rs->lockfd == -1)
+	  rs_gdbm_sideopen(rs);
+     if ( ! rs_gdbm_sidelock(rs, where, rw) ) {
+	  elog_printf(ERROR, "Unable to lock %s from %s", rs->lockname, 
+		      where);
+	  return 0;	/* failure */
+     }
+
+     /* GDBM caches its header and bucket directory, so a kept-open 
+      * handle is only good if no one else has written since it was 
+      * opened. It also has to be writable if we want to write */
+     if (rs->persist) {
+	  gen = rs_gdbm_sidegen(rs);
+	  if (rs->ref && (gen != rs->gen || 
+			  (rs->refmode == RS_RDLOCK && 
+			   rw != RS_RDLOCK && rw != RS_RDLOCKNOW)))
+	       rs_gdbm_dbclose(rs);
+	  rs->gen = gen;
      }
 
      /* obtain lock and record in descriptor */
      if (!rs_gdbm_dbopen(rs, where, rw)) {
+	  rs_gdbm_sideunlock(rs);
 	  elog_printf(ERROR, "Unable to open gdbm for lock from %s", where);
 	  return 0;	/* failure */
      }
@@ -265,7 +324,9 @@ int    rs_gdbm_lock(RS_LLD lld,		/* RS generic low level descriptor */
 }
 
 
-/* Unlock the GDBM, which actually closes the underlying file */
+/* Unlock the GDBM, which actually closes the underlying file unless the
+ * descriptor is persistent, in which case pending writes are flushed.
+ * Releasing a write lock advances the generation in the sidecar */
 void   rs_gdbm_unlock       (RS_LLD lld	/* RS generic low level descriptor */)
 {
      RS_GDBMD rs;
@@ -283,7 +344,13 @@ void   rs_gdbm_unlock       (RS_LLD lld	/* RS generic low level descriptor */)
 	  return;
      }
 
-     rs_gdbm_dbclose(rs);
+     if ( ! rs->persist )
+	  rs_gdbm_dbclose(rs);
+     else if (rs->lock == RS_WRLOCK)
+	  gdbm_sync(rs->ref);
+     if (rs->lock == RS_WRLOCK)
+	  rs->gen = rs_gdbm_sidebump(rs);
+     rs_gdbm_sideunlock(rs);
      rs->lock = RS_UNLOCK;
 }
 
@@ -337,7 +404,7 @@ RS_SUPER rs_gdbm_read_super_file (char *dbname	/* name of GDBM file */)
      /* open the GDBM using a direct low level call */
      if (access(dbname, R_OK) == -1)
 	  return NULL;
-     db = gdbm_open(dbname, 0, GDBM_READER || GDBM_NOLOCK, 
+     db = gdbm_open(dbname, 0, GDBM_READER | GDBM_NOLOCK, 
 		    RS_GDBM_READ_PERM, rs_gdbm_dberr);
      if (!db) {
 	  elog_printf(DIAG, "unable to open %s as GDBM file (%d:%s)", 
@@ -591,7 +658,7 @@ int    rs_gdbm_write_rings (RS_LLD lld, /* RS generic low level descriptor */
  */
 ITREE *rs_gdbm_read_headers (RS_LLD lld	/* RS generic low level descriptor */)
 {
-     char *headstr, *hd_val, *tok;
+     char *headstr, *hd_val, *tok, *tokpos;
      int length;
      unsigned int hd_hash;
      ITREE *hds;
@@ -613,12 +680,12 @@ ITREE *rs_gdbm_read_headers (RS_LLD lld	/* RS generic low level descriptor */)
      hds = itree_create();
      if (headstr) {
 	  /* fast, simple list reader for <hd_hash>|<hd_val>\001 */
-          hd_hash = strtoul(strtok(headstr, "|"), NULL, 10);
-	  hd_val = strtok(NULL, "\001");
+          hd_hash = strtoul(strtok_r(headstr, "|", &tokpos), NULL, 10);
+	  hd_val = strtok_r(NULL, "\001", &tokpos);
 	  itree_add(hds, hd_hash, xnstrdup(hd_val));
-	  while ((tok = strtok(NULL, "|"))) {
+	  while ((tok = strtok_r(NULL, "|", &tokpos))) {
 	       hd_hash = strtoul(tok, NULL, 10);
-	       hd_val = strtok(NULL, "\001");
+	       hd_val = strtok_r(NULL, "\001", &tokpos);
 	       itree_add(hds, hd_hash, xnstrdup(hd_val));
 	  }
 	  nfree(headstr);
@@ -684,16 +751,19 @@ int    rs_gdbm_write_headers (RS_LLD lld,    /* generic low level descriptor */
  *    seq      sequence number of datum
  *    time     date and time (int time_t format) datum was created
  *    hd_hash  hash index of the datum's header
+ * The index is held in binary chunks (see rs_gdbm_read_index_range()),
+ * so this is the expensive way to get at it; use the range and ends 
+ * calls if only part of the index is needed.
  * Returns a TABLE if successful, which will be empty if no index 
  * exists for the ring. If there is a failure, NULL will be returned.
  */
 TABLE rs_gdbm_read_index (RS_LLD lld, 	/* RS generic low level descriptor */
 			  int ringid	/* ring id */)
 {
-     char *ringindex, indexname[RS_GDBM_INDEXKEYLEN];
-     int length;
+     int i, n;
      TABLE index;
      RS_GDBMD rs;
+     RS_IDXENT ents;
 
      /* param checking and conversion */
      if (lld == NULL) {
@@ -706,17 +776,24 @@ TABLE rs_gdbm_read_index (RS_LLD lld, 	/* RS generic low level descriptor */
 	  return NULL;
      }
 
-     /* make the ring index name of the form 'ri<ringid>' and read it */
-     sprintf(indexname, "%s%d", RS_GDBM_INDEXNAME, ringid);
-     ringindex = rs_gdbm_dbfetch(rs, indexname, &length);
+     /* fetch all the entries of the ring */
+     n = rs_gdbm_read_index_range(lld, ringid, -1, -1, &ents);
+     if (n < 0)
+	  return NULL;
 
-     /* create table from ring index text */
+     /* create table from the index entries */
      index = table_create_a(rs_ringidx_hds);
-     if (ringindex) {
-          table_scan(index, ringindex, "\t", TABLE_SINGLESEP, TABLE_NOCOLNAMES, 
-		     TABLE_NORULER);
-	  table_freeondestroy(index, ringindex);
-     }
+     for (i=0; i<n; i++) {
+	  table_addemptyrow(index);
+	  table_replacecurrentcell_alloc(index, "seq", 
+					 util_i32toa(ents[i].seq));
+	  table_replacecurrentcell_alloc(index, "time",
+					 util_i64toa(ents[i].time));
+	  table_replacecurrentcell_alloc(index, "hd_hash", 
+					 util_u32toa(ents[i].hd_hash));
+     }
+     if (ents)
+	  nfree(ents);
 
      /* return the table regardless of success. 
       * If the ring index was found, then the table will have some 
@@ -726,16 +803,19 @@ TABLE rs_gdbm_read_index (RS_LLD lld, 	/* RS generic low level descriptor */
 
 
 /*
- * Write the passed TABLE representing a ring index to the GDBM datastore.
+ * Write the passed TABLE representing a ring index to the GDBM datastore,
+ * replacing the existing index in full.
  * Returns 1 if successful or 0 if the operation has failed.
  */
 int    rs_gdbm_write_index (RS_LLD lld, /* RS generic low level descriptor */
 			    int ringid,	/* ring id */
 			    TABLE index	/* index of samples within ring */)
 {
-     char *ringindex, indexname[RS_GDBM_INDEXKEYLEN];
-     int length, r;
+     char indexname[RS_GDBM_INDEXKEYLEN];
+     int n, r=1;
      RS_GDBMD rs;
+     RS_IDXENT ents;
+     struct rs_index_entry oldest, youngest;
 
      /* param checking and conversion */
      if (lld == NULL) {
@@ -748,22 +828,41 @@ int    rs_gdbm_write_index (RS_LLD lld, /* RS generic low level descriptor */
 	  return 0;
      }
 
-     /* convert table to a string and write it to the GDBM */
-     ringindex = table_outbody(index);
-     if (ringindex) {
-	  util_strrtrim(ringindex);	/* strip trailing \n */
-	  length = strlen(ringindex)+1;	/* include \0 */
-	  sprintf(indexname, "%s%d", RS_GDBM_INDEXNAME, ringid);
-	  r = rs_gdbm_dbreplace(rs, indexname, ringindex, length);
-     }
-
-     nfree(ringindex);
+     /* remove the existing index, binary or text */
+     if (rs_gdbm_idx_readhead(rs, ringid, &oldest, &youngest))
+	  rs_gdbm_idx_rmchunks(rs, ringid, oldest.seq, youngest.seq);
+     sprintf(indexname, "%s%d", RS_GDBM_IDXHEADNAME, ringid);
+     rs_gdbm_dbdelete(rs, indexname);
+     sprintf(indexname, "%s%d", RS_GDBM_INDEXNAME, ringid);
+     rs_gdbm_dbdelete(rs, indexname);
+
+     /* convert the table to entries, which are expected in sequence 
+      * order, and write them out with a new head */
+     n = table_nrows(index);
+     if (n == 0)
+	  return 1;
+     ents = xnmalloc(sizeof(struct rs_index_entry) * n);
+     n = 0;
+     table_traverse(index) {
+	  ents[n].seq     = strtol(table_getcurrentcell(index, "seq"), 
+				   (char**)NULL, 10);
+	  ents[n].time    = strtol(table_getcurrentcell(index, "time"), 
+				   (char**)NULL, 10);
+	  ents[n].hd_hash = strtoul(table_getcurrentcell(index, "hd_hash"), 
+				    (char**)NULL, 10);
+	  n++;
+     }
+     if ( ! rs_gdbm_idx_putents(rs, ringid, ents, n) ||
+	  ! rs_gdbm_idx_writehead(rs, ringid, &ents[0], &ents[n-1]) )
+	  r = 0;
+
+     nfree(ents);
      return r;
 }
 
 
 /*
- * Remove the index file from the GDBM file. Used as part of the ring
+ * Remove the index from the GDBM file. Used as part of the ring
  * deletion process and should be used inside a write lock. 
  * Returns 1 for success or 0 for failure.
  */
@@ -771,7 +870,8 @@ int    rs_gdbm_rm_index     (RS_LLD lld, int ringid)
 {
      RS_GDBMD rs;
      char indexname[RS_GDBM_INDEXKEYLEN];
-     int r;
+     struct rs_index_entry oldest, youngest;
+     int r=0;
 
      /* param checking and conversion */
      if (lld == NULL) {
@@ -784,14 +884,301 @@ int    rs_gdbm_rm_index     (RS_LLD lld, int ringid)
 	  return 0;
      }
 
-     /* delete the index record from the GDBM */
+     /* delete the binary index chunks and head from the GDBM */
+     if (rs_gdbm_idx_readhead(rs, ringid, &oldest, &youngest)) {
+	  rs_gdbm_idx_rmchunks(rs, ringid, oldest.seq, youngest.seq);
+	  sprintf(indexname, "%s%d", RS_GDBM_IDXHEADNAME, ringid);
+	  r = rs_gdbm_dbdelete(rs, indexname);
+     }
+
+     /* delete any text index left from older versions */
      sprintf(indexname, "%s%d", RS_GDBM_INDEXNAME, ringid);
-     r = rs_gdbm_dbdelete(rs, indexname);
+     if (rs_gdbm_dbdelete(rs, indexname))
+	  r = 1;
 
      return r;
 }
 
 
+/*
+ * Find the oldest and youngest entries in the index of ring 'ringid', 
+ * which are copied into the structures provided. Only the index head
+ * is read, so this is the cheap way to find the bounds of a ring.
+ * A text index from an older version will be converted to binary
+ * if the GDBM is locked for writing.
+ * Returns the number of entries in the index, which will be 0 if 
+ * empty or not present, or -1 for error.
+ */
+int    rs_gdbm_index_ends   (RS_LLD lld,	/* low level descriptor */
+			     int ringid,	/* ring id */
+			     RS_IDXENT oldest,	/* RET: oldest entry */
+			     RS_IDXENT youngest	/* RET: youngest entry */)
+{
+     RS_GDBMD rs;
+     RS_IDXENT ents;
+     int n;
+
+     /* param checking and conversion */
+     if (lld == NULL) {
+	  elog_printf(ERROR, "ringstore not open");
+	  return -1;
+     }
+     rs = rs_gdbmd_from_lld(lld);
+     if (rs->ref == NULL || rs->lock == RS_UNLOCK) {
+          elog_die(FATAL, "underlying GDBM not open");
+	  return -1;
+     }
+
+     oldest->seq = youngest->seq = -1;
+     oldest->time = youngest->time = 0;
+     oldest->hd_hash = youngest->hd_hash = 0;
+     if ( ! rs_gdbm_idx_readhead(rs, ringid, oldest, youngest) ) {
+	  switch (rs_gdbm_idx_migrate(rs, ringid)) {
+	  case 0:
+	       return 0;	/* no index */
+	  case 1:
+	       if ( ! rs_gdbm_idx_readhead(rs, ringid, oldest, youngest) )
+		    return -1;
+	       break;
+	  default:
+	       /* text index that can't be converted; read it all */
+	       ents = rs_gdbm_idx_legacy(rs, ringid, &n);
+	       if (n > 0) {
+		    *oldest   = ents[0];
+		    *youngest = ents[n-1];
+	       }
+	       if (ents)
+		    nfree(ents);
+	       return n;
+	  }
+     }
+
+     return youngest->seq - oldest->seq + 1;
+}
+
+
+/*
+ * Read the entries of the index of ring 'ringid' that lie between 
+ * 'from_seq' and 'to_seq' inclusive; either may be -1 to open that 
+ * end of the range. Only the binary chunks holding the range are read.
+ * The entries are returned in sequence order in an nmalloc()ed array 
+ * set in 'entries', which should be freed with nfree() after use.
+ * Returns the number of entries read, which will be 0 (and entries 
+ * set to NULL) if there are none, or -1 for error.
+ */
+int    rs_gdbm_read_index_range(RS_LLD lld,	/* low level descriptor */
+				int ringid,	/* ring id */
+				int from_seq,	/* first seq or -1 */
+				int to_seq,	/* last seq or -1 */
+				RS_IDXENT *entries /* RET: array of entries */)
+{
+     RS_GDBMD rs;
+     RS_IDXENT ents;
+     struct rs_index_entry oldest, youngest;
+     char key[RS_GDBM_INDEXKEYLEN], *value;
+     int i, n, r, chunk, off, seq, length;
+
+     /* param checking and conversion */
+     *entries = NULL;
+     if (lld == NULL) {
+	  elog_printf(ERROR, "ringstore not open");
+	  return -1;
+     }
+     rs = rs_gdbmd_from_lld(lld);
+     if (rs->ref == NULL || rs->lock == RS_UNLOCK) {
+          elog_die(FATAL, "underlying GDBM not open");
+	  return -1;
+     }
+
+     /* find the extent of the index */
+     if ( ! rs_gdbm_idx_readhead(rs, ringid, &oldest, &youngest) ) {
+	  r = rs_gdbm_idx_migrate(rs, ringid);
+	  if (r == 0)
+	       return 0;	/* no index */
+	  if (r < 0) {
+	       /* text index that can't be converted; read it all and
+		* keep only the range asked for */
+	       ents = rs_gdbm_idx_legacy(rs, ringid, &n);
+	       for (i=r=0; i<n; i++)
+		    if ((from_seq == -1 || ents[i].seq >= from_seq) &&
+			(to_seq   == -1 || ents[i].seq <= to_seq))
+			 ents[r++] = ents[i];
+	       if (r == 0 && ents) {
+		    nfree(ents);
+		    ents = NULL;
+	       }
+	       *entries = ents;
+	       return r;
+	  }
+	  if ( ! rs_gdbm_idx_readhead(rs, ringid, &oldest, &youngest) )
+	       return -1;
+     }
+     if (from_seq == -1 || from_seq < oldest.seq)
+	  from_seq = oldest.seq;
+     if (to_seq == -1 || to_seq > youngest.seq)
+	  to_seq = youngest.seq;
+     if (from_seq > to_seq)
+	  return 0;
+
+     /* read the chunks that cover the range, unpacking only the 
+      * entries that are in range */
+     ents = xnmalloc(sizeof(struct rs_index_entry) * (to_seq-from_seq+1));
+     n = 0;
+     for (chunk = from_seq / RS_GDBM_IDXCHUNK; 
+	  chunk <= to_seq / RS_GDBM_IDXCHUNK; chunk++) {
+	  snprintf(key, RS_GDBM_INDEXKEYLEN, "%s%d_%d", 
+		   RS_GDBM_IDXCHUNKNAME, ringid, chunk);
+	  value = rs_gdbm_dbfetch(rs, key, &length);
+	  if ( ! value ) {
+	       elog_printf(DEBUG, "index chunk does not exist: %s", key);
+	       continue;
+	  }
+	  for (off=0; (off+1) * RS_GDBM_IDXENTSZ <= length; off++) {
+	       seq = chunk * RS_GDBM_IDXCHUNK + off;
+	       if (seq < from_seq || seq > to_seq)
+		    continue;
+	       rs_gdbm_idx_unpack((unsigned char *) value + 
+				  off * RS_GDBM_IDXENTSZ, &ents[n]);
+	       if (ents[n].seq == seq)
+		    n++;
+	  }
+	  nfree(value);
+     }
+
+     if (n == 0) {
+	  nfree(ents);
+	  return 0;
+     }
+     *entries = ents;
+     return n;
+}
+
+
+/*
+ * Append entries to the index of ring 'ringid' to describe the 
+ * data blocks in 'dblock', which is a list of RS_DBLOCK in the same 
+ * form as given to rs_gdbm_append_dblock(). The first block takes
+ * sequence 'start_seq' and successive ones follow on.
+ * Only the tail chunk of the index (and one more if the append spills
+ * over) and the index head are rewritten. The GDBM should be locked 
+ * for writing.
+ * Returns the number of entries appended, 0 for failure.
+ */
+int    rs_gdbm_append_index (RS_LLD lld,	/* low level descriptor */
+			     int ringid,	/* ring id */
+			     int start_seq,	/* starting sequence */
+			     ITREE *dblock	/* list of RS_DBLOCK */)
+{
+     RS_GDBMD rs;
+     RS_DBLOCK d;
+     RS_IDXENT ents;
+     struct rs_index_entry oldest, youngest;
+     int i, n, r;
+
+     /* param checking and conversion */
+     if (lld == NULL) {
+	  elog_printf(ERROR, "ringstore not open");
+	  return 0;
+     }
+     rs = rs_gdbmd_from_lld(lld);
+     if (rs->ref == NULL || rs->lock != RS_WRLOCK) {
+          elog_die(FATAL, "underlying GDBM not open for writing");
+	  return 0;
+     }
+     if (itree_empty(dblock))
+	  return 0;
+
+     /* find the current extent, converting an old index if needed */
+     n = rs_gdbm_index_ends(lld, ringid, &oldest, &youngest);
+     if (n < 0)
+	  return 0;
+
+     /* make entries from data blocks and write to their chunks */
+     ents = xnmalloc(sizeof(struct rs_index_entry) * itree_n(dblock));
+     i = 0;
+     itree_traverse(dblock) {
+	  d = itree_get(dblock);
+	  ents[i].seq     = start_seq + i;
+	  ents[i].time    = d->time;
+	  ents[i].hd_hash = d->hd_hashkey;
+	  i++;
+     }
+     r = rs_gdbm_idx_putents(rs, ringid, ents, i);
+
+     /* update the head */
+     if (r) {
+	  if (n == 0)
+	       oldest = ents[0];
+	  r = rs_gdbm_idx_writehead(rs, ringid, &oldest, &ents[i-1]);
+     }
+
+     nfree(ents);
+     return r ? i : 0;
+}
+
+
+/*
+ * Remove the entries from the index of ring 'ringid' that are older 
+ * than or equal to 'to_seq'. Chunks that become wholly expired are 
+ * deleted, the head chunk is left in place but the index head moves
+ * past the expired entries. The GDBM should be locked for writing.
+ * Returns the number of entries removed.
+ */
+int    rs_gdbm_expire_index (RS_LLD lld,	/* low level descriptor */
+			     int ringid,	/* ring id */
+			     int to_seq		/* less than and equal to */)
+{
+     RS_GDBMD rs;
+     RS_IDXENT ents;
+     struct rs_index_entry oldest, youngest;
+     char indexname[RS_GDBM_INDEXKEYLEN];
+     int n, r;
+
+     /* param checking and conversion */
+     if (lld == NULL) {
+	  elog_printf(ERROR, "ringstore not open");
+	  return 0;
+     }
+     rs = rs_gdbmd_from_lld(lld);
+     if (rs->ref == NULL || rs->lock != RS_WRLOCK) {
+          elog_die(FATAL, "underlying GDBM not open for writing");
+	  return 0;
+     }
+
+     /* find the current extent, converting an old index if needed */
+     n = rs_gdbm_index_ends(lld, ringid, &oldest, &youngest);
+     if (n <= 0 || to_seq < oldest.seq)
+	  return 0;
+
+     if (to_seq >= youngest.seq) {
+	  /* everything goes */
+	  rs_gdbm_idx_rmchunks(rs, ringid, oldest.seq, youngest.seq);
+	  sprintf(indexname, "%s%d", RS_GDBM_IDXHEADNAME, ringid);
+	  rs_gdbm_dbdelete(rs, indexname);
+	  return n;
+     }
+
+     /* remove the chunks whose entries are all expired, which are 
+      * those before the chunk holding the new oldest */
+     if ((to_seq+1) / RS_GDBM_IDXCHUNK > oldest.seq / RS_GDBM_IDXCHUNK)
+	  rs_gdbm_idx_rmchunks(rs, ringid, oldest.seq, 
+			       ((to_seq+1) / RS_GDBM_IDXCHUNK) 
+			       * RS_GDBM_IDXCHUNK - 1);
+
+     /* move the head on to the new oldest entry */
+     r = rs_gdbm_read_index_range(lld, ringid, to_seq+1, to_seq+1, &ents);
+     if (r != 1) {
+	  elog_printf(ERROR, "ring %d index missing seq %d after expiry", 
+		      ringid, to_seq+1);
+	  return 0;
+     }
+     rs_gdbm_idx_writehead(rs, ringid, ents, &youngest);
+     nfree(ents);
+
+     return to_seq - oldest.seq + 1;
+}
+
+
 /*
  * Add data blocks into the GDBM database and index them as a sequence.
  * The data blocks are in an ordered list with the values being of type
@@ -806,10 +1193,10 @@ int    rs_gdbm_append_dblock(RS_LLD lld,	/* low level descriptor */
 			     int start_seq, 	/* starting sequence */
 			     ITREE *dblock	/* list of RS_DBLOCK */)
 {
-     int length, r, seq, num_written=0;
+     int length, plen, r, seq, num_written=0;
      RS_GDBMD rs;
      RS_DBLOCK d;
-     char key[RS_GDBM_DATAKEYLEN];
+     char key[RS_GDBM_DATAKEYLEN], prefix[RS_DBLOCK_HEADROOM];
      char *value;
 
      /* param checking and conversion */
@@ -830,11 +1217,19 @@ int    rs_gdbm_append_dblock(RS_LLD lld,	/* low level descriptor */
 	  d = itree_get(dblock);
 	  snprintf(key, RS_GDBM_DATAKEYLEN, "%s%d_%d", RS_GDBM_DATANAME, 
 		   ringid, seq);
-	  length = strlen(d->data);
-	  value = xnmalloc(length + 25);	/* space for time & hd key */
-	  length = snprintf(value, length+25, "%ld|%lu|%s", 
-			    d->time, d->hd_hashkey, d->data);
-	  length++;	/* include \0 */
+	  length = d->datalen >= 0 ? d->datalen : strlen(d->data);
+	  plen = snprintf(prefix, RS_DBLOCK_HEADROOM, "%ld|%lu|", 
+			  d->time, d->hd_hashkey);
+	  if (d->headroom >= plen) {
+	       /* prefix the data in place */
+	       value = d->data - plen;
+	       memcpy(value, prefix, plen);
+	  } else {
+	       value = xnmalloc(plen + length + 1);
+	       memcpy(value, prefix, plen);
+	       memcpy(value + plen, d->data, length + 1);
+	  }
+	  length += plen + 1;	/* include \0 */
 
 	  /* write the composed block of data */
 	  r = rs_gdbm_dbreplace(rs, key, value, length);
@@ -844,7 +1239,8 @@ int    rs_gdbm_append_dblock(RS_LLD lld,	/* low level descriptor */
 	       num_written++;
 
 	  /* loop */
-	  nfree(value);
+	  if (d->headroom < plen)
+	       nfree(value);
 	  seq++;
      }
 
@@ -871,7 +1267,7 @@ ITREE *rs_gdbm_read_dblock(RS_LLD lld,	  /* low level descriptor */
      RS_GDBMD rs;
      RS_DBLOCK d;
      ITREE *dlist;
-     char key[RS_GDBM_DATAKEYLEN], *value;
+     char key[RS_GDBM_DATAKEYLEN], *value, *tokpos;
      int length, i;
 
      /* param checking and conversion */
@@ -909,9 +1305,11 @@ ITREE *rs_gdbm_read_dblock(RS_LLD lld,	  /* low level descriptor */
 	   * hold a reference to it so that mem can be released
 	   * with rs_free_dblock() */
 	  d = xnmalloc(sizeof(struct rs_data_block));
-	  d->time = strtol(strtok(value, "|"), NULL, 10);
-	  d->hd_hashkey = strtoul(strtok(NULL, "|"), NULL, 10);
-	  d->data = strtok(NULL, "|");
+	  d->time = strtol(strtok_r(value, "|", &tokpos), NULL, 10);
+	  d->hd_hashkey = strtoul(strtok_r(NULL, "|", &tokpos), NULL, 10);
+	  d->data = strtok_r(NULL, "|", &tokpos);
+	  d->datalen = -1;
+	  d->headroom = 0;
 	  d->__priv_alloc_mem = value;
 	  itree_add(dlist, start_seq+i, d);
      }
@@ -1190,15 +1588,20 @@ int rs_gdbm_dbopen(RS_GDBMD rs, char *where, enum rs_db_lock rw)
 				"RD_RDLOCK_NOW", rs->name);
 		    return 0;
 	       }
-	       db = gdbm_open(rs->name, 0, GDBM_READER || GDBM_NOLOCK, 
+	       db = gdbm_open(rs->name, 0, 
+			      GDBM_READER | (rs->persist ? GDBM_NOLOCK : 0),
 			      rs->mode, rs_gdbm_dberr);
 	       break;
 	  case RS_WRLOCK:	/* write */
 	  case RS_WRLOCKNOW:
-	       db = gdbm_open(rs->name,0,GDBM_WRITER,rs->mode,rs_gdbm_dberr);
+	       db = gdbm_open(rs->name, 0, 
+			      GDBM_WRITER | (rs->persist ? GDBM_NOLOCK : 0),
+			      rs->mode, rs_gdbm_dberr);
 	       break;
 	  case RS_CRLOCKNOW:	/* create */
-	       db = gdbm_open(rs->name,0,GDBM_WRCREAT,rs->mode,rs_gdbm_dberr);
+	       db = gdbm_open(rs->name, 0, 
+			      GDBM_WRCREAT | (rs->persist ? GDBM_NOLOCK : 0),
+			      rs->mode, rs_gdbm_dberr);
 	       break;
 	  default:
 	       elog_safeprintf(ERROR, "%s unsupported action: %d",
@@ -1210,6 +1613,8 @@ int rs_gdbm_dbopen(RS_GDBMD rs, char *where, enum rs_db_lock rw)
 	  /* got a lock and opened database */
 	  if (db) {
 	       rs->ref = db;
+	       rs->refmode = (rw == RS_RDLOCK || rw == RS_RDLOCKNOW) ? 
+		    RS_RDLOCK : RS_WRLOCK;
 	       return 1;	/* success */
 	  }
 
@@ -1260,6 +1665,7 @@ void rs_gdbm_dbclose(RS_GDBMD rs)
 
      gdbm_close(rs->ref);
      rs->ref = NULL;
+     rs->refmode = RS_UNLOCK;
 }
 
 
@@ -1356,6 +1762,125 @@ int rs_gdbm_dbreorganise(RS_GDBMD rs)
 }
 
 
+/*
+ * Private: open or create the sidecar lock file next to the GDBM file,
+ * giving it the same permissions as the GDBM file so that every
+ * process able to write the ringstore can lock it.
+ * Only processes that can write the ringstore create the sidecar; 
+ * readers open an existing one read only, which is enough for flock(), 
+ * so that they leave nothing behind in directories they may not be able
+ * to write. 
+ * Returns 1 if opened or 0 if the sidecar is not available, in which
+ * case rs->lockfd remains -1 and GDBM's own locking is used
+ */
+int rs_gdbm_sideopen(RS_GDBMD rs)
+{
+     struct stat buf;
+     mode_t mode;
+
+     if (stat(rs->name, &buf) == 0)
+	  mode = buf.st_mode & 0666;
+     else
+	  mode = rs->mode ? rs->mode : 0644;
+
+     if (access(rs->name, W_OK) == 0)
+	  rs->lockfd = open(rs->lockname, O_RDWR|O_CREAT, mode);
+     else
+	  rs->lockfd = open(rs->lockname, O_RDONLY);
+     if (rs->lockfd == -1)
+	  return 0;
+     fcntl(rs->lockfd, F_SETFD, FD_CLOEXEC);
+
+     return 1;
+}
+
+
+/*
+ * Private: take the sidecar lock, shared for reading and exclusive for
+ * writing, polling RS_GDBM_NTRYS times as rs_gdbm_dbopen() would.
+ * The *NOW locks make only a single attempt.
+ * Returns 1 if successful, including when there is no sidecar, or 0
+ * for failure.
+ */
+int rs_gdbm_sidelock(RS_GDBMD rs, char *where, enum rs_db_lock rw)
+{
+     int i, op;
+     struct timespec t;
+
+     if (rs->lockfd == -1)
+	  return 1;	/* no sidecar: GDBM locks for us */
+
+     if (rw == RS_RDLOCK || rw == RS_RDLOCKNOW)
+	  op = LOCK_SH;
+     else
+	  op = LOCK_EX;
+
+     for (i=0; i < RS_GDBM_NTRYS; i++) {
+	  if (flock(rs->lockfd, op|LOCK_NB) == 0)
+	       return 1;	/* success */
+	  if (errno != EWOULDBLOCK && errno != EINTR)
+	       break;
+	  if (rw == RS_RDLOCKNOW || rw == RS_WRLOCKNOW || rw == RS_CRLOCKNOW)
+	       break;
+
+	  /* wait waittry nanoseconds */
+	  t.tv_sec = 0;
+	  t.tv_nsec = RS_GDBM_WAITTRY;
+	  nanosleep(&t, NULL);
+     }
+
+     elog_printf(DIAG, "%s unable to lock %s mode %d (%d: %s) after %d "
+		 "attempts", where, rs->lockname, rw, errno,
+		 strerror(errno), i);
+     return 0;
+}
+
+
+/* Private: release the sidecar lock, if there is one */
+void rs_gdbm_sideunlock(RS_GDBMD rs)
+{
+     if (rs->lockfd != -1)
+	  flock(rs->lockfd, LOCK_UN);
+}
+
+
+/*
+ * Private: return the write generation held in the sidecar, which should
+ * be locked. A new or absent sidecar has a generation of 0
+ */
+unsigned long rs_gdbm_sidegen(RS_GDBMD rs)
+{
+     unsigned long gen;
+
+     if (rs->lockfd == -1)
+	  return 0;
+     if (pread(rs->lockfd, &gen, sizeof(gen), 0) != sizeof(gen))
+	  return 0;
+
+     return gen;
+}
+
+
+/*
+ * Private: advance the write generation in the sidecar, which should be
+ * write locked, telling persistent descriptors in other processes that
+ * their GDBM handles are stale. Returns the new generation
+ */
+unsigned long rs_gdbm_sidebump(RS_GDBMD rs)
+{
+     unsigned long gen;
+
+     if (rs->lockfd == -1)
+	  return 0;
+     gen = rs_gdbm_sidegen(rs) + 1;
+     if (pwrite(rs->lockfd, &gen, sizeof(gen), 0) != sizeof(gen))
+	  elog_printf(ERROR, "unable to update lock file %s: %s",
+		      rs->lockname, strerror(errno));
+
+     return gen;
+}
+
+
 /*
  * Start a read traversal of the entire GDBM which should be 
  * locked for reading
@@ -1455,6 +1980,266 @@ void rs_gdbm_readend(RS_GDBMD rs)
 }
 
 
+/*
+ * Private: read the head of the binary index of ring 'ringid', which
+ * holds the oldest and youngest entries. A head is only present if the
+ * index has entries.
+ * Returns 1 if the head was read into oldest and youngest, or 0 if there 
+ * is no binary index.
+ */
+int rs_gdbm_idx_readhead(RS_GDBMD rs, int ringid, RS_IDXENT oldest, 
+			 RS_IDXENT youngest)
+{
+     char key[RS_GDBM_INDEXKEYLEN];
+     unsigned char *value;
+     int length;
+
+     snprintf(key, RS_GDBM_INDEXKEYLEN, "%s%d", RS_GDBM_IDXHEADNAME, ringid);
+     value = (unsigned char *) rs_gdbm_dbfetch(rs, key, &length);
+     if ( ! value )
+	  return 0;
+     if (length < RS_GDBM_IDXHEADSZ || value[3] != RS_GDBM_IDXVERSION) {
+	  elog_printf(ERROR, "index head %s is corrupt or of an unknown "
+		      "version (length %d)", key, length);
+	  nfree(value);
+	  return 0;
+     }
+
+     /* version word followed by two packed entries */
+     rs_gdbm_idx_unpack(value+4, oldest);
+     rs_gdbm_idx_unpack(value+4+RS_GDBM_IDXENTSZ, youngest);
+     nfree(value);
+
+     return 1;
+}
+
+
+/*
+ * Private: write the head of the binary index of ring 'ringid'.
+ * Returns 1 for success or 0 for error.
+ */
+int rs_gdbm_idx_writehead(RS_GDBMD rs, int ringid, RS_IDXENT oldest, 
+			  RS_IDXENT youngest)
+{
+     char key[RS_GDBM_INDEXKEYLEN];
+     unsigned char value[RS_GDBM_IDXHEADSZ];
+
+     value[0] = value[1] = value[2] = 0;
+     value[3] = RS_GDBM_IDXVERSION;
+     rs_gdbm_idx_pack(value+4, oldest);
+     rs_gdbm_idx_pack(value+4+RS_GDBM_IDXENTSZ, youngest);
+     snprintf(key, RS_GDBM_INDEXKEYLEN, "%s%d", RS_GDBM_IDXHEADNAME, ringid);
+
+     return rs_gdbm_dbreplace(rs, key, (char *) value, RS_GDBM_IDXHEADSZ);
+}
+
+
+/*
+ * Private: write 'n' index entries, which must be in ascending sequence 
+ * order, into the chunks of ring 'ringid'. Each chunk holds 
+ * RS_GDBM_IDXCHUNK entries at fixed offsets, so chunk and position are 
+ * worked out from the sequence and only the chunks touched are 
+ * fetched and rewritten. The index head is not changed.
+ * Returns 1 for success or 0 for error.
+ */
+int rs_gdbm_idx_putents(RS_GDBMD rs, int ringid, RS_IDXENT ents, int n)
+{
+     char key[RS_GDBM_INDEXKEYLEN], *old, *buf;
+     int i, j, chunk, length, oldlength, r;
+
+     i = 0;
+     while (i < n) {
+	  /* find the entries that belong in this chunk */
+	  chunk = ents[i].seq / RS_GDBM_IDXCHUNK;
+	  for (j=i; j < n && ents[j].seq / RS_GDBM_IDXCHUNK == chunk; j++)
+	       ;
+	  length = (ents[j-1].seq % RS_GDBM_IDXCHUNK + 1) * RS_GDBM_IDXENTSZ;
+
+	  /* overlay the entries on the existing chunk */
+	  snprintf(key, RS_GDBM_INDEXKEYLEN, "%s%d_%d", 
+		   RS_GDBM_IDXCHUNKNAME, ringid, chunk);
+	  old = rs_gdbm_dbfetch(rs, key, &oldlength);
+	  if (old && oldlength > length)
+	       length = oldlength;
+	  buf = xnmalloc(length);
+	  memset(buf, 0, length);
+	  if (old) {
+	       memcpy(buf, old, oldlength);
+	       nfree(old);
+	  }
+	  for (; i < j; i++)
+	       rs_gdbm_idx_pack((unsigned char *) buf + 
+				(ents[i].seq % RS_GDBM_IDXCHUNK) 
+				* RS_GDBM_IDXENTSZ, &ents[i]);
+
+	  r = rs_gdbm_dbreplace(rs, key, buf, length);
+	  nfree(buf);
+	  if ( ! r ) {
+	       elog_printf(ERROR, "couldn't write index chunk %s", key);
+	       return 0;
+	  }
+     }
+
+     return 1;
+}
+
+
+/*
+ * Private: delete the index chunks of ring 'ringid' that hold 
+ * sequences 'from_seq' to 'to_seq'. Whole chunks are removed, so the
+ * range should fall on chunk boundaries unless all the index is going.
+ * Returns the number of chunks removed.
+ */
+int rs_gdbm_idx_rmchunks(RS_GDBMD rs, int ringid, int from_seq, int to_seq)
+{
+     char key[RS_GDBM_INDEXKEYLEN];
+     int chunk, num_rm=0;
+
+     for (chunk = from_seq / RS_GDBM_IDXCHUNK; 
+	  chunk <= to_seq / RS_GDBM_IDXCHUNK; chunk++) {
+	  snprintf(key, RS_GDBM_INDEXKEYLEN, "%s%d_%d", 
+		   RS_GDBM_IDXCHUNKNAME, ringid, chunk);
+	  if (rs_gdbm_dbdelete(rs, key))
+	       num_rm++;
+	  else
+	       elog_printf(DEBUG, "couldn't delete %s", key);
+     }
+
+     return num_rm;
+}
+
+
+/*
+ * Private: read the text index used by earlier versions of the ringstore
+ * ('ri<ringid>': lines of seq, time and hd_hash separated by tabs).
+ * Returns an nmalloc()ed array of entries in sequence order and sets
+ * the count in 'nents', or NULL and 0 if there is no text index.
+ */
+RS_IDXENT rs_gdbm_idx_legacy(RS_GDBMD rs, int ringid, int *nents)
+{
+     char key[RS_GDBM_INDEXKEYLEN], *text, *pt, *next;
+     int length, n, size;
+     RS_IDXENT ents;
+
+     *nents = 0;
+     snprintf(key, RS_GDBM_INDEXKEYLEN, "%s%d", RS_GDBM_INDEXNAME, ringid);
+     text = rs_gdbm_dbfetch(rs, key, &length);
+     if ( ! text )
+	  return NULL;
+
+     /* make sure the text is terminated, then count lines for size */
+     text = xnrealloc(text, length+1);
+     text[length] = '\0';
+     for (size=1, pt=text; *pt; pt++)
+	  if (*pt == '\n')
+	       size++;
+     ents = xnmalloc(sizeof(struct rs_index_entry) * size);
+
+     /* each line is three numbers; strtol() skips the white space */
+     n = 0;
+     pt = text;
+     while (n < size) {
+	  ents[n].seq = strtol(pt, &next, 10);
+	  if (next == pt)
+	       break;		/* no more numbers */
+	  ents[n].time    = strtol (next, &pt,   10);
+	  ents[n].hd_hash = strtoul(pt,   &next, 10);
+	  pt = next;
+	  n++;
+     }
+     nfree(text);
+
+     if (n == 0) {
+	  nfree(ents);
+	  return NULL;
+     }
+     *nents = n;
+     return ents;
+}
+
+
+/*
+ * Private: convert the text index of ring 'ringid' left by an earlier 
+ * version of the ringstore into the binary index and remove the text.
+ * This needs a write lock, so readers will have to use the text 
+ * with rs_gdbm_idx_legacy() until a writer comes along.
+ * Returns 1 if the index was converted, 0 if there was no text index
+ * or -1 if there is one but it was not converted.
+ */
+int rs_gdbm_idx_migrate(RS_GDBMD rs, int ringid)
+{
+     char key[RS_GDBM_INDEXKEYLEN];
+     RS_IDXENT ents;
+     int n;
+
+     snprintf(key, RS_GDBM_INDEXKEYLEN, "%s%d", RS_GDBM_INDEXNAME, ringid);
+     if (rs->lock != RS_WRLOCK) {
+	  /* just check whether it exists */
+	  ents = rs_gdbm_idx_legacy(rs, ringid, &n);
+	  if ( ! ents )
+	       return 0;
+	  nfree(ents);
+	  return -1;
+     }
+
+     ents = rs_gdbm_idx_legacy(rs, ringid, &n);
+     if ( ! ents ) {
+	  rs_gdbm_dbdelete(rs, key);	/* may be empty text */
+	  return 0;
+     }
+     if ( ! rs_gdbm_idx_putents(rs, ringid, ents, n) ||
+	  ! rs_gdbm_idx_writehead(rs, ringid, &ents[0], &ents[n-1]) ) {
+	  elog_printf(ERROR, "unable to convert index %s", key);
+	  nfree(ents);
+	  return -1;
+     }
+     rs_gdbm_dbdelete(rs, key);
+     nfree(ents);
+
+     elog_printf(DIAG, "converted text index %s with %d entries to binary", 
+		 key, n);
+     return 1;
+}
+
+
+/*
+ * Private: pack an index entry into RS_GDBM_IDXENTSZ bytes of buf, big 
+ * endian so that files can move between hosts: a 32 bit sequence, a 64 
+ * bit time, so that it will not wrap in 2038, and a 32 bit header hash
+ */
+void rs_gdbm_idx_pack(unsigned char *buf, RS_IDXENT ent)
+{
+     unsigned long long word[3];
+     int size[3] = {4, 8, 4};
+     int i, j;
+
+     word[0] = (unsigned long) ent->seq;
+     word[1] = (unsigned long long) ent->time;
+     word[2] = ent->hd_hash;
+     for (i=0; i<3; i++)
+	  for (j=size[i]-1; j >= 0; j--)
+	       *buf++ = (word[i] >> (j*8)) & 0xff;
+}
+
+
+/* Private: unpack an index entry made by rs_gdbm_idx_pack() */
+void rs_gdbm_idx_unpack(unsigned char *buf, RS_IDXENT ent)
+{
+     unsigned long long word[3];
+     int size[3] = {4, 8, 4};
+     int i, j;
+
+     for (i=0; i<3; i++) {
+	  word[i] = 0;
+	  for (j=0; j < size[i]; j++)
+	       word[i] = (word[i] << 8) | *buf++;
+     }
+     ent->seq     = (int) word[0];
+     ent->time    = (time_t) (long long) word[1];
+     ent->hd_hash = (unsigned long) word[2];
+}
+
+
 
 
 
@@ -1571,6 +2356,7 @@ void   rs_free_dblock    (ITREE *dlist)
 
 
 #include <sys/time.h>
+#include <sys/wait.h>
 #include "rt_file.h"
 #include "rt_std.h"
 #define TESTRS1 "t.rs_gdbm.1.dat"
@@ -1579,7 +2365,7 @@ void   rs_free_dblock    (ITREE *dlist)
 
 int main()
 {
-     RS_GDBMD rs;
+     RS_GDBMD rs, rs2;
      int r, i;
      TABLE ringdir, ringdir2, index, index2;
      char *buf1, *buf2, *buf3;
@@ -1587,6 +2373,8 @@ int main()
      ITREE *dlist, *dlist2;
      RS_DBLOCK dblock, dblock2;
      struct rs_data_block data1, data2, data3;
+     struct rs_index_entry ent1, ent2, *ents;
+     struct rs_data_block blocks[RS_GDBM_IDXCHUNK+10];
 
      /* initialise */
      route_init(NULL, 0);
@@ -1797,6 +2585,10 @@ int main()
      table_replacecurrentcell(index, "seq", "23");
      table_replacecurrentcell(index, "time", "98753388");
      table_replacecurrentcell(index, "hd_hash", "592264");
+     table_addemptyrow(index);		/* a time beyond 2038 */
+     table_replacecurrentcell(index, "seq", "24");
+     table_replacecurrentcell(index, "time", "4102444800");
+     table_replacecurrentcell(index, "hd_hash", "4000000000");
      if ( ! rs_gdbm_lock(rs, RS_WRLOCK, "test")) {
 	  fprintf(stderr, "[4] Unable to lock rs_gdbm for writing\n");
 	  exit(1);
@@ -1847,14 +2639,20 @@ int main()
      data1.time = time(NULL);
      data1.hd_hashkey = 6783365;
      data1.data = "tom";
+     data1.datalen = -1;
+     data1.headroom = 0;
      itree_append(dlist, &data1);
      data2.time = time(NULL);
      data2.hd_hashkey = 6783365;
      data2.data = "dick";
+     data2.datalen = -1;
+     data2.headroom = 0;
      itree_append(dlist, &data2);
      data3.time = time(NULL);
      data3.hd_hashkey = 6783365;
      data3.data = "harry";
+     data3.datalen = -1;
+     data3.headroom = 0;
      itree_append(dlist, &data3);
      if ( ! rs_gdbm_lock(rs, RS_WRLOCK, "test")) {
 	  fprintf(stderr, "[5] Unable to lock rs_gdbm for writing\n");
@@ -1927,6 +2725,159 @@ int main()
      rs_free_dblock(dlist2);
      itree_destroy(dlist);
 
+     /* test 6: append to the binary index over chunk boundaries, 
+      * read ranges and ends, then expire from the head */
+     rs = rs_gdbm_open(TESTRS1, 0644, 1);
+     if ( ! rs_gdbm_lock(rs, RS_WRLOCK, "test")) {
+	  fprintf(stderr, "[6] Unable to lock rs_gdbm for writing\n");
+	  exit(1);
+     }
+     dlist = itree_create();
+     for (i=0; i < RS_GDBM_IDXCHUNK+10; i++) {
+	  blocks[i].time = 1000+i;
+	  blocks[i].hd_hashkey = 6783365;
+	  itree_append(dlist, &blocks[i]);
+	  if (i % 7 == 6 || i == RS_GDBM_IDXCHUNK+9) {
+	       r = rs_gdbm_append_index(rs, 8, i - itree_n(dlist) + 1, dlist);
+	       if (r != itree_n(dlist)) {
+		    fprintf(stderr, "[6a] append %d returned %d\n", i, r);
+		    exit(1);
+	       }
+	       itree_clearout(dlist, NULL);
+	  }
+     }
+     itree_destroy(dlist);
+     r = rs_gdbm_index_ends(rs, 8, &ent1, &ent2);
+     if (r != RS_GDBM_IDXCHUNK+10 || ent1.seq != 0 || ent1.time != 1000 || 
+	 ent2.seq != RS_GDBM_IDXCHUNK+9 || ent2.time != 1000+ent2.seq ||
+	 ent2.hd_hash != 6783365) {
+	  fprintf(stderr, "[6b] wrong ends %d: %d-%d\n", r, ent1.seq, 
+		  ent2.seq);
+	  exit(1);
+     }
+     r = rs_gdbm_read_index_range(rs, 8, RS_GDBM_IDXCHUNK-3, 
+				  RS_GDBM_IDXCHUNK+2, &ents);
+     if (r != 6 || ents[0].seq != RS_GDBM_IDXCHUNK-3 || 
+	 ents[5].time != 1000+RS_GDBM_IDXCHUNK+2) {
+	  fprintf(stderr, "[6c] wrong range %d\n", r);
+	  exit(1);
+     }
+     nfree(ents);
+     r = rs_gdbm_expire_index(rs, 8, RS_GDBM_IDXCHUNK+1);
+     if (r != RS_GDBM_IDXCHUNK+2) {
+	  fprintf(stderr, "[6d] expired %d\n", r);
+	  exit(1);
+     }
+     r = rs_gdbm_read_index_range(rs, 8, -1, -1, &ents);
+     if (r != 8 || ents[0].seq != RS_GDBM_IDXCHUNK+2) {
+	  fprintf(stderr, "[6e] wrong range after expire %d\n", r);
+	  exit(1);
+     }
+     nfree(ents);
+     sprintf(buf3 = xnmalloc(RS_GDBM_INDEXKEYLEN), "%s8_0", 
+	     RS_GDBM_IDXCHUNKNAME);
+     if (rs_gdbm_read_value(rs, buf3, &r)) {
+	  fprintf(stderr, "[6f] expired chunk remains\n");
+	  exit(1);
+     }
+     nfree(buf3);
+
+     /* test 7: convert a text index from an earlier version */
+     buf1 = "10\t900\t5\n11\t901\t5\n12\t902\t6";
+     rs_gdbm_write_value(rs, "ri9", buf1, strlen(buf1)+1);
+     rs_gdbm_unlock(rs);
+     rs_gdbm_lock(rs, RS_RDLOCK, "test");
+     r = rs_gdbm_index_ends(rs, 9, &ent1, &ent2);
+     rs_gdbm_unlock(rs);
+     if (r != 3 || ent1.seq != 10 || ent2.seq != 12 || ent2.hd_hash != 6) {
+	  fprintf(stderr, "[7a] text index ends wrong %d\n", r);
+	  exit(1);
+     }
+     rs_gdbm_lock(rs, RS_WRLOCK, "test");
+     r = rs_gdbm_read_index_range(rs, 9, 11, -1, &ents);
+     if (r != 2 || ents[0].seq != 11 || ents[1].time != 902) {
+	  fprintf(stderr, "[7b] converted index wrong %d\n", r);
+	  exit(1);
+     }
+     nfree(ents);
+     if ((buf2 = rs_gdbm_read_value(rs, "ri9", &r))) {
+	  fprintf(stderr, "[7c] text index not removed\n");
+	  exit(1);
+     }
+     rs_gdbm_unlock(rs);
+     rs_gdbm_close(rs);
+
+     /* test 8: persistent descriptors stay open between locks, exclude
+      * each other with the sidecar and notice each other's writes */
+     rs  = rs_gdbm_open(TESTRS1, 0644, RS_PERSIST);
+     rs2 = rs_gdbm_open(TESTRS1, 0644, RS_PERSIST);
+     if ( ! rs || ! rs2 || ! rs->persist || ! rs2->persist) {
+	  fprintf(stderr, "[8a] unable to open persistent\n");
+	  exit(1);
+     }
+     rs_gdbm_lock(rs2, RS_RDLOCK, "test");
+     if ((buf2 = rs_gdbm_read_value(rs2, "persist", &r))) {
+	  fprintf(stderr, "[8b] value should not exist\n");
+	  exit(1);
+     }
+     rs_gdbm_unlock(rs2);
+     if (rs2->ref == NULL) {
+	  fprintf(stderr, "[8c] persistent handle closed on unlock\n");
+	  exit(1);
+     }
+     rs_gdbm_lock(rs, RS_WRLOCK, "test");
+     rs_gdbm_write_value(rs, "persist", "one", 4);
+     if (rs_gdbm_lock(rs2, RS_RDLOCKNOW, "test")) {
+	  fprintf(stderr, "[8d] read lock granted during write lock\n");
+	  exit(1);
+     }
+     rs_gdbm_unlock(rs);
+     rs_gdbm_lock(rs2, RS_RDLOCK, "test");
+     buf2 = rs_gdbm_read_value(rs2, "persist", &r);
+     if (buf2 == NULL || strcmp(buf2, "one") != 0) {
+	  fprintf(stderr, "[8e] write not seen by other descriptor\n");
+	  exit(1);
+     }
+     nfree(buf2);
+     rs_gdbm_unlock(rs2);
+     buf3 = (char *) rs->ref;
+     rs_gdbm_lock(rs, RS_RDLOCK, "test");
+     if ((char *) rs->ref != buf3) {
+	  fprintf(stderr, "[8f] persistent handle reopened needlessly\n");
+	  exit(1);
+     }
+     rs_gdbm_unlock(rs);
+     rs_gdbm_close(rs);
+     rs_gdbm_close(rs2);
+     unlink(TESTRS1 RS_GDBM_LOCKSUFFIX);
+
+     /* test 9: a reader without write access to the ringstore does not 
+      * create the sidecar and uses GDBM's lock instead. Run it in a child 
+      * which gives up root, as root can always write */
+     chmod(TESTRS1, 0444);
+     if ((i = fork()) == 0) {
+	  if (getuid() == 0 && setuid(65534) == -1)
+	       exit(2);
+	  rs = rs_gdbm_open(TESTRS1, 0644, RS_PERSIST);
+	  if ( ! rs || rs->lockfd != -1 || rs->persist )
+	       exit(1);
+	  if ( ! rs_gdbm_lock(rs, RS_RDLOCK, "test") )
+	       exit(1);
+	  buf2 = rs_gdbm_read_value(rs, "persist", &r);
+	  if (buf2 == NULL || strcmp(buf2, "one") != 0)
+	       exit(1);
+	  rs_gdbm_unlock(rs);
+	  rs_gdbm_close(rs);
+	  exit(access(TESTRS1 RS_GDBM_LOCKSUFFIX, F_OK) == 0 ? 1 : 0);
+     }
+     waitpid(i, &r, 0);
+     chmod(TESTRS1, 0644);
+     if (WIFEXITED(r) && WEXITSTATUS(r) == 2) {
+	  fprintf(stderr, "[9] unable to give up root, not tested\n");
+     } else if ( ! WIFEXITED(r) || WEXITSTATUS(r) != 0) {
+	  fprintf(stderr, "[9] read only open failed or made a lock file\n");
+	  exit(1);
+     }
 
      elog_fini();
      route_fini();
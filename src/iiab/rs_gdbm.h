@@ -4,6 +4,14 @@
  *
  * Nigel Stuckey, September 2001 using code from January 1998 onwards
  * Copyright System Garden Limited 1998-2001. All rights reserved.
+ *
+ * Locking: every process that can write a ringstore locks a sidecar file
+ * (<ringstore>.lock) as well as GDBM's own lock. Persistent descriptors 
+ * (RS_PERSIST) keep the GDBM file open and so open it with GDBM_NOLOCK,
+ * relying on the sidecar alone. Binaries built before the sidecar only 
+ * know GDBM's lock and are not excluded by a persistent descriptor: 
+ * they must not write a ringstore while another process holds it open
+ * persistently, so upgrade all binaries sharing a ringstore together.
  */
 #ifndef _RS_GDBM_H_
 #define _RS_GDBM_H_
@@ -27,6 +35,11 @@ struct rs_gdbm_desc {
      int   lock;		/* lock flag: 0=none, 1=read, 2=write */
      int   inhibitlock;		/* inhibit lock flag */
      char *lastkey;		/* last key (for traversal) [needed by GDBM] */
+     int   persist;		/* 1=keep GDBM open between locks */
+     int   refmode;		/* lock mode ref was opened with */
+     char *lockname;		/* sidecar lock file name */
+     int   lockfd;		/* sidecar lock file descriptor or -1 */
+     unsigned long gen;		/* write generation when ref was opened */
 };
 typedef struct rs_gdbm_desc * RS_GDBMD;
 
@@ -42,10 +55,17 @@ extern const struct rs_lowlevel rs_gdbm_method;
 #define RS_GDBM_NTRYS		80
 #define RS_GDBM_WAITTRY		50000000	/* 5 miliseconds */
 #define RS_GDBM_READ_PERM	0400		/* just need to read */
+#define RS_GDBM_LOCKSUFFIX	".lock"		/* sidecar lock file suffix */
 #define RS_GDBM_RINGDIR		"ringdir"
 #define RS_GDBM_HEADDICT	"headdict"
-#define RS_GDBM_INDEXNAME	"ri"
-#define RS_GDBM_INDEXKEYLEN	15
+#define RS_GDBM_INDEXNAME	"ri"	/* legacy text index, ri<ringid> */
+#define RS_GDBM_INDEXKEYLEN	25
+#define RS_GDBM_IDXHEADNAME	"rh"	/* binary index head, rh<ringid> */
+#define RS_GDBM_IDXCHUNKNAME	"rx"	/* binary index chunk, rx<ringid>_<n> */
+#define RS_GDBM_IDXCHUNK	512	/* index entries held in each chunk */
+#define RS_GDBM_IDXENTSZ	16	/* bytes: seq(4), time(8), hd_hash(4) */
+#define RS_GDBM_IDXHEADSZ	36	/* bytes: version, oldest, youngest */
+#define RS_GDBM_IDXVERSION	2
 #define RS_GDBM_DATAKEYLEN	25
 #define RS_GDBM_DATANAME	"rd"
 
@@ -71,6 +91,12 @@ int    rs_gdbm_write_headers(RS_LLD, ITREE *headers);
 TABLE  rs_gdbm_read_index   (RS_LLD, int ringid);
 int    rs_gdbm_write_index  (RS_LLD, int ringid, TABLE index);
 int    rs_gdbm_rm_index     (RS_LLD, int ringid);
+int    rs_gdbm_index_ends   (RS_LLD, int ringid, RS_IDXENT oldest, 
+			     RS_IDXENT youngest);
+int    rs_gdbm_read_index_range(RS_LLD, int ringid, int from_seq, int to_seq,
+				RS_IDXENT *entries);
+int    rs_gdbm_append_index (RS_LLD, int ringid, int start_seq, ITREE *dblock);
+int    rs_gdbm_expire_index (RS_LLD, int ringid, int to_seq);
 int    rs_gdbm_append_dblock(RS_LLD, int ringid, int start_seq, ITREE *dblock);
 ITREE *rs_gdbm_read_dblock  (RS_LLD, int ringid, int start_seq, int nblocks);
 int    rs_gdbm_expire_dblock(RS_LLD, int ringid, int from_seq, int to_seq);
@@ -93,7 +119,22 @@ int    rs_gdbm_dbdelete(RS_GDBMD rs, char *key);
 char * rs_gdbm_dbfirstkey(RS_GDBMD rs);
 char * rs_gdbm_dbnextkey(RS_GDBMD rs, char *lastkey);
 int    rs_gdbm_dbreorganise(RS_GDBMD rs);
+int    rs_gdbm_sideopen(RS_GDBMD rs);
+int    rs_gdbm_sidelock(RS_GDBMD rs, char *where, enum rs_db_lock rw);
+void   rs_gdbm_sideunlock(RS_GDBMD rs);
+unsigned long rs_gdbm_sidegen(RS_GDBMD rs);
+unsigned long rs_gdbm_sidebump(RS_GDBMD rs);
 char * rs_gdbm_readfirst(RS_GDBMD rs, char **key, int *length);
 char * rs_gdbm_readnext(RS_GDBMD rs, char **key, int *length);
 void   rs_gdbm_readend(RS_GDBMD rs);
+int    rs_gdbm_idx_readhead(RS_GDBMD rs, int ringid, RS_IDXENT oldest, 
+			    RS_IDXENT youngest);
+int    rs_gdbm_idx_writehead(RS_GDBMD rs, int ringid, RS_IDXENT oldest, 
+			     RS_IDXENT youngest);
+int    rs_gdbm_idx_putents(RS_GDBMD rs, int ringid, RS_IDXENT ents, int n);
+int    rs_gdbm_idx_rmchunks(RS_GDBMD rs, int ringid, int from_seq, int to_seq);
+RS_IDXENT rs_gdbm_idx_legacy(RS_GDBMD rs, int ringid, int *nents);
+int    rs_gdbm_idx_migrate(RS_GDBMD rs, int ringid);
+void   rs_gdbm_idx_pack(unsigned char *buf, RS_IDXENT ent);
+void   rs_gdbm_idx_unpack(unsigned char *buf, RS_IDXENT ent);
 #endif /* _RS_GDBM_H_ */
@@ -0,0 +1,1429 @@
+/*
+ * Ringstore low level storage using an abstracted interface
+ * In-memory implementation (memrs), holding the recent window of each
+ * ring in process memory and writing through to GDBM
+ *
+ * Every write goes to GDBM, as rs_gdbm_method would, and to a cache of
+ * the file held in process memory: the superblock, ring directory,
+ * header dictionary, the whole index of each ring and the most recent
+ * data blocks of each ring (rs_mem_setwindow(), RS_MEM_NSAMPLES by
+ * default). Reads that the cache can answer are served from memory.
+ *
+ * The cache is only trusted while the write generation in the GDBM
+ * sidecar lock file (see rs_gdbm.c) matches the one the cache was built
+ * with. A read lock is granted without locking the file at all if it
+ * does, and the file is only locked later if a read misses the cache.
+ * Writes from other processes change the generation, so the cache is
+ * emptied and refilled from disk. Without a sidecar, nothing is cached
+ * and the method behaves just like rs_gdbm_method.
+ *
+ * The cache of a file is shared by all its descriptors in the process
+ * and lives until rs_mem_fini(). It is guarded by a mutex so that
+ * descriptors can be used in different threads.
+ *
+ * Copyright System Garden Limited. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "nmalloc.h"
+#include "elog.h"
+#include "util.h"
+#include "rs.h"
+#include "rs_gdbm.h"
+#include "rs_mem.h"
+
+const struct rs_lowlevel rs_mem_method = {
+     rs_mem_init,          rs_mem_fini,          rs_mem_open,
+     rs_mem_close,         rs_mem_exists,        rs_mem_lock,
+     rs_mem_unlock,        rs_mem_read_super,    rs_mem_write_super,
+     rs_mem_read_rings,    rs_mem_write_rings,   rs_mem_read_headers,
+     rs_mem_write_headers, rs_mem_read_index,    rs_mem_write_index,
+     rs_mem_rm_index,      rs_mem_append_dblock, rs_mem_read_dblock,
+     rs_mem_expire_dblock, rs_mem_read_substr,   rs_mem_read_value,
+     rs_mem_write_value,   rs_mem_checkpoint,    rs_mem_footprint,
+     rs_mem_dumpdb,        rs_mem_errstat,       rs_mem_index_ends,
+     rs_mem_read_index_range, rs_mem_append_index, rs_mem_expire_index
+};
+
+/* statics */
+int   rs_mem_isinit=0;			/* initialised */
+int   rs_mem_nsamples=RS_MEM_NSAMPLES;	/* data blocks held for each ring */
+TREE *rs_mem_files=NULL;		/* struct rs_mem_file by file name */
+pthread_mutex_t rs_mem_mutex = PTHREAD_MUTEX_INITIALIZER; /* guards cache */
+
+/* initialise */
+void   rs_mem_init         ()
+{
+     rs_gdbm_init();
+     pthread_mutex_lock(&rs_mem_mutex);
+     if ( ! rs_mem_isinit ) {
+	  rs_mem_files = tree_create();
+	  rs_mem_isinit=1;
+     }
+     pthread_mutex_unlock(&rs_mem_mutex);
+}
+
+
+/* finalise, freeing the cache of files that are no longer open */
+void   rs_mem_fini         ()
+{
+     struct rs_mem_file *file;
+
+     pthread_mutex_lock(&rs_mem_mutex);
+     if (rs_mem_isinit) {
+	  tree_first(rs_mem_files);
+	  while ( ! tree_isbeyondend(rs_mem_files) ) {
+	       file = tree_get(rs_mem_files);
+	       if (file->nref > 0) {
+		    tree_next(rs_mem_files);
+		    continue;
+	       }
+	       rs_mem_flush(file);
+	       itree_destroy(file->rings);
+	       tree_rm(rs_mem_files);
+	       nfree(file->name);
+	       nfree(file);
+	  }
+	  if (tree_empty(rs_mem_files)) {
+	       tree_destroy(rs_mem_files);
+	       rs_mem_files = NULL;
+	       rs_mem_isinit = 0;
+	  }
+     }
+     pthread_mutex_unlock(&rs_mem_mutex);
+}
+
+
+/*
+ * Set the number of the most recent data blocks of each ring to hold
+ * in memory; 0 holds just the index and ring details. Rings already
+ * cached keep their current window until it is next emptied.
+ */
+void   rs_mem_setwindow    (int nsamples)
+{
+     rs_mem_nsamples = nsamples < 0 ? 0 : nsamples;
+}
+
+
+/*
+ * Open the ringstore with rs_gdbm_open() (see there for the flags) and
+ * attach the descriptor to the cache of the file, which is created if
+ * this is the first time the process has opened it.
+ * Returns the low level descriptor if successful or NULL otherwise.
+ */
+RS_LLD rs_mem_open         (char *filename,	/* name of GDBM file */
+			    mode_t perm, 	/* unix file creation perms */
+			    int flags		/* RS_CREATE|RS_PERSIST */ )
+{
+     RS_LLD gdbm;
+     RS_MEMD rs;
+     struct rs_mem_file *file;
+
+     if (! rs_mem_isinit)
+          elog_die(FATAL, "rs_mem unitialised");
+
+     gdbm = rs_gdbm_open(filename, perm, flags);
+     if ( ! gdbm )
+	  return NULL;
+
+     rs = xnmalloc(sizeof(struct rs_mem_desc));
+     rs->lld_type = RS_LLD_TYPE_MEM;
+     rs->gdbm     = gdbm;
+     rs->file     = NULL;
+     rs->lock     = RS_UNLOCK;
+     rs->disklock = 0;
+     rs->gen      = 0;
+     rs->where    = NULL;
+
+     /* other processes' writes can only be seen with a sidecar */
+     if (rs_gdbmd_from_lld(gdbm)->lockfd == -1) {
+	  elog_printf(DIAG, "no lock file for %s, so it will not be held "
+		      "in memory", filename);
+	  return rs;
+     }
+
+     pthread_mutex_lock(&rs_mem_mutex);
+     file = tree_find(rs_mem_files, filename);
+     if (file == TREE_NOVAL) {
+	  file = xnmalloc(sizeof(struct rs_mem_file));
+	  file->name    = xnstrdup(filename);
+	  file->nref    = 0;
+	  file->valid   = 0;
+	  file->gen     = 0;
+	  file->super   = NULL;
+	  file->ringdir = NULL;
+	  file->headers = NULL;
+	  file->rings   = itree_create();
+	  tree_add(rs_mem_files, file->name, file);
+     }
+     file->nref++;
+     rs->file = file;
+     pthread_mutex_unlock(&rs_mem_mutex);
+
+     return rs;
+}
+
+
+/* Close and free up an existing rs_mem descriptor; the cache remains */
+void   rs_mem_close        (RS_LLD lld	/* RS generic low level descriptor */)
+{
+     RS_MEMD rs;
+
+     rs = rs_memd_from_lld(lld);
+     if (rs->lock != RS_UNLOCK)			/* unlock if needed */
+	  rs_mem_unlock(rs);
+     rs_gdbm_close(rs->gdbm);
+     if (rs->file) {
+	  pthread_mutex_lock(&rs_mem_mutex);
+	  rs->file->nref--;
+	  pthread_mutex_unlock(&rs_mem_mutex);
+     }
+     nfree(rs);
+}
+
+
+/* Checks to see if the filename is a ringstore, see rs_gdbm_exists() */
+int    rs_mem_exists       (char *filename, enum rs_db_writable todo)
+{
+     return rs_gdbm_exists(filename, todo);
+}
+
+
+/*
+ * Lock the ringstore for work until rs_mem_unlock() is called.
+ * Read locks (RS_RDLOCK and RS_RDLOCKNOW) are granted straight away if
+ * the cache is current, without locking the file; the file is locked
+ * for reading later if a read can't be answered from memory.
+ * Write locks always lock the file, as rs_gdbm_lock() does, and empty
+ * the cache if another process has written since it was filled.
+ * Returns 1 for success or 0 for failure
+ */
+int    rs_mem_lock(RS_LLD lld,		/* RS generic low level descriptor */
+		   enum rs_db_lock rw,	/* lock to take on db */
+		   char *where		/* caller id */)
+{
+     RS_MEMD rs;
+     int current;
+
+     /* param checking */
+     if (lld == NULL) {
+	  elog_printf(ERROR, "ringstore not opened before locking");
+	  return 0;
+     }
+     rs = rs_memd_from_lld(lld);
+
+     if (rw == RS_RDLOCK || rw == RS_RDLOCKNOW) {
+	  if (rs->lock != RS_UNLOCK) {
+	       if (rs->lock == RS_RDLOCK)
+		    elog_printf(ERROR, "%s already have read lock; do nothing",
+				where);
+	       return 1;	/* success */
+	  }
+
+	  /* serve from memory if no one else has written */
+	  current = 0;
+	  if (rs->file) {
+	       pthread_mutex_lock(&rs_mem_mutex);
+	       if (rs->file->valid &&
+		   rs_gdbm_sidegen(rs_gdbmd_from_lld(rs->gdbm)) ==
+		   rs->file->gen) {
+		    rs->gen = rs->file->gen;
+		    current = 1;
+	       }
+	       pthread_mutex_unlock(&rs_mem_mutex);
+	  }
+	  if ( ! current && ! rs_mem_disklock(rs, rw, where) )
+	       return 0;	/* failure */
+	  rs->lock  = RS_RDLOCK;
+	  rs->where = where;
+	  return 1;		/* success */
+     }
+
+     if (rs->lock == RS_WRLOCK) {
+	  elog_printf(ERROR, "%s already have write lock; do nothing", where);
+	  return 1;		/* success */
+     }
+
+     /* write locks escalate a read lock, which is lost on failure */
+     if ( ! rs_mem_disklock(rs, rw, where) ) {
+	  rs->lock = RS_UNLOCK;
+	  return 0;	/* failure */
+     }
+     rs->lock  = RS_WRLOCK;
+     rs->where = where;
+     return 1;		/* success */
+}
+
+
+/* Unlock the ringstore, unlocking the file if it was locked. Releasing
+ * a write lock moves the cache on to the new write generation */
+void   rs_mem_unlock       (RS_LLD lld	/* RS generic low level descriptor */)
+{
+     RS_MEMD rs;
+
+     /* param checking */
+     if (lld == NULL) {
+	  elog_printf(ERROR, "ringstore not opened before unlocking");
+	  return;
+     }
+     rs = rs_memd_from_lld(lld);
+     if (rs->lock == RS_UNLOCK) {
+          elog_die(FATAL, "ringstore not locked");
+	  return;
+     }
+
+     if (rs->disklock) {
+	  rs_gdbm_unlock(rs->gdbm);
+	  rs->disklock = 0;
+	  if (rs->lock == RS_WRLOCK && rs->file) {
+	       pthread_mutex_lock(&rs_mem_mutex);
+	       if (rs->file->valid && rs->file->gen == rs->gen)
+		    rs->file->gen = rs_gdbmd_from_lld(rs->gdbm)->gen;
+	       else
+		    rs->file->valid = 0;
+	       pthread_mutex_unlock(&rs_mem_mutex);
+	  }
+     }
+     rs->lock  = RS_UNLOCK;
+     rs->where = NULL;
+}
+
+
+/* Return a copy of the superblock, from memory if possible.
+ * Free with rs_free_superblock() */
+RS_SUPER rs_mem_read_super (RS_LLD lld	/* RS generic low level descriptor */)
+{
+     RS_MEMD rs;
+     RS_SUPER super = NULL;
+
+     rs = rs_memd_from_lld(lld);
+     pthread_mutex_lock(&rs_mem_mutex);
+     if (rs_mem_fresh(rs) && rs->file->super)
+	  super = rs_copy_superblock(rs->file->super);
+     pthread_mutex_unlock(&rs_mem_mutex);
+     if (super)
+	  return super;
+
+     if ( ! rs_mem_needdisk(rs) )
+	  return NULL;
+     super = rs_gdbm_read_super(rs->gdbm);
+     if (super) {
+	  pthread_mutex_lock(&rs_mem_mutex);
+	  if (rs_mem_fresh(rs)) {
+	       if (rs->file->super)
+		    rs_free_superblock(rs->file->super);
+	       rs->file->super = rs_copy_superblock(super);
+	  }
+	  pthread_mutex_unlock(&rs_mem_mutex);
+     }
+
+     return super;
+}
+
+
+/* Write the superblock through to GDBM and keep a copy.
+ * Returns 1 for success or 0 for failure */
+int    rs_mem_write_super  (RS_LLD lld,    /* RS generic low level descriptor */
+			    RS_SUPER super /* superblock */)
+{
+     RS_MEMD rs;
+     int r;
+
+     rs = rs_memd_from_lld(lld);
+     r = rs_gdbm_write_super(rs->gdbm, super);
+     if ( ! r ) {
+	  rs_mem_invalidate(rs);
+	  return 0;
+     }
+     pthread_mutex_lock(&rs_mem_mutex);
+     if (rs_mem_fresh(rs)) {
+	  if (rs->file->super)
+	       rs_free_superblock(rs->file->super);
+	  rs->file->super = rs_copy_superblock(super);
+     }
+     pthread_mutex_unlock(&rs_mem_mutex);
+
+     return r;
+}
+
+
+/* Return the ring directory in the form of rs_gdbm_read_rings(),
+ * from memory if possible */
+TABLE  rs_mem_read_rings   (RS_LLD lld	/* RS generic low level descriptor */)
+{
+     RS_MEMD rs;
+     TABLE rings;
+     char *ringdir = NULL;
+
+     rs = rs_memd_from_lld(lld);
+     pthread_mutex_lock(&rs_mem_mutex);
+     if (rs_mem_fresh(rs) && rs->file->ringdir)
+	  ringdir = xnstrdup(rs->file->ringdir);
+     pthread_mutex_unlock(&rs_mem_mutex);
+     if (ringdir) {
+	  rings = table_create_a(rs_ringdir_hds);
+	  table_scan(rings, ringdir, "\t", TABLE_SINGLESEP,
+		     TABLE_NOCOLNAMES, TABLE_NORULER);
+	  table_freeondestroy(rings, ringdir);
+	  return rings;
+     }
+
+     if ( ! rs_mem_needdisk(rs) )
+	  return NULL;
+     rings = rs_gdbm_read_rings(rs->gdbm);
+     if (rings) {
+	  ringdir = table_outbody(rings);
+	  pthread_mutex_lock(&rs_mem_mutex);
+	  if (rs_mem_fresh(rs)) {
+	       if (rs->file->ringdir)
+		    nfree(rs->file->ringdir);
+	       rs->file->ringdir = ringdir ? ringdir : xnstrdup("");
+	       ringdir = NULL;
+	  }
+	  pthread_mutex_unlock(&rs_mem_mutex);
+	  if (ringdir)
+	       nfree(ringdir);
+     }
+
+     return rings;
+}
+
+
+/* Write the ring directory through to GDBM and keep a copy.
+ * Returns 1 for success or 0 for failure */
+int    rs_mem_write_rings  (RS_LLD lld, /* RS generic low level descriptor */
+			    TABLE rings /* table of rings */)
+{
+     RS_MEMD rs;
+     char *ringdir;
+     int r;
+
+     rs = rs_memd_from_lld(lld);
+     r = rs_gdbm_write_rings(rs->gdbm, rings);
+     if ( ! r ) {
+	  rs_mem_invalidate(rs);
+	  return 0;
+     }
+     ringdir = table_outbody(rings);
+     pthread_mutex_lock(&rs_mem_mutex);
+     if (rs_mem_fresh(rs)) {
+	  if (rs->file->ringdir)
+	       nfree(rs->file->ringdir);
+	  rs->file->ringdir = ringdir ? ringdir : xnstrdup("");
+	  ringdir = NULL;
+     }
+     pthread_mutex_unlock(&rs_mem_mutex);
+     if (ringdir)
+	  nfree(ringdir);
+
+     return r;
+}
+
+
+/* Return the header dictionary in the form of rs_gdbm_read_headers(),
+ * from memory if possible.
+ * Free with itree_clearoutandfree(), then itree_destroy() */
+ITREE *rs_mem_read_headers (RS_LLD lld	/* RS generic low level descriptor */)
+{
+     RS_MEMD rs;
+     ITREE *hds = NULL;
+
+     rs = rs_memd_from_lld(lld);
+     pthread_mutex_lock(&rs_mem_mutex);
+     if (rs_mem_fresh(rs) && rs->file->headers)
+	  hds = itree_copystr(rs->file->headers);
+     pthread_mutex_unlock(&rs_mem_mutex);
+     if (hds)
+	  return hds;
+
+     if ( ! rs_mem_needdisk(rs) )
+	  return NULL;
+     hds = rs_gdbm_read_headers(rs->gdbm);
+     if (hds) {
+	  pthread_mutex_lock(&rs_mem_mutex);
+	  if (rs_mem_fresh(rs)) {
+	       if (rs->file->headers) {
+		    itree_clearoutandfree(rs->file->headers);
+		    itree_destroy(rs->file->headers);
+	       }
+	       rs->file->headers = itree_copystr(hds);
+	  }
+	  pthread_mutex_unlock(&rs_mem_mutex);
+     }
+
+     return hds;
+}
+
+
+/* Write the header dictionary through to GDBM and keep a copy.
+ * Returns 1 for success or 0 for failure */
+int    rs_mem_write_headers(RS_LLD lld,     /* generic low level descriptor */
+			    ITREE *headers  /* list of header strings */)
+{
+     RS_MEMD rs;
+     int r;
+
+     rs = rs_memd_from_lld(lld);
+     r = rs_gdbm_write_headers(rs->gdbm, headers);
+     if ( ! r ) {
+	  rs_mem_invalidate(rs);
+	  return 0;
+     }
+     pthread_mutex_lock(&rs_mem_mutex);
+     if (rs_mem_fresh(rs)) {
+	  if (rs->file->headers) {
+	       itree_clearoutandfree(rs->file->headers);
+	       itree_destroy(rs->file->headers);
+	  }
+	  rs->file->headers = itree_copystr(headers);
+     }
+     pthread_mutex_unlock(&rs_mem_mutex);
+
+     return r;
+}
+
+
+/* Read the index of a ring as a TABLE from GDBM, see rs_gdbm_read_index() */
+TABLE  rs_mem_read_index   (RS_LLD lld, 	/* RS generic low level descriptor */
+			    int ringid		/* ring id */)
+{
+     RS_MEMD rs;
+
+     rs = rs_memd_from_lld(lld);
+     if ( ! rs_mem_needdisk(rs) )
+	  return NULL;
+     return rs_gdbm_read_index(rs->gdbm, ringid);
+}
+
+
+/* Write a whole index to GDBM, dropping the ring from the cache.
+ * Returns 1 for success or 0 for failure */
+int    rs_mem_write_index  (RS_LLD lld,	/* RS generic low level descriptor */
+			    int ringid,	/* ring id */
+			    TABLE index	/* index table */)
+{
+     RS_MEMD rs;
+
+     rs = rs_memd_from_lld(lld);
+     if (rs->file) {
+	  pthread_mutex_lock(&rs_mem_mutex);
+	  rs_mem_dropring(rs->file, ringid);
+	  pthread_mutex_unlock(&rs_mem_mutex);
+     }
+     return rs_gdbm_write_index(rs->gdbm, ringid, index);
+}
+
+
+/* Remove the index of a ring from GDBM and the ring from the cache.
+ * Returns 1 for success or 0 for failure */
+int    rs_mem_rm_index     (RS_LLD lld, int ringid)
+{
+     RS_MEMD rs;
+
+     rs = rs_memd_from_lld(lld);
+     if (rs->file) {
+	  pthread_mutex_lock(&rs_mem_mutex);
+	  rs_mem_dropring(rs->file, ringid);
+	  pthread_mutex_unlock(&rs_mem_mutex);
+     }
+     return rs_gdbm_rm_index(rs->gdbm, ringid);
+}
+
+
+/*
+ * Find the oldest and youngest entries of the index of ring 'ringid',
+ * as rs_gdbm_index_ends(), from the cached index.
+ * Returns the number of entries in the index, which will be 0 if
+ * empty or not present, or -1 for error.
+ */
+int    rs_mem_index_ends   (RS_LLD lld,	/* low level descriptor */
+			    int ringid,		/* ring id */
+			    RS_IDXENT oldest,	/* RET: oldest entry */
+			    RS_IDXENT youngest	/* RET: youngest entry */)
+{
+     RS_MEMD rs;
+     struct rs_mem_ring *mr;
+     int n = -1;
+
+     rs = rs_memd_from_lld(lld);
+     if (rs_mem_loadidx(rs, ringid)) {
+	  pthread_mutex_lock(&rs_mem_mutex);
+	  mr = rs_mem_ring(rs->file, ringid, 0);
+	  if (rs_mem_fresh(rs) && mr && mr->loaded) {
+	       n = mr->idx_n;
+	       if (n) {
+		    *oldest   = mr->idx[0];
+		    *youngest = mr->idx[n-1];
+	       } else {
+		    oldest->seq = youngest->seq = -1;
+		    oldest->time = youngest->time = 0;
+		    oldest->hd_hash = youngest->hd_hash = 0;
+	       }
+	  }
+	  pthread_mutex_unlock(&rs_mem_mutex);
+	  if (n != -1)
+	       return n;
+     }
+
+     if ( ! rs_mem_needdisk(rs) )
+	  return -1;
+     return rs_gdbm_index_ends(rs->gdbm, ringid, oldest, youngest);
+}
+
+
+/*
+ * Read the entries of the index of ring 'ringid' that lie between
+ * 'from_seq' and 'to_seq' inclusive, as rs_gdbm_read_index_range(),
+ * from the cached index.
+ * Returns the number of entries read, which will be 0 (and entries
+ * set to NULL) if there are none, or -1 for error.
+ */
+int    rs_mem_read_index_range(RS_LLD lld,	/* low level descriptor */
+			       int ringid,	/* ring id */
+			       int from_seq,	/* first seq or -1 */
+			       int to_seq,	/* last seq or -1 */
+			       RS_IDXENT *entries /* RET: array of entries */)
+{
+     RS_MEMD rs;
+     struct rs_mem_ring *mr;
+     int first, last, n = -1;
+
+     *entries = NULL;
+     rs = rs_memd_from_lld(lld);
+     if (rs_mem_loadidx(rs, ringid)) {
+	  pthread_mutex_lock(&rs_mem_mutex);
+	  mr = rs_mem_ring(rs->file, ringid, 0);
+	  if (rs_mem_fresh(rs) && mr && mr->loaded) {
+	       first = from_seq == -1 ? 0 : rs_mem_idx_byseq(mr, from_seq);
+	       last  = to_seq   == -1 ? mr->idx_n :
+		                        rs_mem_idx_byseq(mr, to_seq+1);
+	       n = last > first ? last - first : 0;
+	       if (n) {
+		    *entries = xnmemdup(mr->idx + first,
+					n * sizeof(struct rs_index_entry));
+	       }
+	  }
+	  pthread_mutex_unlock(&rs_mem_mutex);
+	  if (n != -1)
+	       return n;
+     }
+
+     if ( ! rs_mem_needdisk(rs) )
+	  return -1;
+     return rs_gdbm_read_index_range(rs->gdbm, ringid, from_seq, to_seq,
+				     entries);
+}
+
+
+/*
+ * Append entries to the index of ring 'ringid' for the data blocks in
+ * 'dblock', starting at 'start_seq', in GDBM and in the cached index.
+ * Returns the number of entries appended, 0 for failure.
+ */
+int    rs_mem_append_index (RS_LLD lld,	/* low level descriptor */
+			    int ringid,		/* ring id */
+			    int start_seq,	/* starting sequence */
+			    ITREE *dblock	/* list of RS_DBLOCK */)
+{
+     RS_MEMD rs;
+     RS_DBLOCK d;
+     struct rs_mem_ring *mr;
+     int r;
+
+     rs = rs_memd_from_lld(lld);
+     r = rs_gdbm_append_index(rs->gdbm, ringid, start_seq, dblock);
+     if ( ! rs->file )
+	  return r;
+
+     pthread_mutex_lock(&rs_mem_mutex);
+     mr = rs_mem_ring(rs->file, ringid, 0);
+     if (mr && mr->loaded) {
+	  if (r != itree_n(dblock) || ! rs_mem_fresh(rs) ||
+	      (mr->idx_n && mr->idx[mr->idx_n-1].seq != start_seq-1)) {
+	       /* out of step: reload next time */
+	       mr->loaded = 0;
+	       mr->idx_n  = 0;
+	  } else {
+	       if (mr->idx_n + r > mr->idx_alloc) {
+		    mr->idx_alloc = (mr->idx_n + r) * 2;
+		    mr->idx = xnrealloc(mr->idx, sizeof(struct rs_index_entry)
+					* mr->idx_alloc);
+	       }
+	       itree_traverse(dblock) {
+		    d = itree_get(dblock);
+		    mr->idx[mr->idx_n].seq     = start_seq++;
+		    mr->idx[mr->idx_n].time    = d->time;
+		    mr->idx[mr->idx_n].hd_hash = d->hd_hashkey;
+		    mr->idx_n++;
+	       }
+	  }
+     }
+     pthread_mutex_unlock(&rs_mem_mutex);
+
+     return r;
+}
+
+
+/*
+ * Remove the entries older than or equal to 'to_seq' from the index of
+ * ring 'ringid', in GDBM and in the cached index.
+ * Returns the number of entries removed.
+ */
+int    rs_mem_expire_index (RS_LLD lld,	/* low level descriptor */
+			    int ringid,		/* ring id */
+			    int to_seq		/* less than and equal to */)
+{
+     RS_MEMD rs;
+     struct rs_mem_ring *mr;
+     int r, i;
+
+     rs = rs_memd_from_lld(lld);
+     r = rs_gdbm_expire_index(rs->gdbm, ringid, to_seq);
+     if ( ! rs->file )
+	  return r;
+
+     pthread_mutex_lock(&rs_mem_mutex);
+     mr = rs_mem_ring(rs->file, ringid, 0);
+     if (mr && mr->loaded) {
+	  i = rs_mem_idx_byseq(mr, to_seq+1);
+	  if (i > 0) {
+	       mr->idx_n -= i;
+	       memmove(mr->idx, mr->idx + i,
+		       mr->idx_n * sizeof(struct rs_index_entry));
+	  }
+     }
+     pthread_mutex_unlock(&rs_mem_mutex);
+
+     return r;
+}
+
+
+/*
+ * Add data blocks to GDBM as rs_gdbm_append_dblock() and keep a copy
+ * of each in the ring's window of recent data blocks, dropping the
+ * oldest held when it is full.
+ * Returns number of blocks inserted.
+ */
+int    rs_mem_append_dblock(RS_LLD lld,	/* low level descriptor */
+			    int ringid,		/* ring id */
+			    int start_seq, 	/* starting sequence */
+			    ITREE *dblock	/* list of RS_DBLOCK */)
+{
+     RS_MEMD rs;
+     RS_DBLOCK d;
+     struct rs_mem_ring *mr;
+     int r, seq;
+
+     rs = rs_memd_from_lld(lld);
+     r = rs_gdbm_append_dblock(rs->gdbm, ringid, start_seq, dblock);
+     if ( ! rs->file )
+	  return r;
+
+     pthread_mutex_lock(&rs_mem_mutex);
+     if (rs_mem_fresh(rs)) {
+	  mr = rs_mem_ring(rs->file, ringid, 1);
+	  if (r != itree_n(dblock)) {
+	       /* some were not written and we don't know which */
+	       rs_mem_win_clear(mr);
+	  } else {
+	       seq = start_seq;
+	       itree_traverse(dblock) {
+		    d = itree_get(dblock);
+		    rs_mem_win_put(mr, seq++, d->time, d->hd_hashkey, d->data,
+				   d->datalen >= 0 ? d->datalen :
+				   strlen(d->data));
+	       }
+	  }
+     }
+     pthread_mutex_unlock(&rs_mem_mutex);
+
+     return r;
+}
+
+
+/*
+ * Read a set of data blocks in sequence from the ring 'ringid', in the
+ * form of rs_gdbm_read_dblock(). Blocks held in memory are copied from
+ * there and the rest are read from GDBM. Blocks read from GDBM that
+ * lead up to the ones held are added to the window if there is room.
+ * Returns an ITREE if successful (including empty data) or NULL
+ * otherwise. Free the returned data with rs_free_dblock().
+ */
+ITREE *rs_mem_read_dblock  (RS_LLD lld,	  /* low level descriptor */
+			    int ringid,	  /* ring id */
+			    int start_seq, /* starting sequence */
+			    int nblocks	  /* number of data blocks */)
+{
+     RS_MEMD rs;
+     RS_DBLOCK d;
+     ITREE *dlist, *disk;
+     struct rs_mem_ring *mr;
+     struct rs_mem_sample *s;
+     int lo, hi, wlo, whi, seq, known;
+
+     rs = rs_memd_from_lld(lld);
+     if ( ! rs->file ) {
+	  if ( ! rs_mem_needdisk(rs) )
+	       return NULL;
+	  return rs_gdbm_read_dblock(rs->gdbm, ringid, start_seq, nblocks);
+     }
+
+     /* Copy the blocks held. The window always ends at the youngest
+      * block of the ring, so if there is a window or a cached index,
+      * nothing beyond its end need be looked for */
+     dlist = itree_create();
+     lo = start_seq;
+     hi = start_seq + nblocks - 1;
+     wlo = hi + 1;
+     whi = hi;
+     known = 0;
+     pthread_mutex_lock(&rs_mem_mutex);
+     mr = rs_mem_fresh(rs) ? rs_mem_ring(rs->file, ringid, 0) : NULL;
+     if (mr && mr->loaded) {
+	  if (mr->idx_n == 0) {
+	       pthread_mutex_unlock(&rs_mem_mutex);
+	       return dlist;		/* empty ring */
+	  }
+	  if (lo < mr->idx[0].seq)
+	       lo = mr->idx[0].seq;
+	  if (hi > mr->idx[mr->idx_n-1].seq)
+	       hi = mr->idx[mr->idx_n-1].seq;
+	  known++;
+     }
+     if (mr && mr->win_n) {
+	  wlo = mr->win_first;
+	  whi = mr->win_first + mr->win_n - 1;
+	  if (hi > whi)
+	       hi = whi;
+	  known++;
+     }
+     for (seq = lo > wlo ? lo : wlo; seq <= hi && seq <= whi; seq++) {
+	  s = rs_mem_win_get(mr, seq);
+	  d = xnmalloc(sizeof(struct rs_data_block));
+	  d->time       = s->time;
+	  d->hd_hashkey = s->hd_hash;
+	  d->data       = xnmemdup(s->data, s->datalen+1);
+	  d->datalen    = s->datalen;
+	  d->headroom   = 0;
+	  d->__priv_alloc_mem = d->data;
+	  itree_add(dlist, seq, d);
+     }
+     pthread_mutex_unlock(&rs_mem_mutex);
+
+     /* read the older blocks from disk and fill the window with them */
+     if (lo < wlo && lo <= hi) {
+	  if ( ! rs_mem_needdisk(rs) ) {
+	       rs_free_dblock(dlist);
+	       return NULL;
+	  }
+	  disk = rs_gdbm_read_dblock(rs->gdbm, ringid, lo,
+				     (hi < wlo-1 ? hi : wlo-1) - lo + 1);
+	  if ( ! disk ) {
+	       rs_free_dblock(dlist);
+	       return NULL;
+	  }
+	  pthread_mutex_lock(&rs_mem_mutex);
+	  if (known && rs_mem_fresh(rs) &&
+	      (mr = rs_mem_ring(rs->file, ringid, 1)))
+	       rs_mem_win_fill(mr, disk);
+	  pthread_mutex_unlock(&rs_mem_mutex);
+	  itree_traverse(disk)
+	       itree_add(dlist, itree_getkey(disk), itree_get(disk));
+	  itree_destroy(disk);
+     }
+
+     return dlist;
+}
+
+
+/*
+ * Remove the data blocks of ring 'ringid' between 'from_seq' and
+ * 'to_seq' inclusive from GDBM and from memory.
+ * Returns the number of blocks removed
+ */
+int    rs_mem_expire_dblock(RS_LLD lld,   /* low level descriptor */
+			    int ringid,   /* ring id */
+			    int from_seq, /* greater and equal */
+			    int to_seq    /* less than and equal to */ )
+{
+     RS_MEMD rs;
+     struct rs_mem_ring *mr;
+
+     rs = rs_memd_from_lld(lld);
+     if (rs->file) {
+	  pthread_mutex_lock(&rs_mem_mutex);
+	  mr = rs_mem_ring(rs->file, ringid, 0);
+	  if (mr)
+	       rs_mem_win_expire(mr, from_seq, to_seq);
+	  pthread_mutex_unlock(&rs_mem_mutex);
+     }
+     return rs_gdbm_expire_dblock(rs->gdbm, ringid, from_seq, to_seq);
+}
+
+
+TREE  *rs_mem_read_substr  (RS_LLD lld, /* RS generic low level descriptor */
+			    char *substr_key)
+{
+     RS_MEMD rs;
+
+     rs = rs_memd_from_lld(lld);
+     if ( ! rs_mem_needdisk(rs) )
+	  return NULL;
+     return rs_gdbm_read_substr(rs->gdbm, substr_key);
+}
+
+
+/* Read a value from GDBM, see rs_gdbm_read_value() */
+char  *rs_mem_read_value   (RS_LLD lld, /* RS generic low level descriptor */
+			    char *key, int *length)
+{
+     RS_MEMD rs;
+
+     rs = rs_memd_from_lld(lld);
+     if ( ! rs_mem_needdisk(rs) )
+	  return NULL;
+     return rs_gdbm_read_value(rs->gdbm, key, length);
+}
+
+
+/* Write a value to GDBM, see rs_gdbm_write_value() */
+int    rs_mem_write_value  (RS_LLD lld,	/* RS generic low level descriptor */
+			    char *key, char *value, int length)
+{
+     return rs_gdbm_write_value(rs_memd_from_lld(lld)->gdbm, key, value,
+				length);
+}
+
+
+/* Checkpoint the GDBM file. Returns 1 for success or 0 for failure */
+int    rs_mem_checkpoint   (RS_LLD lld	/* RS generic low level descriptor */)
+{
+     return rs_gdbm_checkpoint(rs_memd_from_lld(lld)->gdbm);
+}
+
+
+/* Return the size taken by the GDBM file in bytes or -1 for error */
+int    rs_mem_footprint    (RS_LLD lld	/* RS generic low level descriptor */)
+{
+     RS_MEMD rs;
+
+     rs = rs_memd_from_lld(lld);
+     if ( ! rs_mem_needdisk(rs) )
+	  return -1;
+     return rs_gdbm_footprint(rs->gdbm);
+}
+
+
+/* Dump the GDBM file to elog, see rs_gdbm_dumpdb() */
+int    rs_mem_dumpdb       (RS_LLD lld	/* RS generic low level descriptor */)
+{
+     RS_MEMD rs;
+
+     rs = rs_memd_from_lld(lld);
+     if ( ! rs_mem_needdisk(rs) )
+	  return 0;
+     return rs_gdbm_dumpdb(rs->gdbm);
+}
+
+
+void   rs_mem_errstat      (RS_LLD lld, int *errnum, char **errstr)
+{
+     rs_gdbm_errstat(rs_memd_from_lld(lld)->gdbm, errnum, errstr);
+}
+
+
+/* --------------- Private routines ----------------- */
+
+
+RS_MEMD rs_memd_from_lld(RS_LLD lld	/* typeless low level data */)
+{
+     if (((RS_MEMD)lld)->lld_type != RS_LLD_TYPE_MEM) {
+	  elog_die(FATAL, "type mismatch %d != RS_LLD_TYPE_MEM",
+		   ((RS_MEMD)lld)->lld_type);
+     }
+     return (RS_MEMD) lld;
+}
+
+
+/*
+ * Private: lock the GDBM file, emptying the cache if the write
+ * generation shows that another process has written to it since the
+ * cache was filled.
+ * Returns 1 for success or 0 for failure.
+ */
+int    rs_mem_disklock(RS_MEMD rs, enum rs_db_lock rw, char *where)
+{
+     struct rs_mem_file *file;
+     unsigned long gen;
+
+     if ( ! rs_gdbm_lock(rs->gdbm, rw, where) ) {
+	  rs->disklock = 0;
+	  return 0;
+     }
+     rs->disklock = 1;
+
+     if ( (file = rs->file) ) {
+	  pthread_mutex_lock(&rs_mem_mutex);
+	  gen = rs_gdbm_sidegen(rs_gdbmd_from_lld(rs->gdbm));
+	  if ( ! file->valid || file->gen != gen ) {
+	       rs_mem_flush(file);
+	       file->gen   = gen;
+	       file->valid = 1;
+	  }
+	  rs->gen = gen;
+	  pthread_mutex_unlock(&rs_mem_mutex);
+     }
+
+     return 1;
+}
+
+
+/*
+ * Private: make sure the GDBM file is locked before reading from it.
+ * A read lock granted from memory takes its disk lock now.
+ * Returns 1 if locked or 0 for failure.
+ */
+int    rs_mem_needdisk(RS_MEMD rs)
+{
+     if (rs->disklock)
+	  return 1;
+     if (rs->lock == RS_UNLOCK) {
+          elog_die(FATAL, "ringstore not locked");
+	  return 0;
+     }
+     return rs_mem_disklock(rs, RS_RDLOCK, rs->where ? rs->where :
+			    "rs_mem_needdisk");
+}
+
+
+/* Private: returns 1 if the cache may be used by this descriptor in
+ * its current lock. Call with rs_mem_mutex held */
+int    rs_mem_fresh(RS_MEMD rs)
+{
+     return rs->file && rs->file->valid && rs->file->gen == rs->gen;
+}
+
+
+/* Private: distrust the cache after a failed write, so it is emptied
+ * when next locked */
+void   rs_mem_invalidate(RS_MEMD rs)
+{
+     if ( ! rs->file )
+	  return;
+     pthread_mutex_lock(&rs_mem_mutex);
+     rs->file->valid = 0;
+     pthread_mutex_unlock(&rs_mem_mutex);
+}
+
+
+/* Private: empty the cache of a file. Call with rs_mem_mutex held */
+void   rs_mem_flush(struct rs_mem_file *file)
+{
+     struct rs_mem_ring *mr;
+
+     if (file->super)
+	  rs_free_superblock(file->super);
+     if (file->ringdir)
+	  nfree(file->ringdir);
+     if (file->headers) {
+	  itree_clearoutandfree(file->headers);
+	  itree_destroy(file->headers);
+     }
+     file->super   = NULL;
+     file->ringdir = NULL;
+     file->headers = NULL;
+
+     itree_traverse(file->rings) {
+	  mr = itree_get(file->rings);
+	  rs_mem_win_clear(mr);
+	  if (mr->win)
+	       nfree(mr->win);
+	  if (mr->idx)
+	       nfree(mr->idx);
+	  nfree(mr);
+     }
+     itree_clearout(file->rings, NULL);
+}
+
+
+/* Private: find the cache of a ring, creating an empty one if 'create'
+ * is set. Returns NULL if not found. Call with rs_mem_mutex held */
+struct rs_mem_ring *rs_mem_ring(struct rs_mem_file *file, int ringid,
+				int create)
+{
+     struct rs_mem_ring *mr;
+
+     mr = itree_find(file->rings, ringid);
+     if (mr != ITREE_NOVAL)
+	  return mr;
+     if ( ! create )
+	  return NULL;
+
+     mr = xnmalloc(sizeof(struct rs_mem_ring));
+     mr->loaded    = 0;
+     mr->idx       = NULL;
+     mr->idx_n     = 0;
+     mr->idx_alloc = 0;
+     mr->win       = NULL;
+     mr->win_alloc = 0;
+     mr->win_head  = 0;
+     mr->win_n     = 0;
+     mr->win_first = 0;
+     itree_add(file->rings, ringid, mr);
+
+     return mr;
+}
+
+
+/* Private: remove a ring from the cache. Call with rs_mem_mutex held */
+void   rs_mem_dropring(struct rs_mem_file *file, int ringid)
+{
+     struct rs_mem_ring *mr;
+
+     mr = itree_find(file->rings, ringid);
+     if (mr == ITREE_NOVAL)
+	  return;
+     rs_mem_win_clear(mr);
+     if (mr->win)
+	  nfree(mr->win);
+     if (mr->idx)
+	  nfree(mr->idx);
+     nfree(mr);
+     itree_rm(file->rings);
+}
+
+
+/*
+ * Private: make sure the whole index of a ring is cached, reading it
+ * from GDBM if not. This happens once for each ring, as appends and
+ * expiries keep it up to date afterwards.
+ * Returns 1 if the index is cached or 0 if it can't be.
+ */
+int    rs_mem_loadidx(RS_MEMD rs, int ringid)
+{
+     struct rs_mem_ring *mr;
+     RS_IDXENT ents;
+     int n, r=0;
+
+     if ( ! rs->file )
+	  return 0;
+     pthread_mutex_lock(&rs_mem_mutex);
+     mr = rs_mem_ring(rs->file, ringid, 0);
+     if (rs_mem_fresh(rs) && mr && mr->loaded)
+	  r = 1;
+     pthread_mutex_unlock(&rs_mem_mutex);
+     if (r)
+	  return 1;
+
+     if ( ! rs_mem_needdisk(rs) )
+	  return 0;
+     n = rs_gdbm_read_index_range(rs->gdbm, ringid, -1, -1, &ents);
+     if (n < 0)
+	  return 0;
+
+     pthread_mutex_lock(&rs_mem_mutex);
+     if (rs_mem_fresh(rs)) {
+	  mr = rs_mem_ring(rs->file, ringid, 1);
+	  if (mr->idx)
+	       nfree(mr->idx);
+	  mr->idx       = ents;
+	  mr->idx_n     = n;
+	  mr->idx_alloc = n;
+	  mr->loaded    = 1;
+	  ents = NULL;
+	  r = 1;
+	  /* the window must end at the youngest */
+	  if (mr->win_n && (n == 0 || mr->win_first + mr->win_n - 1 !=
+			    mr->idx[n-1].seq))
+	       rs_mem_win_clear(mr);
+     }
+     pthread_mutex_unlock(&rs_mem_mutex);
+     if (ents)
+	  nfree(ents);
+
+     return r;
+}
+
+
+/* Private: bisect the cached index for the first entry with a sequence
+ * equal to or greater than seq, returning idx_n if there is none */
+int    rs_mem_idx_byseq(struct rs_mem_ring *mr, int seq)
+{
+     int lo=0, hi=mr->idx_n, mid;
+
+     while (lo < hi) {
+	  mid = (lo + hi) / 2;
+	  if (mr->idx[mid].seq < seq)
+	       lo = mid + 1;
+	  else
+	       hi = mid;
+     }
+     return lo;
+}
+
+
+/* Private: return the sample held for seq or NULL if not held */
+struct rs_mem_sample *rs_mem_win_get(struct rs_mem_ring *mr, int seq)
+{
+     if (mr->win_n == 0 || seq < mr->win_first ||
+	 seq >= mr->win_first + mr->win_n)
+	  return NULL;
+     return &mr->win[(mr->win_head + seq - mr->win_first) % mr->win_alloc];
+}
+
+
+/*
+ * Private: hold a copy of a data block written as seq. Blocks follow on
+ * from the youngest held, replace one already held or, if there is a
+ * gap, start the window again.
+ */
+void   rs_mem_win_put(struct rs_mem_ring *mr, int seq, time_t time,
+		      unsigned long hd_hash, char *data, int datalen)
+{
+     struct rs_mem_sample *s;
+
+     if (rs_mem_nsamples == 0 && mr->win_alloc == 0)
+	  return;
+     if (mr->win_alloc == 0) {
+	  mr->win_alloc = rs_mem_nsamples;
+	  mr->win = xnmalloc(sizeof(struct rs_mem_sample) * mr->win_alloc);
+     }
+
+     if ( (s = rs_mem_win_get(mr, seq)) ) {
+	  nfree(s->data);			/* replace */
+     } else {
+	  if (mr->win_n && seq != mr->win_first + mr->win_n)
+	       rs_mem_win_clear(mr);		/* gap */
+	  if (mr->win_n == 0) {
+	       mr->win_head  = 0;
+	       mr->win_first = seq;
+	  } else if (mr->win_n == mr->win_alloc) {
+	       nfree(mr->win[mr->win_head].data);	/* full */
+	       mr->win_head = (mr->win_head + 1) % mr->win_alloc;
+	       mr->win_first++;
+	       mr->win_n--;
+	  }
+	  mr->win_n++;
+	  s = rs_mem_win_get(mr, seq);
+     }
+     s->time    = time;
+     s->hd_hash = hd_hash;
+     s->data    = xnmemdup(data, datalen+1);
+     s->data[datalen] = '\0';
+     s->datalen = datalen;
+}
+
+
+/* Private: hold a copy of the data block before the oldest held, which
+ * should be checked to be in sequence and there should be room */
+void   rs_mem_win_prepend(struct rs_mem_ring *mr, time_t time,
+			  unsigned long hd_hash, char *data, int datalen)
+{
+     struct rs_mem_sample *s;
+
+     mr->win_head = (mr->win_head + mr->win_alloc - 1) % mr->win_alloc;
+     mr->win_first--;
+     mr->win_n++;
+     s = &mr->win[mr->win_head];
+     s->time    = time;
+     s->hd_hash = hd_hash;
+     s->data    = xnmemdup(data, datalen+1);
+     s->data[datalen] = '\0';
+     s->datalen = datalen;
+}
+
+
+/* Private: drop the blocks held between from_seq and to_seq. Only the
+ * oldest can be removed from a window, so a gap empties it */
+void   rs_mem_win_expire(struct rs_mem_ring *mr, int from_seq, int to_seq)
+{
+     if (mr->win_n == 0 || to_seq < mr->win_first ||
+	 from_seq >= mr->win_first + mr->win_n)
+	  return;
+     if (from_seq > mr->win_first) {
+	  rs_mem_win_clear(mr);
+	  return;
+     }
+     while (mr->win_n && mr->win_first <= to_seq) {
+	  nfree(mr->win[mr->win_head].data);
+	  mr->win_head = (mr->win_head + 1) % mr->win_alloc;
+	  mr->win_first++;
+	  mr->win_n--;
+     }
+}
+
+
+/* Private: drop all the blocks held for a ring */
+void   rs_mem_win_clear(struct rs_mem_ring *mr)
+{
+     while (mr->win_n) {
+	  nfree(mr->win[mr->win_head].data);
+	  mr->win_head = (mr->win_head + 1) % mr->win_alloc;
+	  mr->win_n--;
+     }
+     mr->win_head = 0;
+}
+
+
+/*
+ * Private: add the blocks in dlist, read from disk, that lead up to
+ * the oldest block in the window while there is room. An empty window
+ * is only started from the youngest block in the cached index, so that
+ * the window always ends at the youngest.
+ */
+void   rs_mem_win_fill(struct rs_mem_ring *mr, ITREE *dlist)
+{
+     RS_DBLOCK d;
+     int next;
+
+     if (mr->win_n)
+	  next = mr->win_first - 1;
+     else if (mr->loaded && mr->idx_n)
+	  next = mr->idx[mr->idx_n-1].seq;
+     else
+	  return;
+     if (mr->win_alloc == 0) {
+	  if (rs_mem_nsamples == 0)
+	       return;
+	  mr->win_alloc = rs_mem_nsamples;
+	  mr->win = xnmalloc(sizeof(struct rs_mem_sample) * mr->win_alloc);
+     }
+     if (mr->win_n == 0) {
+	  mr->win_head  = 0;
+	  mr->win_first = next + 1;
+     }
+
+     itree_last(dlist);
+     while ( ! itree_isbeyondend(dlist) && mr->win_n < mr->win_alloc) {
+	  if (itree_getkey(dlist) < next)
+	       break;
+	  if (itree_getkey(dlist) == next) {
+	       d = itree_get(dlist);
+	       rs_mem_win_prepend(mr, d->time, d->hd_hashkey, d->data,
+				  d->datalen >= 0 ? d->datalen :
+				  strlen(d->data));
+	       next--;
+	  }
+	  itree_prev(dlist);
+     }
+}
+
+
+
+#if TEST
+
+#include "route.h"
+#include "rt_std.h"
+
+#define RSFILE1  "t.rs_mem.1.rs"
+#define RSRING1  "ring1"
+#define RSTEXT1  "tom\tdick\tharry\n--\n1\t2\t3\n"
+#define RSTEXT2  "tom\tdick\tharry\n--\n4\t5\t6\n"
+
+int main() {
+     RS rs1, rs2;
+     TABLE tab1;
+     ITREE *dl;
+     RS_DBLOCK d;
+     RS_MEMD md;
+     char *buf1;
+     int i, r;
+
+     route_init(NULL, 0);
+     route_register(&rt_stdin_method);
+     route_register(&rt_stdout_method);
+     route_register(&rt_stderr_method);
+     elog_init(0, "rs_mem test", NULL);
+     rs_init();
+
+     /* clear up before we start */
+     unlink(RSFILE1);
+     unlink(RSFILE1 RS_GDBM_LOCKSUFFIX);
+     rs_mem_setwindow(3);
+
+     /* test 1: create and write 5 samples into a ring of 4 slots */
+     rs1 = rs_open(&rs_mem_method, RSFILE1, 0644, RSRING1, "ring one",
+		   "memrs test ring", 4, 0, RS_CREATE|RS_PERSIST);
+     if ( ! rs1 )
+	  elog_die(FATAL, "[1] can't create ringstore");
+     for (i=0; i<5; i++) {
+	  tab1 = table_create();
+	  buf1 = xnstrdup(i%2 ? RSTEXT2 : RSTEXT1);
+	  table_scan(tab1, buf1, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES,
+		     TABLE_HASRULER);
+	  table_freeondestroy(tab1, buf1);
+	  if ( ! rs_put(rs1, tab1) )
+	       elog_die(FATAL, "[1] unable to put sample %d", i);
+	  table_destroy(tab1);
+     }
+
+     /* test 2: the recent window is read without locking the file */
+     md = rs_memd_from_lld(rs1->handle);
+     if ( ! rs_mem_lock(md, RS_RDLOCK, "test 2") )
+	  elog_die(FATAL, "[2] unable to lock");
+     dl = rs_mem_read_dblock(md, rs1->ringid, 2, 3);
+     if (md->disklock)
+	  elog_die(FATAL, "[2] recent window read from disk");
+     if (itree_n(dl) != 3)
+	  elog_die(FATAL, "[2] %d blocks read, not 3", itree_n(dl));
+     itree_first(dl);
+     d = itree_get(dl);
+     if (itree_getkey(dl) != 2 || strcmp(d->data, "1\t2\t3\n") != 0)
+	  elog_die(FATAL, "[2] bad block %d: %s", itree_getkey(dl), d->data);
+     rs_free_dblock(dl);
+
+     /* test 3: older blocks come from disk, expired ones are not there */
+     dl = rs_mem_read_dblock(md, rs1->ringid, 0, 5);
+     if ( ! md->disklock )
+	  elog_die(FATAL, "[3] old block not read from disk");
+     if (itree_n(dl) != 4)
+	  elog_die(FATAL, "[3] %d blocks read, not 4", itree_n(dl));
+     rs_free_dblock(dl);
+     rs_mem_unlock(md);
+
+     /* test 4: whole table reads from memory */
+     tab1 = rs_mget_range(rs1, -1, -1, -1, -1);
+     if ( ! tab1 || table_nrows(tab1) != 4)
+	  elog_die(FATAL, "[4] range has %d rows not 4",
+		   tab1 ? table_nrows(tab1) : -1);
+     table_destroy(tab1);
+
+     /* test 5: a write by another process (here, a plain GDBM
+      * descriptor) is seen */
+     rs2 = rs_open(&rs_gdbm_method, RSFILE1, 0644, RSRING1, "ring one",
+		   "memrs test ring", 4, 0, 0);
+     if ( ! rs2 )
+	  elog_die(FATAL, "[5] can't open ringstore with GDBM");
+     tab1 = table_create();
+     buf1 = xnstrdup(RSTEXT2);
+     table_scan(tab1, buf1, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES,
+		TABLE_HASRULER);
+     table_freeondestroy(tab1, buf1);
+     r = rs_put(rs2, tab1);
+     table_destroy(tab1);
+     rs_close(rs2);
+     if ( ! r )
+	  elog_die(FATAL, "[5] unable to put with GDBM");
+     tab1 = rs_mget_range(rs1, 5, 5, -1, -1);
+     if ( ! tab1 || table_nrows(tab1) != 1)
+	  elog_die(FATAL, "[5] other process's sample not read");
+     table_first(tab1);
+     if (strcmp(table_getcurrentcell(tab1, "tom"), "4") != 0)
+	  elog_die(FATAL, "[5] bad data from other process");
+     table_destroy(tab1);
+
+     rs_close(rs1);
+     rs_mem_fini();
+     rs_fini();
+     elog_fini();
+     route_fini();
+
+     printf("tests finished successfully\n");
+     exit(0);
+}
+
+#endif /* TEST */
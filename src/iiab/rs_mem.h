@@ -0,0 +1,122 @@
+/*
+ * Ringstore low level storage using an abstracted interface
+ * In-memory implementation (memrs), holding the recent window of each
+ * ring in process memory and writing through to GDBM
+ *
+ * Copyright System Garden Limited. All rights reserved.
+ */
+#ifndef _RS_MEM_H_
+#define _RS_MEM_H_
+
+#include <time.h>
+#include "tree.h"
+#include "itree.h"
+#include "rs.h"
+
+/* a data block held in memory */
+struct rs_mem_sample {
+     time_t time;		/* sample time */
+     unsigned long hd_hash;	/* header hash */
+     char *data;		/* nmalloc()ed copy of the data text */
+     int   datalen;		/* length of data, excluding \0 */
+};
+
+/* the cached index and recent data blocks of a ring */
+struct rs_mem_ring {
+     int   loaded;		/* 1 if idx holds the whole index */
+     RS_IDXENT idx;		/* index entries, oldest first */
+     int   idx_n;		/* number of entries in idx */
+     int   idx_alloc;		/* number of entries allocated in idx */
+     struct rs_mem_sample *win;	/* circular buffer of recent samples */
+     int   win_alloc;		/* slots in win */
+     int   win_head;		/* slot holding win_first */
+     int   win_n;		/* number of samples held */
+     int   win_first;		/* sequence of the oldest sample held */
+};
+
+/* cached state of a ringstore file, shared by all its descriptors */
+struct rs_mem_file {
+     char *name;		/* file name, key in rs_mem_files */
+     int   nref;		/* number of descriptors open on the file */
+     int   valid;		/* 1 if the cache is in step with gen */
+     unsigned long gen;		/* sidecar write generation of the cache */
+     RS_SUPER super;		/* superblock or NULL if not cached */
+     char *ringdir;		/* ring directory text or NULL */
+     ITREE *headers;		/* header dictionary or NULL */
+     ITREE *rings;		/* struct rs_mem_ring indexed by ring id */
+};
+
+struct rs_mem_desc {
+     enum rs_lld_type lld_type;	/* low level descriptor type (run time
+				 * checking) */
+     RS_LLD gdbm;		/* GDBM descriptor written through to */
+     struct rs_mem_file *file;	/* cached state or NULL if uncacheable */
+     int   lock;		/* lock given to caller: 0=none, 1=read,
+				 * 2=write as enum rs_db_lock */
+     int   disklock;		/* 1 if the GDBM descriptor is locked */
+     unsigned long gen;		/* generation when locked */
+     char *where;		/* caller of the lock, for late disk locks */
+};
+typedef struct rs_mem_desc * RS_MEMD;
+
+extern const struct rs_lowlevel rs_mem_method;
+
+#define RS_MEM_NSAMPLES	60	/* default data blocks held for each ring */
+
+/* functional prototypes */
+void   rs_mem_init         ();
+void   rs_mem_fini         ();
+void   rs_mem_setwindow    (int nsamples);
+RS_LLD rs_mem_open         (char *filename, mode_t perm, int create);
+void   rs_mem_close        (RS_LLD);
+int    rs_mem_exists       (char *filename, enum rs_db_writable todo);
+int    rs_mem_lock         (RS_LLD, enum rs_db_lock rw, char *where);
+void   rs_mem_unlock       (RS_LLD);
+RS_SUPER rs_mem_read_super (RS_LLD);
+int    rs_mem_write_super  (RS_LLD, RS_SUPER);
+TABLE  rs_mem_read_rings   (RS_LLD);
+int    rs_mem_write_rings  (RS_LLD, TABLE rings);
+ITREE *rs_mem_read_headers (RS_LLD);
+int    rs_mem_write_headers(RS_LLD, ITREE *headers);
+TABLE  rs_mem_read_index   (RS_LLD, int ringid);
+int    rs_mem_write_index  (RS_LLD, int ringid, TABLE index);
+int    rs_mem_rm_index     (RS_LLD, int ringid);
+int    rs_mem_index_ends   (RS_LLD, int ringid, RS_IDXENT oldest,
+			    RS_IDXENT youngest);
+int    rs_mem_read_index_range(RS_LLD, int ringid, int from_seq, int to_seq,
+			       RS_IDXENT *entries);
+int    rs_mem_append_index (RS_LLD, int ringid, int start_seq, ITREE *dblock);
+int    rs_mem_expire_index (RS_LLD, int ringid, int to_seq);
+int    rs_mem_append_dblock(RS_LLD, int ringid, int start_seq, ITREE *dblock);
+ITREE *rs_mem_read_dblock  (RS_LLD, int ringid, int start_seq, int nblocks);
+int    rs_mem_expire_dblock(RS_LLD, int ringid, int from_seq, int to_seq);
+TREE  *rs_mem_read_substr  (RS_LLD, char *substr_key);
+char  *rs_mem_read_value   (RS_LLD, char *key, int *length);
+int    rs_mem_write_value  (RS_LLD, char *key, char *value, int length);
+int    rs_mem_checkpoint   (RS_LLD);
+int    rs_mem_footprint    (RS_LLD);
+int    rs_mem_dumpdb       (RS_LLD);
+void   rs_mem_errstat      (RS_LLD, int *errnum, char **errstr);
+
+/* private functions */
+RS_MEMD rs_memd_from_lld(RS_LLD lld);
+int    rs_mem_disklock(RS_MEMD rs, enum rs_db_lock rw, char *where);
+int    rs_mem_needdisk(RS_MEMD rs);
+int    rs_mem_fresh(RS_MEMD rs);
+void   rs_mem_invalidate(RS_MEMD rs);
+void   rs_mem_flush(struct rs_mem_file *file);
+struct rs_mem_ring *rs_mem_ring(struct rs_mem_file *file, int ringid,
+				int create);
+void   rs_mem_dropring(struct rs_mem_file *file, int ringid);
+int    rs_mem_loadidx(RS_MEMD rs, int ringid);
+int    rs_mem_idx_byseq(struct rs_mem_ring *mr, int seq);
+struct rs_mem_sample *rs_mem_win_get(struct rs_mem_ring *mr, int seq);
+void   rs_mem_win_put(struct rs_mem_ring *mr, int seq, time_t time,
+		      unsigned long hd_hash, char *data, int datalen);
+void   rs_mem_win_prepend(struct rs_mem_ring *mr, time_t time,
+			  unsigned long hd_hash, char *data, int datalen);
+void   rs_mem_win_expire(struct rs_mem_ring *mr, int from_seq, int to_seq);
+void   rs_mem_win_clear(struct rs_mem_ring *mr);
+void   rs_mem_win_fill(struct rs_mem_ring *mr, ITREE *dlist);
+
+#endif /* _RS_MEM_H_ */
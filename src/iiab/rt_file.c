@@ -27,7 +27,8 @@ const struct route_lowlevel rt_filea_method = {
      rt_file_init,       rt_file_fini,       rt_file_access,
      rt_filea_open,      rt_file_close,      rt_file_write,
      rt_file_twrite,     rt_file_tell,       rt_file_read,
-     rt_file_tread,      rt_file_status,     rt_file_checkpoint
+     rt_file_tread,      rt_file_status,     rt_file_checkpoint,
+     rt_file_writev
 };
 
 const struct route_lowlevel rt_fileov_method = {
@@ -35,7 +36,8 @@ const struct route_lowlevel rt_fileov_method = {
      rt_file_init,       rt_file_fini,       rt_file_access,
      rt_fileov_open,     rt_file_close,      rt_file_write,
      rt_file_twrite,     rt_file_tell,       rt_file_read,
-     rt_file_tread,      rt_file_status,     rt_file_checkpoint
+     rt_file_tread,      rt_file_status,     rt_file_checkpoint,
+     rt_file_writev
 };
 
 char *rt_file_tabschema[] = {"data", "_time", NULL};
@@ -124,6 +126,7 @@ RT_LLD rt_filea_open (char *p_url, char *comment, char *password, int keep,
      rt->fd = fd;
      rt->p_url = p_url;
      rt->filepath = basename;
+     rt->out.buf = NULL;
 
      return rt;
 }
@@ -182,6 +185,7 @@ RT_LLD rt_fileov_open (char *p_url, char *comment, char *password, int keep,
      rt->fd = fd;
      rt->p_url = p_url;
      rt->filepath = basename;
+     rt->out.buf = NULL;
 
      return rt;
 }
@@ -193,6 +197,8 @@ void   rt_file_close (RT_LLD lld)
      rt = rt_file_from_lld(lld);
 
      close(rt->fd);
+     if (rt->out.buf)
+	  table_outbuf_free(&rt->out);
      rt->magic = 0;	/* don't use again */
      nfree(rt);
 }
@@ -211,20 +217,40 @@ int    rt_file_write (RT_LLD lld, const void *buf, int buflen)
      return n;
 }
 
+/* write a vector of buffers in a single system call */
+int    rt_file_writev (RT_LLD lld, const struct iovec *iov, int iovcnt)
+{
+     int n;
+     RT_FILED rt;
+
+     rt = rt_file_from_lld(lld);
+
+     n = writev(rt->fd, iov, iovcnt);
+     if (n == -1)
+	  elog_printf(ERROR, "writev() system call returns -1: %s",
+		      strerror(errno));
+     return n;
+}
+
 int    rt_file_twrite (RT_LLD lld, TABLE tab)
 {
      RT_FILED rt;
-     char *buf;
      int n;
 
      rt = rt_file_from_lld(lld);
 
-     buf = table_outtable(tab);
-     if ( ! buf)
+     /* serialise into the route's buffer, which is kept between writes */
+     if (rt->out.buf)
+	  table_outbuf_reset(&rt->out);
+     else
+	  table_outbuf_init(&rt->out, 0);
+     if ( ! tab || ! table_outtable_buf(tab, &rt->out, 
+					table_getseparator(tab),
+					TABLE_WITHCOLNAMES, TABLE_WITHINFO) )
        return 1;	/* empty table, successfully don't writing anything */
 
-     n = write(rt->fd, buf, strlen(buf));
-     nfree(buf);
+     n = write(rt->fd, table_outbuf_text(&rt->out), 
+	       table_outbuf_len(&rt->out));
      if (n == -1) {
 	  elog_printf(ERROR, "write() system call returns -1: %s",
 		      strerror(errno));
@@ -432,6 +458,9 @@ int main(int argc, char **argv) {
      time_t time1;
      ITREE *chain;
      ROUTE_BUF *rtbuf;
+     ROUTE rt;
+     char *text;
+     int i, len;
 
      cf = cf_create();
      rt_file_init(cf, 1);
@@ -614,6 +643,38 @@ int main(int argc, char **argv) {
 	  elog_die(FATAL, "[8] bad kama! size is set to %d", size1);
      rt_file_close(lld1);
 
+     /* test 9: buffered route writes spanning many chunks, flushed 
+      * with writev() */
+     route_init(cf, 0);
+     route_register(&rt_fileov_method);
+     rt = route_open("fileov:" TFILE1, "blah", NULL, 10);
+     if (!rt)
+	  elog_die(FATAL, "[9] can't open route to %s", TFILE1);
+     for (i=0; i < 100000; i++)
+	  route_printf(rt, "line %d\n", i);
+     text = route_buffer(rt, &len);
+     if (!text || len != 1088890 || strncmp(text, "line 0\nline 1\n", 14))
+	  elog_die(FATAL, "[9] coalesced buffer is wrong: len %d", len);
+     route_killbuffer(rt, 1);
+     for (i=0; i < 100000; i++)
+	  route_printf(rt, "line %d\n", i);
+     route_close(rt);
+     lld1 = rt_filea_open(TURL1, "blah", NULL, 10, TFILE1);
+     if (!lld1)
+	  elog_die(FATAL, "[9] can't open file %s", TFILE1);
+     r = rt_file_tell(lld1, &seq1, &size1, &time1);
+     if (!r || size1 != 1088890)
+	  elog_die(FATAL, "[9] file size is %d not 1088890", size1);
+     chain = rt_file_read(lld1, 0, 0);
+     itree_first(chain);
+     rtbuf = itree_get(chain);
+     if (strncmp(rtbuf->buffer + 1088890 - 11, "line 99999\n", 11))
+	  elog_die(FATAL, "[9] file ends with %s", 
+		   rtbuf->buffer + 1088890 - 11);
+     route_free_routebuf(chain);
+     rt_file_close(lld1);
+     route_fini();
+
      cf_destroy(cf);
      rt_file_fini();
      return 0;
@@ -23,6 +23,8 @@ typedef struct rt_file_desc {
      int fd;
      char *p_url;
      char *filepath;
+     struct table_outbuf out;	/* reused to write tables, buf is NULL 
+				 * until the first write */
 } * RT_FILED;
 
 extern const struct route_lowlevel rt_filea_method;
@@ -50,5 +52,6 @@ ITREE *rt_file_read  (RT_LLD lld, int seq, int offset);
 TABLE  rt_file_tread (RT_LLD lld, int seq, int offset);
 void   rt_file_status(RT_LLD lld, char **status, char **info);
 int    rt_file_checkpoint(RT_LLD lld);
+int    rt_file_writev(RT_LLD lld, const struct iovec *iov, int iovcnt);
 
 #endif /* _RT_FILE_H_ */
@@ -0,0 +1,329 @@
+/*
+ * Route driver that holds output in memory, to be replayed to another
+ * route later
+ *
+ * Text and tables written to a mem: route are kept in order as separate
+ * records and copied, in the same order, to a real route by
+ * rt_mem_replay(). This lets work that can't use a route directly, such
+ * as a method running in a thread, produce output that is written later
+ * by the owner of the real route. The location part of the p-url is
+ * only descriptive.
+ *
+ * Copyright System Garden Ltd 2004. All rights reserved
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "nmalloc.h"
+#include "cf.h"
+#include "elog.h"
+#include "util.h"
+#include "rt_mem.h"
+
+/* private functional prototypes */
+RT_MEMD rt_mem_from_lld(RT_LLD lld);
+void    rt_mem_priv_add(RT_MEMD rt, struct rt_mem_rec *rec);
+
+const struct route_lowlevel rt_mem_method = {
+     rt_mem_magic,     rt_mem_prefix,    rt_mem_description,
+     rt_mem_init,      rt_mem_fini,      rt_mem_access,
+     rt_mem_open,      rt_mem_close,     rt_mem_write,
+     rt_mem_twrite,    rt_mem_tell,      rt_mem_read,
+     rt_mem_tread,     rt_mem_status,    rt_mem_checkpoint
+};
+
+int    rt_mem_magic() { return RT_MEM_LLD_MAGIC; }
+char * rt_mem_prefix() { return "mem"; }
+char * rt_mem_description() { return "memory held for replay"; }
+void   rt_mem_init  (CF_VALS cf, int debug) {}
+void   rt_mem_fini  () {}
+
+/* Check accessability of memory. Always 1 (success) */
+int    rt_mem_access(char *p_url, char *password, char *basename, int flag)
+{
+     return 1;
+}
+
+/* open an empty memory route */
+RT_LLD rt_mem_open (char *p_url, char *comment, char *password, int keep,
+		    char *basename)
+{
+     RT_MEMD rt;
+
+     rt = xnmalloc(sizeof(struct rt_mem_desc));
+     rt->magic = rt_mem_magic();
+     rt->prefix = rt_mem_prefix();
+     rt->description = rt_mem_description();
+     rt->p_url = p_url;
+     rt->first = rt->last = NULL;
+     rt->nrecs = 0;
+     rt->size = 0;
+     rt->modt = 0;
+
+     return rt;
+}
+
+/* close the route, discarding anything that has not been replayed */
+void   rt_mem_close (RT_LLD lld)
+{
+     RT_MEMD rt;
+
+     rt = rt_mem_from_lld(lld);
+
+     rt_mem_clear(rt);
+     rt->magic = 0;	/* don't use again */
+     nfree(rt);
+}
+
+/* hold a copy of the text as a record, returning the number of characters
+ * held */
+int    rt_mem_write (RT_LLD lld, const void *buf, int buflen)
+{
+     RT_MEMD rt;
+     struct rt_mem_rec *rec;
+
+     rt = rt_mem_from_lld(lld);
+
+     rec = xnmalloc(sizeof(struct rt_mem_rec));
+     rec->text = xnmalloc(buflen+1);
+     memcpy(rec->text, buf, buflen);
+     rec->text[buflen] = '\0';
+     rec->len = buflen;
+     rec->tab = NULL;
+     rt_mem_priv_add(rt, rec);
+     rt->size += buflen;
+
+     return buflen;
+}
+
+/* hold an independent copy of the table as a record.
+ * Returns 1 for success or 0 for failure */
+int    rt_mem_twrite (RT_LLD lld, TABLE tab)
+{
+     RT_MEMD rt;
+     struct rt_mem_rec *rec;
+     TABLE copy;
+
+     rt = rt_mem_from_lld(lld);
+
+     copy = table_create_fromdonor(tab);
+     if (table_nrows(tab) > 0 && table_addtable(copy, tab, 0) == -1) {
+	  table_destroy(copy);
+	  return 0;
+     }
+
+     rec = xnmalloc(sizeof(struct rt_mem_rec));
+     rec->text = NULL;
+     rec->len = 0;
+     rec->tab = copy;
+     rt_mem_priv_add(rt, rec);
+
+     return 1;
+}
+
+/* Returns the number of records as the sequence (-1 if there are none),
+ * the characters of text held as size and the time of the last write.
+ * Returns 1 for success */
+int    rt_mem_tell  (RT_LLD lld, int *seq, int *size, time_t *modt)
+{
+     RT_MEMD rt;
+
+     rt = rt_mem_from_lld(lld);
+
+     *seq  = rt->nrecs - 1;
+     *size = rt->size;
+     *modt = rt->modt;
+
+     return 1;
+}
+
+/* memory routes are only read by replaying them */
+ITREE *rt_mem_read  (RT_LLD lld, int seq, int offset) { return NULL; }
+TABLE  rt_mem_tread (RT_LLD lld, int seq, int offset) { return NULL; }
+
+/*
+ * Return the status of an open memory route.
+ * Free the data from status and info with nfree() if non NULL.
+ */
+void   rt_mem_status(RT_LLD lld, char **status, char **info) {
+     RT_MEMD rt;
+
+     rt = rt_mem_from_lld(lld);
+
+     if (status)
+          *status = util_strjoin("holding ", util_i32toa(rt->nrecs),
+				 " records", NULL);
+     if (info)
+          *info = NULL;
+}
+
+/* nothing to checkpoint */
+int    rt_mem_checkpoint (RT_LLD lld) { return 1; }
+
+
+/*
+ * Copy the records held by the memory route to the route dest, in the
+ * order they were written, then discard them. Text is written with
+ * route_write() and tables with route_twrite(); dest is flushed at the
+ * end.
+ * Returns the number of records replayed or -1 if any could not be
+ * written, in which case all records are still discarded.
+ */
+int    rt_mem_replay(ROUTE held,	/* open memory route */
+		     ROUTE dest		/* destination for records */)
+{
+     RT_MEMD rt;
+     struct rt_mem_rec *rec;
+     int n=0, ret=0;
+
+     route_flush(held);
+     rt = rt_mem_from_lld(held->handle);
+
+     for (rec = rt->first; rec; rec = rec->next) {
+	  if (rec->tab) {
+	       if ( ! route_twrite(dest, rec->tab) )
+		    ret = -1;
+	  } else {
+	       if (route_write(dest, rec->text, rec->len) != rec->len)
+		    ret = -1;
+	  }
+	  n++;
+     }
+     if ( ! route_flush(dest) )
+	  ret = -1;
+     rt_mem_clear(rt);
+
+     return ret == -1 ? -1 : n;
+}
+
+
+/* Discard the records held by the memory route */
+void   rt_mem_clear(RT_MEMD rt)
+{
+     struct rt_mem_rec *rec, *next;
+
+     for (rec = rt->first; rec; rec = next) {
+	  next = rec->next;
+	  if (rec->tab)
+	       table_destroy(rec->tab);
+	  if (rec->text)
+	       nfree(rec->text);
+	  nfree(rec);
+     }
+     rt->first = rt->last = NULL;
+     rt->nrecs = 0;
+     rt->size = 0;
+}
+
+
+/* --------------- Private routines ----------------- */
+
+
+/* append a record to the memory route */
+void   rt_mem_priv_add(RT_MEMD rt, struct rt_mem_rec *rec)
+{
+     rec->next = NULL;
+     if (rt->last)
+	  rt->last->next = rec;
+     else
+	  rt->first = rec;
+     rt->last = rec;
+     rt->nrecs++;
+     rt->modt = time(NULL);
+}
+
+
+RT_MEMD rt_mem_from_lld(RT_LLD lld	/* typeless low level data */)
+{
+     if (!lld)
+	  elog_die(FATAL, "passed NULL low level descriptor");
+     if (((RT_MEMD)lld)->magic != RT_MEM_LLD_MAGIC) {
+          if (((RT_MEMD)lld)->magic == 0)
+	       elog_printf(FATAL, "magic type of 0 encountered, possibly "
+			   "previously deleted\n");
+	  elog_die(FATAL, "magic type mismatch: we were given "
+		   "%s (%s [magic %d]) but can only handle %s (%s)",
+		   ((RT_MEMD)lld)->prefix,
+		   ((RT_MEMD)lld)->description,
+		   ((RT_MEMD)lld)->magic,
+		   rt_mem_prefix(), rt_mem_description());
+     }
+
+     return (RT_MEMD) lld;
+}
+
+
+
+#if TEST
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "rt_file.h"
+#define TFILE1 "t.rt_mem.dat"
+
+int main(int argc, char **argv) {
+     int r, seq, size;
+     time_t modt;
+     CF_VALS cf;
+     ROUTE held, dest;
+     TABLE tab;
+     char *data, *cols[] = {"a", "b", NULL};
+
+     cf = cf_create();
+     route_init(cf, 0);
+     route_register(&rt_mem_method);
+     route_register(&rt_fileov_method);
+     unlink(TFILE1);
+
+     /* test 1: open and write text and a table */
+     held = route_open("mem:test", NULL, NULL, 0);
+     if ( ! held )
+	  elog_die(FATAL, "[1] unable to open mem route");
+     route_printf(held, "tom, dick ");
+     route_printf(held, "and harry\n");
+     tab = table_create_a(cols);
+     table_addemptyrow(tab);
+     table_replacecurrentcell_alloc(tab, "a", "1");
+     table_replacecurrentcell_alloc(tab, "b", "2");
+     if ( ! route_twrite(held, tab) )
+	  elog_die(FATAL, "[1] unable to write table");
+     table_destroy(tab);		/* held copy must be independent */
+     route_printf(held, "the end\n");
+     route_flush(held);
+     r = route_tell(held, &seq, &size, &modt);
+     if ( ! r || seq != 2 || size != 28 || modt == 0)
+	  elog_die(FATAL, "[1] tell is wrong: r %d seq %d size %d",
+		   r, seq, size);
+
+     /* test 2: replay in order to a file */
+     dest = route_open("fileov:" TFILE1, "test", NULL, 10);
+     if ( ! dest )
+	  elog_die(FATAL, "[2] unable to open %s", TFILE1);
+     r = rt_mem_replay(held, dest);
+     if (r != 3)
+	  elog_die(FATAL, "[2] replayed %d records not 3", r);
+     route_close(dest);
+     data = route_read("fileov:" TFILE1, NULL, &size);
+     if ( ! data || strcmp(data, "tom, dick and harry\n"
+			   "a\tb\n--\n1\t2\nthe end\n") )
+	  elog_die(FATAL, "[2] file is wrong: %s", data);
+     nfree(data);
+
+     /* test 3: held records have gone */
+     r = route_tell(held, &seq, &size, &modt);
+     if ( ! r || seq != -1 || size != 0)
+	  elog_die(FATAL, "[3] records remain: seq %d size %d", seq, size);
+
+     /* test 4: unreplayed records are freed on close */
+     route_printf(held, "never sent\n");
+     route_close(held);
+
+     route_fini();
+     cf_destroy(cf);
+     unlink(TFILE1);
+     printf("%s: tests finished successfully\n", argv[0]);
+     exit(0);
+}
+
+#endif /* TEST */
@@ -0,0 +1,60 @@
+/*
+ * Route driver that holds output in memory, to be replayed to another
+ * route later
+ *
+ * Copyright System Garden Ltd 2004. All rights reserved
+ */
+
+#ifndef _RT_MEM_H_
+#define _RT_MEM_H_
+
+#include <time.h>
+#include "cf.h"
+#include "route.h"
+#include "table.h"
+
+/* General definitions */
+#define RT_MEM_LLD_MAGIC  5571203
+
+/* a single write: either text or a table */
+struct rt_mem_rec {
+     struct rt_mem_rec *next;	/* next record or NULL */
+     char *text;		/* text written or NULL if a table */
+     int len;			/* length of text */
+     TABLE tab;			/* copy of table written or NULL if text */
+};
+
+typedef struct rt_mem_desc {
+     int magic;
+     char *prefix;
+     char *description;
+     char *p_url;
+     struct rt_mem_rec *first;	/* oldest record held or NULL */
+     struct rt_mem_rec *last;	/* most recent record held */
+     int nrecs;			/* number of records */
+     int size;			/* characters of text held */
+     time_t modt;		/* time of last write */
+} * RT_MEMD;
+
+extern const struct route_lowlevel rt_mem_method;
+
+int    rt_mem_magic();
+char * rt_mem_prefix();
+char * rt_mem_description();
+void   rt_mem_init   (CF_VALS cf, int debug);
+void   rt_mem_fini   ();
+int    rt_mem_access (char *p_url, char *password, char *basename, int flag);
+RT_LLD rt_mem_open   (char *p_url, char *comment, char *password, int keep,
+		      char *basename);
+void   rt_mem_close  (RT_LLD lld);
+int    rt_mem_write  (RT_LLD lld, const void *buf, int buflen);
+int    rt_mem_twrite (RT_LLD lld, TABLE tab);
+int    rt_mem_tell   (RT_LLD lld, int *seq, int *size, time_t *modt);
+ITREE *rt_mem_read   (RT_LLD lld, int seq, int offset);
+TABLE  rt_mem_tread  (RT_LLD lld, int seq, int offset);
+void   rt_mem_status (RT_LLD lld, char **status, char **info);
+int    rt_mem_checkpoint(RT_LLD lld);
+int    rt_mem_replay (ROUTE held, ROUTE dest);
+void   rt_mem_clear  (RT_MEMD rt);
+
+#endif /* _RT_MEM_H_ */
@@ -16,13 +16,20 @@
 #include "table.h"
 #include "tableset.h"
 #include "util.h"
+#include "callback.h"
+#include "itree.h"
+#include "runq.h"
 #include "rs_gdbm.h"
+#include "rs_mem.h"
 /*#include "rs_berk.h"*/
 #include "rs.h"
 #include "rt_rs.h"
 
 /* private functional prototypes */
 RT_RSD rt_rs_from_lld(RT_LLD lld);
+void   rt_rs_tickstart();
+void   rt_rs_tickend();
+void   rt_rs_commitall();
 
 const struct route_lowlevel rt_grs_method = {
      rt_grs_magic,   rt_grs_prefix,   rt_grs_description,
@@ -45,9 +52,37 @@ const struct route_lowlevel rt_brs_method = {
 char *rt_rs_schema[] = {"_time", "_seq", "text", NULL};
 
 int rt_rs_debug=0;
-
-void   rt_rs_init  (CF_VALS cf, int debug) {rt_rs_debug=debug;}
-void   rt_rs_fini  () {}
+int rt_rs_coalesce=0;		/* hold writes until the end of dispatch */
+ITREE *rt_rs_pending=NULL;	/* held writes: struct rt_rs_pendwrite */
+RS_METHOD rt_rs_method=&rs_gdbm_method; /* ringstore used by grs: routes */
+
+/* Writes made while the run queue is dispatching are held back and 
+ * written together at the end with rs_put_batch(), so that jobs scheduled
+ * for the same second and writing to the same ringstore file share a 
+ * single write lock, taken only for the time of the writes */
+void   rt_rs_init  (CF_VALS cf, int debug) {
+     rt_rs_debug=debug;
+     callback_init();
+     callback_regcb(RUNQ_CB_DISPATCH_START, (void *) rt_rs_tickstart);
+     callback_regcb(RUNQ_CB_DISPATCH_END,   (void *) rt_rs_tickend);
+     callback_mkevent(RT_RS_CB_WRITE);
+}
+void   rt_rs_fini  () {rt_rs_commitall();}
+
+/* Hold the most recent nsamples of each ring opened by grs: routes in 
+ * memory [rs_mem_method], writing through to the GDBM file, so that the
+ * recent window can be read without going to disk. It is only worth
+ * doing in long running processes and should be called before any 
+ * routes are opened. 0 or less goes back to plain GDBM */
+void   rt_rs_usemem(int nsamples)
+{
+     if (nsamples > 0) {
+	  rs_mem_setwindow(nsamples);
+	  rt_rs_method = &rs_mem_method;
+     } else {
+	  rt_rs_method = &rs_gdbm_method;
+     }
+}
 
 int    rt_grs_magic()       { return RT_RS_GDBM_LLD_MAGIC; }
 char * rt_grs_prefix()      { return RT_RS_GDBM_PREFIX; }
@@ -67,6 +102,7 @@ int    rt_grs_access(char *p_url, char *password, char *basename, int flag)
 
      if (!basename)
 	  return 0;
+     rt_rs_commitall();
 
      /* basename will be of the form: file,ring,dur,attr
       * we dont want the attribute */
@@ -81,7 +117,7 @@ int    rt_grs_access(char *p_url, char *password, char *basename, int flag)
 	  return 0;
      }
 
-     id = rs_open(&rs_gdbm_method, file, 0644, ring, "don't create", 
+     id = rs_open(rt_rs_method, file, 0644, ring, "don't create", 
 		  "don't create", 0, strtol(dur, NULL, 10), 0);
 
      if (id) {
@@ -206,13 +242,14 @@ RT_LLD rt_grs_open (char *p_url, char *comment, char *password, int keep,
           cons++;
 
      if (meta == rt_rs_none && !cons) {
-          id = rs_open(&rs_gdbm_method, file, 0644, ring, "dont create",
-		       "dont create", 0, strtol(dur, NULL, 10), 0);
+          /* routes are long lived, so keep the ringstore open */
+          id = rs_open(rt_rs_method, file, 0644, ring, "dont create",
+		       "dont create", 0, strtol(dur, NULL, 10), RS_PERSIST);
 	  if ( !id ) {
 	       if (keep)
-		    id = rs_open(&rs_gdbm_method, file, 0644, ring, ring,
+		    id = rs_open(rt_rs_method, file, 0644, ring, ring,
 				 comment, keep, strtol(dur, NULL, 10),
-				 RS_CREATE);
+				 RS_CREATE|RS_PERSIST);
 	       if ( ! id ) {
 		    /* well... we tried */
 		    elog_printf(DEBUG, "Unable to open %sringstore "
@@ -391,8 +428,10 @@ void   rt_rs_close (RT_LLD lld)
 
      rt = rt_rs_from_lld(lld);
 
-     if (rt->rs_id)
+     if (rt->rs_id) {
+	  rt_rs_commitall();
           rs_close(rt->rs_id);
+     }
      rt->magic = 0;	/* don't use again */
      nfree(rt->filepath);
      if (rt->password)
@@ -423,14 +462,40 @@ int    rt_rs_write (RT_LLD lld, const void *buf, int buflen)
 	  return -1;
 }
 
-/* write to ringstore, return 1 for success or 0 for failure */
+/* write to ringstore, return 1 for success or 0 for failure.
+ * When coalescing, a copy of the table is held to be written with the 
+ * others at the end of the dispatch, so success means it was accepted.
+ * RT_RS_CB_WRITE is raised after a successful write */
 int    rt_rs_twrite (RT_LLD lld, TABLE tab)
 {
      RT_RSD rt;
+     TABLE copy;
+     struct rt_rs_pendwrite *pend;
+     int r;
 
      rt = rt_rs_from_lld(lld);
 
-     return rs_put(rt->rs_id, tab);
+     if (rt_rs_coalesce && rt->rs_id) {
+	  copy = table_create_fromdonor(tab);
+	  if (table_nrows(tab) > 0 && table_addtable(copy, tab, 0) == -1) {
+	       elog_printf(ERROR, "unable to hold table for %s,%s", 
+			   rt->filepath, rt->ring);
+	       table_destroy(copy);
+	       return 0;
+	  }
+	  pend = nmalloc(sizeof(struct rt_rs_pendwrite));
+	  pend->rt  = rt;
+	  pend->tab = copy;
+	  itree_append(rt_rs_pending, pend);
+	  return 1;
+     }
+
+     r = rs_put(rt->rs_id, tab);
+     if (r)
+	  callback_raise(RT_RS_CB_WRITE, rt->filepath, rt->ring, 
+			 (void *) (long) rt->duration, NULL);
+
+     return r;
 }
 
 /* Returns the sequence size of the ringstore;
@@ -441,6 +506,7 @@ int    rt_rs_tell  (RT_LLD lld, int *seq, int *size, time_t *modt)
      RT_RSD rt;
 
      rt = rt_rs_from_lld(lld);
+     rt_rs_commitall();
 
      if (rt->rs_id) {
           rs_youngest(rt->rs_id, seq, modt);
@@ -470,6 +536,7 @@ ITREE *rt_rs_read  (RT_LLD lld, int seq, int offset)
      char *buf;
 
      rt = rt_rs_from_lld(lld);
+     rt_rs_commitall();
 
      if (rs_goto_seq(rt->rs_id, seq) != seq)
 	  return NULL;
@@ -534,23 +601,24 @@ TABLE rt_grs_tread  (RT_LLD lld, int seq, int offset)
      RT_RSD rt;
 
      rt = rt_rs_from_lld(lld);
+     rt_rs_commitall();
 
      if (rt->meta == rt_rs_info) {
           /* return meta data not stored data */
-          return rs_lsrings(&rs_gdbm_method, rt->filepath);
+          return rs_lsrings(rt_rs_method, rt->filepath);
      } else if (rt->meta == rt_rs_linfo) {
           /* return meta data not stored data */
-          return rs_inforings(&rs_gdbm_method, rt->filepath);
+          return rs_inforings(rt_rs_method, rt->filepath);
      } else if (rt->meta == rt_rs_cinfo) {
           /* return meta data not stored data */
-          return rs_lsconsrings(&rs_gdbm_method, rt->filepath);
+          return rs_lsconsrings(rt_rs_method, rt->filepath);
      } else if (rt->meta == rt_rs_clinfo) {
           /* return meta data not stored data */
-          return rs_infoconsrings(&rs_gdbm_method, rt->filepath);
+          return rs_infoconsrings(rt_rs_method, rt->filepath);
      }
 
      if (rt->cons) {
-          return rs_mget_cons(&rs_gdbm_method, rt->filepath, rt->ring, 
+          return rs_mget_cons(rt_rs_method, rt->filepath, rt->ring, 
 			      rt->from_t, rt->to_t);
      }
 
@@ -654,6 +722,7 @@ int rt_rs_checkpoint(RT_LLD lld)
      RT_RSD rt;
 
      rt = rt_rs_from_lld(lld);
+     rt_rs_commitall();
 
      return rs_checkpoint(rt->rs_id);
 }
@@ -664,6 +733,72 @@ int rt_rs_checkpoint(RT_LLD lld)
 /* --------------- Private routines ----------------- */
 
 
+/* Callback at the start of runq_dispatch(): coalesce writes */
+void rt_rs_tickstart()
+{
+     route_lock();		/* drivers may be used by threads */
+     if ( ! rt_rs_pending )
+	  rt_rs_pending = itree_create();
+     rt_rs_coalesce = 1;
+     route_unlock();
+}
+
+
+/* Callback at the end of runq_dispatch(): write the coalesced tables */
+void rt_rs_tickend()
+{
+     route_lock();
+     rt_rs_commitall();
+     rt_rs_coalesce = 0;
+     route_unlock();
+}
+
+
+/* Write all the tables held back by coalescing, in a single transaction
+ * for each ringstore file, then raise RT_RS_CB_WRITE for them.
+ * Called at the end of dispatch and before reading, telling or closing,
+ * so that the caller sees its own writes */
+void rt_rs_commitall()
+{
+     struct rt_rs_pendwrite *pend;
+     RS *rings;
+     TABLE *tabs;
+     int i, n, nput;
+
+     if ( ! rt_rs_pending || (n = itree_n(rt_rs_pending)) == 0 )
+	  return;
+
+     rings = nmalloc(sizeof(RS) * n);
+     tabs  = nmalloc(sizeof(TABLE) * n);
+     i = 0;
+     itree_traverse(rt_rs_pending) {
+	  pend = itree_get(rt_rs_pending);
+	  rings[i] = pend->rt->rs_id;
+	  tabs[i]  = pend->tab;
+	  i++;
+     }
+
+     nput = rs_put_batch(rings, tabs, n);
+     if (nput < n)
+	  elog_printf(ERROR, "only %d of %d coalesced writes were made", 
+		      nput, n);
+
+     /* a failed put has been logged by rs_put(); raising the callback
+      * for it as well only causes a needless refresh by listeners */
+     itree_traverse(rt_rs_pending) {
+	  pend = itree_get(rt_rs_pending);
+	  if (nput)
+	       callback_raise(RT_RS_CB_WRITE, pend->rt->filepath, 
+			      pend->rt->ring, 
+			      (void *) (long) pend->rt->duration, NULL);
+	  table_destroy(pend->tab);
+     }
+     itree_clearoutandfree(rt_rs_pending);
+     nfree(rings);
+     nfree(tabs);
+}
+
+
 RT_RSD rt_rs_from_lld(RT_LLD lld	/* typeless low level data */)
 {
      if (!lld)
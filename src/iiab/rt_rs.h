@@ -22,6 +22,13 @@
 #define RT_RS_BERK_PREFIX      "brs"
 #define RT_RS_BERK_DESCRIPTION "Berkeley DB Ringstore"
 
+/* Raised after a table is written to a ring, with arguments
+ * (char *filepath, char *ring, (long) duration, NULL) */
+#define RT_RS_CB_WRITE "rt_rs_write"
+
+/* Configuration: recent samples of each ring to hold in memory */
+#define RT_RS_CF_MEM "rs.mem"
+
 
 enum rt_rs_meta {rt_rs_none, rt_rs_info, rt_rs_linfo, rt_rs_cinfo, 
 		 rt_rs_clinfo};
@@ -44,11 +51,19 @@ typedef struct rt_rs_desc {
      int    cons;	/* consolidation flag */
 } * RT_RSD;
 
+/* A table written while coalescing, held until the end of dispatch */
+struct rt_rs_pendwrite {
+     RT_RSD rt;		/* route the table was written to */
+     TABLE  tab;	/* copy of the written table */
+};
+
 extern const struct route_lowlevel rt_grs_method;
+extern RS_METHOD rt_rs_method;
 /*extern const struct route_lowlevel rt_brs_method;*/
 
 void   rt_rs_init  (CF_VALS cf, int debug);
 void   rt_rs_fini  ();
+void   rt_rs_usemem(int nsamples);
 
 int    rt_grs_magic ();
 char * rt_grs_prefix();
@@ -81,6 +81,7 @@ RT_LLD rt_stdin_open (char *p_url, char *comment, char *password, int keep,
      rt->magic = rt_stdin_magic();
      rt->prefix = rt_stdin_prefix();
      rt->description = rt_stdin_description();
+     rt->out.buf = NULL;
 
      return rt;
 }
@@ -95,6 +96,7 @@ RT_LLD rt_stdout_open (char *p_url, char *comment, char *password, int keep,
      rt->magic = rt_stdout_magic();
      rt->prefix = rt_stdout_prefix();
      rt->description = rt_stdout_description();
+     rt->out.buf = NULL;
 
      return rt;
 }
@@ -109,6 +111,7 @@ RT_LLD rt_stderr_open (char *p_url, char *comment, char *password, int keep,
      rt->magic = rt_stderr_magic();
      rt->prefix = rt_stderr_prefix();
      rt->description = rt_stderr_description();
+     rt->out.buf = NULL;
 
      return rt;
 }
@@ -119,6 +122,8 @@ void   rt_std_close (RT_LLD lld)
 
      rt = rt_std_from_lld(lld);
 
+     if (rt->out.buf)
+	  table_outbuf_free(&rt->out);
      rt->magic = 0;	/* don't use again */
      nfree(rt);
 }
@@ -145,16 +150,21 @@ int    rt_std_twrite (RT_LLD lld, TABLE tab)
 {
      int n;
      RT_STDD rt;
-     char *buf;
 
      rt = rt_std_from_lld(lld);
 
-     buf = table_outtable(tab);
-     if ( ! buf)
+     /* serialise into the route's buffer, which is kept between writes */
+     if (rt->out.buf)
+	  table_outbuf_reset(&rt->out);
+     else
+	  table_outbuf_init(&rt->out, 0);
+     if ( ! tab || ! table_outtable_buf(tab, &rt->out, 
+					table_getseparator(tab),
+					TABLE_WITHCOLNAMES, TABLE_WITHINFO) )
        return 1;	/* empty table, successfully don't writing anything */
 
-     n = rt_std_write(lld, buf, strlen(buf));
-     nfree(buf);
+     n = rt_std_write(lld, table_outbuf_text(&rt->out), 
+		      table_outbuf_len(&rt->out));
 
      if (n == -1)
 	  return 0;
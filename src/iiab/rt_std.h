@@ -23,6 +23,8 @@ typedef struct rt_std_desc {
      char *prefix;
      char *description;
      int fd;
+     struct table_outbuf out;	/* reused to write tables, buf is NULL 
+				 * until the first write */
 } * RT_STDD;
 
 extern const struct route_lowlevel rt_stdin_method;
@@ -12,6 +12,7 @@
  * Revised March 1997
  * Renamed, reorganised and consolidated December 1997
  * Algorithm change December 2000
+ * Nanosecond times and timerfd dispatch 2026
  *
  * Copyright System Garden Ltd 1996-2001. All rights reserved.
  */
@@ -20,6 +21,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#if linux
+#include <sys/timerfd.h>
+#endif
 #include "nmalloc.h"
 #include "util.h"
 #include "sig.h"
@@ -39,6 +45,17 @@
  * runq_dispatch() is called by the SIGALRM and traverses the event queue
  * to start the the peices of work.
  *
+ * Times are held in nanoseconds from the epoch, so work may be scheduled
+ * at intervals of less than a second. Each execution is placed on the
+ * grid of start + n * interval, rather than relative to the last run,
+ * so that lateness does not accumulate; the work's policy decides 
+ * whether times missed because of an overrun are skipped or caught up.
+ * By default, the dispatcher is woken by SIGALRM from setitimer(). 
+ * Once runq_usetimerfd() has been called, it is woken instead by a
+ * timerfd set to the absolute time of the next event, which is handled
+ * as a file descriptor callback in the meth_relay() event loop rather 
+ * than in a signal handler.
+ *
  * For efficiency, repeated work execution is gathered together in `runs', 
  * detected by runq_schedw() and called by runq_dispatch(). These are
  * generally calls to open and shut I/O for efficiency.
@@ -54,14 +71,22 @@ ITREE *runq_tab;	/* List of accepted work. Once work has expired and
 			 * its last method completed, it will be removed
 			 * from this list. Keyed by a unique id that is 
 			 * constant acorss the lifetimne of the work run */
-ITREE *runq_event;	/* Time ordered tree of work references to runq_tab. 
+Rb_node runq_event;	/* Time ordered tree of work references to runq_tab. 
 			 * Represents the times at which the next execution 
 			 * of each peice of work should occur. Once carried 
 			 * out, the next execution should be rescheduled.
-			 * Keyed by next execution time */
+			 * Keyed by the work itself, ordered by next 
+			 * execution time (runq_work.due) then phase */
 time_t runq_startup;	/* Time at which the runq was started */
 int    runq_drain;	/* If set, don't dispatch any more work */
 int    runq_nextid=0;	/* The id counter */
+int    runq_timerfd=-1;	/* timerfd to wake dispatch or -1 for SIGALRM */
+
+/* private functions */
+void runq_evadd(struct runq_work *w, long long due);
+int  runq_evrm(struct runq_work *w);
+int  runq_evcmp(char *a, char *b);
+void runq_canceltimer();
 
 /* Initialise work queues and install the signal handlers */
 void runq_init(time_t startup	/* time queue was initialised */ )
@@ -71,16 +96,23 @@ void runq_init(time_t startup	/* time queue was initialised */ )
      callback_regcb(METH_CB_FINISHED, (void *) runq_methfinished);
 
      runq_tab = itree_create();		/* Cached requests */
-     runq_event = itree_create();	/* List of events */
+     runq_event = make_rb();		/* List of events */
      runq_startup = startup;		/* Resister the start time */
      runq_drain = 0;			/* Normally dispatch work */
+     runq_timerfd = -1;			/* Start with SIGALRM */
 }
 
 void runq_fini()
 {
      struct runq_work *w;
 
-     alarm(0);
+     runq_canceltimer();
+     if (runq_timerfd != -1) {
+	  meth_rm_fdcallback(runq_timerfd);
+	  callback_unregcb(RUNQ_CB_TIMER, (void *) runq_timerdispatch);
+	  close(runq_timerfd);
+	  runq_timerfd = -1;
+     }
      if (runq_tab) {
           while ( ! itree_empty(runq_tab) ) {
 	       itree_first(runq_tab);
@@ -93,25 +125,23 @@ void runq_fini()
 	  itree_destroy(runq_tab);
      }
      if (runq_event) {
-          while ( ! itree_empty(runq_event) ) {
-	       itree_first(runq_event);
-	       itree_rm(runq_event);
-	  }
-	  itree_destroy(runq_event);
+	  rb_free_tree(runq_event);
+	  runq_event = NULL;
      }
 }
 
 /* List the event and work trees in a combined way */
 void runq_dump() {
      struct runq_work *w;
+     Rb_node n;
      time_t t;
 /*     char *buf;*/
      
      elog_startsend(DEBUG, "Work events -----\n");
      /* List the event queue */
-     itree_traverse(runq_event) {
-	  w = itree_get(runq_event);
-	  t = itree_getkey(runq_event);
+     rb_traverse(n, runq_event) {
+	  w = (struct runq_work *) rb_val(n);
+	  t = runq_duesec(w);
 /*	  tm = localtime(&t);
 	  strftime(str, RUNQ_TMPBUF, "%d-%b-%y %H:%M:%S", tm);
 	  buf = util_bintostr(RUNQ_TMPBUF, w->argument, w->arglen);*/
@@ -124,8 +154,8 @@ void runq_dump() {
      /* List the work not in the event queue */
      itree_traverse(runq_tab) {
 	  w = itree_get(runq_tab);
-	  itree_traverse(runq_event)
-	       if (itree_get(runq_event) == w)
+	  rb_traverse(n, runq_event)
+	       if ((struct runq_work *) rb_val(n) == w)
 		    goto ineventq;
 	  /*buf = util_bintostr(RUNQ_TMPBUF, w->argument, w->arglen);*/
 	  elog_contprintf(DEBUG, 
@@ -166,20 +196,56 @@ int runq_add(long start,	/* time work should start in GMT */
 	     int (*endofrun)(),	/* Call at end of run set */
 	     void *argument,	/* nmalloc()ed argument buffer to reparent */
 	     int arglen		/* Length of argument buffer */ )
+{
+     struct timespec startt, intervalt;
+
+     startt.tv_sec     = start;
+     startt.tv_nsec    = 0;
+     intervalt.tv_sec  = interval;
+     intervalt.tv_nsec = 0;
+
+     return runq_addt(&startt, &intervalt, phase, count, desc, startofrun,
+		      command, isrunning, endofrun, argument, arglen);
+}
+
+
+/*
+ * As runq_add(), but with the start time and interval given to the
+ * nanosecond, so that work may run more often than once a second.
+ * A start of 0 seconds and 0 nanoseconds means the runq startup time.
+ * Returns as runq_add().
+ */
+int runq_addt(struct timespec *start,	/* time work should start in GMT */
+	      struct timespec *interval,/* time in between each run */
+	      long phase,	/* order in each scheduled time point */
+	      long count,	/* number of times to run (0=continuous) */
+	      char *desc,	/* description or string id of work */
+	      int (*startofrun)(),/* Call at start of run set */
+	      int (*command)(),	/* Command to execute */
+	      int (*isrunning)(),/* Test for command still running */
+	      int (*endofrun)(),/* Call at end of run set */
+	      void *argument,	/* nmalloc()ed argument buffer to reparent */
+	      int arglen	/* Length of argument buffer */ )
 {
      struct runq_work *work;
 
-     if (start <0 || interval <0 || phase <0 || count <0 || command == NULL) {
-          elog_printf(ERROR, "bad parameter: %d %d %d %d %p",
-		      start, interval, phase, count, command);
+     if (start->tv_sec <0 || start->tv_nsec <0 || start->tv_nsec >= RUNQ_NSEC
+	 || interval->tv_sec <0 || interval->tv_nsec <0 
+	 || interval->tv_nsec >= RUNQ_NSEC || phase <0 || count <0 
+	 || command == NULL) {
+          elog_printf(ERROR, "bad parameter: %ld.%09ld %ld.%09ld %d %d %p",
+		      (long) start->tv_sec, start->tv_nsec, 
+		      (long) interval->tv_sec, interval->tv_nsec, 
+		      phase, count, command);
 	  nfree(argument);
 	  return -1;
      }
 
      /* Create and assign a queue structure */
      work             = xnmalloc(sizeof(struct runq_work));
-     work->start      = (start == 0 ? runq_startup : start);
-     work->interval   = interval;
+     work->start      = (start->tv_sec == 0 && start->tv_nsec == 0) ? 
+			runq_startup : start->tv_sec;
+     work->interval   = interval->tv_sec;
      work->phase      = phase;
      work->count      = count;
      work->desc       = xnstrdup(desc);
@@ -192,14 +258,21 @@ int runq_add(long start,	/* time work should start in GMT */
      work->nruns      = 0;
      work->expired    = 0;
      work->clearup    = 0;
+     work->startns    = (start->tv_sec == 0 && start->tv_nsec == 0) ? 
+			runq_startup * RUNQ_NSEC :
+			start->tv_sec * RUNQ_NSEC + start->tv_nsec;
+     work->intervalns = interval->tv_sec * RUNQ_NSEC + interval->tv_nsec;
+     work->due        = 0;
+     work->policy     = RUNQ_SKIP;
      
      /* Debug: List the addition to the work queue */
-     elog_printf(DEBUG, "%s %d %d %d starts %.25s",
-		 desc, interval, phase, count, util_shortadaptdatetime(start));
+     elog_printf(DEBUG, "%s %ld.%09ld %d %d starts %.25s",
+		 desc, (long) interval->tv_sec, interval->tv_nsec, phase, 
+		 count, util_shortadaptdatetime(work->start));
 
      /* Add to table of all work, schedule into an event and run if needed */
      itree_add(runq_tab, runq_nextid, work);
-     if (runq_schedw(work, 0, time(NULL)) == 0)
+     if (runq_schedw(work, 0, runq_now()) == 0)
 	  return -2;
      runq_setdispatch();
      /*runq_dispatch();*//*try -NS 25/12/00*/
@@ -209,6 +282,26 @@ int runq_add(long start,	/* time work should start in GMT */
 	  return runq_nextid++;
 }
 
+
+/*
+ * Set the policy for work indexed by ikey when its executions are missed
+ * because dispatching overran. RUNQ_SKIP (the default) goes on to the
+ * next time in the future; RUNQ_CATCHUP runs the missed times in turn.
+ * Returns 1=success, 0=error.
+ */
+int runq_setpolicy(int ikey, enum runq_policy policy)
+{
+     struct runq_work *w;
+
+     if ((w = itree_find(runq_tab, ikey)) == ITREE_NOVAL) {
+          elog_printf(DEBUG, "work doesn't exist with id %d", ikey);
+	  return 0;
+     }
+     w->policy = policy;
+
+     return 1;
+}
+
 /*
  * Remove work indexed by ikey from the runq_tab.
  * This will not stop any running work, but will prevent any further work
@@ -230,18 +323,12 @@ int runq_rm(int ikey /* work key */) {
      w->expired++;
 
      /* remove work from event table if scheduled */
-     itree_traverse(runq_event)	{
-	  if (itree_get(runq_event) == w) {
-	       itree_rm(runq_event);
-	       break;
-	  }
-     }
+     runq_evrm(w);
 
      /* is the work running? */
      if (w->isrunning && (*w->isrunning)(w->argument, w->arglen)) {
 	  /* schedule a clearup attempt after a the defult time */ 
-	  itree_add(runq_event, time(NULL) + RUNQ_EXPIREWAITDEF, 
-		    itree_get(runq_tab));
+	  runq_evadd(w, runq_now() + RUNQ_EXPIREWAITDEF * RUNQ_NSEC);
 	  elog_printf(DEBUG, "%s expired but removal delayed", w->desc);
 
 	  return 1;	/* still a success */
@@ -313,10 +400,11 @@ int runq_ntab() {
 /* Return the number of non-expired jobs that are scheduled */
 int runq_nsched() {
      struct runq_work *w;
+     Rb_node e;
      int n=0;
 
-     itree_traverse(runq_event) {
-	  w = itree_get(runq_event);
+     rb_traverse(e, runq_event) {
+	  w = (struct runq_work *) rb_val(e);
 	  if ( ! w->expired )
 	       n++;
      }
@@ -325,6 +413,31 @@ int runq_nsched() {
 }
 
 
+/* Return the number of events in the queue, expired or not */
+int runq_nevent() {
+     Rb_node e;
+     int n=0;
+
+     rb_traverse(e, runq_event)
+	  n++;
+
+     return n;
+}
+
+
+/* Return the work of the n'th event in time order (from 0) or NULL if 
+ * there are not that many. Its time is in runq_work.due */
+struct runq_work *runq_getevent(int n) {
+     Rb_node e;
+
+     rb_traverse(e, runq_event)
+	  if (n-- == 0)
+	       return (struct runq_work *) rb_val(e);
+
+     return NULL;
+}
+
+
 /*
  * Schedule the next execution of work specified by ikey in runq_tab
  * Returns 1 if successfully scheduled, 0 if not scheduled because all the
@@ -332,10 +445,10 @@ int runq_nsched() {
  * If failed, it is up to the caller to remove the entry from runq_tab().
  */
 int  runq_sched(int ikey,	/* index key of work */
-		time_t last,	/* last time this work was run or 0 
+		long long last,	/* last time this work was run (ns) or 0 
 				 * if new or unknown */
-		time_t now	/* reference time, supplied by caller
-				 * and should usually be time(NULL) */)
+		long long now	/* reference time (ns), supplied by caller
+				 * and should usually be runq_now() */)
 {
      struct runq_work *w;
 
@@ -349,10 +462,12 @@ int  runq_sched(int ikey,	/* index key of work */
 /*
  * Schedule the next execution of work specified by runq_work (the list
  * of potential work) and place the instruction to run into runq_event.
- * Work is scheduled at a number of seconds past the epoc in GMT and at
- * periods thereafter until the end of its run. 
+ * Work is scheduled at a number of nanoseconds past the epoc in GMT and 
+ * at periods thereafter until the end of its run. 
  * The next eligable execution is NOW or the next FOREWARD time; past or
- * missed times are always ignored.
+ * missed times are ignored unless the work's policy is RUNQ_CATCHUP,
+ * when the time after the last one run is used even if it has passed
+ * (as long as it is no more than RUNQ_CATCHUPMAX intervals behind).
  *
  * The data contained in each peice of work and their rules are:-
  * start    = Execute the work `start' seconds from unix epoch GMT.
@@ -372,6 +487,7 @@ int  runq_sched(int ikey,	/* index key of work */
  * argument = Buffer to pass to function
  * arglen   = Length of argument buffer
  * nruns    = number of times this work has been executed
+ * policy   = RUNQ_SKIP or RUNQ_CATCHUP for missed executions
  *
  * This function does not execute anything: start-of-run, end-of-run or
  * the execution. That is done by runq_dispatch() ONLY.
@@ -381,43 +497,55 @@ int  runq_sched(int ikey,	/* index key of work */
  * This includes when runq has been disabled and is being drained.
  */
 int  runq_schedw(struct runq_work *w,	/* work structure */
-		 time_t lastw,		/* last time this work was run
-					 * or 0 if new or unknown */
-		 time_t now		/* reference time, supplied by caller
-					 * and should usually be time(NULL) */)
+		 long long lastw,	/* last time this work was due to 
+					 * run (ns) or 0 if new or unknown */
+		 long long now		/* reference time (ns), supplied by
+					 * caller and should usually be 
+					 * runq_now() */)
 {
-     time_t last, base, next, final;
+     long long last, base, next, final;
 
      /* if set, don't dispatch any more work; allow to drain down */
      if (runq_drain)
           return 0;	/* disabled: draining */
 
-     /* set up times */
-     last  = lastw == 0    ? now          : lastw;
-     base  = w->start == 0 ? runq_startup : w->start;
-     final = base + (w->count-1) * w->interval;
-
      /* reform questionable parameters before they harm someone */
-     if (w->interval == 0 && w->count != 1) {
+     if (w->intervalns == 0 && w->count != 1) {
           w->count = 1;		/* only count==1 make sense */
 	  elog_printf(WARNING, "%s set count=1 as interval==0", w->desc);
      }
-     if (w->interval == 0)
-	  w->interval = 1;
+     if (w->intervalns == 0) {
+	  w->interval   = 1;
+	  w->intervalns = RUNQ_NSEC;
+     }
+
+     /* set up times */
+     last  = lastw > now   ? lastw        : now;
+     base  = w->startns == 0 ? runq_startup * RUNQ_NSEC : w->startns;
+     final = base + (w->count-1) * w->intervalns;
 
      /* catagorise events and handle separately */
      if (base > now) {
 	  /* future events */
 	  next = base;
+     } else if (lastw != 0 && w->policy == RUNQ_CATCHUP && 
+		lastw + w->intervalns < now &&
+		now - lastw <= RUNQ_CATCHUPMAX * w->intervalns) {
+	  /* overran: run the next time on the grid even though it has 
+	   * passed, so each missed execution is made up in turn */
+	  next = lastw + w->intervalns;
+	  if (w->count != 0 && next > final)
+	       next = 0;	/* work is in the past */
      } else if (w->count != 0 && final < now) {
 	  /* non-continous and past */
 	  next = 0;		/* work is in the past */
      } else {
-	  /* continuous or current */
-	  next = base + ((last - base) / w->interval +1) * w->interval;
+	  /* continuous or current: the next time on the grid, skipping 
+	   * any that have been missed */
+	  next = base + ((last - base) / w->intervalns +1) * w->intervalns;
 	  if (lastw != 0 && next == lastw) {
 	       /* don't reschedule at the same as last time */
-	       next += w->interval;
+	       next += w->intervalns;
 	       if (next > final) {
 		    next=0;	/* work is in the past */
 	       }
@@ -427,18 +555,19 @@ int  runq_schedw(struct runq_work *w,	/* work structure */
      /* insert work as an event and log it */
      if (next) {
 	  /* work is current */
-          elog_printf(DEBUG, "%s next run at %s (in %ds)", w->desc, 
-		      util_decdatetime(next), next-now);
+          elog_printf(DEBUG, "%s next run at %s.%03d (in %lldms)", w->desc, 
+		      util_decdatetime(next / RUNQ_NSEC), 
+		      (int) (next % RUNQ_NSEC / 1000000), 
+		      (next-now) / 1000000);
 
 	  /* DEBUG: check for duplicates */
-	  itree_traverse(runq_event)
-	       if (itree_get(runq_event) == w) {
-		    runq_dump();
-		    elog_die(FATAL, "found a duplicate in runq_event "
-			     "for %s", w->desc);
-	       }
+	  if (runq_evrm(w)) {
+	       runq_dump();
+	       elog_die(FATAL, "found a duplicate in runq_event "
+			"for %s", w->desc);
+	  }
 
-	  itree_add(runq_event, next, w);
+	  runq_evadd(w, next);
 
 	  return 1;
      } else {
@@ -462,7 +591,7 @@ void runq_schedall() {
      
      /* Schedule each piece of in the runq_tab tree */
      itree_traverse(runq_tab)
-	  runq_sched(itree_getkey(runq_tab), 0, time(NULL));
+	  runq_sched(itree_getkey(runq_tab), 0, runq_now());
 }
 
 /*
@@ -478,14 +607,12 @@ int runq_schedrm(int ikey /* work key */) {
      w = itree_get(runq_tab);
      
      /* Search the event list for the one pointing to the same data */
-     itree_traverse(runq_event)
-	  if (itree_get(runq_event) == w) {
-	       itree_rm(runq_event);
-	       /* Debug: Event removed */
-	       elog_printf(DEBUG, "%d at %d has been unscheduled", ikey, 
-			   itree_getkey(runq_event));
-	       return 1;
-	  }
+     if (runq_evrm(w)) {
+	  /* Debug: Event removed */
+	  elog_printf(DEBUG, "%d at %d has been unscheduled", ikey, 
+		      runq_duesec(w));
+	  return 1;
+     }
 
      return 0;
 }
@@ -496,46 +623,97 @@ int runq_schedrm(int ikey /* work key */) {
  */
 void runq_schedrmall() {
      /* Remove the contents of the runq_event tree */
-     alarm(0);
-     itree_first(runq_event);
-     while (!itree_empty(runq_event))
-	  itree_rm(runq_event);
+     runq_canceltimer();
+     while (!rb_empty(runq_event))
+	  rb_delete_node(rb_first(runq_event));
 }
 
 
 /*
  * Finds the time of the first runnable event in runq_event and sets
- * the alarm() call [in unix] so that all the work at that and earlier 
- * time intervals may be dispatched.
+ * the timer so that all the work at that and earlier times may be 
+ * dispatched. 
+ * With a timerfd, the timer is set to the absolute time of the event,
+ * so time taken to get here is not added to the wait; if the event is
+ * already due, the timer fires straight away and the event loop calls
+ * runq_dispatch() again after it has serviced its other descriptors.
+ * With SIGALRM, setitimer() is given the time remaining.
  */
 void runq_setdispatch()
 {
-     time_t now, next;
+     struct runq_work *w;
+     struct itimerval it;
+     long long now, wait;
+#if linux
+     struct itimerspec its;
+#endif
+
+     if (rb_empty(runq_event)) {
+          elog_send(DEBUG, "empty event queue");
+	  return;
+     }
+
+     w = (struct runq_work *) rb_val(rb_first(runq_event));
+     now = runq_now();
+     wait = w->due - now;
+
+#if linux
+     if (runq_timerfd != -1) {
+	  its.it_interval.tv_sec  = 0;
+	  its.it_interval.tv_nsec = 0;
+	  its.it_value.tv_sec     = w->due / RUNQ_NSEC;
+	  its.it_value.tv_nsec    = w->due % RUNQ_NSEC;
+	  if (timerfd_settime(runq_timerfd, TFD_TIMER_ABSTIME, &its, NULL) 
+	      == -1)
+	       elog_printf(ERROR, "unable to set timerfd %d: %d %s", 
+			   runq_timerfd, errno, strerror(errno));
+
+	  /* Debug: Say when we wake up */
+	  elog_printf(DEBUG, "will wake in %lldms", wait > 0 ? 
+		      wait / 1000000 : 0LL);
+	  return;
+     }
+#endif
 
      /* 
-      * Find the next event and set the alarm to go off then.
+      * Set the alarm to go off at the next event.
       * If there was a high workload in running work above, we may be
-      * into the next second or even later. Despite this, force a 
-      * minimum wait of 1 second to avoid too much recursion
-      * and other dizzyness that I dont want to deal with now.
-      * We may be able to catch up in the next time point.
+      * past the event already. Despite this, force a minimum wait of
+      * RUNQ_MINWAIT so that the signal is taken after we have returned
+      * rather than recursing. It is short enough for sub-second work
+      * and RUNQ_CATCHUP to make up missed executions promptly.
       */
-     if (!itree_empty(runq_event)) {
-	  itree_first(runq_event);
-	  now = time(NULL);
-	  if (itree_getkey(runq_event) <= now)
-	       next = 1;
-	  else
-	       next = itree_getkey(runq_event) - now;
+     if (wait <= 0)
+	  wait = RUNQ_MINWAIT;
+     it.it_interval.tv_sec  = 0;
+     it.it_interval.tv_usec = 0;
+     it.it_value.tv_sec     = wait / RUNQ_NSEC;
+     it.it_value.tv_usec    = wait % RUNQ_NSEC / 1000;
+     if (it.it_value.tv_sec == 0 && it.it_value.tv_usec == 0)
+	  it.it_value.tv_usec = 1;
+     setitimer(ITIMER_REAL, &it, NULL);
+
+     /* Debug: Say when we wake up */
+     elog_printf(DEBUG, "will wake in %lldms", wait / 1000000);
+}
 
-	  alarm(next);
 
-	  /* Debug: Say when we wake up */
-	  elog_printf(DEBUG, "will wake in %d seconds", next);
-     } else {
-          elog_send(DEBUG, "empty event queue");
+/* Stop the dispatch timer, either the alarm or the timerfd */
+void runq_canceltimer()
+{
+     struct itimerval it;
+#if linux
+     struct itimerspec its;
+
+     if (runq_timerfd != -1) {
+	  memset(&its, 0, sizeof(its));
+	  timerfd_settime(runq_timerfd, 0, &its, NULL);
+	  return;
      }
+#endif
 
+     memset(&it, 0, sizeof(it));
+     setitimer(ITIMER_REAL, &it, NULL);
 }
 
 
@@ -573,39 +751,35 @@ void runq_setdispatch()
  * If any jobs missed their time, they will still be executed.
  */
 void runq_dispatch() {
-     time_t now;
+     long long now;
      struct runq_work *w=NULL;
      ITREE *resched;
      int r, ikey;
 
      resched = itree_create();
-     now = time(NULL);		/* Find the current time */
+     now = runq_now();		/* Find the current time */
 
      /*
       * Traverse the event list in order, finding the events to run
-      * at this second of before.
+      * at this time or before.
       * Run these events and mark them for reschedualing.
       * Use a traversal loop which can cope with removals
       */
      elog_printf(DEBUG, "event queue of %d before dispatching", 
-		 itree_n(runq_event));
+		 runq_nevent());
 
      /* 
       * The code below traverses the tree, executing the code with time
       * keys that are smaller than or equal to 'now'. Once executed, 
       * the work is removed from the event tree and placed in the resched 
       * tree to have a new commencement time calculated.
+      * Callbacks either side let interested parties (such as the 
+      * ringstore route) treat the work of this second as a batch.
       */
-     while (!itree_empty(runq_event)) {
-          itree_first(runq_event);
-	  if (itree_getkey(runq_event) <= now) {
-	       w = itree_get(runq_event);
-	       if ( !w ) {
-		    runq_dump();
-		    elog_die(ERROR, 
-			     "unable to get event details key=%d now=%d", 
-			     itree_getkey(runq_event), now);
-	       }
+     callback_raise(RUNQ_CB_DISPATCH_START, NULL, NULL, NULL, NULL);
+     while (!rb_empty(runq_event)) {
+	  w = (struct runq_work *) rb_val(rb_first(runq_event));
+	  if (w->due <= now) {
 
 	       /* expired? -- don't run! just ask to be rescheduled */
 	       if (w->expired)
@@ -629,29 +803,34 @@ void runq_dispatch() {
 				w->desc);
 
 	  expired:
-	       /* add to reschedule queue & remove from run queue */
-	       itree_add(resched, now, w);
-	       itree_rm(runq_event);
+	       /* add to reschedule queue & remove from run queue; 
+		* the time it was due is kept in the work */
+	       itree_append(resched, w);
+	       rb_delete_node(rb_first(runq_event));
 	  } else
 	       break;
      }
+     callback_raise(RUNQ_CB_DISPATCH_END, NULL, NULL, NULL, NULL);
 
      elog_printf(DEBUG, "event queue of %d after dispatching", 
-		 itree_n(runq_event));
+		 runq_nevent());
 
      /*
       * All jobs run have been marked for rescheduling in the ITREE
-      * resched. Traverse this now to do the actual rescheduling.
+      * resched. Traverse this now to do the actual rescheduling from
+      * the time each was due, so the schedule does not drift.
       * Destroy the tree when finished, but don't touch the values
       * as they are just referencies to runq_tab, which 'owns' them.
       */
-     itree_traverse(resched)
-          if (runq_schedw(itree_get(resched), itree_getkey(resched), 
-			  time(NULL)) == 0) {
+     now = runq_now();
+     itree_traverse(resched) {
+	  w = itree_get(resched);
+          if (runq_schedw(w, w->due, now) == 0) {
 	       /* work has probably expired (or it was bad) mark
 		* it as expired for later clearing and don't schedule */
 	       w->expired++;
 	  }
+     }
      itree_destroy(resched);
 
      /* traverse runq_tab to find work that has been expired and needs 
@@ -682,9 +861,8 @@ void runq_dispatch() {
 		    /* check there are no other events using the same structure
 		     * the remove the table entry and free the sstructure */
 		    elog_printf(DEBUG, "clearing up %s", w->desc);
-		    itree_traverse(runq_event)
-			 if (itree_get(runq_event) == w)
-			      itree_rm(runq_event);
+		    while (runq_evrm(w))
+			 ;
 		    nfree(w->desc);
 		    nfree(w->argument);
 		    nfree(w);
@@ -719,6 +897,106 @@ void runq_sigdispatch() {
 #endif
 
 
+/*
+ * Dispatch from a timerfd rather than SIGALRM. 
+ * A timerfd is created and registered with meth as a file descriptor
+ * callback, so that work is dispatched from the meth_relay() event loop
+ * instead of a signal handler. Call after meth_init() and runq_init().
+ * Returns 1 if the timerfd is in use, or 0 if it is not available, in 
+ * which case SIGALRM continues to be used.
+ */
+int runq_usetimerfd() {
+#if linux
+     int fd;
+
+     if (runq_timerfd != -1)
+	  return 1;
+
+     fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK|TFD_CLOEXEC);
+     if (fd == -1) {
+	  elog_printf(WARNING, "unable to create timerfd, continuing to "
+		      "dispatch with alarms: %d %s", errno, strerror(errno));
+	  return 0;
+     }
+
+     runq_canceltimer();	/* stop the alarm */
+     runq_timerfd = fd;
+     callback_regcb(RUNQ_CB_TIMER, (void *) runq_timerdispatch);
+     meth_add_fdcallback(fd, RUNQ_CB_TIMER);
+     runq_setdispatch();
+
+     elog_printf(DEBUG, "dispatching from timerfd %d", fd);
+     return 1;
+#else
+     return 0;
+#endif
+}
+
+
+/*
+ * Callback from the meth_relay() event loop when the timerfd is readable.
+ * Clear its expiry count and dispatch the work that is due
+ */
+void runq_timerdispatch(void *fd)
+{
+     unsigned long long expired;
+
+     if (read((long) fd, &expired, sizeof(expired)) == -1 && 
+	 errno != EAGAIN)
+	  elog_printf(ERROR, "unable to read timerfd %ld: %d %s", 
+		      (long) fd, errno, strerror(errno));
+     runq_dispatch();
+}
+
+
+/* Return the current time in nanoseconds from the epoch */
+long long runq_now()
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_REALTIME, &ts);
+     return ts.tv_sec * RUNQ_NSEC + ts.tv_nsec;
+}
+
+
+/* Private: add work to the event queue, to be run at due (ns) */
+void runq_evadd(struct runq_work *w, long long due)
+{
+     w->due = due;
+     rb_insertg(runq_event, (char *) w, (char *) w, runq_evcmp);
+}
+
+
+/* Private: remove work from the event queue. 
+ * Returns 1 if it was removed or 0 if it was not in the queue */
+int runq_evrm(struct runq_work *w)
+{
+     Rb_node e;
+
+     rb_traverse(e, runq_event)
+	  if ((struct runq_work *) rb_val(e) == w) {
+	       rb_delete_node(e);
+	       return 1;
+	  }
+
+     return 0;
+}
+
+
+/* Private: order events by time then phase */
+int runq_evcmp(char *a, char *b)
+{
+     struct runq_work *wa = (struct runq_work *) a;
+     struct runq_work *wb = (struct runq_work *) b;
+
+     if (wa->due != wb->due)
+	  return wa->due < wb->due ? -1 : 1;
+     if (wa->phase != wb->phase)
+	  return wa->phase < wb->phase ? -1 : 1;
+     return 0;
+}
+
+
 
 /*
  * Callback signal from meth class that a long running method has finished.
@@ -792,9 +1070,74 @@ int test1(char *arg, int arglen) {
      return 0;		/* Success */
 }
 
+/* Overrun test: record when each run was due and make the first run 
+ * take longer than two intervals */
+long long tdue[20];
+int tnruns;
+
+int test2(char *arg, int arglen) {
+     if (tnruns < 20)
+	  tdue[tnruns] = runq_getevent(0)->due;
+     if (tnruns++ == 0)
+	  usleep(250000);
+     return 0;
+}
+
+/* Run six times at 100ms with the given policy, forcing an overrun on 
+ * the first run. Dispatch from the timerfd if usefd is set, otherwise 
+ * from SIGALRM. Returns the number of runs and their due times in tdue[] */
+int test_overrun(char *desc, enum runq_policy policy, int usefd) {
+     struct timespec start, interval;
+     int i, id;
+
+     tnruns = 0;
+     start.tv_sec  = time(NULL)+1;
+     start.tv_nsec = 0;
+     interval.tv_sec  = 0;
+     interval.tv_nsec = RUNQ_NSEC/10;
+     id = runq_addt(&start, &interval, 0, 6, desc, NULL, test2, NULL, 
+		    NULL, xnstrdup(tmsg1), sizeof(tmsg1));
+     if (id < 0)
+	  elog_die(FATAL, "[%s] Can't add\n", desc);
+     if ( ! runq_setpolicy(id, policy) )
+	  elog_die(FATAL, "[%s] Can't set policy\n", desc);
+     for (i=0; i < 300 && runq_nevent(); i++)
+	  if (usefd)
+	       meth_relay();
+	  else
+	       usleep(10000);
+     if (runq_nevent()) {
+	  runq_dump();
+	  elog_die(FATAL, "[%s] Event queue should be empty\n", desc);
+     }
+     runq_clear();
+
+     return tnruns;
+}
+
+/* Check the runs of test_overrun() were due at the given multiples of 
+ * 100ms from the first one */
+void test_checkrun(char *desc, int nruns, int *want, int nwant) {
+     int i;
+
+     if (nruns != nwant)
+	  elog_die(FATAL, "[%s] ran %d times, want %d\n", desc, nruns, 
+		   nwant);
+     for (i=0; i < nwant; i++)
+	  if (tdue[i] - tdue[0] != want[i] * RUNQ_NSEC/10)
+	       elog_die(FATAL, "[%s] run %d due at +%lldms, want +%dms\n", 
+			desc, i, (tdue[i] - tdue[0]) / 1000000, want[i]*100);
+}
+
 int main(int argc, char **argv) {
      time_t now;
      char *str;
+     struct timespec start, interval;
+     struct runq_work *w;
+     long long base;
+     int i;
+     int skipruns[]  = {0, 3, 4, 5};
+     int catchruns[] = {0, 1, 2, 3, 4, 5};
      
      now = time(NULL);
      route_init(NULL, 0);
@@ -823,15 +1166,14 @@ int main(int argc, char **argv) {
      {
 	  elog_die(FATAL, "[1a] Can't add\n");
      }
-     itree_first(runq_event);
-     if (itree_getkey(runq_event) != now+5) {
+     if (runq_duesec(runq_getevent(0)) != now+5) {
 	  elog_die(FATAL, "[1a] Queued at an incorrect time\n");
      }
      runq_clear();
-     if (!itree_empty(runq_event) || !itree_empty(runq_tab)) {
+     if (runq_nevent() || !itree_empty(runq_tab)) {
 	  elog_die(FATAL, 
 		  "[1a] Trees not emptied. runq_events=%d, runq_tab=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab));
+		  runq_nevent(), itree_n(runq_tab));
      }
      now = time(NULL);
      
@@ -846,19 +1188,17 @@ int main(int argc, char **argv) {
      {
 	  elog_die(FATAL, "[1b] Can't add second\n");
      }
-     itree_first(runq_event);
-     if (itree_getkey(runq_event) != now+5) {
+     if (runq_duesec(runq_getevent(0)) != now+5) {
 	  elog_die(FATAL, "[1b] First queued at an incorrect time\n");
      }
-     itree_next(runq_event);
-     if (itree_getkey(runq_event) != now+5) {
+     if (runq_duesec(runq_getevent(1)) != now+5) {
 	  elog_die(FATAL, "[1b] Second queued at an incorrect time\n");
      }
      runq_clear();
-     if (!itree_empty(runq_event) || !itree_empty(runq_tab)) {
+     if (runq_nevent() || !itree_empty(runq_tab)) {
 	  elog_die(FATAL, 
 		  "[1b] Trees not emptied. runq_events=%d, runq_tab=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab));
+		  runq_nevent(), itree_n(runq_tab));
      }
      now = time(NULL);
      
@@ -873,19 +1213,17 @@ int main(int argc, char **argv) {
      {
 	  elog_die(FATAL, "[1c] Can't add second\n");
      }
-     itree_first(runq_event);
-     if (itree_getkey(runq_event) != now+5) {
+     if (runq_duesec(runq_getevent(0)) != now+5) {
 	  elog_die(FATAL, "[1c] First queued at an incorrect time\n");
      }
-     itree_next(runq_event);
-     if (itree_getkey(runq_event) != now+6) {
+     if (runq_duesec(runq_getevent(1)) != now+6) {
 	  elog_die(FATAL, "[1c] Second queued at an incorrect time\n");
      }
      runq_clear();
-     if (!itree_empty(runq_event) || !itree_empty(runq_tab)) {
+     if (runq_nevent() || !itree_empty(runq_tab)) {
 	  elog_die(FATAL, 
 		  "[1c] Trees not emptied. runq_events=%d, runq_tab=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab));
+		  runq_nevent(), itree_n(runq_tab));
      }
      now = time(NULL);
      
@@ -895,17 +1233,16 @@ int main(int argc, char **argv) {
      {
 	  elog_die(FATAL, "[1d] Can't add\n");
      }
-     itree_first(runq_event);
-     if (itree_getkey(runq_event) != now+3) {
+     if (runq_duesec(runq_getevent(0)) != now+3) {
 	  elog_die(FATAL, 
-		  "[1d] Event queued at an incorrect time: bad=%d good=%ld\n", 
-		  itree_getkey(runq_event), now+3);
+		  "[1d] Event queued at an incorrect time: bad=%ld good=%ld\n", 
+		  (long) runq_duesec(runq_getevent(0)), now+3);
      }
      runq_clear();
-     if (!itree_empty(runq_event) || !itree_empty(runq_tab)) {
+     if (runq_nevent() || !itree_empty(runq_tab)) {
 	  elog_die(FATAL, 
 		  "[1d] Trees not emptied. runq_events=%d, runq_tab=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab));
+		  runq_nevent(), itree_n(runq_tab));
      }
      now = time(NULL);
      
@@ -920,19 +1257,17 @@ int main(int argc, char **argv) {
      {
 	  elog_die(FATAL, "[1e] Can't add second\n");
      }
-     itree_first(runq_event);
-     if (itree_getkey(runq_event) != now+2) {
+     if (runq_duesec(runq_getevent(0)) != now+2) {
 	  elog_die(FATAL, "[1e] First queued at an incorrect time\n");
      }
-     itree_next(runq_event);
-     if (itree_getkey(runq_event) != now+4) {
+     if (runq_duesec(runq_getevent(1)) != now+4) {
 	  elog_die(FATAL, "[1e] Second queued at an incorrect time\n");
      }
      runq_clear();
-     if (!itree_empty(runq_event) || !itree_empty(runq_tab)) {
+     if (runq_nevent() || !itree_empty(runq_tab)) {
 	  elog_die(FATAL, 
 		  "[1e] Trees not emptied. runq_events=%d, runq_tab=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab));
+		  runq_nevent(), itree_n(runq_tab));
      }
      now = time(NULL);
      
@@ -947,24 +1282,22 @@ int main(int argc, char **argv) {
      {
 	  elog_die(FATAL, "[1f] Can't add second\n");
      }
-     itree_first(runq_event);
-     if (itree_getkey(runq_event) != now+2) {
-	  elog_die(FATAL, "[1f] 1st queued at wrong time, want %ld got %d\n",
-		  now+2, itree_getkey(runq_event));
+     if (runq_duesec(runq_getevent(0)) != now+2) {
+	  elog_die(FATAL, "[1f] 1st queued at wrong time, want %ld got %ld\n",
+		  now+2, (long) runq_duesec(runq_getevent(0)));
           runq_dump();
      }
-     itree_next(runq_event);
-     if (itree_getkey(runq_event) != now+5) {
+     if (runq_duesec(runq_getevent(1)) != now+5) {
           /* should have run already in the runq_add as it was eligable  */
-	  elog_die(FATAL, "[1f] 2nd queued at wrong time, want %ld got %d\n",
-		  now+5, itree_getkey(runq_event));
+	  elog_die(FATAL, "[1f] 2nd queued at wrong time, want %ld got %ld\n",
+		  now+5, (long) runq_duesec(runq_getevent(1)));
           runq_dump();
      }
      runq_clear();
-     if (!itree_empty(runq_event) || !itree_empty(runq_tab)) {
+     if (runq_nevent() || !itree_empty(runq_tab)) {
 	  elog_die(FATAL, 
 		  "[1f] Trees not emptied. runq_events=%d, runq_tab=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab));
+		  runq_nevent(), itree_n(runq_tab));
      }
      now = time(NULL);
      
@@ -979,14 +1312,14 @@ int main(int argc, char **argv) {
      {
 	  elog_die(FATAL, "[1g] Can't add second\n");
      }
-     if (!itree_empty(runq_event)) {
+     if (runq_nevent()) {
 	  elog_die(FATAL, "[1g] Event queue should be empty\n");
      }
      runq_clear();
-     if (!itree_empty(runq_event) || !itree_empty(runq_tab)) {
+     if (runq_nevent() || !itree_empty(runq_tab)) {
 	  elog_die(FATAL, 
 		  "[1g] Trees not emptied. runq_events=%d, runq_tab=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab));
+		  runq_nevent(), itree_n(runq_tab));
      }
      now = time(NULL);
      
@@ -1004,19 +1337,106 @@ int main(int argc, char **argv) {
      sleep(6);		/* let it run */
      sleep(2);		/* let it run */
      sleep(2);		/* let it run */
-     if (!itree_empty(runq_event)) {
+     if (runq_nevent()) {
 	  elog_die(FATAL, "[1h] Event queue should be empty\n");
 	  runq_dump();
      }
      runq_clear();
-     if (!itree_empty(runq_event) || !itree_empty(runq_tab)) {
+     if (runq_nevent() || !itree_empty(runq_tab)) {
 	  elog_die(FATAL, 
 		  "[1h] Trees not emptied. runq_events=%d, runq_tab=%d\n", 
-		  itree_n(runq_event), itree_n(runq_tab));
+		  runq_nevent(), itree_n(runq_tab));
      }
      now = time(NULL);
 
+     /* Sub-second test: four runs a quarter of a second apart */
+     start.tv_sec  = now+1;
+     start.tv_nsec = 0;
+     interval.tv_sec  = 0;
+     interval.tv_nsec = RUNQ_NSEC/4;
+     if (runq_addt(&start, &interval, 0, 4, "2a", NULL, test1, NULL, NULL, 
+		   xnstrdup(tmsg1), sizeof(tmsg1)) == -1)
+     {
+	  elog_die(FATAL, "[2a] Can't add\n");
+     }
+     if (runq_getevent(0)->due != (now+1) * RUNQ_NSEC) {
+	  elog_die(FATAL, "[2a] Queued at an incorrect time\n");
+     }
+     for (i=0; i < 30 && runq_nevent(); i++)
+	  usleep(100000);	/* let it run */
+     if (runq_nevent()) {
+	  runq_dump();
+	  elog_die(FATAL, "[2a] Event queue should be empty\n");
+     }
+     runq_clear();
+     now = time(NULL);
+
+     /* Scheduling after an overrun, given the time last due and the 
+      * time now. The work is in the future so it is never dispatched;
+      * take it off the event queue before each reschedule as dispatch 
+      * would */
+     start.tv_sec  = now+1000;
+     start.tv_nsec = 0;
+     interval.tv_sec  = 0;
+     interval.tv_nsec = RUNQ_NSEC/4;
+     if ((i = runq_addt(&start, &interval, 0, 0, "2b", NULL, test1, NULL, 
+			NULL, xnstrdup(tmsg1), sizeof(tmsg1))) == -1)
+     {
+	  elog_die(FATAL, "[2b] Can't add\n");
+     }
+     w = itree_find(runq_tab, i);
+     base = w->startns;
+     runq_evrm(w);
+     runq_schedw(w, base + 50*RUNQ_NSEC/4, base + 53*RUNQ_NSEC/4 + 1);
+     if (w->due != base + 54*RUNQ_NSEC/4) {
+	  elog_die(FATAL, "[2b] SKIP should skip missed runs\n");
+     }
+     runq_setpolicy(i, RUNQ_CATCHUP);
+     runq_evrm(w);
+     runq_schedw(w, base + 50*RUNQ_NSEC/4, base + 53*RUNQ_NSEC/4 + 1);
+     if (w->due != base + 51*RUNQ_NSEC/4) {
+	  elog_die(FATAL, "[2b] CATCHUP should run the next missed time\n");
+     }
+     runq_evrm(w);
+     runq_schedw(w, base + 51*RUNQ_NSEC/4, base + 53*RUNQ_NSEC/4 + 1);
+     if (w->due != base + 52*RUNQ_NSEC/4) {
+	  elog_die(FATAL, "[2b] CATCHUP should continue catching up\n");
+     }
+     runq_evrm(w);
+     runq_schedw(w, base + 53*RUNQ_NSEC/4, base + 53*RUNQ_NSEC/4 + 1);
+     if (w->due != base + 54*RUNQ_NSEC/4) {
+	  elog_die(FATAL, "[2b] CATCHUP should resume when caught up\n");
+     }
+     runq_evrm(w);
+     runq_schedw(w, base + 40*RUNQ_NSEC/4, 
+		 base + (41+RUNQ_CATCHUPMAX)*RUNQ_NSEC/4 + 1);
+     if (w->due != base + (42+RUNQ_CATCHUPMAX)*RUNQ_NSEC/4) {
+	  elog_die(FATAL, "[2b] CATCHUP should skip beyond "
+		   "RUNQ_CATCHUPMAX\n");
+     }
+     w->count = 52;
+     runq_evrm(w);
+     if (runq_schedw(w, base + 51*RUNQ_NSEC/4, base + 53*RUNQ_NSEC/4 + 1)) {
+	  elog_die(FATAL, "[2b] CATCHUP should not run beyond count\n");
+     }
+     runq_clear();
+     now = time(NULL);
+
+     /* Dispatch an overrun from SIGALRM: SKIP misses the runs due while
+      * the first was running, CATCHUP makes them up in turn */
+     test_checkrun("2c", test_overrun("2c", RUNQ_SKIP, 0), skipruns, 4);
+     test_checkrun("2d", test_overrun("2d", RUNQ_CATCHUP, 0), catchruns, 6);
+
+     /* The same, dispatched from a timerfd in the meth_relay() loop */
+     meth_init(argc, argv, NULL);
+     if ( ! runq_usetimerfd() ) {
+	  elog_die(FATAL, "[2e] Can't dispatch from timerfd\n");
+     }
+     test_checkrun("2e", test_overrun("2e", RUNQ_SKIP, 1), skipruns, 4);
+     test_checkrun("2f", test_overrun("2f", RUNQ_CATCHUP, 1), catchruns, 6);
+
      runq_fini();
+     meth_fini();
      elog_fini();
      route_fini();
      callback_fini();
@@ -16,6 +16,20 @@
 #define RUNQ_EXPIREWAITMAX 10
 #define RUNQ_MAXID INT_MAX
 #define RUNQ_CB_EXPIRED "runq_expired"
+#define RUNQ_CB_DISPATCH_START "runq_dispatch_start"
+#define RUNQ_CB_DISPATCH_END   "runq_dispatch_end"
+#define RUNQ_CB_TIMER "runq_timer"
+#define RUNQ_NSEC 1000000000LL	/* nanoseconds in a second */
+#define RUNQ_CATCHUPMAX 10	/* most missed runs caught up by RUNQ_CATCHUP */
+#define RUNQ_MINWAIT 1000000LL	/* shortest alarm when work is overdue (ns) */
+
+/* What to do when work has missed one or more of its times because 
+ * dispatching overran */
+enum runq_policy {
+     RUNQ_SKIP,			/* skip to the next time in the future */
+     RUNQ_CATCHUP		/* run each missed time in turn, up to 
+				 * RUNQ_CATCHUPMAX intervals behind */
+};
 
 /* Work queue structure */
 struct runq_work {
@@ -33,6 +47,11 @@ struct runq_work {
      int nruns;			/* accumulated number of runs */
      int expired;		/* =1 if no further executions of work */
      int clearup;		/* =1 remove from runq_tab list */
+     long long startns;		/* start time in nanoseconds from epoch */
+     long long intervalns;	/* nanoseconds between each execution */
+     long long due;		/* next execution in nanoseconds from epoch,
+				 * while in the event queue */
+     enum runq_policy policy;	/* action on missed executions */
 };
 
 /* Time resolution list */
@@ -48,20 +67,33 @@ void runq_dump();
 int  runq_add(long start, long interval, long phase, long count, char *desc, 
 	      int (*startofrun)(), int (*command)(), int (*isrunning)(),
 	      int (*endofrun)(), void *argument, int arglen);
+int  runq_addt(struct timespec *start, struct timespec *interval, long phase,
+	       long count, char *desc, int (*startofrun)(), int (*command)(),
+	       int (*isrunning)(), int (*endofrun)(), void *argument, 
+	       int arglen);
+int  runq_setpolicy(int ikey, enum runq_policy policy);
 int  runq_rm(int ikey);
 void runq_clear();
 int  runq_ntab();
 int  runq_nsched();
-int  runq_sched (int ikey,           time_t last, time_t now);
-int  runq_schedw(struct runq_work *, time_t last, time_t now);
+int  runq_sched (int ikey,           long long last, long long now);
+int  runq_schedw(struct runq_work *, long long last, long long now);
 void runq_schedall();
 int  runq_schedrm(int ikey);
 void runq_schedrmall();
 void runq_dispatch();
 void runq_setdispatch();
 void runq_sigdispatch();
+int  runq_usetimerfd();
+void runq_timerdispatch(void *fd);
+long long runq_now();
+int  runq_nevent();
+struct runq_work *runq_getevent(int n);
 void runq_methfinished(void *key);
 void runq_disable();
 void runq_enable();
 
+/* time of an event in whole seconds */
+#define runq_duesec(w) ((time_t) ((w)->due / RUNQ_NSEC))
+
 #endif /* _RUNQ_H_ */
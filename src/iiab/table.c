@@ -8,15 +8,38 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include "tree.h"
 #include "itree.h"
 #include "table.h"
 #include "elog.h"
 #include "nmalloc.h"
 #include "util.h"
+#include "hash.h"
 
 /* globals */
 
+/* private functions */
+void     table_priv_addcol(TABLE t, char *colname, ITREE *cells);
+void     table_priv_rmcolref(TABLE t, int h);
+void     table_priv_hashcols(TABLE t);
+Rb_node  table_priv_node(TABLE t, int row, int h);
+void     table_priv_rowindex(TABLE t);
+void     table_priv_rowappend(TABLE t);
+void     table_priv_rowremove(TABLE t, int row);
+void     table_priv_setcursor(TABLE t);
+void    *table_priv_arenaalloc(TABLE t, size_t len);
+struct table_colvec *table_priv_vecnew(TABLE t);
+void     table_priv_vecfree(struct table_colvec *v);
+int      table_priv_vecappend(TABLE t);
+void     table_priv_vectype(TABLE t, int h);
+void     table_priv_vecset(TABLE t, int h, int row, char *text, int alloc);
+char    *table_priv_vectext(TABLE t, struct table_colvec *v, int row);
+void     table_priv_vecdemote(TABLE t, struct table_colvec *v);
+void     table_priv_usetrees(TABLE t);
+void     table_priv_outcell(struct table_outbuf *out, char *cell, char sep);
+char    *table_priv_outstr(struct table_outbuf *out, int n);
+
 /* Create an empty table */
 TABLE table_create()
 {
@@ -35,6 +58,19 @@ TABLE table_create()
   t->refcount = 1;
   t->roworder = NULL;
   t->separator = TABLE_DEFSEPERATOR;
+  t->colref = NULL;
+  t->ncolref = 0;
+  t->colrefalloc = 0;
+  t->colhash = NULL;
+  t->colhashsz = 0;
+  t->rowkeys = NULL;
+  t->rowidxok = 0;
+  t->rowidxalloc = 0;
+  t->currow = 0;
+  t->arena = NULL;
+  t->arenablk = 0;
+  t->colvecs = 0;
+  t->vecalloc = 0;
 
   return t;
 }
@@ -54,7 +90,7 @@ TABLE table_create_t(ITREE *colnames)
      t = table_create();
      t->ncols = itree_n(colnames);
      itree_traverse(colnames) {
-	  tree_add(t->data, itree_get(colnames), itree_create());
+	  table_priv_addcol(t, itree_get(colnames), itree_create());
 	  itree_append(t->colorder, itree_get(colnames));
      }
 
@@ -153,13 +189,16 @@ TABLE table_create_fromdonor(TABLE donor)
      ITREE *newcol, *donorcol;
 
      t = table_create();
+     if (donor->arenablk)
+	  table_usearena(t, donor->arenablk);
+     if (donor->colvecs)
+	  table_usecolumns(t);
 
      /* copy from donor */
      t->ncols = donor->ncols;
      tree_traverse(donor->data) {
-	  s = xnstrdup(tree_getkey(donor->data));
-	  tree_add(t->data, s, itree_create());
-	  table_freeondestroy(t, s);
+	  s = table_strdup(t, tree_getkey(donor->data));
+	  table_priv_addcol(t, s, itree_create());
      }
      itree_traverse(donor->colorder) {
 	  /* colorder is an ordered list, values must point to valid memory
@@ -170,22 +209,21 @@ TABLE table_create_fromdonor(TABLE donor)
      }
      itree_traverse(donor->infolookup) {
 	  /* name to rowkey mapping */
-	  s = xnstrdup(tree_getkey(donor->infolookup));
+	  s = table_strdup(t, tree_getkey(donor->infolookup));
 	  tree_add(t->infolookup, s, tree_get(donor->infolookup));
-	  table_freeondestroy(t, s);
      }
      itree_traverse(donor->info) {
 	  /* copy all info rows for each column in independent memory */
 	  newcol = itree_create();
-	  s = xnstrdup(tree_getkey(donor->info));
+	  s = table_strdup(t, tree_getkey(donor->info));
 	  tree_add(t->info, s, newcol);
-	  table_freeondestroy(t, s);
 
 	  donorcol = tree_get(donor->info);
 	  itree_traverse(donorcol) {
-	       s = xnstrdup(itree_get(donorcol));
+	       s = itree_get(donorcol);		/* info cells may be empty */
+	       if (s)
+		    s = table_strdup(t, s);
 	       itree_add(newcol, itree_getkey(donorcol), s);
-	       table_freeondestroy(t, s);
 	  }
      }
      t->separator = donor->separator;
@@ -201,6 +239,7 @@ TABLE table_create_fromdonor(TABLE donor)
  */
 TREE *table_getheader(TABLE t)
 {
+     table_priv_usetrees(t);	/* callers walk the values */
      return t->data;
 }
 
@@ -214,6 +253,9 @@ TREE *table_getheader(TABLE t)
  */
 void table_destroy(TABLE t)
 {
+     int i;
+     struct table_arena *blk;
+
      if (t == NULL)
 	  return;
      if ( t->refcount == 0 ) {
@@ -249,6 +291,27 @@ void table_destroy(TABLE t)
 	  nfree( itree_get(t->tobegarbage) );
      itree_destroy(t->tobegarbage);
 
+     /* arena blocks */
+     while (t->arena) {
+	  blk = t->arena;
+	  t->arena = blk->next;
+	  nfree(blk);
+     }
+
+     /* column handles and row index */
+     for (i=0; i < t->ncolref; i++) {
+	  if (t->colref[i].rows)
+	       nfree(t->colref[i].rows);
+	  if (t->colref[i].vec)
+	       table_priv_vecfree(t->colref[i].vec);
+     }
+     if (t->colref)
+	  nfree(t->colref);
+     if (t->colhash)
+	  nfree(t->colhash);
+     if (t->rowkeys)
+	  nfree(t->rowkeys);
+
      nfree(t);
 }
 
@@ -264,6 +327,102 @@ void  table_freeondestroy(TABLE t, void *block)
 }
 
 
+/*
+ * Give the table an arena, so that memory allocated with table_alloc()
+ * and table_strdup() comes from large blocks owned by the table rather
+ * than individual allocations. The table's own copies of cells and names
+ * then cost a handful of nmalloc()s per table and table_destroy() frees 
+ * them by the block. Use for tables that are built and thrown away, such
+ * as samples. blksz is the size of each block or 0 for TABLE_ARENABLK.
+ * Memory from the arena must not be nfree()ed or given to 
+ * table_freeondestroy().
+ */
+void  table_usearena(TABLE t, size_t blksz)
+{
+     t->arenablk = blksz ? blksz : TABLE_ARENABLK;
+}
+
+
+/*
+ * Allocate len bytes that last for the life of the table, aligned to
+ * TABLE_ARENAALIGN. Comes from the table's arena if it has one, otherwise
+ * it is nmalloc()ed and given to table_freeondestroy().
+ * Always returns memory; will exit if unable to allocate
+ */
+void *table_alloc(TABLE t, size_t len)
+{
+     if ( ! t->arenablk ) {
+	  void *mem;
+
+	  mem = xnmalloc(len ? len : 1);
+	  table_freeondestroy(t, mem);
+	  return mem;
+     }
+
+     if (t->arena)
+	  t->arena->used = (t->arena->used + TABLE_ARENAALIGN-1) & 
+	       ~((size_t) TABLE_ARENAALIGN-1);
+     return table_priv_arenaalloc(t, len);
+}
+
+
+/* Return a copy of str that lasts for the life of the table, 
+ * as table_alloc() */
+char *table_strdup(TABLE t, const char *str)
+{
+     return table_strndup(t, str, strlen(str));
+}
+
+
+/* Return a '\0' terminated copy of the first len characters of str 
+ * that lasts for the life of the table, as table_alloc() */
+char *table_strndup(TABLE t, const char *str, size_t len)
+{
+     char *s;
+
+     if (t->arenablk)
+	  s = table_priv_arenaalloc(t, len+1);
+     else
+	  s = table_alloc(t, len+1);
+     memcpy(s, str, len);
+     s[len] = '\0';
+
+     return s;
+}
+
+
+/*
+ * Hold the table's cells in typed column stores rather than cell trees 
+ * (see struct table_colvec), so that numeric columns may be scanned as 
+ * arrays with table_colints() and table_coldbls(). Cell text is still 
+ * given by table_getcell() and the other cell calls, so existing code 
+ * works unchanged. Adding rows, setting and reading cells, scanning, 
+ * traversal, info and output work on the columns directly; calls that 
+ * need the cell trees, such as table_getheader(), table_getcol(), 
+ * table_rmrow() and the sorts, move the cells into trees first and the 
+ * table stays that way. Columns are typed when their `type' info is set.
+ * Returns 1 for success or 0 if the table already has rows.
+ */
+int   table_usecolumns(TABLE t)
+{
+     int h;
+
+     if (t->colvecs)
+	  return 1;
+     if (t->nrows)
+	  return 0;
+
+     t->colvecs = 1;
+     for (h=0; h < t->ncolref; h++)
+	  if (t->colref[h].cells) {
+	       t->colref[h].vec = table_priv_vecnew(t);
+	       table_priv_vectype(t, h);
+	  }
+
+     return 1;
+}
+
+
 /*
  * Add a row of data from the list row.
  * Cell data is xnmalloc'ed, that the caller may free the memory after use.
@@ -275,9 +434,17 @@ void  table_freeondestroy(TABLE t, void *block)
  */
 int table_addrow_alloc(TABLE t, TREE *row)
 {
-     int rowkey;
+     int rowkey, h;
      char *cellcpy;
 
+     if (t->colvecs) {
+	  rowkey = table_priv_vecappend(t);
+	  tree_traverse(row)
+	       if ((h = table_colhandle(t, tree_getkey(row))) != TABLE_NOHANDLE)
+		    table_priv_vecset(t, h, rowkey, tree_get(row), 1);
+	  return rowkey;
+     }
+
      rowkey = -1;
 
      tree_traverse(t->data) {
@@ -287,8 +454,7 @@ int table_addrow_alloc(TABLE t, TREE *row)
 	       cellcpy = NULL;
 	  } else {
 	       if (tree_get(row)) {
-		    cellcpy = xnstrdup(tree_get(row));
-		    table_freeondestroy(t, cellcpy);
+		    cellcpy = table_strdup(t, tree_get(row));
 	       } else {
 		    cellcpy = tree_get(row);
 	       }
@@ -300,6 +466,8 @@ int table_addrow_alloc(TABLE t, TREE *row)
 	  t->minrowkey = 0;
      t->nrows++;
      t->maxrowkey = rowkey;
+     table_priv_rowappend(t);
+     t->currow = t->nrows-1;
 
      return rowkey;
 }
@@ -319,7 +487,15 @@ int table_addrow_alloc(TABLE t, TREE *row)
  */
 int table_addrow_noalloc(TABLE t, TREE *row)
 {
-     int rowkey;
+     int rowkey, h;
+
+     if (t->colvecs) {
+	  rowkey = table_priv_vecappend(t);
+	  tree_traverse(row)
+	       if ((h = table_colhandle(t, tree_getkey(row))) != TABLE_NOHANDLE)
+		    table_priv_vecset(t, h, rowkey, tree_get(row), 0);
+	  return rowkey;
+     }
 
      rowkey = -1;
 
@@ -350,6 +526,8 @@ int table_addrow_noalloc(TABLE t, TREE *row)
 	  if (itree_getkey(tree_get(t->data)) != rowkey)
 	       itree_append(tree_get(t->data), NULL);
      }
+     table_priv_rowappend(t);
+     t->currow = t->nrows-1;
 
      return rowkey;
 }
@@ -374,21 +552,25 @@ int table_addrows_a(TABLE t, void ***array){
  */
 int table_addemptyrow(TABLE t)
 {
-     int rowkey;
+     int rowkey, h;
+
+     if (t->colvecs)
+	  return table_priv_vecappend(t);
 
      rowkey = -1;
 
      /* add blank cells to all columns */
-     tree_traverse(t->data) {
-	  rowkey = itree_append( tree_get(t->data), NULL );
-	  itree_last( tree_get(t->data) );
-     }
+     for (h=0; h < t->ncolref; h++)
+	  if (t->colref[h].cells)
+	       rowkey = itree_append( t->colref[h].cells, NULL );
 
      /* update counters */
      if ( t->nrows == 0 )
 	  t->minrowkey = 0;
      t->nrows++;
      t->maxrowkey = rowkey;
+     table_priv_rowappend(t);
+     t->currow = t->nrows-1;
 
      return rowkey;
 }
@@ -423,21 +605,18 @@ int table_addtable(TABLE t, TABLE rows, int expand) {
 	  /* create new columns to accommodate data */
 	  itree_traverse(rows->colorder) {
 	       if (tree_find(t->data, itree_get(rows->colorder))==TREE_NOVAL) {
-		    colname = xnstrdup(itree_get(rows->colorder));
+		    colname = table_strdup(t, itree_get(rows->colorder));
 		    table_addcol(t, colname, NULL);
-		    table_freeondestroy(t, colname);
 		    infocol = table_getinfocol(rows, colname);
 		    tree_traverse(infocol) {
 			 if (tree_find(t->infolookup,
 				       tree_getkey(infocol)) == TREE_NOVAL) {
-			      tmp = xnstrdup(tree_getkey(infocol));
+			      tmp = table_strdup(t, tree_getkey(infocol));
 			      table_addemptyinfo(t, tmp);
-			      table_freeondestroy(t, tmp);
 			 }
-			 tmp = xnstrdup(tree_get(infocol));
+			 tmp = table_strdup(t, tree_get(infocol));
 			 table_replaceinfocell(t, tree_getkey(infocol),
 					       colname, tmp);
-			 table_freeondestroy(t, tmp);
 		    }
 		    tree_destroy(infocol);
 	       }
@@ -461,9 +640,8 @@ int table_addtable(TABLE t, TABLE rows, int expand) {
 		* column headers are duplicated for saftey */
 	       t->ncols = rows->ncols;
 	       tree_traverse(rows->data) {
-		    tmp = xnstrdup(tree_get(rows->data));
-		    tree_add(t->data, tmp, itree_create());
-		    table_freeondestroy(t, tmp);
+		    tmp = table_strdup(t, tree_get(rows->data));
+		    table_priv_addcol(t, tmp, itree_create());
 	       }
 	  }
      }
@@ -492,53 +670,34 @@ int table_addtable(TABLE t, TABLE rows, int expand) {
 /* remove the row addressed by rowkey */
 void table_rmrow(TABLE t, int rowkey)
 {
-     ITREE *column=NULL;
-     int rowfound=0;
+     int row;
 
      if (t->nrows == 0)
 	  return;	/* nothing to remove */
+     table_priv_usetrees(t);
 
-     tree_traverse(t->data) {
-	  column = tree_get(t->data);
-	  if (itree_find(column, rowkey) != ITREE_NOVAL) {
-	       itree_rm(column);
-	       rowfound++;
-	  }
-     }
-
-     if ( ! rowfound )
+     row = table_rowindex(t, rowkey);
+     if (row == -1)
 	  return;	/* key not there to remove */
 
-     /* handling emptyness */
-     t->nrows--;
-     if (t->nrows == 0) {
-	  /* empty */
-	  t->minrowkey = t->maxrowkey = -1;
-     } else {
-	  /* update counter, first and last row indexes */
-	  itree_first(column);
-	  t->minrowkey = itree_getkey(column);
-	  itree_last(column);
-	  t->maxrowkey = itree_getkey(column);
-     }
+     table_priv_rowremove(t, row);
+     if (t->currow > row)
+	  t->currow--;	/* stay on the same row */
 }
 
 
 /* return the location of the cell addressed by rowkey,colname */
 void *table_getcell(TABLE t, int rowkey, char *colname)
 {
-  ITREE *column;
-  void *celldata;
+     int h, row;
 
-  /* find cell */
-  column = tree_find(t->data, colname);
-  if ( column == TREE_NOVAL )
-    return NULL;
-  celldata = itree_find(column, rowkey);
-  if ( celldata == ITREE_NOVAL )
-    return NULL;
+     /* find cell */
+     if ((h = table_colhandle(t, colname)) == TABLE_NOHANDLE)
+	  return NULL;
+     if ((row = table_rowindex(t, rowkey)) == -1)
+	  return NULL;
 
-  return celldata;
+     return table_getcell_h(t, row, h);
 }
 
 
@@ -555,6 +714,8 @@ int    table_search(TABLE t, char *haystack, char *needle)
      int rowidx;
      ITREE *c;
 
+     table_priv_usetrees(t);
+
      /* get column's ITREE (the selected haystack) and search for needle */
      c = tree_find(t->data, haystack);
      if (c == TREE_NOVAL)
@@ -564,10 +725,7 @@ int    table_search(TABLE t, char *haystack, char *needle)
 	  return -1;
 
      /* set the current row to the one that contains the key */
-     tree_traverse(t->data) {
-	  c = tree_get(t->data);
-	  itree_find(c, rowidx);
-     }
+     t->currow = table_rowindex(t, rowidx);
 
      return rowidx;
 }
@@ -607,21 +765,22 @@ int    table_search2(TABLE t, char *haystack1, char *needle1, char *haystack2,
 int table_replacecell_alloc(TABLE t, int rowkey, char *colname, 
 			    char *newcelldata)
 {
-     ITREE *column;
-     void *celldata, *dupnewdata;
+     int h, row;
+     void *dupnewdata;
 
      /* find cell */
-     column = tree_find(t->data, colname);
-     if ( column == TREE_NOVAL)
+     if ((h = table_colhandle(t, colname)) == TABLE_NOHANDLE)
           return 0;
-     celldata = itree_find(column, rowkey);
-     if ( celldata == ITREE_NOVAL )
+     if ((row = table_rowindex(t, rowkey)) == -1)
           return 0;
+     if (t->colvecs) {
+	  table_priv_vecset(t, h, row, newcelldata, 1);
+	  return 1;
+     }
 
      /* free previous inhabitant and set new one */
-     dupnewdata = xnstrdup(newcelldata);
-     itree_put(column, dupnewdata);
-     table_freeondestroy(t, dupnewdata);
+     dupnewdata = table_strdup(t, newcelldata);
+     table_replacecell_h(t, row, h, dupnewdata);
 
      return 1;
 }
@@ -636,21 +795,16 @@ int table_replacecell_alloc(TABLE t, int rowkey, char *colname,
 int table_replacecell_noalloc(TABLE t, int rowkey, char *colname, 
 			      char *newcelldata)
 {
-  ITREE *column;
-  void *celldata;
-
-  /* find cell */
-  column = tree_find(t->data, colname);
-  if ( column == TREE_NOVAL )
-    return 0;
-  celldata = itree_find(column, rowkey);
-  if ( celldata == ITREE_NOVAL )
-    return 0;
+     int h, row;
 
-  /* free previous inhabitant and set new one */
-  itree_put(column, newcelldata);
+     /* find cell */
+     if ((h = table_colhandle(t, colname)) == TABLE_NOHANDLE)
+	  return 0;
+     if ((row = table_rowindex(t, rowkey)) == -1)
+	  return 0;
 
-  return 1;
+     /* free previous inhabitant and set new one */
+     return table_replacecell_h(t, row, h, newcelldata);
 }
 
 
@@ -662,20 +816,19 @@ int table_replacecell_noalloc(TABLE t, int rowkey, char *colname,
  */
 TREE *table_getrow(TABLE t, int rowkey)
 {
-  TREE *row;
-  ITREE *column;
+     TREE *row;
+     int r, h;
 
-  row = tree_create();
-  tree_traverse(t->data) {
-    column = tree_get(t->data);
-    if ( itree_find(column, rowkey) == ITREE_NOVAL) {
-      elog_printf(DEBUG, "cant find row key %d", rowkey);
-      return NULL;
-    }
-    tree_add(row, tree_getkey(t->data), itree_get(column));
-  }
+     if ((r = table_rowindex(t, rowkey)) == -1) {
+	  elog_printf(DEBUG, "cant find row key %d", rowkey);
+	  return NULL;
+     }
+     row = tree_create();
+     for (h=0; h < t->ncolref; h++)
+	  if (t->colref[h].cells)
+	       tree_add(row, t->colref[h].name, table_getcell_h(t, r, h));
 
-  return row;
+     return row;
 }
 
 
@@ -689,6 +842,7 @@ ITREE *table_getcol(TABLE t, char *colname)
 {
   ITREE *column, *newcolumn = NULL;
 
+  table_priv_usetrees(t);
   column = tree_find(t->data, colname);
   if (column == TREE_NOVAL) {
        return NULL;
@@ -723,6 +877,7 @@ ITREE *table_getsortedcol(TABLE t, char *colname)
      if (t->roworder == NULL)
 	  return table_getcol(t, colname);
 
+     table_priv_usetrees(t);
      column = tree_find(t->data, colname);
      if (column == TREE_NOVAL) {
 	  return NULL;
@@ -766,6 +921,18 @@ int table_addcol(TABLE t, char *colname, ITREE *coldata)
      if (table_hascol(t, colname))
 	  return -1;	/* already have column */
 
+     if (t->colvecs) {
+	  if (coldata)
+	       table_priv_usetrees(t);
+	  else {
+	       /* a blank column store */
+	       table_priv_addcol(t, colname, itree_create());
+	       itree_append(t->colorder, colname);
+	       t->ncols++;
+	       return t->nrows;
+	  }
+     }
+
      if (t->nrows) {
 	  /* --- table has existing data --- */
 
@@ -812,7 +979,7 @@ int table_addcol(TABLE t, char *colname, ITREE *coldata)
      }
 
      /* add new column to table and return. */
-     tree_add(t->data, colname, newcol);
+     table_priv_addcol(t, colname, newcol);
      itree_append(t->colorder, colname);
      t->ncols++;
      return t->nrows;
@@ -829,6 +996,7 @@ void table_rmcol(TABLE t, char *colname)
 	  return;
 
      /* column exists, so remove it */
+     table_priv_rmcolref(t, table_colhandle(t, colname));
      itree_destroy(collist);
      tree_rm(t->data);
      t->ncols--;
@@ -853,6 +1021,7 @@ int    table_renamecol(TABLE t, char *oldcolname, char *newcolname)
 {
      char *name;
      void *data;
+     int h;
 
      if (tree_find(t->data, newcolname) != TREE_NOVAL)
 	  return 0;	/* failure - new col name already exists */
@@ -861,12 +1030,14 @@ int    table_renamecol(TABLE t, char *oldcolname, char *newcolname)
 	  return 0;	/* failure - rename col not there */
 
      /* make and register new nme */
-     name = xnstrdup(newcolname);
-     table_freeondestroy(t, name);
+     name = table_strdup(t, newcolname);
 
-     /* update data: colnames */
+     /* update data: colnames and handle, which is unchanged */
+     h = table_colhandle(t, oldcolname);
      tree_rm(t->data);
      tree_add(t->data, name, data);
+     t->colref[h].name = name;
+     table_priv_hashcols(t);
 
      /* update col order list: change name but keep same order */
      itree_traverse(t->colorder)
@@ -941,6 +1112,7 @@ int *table_datawidths(TABLE t, int fromrowkey, int torowkey, ITREE *cols)
 
   if (itree_n(cols) == 0)
        return NULL;
+  table_priv_usetrees(t);
 
   cw = xnmalloc( itree_n(cols) * sizeof(int) );
   ncol = 0;
@@ -1090,6 +1262,8 @@ char *table_printselect(TABLE t, int fromrowkey, int torowkey, ITREE *colorder)
   char *output, *outputpt, fmt[TABLE_FMTLEN];
   int maxwidth, i, j, colindex, outalloc, *widths, ncols;
 
+  table_priv_usetrees(t);
+
   /* get the column widths in an nmalloced array of int */
   widths = table_colwidths(t, fromrowkey, torowkey, colorder);
   if ( ! widths )
@@ -1173,6 +1347,8 @@ char *table_html(TABLE t, int fromrowkey, int torowkey, ITREE *colorder)
   int outlen, outalloc, i, fromrow=0, torow=0;
   ITREE *attr, *col;
 
+  table_priv_usetrees(t);
+
   /* set defaults */
   if (colorder)
        attr = colorder;
@@ -1266,30 +1442,15 @@ char *table_html(TABLE t, int fromrowkey, int torowkey, ITREE *colorder)
  */
 char *table_outheader(TABLE t)
 {
-     int i=0;
-     char *outbuf, *outpt;
+     struct table_outbuf out;
 
      /* return if no columns */
      if (t == NULL || t->ncols == 0)
 	  return NULL;
 
-     /* get size of buffer */
-     tree_traverse(t->data)
-	  i += strlen( tree_getkey(t->data) )+3;
-
-     /* allocate and copy headers */
-     outpt = outbuf = xnmalloc(i);
-     itree_traverse(t->colorder) {
-	  if (tree_find(t->data, itree_get(t->colorder)) == TREE_NOVAL)
-	       continue;
-	  util_quotestr(tree_getkey(t->data), "\t", outpt, i-(outpt-outbuf));
-	  while (*outpt)
-	       outpt++;
-	  *(outpt++) = t->separator;
-     }
-     *(--outpt) = '\0';
-
-     return outbuf;
+     table_outbuf_init(&out, 0);
+     table_outheader_buf(t, &out);
+     return out.buf;
 }
 
 
@@ -1302,46 +1463,10 @@ char *table_outheader(TABLE t)
  */
 char *table_outinfo(TABLE t)
 {
-     int toklen, bufalloc;
-     char *outbuf, *outpt, *tok, *newbuf, strbuf[8000];
-
-     /* return if no data or info */
-     if (t == NULL || t->ncols == 0 || tree_n(t->infolookup) == 0)
-	  return NULL;
-
-     /* allocate fixed buffer for speed */
-     bufalloc = TABLE_OUTINFOBUFSZ;
-     outpt = outbuf = xnmalloc(TABLE_OUTINFOBUFSZ);
-
-     /* allocate and copy headers */
-     tree_traverse(t->infolookup) {
-	  itree_traverse(t->colorder) {
-	       tok = "";
-	       if (tree_find(t->info, itree_get(t->colorder)) != TREE_NOVAL)
-		    if (itree_find(tree_get(t->info), (int) (long)
-				   tree_get(t->infolookup)) != TREE_NOVAL)
-		         tok = util_quotestr( itree_get( tree_get(t->info) ), 
-					      "\t", strbuf, 8000 );
-	       toklen = strlen(tok);
-	       if (toklen + outpt > outbuf + bufalloc + 100) {
-		    /* enlarge buffer and adjust pointers */
-		    bufalloc += TABLE_OUTINFOBUFSZ;
-		    newbuf = xnrealloc(outbuf, bufalloc);
-		    outpt += outbuf - newbuf;
-		    outbuf = newbuf;
-	       }
-	       strcpy(outpt, tok);
-	       outpt += toklen;
-	       *(outpt++) = t->separator;
-	  }
-	  tok = util_quotestr( tree_getkey(t->infolookup), 
-			       "\t", outpt, bufalloc - (outpt-outbuf) );
-	  outpt += strlen(tok);	/* assume max 100 chars */
-	  *(outpt++) = '\n';
-     }
-     *(outpt-1) = '\0';
+     struct table_outbuf out;
 
-     return outbuf;
+     table_outbuf_init(&out, 0);
+     return table_priv_outstr(&out, table_outinfo_buf(t, &out));
 }
 
 
@@ -1351,57 +1476,10 @@ char *table_outinfo(TABLE t)
  */
 char *table_outbody(TABLE t)
 {
-     int alloc=0, used=0, len;
-     char *outbuf, *outpt, *tok, *oldbuf, strbuf[8000], *cell;
-     ITREE *col;
-
-     /* return if no data */
-     if (t == NULL || t->nrows == 0)
-	  return NULL;
-
-     /* get size of buffer */
-     tree_traverse(t->data) {
-	  col = tree_get(t->data);
-	  itree_traverse(col)
-	       if ( itree_get(col) )
-		    alloc += strlen( itree_get(col) )+3;
-	       else
-		    alloc += 3;
-     }
-
-     if (alloc == 0)
-	  return NULL;
-
-     /* allocate and copy body cells */
-     outpt = outbuf = xnmalloc(alloc);
-     table_traverse(t) {
-	  itree_traverse(t->colorder) {
-	       /* get each cell, quote it and copy into buffer. If the
-		* buffer is too small, allocate a bigger one */
-	       cell = table_getcurrentcell(t, itree_get(t->colorder));
-	       tok = util_quotestr(cell, "\t", strbuf, 8000 );
-	       len = strlen(tok);
-	       used += len+1;	/* include the additional trailing space */
-	       if (used+1 > alloc) {
-		    /* allocate more memory to fit the current requirement, 
-		     * plus some more (64 at mo) */
-		    alloc = used+64;
-		    oldbuf = outbuf;
-		    outbuf = xnrealloc(outbuf, alloc);
-		    if (outbuf != oldbuf)
-			 /* location of buffer has changed: so adjust */
-			 outpt += outbuf-oldbuf;
-	       }
-	       strcpy(outpt, tok);
-	       outpt += len;
-	       *(outpt++) = t->separator;
-	  }
-	  *(outpt-1) = '\n';
-     }
-     *(outpt) = '\0';
+     struct table_outbuf out;
 
-
-     return outbuf;
+     table_outbuf_init(&out, 0);
+     return table_priv_outstr(&out, table_outbody_buf(t, &out));
 }
 
 
@@ -1422,6 +1500,7 @@ char *table_outrows(TABLE t, 		/* table */
      /* return if no data */
      if (t == NULL || t->nrows == 0)
 	  return NULL;
+     table_priv_usetrees(t);
 
      /* get size of buffer */
      tree_traverse(t->data) {
@@ -1495,30 +1574,12 @@ char *table_outrows(TABLE t, 		/* table */
  */
 char *table_outtable(TABLE t)
 {
-     char *header, *info, *body, *output;
-
      /* return if no data */
      if (t == NULL || t->nrows == 0)
 	  return NULL;
 
-     /* get data */
-     header = table_outheader(t);
-     info = table_outinfo(t);
-     body = table_outbody(t);
-
-     /* perform joins, depending on data */
-     if (info)
-	  output = util_strjoin(header, "\n", info, "\n--\n", body, NULL);
-     else
-	  output = util_strjoin(header, "\n--\n", body, NULL);
-
-     /* clean up */
-     nfree(header);
-     if (info)
-	  nfree(info);
-     nfree(body);
-
-     return output;
+     return table_outtable_full(t, t->separator, TABLE_WITHCOLNAMES, 
+				TABLE_WITHINFO);
 }
 
 
@@ -1549,43 +1610,271 @@ char *table_outtable(TABLE t)
  */
 char  *table_outtable_full(TABLE t, char sep, int withcolnames, int withinfo)
 {
-     char *header=NULL, *info=NULL, *body, *output, origsep;
+     struct table_outbuf out;
 
      /* return if no data */
      if (t == NULL || t->nrows == 0)
 	  return NULL;
 
-     /* get data */
-     origsep = t->separator;
-     t->separator = sep;
-     if (withcolnames)
-	  header = table_outheader(t);
-     if (withinfo)
-	  info = table_outinfo(t);
-     body = table_outbody(t);
-
-     /* perform joins and free working data after use, depending on what 
-      * has been asked for and if info is available */
-     if (withcolnames) {
-	  if (withinfo) {
-	       if (info) {
-		    output = util_strjoin(header, "\n", info, "\n--\n", body, 
-					  NULL);
-		    nfree(info);
-	       } else {
-		    output = util_strjoin(header, "\n--\n", body, NULL);
-	       }
-	  } else {
-	       output = util_strjoin(header, "\n--\n", body, NULL);
-	  }
-	  nfree(header);
-	  nfree(body);
-     } else {
-	  output = body;
-     }
+     table_outbuf_init(&out, 0);
+     return table_priv_outstr(&out, table_outtable_buf(t, &out, sep, 
+						       withcolnames, 
+						       withinfo));
+}
 
-     t->separator = origsep;
-     return output;
+
+
+/*
+ * Streaming serialisation.
+ * The table_out*_buf() functions append the same text as their 
+ * table_out*() equivalents to a caller's struct table_outbuf, in a single
+ * pass over the table and without intermediate strings. The buffer 
+ * grows as needed and may be reset and reused for the next table, so 
+ * that a steady state writer does not allocate at all.
+ */
+
+
+/*
+ * Initialise an output buffer, keeping `head' bytes free at its start.
+ * Text is appended after the head, which the consumer of the buffer may 
+ * then fill with a prefix, such as a storage record header, to send 
+ * prefix and text on together without copying.
+ * Release with table_outbuf_free().
+ */
+void   table_outbuf_init(struct table_outbuf *out, int head)
+{
+     out->head  = head;
+     out->alloc = head + TABLE_OUTBLOCKSZ;
+     out->buf   = xnmalloc(out->alloc);
+     table_outbuf_reset(out);
+}
+
+
+/* Empty the buffer of text, keeping its allocation for reuse */
+void   table_outbuf_reset(struct table_outbuf *out)
+{
+     out->len = out->head;
+     out->buf[out->len] = '\0';
+}
+
+
+/* Free the buffer's storage */
+void   table_outbuf_free(struct table_outbuf *out)
+{
+     if (out->buf)
+	  nfree(out->buf);
+     out->buf = NULL;
+     out->len = out->alloc = 0;
+}
+
+
+/* Make sure that there is space for n more characters plus the 
+ * terminating '\0', growing the buffer by doubling */
+void   table_outbuf_need(struct table_outbuf *out, int n)
+{
+     if (out->len + n + 1 <= out->alloc)
+	  return;
+     out->alloc *= 2;
+     if (out->alloc < out->len + n + 1)
+	  out->alloc = out->len + n + 1 + TABLE_OUTBLOCKSZ;
+     out->buf = xnrealloc(out->buf, out->alloc);
+}
+
+
+/* Append len characters of str to the buffer */
+void   table_outbuf_add(struct table_outbuf *out, char *str, int len)
+{
+     table_outbuf_need(out, len);
+     memcpy(out->buf + out->len, str, len);
+     out->len += len;
+     out->buf[out->len] = '\0';
+}
+
+
+/*
+ * Append the header of the table, as table_outheader(), to out.
+ * Returns the number of characters appended
+ */
+int    table_outheader_buf(TABLE t, struct table_outbuf *out)
+{
+     int start;
+
+     if (t == NULL || t->ncols == 0)
+	  return 0;
+
+     start = out->len;
+     itree_traverse(t->colorder) {
+	  if (tree_find(t->data, itree_get(t->colorder)) == TREE_NOVAL)
+	       continue;
+	  table_priv_outcell(out, tree_getkey(t->data), t->separator);
+     }
+     if (out->len > start)
+	  out->buf[--out->len] = '\0';	/* lose the trailing separator */
+
+     return out->len - start;
+}
+
+
+/*
+ * Append the info lines of the table, as table_outinfo(), to out.
+ * Returns the number of characters appended, 0 if there is no info
+ */
+int    table_outinfo_buf(TABLE t, struct table_outbuf *out)
+{
+     int start, infokey;
+     ITREE *col;
+
+     if (t == NULL || t->ncols == 0 || tree_n(t->infolookup) == 0)
+	  return 0;
+
+     start = out->len;
+     tree_traverse(t->infolookup) {
+	  infokey = (int) (long) tree_get(t->infolookup);
+	  itree_traverse(t->colorder) {
+	       col = tree_find(t->info, itree_get(t->colorder));
+	       if (col != TREE_NOVAL && itree_find(col, infokey) != ITREE_NOVAL)
+		    table_priv_outcell(out, itree_get(col), t->separator);
+	       else
+		    table_outbuf_add(out, &t->separator, 1);
+	  }
+	  table_priv_outcell(out, tree_getkey(t->infolookup), '\n');
+     }
+     out->buf[--out->len] = '\0';	/* lose the final new line */
+
+     return out->len - start;
+}
+
+
+/*
+ * Append the body of the table, as table_outbody(), to out.
+ * Returns the number of characters appended, 0 if there is no data
+ */
+int    table_outbody_buf(TABLE t, struct table_outbuf *out)
+{
+     int i, ncols, start, *handles;
+
+     if (t == NULL || t->nrows == 0 || t->ncols == 0)
+	  return 0;
+
+     /* resolve the columns to print once */
+     handles = xnmalloc(sizeof(int) * (itree_n(t->colorder) + 1));
+     ncols = 0;
+     itree_traverse(t->colorder)
+	  handles[ncols++] = table_colhandle(t, itree_get(t->colorder));
+     if (ncols == 0) {
+	  nfree(handles);
+	  return 0;
+     }
+
+     start = out->len;
+     table_traverse(t) {
+	  for (i=0; i < ncols; i++)
+	       table_priv_outcell(out, table_getcurrentcell_h(t, handles[i]),
+				  t->separator);
+	  out->buf[out->len-1] = '\n';	/* last separator ends the line */
+     }
+     nfree(handles);
+
+     return out->len - start;
+}
+
+
+/*
+ * Append the whole table, as table_outtable_full(), to out.
+ * Returns the number of characters appended, 0 if there are no rows
+ */
+int    table_outtable_buf(TABLE t, struct table_outbuf *out, char sep, 
+			  int withcolnames, int withinfo)
+{
+     int start, mark;
+     char origsep;
+
+     /* return if no data */
+     if (t == NULL || t->nrows == 0)
+	  return 0;
+
+     start = out->len;
+     origsep = t->separator;
+     t->separator = sep;
+     if (withcolnames) {
+	  table_outheader_buf(t, out);
+	  if (withinfo) {
+	       mark = out->len;
+	       table_outbuf_add(out, "\n", 1);
+	       if (table_outinfo_buf(t, out) == 0) {
+		    out->len = mark;		/* no info: take back the \n */
+		    out->buf[mark] = '\0';
+	       }
+	  }
+	  table_outbuf_add(out, "\n--\n", 4);
+     }
+     table_outbody_buf(t, out);
+     t->separator = origsep;
+
+     return out->len - start;
+}
+
+
+/*
+ * Append cell to out followed by the character sep, quoting it in the 
+ * same way as util_quotestr() if it contains a tab: empty cells become 
+ * "" and quoted cells have their quotes and new lines escaped.
+ */
+void table_priv_outcell(struct table_outbuf *out, char *cell, char sep)
+{
+     int len;
+     char *pt;
+
+     if (cell == NULL || *cell == '\0') {
+	  table_outbuf_need(out, 3);
+	  pt = out->buf + out->len;
+	  *pt++ = '"';
+	  *pt++ = '"';
+	  *pt++ = sep;
+	  *pt   = '\0';
+	  out->len += 3;
+	  return;
+     }
+
+     len = strcspn(cell, "\t");
+     if (cell[len] == '\0') {
+	  /* plain cell, copied as is */
+	  table_outbuf_need(out, len+1);
+	  pt = out->buf + out->len;
+	  memcpy(pt, cell, len);
+	  pt[len++] = sep;
+	  pt[len]   = '\0';
+	  out->len += len;
+	  return;
+     }
+
+     /* quote and escape */
+     len += strlen(cell+len);
+     table_outbuf_need(out, len+3);
+     pt = out->buf + out->len;
+     *pt++ = '"';
+     for (; *cell; cell++)
+	  if (*cell == '"')
+	       *pt++ = '\001';
+	  else if (*cell == '\n')
+	       *pt++ = '\002';
+	  else
+	       *pt++ = *cell;
+     *pt++ = '"';
+     *pt++ = sep;
+     *pt   = '\0';
+     out->len += len+3;
+}
+
+
+/* Return the text of out as a string to be nfree()ed by the caller, or 
+ * NULL and free out if n, the length of text, is 0 */
+char *table_priv_outstr(struct table_outbuf *out, int n)
+{
+     if (n > 0)
+	  return out->buf;
+     table_outbuf_free(out);
+     return NULL;
 }
 
 
@@ -1634,23 +1923,37 @@ char  *table_outtable_full(TABLE t, char sep, int withcolnames, int withinfo)
 int table_scan(TABLE t, char *buffer, char *sepstr, int mode, 
 	       int hascolnames, int hasruler)
 {
-     int i, nlines, ncols, line, row_ncols;
-     ITREE *colnames=NULL, *row, *parselist=NULL;
+     struct util_scantoks toks = UTIL_SCANTOKSINIT;
+     int i, c, nlines=-1, ncols, line, first, row_ncols, *handles;
+     ITREE *parselist=NULL, *row;
      char tmp[20], *tmpcpy, *iname;
 
-     /* scan the buffer into word lists */
-     if (mode == TABLE_SINGLESEP)
-          nlines = util_scantext(buffer, sepstr, UTIL_SINGLESEP, &parselist);
-     else if (mode == TABLE_MULTISEP)
-          nlines = util_scantext(buffer, sepstr, UTIL_MULTISEP, &parselist);
-     else if (mode == TABLE_CFMODE)
+     /* split the buffer into fields in place */
+     if (mode == TABLE_SINGLESEP) {
+          nlines = util_scantoks(buffer, sepstr, UTIL_SINGLESEP, &toks);
+     } else if (mode == TABLE_MULTISEP) {
+          nlines = util_scantoks(buffer, sepstr, UTIL_MULTISEP, &toks);
+     } else if (mode == TABLE_CFMODE) {
+	  /* config rules remove comments and are scanned into lists, 
+	   * which are flattened into fields */
           nlines = util_scancftext(buffer, sepstr, NULL, &parselist);
-     if (nlines == -1) {
-	  if (parselist)
+	  if (parselist) {
+	       itree_traverse(parselist) {
+		    row = itree_get(parselist);
+		    first = toks.nfields;
+		    itree_traverse(row)
+			 util_scantoks_add(&toks, itree_get(row));
+		    util_scantoks_endline(&toks, first);
+	       }
 	       util_scanfree(parselist);
+	  }
+     }
+     if (nlines == -1) {
+	  util_scantoksfree(&toks);
 	  return -1;		/* error */
      }
      if (nlines == 0) {
+	  util_scantoksfree(&toks);
 	  return 0;		/* empty buffer */
      }
 
@@ -1663,38 +1966,36 @@ int table_scan(TABLE t, char *buffer, char *sepstr, int mode,
      if (nlines < i) {
           elog_printf(ERROR, "Need %d lines in buffer, only have %d",
 		      i, nlines);
-	  util_scanfree(parselist);
+	  util_scantoksfree(&toks);
 	  return -1;
      }
      if (nlines == i) {
-	  util_scanfree(parselist);
+	  util_scantoksfree(&toks);
 	  return 0;
      }
 
      /* check the number of buffer columns match ours */
      ncols = 0;
-     itree_first(parselist);
+     line = 0;
      if (hascolnames) {
-	  ncols = itree_n(itree_get(parselist));
+	  ncols = util_scantoks_nfields(&toks, 0);
 	  if (t->ncols && ncols != t->ncols) {
-	       util_scanfree(parselist);
+	       util_scantoksfree(&toks);
 	       elog_printf(ERROR, "Header cols (%d) and table cols "
 			   "(%d) do not match", ncols, t->ncols);
 	       return -1;
 	  }
-	  itree_next(parselist);
+	  line++;
      }
      if (hasruler) {
-	  while ( ! itree_isbeyondend(parselist) ) {
-	       row = itree_get(parselist);
-	       row_ncols = itree_n(row);
-	       if (strncmp(itree_find(row, 0), "--", 2) == 0) {
-	       /*if ( *( (char *) itree_find(row, 0) ) == '-' ) {*/
-		    itree_next(parselist);
+	  while (line < nlines) {
+	       row_ncols = util_scantoks_nfields(&toks, line);
+	       if (strncmp(util_scantoks_get(&toks, line, 0), "--", 2) == 0) {
+		    line++;
 		    break;
 	       }
 	       if (t->ncols && row_ncols != t->ncols+1) {
-		    util_scanfree(parselist);
+		    util_scantoksfree(&toks);
 		    elog_printf(ERROR, "info cols (%d+1) and header "
 				"(%d) do not match", row_ncols, t->ncols);
 		    return -1;
@@ -1702,23 +2003,21 @@ int table_scan(TABLE t, char *buffer, char *sepstr, int mode,
 	       if (ncols == 0)
 		    ncols = row_ncols-1;
 	       if (ncols && row_ncols != ncols+1) {
-		    util_scanfree(parselist);
+		    util_scantoksfree(&toks);
 		    elog_printf(DIAG, "info cols (%d+1) and header "
 				"(%d) do not match", row_ncols, ncols);
 		    return -1;
 	       }
-	       itree_next(parselist);
+	       line++;
 	  }
      }
-     line = 1;
-     while ( ! itree_isbeyondend(parselist) ) {
-	  row = itree_get(parselist);
-	  row_ncols = itree_n(row);
+     for (i=line; i < nlines; i++) {
+	  row_ncols = util_scantoks_nfields(&toks, i);
 	  if (t->ncols && row_ncols != t->ncols) {
 	       elog_printf(DIAG, "scanned text at data line %d has %d "
 			   "cols not %d cols expected by table",
-			   line, row_ncols, t->ncols);
-	       util_scanfree(parselist);
+			   i-line+1, row_ncols, t->ncols);
+	       util_scantoksfree(&toks);
 	       return -1;
 	  }
 	  if (ncols == 0)
@@ -1726,31 +2025,28 @@ int table_scan(TABLE t, char *buffer, char *sepstr, int mode,
 	  if (ncols && row_ncols != ncols) {
 	       elog_printf(DIAG, "scanned text at data line %d has %d "
 			   "cols not %d cols expected by header",
-			   line, row_ncols, ncols);
-	       util_scanfree(parselist);
+			   i-line+1, row_ncols, ncols);
+	       util_scantoksfree(&toks);
 	       return -1;
 	  }
-	  itree_next(parselist);
-	  line++;
      }
 
-     /* check the header names matches our table's */
-     itree_first(parselist);
-     line = 1;
+     /* set up the table's columns from the header or by default, then
+      * resolve the handle of each buffer column */
+     line = 0;
      if (hascolnames) {
-	  colnames = itree_get(parselist);
 	  if (t->ncols) {
 	       /* check the column headers match the existing ones */
 	       /* NOT IMPLEMENTED YET */
 	  } else {
 	       /* use the column headers to setup this table */
 	       t->ncols = ncols;
-	       itree_traverse(colnames) {
-		    tree_add(t->data, itree_get(colnames), itree_create());
-		    itree_append(t->colorder, itree_get(colnames));
+	       for (c=0; c < ncols; c++) {
+		    iname = util_scantoks_get(&toks, 0, c);
+		    table_priv_addcol(t, iname, itree_create());
+		    itree_append(t->colorder, iname);
 	       }
 	  }
-	  itree_next(parselist);
 	  line++;
      } else {
 	  if (t->ncols) {
@@ -1762,82 +2058,68 @@ int table_scan(TABLE t, char *buffer, char *sepstr, int mode,
 	       for (i=0; i<ncols; i++) {
 		    /* create data to be freed on destruction */
 		    sprintf(tmp, "column_%d", i);
-		    tmpcpy = xnstrdup(tmp);
-		    tree_add(t->data, tmpcpy, itree_create());
+		    tmpcpy = table_strdup(t, tmp);
+		    table_priv_addcol(t, tmpcpy, itree_create());
 		    itree_append(t->colorder, tmpcpy);
-		    table_freeondestroy(t, tmpcpy);
 	       }
 	  }
      }
+     handles = xnmalloc(sizeof(int) * (t->ncols + 1));
+     c = 0;
+     if (hascolnames) {
+	  for (c=0; c < ncols; c++)
+	       handles[c] = table_colhandle(t, util_scantoks_get(&toks, 0, c));
+     } else {
+	  /* by not providing headers we have to follow t->colorder for 
+	   * the assignment of tokens to columns */
+	  itree_traverse(t->colorder)
+	       handles[c++] = table_colhandle(t, itree_get(t->colorder));
+     }
 
      /* scan for info lines if a ruler is present */
      if (hasruler) {
-	  while (line <= nlines) {
-	       row = itree_get(parselist);
-	       itree_first(row);
-	       if (strncmp(itree_get(itree_get(parselist)), "--", 2) == 0) {
-	       /*if (*((char *)itree_get(itree_get(parselist))) == '-') {*/
+	  while (line < nlines) {
+	       if (strncmp(util_scantoks_get(&toks, line, 0), "--", 2) == 0) {
 		    /* ruler found */
-		    itree_next(parselist);
 		    line++;
 		    break;
 	       }
 
 	       /* info line - create an empty info row */
-	       itree_last(row);
-	       iname = itree_get(row);
-	       i = table_addemptyinfo(t, iname);
+	       row_ncols = util_scantoks_nfields(&toks, line);
+	       iname = util_scantoks_get(&toks, line, row_ncols-1);
+	       table_addemptyinfo(t, iname);
 
 	       /* add to row */
-	       itree_first(row);
-	       itree_traverse(t->colorder) {
+	       c = 0;
+	       itree_traverse(t->colorder)
 		    table_replaceinfocell(t, iname, itree_get(t->colorder),
-					  itree_get(row));
-		    itree_next(row);
-	       }
-
-	       itree_next(parselist);
+					  util_scantoks_get(&toks, line, c++));
 	       line++;
 	  }
      }
 
-     /* add remaining lines to table */
-
-     /* reset linecounter: this represents the number of non-header
-     * lines parsed and should be equal to nrows */
-     nlines -= line-1;
-
-     /* by not providing headers we have to follow t->colorder for the 
-      * assignment of tokens to columns. */
-     if ( ! hascolnames) {
-	  colnames = itree_create();
-	  tree_traverse(t->colorder)
-	       itree_append(colnames, itree_get(t->colorder));
-     }
-
-     while( ! itree_isbeyondend(parselist) ) {
-	  itree_first(colnames);
-	  row = itree_get(parselist);
+     /* add remaining lines to table, directly by column handle */
+     for (i=line; i < nlines; i++) {
 	  table_addemptyrow(t);
-	  itree_traverse(row) {
-	       if (table_replacecurrentcell(t, itree_get(colnames), 
-					    itree_get(row)) == 0) {
+	  row_ncols = util_scantoks_nfields(&toks, i);
+	  for (c=0; c < row_ncols; c++) {
+	       if (table_replacecurrentcell_h(t, handles[c], 
+					      util_scantoks_get(&toks,i,c))
+		   == 0) {
 		    /* insertion failed */
-		    util_scanfree(parselist);
-		    if ( ! hascolnames )
-			 itree_destroy(colnames);
+		    nfree(handles);
+		    util_scantoksfree(&toks);
 		    return -1;
 	       }
-	       itree_next(colnames);
 	  }
-	  itree_next(parselist);
      }
 
-     /* clear up and return */
-     util_scanfree(parselist);
-     if ( ! hascolnames )
-	  itree_destroy(colnames);
-     return nlines;
+     /* clear up and return the number of non-header lines, which should
+      * equal the rows added */
+     nfree(handles);
+     util_scantoksfree(&toks);
+     return nlines - line;
 }
 
 
@@ -1908,126 +2190,99 @@ ITREE *table_colnames(TABLE t)
  * if not followed by a traversal friendly command then the current 
  * position will be unknown
  * understand the concept of rowkey
+ * The current row is held as a row index, so moving it does not 
+ * involve the columns.
  */
 void table_first(TABLE t)
 {
-     int datakey;
-
      if (t->roworder) {
-       itree_first(t->roworder);
-       datakey = (int) (long) itree_get(t->roworder);
-       tree_traverse(t->data)
-	    itree_find( (ITREE *) tree_get(t->data), datakey );
+	  itree_first(t->roworder);
+	  table_priv_setcursor(t);
      } else {
-          tree_traverse(t->data)
-	       itree_first( (ITREE *) tree_get(t->data) );
+	  t->currow = 0;
      }
 }
 
 void table_next(TABLE t)
 {
-     int datakey;
-
      if (t->roworder) {
-       itree_next(t->roworder);
-       datakey = (int) (long) itree_get(t->roworder);
-       tree_traverse(t->data)
-	    itree_find( (ITREE *) tree_get(t->data), datakey );
+	  itree_next(t->roworder);
+	  table_priv_setcursor(t);
+     } else if (t->currow >= t->nrows) {
+	  t->currow = 0;		/* wraps round, as lists do */
      } else {
-          tree_traverse(t->data)
-	       itree_next( (ITREE *) tree_get(t->data) );
+	  t->currow++;
      }
 }
 
 void table_prev(TABLE t)
 {
-     int datakey;
-
      if (t->roworder) {
-       itree_prev(t->roworder);
-       datakey = (int) (long) itree_get(t->roworder);
-       tree_traverse(t->data)
-	    itree_find( (ITREE *) tree_get(t->data), datakey );
+	  itree_prev(t->roworder);
+	  table_priv_setcursor(t);
+     } else if (t->currow == 0) {
+	  t->currow = t->nrows;		/* before the start */
+     } else if (t->currow >= t->nrows) {
+	  t->currow = t->nrows-1;	/* wraps round, as lists do */
      } else {
-          tree_traverse(t->data)
-	       itree_prev( (ITREE *) tree_get(t->data) );
+	  t->currow--;
      }
 }
 
 void table_last(TABLE t)
 {
-     int datakey;
-
      if (t->roworder) {
-       itree_last(t->roworder);
-       datakey = (int) (long) itree_get(t->roworder);
-       tree_traverse(t->data)
-	    itree_find( (ITREE *) tree_get(t->data), datakey );
+	  itree_last(t->roworder);
+	  table_priv_setcursor(t);
      } else {
-          tree_traverse(t->data)
-	       itree_last( (ITREE *) tree_get(t->data) );
+	  t->currow = t->nrows ? t->nrows-1 : 0;
      }
 }
 
 void table_gotorow(TABLE t, int rowkey)
 {
-     tree_traverse(t->data) {
-	  if ( itree_find(tree_get(t->data), rowkey) == ITREE_NOVAL)
-	       elog_printf(ERROR, "cant find row key %d in col %s", 
-			   rowkey, tree_getkey(t->data));
+     int row;
+
+     if ((row = table_rowindex(t, rowkey)) == -1) {
+	  elog_printf(ERROR, "cant find row key %d", rowkey);
+	  t->currow = t->nrows;
+     } else {
+	  t->currow = row;
      }
 }
 
 int table_isatfirst(TABLE t)
 {
-  ITREE *column;
+  if (t->roworder)
+       return itree_isatstart(t->roworder);
 
-  if (t->roworder) {
-       column = t->roworder;
-  } else {
-       tree_first(t->data);
-       column = tree_get(t->data);
-  }
-
-  return itree_isatstart(column);
+  return t->currow == 0;
 }
 
 /* Is the current position at the end of the table.
  * Also returns true if the table is empty */
 int table_isatlast(TABLE t)
 {
-  ITREE *column;
-
   if (t->ncols <= 0 || t->nrows <= 0)
        return 1;
 
-  if (t->roworder) {
-       column = t->roworder;
-  } else {
-       tree_first(t->data);
-       column = tree_get(t->data);
-  }
+  if (t->roworder)
+       return itree_isatend(t->roworder);
 
-  return itree_isatend(column);
+  return t->currow == t->nrows-1;
 }
 
 /* Is the current position beyond the end of the table.
  * Also returns true if the table is empty */
 int table_isbeyondend(TABLE t)
 {
-  ITREE *column;
-
   if (t->ncols <= 0 || t->nrows <= 0)
        return 1;
 
-  if (t->roworder) {
-       column = t->roworder;
-  } else {
-       tree_first(t->data);
-       column = tree_get(t->data);
-  }
+  if (t->roworder)
+       return itree_isbeyondend(t->roworder);
 
-  return itree_isbeyondend(column);
+  return t->currow >= t->nrows;
 }
 
 /* 
@@ -2039,10 +2294,12 @@ int table_isbeyondend(TABLE t)
 TREE *table_getcurrentrow(TABLE t)
 {
   TREE *row;
+  int h;
 
   row = tree_create();
-  tree_traverse(t->data)
-    tree_add( row, tree_getkey(t->data), itree_get(tree_get(t->data)) );
+  for (h=0; h < t->ncolref; h++)
+       if (t->colref[h].cells)
+	    tree_add(row, t->colref[h].name, table_getcurrentcell_h(t, h));
 
   return row;
 }
@@ -2053,43 +2310,12 @@ TREE *table_getcurrentrow(TABLE t)
  */
 void table_rmcurrentrow(TABLE t)
 {
-     ITREE *column;
-     int rowkey = 0;
-     int is_beyond = 0;
-
-     if (t->nrows == 0)
+     if (t->nrows == 0 || t->currow >= t->nrows)
 	  return;	/* nothing to remove */
+     table_priv_usetrees(t);
 
-     tree_traverse(t->data)
-	  itree_rm( tree_get(t->data) );
-
-     /* handle emptyness */
-     t->nrows--;
-     if (t->nrows == 0) {
-	  /* empty */
-	  t->minrowkey = t->maxrowkey = -1;
-     } else {
-	  /* save row location whilst checking for 'beyondness' */
-	  tree_first(t->data);
-	  column = tree_get(t->data);
-	  if (itree_isbeyondend(column))
-	       is_beyond++;
-	  else
-	       rowkey = itree_getkey(column);
-
-	  /* update counter, first and last row indexes */
-	  itree_first(column);
-	  t->minrowkey = itree_getkey(column);
-	  itree_last(column);
-	  t->maxrowkey = itree_getkey(column);
-
-	  /* restore row location */
-	  if (is_beyond) {
-	       itree_last(column);
-	       itree_next(column);
-	  } else
-	       itree_find(column, rowkey);
-     }
+     /* the next row moves into the current row index */
+     table_priv_rowremove(t, t->currow);
 }
 
 
@@ -2098,10 +2324,15 @@ void table_rmcurrentrow(TABLE t)
  */
 void table_rmallrows(TABLE t)
 {
-     table_first(t);
-     while (t->nrows) {
-          table_rmcurrentrow(t);
-     }
+     int h;
+
+     for (h=0; h < t->ncolref; h++)
+	  if (t->colref[h].cells)
+	       itree_clearout(t->colref[h].cells, NULL);
+     t->nrows = 0;		/* column stores are reused */
+     t->minrowkey = t->maxrowkey = -1;
+     t->rowidxok = 1;		/* an empty index is correct */
+     t->currow = 0;
 }
 
 
@@ -2113,20 +2344,18 @@ void table_rmallrows(TABLE t)
  */
 void *table_getcurrentcell(TABLE t, char *colname)
 {
-  ITREE *column;
-
-  column = tree_find(t->data, colname);
-  if (column != TREE_NOVAL)
-    return (  itree_get(column)  );
-  else
-    return NULL;
+     return table_getcurrentcell_h(t, table_colhandle(t, colname));
 }
 
-/* returns the row key of the current row */
+/* returns the row key of the current row or -1 if beyond the end */
 int table_getcurrentrowkey(TABLE t)
 {
-  tree_first(t->data);
-  return itree_getkey( tree_get(t->data) );
+     if (t->currow >= t->nrows)
+	  return -1;
+     if (t->colvecs)
+	  return t->currow;	/* rows are only appended */
+     table_priv_rowindex(t);
+     return t->rowkeys[t->currow];
 }
 
 /*
@@ -2137,15 +2366,8 @@ int table_getcurrentrowkey(TABLE t)
  */
 int table_replacecurrentcell(TABLE t, char *colname, void *newcelldata)
 {
-  ITREE *column;
-
-  column = tree_find(t->data, colname);
-  if (column == TREE_NOVAL) 
-    return 0;
-
-  itree_put(column, newcelldata);
-
-  return 1;
+     return table_replacecurrentcell_h(t, table_colhandle(t, colname), 
+				       newcelldata);
 }
 
 /*
@@ -2156,21 +2378,8 @@ int table_replacecurrentcell(TABLE t, char *colname, void *newcelldata)
  */
 int table_replacecurrentcell_alloc(TABLE t, char *colname, void *newcelldata)
 {
-     ITREE *column;
-     char *dupdata;
-
-     if (newcelldata == NULL)
-	  return table_replacecurrentcell(t, colname, newcelldata);
-
-     column = tree_find(t->data, colname);
-     if (column == TREE_NOVAL) 
-	  return 0;
-
-     dupdata = xnstrdup(newcelldata);
-     table_freeondestroy(t, dupdata);
-     itree_put(column, dupdata);
-
-     return 1;
+     return table_replacecurrentcell_alloc_h(t, table_colhandle(t, colname),
+					     newcelldata);
 }
 
 /*
@@ -2215,6 +2424,10 @@ int table_replaceinfocell(TABLE t, char *infoname, char *colname, void *value)
      else
 	  itree_add(col, infoindex, value);
 
+     /* column stores are typed from the type info */
+     if (t->colvecs && strcmp(infoname, "type") == 0)
+	  table_priv_vectype(t, table_colhandle(t, colname));
+
      return 1;
 }
 
@@ -2436,6 +2649,8 @@ char *table_getinfocell(TABLE t, char *infoname, char *colname)
 /* Check the internal consistency of the table. Returns 1 for ok, 0 for bad */
 int   table_check(TABLE t)
 {
+     table_priv_usetrees(t);
+
      /* check there are enough columns */
      if (tree_n(t->data) != t->ncols) {
 	  elog_printf(DEBUG, "column mismatch: ncols=%d != data cols=%d",
@@ -2537,6 +2752,7 @@ int   table_sort(TABLE t, char *primarykey, char *secondarykey)
      /* check input parameters */
      if (primarykey == NULL)
 	  return 0;
+     table_priv_usetrees(t);
 
      /* locate primary key column */
      col = tree_find(t->data, primarykey);
@@ -2574,6 +2790,7 @@ int   table_sortnumeric(TABLE t, char *primarykey, char *secondarykey)
      /* check input parameters */
      if (primarykey == NULL)
 	  return 0;
+     table_priv_usetrees(t);
 
      /* locate primary key column */
      col = tree_find(t->data, primarykey);
@@ -2600,7 +2817,7 @@ int   table_sortnumeric(TABLE t, char *primarykey, char *secondarykey)
 
 /* Returns 1 if column exists in table, 0 otherwise */
 int    table_hascol(TABLE t, char *colname) {
-     if (tree_find(t->data, colname) == TREE_NOVAL)
+     if (table_colhandle(t, colname) == TABLE_NOHANDLE)
 	  return 0;
      else
 	  return 1;
@@ -2710,6 +2927,9 @@ int    table_equals(TABLE t, TABLE other)
   ITREE *mydata, *otherdata, *myinfo, *otherinfo;
   int myidx, otheridx;
 
+     table_priv_usetrees(t);
+     table_priv_usetrees(other);
+
      /* compare info row name quantity */
      if (tree_n(t->infolookup) != tree_n(other->infolookup))
           return 0;
@@ -2788,254 +3008,1064 @@ int    table_equals(TABLE t, TABLE other)
 
 
 
-#if TEST
+/*
+ * Return the handle of the column colname or TABLE_NOHANDLE if there is 
+ * no such column. The handle may be used in the *_h() calls to address
+ * the column directly, so resolve a column's name once then use its handle
+ * for repeated access. Handles remain valid until their column is removed.
+ */
+int    table_colhandle(TABLE t, char *colname)
+{
+     int i, h;
 
-#include <stdlib.h>
-#include "route.h"
-#include "rt_std.h"
+     if (colname == NULL || t->colhashsz == 0)
+	  return TABLE_NOHANDLE;
 
-#define TEST_TEXT1 "one two three"
-#define TEST_TEXT2 "c1 c2 c3\none two three\n"
-#define TEST_TEXT3 "c1 c2 c3\n-- -- --\none two three\n"
-#define TEST_TEXT4 "c1\tc2\tc3\nint\tnano\tfloat\ttypes\n--\t--\t--\none\ttwo\tthree\n"
-#define TEST_TEXT5 "c1\tc2\tc3\nint\tnano\tfloat\ttypes\nfirst column\tsecond column\tcolumn number three\thelp\n--\t--\t--\none\ttwo\tthree\n"
+     for (i = hash_str(colname) & (t->colhashsz-1); 
+	  (h = t->colhash[i]) != -1; i = (i+1) & (t->colhashsz-1))
+	  if (strcmp(t->colref[h].name, colname) == 0)
+	       return h;
 
-int main(int argc, char **argv)
-{
-     TABLE tab1, tab2, tab3;
-     ITREE *setupcolnames, *col1;
-     TREE *setuprow1, *inforow1, *row1;
-     int r, i;
-     char *cell1, *buf1, *buf2, *buf3, *buf4;
+     return TABLE_NOHANDLE;
+}
 
-     route_init(NULL, 0);
-     route_register(&rt_stdin_method);
-     route_register(&rt_stdout_method);
-     route_register(&rt_stderr_method);
-     elog_init(0, "holstore test", NULL);
 
-     /* test 1: create and destroy */
-     setupcolnames = itree_create();
-     itree_append(setupcolnames, "tom");
-     itree_append(setupcolnames, "dick");
-     itree_append(setupcolnames, "harry");
-     tab1 = table_create_t(setupcolnames);
-     if ( ! tab1 )
-       elog_die(FATAL, "[1] unable to create tab1");
-     table_destroy(tab1);
+/* Return the name of the column with handle h or NULL if invalid */
+char  *table_colhandlename(TABLE t, int h)
+{
+     if (h < 0 || h >= t->ncolref)
+	  return NULL;
+     return t->colref[h].name;
+}
 
-     /* test 2: create and add a row */
-     setuprow1 = tree_create();
-     tree_add(setuprow1, "tom", "one");
-     tree_add(setuprow1, "dick", "two");
-     tree_add(setuprow1, "harry", "three");
-     tab1 = table_create_t(setupcolnames);
-     if ( ! tab1 )
-       elog_die(FATAL, "[2] unable to create tab1");
-     r = table_addrow_noalloc(tab1, setuprow1);
-     if (r == -1)
-       elog_die(FATAL, "[2] unable add row");
-     table_destroy(tab1);
 
-     /* test 3: add several rows */
-     tab1 = table_create_t(setupcolnames);
-     if ( ! tab1 )
-       elog_die(FATAL, "[3] unable to create tab1");
-     r = table_addrow_noalloc(tab1, setuprow1);
-     if (r == -1)
-       elog_die(FATAL, "[3a] unable add row");
-     r = table_addrow_noalloc(tab1, setuprow1);
-     if (r == -1)
-       elog_die(FATAL, "[3b] unable add row");
-     r = table_addrow_noalloc(tab1, setuprow1);
-     if (r == -1)
-       elog_die(FATAL, "[3c] unable add row");
-     table_destroy(tab1);
+/*
+ * Return the row index of the row with key rowkey or -1 if there is no 
+ * such row. The row index is the position of the row in row key order 
+ * from 0 to table_nrows()-1, so it equals the row key in tables whose
+ * rows have only been added.
+ */
+int    table_rowindex(TABLE t, int rowkey)
+{
+     int lo, hi, mid;
 
-     /* test 4: add several rows to test verious extraction methods */
-     tab1 = table_create_t(setupcolnames);
-     if ( ! tab1 )
-       elog_die(FATAL, "[4] unable to create tab1");
-     r = table_addrow_noalloc(tab1, setuprow1);
-     if (r == -1)
-       elog_die(FATAL, "[4a] unable add row");
-     r = table_addrow_noalloc(tab1, setuprow1);
-     if (r == -1)
-       elog_die(FATAL, "[4b] unable add row");
-     r = table_addrow_noalloc(tab1, setuprow1);
-     if (r == -1)
-       elog_die(FATAL, "[4c] unable add row");
+     if (t->nrows == 0)
+	  return -1;
+     if (t->colvecs)
+	  return (rowkey >= 0 && rowkey < t->nrows) ? rowkey : -1;
+     table_priv_rowindex(t);
+
+     /* direct when rows are dense */
+     mid = rowkey - t->minrowkey;
+     if (mid >= 0 && mid < t->nrows && t->rowkeys[mid] == rowkey)
+	  return mid;
+
+     lo = 0;
+     hi = t->nrows-1;
+     while (lo <= hi) {
+	  mid = (lo + hi) / 2;
+	  if (t->rowkeys[mid] == rowkey)
+	       return mid;
+	  else if (t->rowkeys[mid] < rowkey)
+	       lo = mid+1;
+	  else
+	       hi = mid-1;
+     }
 
-     /* test 5: get row */
-     row1 = table_getrow(tab1, 1);
-     if ( ! row1 )
-       elog_die(FATAL, "[5] unable to get row");
-     if ( (cell1 = tree_find(row1, "tom")) == TREE_NOVAL )
-       elog_die(FATAL, "[5] unable find tom in row");
-     if (strcmp(cell1, "one"))
-       elog_die(FATAL, "[5] tom != one in row");
-     if ( (cell1 = tree_find(row1, "dick")) == TREE_NOVAL )
-       elog_die(FATAL, "[5] unable find dick in row");
-     if (strcmp(cell1, "two"))
-       elog_die(FATAL, "[5] dick != two in row");
-     if ( (cell1 = tree_find(row1, "harry")) == TREE_NOVAL )
-       elog_die(FATAL, "[5] unable find harry in row");
-     if (strcmp(cell1, "three"))
-       elog_die(FATAL, "[5] harry != three in row");
-     if ( tree_find(row1, "sploge") != TREE_NOVAL)
-       elog_die(FATAL, "[5] shouldnt find sploge in row");
-     tree_destroy(row1);
+     return -1;
+}
 
-     /* test 6: get column */
-     col1 = table_getcol(tab1, "harry");
-     if ( ! col1 )
-       elog_die(FATAL, "[6] unable to get col");
-     if ( (cell1 = itree_find(col1, 0)) == ITREE_NOVAL )
-       elog_die(FATAL, "[6] unable find 0 in col");
-     if (strcmp(cell1, "three"))
-       elog_die(FATAL, "[6] 0 != three in col");
-     if ( (cell1 = itree_find(col1, 1)) == ITREE_NOVAL )
-       elog_die(FATAL, "[6] unable find 1 in col");
-     if (strcmp(cell1, "three"))
-       elog_die(FATAL, "[6] 1 != three in col");
-     if ( (cell1 = itree_find(col1, 2)) == ITREE_NOVAL )
-       elog_die(FATAL, "[6] unable find 2 in col");
-     if (strcmp(cell1, "three"))
-       elog_die(FATAL, "[6] 2 != three in col");
-     if ( itree_find(col1, 99) != ITREE_NOVAL )
-       elog_die(FATAL, "[6] shouldnt find 99 in row");
-     itree_destroy(col1);
 
-     /* test 7: iterative/sequential extraction */
-     table_first(tab1);
-     i=0;
-     while ( ! table_isbeyondend(tab1) ) {
-       row1 = table_getcurrentrow(tab1);
-       if ( ! row1 )
-	 elog_die(FATAL, "[7] unable to get row %d", i);
-       if ( (cell1 = tree_find(row1, "tom")) == TREE_NOVAL )
-	 elog_die(FATAL, "[7] unable find tom in row %d", i);
-       if (strcmp(cell1, "one"))
-	 elog_die(FATAL, "[7] tom != one in row %d", i);
-       if ( (cell1 = tree_find(row1, "dick")) == TREE_NOVAL )
-	 elog_die(FATAL, "[7] unable find dick in row %d", i);
-       if (strcmp(cell1, "two"))
-	 elog_die(FATAL, "[7] dick != two in row %d", i);
-       if ( (cell1 = tree_find(row1, "harry")) == TREE_NOVAL )
-	 elog_die(FATAL, "[7] unable find harry in row %d", i);
-       if (strcmp(cell1, "three"))
-	 elog_die(FATAL, "[7] harry != three in row %d", i);
-       if ( tree_find(row1, "sploge") != TREE_NOVAL )
-	 elog_die(FATAL, "[7] shouldnt find sploge in row %d", i);
-       tree_destroy(row1);
-       i++;
-       table_next(tab1);
+/* Return the row index of the current row, which is table_nrows() if 
+ * beyond the end of the table */
+int    table_getcurrentrowindex(TABLE t)
+{
+     return t->currow;
+}
+
+
+/* Make the row with index row current, ignoring any row order */
+void   table_gotorowindex(TABLE t, int row)
+{
+     if (row < 0 || row > t->nrows)
+	  row = t->nrows;
+     t->currow = row;
+}
+
+
+/* 
+ * Return the cell in the row with index row and the column with 
+ * handle h, or NULL if either does not exist.
+ * The returned data is not a copy, so dont free it or overwrite it.
+ */
+void  *table_getcell_h(TABLE t, int row, int h)
+{
+     Rb_node n;
+
+     if (t->colvecs) {
+	  if (h < 0 || h >= t->ncolref || t->colref[h].vec == NULL ||
+	      row < 0 || row >= t->nrows)
+	       return NULL;
+	  return table_priv_vectext(t, t->colref[h].vec, row);
      }
-     if (i != 3)
-       elog_die(FATAL, "[7] there are not three rows");
+     if ((n = table_priv_node(t, row, h)) == NULL)
+	  return NULL;
+     return rb_val(n);
+}
 
-     /* test 8: create and empty table and add a couple of columns */
-     tab2 = table_create();
-     col1 = itree_create();
-     itree_append(col1, "one");
-     itree_append(col1, "one");
-     itree_append(col1, "one");
-     r = table_addcol(tab2, "tom", col1);
-     itree_destroy(col1);
-     col1 = itree_create();
-     itree_append(col1, "two");
-     itree_append(col1, "two");
-     itree_append(col1, "two");
-     r = table_addcol(tab2, "dick", col1);
-     itree_destroy(col1);
-     col1 = itree_create();
-     itree_append(col1, "three");
-     itree_append(col1, "three");
-     itree_append(col1, "three");
-     r = table_addcol(tab2, "harry", col1);
-     itree_destroy(col1);
 
-     /* test 9: print a table, but then save it as a tab delim format */
-     buf1 = table_print(tab1);
-     printf("Test 9 table:-\n%s", buf1);
-     nfree(buf1);
-     buf1 = table_outtable(tab1);
+/*
+ * Replace the cell in the row with index row and column with handle h
+ * with data, which is not copied and must exist as long as the table.
+ * Returns 1 if successful or 0 if unable to find cell
+ */
+int    table_replacecell_h(TABLE t, int row, int h, void *data)
+{
+     Rb_node n;
 
-     /* test 10: table traversing */
-     i=0;
-     table_traverse(tab1)
-          i++;
-     if (i != 3)
-       elog_die(FATAL, "[10] there are not three rows");
+     if (t->colvecs) {
+	  if (h < 0 || h >= t->ncolref || t->colref[h].vec == NULL ||
+	      row < 0 || row >= t->nrows)
+	       return 0;
+	  table_priv_vecset(t, h, row, data, 0);
+	  return 1;
+     }
+     if ((n = table_priv_node(t, row, h)) == NULL)
+	  return 0;
+     n->v.val = data;
+     return 1;
+}
 
-     /* test 11: add info */
-     inforow1 = tree_create();
-     tree_add(inforow1, "tom", "thomas");
-     tree_add(inforow1, "dick", "richard");
-     tree_add(inforow1, "harry", "henry");
-     r = table_addinfo_t(tab1, "real names", inforow1);
-     if (r == 0)
-	  elog_die(FATAL, "[11a] can't addinfo_t()");
-     r = table_addemptyinfo(tab1, "blank line");
-     if (r != 2)
-	  elog_die(FATAL, "[11b] can't addemptyinfo() again");
-     r = table_rminfo(tab1, "not here");
-     if (r != 0)
-	  elog_die(FATAL, "[11c] shouldn't be able to delete");
-     r = table_rminfo(tab1, "real names");
-     if (r != 1)
-	  elog_die(FATAL, "[11d] not able to delete real names");
-     r = table_rminfo(tab1, "blank line");
-     if (r != 1)
-	  elog_die(FATAL, "[11e] not able to delete bank line");
 
-     /* test 12: scan a text representation of a table */
-     tab3 = table_create();
-     r = table_scan(tab3, buf1, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
-		    TABLE_HASRULER);
-     if (r != 3)
-	  elog_die(FATAL, "[12a] does not scan 3 lines");
-     table_freeondestroy(tab3, buf1);
-     buf2 = table_print(tab3);
-     printf("Test 12 table (same as 9):-\n%s", buf2);
-     nfree(buf2);
-     buf2 = table_outtable(tab3);
-     r = table_scan(tab3, buf2, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
-		    TABLE_HASRULER);
-     if (r != 3)
-	  elog_die(FATAL, "[12b] does not scan 3 lines");
-     table_freeondestroy(tab3, buf2);
-     buf2 = table_print(tab3);
-     buf3 = buf2 -1;
-     i=0;
-     while ((buf3=strchr(buf3+1, '\n')))	/* count \n */
-	  i++;
-     if (i != 8)
-	  elog_die(FATAL, "[12c] has not output 6 lines");
-     nfree(buf2);
-     table_destroy(tab2);
+/* As table_getcurrentcell(), but addressing the column with a handle */
+void  *table_getcurrentcell_h(TABLE t, int h)
+{
+     return table_getcell_h(t, t->currow, h);
+}
 
-     /* test 13: outheader, outbody and outtable for scanning and escaping */
-     buf3 = table_outtable(tab3);
-     tab2 = table_create_t(setupcolnames);
-     r = table_scan(tab2, buf3, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
-		    TABLE_HASRULER);
-     if (r != 6)
-	  elog_die(FATAL, "[13a] does not scan 6 lines");
-     table_freeondestroy(tab2, buf3);
-     tree_destroy(setuprow1);
-     setuprow1 = tree_create();
-     tree_add(setuprow1, "tom", "thomas a becket");
-     tree_add(setuprow1, "dick", "richard the III");
-     tree_add(setuprow1, "harry", "henry the VIII");
-     r = table_addrow_noalloc(tab2, setuprow1);
-     if (r == -1)
-       elog_die(FATAL, "[13a] unable add row");
-     tree_destroy(setuprow1);
-     setuprow1 = tree_create();
-/*     tree_add(setuprow1, "tom", "some words with \" that in");*/
-     tree_add(setuprow1, "tom", "some loose words");
-     tree_add(setuprow1, "dick", "");
+
+/* As table_replacecurrentcell(), but addressing the column by handle */
+int    table_replacecurrentcell_h(TABLE t, int h, void *data)
+{
+     return table_replacecell_h(t, t->currow, h, data);
+}
+
+
+/* As table_replacecurrentcell_alloc(), but addressing the column 
+ * by handle */
+int    table_replacecurrentcell_alloc_h(TABLE t, int h, void *data)
+{
+     char *dupdata;
+
+     if (data == NULL)
+	  return table_replacecurrentcell_h(t, h, data);
+     if (t->colvecs) {
+	  if (h < 0 || h >= t->ncolref || t->colref[h].vec == NULL ||
+	      t->currow >= t->nrows)
+	       return 0;
+	  table_priv_vecset(t, h, t->currow, data, 1);
+	  return 1;
+     }
+     if (table_priv_node(t, t->currow, h) == NULL)
+	  return 0;
+
+     dupdata = table_strdup(t, data);
+     return table_replacecurrentcell_h(t, h, dupdata);
+}
+
+
+/*
+ * Return the type of the column store with handle h, being one of
+ * TABLE_COLSTR, TABLE_COLINT or TABLE_COLDBL, or TABLE_COLNONE if the
+ * table is not using columns (see table_usecolumns()) or there is no 
+ * such column.
+ * A column takes its type from the `type' info; a numeric column 
+ * becomes TABLE_COLSTR if given a cell that is not a number.
+ */
+int    table_coltype(TABLE t, int h)
+{
+     if ( ! t->colvecs || h < 0 || h >= t->ncolref || 
+	  t->colref[h].vec == NULL )
+	  return TABLE_COLNONE;
+     return t->colref[h].vec->type;
+}
+
+
+/*
+ * Return the values of the TABLE_COLINT column with handle h as an 
+ * array of table_nrows() entries, indexed by row index, or NULL if 
+ * the column is not of that type. Blank cells are 0; tell them apart 
+ * with table_colblanks(). The array belongs to the table and may move 
+ * when rows are added, so do not keep it across additions.
+ */
+long long *table_colints(TABLE t, int h)
+{
+     if (table_coltype(t, h) != TABLE_COLINT)
+	  return NULL;
+     return t->colref[h].vec->ival;
+}
+
+
+/* As table_colints(), but for the values of a TABLE_COLDBL column */
+double *table_coldbls(TABLE t, int h)
+{
+     if (table_coltype(t, h) != TABLE_COLDBL)
+	  return NULL;
+     return t->colref[h].vec->dval;
+}
+
+
+/*
+ * Return an array of table_nrows() flags for the column store with 
+ * handle h, being 1 where the cell is NULL or empty, or NULL if the 
+ * table is not using columns. As table_colints(), do not keep it 
+ * across the addition of rows.
+ */
+char  *table_colblanks(TABLE t, int h)
+{
+     if (table_coltype(t, h) == TABLE_COLNONE)
+	  return NULL;
+     return t->colref[h].vec->blank;
+}
+
+
+/* Private: add column cells to the table's data under colname and 
+ * issue a handle for it */
+void   table_priv_addcol(TABLE t, char *colname, ITREE *cells)
+{
+     struct table_colref *c;
+     int i;
+
+     tree_add(t->data, colname, cells);
+
+     if (t->ncolref >= t->colrefalloc) {
+	  if (t->colrefalloc) {
+	       t->colrefalloc *= 2;
+	       t->colref = xnrealloc(t->colref, sizeof(struct table_colref) *
+				     t->colrefalloc);
+	  } else {
+	       t->colrefalloc = TABLE_INITHASH / 2;
+	       t->colref = xnmalloc(sizeof(struct table_colref) * 
+				    t->colrefalloc);
+	  }
+     }
+     c = &t->colref[t->ncolref++];
+     c->name  = colname;
+     c->cells = cells;
+     c->rows  = NULL;
+     c->vec   = t->colvecs ? table_priv_vecnew(t) : NULL;
+     t->rowidxok = 0;		/* new cells are not in the row index */
+
+     /* hash the name, keeping the hash under half full */
+     if (t->ncolref * 2 > t->colhashsz) {
+	  table_priv_hashcols(t);
+     } else {
+	  for (i = hash_str(colname) & (t->colhashsz-1); t->colhash[i] != -1;
+	       i = (i+1) & (t->colhashsz-1))
+	       ;
+	  t->colhash[i] = t->ncolref-1;
+     }
+}
+
+
+/* Private: retire the handle h as its column is being removed */
+void   table_priv_rmcolref(TABLE t, int h)
+{
+     if (h < 0 || h >= t->ncolref)
+	  return;
+     if (t->colref[h].rows)
+	  nfree(t->colref[h].rows);
+     if (t->colref[h].vec)
+	  table_priv_vecfree(t->colref[h].vec);
+     t->colref[h].vec   = NULL;
+     t->colref[h].name  = NULL;
+     t->colref[h].cells = NULL;
+     t->colref[h].rows  = NULL;
+     table_priv_hashcols(t);
+}
+
+
+/* Private: (re)build the hash of column names to handles */
+void   table_priv_hashcols(TABLE t)
+{
+     int h, i;
+
+     if (t->colhashsz < TABLE_INITHASH)
+	  t->colhashsz = TABLE_INITHASH;
+     while (t->colhashsz < t->ncolref * 2)
+	  t->colhashsz *= 2;
+     if (t->colhash)
+	  nfree(t->colhash);
+     t->colhash = xnmalloc(sizeof(int) * t->colhashsz);
+     memset(t->colhash, -1, sizeof(int) * t->colhashsz);
+
+     for (h=0; h < t->ncolref; h++) {
+	  if (t->colref[h].name == NULL)
+	       continue;
+	  for (i = hash_str(t->colref[h].name) & (t->colhashsz-1); 
+	       t->colhash[i] != -1; i = (i+1) & (t->colhashsz-1))
+	       ;
+	  t->colhash[i] = h;
+     }
+}
+
+
+/* Private: return the cell node at row index row in the column with 
+ * handle h or NULL if either does not exist */
+Rb_node table_priv_node(TABLE t, int row, int h)
+{
+     if (h < 0 || h >= t->ncolref || t->colref[h].cells == NULL ||
+	 row < 0 || row >= t->nrows)
+	  return NULL;
+     if ( ! t->rowidxok )
+	  table_priv_rowindex(t);
+
+     return t->colref[h].rows[row];
+}
+
+
+/*
+ * Private: bring the row index up to date, if it is not already.
+ * The index holds the key of each row and each column's cell node for 
+ * that row, so that cells can be reached directly. Appending and 
+ * removing rows keep it current; other changes to the shape of the 
+ * table mark it to be rebuilt here when next used.
+ */
+void   table_priv_rowindex(TABLE t)
+{
+     struct table_colref *c;
+     Rb_node n;
+     int h, i, keyed=0;
+
+     if (t->rowidxok)
+	  return;
+     table_priv_usetrees(t);	/* the index is of tree nodes */
+
+     if (t->rowidxalloc < t->nrows || t->rowkeys == NULL) {
+	  if (t->rowidxalloc == 0)
+	       t->rowidxalloc = TABLE_INITHASH;
+	  while (t->rowidxalloc < t->nrows)
+	       t->rowidxalloc *= 2;
+	  if (t->rowkeys)
+	       nfree(t->rowkeys);
+	  t->rowkeys = xnmalloc(sizeof(int) * t->rowidxalloc);
+	  for (h=0; h < t->ncolref; h++)
+	       if (t->colref[h].rows) {
+		    nfree(t->colref[h].rows);
+		    t->colref[h].rows = NULL;
+	       }
+     }
+
+     for (h=0; h < t->ncolref; h++) {
+	  c = &t->colref[h];
+	  if (c->cells == NULL)
+	       continue;
+	  if (c->rows == NULL)
+	       c->rows = xnmalloc(sizeof(Rb_node) * t->rowidxalloc);
+	  i = 0;
+	  rb_traverse(n, c->cells->root) {
+	       if (i >= t->nrows)
+		    break;
+	       if ( ! keyed )
+		    t->rowkeys[i] = n->k.ikey;
+	       c->rows[i++] = n;
+	  }
+	  while (i < t->nrows)
+	       c->rows[i++] = NULL;		/* short column */
+	  keyed++;
+     }
+     if ( ! keyed )
+	  for (i=0; i < t->nrows; i++)
+	       t->rowkeys[i] = i;
+
+     t->rowidxok = 1;
+}
+
+
+/* Private: add the row just appended to the row index, whose cells are 
+ * the last in each column */
+void   table_priv_rowappend(TABLE t)
+{
+     struct table_colref *c;
+     int h, row;
+
+     if ( ! t->rowidxok )
+	  return;		/* rebuilt when next needed */
+
+     row = t->nrows-1;
+     if (row >= t->rowidxalloc) {
+	  t->rowidxalloc = t->rowidxalloc ? t->rowidxalloc*2 : TABLE_INITHASH;
+	  if (t->rowkeys)
+	       t->rowkeys = xnrealloc(t->rowkeys, 
+				      sizeof(int) * t->rowidxalloc);
+	  else
+	       t->rowkeys = xnmalloc(sizeof(int) * t->rowidxalloc);
+	  for (h=0; h < t->ncolref; h++)
+	       if (t->colref[h].rows)
+		    t->colref[h].rows = xnrealloc(t->colref[h].rows, 
+						  sizeof(Rb_node) * 
+						  t->rowidxalloc);
+     }
+
+     t->rowkeys[row] = t->maxrowkey;
+     for (h=0; h < t->ncolref; h++) {
+	  c = &t->colref[h];
+	  if (c->cells == NULL)
+	       continue;
+	  if (c->rows == NULL)
+	       c->rows = xnmalloc(sizeof(Rb_node) * t->rowidxalloc);
+	  c->rows[row] = rb_last(c->cells->root);
+     }
+}
+
+
+/* Private: remove the row with index row from the table's columns and 
+ * the row index, then update the counts and key range */
+void   table_priv_rowremove(TABLE t, int row)
+{
+     struct table_colref *c;
+     int h, nafter;
+
+     table_priv_rowindex(t);
+     nafter = t->nrows - row - 1;
+     for (h=0; h < t->ncolref; h++) {
+	  c = &t->colref[h];
+	  if (c->cells == NULL)
+	       continue;
+	  if (c->rows[row]) {
+	       if (c->cells->node == c->rows[row])
+		    c->cells->node = rb_next(c->rows[row]);
+	       rb_delete_node(c->rows[row]);
+	  }
+	  memmove(c->rows + row, c->rows + row + 1, sizeof(Rb_node) * nafter);
+     }
+     memmove(t->rowkeys + row, t->rowkeys + row + 1, sizeof(int) * nafter);
+
+     t->nrows--;
+     if (t->nrows == 0) {
+	  /* empty */
+	  t->minrowkey = t->maxrowkey = -1;
+     } else {
+	  t->minrowkey = t->rowkeys[0];
+	  t->maxrowkey = t->rowkeys[t->nrows-1];
+     }
+}
+
+
+/* Private: set the current row from the position of the row order */
+void   table_priv_setcursor(TABLE t)
+{
+     int row;
+
+     if (itree_isbeyondend(t->roworder)) {
+	  t->currow = t->nrows;
+     } else {
+	  row = table_rowindex(t, (int) (long) itree_get(t->roworder));
+	  t->currow = (row == -1) ? t->nrows : row;
+     }
+}
+
+
+/*
+ * Private: bump allocate len bytes from the arena. Large requests get 
+ * a block of their own, which is placed behind the current block so 
+ * that its remaining space is not lost.
+ */
+void *table_priv_arenaalloc(TABLE t, size_t len)
+{
+     struct table_arena *blk;
+     size_t hdsz;
+
+     hdsz = (sizeof(struct table_arena) + TABLE_ARENAALIGN-1) & 
+	  ~((size_t) TABLE_ARENAALIGN-1);
+     blk = t->arena;
+     if (blk && blk->used + len <= blk->size) {
+	  blk->used += len;
+	  return (char *) blk + hdsz + blk->used - len;
+     }
+
+     if (len > t->arenablk / 4) {
+	  blk = xnmalloc(hdsz + len);
+	  blk->size = blk->used = len;
+	  if (t->arena) {
+	       blk->next = t->arena->next;
+	       t->arena->next = blk;
+	  } else {
+	       blk->next = NULL;
+	       t->arena = blk;
+	  }
+	  return (char *) blk + hdsz;
+     }
+
+     blk = xnmalloc(hdsz + t->arenablk);
+     blk->size = t->arenablk;
+     blk->used = len;
+     blk->next = t->arena;
+     t->arena = blk;
+     return (char *) blk + hdsz;
+}
+
+
+/* Private: a new column store of string type, with the rows already in 
+ * the table left blank */
+struct table_colvec *table_priv_vecnew(TABLE t)
+{
+     struct table_colvec *v;
+
+     v = xnmalloc(sizeof(struct table_colvec));
+     v->type  = TABLE_COLSTR;
+     v->usign = 0;
+     v->ival  = NULL;
+     v->dval  = NULL;
+     v->text  = NULL;
+     v->blank = NULL;
+     if (t->vecalloc) {
+	  v->text  = xnmalloc(sizeof(char *) * t->vecalloc);
+	  v->blank = xnmalloc(t->vecalloc);
+	  memset(v->text, 0, sizeof(char *) * t->nrows);
+	  memset(v->blank, 1, t->nrows);
+     }
+
+     return v;
+}
+
+
+/* Private: free a column store; cell text belongs to the table */
+void   table_priv_vecfree(struct table_colvec *v)
+{
+     if (v->ival)
+	  nfree(v->ival);
+     if (v->dval)
+	  nfree(v->dval);
+     if (v->text)
+	  nfree(v->text);
+     if (v->blank)
+	  nfree(v->blank);
+     nfree(v);
+}
+
+
+/* Private: append a blank row to every column store, growing them if 
+ * needed and making it the current row. Returns its row key, which is 
+ * also its index */
+int    table_priv_vecappend(TABLE t)
+{
+     struct table_colvec *v;
+     int h, row;
+
+     row = t->nrows;
+     if (row >= t->vecalloc) {
+	  t->vecalloc = t->vecalloc ? t->vecalloc*2 : TABLE_INITHASH;
+	  for (h=0; h < t->ncolref; h++) {
+	       if ((v = t->colref[h].vec) == NULL)
+		    continue;
+	       v->text  = v->text ? 
+		    xnrealloc(v->text,  sizeof(char *) * t->vecalloc) :
+		    xnmalloc(sizeof(char *) * t->vecalloc);
+	       v->blank = v->blank ? 
+		    xnrealloc(v->blank, t->vecalloc) :
+		    xnmalloc(t->vecalloc);
+	       if (v->ival)
+		    v->ival = xnrealloc(v->ival, sizeof(long long) * 
+					t->vecalloc);
+	       if (v->dval)
+		    v->dval = xnrealloc(v->dval, sizeof(double) * 
+					t->vecalloc);
+	  }
+     }
+
+     for (h=0; h < t->ncolref; h++) {
+	  if ((v = t->colref[h].vec) == NULL)
+	       continue;
+	  v->text[row]  = NULL;
+	  v->blank[row] = 1;
+	  if (v->ival)
+	       v->ival[row] = 0;
+	  if (v->dval)
+	       v->dval[row] = 0.0;
+     }
+
+     if ( t->nrows == 0 )
+	  t->minrowkey = 0;
+     t->nrows++;
+     t->maxrowkey = row;
+     t->currow = row;
+
+     return row;
+}
+
+
+/*
+ * Private: type the column store with handle h from its `type' info.
+ * Integer types (i32, u32, i64, u64, int) are held as long long and 
+ * float types (nano, float) as double; anything else is a string.
+ * Cells already in the column are converted.
+ */
+void   table_priv_vectype(TABLE t, int h)
+{
+     struct table_colvec *v;
+     char *type, *text;
+     int newtype, usign=0, row;
+
+     if (h < 0 || h >= t->ncolref || (v = t->colref[h].vec) == NULL)
+	  return;
+
+     type = table_getinfocell(t, "type", t->colref[h].name);
+     if (type == NULL)
+	  newtype = TABLE_COLSTR;
+     else if (strcmp(type, "i32") == 0 || strcmp(type, "i64") == 0 || 
+	      strcmp(type, "int") == 0)
+	  newtype = TABLE_COLINT;
+     else if (strcmp(type, "u32") == 0 || strcmp(type, "u64") == 0) {
+	  newtype = TABLE_COLINT;
+	  usign = 1;
+     } else if (strcmp(type, "nano") == 0 || strcmp(type, "float") == 0)
+	  newtype = TABLE_COLDBL;
+     else
+	  newtype = TABLE_COLSTR;
+
+     if (newtype == v->type && usign == v->usign)
+	  return;
+
+     /* back to text, then parse the existing cells into the new type */
+     table_priv_vecdemote(t, v);
+     if (newtype == TABLE_COLSTR)
+	  return;
+     v->type  = newtype;
+     v->usign = usign;
+     if (newtype == TABLE_COLINT)
+	  v->ival = xnmalloc(sizeof(long long) * (t->vecalloc ? 
+						  t->vecalloc : 1));
+     else
+	  v->dval = xnmalloc(sizeof(double) * (t->vecalloc ? 
+					       t->vecalloc : 1));
+     for (row=0; row < t->nrows; row++) {
+	  text = v->text[row];
+	  table_priv_vecset(t, h, row, text, 0);
+     }
+}
+
+
+/*
+ * Private: set the cell at row index row of the column store with 
+ * handle h to text, copying it if alloc is set. Numeric columns hold 
+ * the parsed value and only keep the text when it would not be 
+ * reproduced from the value (eg `007'), or when it costs nothing to 
+ * keep because it is not copied. A cell that is not a number turns 
+ * the column into a string column.
+ */
+void   table_priv_vecset(TABLE t, int h, int row, char *text, int alloc)
+{
+     struct table_colvec *v;
+     char *end, canon[64];
+     long long ival=0;
+     double dval=0.0;
+
+     v = t->colref[h].vec;
+
+     if (text == NULL || *text == '\0') {
+	  /* blank: NULL or empty */
+	  v->blank[row] = 1;
+	  v->text[row] = (text && alloc) ? table_strdup(t, text) : text;
+	  if (v->ival)
+	       v->ival[row] = 0;
+	  if (v->dval)
+	       v->dval[row] = 0.0;
+	  return;
+     }
+
+     v->blank[row] = 1;		/* no value yet, should it demote */
+     v->text[row] = NULL;
+     if (v->type == TABLE_COLINT) {
+	  errno = 0;
+	  if (v->usign) {
+	       ival = (long long) strtoull(text, &end, 10);
+	       if (*text == '-')
+		    end = text;
+	  } else
+	       ival = strtoll(text, &end, 10);
+	  if (end == text || *end || errno) {
+	       table_priv_vecdemote(t, v);
+	  } else {
+	       v->ival[row] = ival;
+	       v->blank[row] = 0;
+	       if (alloc) {
+		    if (v->usign)
+			 snprintf(canon, 64, "%llu", 
+				  (unsigned long long) ival);
+		    else
+			 snprintf(canon, 64, "%lld", ival);
+		    v->text[row] = strcmp(canon, text) ? 
+			 table_strdup(t, text) : NULL;
+	       } else
+		    v->text[row] = text;
+	       return;
+	  }
+     } else if (v->type == TABLE_COLDBL) {
+	  errno = 0;
+	  dval = strtod(text, &end);
+	  if (end == text || *end || errno) {
+	       table_priv_vecdemote(t, v);
+	  } else {
+	       v->dval[row] = dval;
+	       v->blank[row] = 0;
+	       if (alloc) {
+		    snprintf(canon, 64, "%.15g", dval);
+		    v->text[row] = strcmp(canon, text) ? 
+			 table_strdup(t, text) : NULL;
+	       } else
+		    v->text[row] = text;
+	       return;
+	  }
+     }
+
+     /* string column */
+     v->blank[row] = 0;
+     v->text[row] = alloc ? table_strdup(t, text) : text;
+}
+
+
+/* Private: return the text of the cell at row index row in column store
+ * v, making it from the value the first time it is asked for. 
+ * NULL cells return NULL */
+char  *table_priv_vectext(TABLE t, struct table_colvec *v, int row)
+{
+     char buf[64];
+
+     if (v->text[row] || v->blank[row])
+	  return v->text[row];
+
+     if (v->type == TABLE_COLINT) {
+	  if (v->usign)
+	       snprintf(buf, 64, "%llu", (unsigned long long) v->ival[row]);
+	  else
+	       snprintf(buf, 64, "%lld", v->ival[row]);
+     } else
+	  snprintf(buf, 64, "%.15g", v->dval[row]);
+     v->text[row] = table_strdup(t, buf);
+
+     return v->text[row];
+}
+
+
+/* Private: make column store v a string column, giving every cell 
+ * its text and dropping the values */
+void   table_priv_vecdemote(TABLE t, struct table_colvec *v)
+{
+     int row;
+
+     if (v->type == TABLE_COLSTR)
+	  return;
+     for (row=0; row < t->nrows; row++)
+	  table_priv_vectext(t, v, row);
+     if (v->ival)
+	  nfree(v->ival);
+     if (v->dval)
+	  nfree(v->dval);
+     v->ival  = NULL;
+     v->dval  = NULL;
+     v->type  = TABLE_COLSTR;
+     v->usign = 0;
+}
+
+
+/*
+ * Private: move the cells of a table using column stores into its 
+ * cell trees and stop using the stores, for the calls that work on 
+ * the trees. Rows keep their keys, which are their indexes.
+ */
+void   table_priv_usetrees(TABLE t)
+{
+     struct table_colref *c;
+     int h, row;
+
+     if ( ! t->colvecs )
+	  return;
+
+     for (h=0; h < t->ncolref; h++) {
+	  c = &t->colref[h];
+	  if (c->vec == NULL)
+	       continue;
+	  if (c->cells)
+	       for (row=0; row < t->nrows; row++)
+		    itree_append(c->cells, 
+				 table_priv_vectext(t, c->vec, row));
+	  table_priv_vecfree(c->vec);
+	  c->vec = NULL;
+     }
+     t->colvecs = 0;
+     t->vecalloc = 0;
+     t->rowidxok = 0;
+}
+
+
+#if TEST
+
+#include <stdlib.h>
+#include <sys/time.h>
+#include "route.h"
+#include "rt_std.h"
+
+#define TEST_TEXT1 "one two three"
+#define TEST_TEXT2 "c1 c2 c3\none two three\n"
+#define TEST_TEXT3 "c1 c2 c3\n-- -- --\none two three\n"
+#define TEST_TEXT4 "c1\tc2\tc3\nint\tnano\tfloat\ttypes\n--\t--\t--\none\ttwo\tthree\n"
+#define TEST_TEXT5 "c1\tc2\tc3\nint\tnano\tfloat\ttypes\nfirst column\tsecond column\tcolumn number three\thelp\n--\t--\t--\none\ttwo\tthree\n"
+#define TEST_TEXT6 "n\tf\ts\nint\tnano\tstr\ttype\n--\t--\t--\n1\t1.5\tone\n007\t-2\ttwo\n\t0.25\tthree\n"
+
+void test_bench(int nrows, int ncols);
+void test_benchscan(int mb, int ncols);
+char *test_mkscantext(int mb, int ncols);
+int table_ref_scan(TABLE t, char *buffer, char *sepstr, int mode, 
+		   int hascolnames, int hasruler);
+void test_benchout(int mb, int ncols);
+void test_benchcols(int nrows);
+char *table_ref_outheader(TABLE t);
+char *table_ref_outinfo(TABLE t);
+char *table_ref_outbody(TABLE t);
+char *table_ref_outtable(TABLE t);
+
+int main(int argc, char **argv)
+{
+     TABLE tab1, tab2, tab3;
+     ITREE *setupcolnames, *col1;
+     TREE *setuprow1, *inforow1, *row1;
+     int r, i, h1, h2, h3;
+     char *cell1, *buf1, *buf2, *buf3, *buf4, *blanks;
+     long long *ivals;
+     double *dvals;
+     struct table_outbuf out;
+
+     if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	  nm_deactivate();	/* time the code, not the leak checker */
+     route_init(NULL, 0);
+     route_register(&rt_stdin_method);
+     route_register(&rt_stdout_method);
+     route_register(&rt_stderr_method);
+     elog_init(0, "holstore test", NULL);
+
+     /* test 1: create and destroy */
+     setupcolnames = itree_create();
+     itree_append(setupcolnames, "tom");
+     itree_append(setupcolnames, "dick");
+     itree_append(setupcolnames, "harry");
+     tab1 = table_create_t(setupcolnames);
+     if ( ! tab1 )
+       elog_die(FATAL, "[1] unable to create tab1");
+     table_destroy(tab1);
+
+     /* test 2: create and add a row */
+     setuprow1 = tree_create();
+     tree_add(setuprow1, "tom", "one");
+     tree_add(setuprow1, "dick", "two");
+     tree_add(setuprow1, "harry", "three");
+     tab1 = table_create_t(setupcolnames);
+     if ( ! tab1 )
+       elog_die(FATAL, "[2] unable to create tab1");
+     r = table_addrow_noalloc(tab1, setuprow1);
+     if (r == -1)
+       elog_die(FATAL, "[2] unable add row");
+     table_destroy(tab1);
+
+     /* test 3: add several rows */
+     tab1 = table_create_t(setupcolnames);
+     if ( ! tab1 )
+       elog_die(FATAL, "[3] unable to create tab1");
+     r = table_addrow_noalloc(tab1, setuprow1);
+     if (r == -1)
+       elog_die(FATAL, "[3a] unable add row");
+     r = table_addrow_noalloc(tab1, setuprow1);
+     if (r == -1)
+       elog_die(FATAL, "[3b] unable add row");
+     r = table_addrow_noalloc(tab1, setuprow1);
+     if (r == -1)
+       elog_die(FATAL, "[3c] unable add row");
+     table_destroy(tab1);
+
+     /* test 4: add several rows to test verious extraction methods */
+     tab1 = table_create_t(setupcolnames);
+     if ( ! tab1 )
+       elog_die(FATAL, "[4] unable to create tab1");
+     r = table_addrow_noalloc(tab1, setuprow1);
+     if (r == -1)
+       elog_die(FATAL, "[4a] unable add row");
+     r = table_addrow_noalloc(tab1, setuprow1);
+     if (r == -1)
+       elog_die(FATAL, "[4b] unable add row");
+     r = table_addrow_noalloc(tab1, setuprow1);
+     if (r == -1)
+       elog_die(FATAL, "[4c] unable add row");
+
+     /* test 5: get row */
+     row1 = table_getrow(tab1, 1);
+     if ( ! row1 )
+       elog_die(FATAL, "[5] unable to get row");
+     if ( (cell1 = tree_find(row1, "tom")) == TREE_NOVAL )
+       elog_die(FATAL, "[5] unable find tom in row");
+     if (strcmp(cell1, "one"))
+       elog_die(FATAL, "[5] tom != one in row");
+     if ( (cell1 = tree_find(row1, "dick")) == TREE_NOVAL )
+       elog_die(FATAL, "[5] unable find dick in row");
+     if (strcmp(cell1, "two"))
+       elog_die(FATAL, "[5] dick != two in row");
+     if ( (cell1 = tree_find(row1, "harry")) == TREE_NOVAL )
+       elog_die(FATAL, "[5] unable find harry in row");
+     if (strcmp(cell1, "three"))
+       elog_die(FATAL, "[5] harry != three in row");
+     if ( tree_find(row1, "sploge") != TREE_NOVAL)
+       elog_die(FATAL, "[5] shouldnt find sploge in row");
+     tree_destroy(row1);
+
+     /* test 6: get column */
+     col1 = table_getcol(tab1, "harry");
+     if ( ! col1 )
+       elog_die(FATAL, "[6] unable to get col");
+     if ( (cell1 = itree_find(col1, 0)) == ITREE_NOVAL )
+       elog_die(FATAL, "[6] unable find 0 in col");
+     if (strcmp(cell1, "three"))
+       elog_die(FATAL, "[6] 0 != three in col");
+     if ( (cell1 = itree_find(col1, 1)) == ITREE_NOVAL )
+       elog_die(FATAL, "[6] unable find 1 in col");
+     if (strcmp(cell1, "three"))
+       elog_die(FATAL, "[6] 1 != three in col");
+     if ( (cell1 = itree_find(col1, 2)) == ITREE_NOVAL )
+       elog_die(FATAL, "[6] unable find 2 in col");
+     if (strcmp(cell1, "three"))
+       elog_die(FATAL, "[6] 2 != three in col");
+     if ( itree_find(col1, 99) != ITREE_NOVAL )
+       elog_die(FATAL, "[6] shouldnt find 99 in row");
+     itree_destroy(col1);
+
+     /* test 7: iterative/sequential extraction */
+     table_first(tab1);
+     i=0;
+     while ( ! table_isbeyondend(tab1) ) {
+       row1 = table_getcurrentrow(tab1);
+       if ( ! row1 )
+	 elog_die(FATAL, "[7] unable to get row %d", i);
+       if ( (cell1 = tree_find(row1, "tom")) == TREE_NOVAL )
+	 elog_die(FATAL, "[7] unable find tom in row %d", i);
+       if (strcmp(cell1, "one"))
+	 elog_die(FATAL, "[7] tom != one in row %d", i);
+       if ( (cell1 = tree_find(row1, "dick")) == TREE_NOVAL )
+	 elog_die(FATAL, "[7] unable find dick in row %d", i);
+       if (strcmp(cell1, "two"))
+	 elog_die(FATAL, "[7] dick != two in row %d", i);
+       if ( (cell1 = tree_find(row1, "harry")) == TREE_NOVAL )
+	 elog_die(FATAL, "[7] unable find harry in row %d", i);
+       if (strcmp(cell1, "three"))
+	 elog_die(FATAL, "[7] harry != three in row %d", i);
+       if ( tree_find(row1, "sploge") != TREE_NOVAL )
+	 elog_die(FATAL, "[7] shouldnt find sploge in row %d", i);
+       tree_destroy(row1);
+       i++;
+       table_next(tab1);
+     }
+     if (i != 3)
+       elog_die(FATAL, "[7] there are not three rows");
+
+     /* test 8: create and empty table and add a couple of columns */
+     tab2 = table_create();
+     col1 = itree_create();
+     itree_append(col1, "one");
+     itree_append(col1, "one");
+     itree_append(col1, "one");
+     r = table_addcol(tab2, "tom", col1);
+     itree_destroy(col1);
+     col1 = itree_create();
+     itree_append(col1, "two");
+     itree_append(col1, "two");
+     itree_append(col1, "two");
+     r = table_addcol(tab2, "dick", col1);
+     itree_destroy(col1);
+     col1 = itree_create();
+     itree_append(col1, "three");
+     itree_append(col1, "three");
+     itree_append(col1, "three");
+     r = table_addcol(tab2, "harry", col1);
+     itree_destroy(col1);
+
+     /* test 9: print a table, but then save it as a tab delim format */
+     buf1 = table_print(tab1);
+     printf("Test 9 table:-\n%s", buf1);
+     nfree(buf1);
+     buf1 = table_outtable(tab1);
+
+     /* test 10: table traversing */
+     i=0;
+     table_traverse(tab1)
+          i++;
+     if (i != 3)
+       elog_die(FATAL, "[10] there are not three rows");
+
+     /* test 11: add info */
+     inforow1 = tree_create();
+     tree_add(inforow1, "tom", "thomas");
+     tree_add(inforow1, "dick", "richard");
+     tree_add(inforow1, "harry", "henry");
+     r = table_addinfo_t(tab1, "real names", inforow1);
+     if (r == 0)
+	  elog_die(FATAL, "[11a] can't addinfo_t()");
+     r = table_addemptyinfo(tab1, "blank line");
+     if (r != 2)
+	  elog_die(FATAL, "[11b] can't addemptyinfo() again");
+     r = table_rminfo(tab1, "not here");
+     if (r != 0)
+	  elog_die(FATAL, "[11c] shouldn't be able to delete");
+     r = table_rminfo(tab1, "real names");
+     if (r != 1)
+	  elog_die(FATAL, "[11d] not able to delete real names");
+     r = table_rminfo(tab1, "blank line");
+     if (r != 1)
+	  elog_die(FATAL, "[11e] not able to delete bank line");
+
+     /* test 12: scan a text representation of a table */
+     tab3 = table_create();
+     r = table_scan(tab3, buf1, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		    TABLE_HASRULER);
+     if (r != 3)
+	  elog_die(FATAL, "[12a] does not scan 3 lines");
+     table_freeondestroy(tab3, buf1);
+     buf2 = table_print(tab3);
+     printf("Test 12 table (same as 9):-\n%s", buf2);
+     nfree(buf2);
+     buf2 = table_outtable(tab3);
+     r = table_scan(tab3, buf2, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		    TABLE_HASRULER);
+     if (r != 3)
+	  elog_die(FATAL, "[12b] does not scan 3 lines");
+     table_freeondestroy(tab3, buf2);
+     buf2 = table_print(tab3);
+     buf3 = buf2 -1;
+     i=0;
+     while ((buf3=strchr(buf3+1, '\n')))	/* count \n */
+	  i++;
+     if (i != 8)
+	  elog_die(FATAL, "[12c] has not output 6 lines");
+     nfree(buf2);
+     table_destroy(tab2);
+
+     /* test 13: outheader, outbody and outtable for scanning and escaping */
+     buf3 = table_outtable(tab3);
+     tab2 = table_create_t(setupcolnames);
+     r = table_scan(tab2, buf3, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		    TABLE_HASRULER);
+     if (r != 6)
+	  elog_die(FATAL, "[13a] does not scan 6 lines");
+     table_freeondestroy(tab2, buf3);
+     tree_destroy(setuprow1);
+     setuprow1 = tree_create();
+     tree_add(setuprow1, "tom", "thomas a becket");
+     tree_add(setuprow1, "dick", "richard the III");
+     tree_add(setuprow1, "harry", "henry the VIII");
+     r = table_addrow_noalloc(tab2, setuprow1);
+     if (r == -1)
+       elog_die(FATAL, "[13a] unable add row");
+     tree_destroy(setuprow1);
+     setuprow1 = tree_create();
+/*     tree_add(setuprow1, "tom", "some words with \" that in");*/
+     tree_add(setuprow1, "tom", "some loose words");
+     tree_add(setuprow1, "dick", "");
      tree_add(setuprow1, "harry", "the last one was empty");
      r = table_addrow_noalloc(tab2, setuprow1);
      if (r == -1)
@@ -3049,149 +4079,1120 @@ int main(int argc, char **argv)
      buf3 = table_outtable(tab2);
      buf2 = buf3 -1;
      i=0;
-     while ((buf2=strchr(buf2+1, '\n')))	/* count \n */
+     while ((buf2=strchr(buf2+1, '\n')))	/* count \n */
+	  i++;
+     if (i != 18)
+	  elog_die(FATAL, "[13b] has not output 18 lines");
+
+     /* remove lists and tables */
+     nfree(buf3);
+     table_destroy(tab1);
+     table_destroy(tab2);
+     table_destroy(tab3);
+     itree_destroy(setupcolnames);
+     tree_destroy(setuprow1);
+     tree_destroy(inforow1);
+
+     /* test 14: scan a text buffer with out column headers into a table */
+     tab1 = table_create();
+     tab2 = table_create();
+     buf3 = xnstrdup(TEST_TEXT1);
+     r = table_scan(tab1, buf3, "\t", TABLE_SINGLESEP, TABLE_NOCOLNAMES, 
+		    TABLE_NORULER);
+     if (r != 1)
+	  elog_die(FATAL, "[14a] does not scan 1 line");
+     buf1 = table_print(tab1);
+     buf4 = xnstrdup(buf1);
+     r = table_scan(tab2, buf4, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		    TABLE_HASRULER);
+     if (r != 1)
+	  elog_die(FATAL, "[14b] does not scan 1 line");
+     buf2 = table_print(tab2);
+     if (strcmp(buf1, buf2) != 0)
+	  elog_die(FATAL, "[14] buffer mismatch");
+     nfree(buf1);
+     nfree(buf2);
+     nfree(buf3);
+     nfree(buf4);
+     table_destroy(tab1);
+     table_destroy(tab2);
+
+     /* test 15: scan a text buffer with column headers into a table */
+     tab1 = table_create();
+     tab2 = table_create();
+     buf3 = xnstrdup(TEST_TEXT2);
+     r = table_scan(tab1, buf3, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		    TABLE_NORULER);
+     if (r != 1)
+	  elog_die(FATAL, "[15a] does not scan 1 line");
+     buf1 = table_outtable(tab1);
+     buf4 = xnstrdup(buf1);
+     r = table_scan(tab2, buf4, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		    TABLE_HASRULER);
+     if (r != 1)
+	  elog_die(FATAL, "[15b] does not scan 1 line");
+     buf2 = table_outtable(tab2);
+     if (strcmp(buf1, buf2) != 0)
+	  elog_die(FATAL, "[15] buffer mismatch");
+     nfree(buf1);
+     nfree(buf2);
+     nfree(buf3);
+     nfree(buf4);
+     table_destroy(tab1);
+     table_destroy(tab2);
+
+     /* test 16: scan a text buffer with column headers and ruler into 
+      * a table */
+     tab1 = table_create();
+     tab2 = table_create();
+     buf3 = xnstrdup(TEST_TEXT3);
+     r = table_scan(tab1, buf3, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		    TABLE_HASRULER);
+     if (r != 1)
+	  elog_die(FATAL, "[16a] does not scan 1 line");
+     buf1 = table_outtable(tab1);
+     buf4 = xnstrdup(buf1);
+     r = table_scan(tab2, buf4, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		    TABLE_HASRULER);
+     if (r != 1)
+	  elog_die(FATAL, "[16b] does not scan 1 line");
+     buf2 = table_outtable(tab2);
+     if (strcmp(buf1, buf2) != 0)
+	  elog_die(FATAL, "[16] buffer mismatch");
+     nfree(buf1);
+     nfree(buf2);
+     nfree(buf3);
+     nfree(buf4);
+     table_destroy(tab1);
+     table_destroy(tab2);
+
+     /* test 17: scan a text buffer with column headers, ruler and 
+      * an info line into a table */
+     tab1 = table_create();
+     tab2 = table_create();
+     buf3 = xnstrdup(TEST_TEXT4);
+     r = table_scan(tab1, buf3, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		    TABLE_HASRULER);
+     if (r != 1)
+	  elog_die(FATAL, "[17a] does not scan 1 line");
+     buf1 = table_outtable(tab1);
+     buf4 = xnstrdup(buf1);
+     r = table_scan(tab2, buf4, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		    TABLE_HASRULER);
+     if (r != 1)
+	  elog_die(FATAL, "[17b] does not scan 1 line");
+     buf2 = table_outtable(tab2);
+     if (strcmp(buf1, buf2) != 0)
+	  elog_die(FATAL, "[17] buffer mismatch");
+     nfree(buf1);
+     nfree(buf2);
+     nfree(buf3);
+     nfree(buf4);
+     table_destroy(tab1);
+     table_destroy(tab2);
+
+     /* test 18: scan a text buffer with column headers, ruler and 
+      * two info lines (one with spaces) into a table */
+     tab1 = table_create();
+     tab2 = table_create();
+     buf3 = xnstrdup(TEST_TEXT5);
+     r = table_scan(tab1, buf3, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		    TABLE_HASRULER);
+     if (r != 1)
+	  elog_die(FATAL, "[18a] does not scan 1 line");
+     buf1 = table_outtable(tab1);
+     buf4 = xnstrdup(buf1);
+     r = table_scan(tab2, buf4, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		    TABLE_HASRULER);
+     if (r != 1)
+	  elog_die(FATAL, "[18b] does not scan 1 line");
+     buf2 = table_outtable(tab2);
+     if (strcmp(buf1, buf2) != 0)
+	  elog_die(FATAL, "[18] buffer mismatch");
+     nfree(buf1);
+     nfree(buf2);
+     nfree(buf3);
+     nfree(buf4);
+     table_destroy(tab1);
+     table_destroy(tab2);
+
+     /* test 19: column handles and cell access by row index */
+     setupcolnames = itree_create();
+     itree_append(setupcolnames, "tom");
+     itree_append(setupcolnames, "dick");
+     itree_append(setupcolnames, "harry");
+     setuprow1 = tree_create();
+     tree_add(setuprow1, "tom", "one");
+     tree_add(setuprow1, "dick", "two");
+     tree_add(setuprow1, "harry", "three");
+     tab1 = table_create_t(setupcolnames);
+     table_addrow_noalloc(tab1, setuprow1);
+     table_addrow_noalloc(tab1, setuprow1);
+     table_addrow_noalloc(tab1, setuprow1);
+     h1 = table_colhandle(tab1, "tom");
+     h2 = table_colhandle(tab1, "dick");
+     h3 = table_colhandle(tab1, "harry");
+     if (h1 == TABLE_NOHANDLE || h2 == TABLE_NOHANDLE || 
+	 h3 == TABLE_NOHANDLE)
+	  elog_die(FATAL, "[19a] missing handles");
+     if (h1 == h2 || h2 == h3 || h1 == h3)
+	  elog_die(FATAL, "[19a] handles not distinct");
+     if (table_colhandle(tab1, "sally") != TABLE_NOHANDLE)
+	  elog_die(FATAL, "[19a] handle for missing column");
+     if (strcmp(table_colhandlename(tab1, h2), "dick"))
+	  elog_die(FATAL, "[19a] handle name wrong");
+     if (table_rowindex(tab1, 2) != 2)
+	  elog_die(FATAL, "[19b] row index for key 2 != 2");
+     cell1 = table_getcell_h(tab1, 1, h2);
+     if ( ! cell1 || strcmp(cell1, "two"))
+	  elog_die(FATAL, "[19b] cell (1,dick) != two");
+     if ( ! table_replacecell_h(tab1, 1, h2, "deux"))
+	  elog_die(FATAL, "[19c] unable to replace cell");
+     cell1 = table_getcell(tab1, 1, "dick");
+     if ( ! cell1 || strcmp(cell1, "deux"))
+	  elog_die(FATAL, "[19c] replaced cell (1,dick) != deux");
+     if (table_getcell_h(tab1, 3, h2) || table_getcell_h(tab1, 0, 99))
+	  elog_die(FATAL, "[19c] got cell out of range");
+     table_rmrow(tab1, 0);
+     if (table_rowindex(tab1, 0) != -1 || table_rowindex(tab1, 1) != 0)
+	  elog_die(FATAL, "[19d] row index wrong after removal");
+     cell1 = table_getcell_h(tab1, 0, h2);
+     if ( ! cell1 || strcmp(cell1, "deux"))
+	  elog_die(FATAL, "[19d] cell (0,dick) != deux after removal");
+     i = 0;
+     table_traverse(tab1) {
+	  if (table_getcurrentrowindex(tab1) != i++)
+	       elog_die(FATAL, "[19e] current row index != %d", i-1);
+	  table_replacecurrentcell_alloc_h(tab1, h3, "trois");
+     }
+     if (i != 2)
+	  elog_die(FATAL, "[19e] traversed %d rows, not 2", i);
+     table_gotorowindex(tab1, 1);
+     cell1 = table_getcurrentcell(tab1, "harry");
+     if ( ! cell1 || strcmp(cell1, "trois"))
+	  elog_die(FATAL, "[19e] current cell (1,harry) != trois");
+     table_renamecol(tab1, "dick", "richard");
+     if (table_colhandle(tab1, "dick") != TABLE_NOHANDLE ||
+	 table_colhandle(tab1, "richard") != h2)
+	  elog_die(FATAL, "[19f] handle not renamed");
+     table_rmcol(tab1, "tom");
+     if (table_colhandle(tab1, "tom") != TABLE_NOHANDLE ||
+	 table_getcell_h(tab1, 0, h1) != NULL)
+	  elog_die(FATAL, "[19f] removed column still has a handle");
+     cell1 = table_getcell_h(tab1, 0, h3);
+     if ( ! cell1 || strcmp(cell1, "trois"))
+	  elog_die(FATAL, "[19f] cell (0,harry) != trois after rmcol");
+     table_destroy(tab1);
+     itree_destroy(setupcolnames);
+     tree_destroy(setuprow1);
+
+     /* test 20: arena allocation, with small blocks to force several 
+      * blocks and oversized strings */
+     tab1 = table_create();
+     table_usearena(tab1, 64);
+     table_addcol(tab1, "a", NULL);
+     table_addcol(tab1, "b", NULL);
+     h1 = table_colhandle(tab1, "a");
+     h2 = table_colhandle(tab1, "b");
+     for (i=0; i < 100; i++) {
+	  table_addemptyrow(tab1);
+	  table_replacecurrentcell_alloc_h(tab1, h1, util_i32toa(i));
+	  table_replacecurrentcell_alloc_h(tab1, h2, TEST_TEXT5);
+     }
+     if (tab1->arena == NULL || tab1->arena->next == NULL)
+	  elog_die(FATAL, "[20a] arena not in use");
+     buf1 = table_alloc(tab1, 3);
+     buf2 = table_alloc(tab1, sizeof(double));
+     if (((long) buf2) % TABLE_ARENAALIGN)
+	  elog_die(FATAL, "[20a] table_alloc() not aligned");
+     buf3 = table_strndup(tab1, "abcdef", 3);
+     if (strcmp(buf3, "abc"))
+	  elog_die(FATAL, "[20b] strndup %s != abc", buf3);
+     for (i=0; i < 100; i++) {
+	  cell1 = table_getcell_h(tab1, i, h1);
+	  if (strcmp(cell1, util_i32toa(i)))
+	       elog_die(FATAL, "[20c] cell (%d,a) = %s", i, cell1);
+	  cell1 = table_getcell_h(tab1, i, h2);
+	  if (strcmp(cell1, TEST_TEXT5))
+	       elog_die(FATAL, "[20c] cell (%d,b) = %s", i, cell1);
+     }
+     tab2 = table_create_fromdonor(tab1);
+     if (tab2->arenablk != 64)
+	  elog_die(FATAL, "[20d] donor's arena not inherited");
+     table_destroy(tab2);
+     table_destroy(tab1);
+
+     /* test 21: streaming output of awkward cells and info against the 
+      * reference, into a buffer with head room that is then reused */
+     tab1 = table_create();
+     table_addcol(tab1, "a", NULL);
+     table_addcol(tab1, "b", NULL);
+     table_addcol(tab1, "c", NULL);
+     table_addemptyrow(tab1);
+     table_replacecurrentcell(tab1, "a", "plain");
+     table_replacecurrentcell(tab1, "b", "with\ttab \"quote\"\nline");
+     table_replacecurrentcell(tab1, "c", "");
+     table_addemptyrow(tab1);
+     table_replacecurrentcell(tab1, "a", "2");
+     table_replacecurrentcell(tab1, "c", "three");
+     table_addemptyinfo(tab1, "type");
+     table_addemptyinfo(tab1, "info");
+     table_replaceinfocell(tab1, "type", "a", "int");
+     table_replaceinfocell(tab1, "info", "b", "b\tinfo");
+     buf1 = table_ref_outtable(tab1);
+     buf2 = table_outtable(tab1);
+     if (strcmp(buf1, buf2))
+	  elog_die(FATAL, "[21a] outtable differs:-\n%s\nreference:-\n%s", 
+		   buf2, buf1);
+     nfree(buf1);
+     nfree(buf2);
+     table_outbuf_init(&out, 24);
+     for (i=0; i < 3; i++) {
+	  table_outbuf_reset(&out);
+	  r = table_outbody_buf(tab1, &out);
+	  buf1 = table_ref_outbody(tab1);
+	  if (r != strlen(buf1) || table_outbuf_len(&out) != r ||
+	      strcmp(table_outbuf_text(&out), buf1))
+	       elog_die(FATAL, "[21b] body %d differs:-\n%s\nreference:-\n%s",
+			i, table_outbuf_text(&out), buf1);
+	  nfree(buf1);
+     }
+     table_outbuf_reset(&out);
+     table_outheader_buf(tab1, &out);
+     buf1 = table_ref_outheader(tab1);
+     if (strcmp(table_outbuf_text(&out), buf1))
+	  elog_die(FATAL, "[21c] header %s != %s", table_outbuf_text(&out), 
+		   buf1);
+     nfree(buf1);
+     table_outbuf_reset(&out);
+     table_outinfo_buf(tab1, &out);
+     buf1 = table_ref_outinfo(tab1);
+     if (strcmp(table_outbuf_text(&out), buf1))
+	  elog_die(FATAL, "[21d] info %s != %s", table_outbuf_text(&out), 
+		   buf1);
+     nfree(buf1);
+     table_outbuf_reset(&out);
+     table_outtable_buf(tab1, &out, ',', TABLE_WITHCOLNAMES, 0);
+     if (strncmp(table_outbuf_text(&out), "a,b,c\n--\nplain,", 15))
+	  elog_die(FATAL, "[21e] without info, comma separated: %s", 
+		   table_outbuf_text(&out));
+     table_outbuf_free(&out);
+     table_destroy(tab1);
+
+     /* test 22: column stores, typed from the info, behind the cell 
+      * calls and against the same table held in trees */
+     tab1 = table_create();
+     if (table_usecolumns(tab1) != 1)
+	  elog_die(FATAL, "[22a] unable to use columns");
+     buf1 = xnstrdup(TEST_TEXT6);
+     table_scan(tab1, buf1, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		TABLE_HASRULER);
+     table_freeondestroy(tab1, buf1);
+     if (table_nrows(tab1) != 3)
+	  elog_die(FATAL, "[22a] %d rows scanned, not 3", table_nrows(tab1));
+     h1 = table_colhandle(tab1, "n");
+     h2 = table_colhandle(tab1, "f");
+     h3 = table_colhandle(tab1, "s");
+     if (table_coltype(tab1, h1) != TABLE_COLINT || 
+	 table_coltype(tab1, h2) != TABLE_COLDBL || 
+	 table_coltype(tab1, h3) != TABLE_COLSTR)
+	  elog_die(FATAL, "[22b] column types %d %d %d", 
+		   table_coltype(tab1, h1), table_coltype(tab1, h2), 
+		   table_coltype(tab1, h3));
+     ivals  = table_colints(tab1, h1);
+     dvals  = table_coldbls(tab1, h2);
+     blanks = table_colblanks(tab1, h1);
+     if (ivals == NULL || ivals[0] != 1 || ivals[1] != 7 || 
+	 blanks[0] || blanks[1] || ! blanks[2])
+	  elog_die(FATAL, "[22c] integer column wrong");
+     if (dvals == NULL || dvals[0] != 1.5 || dvals[1] != -2.0 || 
+	 dvals[2] != 0.25 || table_colints(tab1, h2) != NULL)
+	  elog_die(FATAL, "[22c] double column wrong");
+     cell1 = table_getcell(tab1, 1, "n");
+     if (cell1 == NULL || strcmp(cell1, "007"))
+	  elog_die(FATAL, "[22d] cell (1,n) = %s not 007", cell1);
+     cell1 = table_getcell(tab1, 1, "f");
+     if (cell1 == NULL || strcmp(cell1, "-2"))
+	  elog_die(FATAL, "[22d] cell (1,f) = %s not -2", cell1);
+     tab2 = table_create();
+     buf2 = xnstrdup(TEST_TEXT6);
+     table_scan(tab2, buf2, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		TABLE_HASRULER);
+     table_freeondestroy(tab2, buf2);
+     buf1 = table_outtable(tab1);
+     buf2 = table_outtable(tab2);
+     if (strcmp(buf1, buf2))
+	  elog_die(FATAL, "[22e] outtable differs:-\n%s\ntrees:-\n%s", 
+		   buf1, buf2);
+     nfree(buf1);
+     nfree(buf2);
+     if ( ! tab1->colvecs )
+	  elog_die(FATAL, "[22e] output moved the cells to trees");
+
+     /* copied cells: numbers are held as values and their text made 
+      * when asked for */
+     r = table_addemptyrow(tab1);
+     table_replacecurrentcell_alloc(tab1, "n", "42");
+     table_replacecurrentcell_alloc(tab1, "f", "3");
+     table_replacecurrentcell_alloc(tab1, "s", "four");
+     ivals = table_colints(tab1, h1);
+     if (r != 3 || ivals[3] != 42 || tab1->colref[h1].vec->text[3])
+	  elog_die(FATAL, "[22f] appended row %d not held as a value", r);
+     cell1 = table_getcell(tab1, 3, "f");
+     if (cell1 == NULL || strcmp(cell1, "3"))
+	  elog_die(FATAL, "[22f] cell (3,f) = %s not 3", cell1);
+     table_first(tab1);
+     table_next(tab1);
+     if (table_getcurrentrowkey(tab1) != 1 || 
+	 strcmp(table_getcurrentcell(tab1, "s"), "two"))
+	  elog_die(FATAL, "[22f] current row not 1");
+
+     /* a cell that is not a number makes the column a string column */
+     table_replacecell_alloc(tab1, 2, "f", "n/a");
+     if (table_coltype(tab1, h2) != TABLE_COLSTR || 
+	 table_coldbls(tab1, h2) != NULL ||
+	 strcmp(table_getcell(tab1, 0, "f"), "1.5") || 
+	 strcmp(table_getcell(tab1, 2, "f"), "n/a"))
+	  elog_die(FATAL, "[22g] not demoted to strings");
+     tab3 = table_create_fromdonor(tab1);
+     if ( ! tab3->colvecs )
+	  elog_die(FATAL, "[22g] donor's columns not inherited");
+     table_destroy(tab3);
+
+     /* calls needing trees move the cells there */
+     table_sort(tab1, "s", NULL);
+     if (tab1->colvecs || table_coltype(tab1, h1) != TABLE_COLNONE || 
+	 ! table_check(tab1))
+	  elog_die(FATAL, "[22h] not moved to trees");
+     table_first(tab1);
+     if (strcmp(table_getcurrentcell(tab1, "s"), "four") ||
+	 strcmp(table_getcurrentcell(tab1, "n"), "42"))
+	  elog_die(FATAL, "[22h] sorted first row is not four,42");
+     if (strcmp(table_getcell(tab1, 1, "n"), "007") ||
+	 strcmp(table_getcell(tab1, 2, "f"), "n/a"))
+	  elog_die(FATAL, "[22h] cells changed by moving to trees");
+     table_destroy(tab2);
+     table_destroy(tab1);
+
+     /* benchmark if asked: t.table bench [nrows [ncols]] */
+     if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	  test_bench(argc > 2 ? atoi(argv[2]) : 2000, 
+		     argc > 3 ? atoi(argv[3]) : 60);
+     if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+	  test_benchscan(1, 60);
+	  test_benchscan(100, 60);
+	  test_benchout(8, 60);
+	  test_benchcols(argc > 2 ? atoi(argv[2]) * 100 : 200000);
+     }
+
+     /* shutdown and exit */
+     elog_fini();
+     route_fini();
+
+     printf("tests finished successfully\n");
+     exit(0);
+}
+
+
+/* time filling and reading a probe sized table by column name and 
+ * by column handle */
+void test_bench(int nrows, int ncols)
+{
+     TABLE tab;
+     ITREE *colnames;
+     char **names, *cell;
+     int *handles, r, c, n, a;
+     struct timeval t1, t2;
+     double secs;
+
+     names   = xnmalloc(sizeof(char *) * ncols);
+     handles = xnmalloc(sizeof(int) * ncols);
+     colnames = itree_create();
+     for (c=0; c < ncols; c++) {
+	  names[c] = xnmalloc(16);
+	  sprintf(names[c], "column%d", c);
+	  itree_append(colnames, names[c]);
+     }
+     printf("table: %d rows x %d cols\n", nrows, ncols);
+     printf("%-10s %-10s %10s\n", "access", "path", "secs");
+
+     /* fill by name */
+     tab = table_create_t(colnames);
+     gettimeofday(&t1, NULL);
+     for (r=0; r < nrows; r++) {
+	  table_addemptyrow(tab);
+	  for (c=0; c < ncols; c++)
+	       table_replacecurrentcell(tab, names[c], "1234");
+     }
+     gettimeofday(&t2, NULL);
+     secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+     printf("%-10s %-10s %10.4f\n", "fill", "name", secs);
+
+     /* read by name */
+     n = 0;
+     gettimeofday(&t1, NULL);
+     for (r=0; r < nrows; r++)
+	  for (c=0; c < ncols; c++)
+	       if ((cell = table_getcell(tab, r, names[c])) && *cell)
+		    n++;
+     gettimeofday(&t2, NULL);
+     secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+     printf("%-10s %-10s %10.4f\n", "read", "name", secs);
+     table_destroy(tab);
+
+     /* fill by handle */
+     tab = table_create_t(colnames);
+     gettimeofday(&t1, NULL);
+     for (c=0; c < ncols; c++)
+	  handles[c] = table_colhandle(tab, names[c]);
+     for (r=0; r < nrows; r++) {
+	  table_addemptyrow(tab);
+	  for (c=0; c < ncols; c++)
+	       table_replacecurrentcell_h(tab, handles[c], "1234");
+     }
+     gettimeofday(&t2, NULL);
+     secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+     printf("%-10s %-10s %10.4f\n", "fill", "handle", secs);
+
+     /* read by handle */
+     gettimeofday(&t1, NULL);
+     for (r=0; r < nrows; r++)
+	  for (c=0; c < ncols; c++)
+	       if ((cell = table_getcell_h(tab, r, handles[c])) && *cell)
+		    n--;
+     gettimeofday(&t2, NULL);
+     secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+     printf("%-10s %-10s %10.4f\n", "read", "handle", secs);
+     if (n != 0)
+	  elog_die(FATAL, "[bench] name and handle reads differ by %d", n);
+     table_destroy(tab);
+
+     /* fill copied cells from the heap then an arena, including destroy */
+     for (a=0; a < 2; a++) {
+	  gettimeofday(&t1, NULL);
+	  tab = table_create_t(colnames);
+	  if (a)
+	       table_usearena(tab, 0);
+	  for (r=0; r < nrows; r++) {
+	       table_addemptyrow(tab);
+	       for (c=0; c < ncols; c++)
+		    table_replacecurrentcell_alloc_h(tab, handles[c], "1234");
+	  }
+	  table_destroy(tab);
+	  gettimeofday(&t2, NULL);
+	  secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+	  printf("%-10s %-10s %10.4f\n", "fill+free", a ? "arena" : "heap", 
+		 secs);
+     }
+
+     for (c=0; c < ncols; c++)
+	  nfree(names[c]);
+     nfree(names);
+     nfree(handles);
+     itree_destroy(colnames);
+}
+
+
+
+/* Make a buffer of about mb megabytes in the format of a ring's data: 
+ * column names, an info line, a ruler then rows of numbers */
+char *test_mkscantext(int mb, int ncols)
+{
+     char *buf, *pt;
+     long size, r;
+     int c;
+
+     size = (long) mb * 1024 * 1024;
+     buf = xnmalloc(size + 4096);
+     pt = buf;
+     for (c=0; c < ncols; c++)
+	  pt += sprintf(pt, "column%d\t", c);
+     *(pt-1) = '\n';
+     for (c=0; c < ncols; c++)
+	  pt += sprintf(pt, "%s\t", c % 2 ? "u32" : "str");
+     pt += sprintf(pt, "type\n");
+     for (c=0; c < ncols; c++)
+	  pt += sprintf(pt, "--\t");
+     *(pt-1) = '\n';
+     for (r=0; pt - buf < size; r++) {
+	  for (c=0; c < ncols; c++)
+	       pt += sprintf(pt, "%ld\t", (r * 7919 + c) % 100000);
+	  *(pt-1) = '\n';
+     }
+     *pt = '\0';
+
+     return buf;
+}
+
+
+/* time scanning an mb megabyte buffer with the flat tokenizer against
+ * the list of lists, then into a table against the reference scan, 
+ * checking the tables are the same. Tables are only built for smaller
+ * buffers to limit memory */
+void test_benchscan(int mb, int ncols)
+{
+     struct util_scantoks toks = UTIL_SCANTOKSINIT;
+     struct timeval t1, t2;
+     char *text, *buf, *out1, *out2;
+     ITREE *lol;
+     TABLE tab1, tab2;
+     double secs;
+     long len;
+     int n1, n2;
+
+     text = test_mkscantext(mb, ncols);
+     len = strlen(text);
+     buf = xnmalloc(len + 1);
+     printf("scan: %dMB, %d cols\n", mb, ncols);
+     printf("%-10s %-10s %10s %10s\n", "scan", "path", "secs", "MB/s");
+
+     memcpy(buf, text, len+1);
+     gettimeofday(&t1, NULL);
+     n1 = util_scantext(buf, "\t", UTIL_SINGLESEP, &lol);
+     util_scanfree(lol);
+     gettimeofday(&t2, NULL);
+     secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+     printf("%-10s %-10s %10.4f %10.1f\n", "tokenize", "lists", secs, 
+	    mb / secs);
+
+     memcpy(buf, text, len+1);
+     gettimeofday(&t1, NULL);
+     n2 = util_scantoks(buf, "\t", UTIL_SINGLESEP, &toks);
+     gettimeofday(&t2, NULL);
+     util_scantoksfree(&toks);
+     secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+     printf("%-10s %-10s %10.4f %10.1f\n", "tokenize", "flat", secs, 
+	    mb / secs);
+     if (n1 != n2)
+	  elog_die(FATAL, "[benchscan] %d lines in lists, %d flat", n1, n2);
+
+     if (mb <= 16) {
+	  memcpy(buf, text, len+1);
+	  tab1 = table_create();
+	  gettimeofday(&t1, NULL);
+	  n1 = table_ref_scan(tab1, buf, "\t", TABLE_SINGLESEP, 
+			      TABLE_HASCOLNAMES, TABLE_HASRULER);
+	  gettimeofday(&t2, NULL);
+	  secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+	  printf("%-10s %-10s %10.4f %10.1f\n", "table", "reference", secs, 
+		 mb / secs);
+	  out1 = table_outtable(tab1);
+	  table_destroy(tab1);
+
+	  memcpy(buf, text, len+1);
+	  tab2 = table_create();
+	  gettimeofday(&t1, NULL);
+	  n2 = table_scan(tab2, buf, "\t", TABLE_SINGLESEP, 
+			  TABLE_HASCOLNAMES, TABLE_HASRULER);
+	  gettimeofday(&t2, NULL);
+	  secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+	  printf("%-10s %-10s %10.4f %10.1f\n", "table", "table_scan", secs, 
+		 mb / secs);
+	  out2 = table_outtable(tab2);
+	  table_destroy(tab2);
+
+	  if (n1 != n2 || strcmp(out1, out2) != 0)
+	       elog_die(FATAL, "[benchscan] tables differ");
+	  nfree(out1);
+	  nfree(out2);
+     }
+
+     nfree(buf);
+     nfree(text);
+}
+
+
+/* time serialising an mb megabyte table with the reference joins, 
+ * table_outtable() and a reused buffer, checking they are the same */
+void test_benchout(int mb, int ncols)
+{
+     struct table_outbuf out;
+     struct timeval t1, t2;
+     char *text, *out1, *out2;
+     TABLE tab;
+     double secs;
+     int i, n=10;
+
+     text = test_mkscantext(mb, ncols);
+     tab = table_create();
+     table_scan(tab, text, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
+		TABLE_HASRULER);
+     printf("out: %dMB, %d cols, %d times\n", mb, ncols, n);
+     printf("%-10s %-10s %10s %10s\n", "out", "path", "secs", "MB/s");
+
+     gettimeofday(&t1, NULL);
+     for (i=0; i < n; i++) {
+	  out1 = table_ref_outtable(tab);
+	  nfree(out1);
+     }
+     gettimeofday(&t2, NULL);
+     secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+     printf("%-10s %-10s %10.4f %10.1f\n", "table", "reference", secs, 
+	    mb * n / secs);
+
+     gettimeofday(&t1, NULL);
+     for (i=0; i < n; i++) {
+	  out2 = table_outtable(tab);
+	  nfree(out2);
+     }
+     gettimeofday(&t2, NULL);
+     secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+     printf("%-10s %-10s %10.4f %10.1f\n", "table", "outtable", secs, 
+	    mb * n / secs);
+
+     table_outbuf_init(&out, 0);
+     gettimeofday(&t1, NULL);
+     for (i=0; i < n; i++) {
+	  table_outbuf_reset(&out);
+	  table_outtable_buf(tab, &out, '\t', TABLE_WITHCOLNAMES, 
+			     TABLE_WITHINFO);
+     }
+     gettimeofday(&t2, NULL);
+     secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+     printf("%-10s %-10s %10.4f %10.1f\n", "table", "reused buf", secs, 
+	    mb * n / secs);
+
+     out1 = table_ref_outtable(tab);
+     if (strcmp(out1, table_outbuf_text(&out)) != 0)
+	  elog_die(FATAL, "[benchout] output differs");
+     nfree(out1);
+     table_outbuf_free(&out);
+     table_destroy(tab);
+     nfree(text);
+}
+
+
+/*
+ * The previous implementation of table_scan(), which scans the buffer 
+ * into a list of lists with util_scantext() and then copies each field 
+ * into the table by column name. Kept as the reference for speed.
+ */
+int table_ref_scan(TABLE t, char *buffer, char *sepstr, int mode, 
+		   int hascolnames, int hasruler)
+{
+     int i, nlines, ncols, line, row_ncols;
+     ITREE *colnames=NULL, *row, *parselist=NULL;
+     char tmp[20], *tmpcpy, *iname;
+
+     /* scan the buffer into word lists */
+     if (mode == TABLE_SINGLESEP)
+          nlines = util_scantext(buffer, sepstr, UTIL_SINGLESEP, &parselist);
+     else if (mode == TABLE_MULTISEP)
+          nlines = util_scantext(buffer, sepstr, UTIL_MULTISEP, &parselist);
+     else if (mode == TABLE_CFMODE)
+          nlines = util_scancftext(buffer, sepstr, NULL, &parselist);
+     if (nlines == -1) {
+	  if (parselist)
+	       util_scanfree(parselist);
+	  return -1;		/* error */
+     }
+     if (nlines == 0) {
+	  return 0;		/* empty buffer */
+     }
+
+     /* check number of lines */
+     i=0;
+     if (hascolnames)
 	  i++;
-     if (i != 18)
-	  elog_die(FATAL, "[13b] has not output 18 lines");
+     if (hasruler)
+	  i++;
+     if (nlines < i) {
+          elog_printf(ERROR, "Need %d lines in buffer, only have %d",
+		      i, nlines);
+	  util_scanfree(parselist);
+	  return -1;
+     }
+     if (nlines == i) {
+	  util_scanfree(parselist);
+	  return 0;
+     }
+
+     /* check the number of buffer columns match ours */
+     ncols = 0;
+     itree_first(parselist);
+     if (hascolnames) {
+	  ncols = itree_n(itree_get(parselist));
+	  if (t->ncols && ncols != t->ncols) {
+	       util_scanfree(parselist);
+	       elog_printf(ERROR, "Header cols (%d) and table cols "
+			   "(%d) do not match", ncols, t->ncols);
+	       return -1;
+	  }
+	  itree_next(parselist);
+     }
+     if (hasruler) {
+	  while ( ! itree_isbeyondend(parselist) ) {
+	       row = itree_get(parselist);
+	       row_ncols = itree_n(row);
+	       if (strncmp(itree_find(row, 0), "--", 2) == 0) {
+	       /*if ( *( (char *) itree_find(row, 0) ) == '-' ) {*/
+		    itree_next(parselist);
+		    break;
+	       }
+	       if (t->ncols && row_ncols != t->ncols+1) {
+		    util_scanfree(parselist);
+		    elog_printf(ERROR, "info cols (%d+1) and header "
+				"(%d) do not match", row_ncols, t->ncols);
+		    return -1;
+	       }
+	       if (ncols == 0)
+		    ncols = row_ncols-1;
+	       if (ncols && row_ncols != ncols+1) {
+		    util_scanfree(parselist);
+		    elog_printf(DIAG, "info cols (%d+1) and header "
+				"(%d) do not match", row_ncols, ncols);
+		    return -1;
+	       }
+	       itree_next(parselist);
+	  }
+     }
+     line = 1;
+     while ( ! itree_isbeyondend(parselist) ) {
+	  row = itree_get(parselist);
+	  row_ncols = itree_n(row);
+	  if (t->ncols && row_ncols != t->ncols) {
+	       elog_printf(DIAG, "scanned text at data line %d has %d "
+			   "cols not %d cols expected by table",
+			   line, row_ncols, t->ncols);
+	       util_scanfree(parselist);
+	       return -1;
+	  }
+	  if (ncols == 0)
+	       ncols = row_ncols;
+	  if (ncols && row_ncols != ncols) {
+	       elog_printf(DIAG, "scanned text at data line %d has %d "
+			   "cols not %d cols expected by header",
+			   line, row_ncols, ncols);
+	       util_scanfree(parselist);
+	       return -1;
+	  }
+	  itree_next(parselist);
+	  line++;
+     }
+
+     /* check the header names matches our table's */
+     itree_first(parselist);
+     line = 1;
+     if (hascolnames) {
+	  colnames = itree_get(parselist);
+	  if (t->ncols) {
+	       /* check the column headers match the existing ones */
+	       /* NOT IMPLEMENTED YET */
+	  } else {
+	       /* use the column headers to setup this table */
+	       t->ncols = ncols;
+	       itree_traverse(colnames) {
+		    table_priv_addcol(t, itree_get(colnames), itree_create());
+		    itree_append(t->colorder, itree_get(colnames));
+	       }
+	  }
+	  itree_next(parselist);
+	  line++;
+     } else {
+	  if (t->ncols) {
+	       /* treat the whole buffer as data */
+	       /* NOT IMPLEMENTED YET */
+	  } else {
+	       /* generate default column headers to match the buffer */
+	       t->ncols = ncols;
+	       for (i=0; i<ncols; i++) {
+		    /* create data to be freed on destruction */
+		    sprintf(tmp, "column_%d", i);
+		    tmpcpy = table_strdup(t, tmp);
+		    table_priv_addcol(t, tmpcpy, itree_create());
+		    itree_append(t->colorder, tmpcpy);
+	       }
+	  }
+     }
+
+     /* scan for info lines if a ruler is present */
+     if (hasruler) {
+	  while (line <= nlines) {
+	       row = itree_get(parselist);
+	       itree_first(row);
+	       if (strncmp(itree_get(itree_get(parselist)), "--", 2) == 0) {
+	       /*if (*((char *)itree_get(itree_get(parselist))) == '-') {*/
+		    /* ruler found */
+		    itree_next(parselist);
+		    line++;
+		    break;
+	       }
+
+	       /* info line - create an empty info row */
+	       itree_last(row);
+	       iname = itree_get(row);
+	       i = table_addemptyinfo(t, iname);
+
+	       /* add to row */
+	       itree_first(row);
+	       itree_traverse(t->colorder) {
+		    table_replaceinfocell(t, iname, itree_get(t->colorder),
+					  itree_get(row));
+		    itree_next(row);
+	       }
+
+	       itree_next(parselist);
+	       line++;
+	  }
+     }
+
+     /* add remaining lines to table */
+
+     /* reset linecounter: this represents the number of non-header
+     * lines parsed and should be equal to nrows */
+     nlines -= line-1;
+
+     /* by not providing headers we have to follow t->colorder for the 
+      * assignment of tokens to columns. */
+     if ( ! hascolnames) {
+	  colnames = itree_create();
+	  tree_traverse(t->colorder)
+	       itree_append(colnames, itree_get(t->colorder));
+     }
+
+     while( ! itree_isbeyondend(parselist) ) {
+	  itree_first(colnames);
+	  row = itree_get(parselist);
+	  table_addemptyrow(t);
+	  itree_traverse(row) {
+	       if (table_replacecurrentcell(t, itree_get(colnames), 
+					    itree_get(row)) == 0) {
+		    /* insertion failed */
+		    util_scanfree(parselist);
+		    if ( ! hascolnames )
+			 itree_destroy(colnames);
+		    return -1;
+	       }
+	       itree_next(colnames);
+	  }
+	  itree_next(parselist);
+     }
+
+     /* clear up and return */
+     util_scanfree(parselist);
+     if ( ! hascolnames )
+	  itree_destroy(colnames);
+     return nlines;
+}
+
+
+/*
+ * The previous implementation of table_outtable() and its parts, which 
+ * size and fill a string for each section and join them with 
+ * util_strjoin(). Kept as the reference for speed and output.
+ */
+char *table_ref_outheader(TABLE t)
+{
+     int i=0;
+     char *outbuf, *outpt;
+
+     /* return if no columns */
+     if (t == NULL || t->ncols == 0)
+	  return NULL;
+
+     /* get size of buffer */
+     tree_traverse(t->data)
+	  i += strlen( tree_getkey(t->data) )+3;
+
+     /* allocate and copy headers */
+     outpt = outbuf = xnmalloc(i);
+     itree_traverse(t->colorder) {
+	  if (tree_find(t->data, itree_get(t->colorder)) == TREE_NOVAL)
+	       continue;
+	  util_quotestr(tree_getkey(t->data), "\t", outpt, i-(outpt-outbuf));
+	  while (*outpt)
+	       outpt++;
+	  *(outpt++) = t->separator;
+     }
+     *(--outpt) = '\0';
+
+     return outbuf;
+}
 
-     /* remove lists and tables */
-     nfree(buf3);
-     table_destroy(tab1);
-     table_destroy(tab2);
-     table_destroy(tab3);
-     itree_destroy(setupcolnames);
-     tree_destroy(setuprow1);
-     tree_destroy(inforow1);
 
-     /* test 14: scan a text buffer with out column headers into a table */
-     tab1 = table_create();
-     tab2 = table_create();
-     buf3 = xnstrdup(TEST_TEXT1);
-     r = table_scan(tab1, buf3, "\t", TABLE_SINGLESEP, TABLE_NOCOLNAMES, 
-		    TABLE_NORULER);
-     if (r != 1)
-	  elog_die(FATAL, "[14a] does not scan 1 line");
-     buf1 = table_print(tab1);
-     buf4 = xnstrdup(buf1);
-     r = table_scan(tab2, buf4, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
-		    TABLE_HASRULER);
-     if (r != 1)
-	  elog_die(FATAL, "[14b] does not scan 1 line");
-     buf2 = table_print(tab2);
-     if (strcmp(buf1, buf2) != 0)
-	  elog_die(FATAL, "[14] buffer mismatch");
-     nfree(buf1);
-     nfree(buf2);
-     nfree(buf3);
-     nfree(buf4);
-     table_destroy(tab1);
-     table_destroy(tab2);
+char *table_ref_outinfo(TABLE t)
+{
+     int toklen, bufalloc;
+     char *outbuf, *outpt, *tok, *newbuf, strbuf[8000];
 
-     /* test 15: scan a text buffer with column headers into a table */
-     tab1 = table_create();
-     tab2 = table_create();
-     buf3 = xnstrdup(TEST_TEXT2);
-     r = table_scan(tab1, buf3, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
-		    TABLE_NORULER);
-     if (r != 1)
-	  elog_die(FATAL, "[15a] does not scan 1 line");
-     buf1 = table_outtable(tab1);
-     buf4 = xnstrdup(buf1);
-     r = table_scan(tab2, buf4, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
-		    TABLE_HASRULER);
-     if (r != 1)
-	  elog_die(FATAL, "[15b] does not scan 1 line");
-     buf2 = table_outtable(tab2);
-     if (strcmp(buf1, buf2) != 0)
-	  elog_die(FATAL, "[15] buffer mismatch");
-     nfree(buf1);
-     nfree(buf2);
-     nfree(buf3);
-     nfree(buf4);
-     table_destroy(tab1);
-     table_destroy(tab2);
+     /* return if no data or info */
+     if (t == NULL || t->ncols == 0 || tree_n(t->infolookup) == 0)
+	  return NULL;
 
-     /* test 16: scan a text buffer with column headers and ruler into 
-      * a table */
-     tab1 = table_create();
-     tab2 = table_create();
-     buf3 = xnstrdup(TEST_TEXT3);
-     r = table_scan(tab1, buf3, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
-		    TABLE_HASRULER);
-     if (r != 1)
-	  elog_die(FATAL, "[16a] does not scan 1 line");
-     buf1 = table_outtable(tab1);
-     buf4 = xnstrdup(buf1);
-     r = table_scan(tab2, buf4, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
-		    TABLE_HASRULER);
-     if (r != 1)
-	  elog_die(FATAL, "[16b] does not scan 1 line");
-     buf2 = table_outtable(tab2);
-     if (strcmp(buf1, buf2) != 0)
-	  elog_die(FATAL, "[16] buffer mismatch");
-     nfree(buf1);
-     nfree(buf2);
-     nfree(buf3);
-     nfree(buf4);
-     table_destroy(tab1);
-     table_destroy(tab2);
+     /* allocate fixed buffer for speed */
+     bufalloc = TABLE_OUTINFOBUFSZ;
+     outpt = outbuf = xnmalloc(TABLE_OUTINFOBUFSZ);
 
-     /* test 17: scan a text buffer with column headers, ruler and 
-      * an info line into a table */
-     tab1 = table_create();
-     tab2 = table_create();
-     buf3 = xnstrdup(TEST_TEXT4);
-     r = table_scan(tab1, buf3, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
-		    TABLE_HASRULER);
-     if (r != 1)
-	  elog_die(FATAL, "[17a] does not scan 1 line");
-     buf1 = table_outtable(tab1);
-     buf4 = xnstrdup(buf1);
-     r = table_scan(tab2, buf4, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
-		    TABLE_HASRULER);
-     if (r != 1)
-	  elog_die(FATAL, "[17b] does not scan 1 line");
-     buf2 = table_outtable(tab2);
-     if (strcmp(buf1, buf2) != 0)
-	  elog_die(FATAL, "[17] buffer mismatch");
-     nfree(buf1);
-     nfree(buf2);
-     nfree(buf3);
-     nfree(buf4);
-     table_destroy(tab1);
-     table_destroy(tab2);
+     /* allocate and copy headers */
+     tree_traverse(t->infolookup) {
+	  itree_traverse(t->colorder) {
+	       tok = "";
+	       if (tree_find(t->info, itree_get(t->colorder)) != TREE_NOVAL)
+		    if (itree_find(tree_get(t->info), (int) (long)
+				   tree_get(t->infolookup)) != TREE_NOVAL)
+		         tok = util_quotestr( itree_get( tree_get(t->info) ), 
+					      "\t", strbuf, 8000 );
+	       toklen = strlen(tok);
+	       if (toklen + outpt > outbuf + bufalloc + 100) {
+		    /* enlarge buffer and adjust pointers */
+		    bufalloc += TABLE_OUTINFOBUFSZ;
+		    newbuf = xnrealloc(outbuf, bufalloc);
+		    outpt += outbuf - newbuf;
+		    outbuf = newbuf;
+	       }
+	       strcpy(outpt, tok);
+	       outpt += toklen;
+	       *(outpt++) = t->separator;
+	  }
+	  tok = util_quotestr( tree_getkey(t->infolookup), 
+			       "\t", outpt, bufalloc - (outpt-outbuf) );
+	  outpt += strlen(tok);	/* assume max 100 chars */
+	  *(outpt++) = '\n';
+     }
+     *(outpt-1) = '\0';
 
-     /* test 18: scan a text buffer with column headers, ruler and 
-      * two info lines (one with spaces) into a table */
-     tab1 = table_create();
-     tab2 = table_create();
-     buf3 = xnstrdup(TEST_TEXT5);
-     r = table_scan(tab1, buf3, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
-		    TABLE_HASRULER);
-     if (r != 1)
-	  elog_die(FATAL, "[18a] does not scan 1 line");
-     buf1 = table_outtable(tab1);
-     buf4 = xnstrdup(buf1);
-     r = table_scan(tab2, buf4, "\t", TABLE_SINGLESEP, TABLE_HASCOLNAMES, 
-		    TABLE_HASRULER);
-     if (r != 1)
-	  elog_die(FATAL, "[18b] does not scan 1 line");
-     buf2 = table_outtable(tab2);
-     if (strcmp(buf1, buf2) != 0)
-	  elog_die(FATAL, "[18] buffer mismatch");
-     nfree(buf1);
-     nfree(buf2);
-     nfree(buf3);
-     nfree(buf4);
-     table_destroy(tab1);
-     table_destroy(tab2);
+     return outbuf;
+}
 
-     /* shutdown and exit */
-     elog_fini();
-     route_fini();
 
-     printf("tests finished successfully\n");
-     exit(0);
+char *table_ref_outbody(TABLE t)
+{
+     int alloc=0, used=0, len, i, ncols, *handles;
+     char *outbuf, *outpt, *tok, *oldbuf, strbuf[8000], *cell;
+     ITREE *col;
+
+     /* return if no data */
+     if (t == NULL || t->nrows == 0)
+	  return NULL;
+     table_priv_usetrees(t);
+
+     /* get size of buffer */
+     tree_traverse(t->data) {
+	  col = tree_get(t->data);
+	  itree_traverse(col)
+	       if ( itree_get(col) )
+		    alloc += strlen( itree_get(col) )+3;
+	       else
+		    alloc += 3;
+     }
+
+     if (alloc == 0)
+	  return NULL;
+
+     /* resolve the columns to print once */
+     handles = xnmalloc(sizeof(int) * (itree_n(t->colorder) + 1));
+     ncols = 0;
+     itree_traverse(t->colorder)
+	  handles[ncols++] = table_colhandle(t, itree_get(t->colorder));
+
+     /* allocate and copy body cells */
+     outpt = outbuf = xnmalloc(alloc);
+     table_traverse(t) {
+	  for (i=0; i < ncols; i++) {
+	       /* get each cell, quote it and copy into buffer. If the
+		* buffer is too small, allocate a bigger one */
+	       cell = table_getcurrentcell_h(t, handles[i]);
+	       tok = util_quotestr(cell, "\t", strbuf, 8000 );
+	       len = strlen(tok);
+	       used += len+1;	/* include the additional trailing space */
+	       if (used+1 > alloc) {
+		    /* allocate more memory to fit the current requirement, 
+		     * plus some more (64 at mo) */
+		    alloc = used+64;
+		    oldbuf = outbuf;
+		    outbuf = xnrealloc(outbuf, alloc);
+		    if (outbuf != oldbuf)
+			 /* location of buffer has changed: so adjust */
+			 outpt += outbuf-oldbuf;
+	       }
+	       strcpy(outpt, tok);
+	       outpt += len;
+	       *(outpt++) = t->separator;
+	  }
+	  *(outpt-1) = '\n';
+     }
+     *(outpt) = '\0';
+     nfree(handles);
+
+     return outbuf;
+}
+
+
+char *table_ref_outtable(TABLE t)
+{
+     char *header, *info, *body, *output;
+
+     /* return if no data */
+     if (t == NULL || t->nrows == 0)
+	  return NULL;
+
+     /* get data */
+     header = table_ref_outheader(t);
+     info = table_ref_outinfo(t);
+     body = table_ref_outbody(t);
+
+     /* perform joins, depending on data */
+     if (info)
+	  output = util_strjoin(header, "\n", info, "\n--\n", body, NULL);
+     else
+	  output = util_strjoin(header, "\n--\n", body, NULL);
+
+     /* clean up */
+     nfree(header);
+     if (info)
+	  nfree(info);
+     nfree(body);
+
+     return output;
+}
+
+/* time summing a float column from its cell text in trees and from 
+ * a column store's values */
+void test_benchcols(int nrows)
+{
+     TABLE tab;
+     char *cell;
+     int r, h, c;
+     double sum[2], *vals;
+     struct timeval t1, t2;
+     double secs;
+
+     printf("column sum: %d rows\n", nrows);
+     printf("%-10s %10s %10s\n", "backing", "fill secs", "sum secs");
+     for (c=0; c < 2; c++) {
+	  gettimeofday(&t1, NULL);
+	  tab = table_create();
+	  if (c)
+	       table_usecolumns(tab);
+	  table_addcol(tab, "v", NULL);
+	  table_addemptyinfo(tab, "type");
+	  table_replaceinfocell(tab, "type", "v", "nano");
+	  h = table_colhandle(tab, "v");
+	  for (r=0; r < nrows; r++) {
+	       table_addemptyrow(tab);
+	       table_replacecurrentcell_alloc_h(tab, h, util_i32toa(r));
+	  }
+	  gettimeofday(&t2, NULL);
+	  secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+
+	  sum[c] = 0.0;
+	  gettimeofday(&t1, NULL);
+	  if ((vals = table_coldbls(tab, h))) {
+	       for (r=0; r < nrows; r++)
+		    sum[c] += vals[r];
+	  } else {
+	       for (r=0; r < nrows; r++)
+		    if ((cell = table_getcell_h(tab, r, h)))
+			 sum[c] += strtod(cell, NULL);
+	  }
+	  gettimeofday(&t2, NULL);
+	  printf("%-10s %10.4f %10.4f\n", c ? "columns" : "trees", secs, 
+		 (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6);
+	  table_destroy(tab);
+     }
+     if (sum[0] != sum[1])
+	  elog_die(FATAL, "[bench] column sums differ %f != %f", sum[0], sum[1]);
 }
 
+
 #endif /* TEST */
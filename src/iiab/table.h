@@ -10,9 +10,50 @@
 #ifndef _TABLE_H_
 #define _TABLE_H_
 
+#include <stddef.h>		/* need size_t */
 #include "tree.h"
 #include "itree.h"
 
+/*
+ * Typed column store, which holds a column's cells in place of its cell 
+ * tree in tables given columns by table_usecolumns(). Numbers are parsed 
+ * once into contiguous arrays, their type taken from the `type' info row
+ * when that is set. The text of a number is 
+ * only made when the cell is asked for, unless the text it came from 
+ * would not be made again exactly (eg. "007"), when that is kept.
+ */
+struct table_colvec {
+     int        type;	/* TABLE_COLSTR, TABLE_COLINT or TABLE_COLDBL */
+     int        usign;	/* 1 if TABLE_COLINT values are unsigned */
+     long long *ival;	/* TABLE_COLINT values, 0 when blank */
+     double    *dval;	/* TABLE_COLDBL values, 0 when blank */
+     char     **text;	/* text of each cell, NULL if not made yet */
+     char      *blank;	/* 1 if the cell is NULL or "", so has no value */
+};
+
+/*
+ * Column reference, indexed by a column handle. Handles are small integers,
+ * issued in turn as columns are created and valid for the life of the 
+ * column. A removed column leaves its slot empty (name and cells NULL)
+ */
+struct table_colref {
+     char    *name;	/* column name, as the key in data */
+     ITREE   *cells;	/* column cells, as the value in data */
+     Rb_node *rows;	/* each row's cell node in row key order; part of 
+			 * the row index */
+     struct table_colvec *vec;	/* typed cells when the table uses columns
+				 * (cells is then empty), otherwise NULL */
+};
+
+/* A block of table owned memory, from which cell text and other data that 
+ * lasts for the life of the table is bump allocated. The space follows 
+ * this header */
+struct table_arena {
+     struct table_arena *next;	/* next block, or NULL */
+     size_t size;	/* bytes of space in this block */
+     size_t used;	/* bytes of space allocated */
+};
+
 struct table_info {
      int ncols;
      int nrows;
@@ -38,10 +79,37 @@ struct table_info {
 			 * of table rows. will only be used with methods 
 			 * that actually use this feature, eg getsortedcol() */
      char separator;	/* value separator for use in table_outbody() */
+     struct table_colref *colref;	/* columns, indexed by handle */
+     int ncolref;	/* number of handles issued */
+     int colrefalloc;	/* size of colref */
+     int *colhash;	/* open addressed hash of column name to handle */
+     int colhashsz;	/* slots in colhash, a power of 2 */
+     int *rowkeys;	/* key of each row in order; part of the row index */
+     int rowidxok;	/* 1 if the row index (rowkeys and colref[].rows) 
+			 * matches data or 0 if it must be rebuilt */
+     int rowidxalloc;	/* size of the row index arrays */
+     int currow;	/* current row (the cursor) as an index into the 
+			 * row index. nrows when beyond the end */
+     struct table_arena *arena;	/* blocks of table memory, latest first */
+     size_t arenablk;	/* arena block size or 0 if not using an arena */
+     int colvecs;	/* 1 if cells are held in colref[].vec, not data */
+     int vecalloc;	/* rows allocated in each colref[].vec */
 };
 
 typedef struct table_info *TABLE;
 
+/* Growable text buffer that the table serialisers append to. A buffer
+ * may be reused for many tables to avoid reallocation and may keep 
+ * `head' bytes free at its start, so that the consumer can prefix the 
+ * text in place rather than copy it (see table_outbuf_init()) */
+struct table_outbuf {
+     char *buf;		/* allocated space, nmalloc()ed */
+     int   head;	/* bytes reserved at the start of buf */
+     int   len;		/* end of text, counted from the start of buf, 
+			 * where there is always a '\0' */
+     int   alloc;	/* size of buf */
+};
+
 #define TABLE_DEFSEPERATOR '\t'
 #define TABLE_FMTLEN 20
 #define TABLE_WITHCOLNAMES 1
@@ -55,6 +123,18 @@ typedef struct table_info *TABLE;
 #define TABLE_MULTISEP 1
 #define TABLE_SINGLESEP 0
 #define TABLE_CFMODE 2
+#define TABLE_NOHANDLE -1
+#define TABLE_INITHASH 32
+#define TABLE_ARENABLK 16384	/* default arena block size */
+#define TABLE_ARENAALIGN 8	/* alignment of table_alloc() memory */
+#define TABLE_COLNONE -1	/* column types of table_coltype() */
+#define TABLE_COLSTR 0
+#define TABLE_COLINT 1
+#define TABLE_COLDBL 2
+
+/* text and its length in a struct table_outbuf */
+#define table_outbuf_text(o) ((o)->buf+(o)->head)
+#define table_outbuf_len(o)  ((o)->len-(o)->head)
 
 
 TABLE  table_create();
@@ -64,6 +144,11 @@ TABLE  table_create_s(char *colnamestr);
 TABLE  table_create_fromdonor(TABLE donor);
 void   table_destroy(TABLE t);
 void   table_freeondestroy(TABLE t, void *block);
+void   table_usearena(TABLE t, size_t blksz);
+void  *table_alloc(TABLE t, size_t len);
+char  *table_strdup(TABLE t, const char *str);
+char  *table_strndup(TABLE t, const char *str, size_t len);
+int    table_usecolumns(TABLE t);
 TREE  *table_getheader(TABLE t);
 int    table_addrow_alloc(TABLE t, TREE *row);
 int    table_addrows_a(TABLE t, void ***array);
@@ -106,6 +191,16 @@ char  *table_outbody(TABLE t);
 char  *table_outrows(TABLE t, int fromkey, int tokey);
 char  *table_outtable(TABLE t);
 char  *table_outtable_full(TABLE t, char sep, int withcolnames, int withinfo);
+void   table_outbuf_init(struct table_outbuf *out, int head);
+void   table_outbuf_reset(struct table_outbuf *out);
+void   table_outbuf_free(struct table_outbuf *out);
+void   table_outbuf_need(struct table_outbuf *out, int n);
+void   table_outbuf_add(struct table_outbuf *out, char *str, int len);
+int    table_outheader_buf(TABLE t, struct table_outbuf *out);
+int    table_outinfo_buf(TABLE t, struct table_outbuf *out);
+int    table_outbody_buf(TABLE t, struct table_outbuf *out);
+int    table_outtable_buf(TABLE t, struct table_outbuf *out, char sep, 
+			  int withcolnames, int withinfo);
 int    table_scan(TABLE t, char *buffer, char *sepstr, int sepmode,
 		  int hascolnames, int hasruler);
 int    table_nrows(TABLE t);
@@ -146,9 +241,24 @@ TREE  *table_uniqcolvals(TABLE t, char *colname, TREE **uniq);
 TABLE  table_selectcolswithkey(TABLE t, char *keycol, char *key, 
 			       ITREE *datacols);
 int    table_equals(TABLE t, TABLE other);
+int    table_colhandle(TABLE t, char *colname);
+char  *table_colhandlename(TABLE t, int h);
+int    table_rowindex(TABLE t, int rowkey);
+int    table_getcurrentrowindex(TABLE t);
+void   table_gotorowindex(TABLE t, int row);
+void  *table_getcell_h(TABLE t, int row, int h);
+int    table_replacecell_h(TABLE t, int row, int h, void *data);
+void  *table_getcurrentcell_h(TABLE t, int h);
+int    table_replacecurrentcell_h(TABLE t, int h, void *data);
+int    table_replacecurrentcell_alloc_h(TABLE t, int h, void *data);
+int    table_coltype(TABLE t, int h);
+long long *table_colints(TABLE t, int h);
+double *table_coldbls(TABLE t, int h);
+char  *table_colblanks(TABLE t, int h);
 
 #define table_traverse(t) for (table_first(t);!(table_isbeyondend(t));table_next(t))
 #define table_incref(t) t->refcount++;
 #define table_decref(t) t->refcount--;
+#define table_getseparator(t) (t)->separator
 
 #endif /* _TABLE_H_*/
@@ -128,20 +128,20 @@ void   tableset_select (TABSET tset	/* tableset instance */,
 void   tableset_selectt(TABSET tset	/* tableset instance */, 
 			char *cols	/* whitespace separated string */)
 {
-     char *mycols, *thiscol;
+     char *mycols, *thiscol, *tokpos;
      ITREE *listcols;
 
      mycols = xnstrdup(cols);
      tableset_freeondestroy(tset, mycols);
 
-     thiscol = strtok(mycols, " \t");
+     thiscol = strtok_r(mycols, " \t", &tokpos);
      if (thiscol)
 	  listcols = itree_create();
      else
 	  return;		/* no cols to index */
      while (thiscol) {
 	  itree_append(listcols, thiscol);
-	  thiscol = strtok(NULL, " \t");
+	  thiscol = strtok_r(NULL, " \t", &tokpos);
      }
 
      tableset_select(tset, listcols);
@@ -175,20 +175,20 @@ void   tableset_exclude(TABSET tset	/* tableset instance */,
 void   tableset_excludet(TABSET tset	/* tableset instance */, 
 			 char *nocols	/* whitespace separated string */)
 {
-     char *mycols, *thiscol;
+     char *mycols, *thiscol, *tokpos;
      TREE *listcols;
 
      mycols = xnstrdup(nocols);
      tableset_freeondestroy(tset, mycols);
 
-     thiscol = strtok(mycols, " \t");
+     thiscol = strtok_r(mycols, " \t", &tokpos);
      if (thiscol)
 	  listcols = tree_create();
      else
 	  return;		/* no cols to index */
      while (thiscol) {
           tree_add(listcols, thiscol, NULL);
-	  thiscol = strtok(NULL, " \t");
+	  thiscol = strtok_r(NULL, " \t", &tokpos);
      }
 
      tableset_exclude(tset, listcols);
@@ -398,7 +398,7 @@ TABLE   tableset_into   (TABSET tset)
 	  infonames = table_getinfonames(tset->tab);
 	  tree_traverse(infonames) {
 	       inforow = table_getinforow(tset->tab, tree_getkey(infonames));
-	       table_addinfo_t(tset->tab, tree_getkey(infonames), inforow);
+	       table_addinfo_t(target, tree_getkey(infonames), inforow);
 	       tree_destroy(inforow);
 	  }
      } else {
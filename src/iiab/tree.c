@@ -29,8 +29,7 @@ TREE *tree_really_create(char *rfile, int rline, const char *rfunc) {
 	 * TREE top level allocation as a first class object, showing 
 	 * the actuall caller */
 	t = malloc(sizeof(TREE));
-	if (nm_active)
-	     nm_add(NM_TREE, t, sizeof(TREE), rfile, rline, rfunc);
+	nm_track(NM_TREE, t, sizeof(TREE), rfile, rline, rfunc);
 
 	t->root = make_rb();
 	if (t->root)
@@ -52,8 +51,7 @@ void tree_really_destroy(TREE *t, char *rfile, int rline, const char *rfunc) {
 	rb_free_tree(t->root);
 
 	/* free from special tracking */
-	if (nm_active)
-	     nm_rm(NM_TREE, t, rfile, rline, rfunc);
+	nm_untrack(NM_TREE, t, rfile, rline, rfunc);
 	free(t);
 }
 
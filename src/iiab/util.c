@@ -460,61 +460,122 @@ int util_scantext(char *buf,		/* null terminated buffer to parse */
 		  int multisep,		/* treat multiple separators as one */
 		  ITREE **retindex	/* return: index list of lists */ )
 {
-     int toksz, sepsz, i, eaten_sep, ln=0, col=0, ncols=0;
-     char *remain, gap[40], *tok;;
+     struct util_scantoks toks = UTIL_SCANTOKSINIT;
      ITREE *lines, *cols;
+     int ln, f;
 
+     *retindex = NULL;
+     if (util_scantoks(buf, sep, multisep, &toks) == -1)
+	  return -1;
+     if (toks.nlines == 0) {
+	  util_scantoksfree(&toks);
+	  return 0;
+     }
+
+     /* index the fields as a list of lists */
+     lines = itree_create();
+     for (ln=0; ln < toks.nlines; ln++) {
+	  cols = itree_create();
+	  for (f=toks.line[ln]; f < toks.line[ln+1]; f++)
+	       itree_append(cols, toks.field[f]);
+	  itree_append(lines, cols);
+     }
+     util_scantoksfree(&toks);
+
+     /* make returns */
+     *retindex = lines;
+     return itree_n(lines);
+}
+
+
+/* grow the field array of toks, as needed by util_scantoks_add() */
+void util_scantoks_grow(struct util_scantoks *toks)
+{
+     toks->fieldalloc = toks->fieldalloc ? toks->fieldalloc * 2 : 256;
+     toks->field = xnrealloc(toks->field, toks->fieldalloc * sizeof(char *));
+}
+
+/* close the current line of toks, whose first field is at first */
+void util_scantoks_endline(struct util_scantoks *toks, int first)
+{
+     if (toks->nlines + 2 > toks->linealloc) {
+	  toks->linealloc = toks->linealloc ? toks->linealloc * 2 : 64;
+	  toks->line = xnrealloc(toks->line, toks->linealloc * sizeof(int));
+     }
+     toks->line[toks->nlines++] = first;
+     toks->line[toks->nlines]   = toks->nfields;
+}
+
+
+/*
+ * Scan a buffer of ASCII text in place into a flat list of fields, 
+ * following the rules of util_scantext() but without building lists:
+ * nulls are patched into the buffer and the fields of each line are
+ * indexed in toks. Lines are found with memchr(3) and, for a single 
+ * separator character, so are the ends of fields, which suits long lines
+ * of many columns. 
+ * toks should be initialised with UTIL_SCANTOKSINIT and may be reused
+ * for several scans, then freed with util_scantoksfree().
+ * Returns the number of lines that contain data, 0 for empty data or -1
+ * if there was an error.
+ */
+int util_scantoks(char *buf,		/* null terminated buffer to parse */
+		  char *sep,		/* separator characters */
+		  int multisep,		/* treat multiple separators as one */
+		  struct util_scantoks *toks /* return: fields found */ )
+{
+     char *p, *end, *nl, *tok, issep[256];
+     int col=0, first, i, sepsz, eaten_sep=0, onesep;
+
+     toks->nlines = toks->nfields = 0;
      if (buf == NULL)
 	  return -1;
 
      /* setup */
-     strcpy(gap, sep);
-     strcat(gap, "\n");
-     remain = buf;
-
-     /* Create tree for lines */
-     lines = itree_create();
-     cols = itree_create();
+     memset(issep, 0, 256);
+     for (p=sep; *p; p++)
+	  issep[(unsigned char) *p] = 1;
+     issep['\n'] = issep['\0'] = 0;
+     onesep = (sep[0] && ! sep[1]);
+     end = buf + strlen(buf);
+     p = buf;
+     nl = memchr(p, '\n', end-p);
+     if ( ! nl )
+	  nl = end;
+     first = 0;
 
      /* iterate over the entire buffer */
-     while (*remain != '\0') {
+     while (p < end) {
 
 	  /* eat end of line */
-	  if (*remain == '\n') {
+	  if (p == nl) {
 	       /* If a delimiter preceeds the end of line, we need to 
 	        * register an empty cell */
 	       if ((!multisep) && eaten_sep) {
-		    itree_append(cols, "");
+		    util_scantoks_add(toks, "");
 		    col++;
 	       }
-	       *remain = '\0';			/* patch with null */
-	       if (ln == 0)
-		    ncols = col;
-	       if (col) {
-		    /* if columns have been recorded, save them in the
-		     * line list */
-		    itree_append(lines, cols);
-		    cols = itree_create();
-	       }
+	       *p++ = '\0';			/* patch with null */
+	       if (col)
+		    util_scantoks_endline(toks, first);
+	       first = toks->nfields;
 	       col = 0;
-	       ln++;
-	       remain++;
 	       eaten_sep = 0;
+	       nl = memchr(p, '\n', end-p);
+	       if ( ! nl )
+		    nl = end;
 	       continue;
 	  }
 
-	  /* eat quoted token */
-	  if (*remain == '"') {
-	       remain++;
-
-	       /* find the terminating quote */
-	       toksz = strcspn(remain, "\"");
-
-	       /* save and patch with null */
-	       remain[toksz] = '\0';
-	       tok = remain;
-	       itree_append(cols, remain);
-	       remain += toksz +1;
+	  /* eat quoted token, which may span lines */
+	  if (*p == '"') {
+	       tok = ++p;
+	       p = memchr(tok, '"', end-tok);
+	       if (p)
+		    *p++ = '\0';
+	       else
+		    p = end;
+	       util_scantoks_add(toks, tok);
 	       col++;
 
 	       /* translate special characters back to normal */
@@ -524,58 +585,66 @@ int util_scantext(char *buf,		/* null terminated buffer to parse */
 		    else if (*tok == '\002')
 			 *tok = '\n';
 	       }
-	       
+	       if (p > nl) {
+		    nl = memchr(p, '\n', end-p);
+		    if ( ! nl )
+			 nl = end;
+	       }
 	       eaten_sep = 0;
 	       continue;
 	  }
 
 	  /* eat unquoted token */
-	  if ( (toksz = strcspn(remain, gap)) ) {
-	       itree_append(cols, remain);
+	  if ( ! issep[(unsigned char) *p] ) {
+	       util_scantoks_add(toks, p);
 	       col++;
-	       remain += toksz;
+	       if (onesep) {
+		    p = memchr(p, sep[0], nl-p);
+		    if ( ! p )
+			 p = nl;
+	       } else {
+		    while (p < nl && ! issep[(unsigned char) *p])
+			 p++;
+	       }
 	       eaten_sep = 0;
 	       continue;
 	  }
 
           /* eat separators */
-          if ( (sepsz = strspn(remain, sep)) ) {
-	       memset(remain, 0, sepsz);	/* fill with nulls */
-	       remain += sepsz;
-	       if (!multisep) {
-		    /* if multiple separators in single sep mode, they
-		     * represent empty fields and thus inc the col counter 
-		     * and push an empty field into the col list.
-		     * If there is a leading value, the first separator
-		     * doesn't count. */
-		    for (i=(col ? 1 : 0); i < sepsz; i++) {
-		         itree_append(cols, "");
-			 col++;
-		    }
+	  for (sepsz=0; p < nl && issep[(unsigned char) *p]; sepsz++)
+	       *p++ = '\0';			/* fill with nulls */
+	  if (!multisep) {
+	       /* if multiple separators in single sep mode, they
+		* represent empty fields and thus inc the col counter 
+		* and push an empty field into the col list.
+		* If there is a leading value, the first separator
+		* doesn't count. */
+	       for (i=(col ? 1 : 0); i < sepsz; i++) {
+		    util_scantoks_add(toks, "");
+		    col++;
 	       }
-	       eaten_sep = 1;
 	  }
+	  eaten_sep = 1;
      }
 
-     if (ln == 0)
-          ncols = col;
-
-     /* close off lists */
+     /* close off the final line without \n */
      if (col)
-          itree_append(lines, cols);	/* final line without \n */
-     else {
-          itree_destroy(cols);
-	  cols = NULL;
-     }
-     ln = itree_n(lines);
-     if (ln == 0) {
-          itree_destroy(lines);
-	  lines = NULL;
-     }
+	  util_scantoks_endline(toks, first);
 
-     /* make returns */
-     *retindex = lines;
-     return ln;
+     return toks->nlines;
+}
+
+
+/* Free the index in toks, leaving the buffer alone */
+void util_scantoksfree(struct util_scantoks *toks)
+{
+     if (toks->field)
+	  nfree(toks->field);
+     if (toks->line)
+	  nfree(toks->line);
+     toks->field = NULL;
+     toks->line = NULL;
+     toks->nlines = toks->nfields = toks->fieldalloc = toks->linealloc = 0;
 }
 
 
@@ -658,7 +727,7 @@ void   util_scandump(ITREE *index	/* scanned index list of lists */ )
  * Transformations not implemented are due to performance reasons
  */
 char *util_escapestr(char *s) {
-     static char buf[UTIL_ESCSTRLEN];
+     static __thread char buf[UTIL_ESCSTRLEN];
      char *spn, *bufpt;
      int i;
 
@@ -1130,10 +1199,16 @@ char *util_strjoin(const char *s, ...) {
 }
 
 
+/*
+ * The conversions below return a static buffer that is overwritten by the
+ * next call. Probes, samples and httpd callbacks call them from worker 
+ * threads as well as the main thread, so each thread has its own buffer.
+ */
+
 /* convert a signed long (32 bits)  to a string */
 char *util_i32toa(long src)
 {
-     static char buf[UTIL_U32STRLEN];
+     static __thread char buf[UTIL_U32STRLEN];
      snprintf(buf, UTIL_U32STRLEN, "%ld", src);
      return buf;
 }
@@ -1142,7 +1217,7 @@ char *util_i32toa(long src)
 /* convert an unsigned long (32 bits) to a string */
 char *util_u32toa(unsigned long src)
 {
-     static char buf[UTIL_U32STRLEN];
+     static __thread char buf[UTIL_U32STRLEN];
      snprintf(buf, UTIL_U32STRLEN, "%lu", src);
      return buf;
 }
@@ -1151,7 +1226,7 @@ char *util_u32toa(unsigned long src)
 /* convert a signed long long (64 bits) to a string */
 char *util_i64toa(long long src)
 {
-     static char buf[UTIL_U64STRLEN];
+     static __thread char buf[UTIL_U64STRLEN];
      snprintf(buf, UTIL_U64STRLEN, "%lld", src);
      return buf;
 }
@@ -1160,7 +1235,7 @@ char *util_i64toa(long long src)
 /* convert an unsigned long long (64 bits) to a string */
 char *util_u64toa(unsigned long long src)
 {
-     static char buf[UTIL_U64STRLEN];
+     static __thread char buf[UTIL_U64STRLEN];
      snprintf(buf, UTIL_U64STRLEN, "%llu", src);
      return buf;
 }
@@ -1169,7 +1244,7 @@ char *util_u64toa(unsigned long long src)
 /* convert a float to a string */
 char  *util_ftoa(float src)
 {
-     static char buf[UTIL_FLOATSTRLEN];
+     static __thread char buf[UTIL_FLOATSTRLEN];
      snprintf(buf, UTIL_FLOATSTRLEN, "%.2f", src);
      return buf;
 }
@@ -1178,7 +1253,7 @@ char  *util_ftoa(float src)
 /* convert an unsigned long (32 bits) to an octal string */
 char *util_u32toaoct(unsigned long src)
 {
-     static char buf[UTIL_U32STRLEN];
+     static __thread char buf[UTIL_U32STRLEN];
      snprintf(buf, UTIL_U32STRLEN, "%lo", src);
      return buf;
 }
@@ -1188,7 +1263,7 @@ char *util_u32toaoct(unsigned long src)
 /* convert a high resolution timer to a string */
 char  *util_hrttoa(hrtime_t src)
 {
-     static char buf[UTIL_NANOSTRLEN];
+     static __thread char buf[UTIL_NANOSTRLEN];
      int r, i;
 
      r = snprintf(buf, UTIL_NANOSTRLEN, "%u.%u", 
@@ -1207,7 +1282,7 @@ char  *util_hrttoa(hrtime_t src)
 /* convert a timestruct to a string, solaris version */
 char  *util_tstoa(timestruc_t *src)
 {
-     static char buf[UTIL_NANOSTRLEN];
+     static __thread char buf[UTIL_NANOSTRLEN];
      int r, i;
 
      r = snprintf(buf,UTIL_NANOSTRLEN,"%lu.%.9li", src->tv_sec, src->tv_nsec);
@@ -1224,7 +1299,7 @@ char  *util_tstoa(timestruc_t *src)
 /* convert a timestruct to a string, linux version */
 char  *util_tstoa(struct timespec *src)
 {
-     static char buf[UTIL_NANOSTRLEN];
+     static __thread char buf[UTIL_NANOSTRLEN];
      int r, i;
 
      r = snprintf(buf,UTIL_NANOSTRLEN,"%lu.%.9li", src->tv_sec, src->tv_nsec);
@@ -1246,7 +1321,7 @@ char  *util_tstoa(struct timespec *src)
 /* converts linux's jiffy format into seconds. input and output are strings */
 char  *util_jiffytoa(unsigned long long jiffies)
 {
-     static char buf[UTIL_NANOSTRLEN];
+     static __thread char buf[UTIL_NANOSTRLEN];
 
      /* a jiffy is 1/100th of a second in linux */
      sprintf(buf, "%llu.%llu", jiffies / 100, jiffies % 100);
@@ -1302,15 +1377,15 @@ char *util_nonull(char *str)
 
 /*
  * Generate an ascii representation of time
- * Warning: single threaded function, returns a static
+ * Returns a static buffer, one per thread
  */
 char *util_decdatetime(time_t t)
 {
-     static char buf[UTIL_SHORTSTR];
-     struct tm *time;
+     static __thread char buf[UTIL_SHORTSTR];
+     struct tm time;
 
-     time = localtime(&t);
-     strftime(buf, UTIL_SHORTSTR, "%d-%b-%y %I:%M:%S %p", time);
+     localtime_r(&t, &time);
+     strftime(buf, UTIL_SHORTSTR, "%d-%b-%y %I:%M:%S %p", &time);
      /* %c */
      /* also %d-%b-%y %I:%M:%S %p */
 
@@ -1319,15 +1394,15 @@ char *util_decdatetime(time_t t)
 
 /*
  * Generate a shorter ascii representation of time
- * Warning: single threaded function, returns a static
+ * Returns a static buffer, one per thread
  */
 char *util_sdecdatetime(time_t t)
 {
-     static char buf[UTIL_SHORTSTR];
-     struct tm *time;
+     static __thread char buf[UTIL_SHORTSTR];
+     struct tm time;
 
-     time = localtime(&t);
-     strftime(buf, UTIL_SHORTSTR, "%d-%b-%y %I%p", time);
+     localtime_r(&t, &time);
+     strftime(buf, UTIL_SHORTSTR, "%d-%b-%y %I%p", &time);
 
      return buf;
 }
@@ -1336,15 +1411,15 @@ char *util_sdecdatetime(time_t t)
  * Generate a short ascii representation of time, adapting its format
  * to the distance of the event: the further away in time, the more
  * approximate the representation.
- * Warning: single threaded function, returns a static */
+ * Returns a static buffer, one per thread */
 char *util_shortadaptdatetime(time_t t) {
-     static char buf[UTIL_SHORTSTR];
+     static __thread char buf[UTIL_SHORTSTR];
      struct tm entry, now;
      time_t now_t;
 
      now_t = time(NULL);
-     memcpy(&entry, localtime(&t), sizeof(struct tm));
-     memcpy(&now, localtime(&now_t), sizeof(struct tm));
+     localtime_r(&t, &entry);
+     localtime_r(&now_t, &now);
 
      strftime(buf, UTIL_SHORTSTR, "%c", &entry); /* also %d-%b-%y %I:%M:%S %p*/
      /* Or adaptive  recent: %I:%M:%S */
@@ -1382,13 +1457,13 @@ char *util_shortadaptdatetime(time_t t) {
  * Generate a short ascii representation of time, adapting its format
  * to the distance between two events t and t_ref: the further away in time,
  * the more approximate the representation.
- * Warning: single threaded function, returns a static */
+ * Returns a static buffer, one per thread */
 char *util_shortadaptreldatetime(time_t t, time_t ref_t) {
-     static char buf[UTIL_SHORTSTR];
+     static __thread char buf[UTIL_SHORTSTR];
      struct tm entry, ref;
 
-     memcpy(&entry, localtime(&t), sizeof(struct tm));
-     memcpy(&ref, localtime(&ref_t), sizeof(struct tm));
+     localtime_r(&t, &entry);
+     localtime_r(&ref_t, &ref);
 
      strftime(buf, UTIL_SHORTSTR, "%c", &entry); /* also %d-%b-%y %I:%M:%S %p*/
      /* Or adaptive  recent: %I:%M:%S */
@@ -1826,7 +1901,7 @@ int util_hexit( char c )
  * for each call */
 char * util_strtok_sc(char *str, char *s)
 {
-     static char *nexttok = NULL;
+     static __thread char *nexttok = NULL;	/* per thread, like strtok_r */
      char *sep, *tok;
 
      if (str) {
@@ -1858,11 +1933,12 @@ char * util_strtok_sc(char *str, char *s)
 /* Return the host name */
 char  util_hostname_t[UTIL_HOSTLEN] = {'\0'};
 char *util_hostname() {
+     char *tokpos;
      if (util_hostname_t[0])
 	  return util_hostname_t;
      if (gethostname(util_hostname_t, UTIL_HOSTLEN) != 0)
 	  return NULL;
-     strtok(util_hostname_t, ".");
+     strtok_r(util_hostname_t, ".", &tokpos);
      return util_hostname_t;
 }
 
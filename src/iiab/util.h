@@ -42,6 +42,26 @@ struct util_scanbuf {
 };
 typedef struct util_scanbuf * SCANBUF;
 
+/* Fields found by util_scantoks() in a buffer. Fields are pointers into
+ * the buffer, which has been patched with nulls to terminate them; the
+ * fields of line l are field[line[l]] to field[line[l+1]-1] */
+struct util_scantoks {
+     char **field;	/* every field, in buffer order */
+     int   *line;	/* index into field of each line's first field, 
+			 * with an extra entry at the end */
+     int    nlines;	/* number of lines containing fields */
+     int    nfields;	/* number of fields */
+     int    fieldalloc;	/* size of field */
+     int    linealloc;	/* size of line */
+};
+#define UTIL_SCANTOKSINIT { NULL, NULL, 0, 0, 0, 0 }
+#define util_scantoks_nfields(t,l) ((t)->line[(l)+1] - (t)->line[l])
+#define util_scantoks_get(t,l,f) (t)->field[(t)->line[l]+(f)]
+#define util_scantoks_add(t,f) \
+     do { if ((t)->nfields >= (t)->fieldalloc) \
+	       util_scantoks_grow(t); \
+	  (t)->field[(t)->nfields++] = (f); } while (0)
+
 
 #if 1
 int    util_parseroute(char *route, char *sep, char *magic, ITREE **retbuf);
@@ -54,6 +74,11 @@ int    util_scancftext(char *buffer, char *sep, char *magic, ITREE **retindex);
 int    util_scantext(char *buffer, char *sep, int multisep, ITREE **retindex);
 int    util_scancfroute(char *route, char *sep, char *magic, ITREE **retindex, 
 			char **retbuffer);
+int    util_scantoks(char *buffer, char *sep, int multisep, 
+		     struct util_scantoks *toks);
+void   util_scantoksfree(struct util_scantoks *toks);
+void   util_scantoks_grow(struct util_scantoks *toks);
+void   util_scantoks_endline(struct util_scantoks *toks, int first);
 void   util_scanfree(ITREE *index);
 void   util_scandump(ITREE *index);
 char  *util_escapestr(char *s);
@@ -15,7 +15,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "probe.h"
+#include "../iiab/hash.h"
+#include "../iiab/ptree.h"
+
+/* private functional prototypes */
+int   probe_priv_init(char *command, ROUTE output, ROUTE error, 
+		      struct meth_runset *rset);
+int   probe_priv_action(char *command, ROUTE output, ROUTE error, 
+			struct meth_runset *rset);
+int   probe_priv_fini(char *command, ROUTE output, ROUTE error, 
+		      struct meth_runset *rset);
+pthread_mutex_t *probe_priv_lock(char *command);
 
 struct meth_info probe_cbinfo = {
      probe_id,
@@ -31,6 +43,21 @@ struct meth_info probe_cbinfo = {
 /* List of all probe data (struct probe_datainfo), keyed by
  * output route */
 PTREE *probe_data=NULL;
+pthread_mutex_t probe_datalock = PTHREAD_MUTEX_INITIALIZER; /* probe_data */
+
+/* Probes keep their state in globals, so each kind of probe is locked
+ * while it is used to allow the probe method to run in threads 
+ * (meth_settype()). Names are matched in the same order as the probe 
+ * functions below, with the final lock for those that are unknown */
+char *probe_kinds[] = {"intr", "io", "names", "ps", "sys", "timer", "net", 
+		       "up", "down", NULL};
+pthread_mutex_t probe_kindlock[] = {
+     PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+     PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+     PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+     PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+     PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+};
 
 /* initialise the table with headers for the specific probe and
  * include the info lines require for probe plotting */
@@ -39,8 +66,10 @@ TABLE probe_tabinit(struct probe_sampletab *hd /* col defs */ )
      TABLE tab;
      struct probe_sampletab *p;
 
-     /* create a table dynamically, which may not be the best performance */
+     /* create a table dynamically, which may not be the best performance.
+      * samples are built then thrown away, so keep their cells in an arena */
      tab = table_create();
+     table_usearena(tab, 0);
 
      /* add columns */
      for (p=hd; p->name != NULL; p++) {
@@ -86,6 +115,20 @@ int probe_init(char *command, 		/* command line */
 	       ROUTE output, 		/* output route */
 	       ROUTE error, 		/* error route */
 	       struct meth_runset *rset	/* runset structure */ )
+{
+     pthread_mutex_t *lock;
+     int r;
+
+     lock = probe_priv_lock(command);
+     pthread_mutex_lock(lock);
+     r = probe_priv_init(command, output, error, rset);
+     pthread_mutex_unlock(lock);
+
+     return r;
+}
+
+int probe_priv_init(char *command, ROUTE output, ROUTE error, 
+		    struct meth_runset *rset)
 {
      struct probe_datainfo *dinfo;
      char *probename, *probeargs;
@@ -107,6 +150,7 @@ int probe_init(char *command, 		/* command line */
      dinfo = xnmalloc(sizeof(struct probe_datainfo));
      dinfo->old = NULL;
      dinfo->new = NULL;
+     dinfo->oldindex = NULL;
 #if __svr4__
      if (strstr(probename, "intr")) {
 	  psolintr_init();
@@ -257,9 +301,11 @@ int probe_init(char *command, 		/* command line */
 #endif
 
      /* add to global list keyed by runset */
+     pthread_mutex_lock(&probe_datalock);
      if (probe_data == NULL)
 	  probe_data = ptree_create();
      ptree_add(probe_data, rset, dinfo);
+     pthread_mutex_unlock(&probe_datalock);
 
      nfree(probename);
      return 0;
@@ -282,6 +328,20 @@ int probe_action(char *command,  		/* command line */
 		 ROUTE output,  		/* output route */
 		 ROUTE error,  			/* error route */
 		 struct meth_runset *rset	/* runset structure */ )
+{
+     pthread_mutex_t *lock;
+     int r;
+
+     lock = probe_priv_lock(command);
+     pthread_mutex_lock(lock);
+     r = probe_priv_action(command, output, error, rset);
+     pthread_mutex_unlock(lock);
+
+     return r;
+}
+
+int probe_priv_action(char *command, ROUTE output, ROUTE error, 
+		      struct meth_runset *rset)
 {
      struct probe_datainfo *dinfo;
      char *probename, *probeargs;
@@ -297,9 +357,11 @@ int probe_action(char *command,  		/* command line */
      probeargs = probename+pnlen+1;
 
      /* fetch probe data structure */
+     pthread_mutex_lock(&probe_datalock);
      if ( ! probe_data )
 	  elog_die(FATAL, "probe_data not initialised");
      dinfo = ptree_find(probe_data, rset);
+     pthread_mutex_unlock(&probe_datalock);
      if (dinfo == PTREE_NOVAL) {
 	  elog_printf(ERROR, "can't find details - method: %s command: %s", 
 		      "probe", command);
@@ -444,6 +506,20 @@ int probe_fini(char *command,  		/* command line */
 	       ROUTE output,  		/* output route */
 	       ROUTE error,  		/* error route */
 	       struct meth_runset *rset	/* runset structure */ ) 
+{
+     pthread_mutex_t *lock;
+     int r;
+
+     lock = probe_priv_lock(command);
+     pthread_mutex_lock(lock);
+     r = probe_priv_fini(command, output, error, rset);
+     pthread_mutex_unlock(lock);
+
+     return r;
+}
+
+int probe_priv_fini(char *command, ROUTE output, ROUTE error, 
+		    struct meth_runset *rset)
 {
      struct probe_datainfo *dinfo;
      char *probename, *probeargs;
@@ -458,10 +534,12 @@ int probe_fini(char *command,  		/* command line */
      probeargs = probename+pnlen+1;
 
      /* fetch probe data entry */
+     pthread_mutex_lock(&probe_datalock);
      if ( ! probe_data )
 	  elog_die(FATAL, "probe_data not initialised");
      dinfo = ptree_find(probe_data, rset);
      if (dinfo == PTREE_NOVAL) {
+	  pthread_mutex_unlock(&probe_datalock);
 	  elog_printf(ERROR, "can't find details - method: %s "
 		      "command: %s", "probe", command);
 	  nfree(probename);
@@ -474,12 +552,14 @@ int probe_fini(char *command,  		/* command line */
           ptree_destroy(probe_data);
 	  probe_data = NULL;
      }
+     pthread_mutex_unlock(&probe_datalock);
 
      /* clear up data for the probe instance */
      if (dinfo->old)
 	  table_destroy(dinfo->old);
      if (dinfo->new)
 	  table_destroy(dinfo->new);
+     probe_freediffindex(dinfo->oldindex);
      nfree(dinfo);
 
      /* finalise data collecion */
@@ -507,6 +587,7 @@ int probe_fini(char *command,  		/* command line */
      }
 #elif linux
      if (strstr(probename, "intr")) {
+          plinintr_fini();
      } else if (strstr(probename, "io")) {
           plinio_fini();
      } else if (strstr(probename, "names")) {
@@ -516,6 +597,7 @@ int probe_fini(char *command,  		/* command line */
      } else if (strstr(probename, "sys")) {
 	  plinsys_fini();
      } else if (strstr(probename, "net")) {
+          plinnet_fini();
      } else if (strstr(probename, "up")) {
           plinup_fini();
      } else if (strstr(probename, "down")) {
@@ -551,6 +633,24 @@ int probe_fini(char *command,  		/* command line */
 }
 
 
+/* Return the lock for the kind of probe named at the start of command */
+pthread_mutex_t *probe_priv_lock(char *command)
+{
+     char *probename;
+     int pnlen, i;
+
+     probename = xnstrdup(command);
+     pnlen = strcspn(command, " ");
+     probename[pnlen] = '\0';
+     for (i=0; probe_kinds[i]; i++)
+	  if (strstr(probename, probe_kinds[i]))
+	       break;
+     nfree(probename);
+
+     return &probe_kindlock[i];
+}
+
+
 
 /*
  * Calculate row differences, both generic and specific
@@ -561,137 +661,237 @@ int probe_fini(char *command,  		/* command line */
  * result column. Sample TABLE columns should have their types specified
  * to allow the calculation to take place.
  *
+ * Rows are matched by the primary key column (if the sample has one) or
+ * by position. The old sample is not searched: when each sample is 
+ * differenced, an index of its keys and parsed source values is built
+ * in the same single pass over its rows and kept in dinfo->oldindex 
+ * to be matched against by the following sample. Rows without a match
+ * in the old sample are left without a difference.
+ *
  * After the generic differencing and for iteration 2 onwards, run probe 
  * specific processing with dinfo->derive hook.
  */
 void probe_rundiff(struct probe_datainfo *dinfo) {
-     int haskey=0, newrowid=0, oldrowid=0;
-     char *keycol;
-     TREE *inforow, *keyvals;
+     struct probe_diffindex *idx, *oldidx;
+     TREE *inforow, *header;
+     ITREE **src, **res, *keycolvals=NULL;
+     enum probe_difftype *type;
+     char *keycol=NULL, *key, *cell, *out;
+     unsigned long long diff;
+     int ndiff, i, r, v, h, oldrow;
+
+     /* if row differences are set, calculate them */
+     if (dinfo->rowdiff && dinfo->rowdiff->source) {
+	  for (ndiff=0; dinfo->rowdiff[ndiff].source; ndiff++)
+	       ;
+
+	  /* find the key column that may exist in the new table */
+	  header = table_getheader(dinfo->new);
+	  inforow = table_getinforow(dinfo->new, "key");
+	  if (inforow) {
+	       keycol = tree_search(inforow, "1", 2);
+	       if (keycol && 
+		   (keycolvals = tree_find(header, keycol)) == TREE_NOVAL)
+		    keycolvals = NULL;
+	       nfree(inforow);
+	  }
 
-     /* derive historic calculations for iteration 2 onwards */
-     if (dinfo->old != NULL) {
-
-          /* if row differences are set, calculate them */
-          if (dinfo->rowdiff && dinfo->rowdiff->source) {
-	       /* find keys that may exist in the new table.
-		* If they do exist, set haskey and compile the instance names 
-		* into keyvals */
-	       inforow = table_getinforow(dinfo->new, "key");
-	       if (inforow) {
-		    keycol = tree_search(inforow, "1", 2);
-		    if (keycol) {
-		         keyvals = table_uniqcolvals(dinfo->new, keycol, NULL);
-			 if (keyvals) {
-			      haskey++;
-			 }
+	  /* find the source and result columns and the source types once,
+	   * then walk all the columns together a row at a time */
+	  src  = xnmalloc(sizeof(ITREE *) * ndiff);
+	  res  = xnmalloc(sizeof(ITREE *) * ndiff);
+	  type = xnmalloc(sizeof(enum probe_difftype) * ndiff);
+	  for (i=0; i < ndiff; i++) {
+	       if ((src[i] = tree_find(header, dinfo->rowdiff[i].source))
+		   == TREE_NOVAL)
+		    src[i] = NULL;
+	       else
+		    itree_first(src[i]);
+	       if ((res[i] = tree_find(header, dinfo->rowdiff[i].result))
+		   == TREE_NOVAL)
+		    res[i] = NULL;
+	       else
+		    itree_first(res[i]);
+	       type[i] = probe_difftypeof(table_getinfocell(dinfo->new, "type",
+						    dinfo->rowdiff[i].source));
+	  }
+	  if (keycolvals)
+	       itree_first(keycolvals);
+
+	  /* index of the new sample, which becomes the old one next time */
+	  idx = xnmalloc(sizeof(struct probe_diffindex));
+	  idx->nrows = table_nrows(dinfo->new);
+	  idx->ndiff = ndiff;
+	  idx->vals  = xnmalloc(sizeof(unsigned long long) * 
+				(idx->nrows * ndiff + 1));
+	  idx->valid = xnmalloc(idx->nrows * ndiff + 1);
+	  if (keycolvals) {
+	       /* open addressed, kept under half full */
+	       for (idx->hsize = 16; idx->hsize < idx->nrows * 2; 
+		    idx->hsize *= 2)
+		    ;
+	       idx->htab = xnmalloc(sizeof(int) * idx->hsize);
+	       memset(idx->htab, -1, sizeof(int) * idx->hsize);
+	       idx->keys = xnmalloc(sizeof(char *) * (idx->nrows + 1));
+	  } else {
+	       idx->hsize = 0;
+	       idx->htab  = NULL;
+	       idx->keys  = NULL;
+	  }
+	  oldidx = dinfo->old ? dinfo->oldindex : NULL;
+
+	  /* text of all the differences, freed with the table */
+	  out = xnmalloc(idx->nrows * ndiff * PROBE_DIFFLEN + 1);
+	  table_freeondestroy(dinfo->new, out);
+
+	  for (r=0; r < idx->nrows; r++) {
+	       /* index the row's key and find the matching old row */
+	       oldrow = -1;
+	       if (keycolvals) {
+		    key = itree_get(keycolvals);
+		    idx->keys[r] = key;
+		    if (key) {
+			 for (h = hash_str(key) & (idx->hsize-1); 
+			      idx->htab[h] != -1; h = (h+1) & (idx->hsize-1))
+			      if (strcmp(idx->keys[idx->htab[h]], key) == 0)
+				   break;
+			 if (idx->htab[h] == -1)
+			      idx->htab[h] = r;		/* first with key */
+			 if (oldidx)
+			      oldrow = probe_difflookup(oldidx, key);
 		    }
-		    nfree(inforow);
+		    itree_next(keycolvals);
+	       } else if (oldidx && oldidx->keys == NULL && r < oldidx->nrows) {
+		    oldrow = r;
 	       }
 
-	       /* traverse the new table by instance name, match rows with
-		* the old table then calculate a difference */
-	       if ( haskey ) {
-		    /* multi instance samples */
-		    tree_traverse(keyvals) {
-		         /* current rows of each table to the same key */
-		         newrowid = table_search(dinfo->new, keycol, 
-						 tree_getkey(keyvals));
-			 oldrowid = table_search(dinfo->old, keycol, 
-						 tree_getkey(keyvals));
-			 probe_rowdiff(dinfo);
+	       /* parse each source value once and difference it */
+	       for (i=0; i < ndiff; i++) {
+		    v = r * ndiff + i;
+		    cell = src[i] ? itree_get(src[i]) : NULL;
+		    if (cell && *cell) {
+			 if (type[i] == PROBE_DIFF_I32 || 
+			     type[i] == PROBE_DIFF_I64)
+			      idx->vals[v] = strtoll(cell, NULL, 10);
+			 else
+			      idx->vals[v] = strtoull(cell, NULL, 10);
+			 idx->valid[v] = 1;
+		    } else {
+			 idx->valid[v] = 0;
 		    }
-	       } else {
-		    /* single instance samples */
 
-		    /* Reset current row of both tables */
-		    table_first(dinfo->new);
-		    table_first(dinfo->old);
+		    if (oldrow != -1 && res[i] && idx->valid[v] && 
+			oldidx->valid[oldrow * ndiff + i]) {
+			 diff = probe_diffval(type[i], 
+					      oldidx->vals[oldrow * ndiff + i],
+					      idx->vals[v]);
+			 if (type[i] == PROBE_DIFF_I32 || 
+			     type[i] == PROBE_DIFF_I64)
+			      snprintf(out + v * PROBE_DIFFLEN, PROBE_DIFFLEN,
+				       "%lld", (long long) diff);
+			 else
+			      snprintf(out + v * PROBE_DIFFLEN, PROBE_DIFFLEN,
+				       "%llu", diff);
+			 itree_put(res[i], out + v * PROBE_DIFFLEN);
+		    }
 
-		    probe_rowdiff(dinfo);
+		    if (src[i])
+			 itree_next(src[i]);
+		    if (res[i])
+			 itree_next(res[i]);
 	       }
 	  }
 
-	  /* calculate probe specific, special metrics */
-	  if (dinfo->derive)
-	       dinfo->derive(dinfo->old, dinfo->new);
+	  nfree(src);
+	  nfree(res);
+	  nfree(type);
+	  probe_freediffindex(dinfo->oldindex);
+	  dinfo->oldindex = idx;
      }
 
-     /* remove the key data */
-     if (haskey)
-          tree_destroy(keyvals);
+     /* derive historic calculations for iteration 2 onwards */
+     if (dinfo->old != NULL && dinfo->derive)
+	  dinfo->derive(dinfo->old, dinfo->new);
 }
 
 
-/* Calculate row differences between current rows of two rows: old and new.
- *
- * In each probe_datainfo structure, there are two sample tables (old and new)
- * and a probe_rowdiff array. Rowdiff holds details of the column names that
- * need to be differenced between the two samples and the name of 
- * result column. Sample TABLE columns should have their types specified
- * to allow the calculation to take place.
- *
- * After the generic differencing and for iteration 2 onwards, run probe 
- * specific processing with dinfo->derive hook.
+/* Convert a habitat type name into its difference type. 
+ * Untyped or unknown columns are treated as signed 64 bit values */
+enum probe_difftype probe_difftypeof(char *type)
+{
+     if (type == NULL)
+	  return PROBE_DIFF_I64;
+     if (strcmp(type, "i32") == 0)
+	  return PROBE_DIFF_I32;
+     if (strcmp(type, "u32") == 0)
+	  return PROBE_DIFF_U32;
+     if (strcmp(type, "u64") == 0)
+	  return PROBE_DIFF_U64;
+     return PROBE_DIFF_I64;
+}
+
+
+/*
+ * Return the difference newval - oldval of the given type.
+ * Signed values are gauges and may go down, giving a negative difference.
+ * Unsigned values are counters which only go up, so a smaller new value 
+ * means either that the counter has wrapped or that it has been reset 
+ * (the source was restarted). A 32 bit counter in the top half of its 
+ * range that becomes smaller has wrapped, and its difference is taken 
+ * modulo 2^32. Otherwise, the counter has been reset and has counted 
+ * up from 0 again, so the difference is the new value.
  */
-void probe_rowdiff(struct probe_datainfo *dinfo) {
-     struct probe_rowdiff *rdiff;
-     char *difftype;
-     long idiff;
-     unsigned long udiff;
-     long long lldiff;
-     unsigned long long ulldiff;
-
-     /* Each probe nominates a set of columns on which to calculate 
-      * differences. */
-     for (rdiff = dinfo->rowdiff; 
-	  rdiff != NULL && rdiff->source != NULL; 
-	  rdiff++) {
-
-          /* Extract type from info */
-          difftype = table_getinfocell(dinfo->new, "type", rdiff->source);
-	  if (strcmp(difftype, "i32")) {
-
-	       /* signed 32 bit integer */
-	       idiff = strtol(table_getcurrentcell(dinfo->new,rdiff->source),
-			      NULL, 10) - 
-		       strtol(table_getcurrentcell(dinfo->old, rdiff->source), 
-			      NULL, 10);
-	       table_replacecurrentcell_alloc(dinfo->new, rdiff->result,
-					      util_i32toa(idiff));
-
-	  } else if (strcmp(difftype, "u32")) {
-
-	       /* unsigned 32 bit integer */
-	       udiff = strtoul(table_getcurrentcell(dinfo->new,rdiff->source), 
-			       NULL, 10) - 
-		       strtoul(table_getcurrentcell(dinfo->old,rdiff->source),
-			       NULL, 10);
-	       table_replacecurrentcell_alloc(dinfo->new, rdiff->result,
-					      util_u32toa(udiff));
-
-	  } else if (strcmp(difftype, "i64")) {
-
-	       /* signed 64 bit integer */
-	       lldiff = strtol(table_getcurrentcell(dinfo->new,rdiff->source), 
-			       NULL, 10) - 
-		        strtol(table_getcurrentcell(dinfo->old,rdiff->source), 
-			       NULL, 10);
-	       table_replacecurrentcell_alloc(dinfo->new, rdiff->result,
-					      util_i64toa(lldiff));
-
-	  } else if (strcmp(difftype, "u64")) {
-
-	       /* unsigned 64 bit integer */
-	       ulldiff=strtoull(table_getcurrentcell(dinfo->new,rdiff->source),
-				NULL, 10) - 
-		       strtoull(table_getcurrentcell(dinfo->old,rdiff->source),
-				NULL, 10);
-	       table_replacecurrentcell_alloc(dinfo->new, rdiff->result,
-					      util_u64toa(ulldiff));
-	  }
+unsigned long long probe_diffval(enum probe_difftype type,
+				 unsigned long long oldval, 
+				 unsigned long long newval)
+{
+     switch (type) {
+     case PROBE_DIFF_I32:
+     case PROBE_DIFF_I64:
+	  return (unsigned long long) ((long long) newval - (long long) oldval);
+     case PROBE_DIFF_U32:
+	  if (newval >= oldval)
+	       return newval - oldval;
+	  if (oldval >= 0x80000000ULL && oldval <= 0xffffffffULL)
+	       return (newval - oldval) & 0xffffffffULL;	/* wrapped */
+	  return newval;					/* reset */
+     case PROBE_DIFF_U64:
+     default:
+	  if (newval >= oldval)
+	       return newval - oldval;
+	  return newval;					/* reset */
      }
+}
+
+
+/* Return the first row in the index with key or -1 if it is not there */
+int probe_difflookup(struct probe_diffindex *idx, char *key)
+{
+     int h;
 
+     if (idx->keys == NULL)
+	  return -1;
+     for (h = hash_str(key) & (idx->hsize-1); idx->htab[h] != -1; 
+	  h = (h+1) & (idx->hsize-1))
+	  if (strcmp(idx->keys[idx->htab[h]], key) == 0)
+	       return idx->htab[h];
+
+     return -1;
+}
+
+
+/* Free a difference index; a NULL index is ignored */
+void probe_freediffindex(struct probe_diffindex *idx)
+{
+     if (idx == NULL)
+	  return;
+     if (idx->htab)
+	  nfree(idx->htab);
+     if (idx->keys)
+	  nfree(idx->keys);
+     nfree(idx->vals);
+     nfree(idx->valid);
+     nfree(idx);
 }
 
 
@@ -742,3 +942,165 @@ char *probe_readfile(char *fname) {
 }
 
 
+
+
+/*
+ * Open a /proc file to be read each sample by probe_procread(), which 
+ * stays open until probe_procclose(). Opening a file that is already 
+ * open does nothing. Files that do not exist in some kernels are not
+ * an error to the probes, so failure is only logged for debugging.
+ * Returns 1 if the file is open or 0 if it could not be opened.
+ */
+int probe_procopen(struct probe_procfile *pf)
+{
+     if (pf->fd != -1)
+	  return 1;
+
+     pf->fd = open(pf->fname, O_RDONLY);
+     if (pf->fd == -1) {
+	  elog_printf(DEBUG, "unable to open %s: %d %s", pf->fname, 
+		      errno, strerror(errno));
+	  return 0;
+     }
+     fcntl(pf->fd, F_SETFD, FD_CLOEXEC);
+
+     return 1;
+}
+
+
+/*
+ * Read the whole of a /proc file opened with probe_procopen(), from the
+ * start, into the file's buffer and return it '\0' terminated. 
+ * The same buffer is used each read and only grows, so the text is only 
+ * valid until the next read: copy anything that is kept into the table 
+ * (probe_proccell()). A closed file is opened first.
+ * Returns NULL if the file could not be opened or read.
+ */
+char *probe_procread(struct probe_procfile *pf)
+{
+     int n, len=0;
+
+     if ( ! probe_procopen(pf) )
+	  return NULL;
+     if (pf->buf == NULL) {
+	  pf->bufsz = PROBE_STATSZ;
+	  pf->buf = xnmalloc(pf->bufsz);
+     }
+
+     /* /proc files are made as they are read, so a short read is the 
+      * end; a full buffer means it has outgrown the buffer */
+     while (1) {
+	  n = pread(pf->fd, pf->buf+len, pf->bufsz-len-1, len);
+	  if (n == -1) {
+	       if (errno == EINTR)
+		    continue;
+	       elog_printf(ERROR, "unable to read %s: %d %s", pf->fname, 
+			   errno, strerror(errno));
+	       close(pf->fd);
+	       pf->fd = -1;
+	       return NULL;
+	  }
+	  len += n;
+	  if (n == 0 || len < pf->bufsz-1)
+	       break;
+	  pf->bufsz *= 2;
+	  pf->buf = xnrealloc(pf->buf, pf->bufsz);
+     }
+     pf->buf[len] = '\0';
+
+     return pf->buf;
+}
+
+
+/* Close a /proc file and free its buffer, ready to be opened again */
+void probe_procclose(struct probe_procfile *pf)
+{
+     if (pf->fd != -1)
+	  close(pf->fd);
+     pf->fd = -1;
+     if (pf->buf)
+	  nfree(pf->buf);
+     pf->buf = NULL;
+     pf->bufsz = 0;
+}
+
+
+/*
+ * Find the next token in the current line of /proc text at *pt, 
+ * skipping any leading characters in sep, without changing the text.
+ * A token ends at a character in sep, a new line or the end of the text.
+ * Returns the start of the token and its length in len, leaving *pt
+ * after it, or NULL if there are no more tokens in the line.
+ */
+char *probe_proctok(char **pt, const char *sep, int *len)
+{
+     char *tok, *end;
+
+     tok = *pt + strspn(*pt, sep);
+     for (end = tok; *end && *end != '\n' && ! strchr(sep, *end); end++)
+	  ;
+     *pt = end;
+     if (end == tok)
+	  return NULL;
+     *len = end - tok;
+
+     return tok;
+}
+
+
+/* Return the start of the line after the one containing pt or NULL 
+ * if there are no more lines */
+char *probe_procnextline(char *pt)
+{
+     pt = strchr(pt, '\n');
+     if (pt == NULL || pt[1] == '\0')
+	  return NULL;
+
+     return pt+1;
+}
+
+
+/* Copy len characters of str into the current row of tab under colname, 
+ * the copy belonging to the table. Returns 1 for success or 0 if the
+ * column does not exist */
+int probe_proccell(TABLE tab, char *colname, char *str, int len)
+{
+     return table_replacecurrentcell(tab, colname, 
+				     table_strndup(tab, str, len));
+}
+
+
+/*
+ * Scan /proc text made of lines of 'key value', where the key and value 
+ * are separated by characters in sep, placing the values of the keys 
+ * listed in keys into the current row of tab. Scanning stops once all
+ * the keys have been found.
+ * Returns the number of keys found.
+ */
+int probe_prockeys(TABLE tab, char *data, const char *sep, 
+		   struct probe_prockey *keys)
+{
+     char *pt, *key, *val;
+     int nkeys, nfound=0, klen, vlen;
+     struct probe_prockey *k;
+
+     for (nkeys=0; keys[nkeys].key; nkeys++)
+	  ;
+     for (pt = data; pt && nfound < nkeys; pt = probe_procnextline(pt)) {
+	  key = probe_proctok(&pt, sep, &klen);
+	  if ( ! key )
+	       continue;
+	  for (k = keys; k->key; k++)
+	       if (strncmp(k->key, key, klen) == 0 && k->key[klen] == '\0')
+		    break;
+	  if ( ! k->key )
+	       continue;
+	  val = probe_proctok(&pt, sep, &vlen);
+	  if ( ! val )
+	       continue;
+	  probe_proccell(tab, k->colname, val, vlen);
+	  nfound++;
+     }
+
+     return nfound;
+}
@@ -65,18 +65,18 @@ char                  **plindown_getpub()     {return NULL;}
  * Initialise probe for linux names information
  */
 void plindown_init(char *probeargs) {
-     char *boot, *alive;
+     char *boot, *alive, *tokpos;
 
      if (probeargs == NULL || *probeargs == '\0')
 	  return;
-     boot = strtok(probeargs, " ");
+     boot = strtok_r(probeargs, " ", &tokpos);
      if (boot == NULL) {
 	  elog_printf(ERROR, "boot p-url not given, unable to "
 		      "initialise 'down' probe\nusage %s", plindown_usage);
 	  return;
      }
 
-     alive = strtok(NULL, " ");
+     alive = strtok_r(NULL, " ", &tokpos);
      if (alive == NULL) {
 	  elog_printf(ERROR, "alive p-url not given, unable to "
 		      "initialise 'down' probe\nusage: %s", plindown_usage);
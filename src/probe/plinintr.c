@@ -55,6 +55,9 @@ char                  **plinintr_getpub()     {return NULL;}
 int plinintr_linuxversion=30;
 int plinintr_ncpu=1;
 
+/* /proc file kept open between samples */
+struct probe_procfile plinintr_intr = PROBE_PROCFILE("/proc/interrupts");
+
 /*
  * Initialise probe for linux interrupt information
  */
@@ -81,46 +84,48 @@ void plinintr_init() {
           plinintr_linuxversion=24;
      } else if (strncmp(vpt, "2.5.", 4) == 0 || strncmp(vpt, "2.6.", 4) == 0) {
           plinintr_linuxversion=26;
-     } else if (strncmp(vpt, "3.", 2) == 0) {
-          plinintr_linuxversion=30;
+     } else if (atoi(vpt) >= 3) {
+          plinintr_linuxversion=30;	/* 3.x and later */
      } else {
           elog_printf(ERROR, "unsupported linux kernel version");
      }
 
+     probe_procopen(&plinintr_intr);
+
      /* free and return */
      nfree(data);
      return;
 }
 
+/* shut down probe */
+void plinintr_fini() {
+     probe_procclose(&plinintr_intr);
+}
+
 /*
  * Linux specific routines
  */
 void plinintr_collect(TABLE tab) {
-     char *data;
-     ITREE *lines;
+     char *data, *line;
+     int len;
 
-     /* open and process the interrupt file */
-     data = probe_readfile("/proc/interrupts");
+     /* read and process the interrupt file */
+     data = probe_procread(&plinintr_intr);
      if (data) {
 	  /*elog_printf(DEBUG,"Read from /proc/interrupts: %s", data);*/
-       util_scantext(data, ": +", UTIL_MULTISEP, &lines);	/* scan */
-	  itree_first(lines);				/* count first line */
-	  plinintr_ncpu = itree_n((ITREE *)itree_get(lines));
-	  itree_traverse(lines) {
-	       if (itree_isatstart(lines))
-		    continue;
-	       table_addemptyrow(tab);
-	       plinintr_col_intr(tab, itree_get(lines) );
-	  }
-
-	  /* clear up */
-	  util_scanfree(lines);
-	  table_freeondestroy(tab, data);
+	  line = data;				/* count first line */
+	  for (plinintr_ncpu = 0; probe_proctok(&line, ": +", &len); 
+	       plinintr_ncpu++)
+	       ;
+	  for (line = probe_procnextline(data); line; 
+	       line = probe_procnextline(line))
+	       plinintr_col_intr(tab, line);
      }
 }
 
-/* gets an I/O structure from /proc */
-void plinintr_col_intr(TABLE tab, ITREE *idata) {
+/* gets an I/O structure from a line of /proc/interrupts, adding a row
+ * to the table */
+void plinintr_col_intr(TABLE tab, char *line) {
      /* /proc/interrupts in version 2.2 has a layout similar to this below:-
       *
       *  0:     371527   timer
@@ -157,29 +162,41 @@ void plinintr_col_intr(TABLE tab, ITREE *idata) {
       * Currently, we just count the interrupts from all the cpus together.
       */
 
+     char *tok, *first, *last;
+     int n, len, firstlen, lastlen;
+     unsigned long val=0;
+
+     /* single pass over the tokens, keeping the first and last */
+     first = last = NULL;
+     firstlen = lastlen = 0;
+     for (n=0; (tok = probe_proctok(&line, ": +", &len)); n++) {
+	  if (n == 0) {
+	       first = tok;
+	       firstlen = len;
+	  } else if (plinintr_linuxversion == 22 ? n == 1 : n <= plinintr_ncpu)
+	       val += strtoul(tok, NULL, 10);
+	  last = tok;
+	  lastlen = len;
+     }
+
      if (plinintr_linuxversion == 22) {
-          if (itree_find(idata, 1) == ITREE_NOVAL)
+          if (n < 2)
 	       return;
-	  table_replacecurrentcell(tab, "hard", itree_get(idata));
-	  itree_last(idata);
-	  table_replacecurrentcell(tab, "name", itree_get(idata));
+	  table_addemptyrow(tab);
+	  table_replacecurrentcell_alloc(tab, "hard", util_u32toa(val));
+	  probe_proccell(tab, "name", last, lastlen);
      } else if (plinintr_linuxversion == 24 || 
                 plinintr_linuxversion == 26 ||
                 plinintr_linuxversion == 30) {
-          int i, val=0;
-
-	  for (i=1; i <= plinintr_ncpu; i++) {
-	       if (itree_find(idata, i) == ITREE_NOVAL)
-		    return;
-	       val += strtol(itree_get(idata), NULL, 10);
-	  }
+	  if (n < plinintr_ncpu + 1)
+	       return;
 
-	  if (itree_n(idata) == plinintr_ncpu + 1)
+	  table_addemptyrow(tab);
+	  if (n == plinintr_ncpu + 1)
 	       /* no driver, use generic name */
-	       itree_first(idata);
+	       probe_proccell(tab, "name", first, firstlen);
 	  else
-	       itree_last(idata);
-	  table_replacecurrentcell(tab, "name", itree_get(idata));
+	       probe_proccell(tab, "name", last, lastlen);
 	  table_replacecurrentcell_alloc(tab, "hard", util_u32toa(val));
      }
 }
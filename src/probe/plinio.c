@@ -68,6 +68,10 @@ int plinio_linuxversion=30;
  * plinio_assemble */
 TREE *plinio_last_data=NULL;
 
+/* /proc files kept open between samples */
+struct probe_procfile plinio_diskstats  = PROBE_PROCFILE("/proc/diskstats");
+struct probe_procfile plinio_partitions = PROBE_PROCFILE("/proc/partitions");
+
 /*
  * Initialise probe for linux I/O information
  */
@@ -93,12 +97,18 @@ void plinio_init() {
           plinio_linuxversion=24;       
      } else if (strncmp(vpt, "2.5.", 4) == 0 || strncmp(vpt, "2.6.", 4) == 0) {
           plinio_linuxversion=26;       
-     } else if (strncmp(vpt, "3.", 2) == 0) {
-          plinio_linuxversion=30;       
+     } else if (atoi(vpt) >= 3) {
+          plinio_linuxversion=30;	/* 3.x and later */
      } else {
           elog_printf(ERROR, "unsupported linux kernel version");
      }
 
+     /* from 2.6, keep the files open and re-read them each sample */
+     if (plinio_linuxversion == 26 || plinio_linuxversion == 30) {
+          probe_procopen(&plinio_diskstats);
+          probe_procopen(&plinio_partitions);
+     }
+
      nfree(data);
      return;
 }
@@ -107,6 +117,9 @@ void plinio_init() {
 /* shut down probe */
 void plinio_fini() {
      plinio_free_assemble_tree(plinio_last_data);
+     plinio_last_data = NULL;
+     probe_procclose(&plinio_diskstats);
+     probe_procclose(&plinio_partitions);
 }
 
 
@@ -158,7 +171,6 @@ void plinio_collect24(TABLE tab) {
 
 void plinio_collect26(TABLE tab) {
      char *disk, *part;
-     ITREE *lines;
      TREE *current_data;	/* keyed by short device name (nmalloced), 
 				 * value is a plinio_assemble struct. 
 				 * Each element represents one device */
@@ -167,20 +179,12 @@ void plinio_collect26(TABLE tab) {
       * and with /proc/mounts with the full device name, then find space 
       * used */
      current_data = tree_create();
-     disk = probe_readfile("/proc/diskstats");
-     if (disk) {
-          util_scantext(disk, " ", UTIL_MULTISEP, &lines);
-	  plinio_col_diskstats(current_data, lines);
-	  util_scanfree(lines);
-	  table_freeondestroy(tab, disk);
-     }
-     part = probe_readfile("/proc/partitions");
-     if (part) {
-          util_scantext(part, " ", UTIL_MULTISEP, &lines);
-	  plinio_col_partitions(current_data, lines);
-	  util_scanfree(lines);
-	  table_freeondestroy(tab, part);
-     }
+     disk = probe_procread(&plinio_diskstats);
+     if (disk)
+	  plinio_col_diskstats(current_data, disk);
+     part = probe_procread(&plinio_partitions);
+     if (part)
+	  plinio_col_partitions(current_data, part);
      plinio_col_mounts(current_data);
      plinio_col_statvfs(current_data);
 
@@ -331,9 +335,9 @@ void plinio_col_stat(TABLE tab, ITREE *lol) {
 }
 
 
-/* scan the I/O information from /proc/diskstats, provided as a list of lists
- * and save it in a TREE of assemble */
-void plinio_col_diskstats(TREE* assemble, ITREE *lol) {
+/* scan the I/O information from the text of /proc/diskstats in a single 
+ * pass and save it in a TREE of assemble */
+void plinio_col_diskstats(TREE* assemble, char *data) {
      /*
       * In kernel 2.6, I/O information comes from /proc/diskstats and
       * goes down to partition level, in a layout similar to below:-
@@ -387,52 +391,58 @@ void plinio_col_diskstats(TREE* assemble, ITREE *lol) {
       *   2. wio:  number of write io operaations
       *   3. rblk: number of blocks read
       *   4. wblk: number of blocks written
+      *
+      * Later kernels give all devices the 11 columns and append discard 
+      * (4.18) and flush (5.5) columns, which are ignored.
       */
 
-     if (plinio_linuxversion == 26) {
-	  ITREE *row;
-	  void *attr;
-	  struct plinio_assemble *asmb;
-
-	  itree_traverse( lol ) {
-	       row = itree_get( lol );
-	       attr = itree_find(row , 2);	/* device name */
-	       asmb = plinio_get_assemble_record(assemble, (char *) attr);
-	       if (itree_n(row) == 7) {
-		    /* short form */
-		    attr = itree_find(row , 3);	/* 1. rio == rios */
-		    asmb->rios = atoll(attr);
-		    itree_next(row);		/* 2. wio == wios */
-		    attr = itree_get(row);
-		    asmb->wios = atoll(attr);
-		    itree_next(row);		/* 3. rblk == kread */
-		    attr = itree_get(row);
-		    asmb->kread = atoll(attr);
-		    itree_next(row);		/* 4. wblk == kwritten */
-		    attr = itree_get(row);
-		    asmb->kwritten = atoll(attr);
-	       } else if (itree_n(row) == 14) {
-		    /* long form */
-		    attr = itree_find(row , 3);	/* 1. rio == rios */
-		    asmb->rios = atoll(attr);
-		    attr = itree_find(row , 7);	/* 5. wio == wios */
-		    asmb->wios = atoll(attr);
-		    attr = itree_find(row , 5);	/* 3. rsect == kread */
-		    asmb->kread = atoll(attr);
-		    attr = itree_find(row , 9);	/* 7. wsect == kwritten */
-		    asmb->kwritten = atoll(attr);
-		    attr = itree_find(row, 6);	/* 4. ruse ==  read_svc_t */
-		    asmb->read_svc_t = atoll(attr);
-		    attr = itree_find(row, 10);	/* 8. wuse ==  write_svc_t */
-		    asmb->write_svc_t = atoll(attr);
-	       }
+     char *line, *pt, *dev, *tok, save;
+     int devlen, len, n;
+     unsigned long long st[PLINIO_NDISKSTATS];
+     struct plinio_assemble *asmb;
+
+     if (plinio_linuxversion != 26 && plinio_linuxversion != 30)
+	  return;
+
+     for (line = data; line; line = probe_procnextline(line)) {
+	  pt = line;
+	  if ( ! probe_proctok(&pt, " ", &len) ||	/* major */
+	       ! probe_proctok(&pt, " ", &len) ||	/* minor */
+	       ! (dev = probe_proctok(&pt, " ", &devlen)) )
+	       continue;
+	  for (n=0; (tok = probe_proctok(&pt, " ", &len)); n++)
+	       if (n < PLINIO_NDISKSTATS)
+		    st[n] = strtoull(tok, NULL, 10);
+	  if (n != 4 && n < PLINIO_NDISKSTATS)
+	       continue;
+
+	  /* terminate the name in place to find its record */
+	  save = dev[devlen];
+	  dev[devlen] = '\0';
+	  asmb = plinio_get_assemble_record(assemble, dev);
+	  dev[devlen] = save;
+
+	  if (n == 4) {
+	       /* short form */
+	       asmb->rios     = st[0];		/* 1. rio == rios */
+	       asmb->wios     = st[1];		/* 2. wio == wios */
+	       asmb->kread    = st[2];		/* 3. rblk == kread */
+	       asmb->kwritten = st[3];		/* 4. wblk == kwritten */
+	  } else {
+	       /* long form */
+	       asmb->rios        = st[0];	/* 1. rio == rios */
+	       asmb->wios        = st[4];	/* 5. wio == wios */
+	       asmb->kread       = st[2];	/* 3. rsect == kread */
+	       asmb->kwritten    = st[6];	/* 7. wsect == kwritten */
+	       asmb->read_svc_t  = st[3];	/* 4. ruse ==  read_svc_t */
+	       asmb->write_svc_t = st[7];	/* 8. wuse ==  write_svc_t */
 	  }
      }
 }
 
 
-/* gets the partition information from /proc */
-void plinio_col_partitions(TREE *assemble, ITREE *lol) {
+/* gets the partition information from the text of /proc/partitions */
+void plinio_col_partitions(TREE *assemble, char *data) {
 
      /* /proc/partitions in kernel 2.4 has a layout similar to this below:-
       *
@@ -457,25 +467,8 @@ void plinio_col_partitions(TREE *assemble, ITREE *lol) {
       *   running: don't know
       *   use:     don't know
       *   aveq:    don't know
-      */
-     if (plinio_linuxversion == 24) {
-	  ITREE *row;
-	  void *attr;
-	  struct plinio_assemble *asmb;
-
-	  itree_traverse( lol ) {
-	       row = itree_get( lol );
-	       if (itree_n(row) < 4)
-		    continue;
-	       attr = itree_find(row , 3);	/* device name */
-	       asmb = plinio_get_assemble_record(assemble, (char *) attr);
-	       attr = itree_find(row , 2);	/* number of blocks */
-	       asmb->size = atoll(attr);
-	       /* now fill in the rest */
-	  }
-     }
-
-     /* /proc/partitions in linux kernel 2.6 & 3.x just gives the block sizes
+      *
+      * /proc/partitions in linux kernel 2.6 & 3.x just gives the block sizes
       * of each device and its major and minor number. It lokks like this:-
       *   1     0      32000 ram0
       *   1     1      32000 ram1
@@ -488,20 +481,32 @@ void plinio_col_partitions(TREE *assemble, ITREE *lol) {
       *   3     7     401593 hda7
       *   3     8   23687811 hda8
       */
-     if (plinio_linuxversion == 26 || plinio_linuxversion == 30) {
-	  ITREE *row;
-	  void *attr;
-	  struct plinio_assemble *asmb;
-
-	  itree_traverse( lol ) {
-	       row = itree_get( lol );
-	       if (itree_n(row) < 4)
-		    continue;
-	       attr = itree_find(row , 3);	/* device name */
-	       asmb = plinio_get_assemble_record(assemble, (char *) attr);
-	       attr = itree_find(row , 2);	/* number of blocks */
-	       asmb->size = atof(attr) / 1024.0;
-	  }
+     char *line, *pt, *blocks, *dev, save;
+     int len, devlen;
+     struct plinio_assemble *asmb;
+
+     if (plinio_linuxversion != 24 && plinio_linuxversion != 26 && 
+	 plinio_linuxversion != 30)
+	  return;
+
+     for (line = data; line; line = probe_procnextline(line)) {
+	  pt = line;
+	  if ( ! probe_proctok(&pt, " ", &len) ||		/* major */
+	       ! probe_proctok(&pt, " ", &len) ||		/* minor */
+	       ! (blocks = probe_proctok(&pt, " ", &len)) ||	/* #blocks */
+	       ! (dev = probe_proctok(&pt, " ", &devlen)) )	/* name */
+	       continue;
+	  if (*blocks < '0' || *blocks > '9')
+	       continue;				/* header */
+
+	  save = dev[devlen];
+	  dev[devlen] = '\0';
+	  asmb = plinio_get_assemble_record(assemble, dev);
+	  dev[devlen] = save;
+	  if (plinio_linuxversion == 24)
+	       asmb->size = atoll(blocks);		/* number of blocks */
+	  else
+	       asmb->size = atof(blocks) / 1024.0;
      }
 }
 
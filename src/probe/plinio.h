@@ -30,6 +30,8 @@ struct plinio_assemble {
 };
 
 
+#define PLINIO_NDISKSTATS 11	/* counters used in the long diskstats form */
+
 /* functional prototypes */
 struct probe_sampletab *plinio_getcols();
 struct probe_rowdiff   *plinio_getrowdiff();
@@ -41,8 +43,8 @@ void  plinio_collect22(TABLE tab);
 void  plinio_collect24(TABLE tab);
 void  plinio_collect26(TABLE tab);
 void  plinio_col_stat(TABLE tab, ITREE *lol);
-void  plinio_col_diskstats(TREE *assemble, ITREE *lol);
-void  plinio_col_partitions(TREE *assemble, ITREE *lol);
+void  plinio_col_diskstats(TREE *assemble, char *data);
+void  plinio_col_partitions(TREE *assemble, char *data);
 void  plinio_col_mounts(TREE *assemble);
 void  plinio_col_statvfs(TREE *assemble);
 void  plinio_derive(TABLE prev, TABLE cur);
@@ -8,6 +8,7 @@
 #if linux
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "probe.h"
 
 /* Linux specific includes */
@@ -54,6 +55,9 @@ char                  **plinnet_getpub()     {return NULL;}
 int plinnet_linuxversion=30;
 int plinnet_ndev=1;
 
+/* /proc file kept open between samples */
+struct probe_procfile plinnet_netdev = PROBE_PROCFILE("/proc/net/dev");
+
 /*
  * Initialise probe for linux interrupt information
  */
@@ -80,46 +84,46 @@ void plinnet_init() {
           plinnet_linuxversion=24;
      } else if (strncmp(vpt, "2.5.", 4) == 0 || strncmp(vpt, "2.6.", 4) == 0) {
           plinnet_linuxversion=26;
-     } else if (strncmp(vpt, "3.", 2) == 0) {
-          plinnet_linuxversion=30;
+     } else if (atoi(vpt) >= 3) {
+          plinnet_linuxversion=30;	/* 3.x and later */
      } else {
           elog_printf(ERROR, "unsupported linux kernel version");
      }
 
+     probe_procopen(&plinnet_netdev);
+
      nfree(data);
      return;
 }
 
+/* shut down probe */
+void plinnet_fini() {
+     probe_procclose(&plinnet_netdev);
+}
+
 /*
  * Linux specific routines
  */
 void plinnet_collect(TABLE tab) {
-     char *data;
-     ITREE *lines;
+     char *data, *line;
 
-     /* open and process the network stats file */
-     data = probe_readfile("/proc/net/dev");
+     /* read and process the network stats file */
+     data = probe_procread(&plinnet_netdev);
      if (data) {
 	  /*elog_printf(DEBUG, "Read from /proc/net/dev: %s", data);*/
-       util_scantext(data, ": |", UTIL_MULTISEP, &lines);	/* scan */
-	  itree_find(lines, 2);			/* data starts at 3rd line */
-	  while(!itree_isbeyondend(lines)) {
-	       table_addemptyrow(tab);
-	       plinnet_col_netdev(tab, itree_get(lines) );
-	       itree_next(lines);
-	  }
-
-	  /* clear up */
-	  util_scanfree(lines);
-	  table_freeondestroy(tab, data);
+	  line = probe_procnextline(data);	/* data starts at 3rd line */
+	  if (line)
+	       line = probe_procnextline(line);
+	  for ( ; line; line = probe_procnextline(line))
+	       plinnet_col_netdev(tab, line);
      }
 }
 
 /* 
- * scans one line of network device information from /proc/net/dev 
- * provided as a tokenised list
+ * scans one line of network device information from /proc/net/dev,
+ * adding a row to the table
  */
-void plinnet_col_netdev(TABLE tab, ITREE *idata) {
+void plinnet_col_netdev(TABLE tab, char *line) {
      /* /proc/net/dev in versions 2.2, 2.4, 2.6 & 3.x have a layout  
       * similar to the one below:-
       *
@@ -132,42 +136,24 @@ void plinnet_col_netdev(TABLE tab, ITREE *idata) {
       * with lo, the again with eth0 etc.
       */
 
+     char *value;
+     int i, len;
+
      if (plinnet_linuxversion == 24 || plinnet_linuxversion == 22 || 
 	 plinnet_linuxversion == 26 || plinnet_linuxversion == 30) {
-	  itree_first(idata);
-	  table_replacecurrentcell(tab, "device", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "rx_bytes", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "rx_pkts", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "rx_errs", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "rx_drop", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "rx_fifo", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "rx_frame", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "rx_comp", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "rx_mcast", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "tx_bytes", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "tx_pkts", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "tx_errs", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "tx_drop", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "tx_fifo", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "tx_colls", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "tx_carrier", itree_get(idata));
-	  itree_next(idata);
-	  table_replacecurrentcell(tab, "tx_comp", itree_get(idata));
+	  value = probe_proctok(&line, ": |", &len);
+	  if ( ! value )
+	       return;
+	  table_addemptyrow(tab);
+	  probe_proccell(tab, "device", value, len);
+
+	  /* counters follow in the order of the columns */
+	  for (i=1; plinnet_cols[i].name; i++) {
+	       value = probe_proctok(&line, ": |", &len);
+	       if ( ! value )
+		    break;
+	       probe_proccell(tab, plinnet_cols[i].name, value, len);
+	  }
      }
 }
 
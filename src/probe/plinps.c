@@ -8,6 +8,7 @@
 #if linux
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <ctype.h>
 #include "../iiab/itree.h"
@@ -40,9 +41,39 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
 #include "../iiab/tableset.h"
 
 #define PLINPS_STATSZ 256
+#define PLINPS_BLKSZ 65536	/* size of blocks holding cell text */
+#define PLINPS_NUMLEN 64	/* space for a formatted number */
+#define PLINPS_NSTATFIELDS 34	/* fields wanted from stat after command */
+#define PLINPS_READSTATUS  1	/* read /proc/<pid>/status */
+#define PLINPS_READSTATM   2	/* read /proc/<pid>/statm */
+#define PLINPS_READCMDLINE 4	/* read /proc/<pid>/cmdline */
+#define PLINPS_READALL     7	/* read all the files */
+#define PLINPS_MAXTHREADS 64	/* most scanning threads allowed */
+#define PLINPS_PIDALLOC 1024	/* first allocation of the pid list */
+#define PLINPS_ROWALLOC 256	/* first allocation of a scan's rows */
+
+/* column numbers in the row buffers, in the order of plinps_cols[] */
+enum plinps_colnum {
+     PLINPS_PROCESS, PLINPS_PID, PLINPS_STATE, PLINPS_CMD, PLINPS_ARGS,
+     PLINPS_PPID, PLINPS_PIDGLEAD, PLINPS_SID, PLINPS_UID, PLINPS_PWNAME,
+     PLINPS_EUID, PLINPS_EPWNAME, PLINPS_GID, PLINPS_EGID, PLINPS_SIZE,
+     PLINPS_RSS, PLINPS_SHARED, PLINPS_TEXT_SIZE, PLINPS_DATA_SIZE,
+     PLINPS_LIBRARY, PLINPS_DIRTY, PLINPS_FLAG, PLINPS_TTY, PLINPS_PC_CPU,
+     PLINPS_PC_MEM, PLINPS_START, PLINPS_TIME, PLINPS_CHILDTIME,
+     PLINPS_USER_T, PLINPS_SYS_T, PLINPS_PRIORITY, PLINPS_NICE,
+     PLINPS_WCHAN, PLINPS_WSTAT, PLINPS_MINFAULTS, PLINPS_CMINFAULTS,
+     PLINPS_MAJFAULTS, PLINPS_CMAJFAULTS, PLINPS_IREALVALUE, PLINPS_NSWAPS,
+     PLINPS_SIGS, PLINPS_PENDSIG, PLINPS_STACK_VADDR, PLINPS_STACK_SIZE,
+     PLINPS_PC_CPU_DIFF,
+     PLINPS_NCOLS
+};
+
+/* set a cell in the scan's current row */
+#define plinps_setcell(sc,col,val) (sc)->row[col] = (val)
 
 ITREE *plinps_uidtoname;	/* uid to username lookup */
 int    plinps_pagesize;		/* pagesize in bytes */
@@ -53,6 +84,27 @@ time_t plinps_filter_t;		/* time stamp of filter route */
 char * plinps_filter_purl;	/* p-url of the filter */
 char * plinps_filter_cmds;	/* table of filter commands */
 TABSET plinps_filter_tset;	/* compiled table set instance */
+DIR   *plinps_procdir;		/* /proc, kept open between samples */
+int    plinps_nthreads;		/* number of threads scanning /proc */
+struct plinps_scanbuf *plinps_scan;	/* buffers for each scanning thread */
+int   *plinps_pids;		/* pids found in the latest sample */
+int    plinps_pidalloc;		/* size of plinps_pids */
+pthread_mutex_t plinps_lock = PTHREAD_MUTEX_INITIALIZER; /* guards shared
+				 * state (nmalloc, caches, table) when 
+				 * scanning in threads */
+pthread_t *plinps_threads;	/* pool of scanning threads or NULL */
+int    plinps_nrunning;		/* number of threads in the pool */
+pthread_mutex_t plinps_thrlock = PTHREAD_MUTEX_INITIALIZER; /* guards below */
+pthread_cond_t  plinps_workcond = PTHREAD_COND_INITIALIZER; /* scans to do */
+pthread_cond_t  plinps_donecond = PTHREAD_COND_INITIALIZER; /* scans done */
+int    plinps_nscans;		/* scans in plinps_scan for this sample */
+int    plinps_nextscan;		/* next scan for a thread to take */
+int    plinps_pending;		/* scans not yet finished */
+int    plinps_thrstop;		/* flag for threads to exit */
+ITREE *plinps_pidcache;		/* pid -> struct plinps_pidinfo */
+int    plinps_nsample;		/* number of samples taken */
+int    plinps_reads;		/* PLINPS_READ* files to read per process */
+char **plinps_pub = NULL;	/* published columns or NULL for all */
 
 /* table constants for system probe */
 struct probe_sampletab plinps_cols[] = {
@@ -140,7 +192,7 @@ struct probe_rowdiff plinps_diffs[] = {
 /* static data return methods */
 struct probe_sampletab *plinps_getcols()    {return plinps_cols;}
 struct probe_rowdiff   *plinps_getrowdiff() {return plinps_diffs;}
-char                  **plinps_getpub()     {return NULL;}
+char                  **plinps_getpub()     {return plinps_pub;}
 
 /* prototypes */
 void plinps_load_filter(char *probeargs);
@@ -148,10 +200,50 @@ void plinps_compile_filter(TABLE tab);
 
 /*
  * Initialise probe for linux system information
- * Takes an optional argument, which is the p-url name of a filter table.
- * If absent, the whole process table is used.
+ * Takes optional arguments of the form: 
+ *    [-t <nthreads>] [-c <col>[,<col>...]] [<filter p-url>]
+ * -t shares the scanning of /proc between a pool of <nthreads> threads,
+ * started here and reused by each sample, which helps when there are 
+ * very many processes; the default is 1, to scan in the caller's thread. 
+ * -c publishes only the listed columns, in that order, and only reads
+ * the /proc files needed for them: a list that can be met from 
+ * /proc/<pid>/stat saves opening status, statm and cmdline for every
+ * process. Without it, all columns are published.
+ * The p-url names a filter table; if absent, the whole process table 
+ * is used.
  */
 void plinps_init(char *probeargs) {
+     char *end;
+     long n;
+     int len;
+
+     /* thread count and column list, in any order */
+     plinps_nthreads = 1;
+     plinps_pub = NULL;
+     while (probeargs) {
+	  probeargs += strspn(probeargs, " ");
+	  if (strncmp(probeargs, "-t", 2) == 0) {
+	       n = strtol(probeargs+2, &end, 10);
+	       if (end == probeargs+2 || n < 1) {
+		    elog_printf(ERROR, "bad thread count in ps probe "
+				"argument '%s'; using 1", probeargs);
+		    n = 1;
+	       } else if (n > PLINPS_MAXTHREADS) {
+		    elog_printf(WARNING, "ps probe limited to %d threads", 
+				PLINPS_MAXTHREADS);
+		    n = PLINPS_MAXTHREADS;
+	       }
+	       plinps_nthreads = n;
+	       probeargs = end;
+	  } else if (strncmp(probeargs, "-c", 2) == 0) {
+	       probeargs += 2;
+	       probeargs += strspn(probeargs, " ");
+	       len = strcspn(probeargs, " ");
+	       plinps_setpub(probeargs, len);
+	       probeargs += len;
+	  } else
+	       break;
+     }
 
      /* set filter parameters and carry out initial load */
      plinps_filter_t    = (time_t) 0;
@@ -176,11 +268,68 @@ void plinps_init(char *probeargs) {
 
      /* get memory size */
      plinps_total_mem = plinps_gettotal_mem();
+
+     /* scanning state: /proc is opened on first collection */
+     plinps_procdir      = NULL;
+     plinps_scan         = xnmalloc(plinps_nthreads * 
+				    sizeof(struct plinps_scanbuf));
+     memset(plinps_scan, 0, plinps_nthreads * sizeof(struct plinps_scanbuf));
+     plinps_pids         = NULL;
+     plinps_pidalloc     = 0;
+     plinps_pidcache     = itree_create();
+     plinps_nsample      = 0;
+     plinps_reads        = plinps_needs(plinps_getpub());
+
+     /* start the scanning threads once, to be reused by every sample */
+     plinps_threads      = NULL;
+     plinps_nrunning     = 0;
+     if (plinps_nthreads > 1)
+	  plinps_threadstart();
+}
+
+
+/*
+ * Set the published columns from the first len characters of cols,
+ * a comma separated list of column names. Unknown columns are reported
+ * and left out; if none are left, all columns are published.
+ */
+void plinps_setpub(char *cols, int len)
+{
+     char *list, *name, *pos;
+     int i, n;
+
+     list = xnmalloc(len+1);
+     strncpy(list, cols, len);
+     list[len] = '\0';
+     plinps_pub = xnmalloc(sizeof(char *) * (PLINPS_NCOLS+1));
+     n = 0;
+     for (name = strtok_r(list, ",", &pos); name && n < PLINPS_NCOLS; 
+	  name = strtok_r(NULL, ",", &pos)) {
+	  for (i=0; plinps_cols[i].name; i++)
+	       if (strcmp(plinps_cols[i].name, name) == 0)
+		    break;
+	  if (plinps_cols[i].name)
+	       plinps_pub[n++] = plinps_cols[i].name;
+	  else
+	       elog_printf(ERROR, "unknown ps probe column '%s', ignored",
+			   name);
+     }
+     plinps_pub[n] = NULL;
+     nfree(list);
+
+     if (n == 0) {
+	  elog_printf(ERROR, "no known columns in ps probe argument '%.*s';"
+		      " publishing all", len, cols);
+	  nfree(plinps_pub);
+	  plinps_pub = NULL;
+     }
 }
 
 
 /* destroy any structures that may be open following a run of sampling */
 void plinps_fini() {
+     int i;
+
      itree_clearoutandfree(plinps_uidtoname);
      itree_destroy(plinps_uidtoname);
      if (plinps_filter_purl)
@@ -189,6 +338,26 @@ void plinps_fini() {
           nfree(plinps_filter_cmds);
      if (plinps_filter_tset)
           tableset_destroy(plinps_filter_tset);
+     if (plinps_procdir)
+	  closedir(plinps_procdir);
+     plinps_procdir = NULL;
+     plinps_threadstop();
+     for (i=0; i < plinps_nthreads; i++) {
+	  if (plinps_scan[i].rbuf)
+	       nfree(plinps_scan[i].rbuf);
+	  if (plinps_scan[i].rows)
+	       nfree(plinps_scan[i].rows);
+     }
+     nfree(plinps_scan);
+     plinps_scan = NULL;
+     if (plinps_pids)
+	  nfree(plinps_pids);
+     plinps_pids = NULL;
+     plinps_clearcache();
+     itree_destroy(plinps_pidcache);
+     if (plinps_pub)
+	  nfree(plinps_pub);
+     plinps_pub = NULL;
 }
 
 
@@ -203,11 +372,12 @@ void plinps_load_filter(char *probeargs) {
      char *filter_cmds = NULL;	/* new commands */
      time_t check_t;		/* time of last check */
      int len, seq, r;
+     char *tokpos;
 
      /* check for a new p-url location supplied as an agrument */
      if (probeargs && *probeargs) {
           /* collect arguments from command line */
-          filter_purl = strtok(probeargs, " ");
+          filter_purl = strtok_r(probeargs, " ", &tokpos);
 	  if (filter_purl == NULL) {
 	       /* if arguments are specified but route does not exist, then
 		* this causes the filter to be cleared and for ps to
@@ -305,75 +475,97 @@ void plinps_compile_filter(TABLE tab) {
 
 /*
  * Linux specific routines
+ *
+ * /proc is opened once and kept open, with each process directory and 
+ * its files opened relative to it with openat(). Files are read into a 
+ * buffer that is reused between files and samples; only the text that 
+ * ends up in cells is copied, into large blocks owned by the table.
+ * Only the files needed for the published columns are read and the
+ * command line of a process is remembered for its life (pid+start time).
+ *
+ * The pids are listed and sorted, then shared in contiguous runs between
+ * plinps_nthreads scans, each parsing into its own row buffer. Once all
+ * have finished, the rows are added to the table scan by scan, which 
+ * keeps them in pid order.
  */
 void plinps_collect(TABLE tab) {
-     DIR *dir;
      struct dirent *d;
-     char pfile[PATH_MAX];
-     void *data;
+     struct plinps_scanbuf *sc;
+     int procfd, reads, npids, nscans, per, i;
      TABLE filtered_tab;
 
-     /* open procfs */
-     dir = opendir("/proc");
-     if ( ! dir ) {
+     /* open procfs the first time, then go back to its start */
+     if (plinps_procdir)
+	  rewinddir(plinps_procdir);
+     else if ( ! (plinps_procdir = opendir("/proc")) ) {
 	  elog_printf(ERROR, "can't open /proc: %d %s",
 		      errno, strerror(errno));
 	  return;
      }
-
-     /* traverse process entries.
-      * remember to take into consideration the transigent nature of 
-      * processes, which may not be there when we come to opening them */
-     while ((d = readdir(dir))) {
-	  /* the linux /proc contains pids, dot files and system status files
-	   * we are only interested in the pid directories whose filenames
-	   * contain only digits */
-	  if (strcmp(d->d_name, ".") == 0)
-	       continue;
-	  if (strcmp(d->d_name, "..") == 0)
-	       continue;
+     procfd = dirfd(plinps_procdir);
+     plinps_nsample++;
+
+     /* a filter may refer to any column, so collect them all */
+     reads = plinps_filter_purl ? PLINPS_READALL : plinps_reads;
+
+     /* list the process entries.
+      * the linux /proc contains pids, dot files and system status files
+      * we are only interested in the pid directories whose filenames
+      * contain only digits */
+     npids = 0;
+     while ((d = readdir(plinps_procdir))) {
 	  if ( ! isdigit(*d->d_name) )
 	       continue;
-
-	  /* open pid's short stat file */
-	  sprintf(pfile, "/proc/%s/stat", d->d_name);
-	  data = probe_readfile(pfile);
-	  if (data) {
-	       /* point of no return: start collecting table data */
-	       table_addemptyrow(tab);
-	       /*plinps_col_fperm(tab, pfile, plinps_uidtoname);*/
-	       plinps_col_stat(tab, data, plinps_uidtoname);
-	       table_freeondestroy(tab, data);
-	  } else
-	       continue;
-
-	  /* add information from the longer status file */
-	  sprintf(pfile, "/proc/%s/status", d->d_name);
-	  data = probe_readfile(pfile);
-	  if (data) {
-	       plinps_col_status(tab, data, plinps_uidtoname);
-	       table_freeondestroy(tab, data);
-	  }
-
-	  /* add memory stats */
-	  sprintf(pfile, "/proc/%s/statm", d->d_name);
-	  data = probe_readfile(pfile);
-	  if (data) {
-	       plinps_col_statm(tab, data, plinps_uidtoname);
-	       table_freeondestroy(tab, data);
+	  if (npids >= plinps_pidalloc) {
+	       plinps_pidalloc = plinps_pidalloc ? plinps_pidalloc * 2 
+		                                 : PLINPS_PIDALLOC;
+	       plinps_pids = xnrealloc(plinps_pids, 
+				       plinps_pidalloc * sizeof(int));
 	  }
+	  plinps_pids[npids++] = strtol(d->d_name, NULL, 10);
+     }
+     qsort(plinps_pids, npids, sizeof(int), plinps_cmppid);
+
+     /* share the pids out in contiguous runs */
+     nscans = plinps_nthreads;
+     if (nscans > npids)
+	  nscans = npids ? npids : 1;
+     per = (npids + nscans - 1) / nscans;
+     for (i=0; i < nscans; i++) {
+	  sc = &plinps_scan[i];
+	  sc->tab     = tab;
+	  sc->blk     = NULL;
+	  sc->blkused = PLINPS_BLKSZ;
+	  sc->nrows   = 0;
+	  sc->procfd  = procfd;
+	  sc->reads   = reads;
+	  sc->pids    = plinps_pids + i * per;
+	  sc->npids   = npids - i * per < per ? npids - i * per : per;
+     }
 
-	  /* find the command line */
-	  sprintf(pfile, "/proc/%s/cmdline", d->d_name);
-	  data = probe_readfile(pfile);
-	  if (data) {
-	       plinps_col_cmd(tab, data);
-	       table_freeondestroy(tab, data);
-	  }
+     /* hand the scans to the pool and wait for them to finish, or scan 
+      * in this thread if there is only one scan or no pool */
+     if (nscans == 1 || ! plinps_threads) {
+	  for (i=0; i < nscans; i++)
+	       plinps_scanpids(&plinps_scan[i]);
+     } else {
+	  pthread_mutex_lock(&plinps_thrlock);
+	  plinps_nscans   = nscans;
+	  plinps_nextscan = 0;
+	  plinps_pending  = nscans;
+	  pthread_cond_broadcast(&plinps_workcond);
+	  while (plinps_pending)
+	       pthread_cond_wait(&plinps_donecond, &plinps_thrlock);
+	  plinps_nscans   = 0;
+	  pthread_mutex_unlock(&plinps_thrlock);
      }
 
-     /* close procfs and clean up */
-     closedir(dir);
+     /* assemble the table in pid order */
+     for (i=0; i < nscans; i++)
+	  plinps_addrows(&plinps_scan[i], tab);
+
+     /* forget processes that have gone */
+     plinps_sweepcache();
 
      /* check to see if there is any change in the route content (and
       * thus the filter clause), then compile the filter on this tab 
@@ -393,6 +585,379 @@ void plinps_collect(TABLE tab) {
      }
 }
 
+
+
+/*
+ * Scan the processes in the pid list of sc, parsing them into the 
+ * scan's row buffer. Runs in its own thread when collecting in parallel,
+ * so shared state (nmalloc, the caches and the table) is only touched 
+ * while holding plinps_lock.
+ * Remember to take into consideration the transigent nature of 
+ * processes, which may not be there when we come to opening them.
+ */
+void plinps_scanpids(struct plinps_scanbuf *sc)
+{
+     struct plinps_pidinfo *pinfo;
+     char name[PLINPS_NUMLEN], *data;
+     int i, pidfd;
+
+     for (i=0; i < sc->npids; i++) {
+	  snprintf(name, PLINPS_NUMLEN, "%d", sc->pids[i]);
+	  pidfd = openat(sc->procfd, name, O_RDONLY|O_DIRECTORY);
+	  if (pidfd < 0)
+	       continue;
+
+	  /* pid's short stat file */
+	  data = plinps_readat(sc, pidfd, "stat");
+	  if ( ! data ) {
+	       close(pidfd);
+	       continue;
+	  }
+
+	  /* point of no return: start collecting row data */
+	  plinps_newrow(sc);
+	  pinfo = plinps_col_stat(sc, data);
+
+	  /* add information from the longer status file */
+	  if ((sc->reads & PLINPS_READSTATUS) &&
+	      (data = plinps_readat(sc, pidfd, "status")))
+	       plinps_col_status(sc, data, plinps_uidtoname);
+
+	  /* add memory stats */
+	  if ((sc->reads & PLINPS_READSTATM) &&
+	      (data = plinps_readat(sc, pidfd, "statm")))
+	       plinps_col_statm(sc, data);
+
+	  /* find the command line, which only changes with exec() and
+	   * is empty for zombies */
+	  if (sc->reads & PLINPS_READCMDLINE) {
+	       if ( ! pinfo->args || pinfo->zombie ) {
+		    data = plinps_readat(sc, pidfd, "cmdline");
+		    if (data) {
+			 pthread_mutex_lock(&plinps_lock);
+			 if (pinfo->args)
+			      nfree(pinfo->args);
+			 pinfo->args = xnstrdup(data);
+			 pthread_mutex_unlock(&plinps_lock);
+		    }
+	       }
+	       if (pinfo->args)
+		    plinps_col_cmd(sc, pinfo->args);
+	  }
+
+	  close(pidfd);
+     }
+}
+
+
+/*
+ * Start the pool of plinps_nthreads scanning threads, which wait for 
+ * plinps_collect() to hand them scans. The threads block signals, 
+ * leaving them to the main thread. If none can be started, plinps_threads
+ * is left NULL and scanning is done in the collecting thread.
+ */
+void plinps_threadstart()
+{
+     sigset_t all, old;
+     int r;
+
+     plinps_thrstop  = 0;
+     plinps_nscans   = 0;
+     plinps_nextscan = 0;
+     plinps_pending  = 0;
+     plinps_threads  = xnmalloc(sizeof(pthread_t) * plinps_nthreads);
+     sigfillset(&all);		/* except faults, which must still be caught */
+     sigdelset(&all, SIGSEGV);
+     sigdelset(&all, SIGBUS);
+     sigdelset(&all, SIGFPE);
+     sigdelset(&all, SIGILL);
+     pthread_sigmask(SIG_BLOCK, &all, &old);
+     for (plinps_nrunning=0; plinps_nrunning < plinps_nthreads; 
+	  plinps_nrunning++) {
+	  r = pthread_create(&plinps_threads[plinps_nrunning], NULL, 
+			     plinps_scanthread, NULL);
+	  if (r) {
+	       elog_printf(ERROR, "unable to start ps scan thread %d: "
+			   "%d %s", plinps_nrunning, r, strerror(r));
+	       break;
+	  }
+     }
+     pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+     if (plinps_nrunning == 0) {
+	  elog_printf(ERROR, "no ps scan threads; scanning in one thread");
+	  nfree(plinps_threads);
+	  plinps_threads = NULL;
+     }
+}
+
+
+/* Stop the pool of scanning threads, if running */
+void plinps_threadstop()
+{
+     int i;
+
+     if ( ! plinps_threads )
+	  return;
+
+     pthread_mutex_lock(&plinps_thrlock);
+     plinps_thrstop = 1;
+     pthread_cond_broadcast(&plinps_workcond);
+     pthread_mutex_unlock(&plinps_thrlock);
+     for (i=0; i < plinps_nrunning; i++)
+	  pthread_join(plinps_threads[i], NULL);
+     nfree(plinps_threads);
+     plinps_threads  = NULL;
+     plinps_nrunning = 0;
+}
+
+
+/*
+ * Body of each pooled thread: take the scans of the current sample 
+ * in turn, signalling the collecting thread when the last is done
+ */
+void *plinps_scanthread(void *unused)
+{
+     struct plinps_scanbuf *sc;
+
+     pthread_mutex_lock(&plinps_thrlock);
+     while (1) {
+	  while ( ! plinps_thrstop && plinps_nextscan >= plinps_nscans )
+	       pthread_cond_wait(&plinps_workcond, &plinps_thrlock);
+	  if (plinps_thrstop)
+	       break;
+
+	  sc = &plinps_scan[plinps_nextscan++];
+	  pthread_mutex_unlock(&plinps_thrlock);
+
+	  plinps_scanpids(sc);
+
+	  pthread_mutex_lock(&plinps_thrlock);
+	  if (--plinps_pending == 0)
+	       pthread_cond_signal(&plinps_donecond);
+     }
+     pthread_mutex_unlock(&plinps_thrlock);
+
+     return NULL;
+}
+
+
+/* Compare pids for qsort() */
+int plinps_cmppid(const void *a, const void *b)
+{
+     return *(const int *) a - *(const int *) b;
+}
+
+
+/* Start a new, empty row in the scan's row buffer */
+void plinps_newrow(struct plinps_scanbuf *sc)
+{
+     if (sc->nrows >= sc->rowalloc) {
+	  sc->rowalloc = sc->rowalloc ? sc->rowalloc * 2 : PLINPS_ROWALLOC;
+	  pthread_mutex_lock(&plinps_lock);
+	  sc->rows = xnrealloc(sc->rows, 
+			       sc->rowalloc * PLINPS_NCOLS * sizeof(char *));
+	  pthread_mutex_unlock(&plinps_lock);
+     }
+     sc->row = sc->rows + sc->nrows * PLINPS_NCOLS;
+     memset(sc->row, 0, PLINPS_NCOLS * sizeof(char *));
+     sc->nrows++;
+}
+
+
+/* Append the rows collected by a scan to the table */
+void plinps_addrows(struct plinps_scanbuf *sc, TABLE tab)
+{
+     char **row;
+     int r, c;
+
+     for (r=0; r < sc->nrows; r++) {
+	  row = sc->rows + r * PLINPS_NCOLS;
+	  table_addemptyrow(tab);
+	  for (c=0; c < PLINPS_NCOLS; c++)
+	       if (row[c])
+		    table_replacecurrentcell(tab, plinps_cols[c].name, row[c]);
+     }
+     sc->nrows = 0;
+}
+
+
+/*
+ * Read the file fname from the directory open as dirfd into the scan's 
+ * read buffer, growing it as needed. The contents are '\0' terminated.
+ * Returns the buffer, which is overwritten by the next read, or NULL if 
+ * the file could not be read.
+ */
+char *plinps_readat(struct plinps_scanbuf *sc, int dirfd, char *fname)
+{
+     int fd, n, len=0;
+
+     fd = openat(dirfd, fname, O_RDONLY);
+     if (fd < 0)
+	  return NULL;
+     if (sc->rbuf == NULL) {
+	  sc->rbufsz = PROBE_STATSZ;
+	  pthread_mutex_lock(&plinps_lock);
+	  sc->rbuf   = xnmalloc(sc->rbufsz);
+	  pthread_mutex_unlock(&plinps_lock);
+     }
+     while ((n = read(fd, sc->rbuf+len, sc->rbufsz-len-1)) > 0) {
+	  len += n;
+	  if (len >= sc->rbufsz-1) {
+	       sc->rbufsz *= 2;
+	       pthread_mutex_lock(&plinps_lock);
+	       sc->rbuf = xnrealloc(sc->rbuf, sc->rbufsz);
+	       pthread_mutex_unlock(&plinps_lock);
+	  }
+     }
+     close(fd);
+     if (n < 0)
+	  return NULL;
+     sc->rbuf[len] = '\0';
+
+     return sc->rbuf;
+}
+
+
+/* Copy len characters of str into the table's cell text, '\0' terminated,
+ * and return the copy, which lasts as long as the table */
+char *plinps_keep(struct plinps_scanbuf *sc, char *str, int len)
+{
+     char *pt;
+
+     if (sc->blkused + len + 1 > PLINPS_BLKSZ) {
+	  if (len + 1 > PLINPS_BLKSZ / 4) {
+	       /* big strings have their own allocation */
+	       pthread_mutex_lock(&plinps_lock);
+	       pt = table_alloc(sc->tab, len + 1);
+	       pthread_mutex_unlock(&plinps_lock);
+	       memcpy(pt, str, len);
+	       pt[len] = '\0';
+	       return pt;
+	  }
+	  pthread_mutex_lock(&plinps_lock);
+	  sc->blk = table_alloc(sc->tab, PLINPS_BLKSZ);
+	  pthread_mutex_unlock(&plinps_lock);
+	  sc->blkused = 0;
+     }
+     pt = sc->blk + sc->blkused;
+     memcpy(pt, str, len);
+     pt[len] = '\0';
+     sc->blkused += len + 1;
+
+     return pt;
+}
+
+
+/* Format into the table's cell text and return it, as plinps_keep() */
+char *plinps_keepf(struct plinps_scanbuf *sc, const char *fmt, ...)
+{
+     va_list ap;
+     char buf[PLINPS_NUMLEN];
+     int len;
+
+     va_start(ap, fmt);
+     len = vsnprintf(buf, PLINPS_NUMLEN, fmt, ap);
+     va_end(ap);
+     if (len >= PLINPS_NUMLEN)
+	  len = PLINPS_NUMLEN-1;
+
+     return plinps_keep(sc, buf, len);
+}
+
+
+/* Work out the files that need to be read to provide the columns in pub,
+ * which is a NULL terminated list or NULL for every column.
+ * Returns a mask of PLINPS_READ* */
+int plinps_needs(char **pub)
+{
+     int i, reads=0;
+
+     if (pub == NULL)
+	  return PLINPS_READALL;
+
+     for (i=0; pub[i]; i++) {
+	  if (strcmp(pub[i], "uid")       == 0 ||
+	      strcmp(pub[i], "pwname")    == 0 ||
+	      strcmp(pub[i], "euid")      == 0 ||
+	      strcmp(pub[i], "epwname")   == 0 ||
+	      strcmp(pub[i], "gid")       == 0 ||
+	      strcmp(pub[i], "egid")      == 0 ||
+	      strcmp(pub[i], "data_size") == 0 ||
+	      strcmp(pub[i], "library")   == 0 ||
+	      strcmp(pub[i], "text_size") == 0)
+	       reads |= PLINPS_READSTATUS;
+	  else if (strcmp(pub[i], "shared") == 0 ||
+		   strcmp(pub[i], "dirty")  == 0)
+	       reads |= PLINPS_READSTATM;
+	  else if (strcmp(pub[i], "args") == 0)
+	       reads |= PLINPS_READCMDLINE;
+     }
+
+     return reads;
+}
+
+
+/* Return the details kept for pid, which are reset if start differs
+ * from the process seen before with the same pid */
+struct plinps_pidinfo *plinps_getpidinfo(int pid, unsigned long long start)
+{
+     struct plinps_pidinfo *pinfo;
+
+     pthread_mutex_lock(&plinps_lock);
+     pinfo = itree_find(plinps_pidcache, pid);
+     if (pinfo == ITREE_NOVAL) {
+	  pinfo = xnmalloc(sizeof(struct plinps_pidinfo));
+	  pinfo->args = NULL;
+	  itree_add(plinps_pidcache, pid, pinfo);
+     } else if (pinfo->start != start && pinfo->args) {
+	  /* pid reused by a new process */
+	  nfree(pinfo->args);
+	  pinfo->args = NULL;
+     }
+     pinfo->start  = start;
+     pinfo->zombie = 0;
+     pinfo->seen   = plinps_nsample;
+     pthread_mutex_unlock(&plinps_lock);
+
+     return pinfo;
+}
+
+
+/* Remove the details of processes not seen in the latest sample */
+void plinps_sweepcache()
+{
+     struct plinps_pidinfo *pinfo;
+
+     itree_first(plinps_pidcache);
+     while ( ! itree_isbeyondend(plinps_pidcache) ) {
+	  pinfo = itree_get(plinps_pidcache);
+	  if (pinfo->seen != plinps_nsample) {
+	       if (pinfo->args)
+		    nfree(pinfo->args);
+	       nfree(pinfo);
+	       itree_rm(plinps_pidcache);	/* moves to next */
+	  } else
+	       itree_next(plinps_pidcache);
+     }
+}
+
+
+/* remove all the details of processes */
+void plinps_clearcache()
+{
+     struct plinps_pidinfo *pinfo;
+
+     itree_traverse(plinps_pidcache) {
+	  pinfo = itree_get(plinps_pidcache);
+	  if (pinfo->args)
+	       nfree(pinfo->args);
+	  nfree(pinfo);
+     }
+     itree_clearout(plinps_pidcache, NULL);
+}
+
+
 /* finds the owner of the process file and thus the process */
 void plinps_col_fperm(TABLE tab, char *fname, ITREE *uidtoname)
 {
@@ -410,19 +975,22 @@ void plinps_col_fperm(TABLE tab, char *fname, ITREE *uidtoname)
 }
 
 /* find the full command line */
-void plinps_col_cmd(TABLE tab, char *value)
+void plinps_col_cmd(struct plinps_scanbuf *sc, char *value)
 {
-     table_replacecurrentcell(tab, "args", value);
+     plinps_setcell(sc, PLINPS_ARGS, plinps_keep(sc, value, strlen(value)));
 }
 
 
-/* takes data from /procs's stat structure into the table */
-void plinps_col_stat(TABLE tab, char *ps, ITREE *uidtoname)
+/* takes data from /procs's stat structure into the table.
+ * Returns the details kept for the process */
+struct plinps_pidinfo *plinps_col_stat(struct plinps_scanbuf *sc, char *ps)
 {
-     char *value, *value2;
+     char *value, *cmd, *line, *f[PLINPS_NSTATFIELDS];
      long long _utime, _stime, _cutime, _cstime, runtime, runstart;
      unsigned pid, flag;
      float pcpu, rss;
+     int nf;
+     struct plinps_pidinfo *pinfo;
 
      /* Format in 2.6 is similar to:
       *    921 (bash) R 4909 4921 4921 34817 7121 0 2028 488573 0 53 
@@ -475,22 +1043,41 @@ void plinps_col_stat(TABLE tab, char *ps, ITREE *uidtoname)
       *     36. cnswap - nswap for all children
       *     37. exit_signal - signal to be sent to parent when proc dies
       *     38. processor - CPU number last executed on
+      *
+      * The command is parenthetised and may itself contain spaces and
+      * parentheses, so it runs to the last ')'. The line is copied to 
+      * the cell text once and split there; f[0] is col 3 (state).
       */
+     value = strrchr(ps, ')');
+     cmd = strchr(ps, '(');
+     if ( ! value || ! cmd || value < cmd )
+	  return plinps_getpidinfo(strtol(ps, NULL, 10), 0);
+     line  = plinps_keep(sc, ps, strlen(ps));
+     cmd   = line + (cmd   - ps);
+     value = line + (value - ps);
+     ps    = line;
+     *value++ = '\0';
+     *cmd++ = '\0';
+     for (nf=0; nf < PLINPS_NSTATFIELDS; nf++)
+	  f[nf] = "0";
+     for (nf=0; nf < PLINPS_NSTATFIELDS && *value; nf++) {
+	  while (*value == ' ')
+	       value++;
+	  f[nf] = value;
+	  value += strcspn(value, " \n");
+	  if (*value)
+	       *value++ = '\0';
+     }
 
-     value = strtok(ps, " ");
-     pid = strtol(value, NULL, 10);
-     table_replacecurrentcell(tab, "pid",       value);
-
-     /* command is parenthetised; remove them */
-     value = strtok(NULL, " ")+1;
-     value[strlen(value)-1] = '\0';
-     table_replacecurrentcell(tab, "cmd",       value);
+     pid = strtol(ps, NULL, 10);
+     value = ps + strspn(ps, " ");
+     value[strcspn(value, " ")] = '\0';
+     plinps_setcell(sc, PLINPS_PID,       value);
+     plinps_setcell(sc, PLINPS_CMD,       cmd);
 
      /* id - human readable id made from cmd and pid */
-     value2 = xnmalloc(strlen(value)+16);
-     sprintf(value2, "%s (%d)", value, pid);
-     table_replacecurrentcell(tab, "process",   value2);
-     table_freeondestroy(tab, value2);
+     plinps_setcell(sc, PLINPS_PROCESS, 
+			      plinps_keepf(sc, "%s (%d)", cmd, pid));
 
      /* PROCESS STATE CODES
       *   D    Uninterruptible sleep (usually IO)
@@ -509,7 +1096,7 @@ void plinps_col_stat(TABLE tab, char *ps, ITREE *uidtoname)
       *   l    is multi-threaded (using CLONE_THREAD, like NPTL pthreads do)
       *   +    is in the foreground process group
       */
-     value = strtok(NULL, " ");		/*state*/
+     value = f[0];			/*state*/
      if (*value == 'R')
 	  value = "Running";
      else if (*value == 'S')
@@ -522,67 +1109,50 @@ void plinps_col_stat(TABLE tab, char *ps, ITREE *uidtoname)
 	  value = "Traced/stopped";
      else if (*value == 'W')
 	  value = "Paging";
-     table_replacecurrentcell_alloc(tab, "state", value);
-
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "ppid",      value);
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "pidglead",  value);
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "sid",       value);
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "tty",       value);
-
-     /* TODO: tpgid (controlling tty process group id) is currently 
+     plinps_setcell(sc, PLINPS_STATE, value);
+
+     plinps_setcell(sc, PLINPS_PPID,      f[1]);
+     plinps_setcell(sc, PLINPS_PIDGLEAD,  f[2]);
+     plinps_setcell(sc, PLINPS_SID,       f[3]);
+     plinps_setcell(sc, PLINPS_TTY,       f[4]);
+
+     /* TODO: tpgid (controlling tty process group id) f[5] is currently 
       * ignored */
-     value = strtok(NULL, " ");
 
      /* PROCESS FLAGS
       *    1   forked but didn't exec
       *    4   used super-user privileges
       */
-     value = strtok(NULL, " ");
-     flag = strtoul(value, (char **)NULL, 10);
-     table_replacecurrentcell_alloc(tab, "flag",      util_u32toaoct(
-					 (unsigned)(flag>>6U)&0x7U));
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "minfaults", value);
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "cminfaults", value);
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "majfaults", value);
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "cmajfaults", value);
-
-     value = strtok(NULL, " ");
-     _utime = strtol(value, NULL, 10);
-     value = strtok(NULL, " ");
-     _stime = strtol(value, NULL, 10);
-     value = strtok(NULL, " ");
-     _cutime = strtol(value, NULL, 10);
-     value = strtok(NULL, " ");
-     _cstime = strtol(value, NULL, 10);
-     table_replacecurrentcell_alloc(tab, "time", util_jiffytoa(_utime+_stime));
-     table_replacecurrentcell_alloc(tab, "childtime", 
-			  util_jiffytoa(_cutime+_cstime/*-_utime-_stime*/));
-     table_replacecurrentcell_alloc(tab, "user_t", util_jiffytoa(_utime));
-     table_replacecurrentcell_alloc(tab, "sys_t",  util_jiffytoa(_stime));
-
-     value = strtok(NULL, " ");		/* priority */
-     table_replacecurrentcell(tab, "priority", value);
-     value = strtok(NULL, " ");		/* nice */
-     table_replacecurrentcell(tab, "nice", value);
-
-     /* timeout is ignored, in 2.6 it is removed */
-     value = strtok(NULL, " ");
-
-     value = strtok(NULL, " ");
-     table_replacecurrentcell_alloc(tab, "irealvalue", 
-				    util_jiffytoa(strtol(value, NULL, 10)));
-
-     value = strtok(NULL, " ");
-     runstart = plinps_boot_t + (strtol(value, NULL, 10) / 100);
-     table_replacecurrentcell_alloc(tab, "start", util_i32toa(runstart));
+     flag = strtoul(f[6], (char **)NULL, 10);
+     plinps_setcell(sc, PLINPS_FLAG, plinps_keepf(sc, "%lo", 
+			     (unsigned long) ((unsigned)(flag>>6U)&0x7U)));
+     plinps_setcell(sc, PLINPS_MINFAULTS,  f[7]);
+     plinps_setcell(sc, PLINPS_CMINFAULTS, f[8]);
+     plinps_setcell(sc, PLINPS_MAJFAULTS,  f[9]);
+     plinps_setcell(sc, PLINPS_CMAJFAULTS, f[10]);
+
+     _utime  = strtol(f[11], NULL, 10);
+     _stime  = strtol(f[12], NULL, 10);
+     _cutime = strtol(f[13], NULL, 10);
+     _cstime = strtol(f[14], NULL, 10);
+     plinps_setcell(sc, PLINPS_TIME,   plinps_keepjiffy(sc, 
+							  _utime+_stime));
+     plinps_setcell(sc, PLINPS_CHILDTIME, plinps_keepjiffy(sc, 
+			  _cutime+_cstime/*-_utime-_stime*/));
+     plinps_setcell(sc, PLINPS_USER_T, plinps_keepjiffy(sc, _utime));
+     plinps_setcell(sc, PLINPS_SYS_T,  plinps_keepjiffy(sc, _stime));
+
+     plinps_setcell(sc, PLINPS_PRIORITY, f[15]);
+     plinps_setcell(sc, PLINPS_NICE,     f[16]);
+
+     /* timeout f[17] is ignored, in 2.6 it is removed */
+
+     plinps_setcell(sc, PLINPS_IREALVALUE, plinps_keepjiffy(sc, 
+					   strtol(f[18], NULL, 10)));
+
+     runstart = plinps_boot_t + (strtol(f[19], NULL, 10) / 100);
+     plinps_setcell(sc, PLINPS_START, plinps_keepf(sc, "%ld", 
+							 (long) runstart));
 
      /* %cpu -- time taken on CPU over life of process
       *         thus, the incremental value and time is recorded since 
@@ -592,68 +1162,42 @@ void plinps_col_stat(TABLE tab, char *ps, ITREE *uidtoname)
      pcpu = (float) (_utime+_stime) / runtime;
      if (pcpu < 0.0)
 	  pcpu = 0.0;
-     table_replacecurrentcell_alloc(tab, "pc_cpu",    util_ftoa(pcpu));
+     plinps_setcell(sc, PLINPS_PC_CPU, plinps_keepf(sc, "%.2f", pcpu));
 
-     value = strtok(NULL, " ");
-     table_replacecurrentcell_alloc(tab, "size",
-			util_ftoa((float) strtol(value, NULL, 10) / 1024.0));
-     value = strtok(NULL, " ");
-     rss = (float) strtol(value, NULL, 10) * plinps_pagetokb;
-     table_replacecurrentcell_alloc(tab, "rss",       util_ftoa(rss));
-				      
+     plinps_setcell(sc, PLINPS_SIZE, plinps_keepf(sc, "%.2f", 
+			(float) ((float) strtol(f[20], NULL, 10) / 1024.0)));
+     rss = (float) strtol(f[21], NULL, 10) * plinps_pagetokb;
+     plinps_setcell(sc, PLINPS_RSS,    plinps_keepf(sc, "%.2f", rss));
 
      /* %mem */
-     table_replacecurrentcell_alloc(tab, "pc_mem",    util_ftoa(
-					 rss * 100ULL / plinps_total_mem));
-
-     /* TODO: rlim (current limit in bytes on the rss of the process 
-      * (usually 4294967295 on i386) is currently ignored */
-     value = strtok(NULL, " ");
-
-     /* TODO: startcode (The address above which program text can run)
-	is currently ignored */
-     value = strtok(NULL, " ");
+     plinps_setcell(sc, PLINPS_PC_MEM, plinps_keepf(sc, "%.2f", 
+				   (float) (rss * 100ULL / plinps_total_mem)));
 
-     /* TODO: endcode (The address below which program text can run) 
-      * is currently ignored */
-     value = strtok(NULL, " ");
+     /* TODO: rlim f[22], startcode f[23] and endcode f[24] are 
+      * currently ignored */
 
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "stack_vaddr", value);
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "stack_size",  value);
+     plinps_setcell(sc, PLINPS_STACK_VADDR, f[25]);
+     plinps_setcell(sc, PLINPS_STACK_SIZE,  f[26]);
 
-     /* TODO: kstkesip (the instruction pointer) is currently ignored */
-     value = strtok(NULL, " ");
+     /* TODO: kstkesip (the instruction pointer) f[27] is currently ignored*/
 
      /* TODO: check the signal value is really a pending signal */
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "pendsig",  value);
+     plinps_setcell(sc, PLINPS_PENDSIG,  f[28]);
 
-     /* TODO: blocked is currently ignored */
-     value = strtok(NULL, " ");
-
-     /* TODO: sigignore is currently ignored */
-     value = strtok(NULL, " ");
-
-     /* TODO: sigcatch is currently ignored */
-     value = strtok(NULL, " ");
+     /* TODO: blocked f[29], sigignore f[30] and sigcatch f[31] are
+      * currently ignored */
 
      /* TODO: wchan is currently unexpanded into a symbol */
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "wchan",     value);
+     plinps_setcell(sc, PLINPS_WCHAN,     f[32]);
 
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "nswaps",     value);
+     plinps_setcell(sc, PLINPS_NSWAPS,    f[33]);
 
-     /* TODO: cnswap is currently ignored */
-     value = strtok(NULL, " ");
+     /* TODO: cnswap, exit_signal and processor are currently ignored */
 
-     /* TODO: exit_signal is currently ignored */
-     value = strtok(NULL, " ");
+     pinfo = plinps_getpidinfo(pid, strtoull(f[19], NULL, 10));
+     pinfo->zombie = (*f[0] == 'Z');
 
-     /* TODO: processor is currently ignored */
-     value = strtok(NULL, " ");
+     return pinfo;
 
 #if 0
 
@@ -670,11 +1214,18 @@ the following have yet to be collected or computed
 }
 
 
+/* Keep jiffies as seconds text, as util_jiffytoa() */
+char *plinps_keepjiffy(struct plinps_scanbuf *sc, unsigned long long jiffies)
+{
+     /* a jiffy is 1/100th of a second in linux */
+     return plinps_keepf(sc, "%llu.%llu", jiffies / 100, jiffies % 100);
+}
+
+
 /* takes data from /procs's status structure into the table */
-void plinps_col_status(TABLE tab, char *ps, ITREE *uidtoname)
+void plinps_col_status(struct plinps_scanbuf *sc, char *ps, ITREE *uidtoname)
 {
-     ITREE *lines, *cols;
-     char *key, *val;
+     char *line, *val;
      int seen_vmdata=0, seen_vmlib=0, seen_vmexe=0;
 
      /* Format is similar to:-
@@ -705,109 +1256,86 @@ void plinps_col_status(TABLE tab, char *ps, ITREE *uidtoname)
       *    CapInh: 0000000000000000
       *    CapPrm: 0000000000000000
       *    CapEff: 0000000000000000
+      *
+      * Only Uid, Gid and three of the Vm lines are wanted, so the lines 
+      * are matched in place and just their values kept.
       */
-
-     util_scantext(ps, " \t:", UTIL_MULTISEP, &lines);
-     itree_traverse(lines) {
-	  cols = itree_get(lines);
-	  key = itree_find(cols, 0);
-	  if (key == ITREE_NOVAL)
-	       continue;
-
-	  switch(key[0]) {
-	  case 'N':	/* Name */
-	       break;
-	  case 'S':	/* State, SleepSVG, Sig* */
-	       break;
-	  case 'T':	/* Tgid, TracerPid, Threads  */
-	       break;
-	  case 'P':	/* Pid, PPid */
-	       break;
+     for (line = ps; line && *line; line = strchr(line, '\n'), 
+	       line = line ? line+1 : NULL) {
+	  switch(line[0]) {
 	  case 'U':	/* Uid */
-	       if (strcmp(key, "Uid") == 0) {
+	       if (strncmp(line, "Uid:", 4) == 0) {
 		    /* real uid */
-		    itree_next(cols);
-		    val = itree_get(cols);
-		    table_replacecurrentcell(tab, "uid",    val);
-		    table_replacecurrentcell(tab, "pwname", 
+		    val = plinps_statusval(sc, line+4, &line);
+		    plinps_setcell(sc, PLINPS_UID,    val);
+		    plinps_setcell(sc, PLINPS_PWNAME, 
 			plinps_getuser(strtol(val, NULL, 10), uidtoname));
 
 		    /* effective uid */
-		    itree_next(cols);
-		    val = itree_get(cols);
-		    table_replacecurrentcell(tab, "euid",    val);
-		    table_replacecurrentcell(tab, "epwname", 
+		    val = plinps_statusval(sc, line, &line);
+		    plinps_setcell(sc, PLINPS_EUID,    val);
+		    plinps_setcell(sc, PLINPS_EPWNAME, 
 			plinps_getuser(strtol(val, NULL, 10), uidtoname));
-#if 0
-		    itree_next(cols);
-		    val = itree_get(cols);	/* suid - saved user id */
-		    itree_next(cols);
-		    val = itree_get(cols);	/* fuid - fs user id */
-#endif
 	       }
 	       break;
 	  case 'G':	/* Gid, Groups */
-	       if (strcmp(key, "Gid") == 0) {
+	       if (strncmp(line, "Gid:", 4) == 0) {
 		    /* real gid */
-		    itree_next(cols);
-		    val = itree_get(cols);
-		    table_replacecurrentcell(tab, "gid",    val);
+		    val = plinps_statusval(sc, line+4, &line);
+		    plinps_setcell(sc, PLINPS_GID,    val);
 
 		    /* effective gid */
-		    itree_next(cols);
-		    val = itree_get(cols);
-		    table_replacecurrentcell(tab, "egid",    val);
-#if 0
-		    itree_next(cols);
-		    val = itree_get(cols);	/* sgid - saved group id */
-		    itree_next(cols);
-		    val = itree_get(cols);	/* fgid - fs group id */
-#endif
+		    val = plinps_statusval(sc, line, &line);
+		    plinps_setcell(sc, PLINPS_EGID,    val);
 	       }
 	       break;
-	  case 'F':	/* FDSize */
-	       break;
 	  case 'V':	/* Vm* */
-	       if (strcmp(key, "VmData") == 0) {
-		    itree_next(cols);
-		    val = itree_get(cols);
-		    table_replacecurrentcell(tab, "data_size", val);
+	       if (strncmp(line, "VmData:", 7) == 0) {
+		    val = plinps_statusval(sc, line+7, &line);
+		    plinps_setcell(sc, PLINPS_DATA_SIZE, val);
 		    seen_vmdata++;
-	       }
-	       if (strcmp(key, "VmLib") == 0) {
-		    itree_next(cols);
-		    val = itree_get(cols);
-		    table_replacecurrentcell(tab, "library", val);
+	       } else if (strncmp(line, "VmLib:", 6) == 0) {
+		    val = plinps_statusval(sc, line+6, &line);
+		    plinps_setcell(sc, PLINPS_LIBRARY, val);
 		    seen_vmlib++;
-	       }
-	       if (strcmp(key, "VmExe") == 0) {
-		    itree_next(cols);
-		    val = itree_get(cols);
-		    table_replacecurrentcell(tab, "text_size", val);
+	       } else if (strncmp(line, "VmExe:", 6) == 0) {
+		    val = plinps_statusval(sc, line+6, &line);
+		    plinps_setcell(sc, PLINPS_TEXT_SIZE, val);
 		    seen_vmexe++;
 	       }
 	       break;
-	  case 'C':	/* Cap* */
-	       break;
 	  default:
 	       break;
 	  }
      }
-     util_scanfree(lines);
 
      if (!seen_vmdata)
-	  table_replacecurrentcell_alloc(tab, "data_size", "0");
+	  plinps_setcell(sc, PLINPS_DATA_SIZE, "0");
      if (!seen_vmlib)
-	  table_replacecurrentcell_alloc(tab, "library", "0");
+	  plinps_setcell(sc, PLINPS_LIBRARY, "0");
      if (!seen_vmexe)
-	  table_replacecurrentcell_alloc(tab, "text_size", "0");
+	  plinps_setcell(sc, PLINPS_TEXT_SIZE, "0");
+}
+
+
+/* Keep the next whitespace separated value from pt on a status line,
+ * setting *end to the character after it */
+char *plinps_statusval(struct plinps_scanbuf *sc, char *pt, char **end)
+{
+     int len;
+
+     pt += strspn(pt, " \t");
+     len = strcspn(pt, " \t\n");
+     *end = pt + len;
+
+     return plinps_keep(sc, pt, len);
 }
 
 
 /* get statistics from /proc/<pid>/statm */
-void plinps_col_statm(TABLE tab, char *ps, ITREE *uidtoname)
+void plinps_col_statm(struct plinps_scanbuf *sc, char *ps)
 {
-     char *value;
+     long shared, dirty;
 
      /* format is typically:-
       *     779 454 536 151 0 628 0
@@ -818,48 +1346,28 @@ void plinps_col_statm(TABLE tab, char *ps, ITREE *uidtoname)
       * col 5  drs        data/stack
       * col 6  lrs        library
       * col 7  dt         dirty pages
+      *
+      * text, data and library come from status as statm's are in pages
+      * and include other mappings
       */
-
-     value = strtok(ps, " ");	/* size */
-     value = strtok(NULL, " ");	/* rss */
-     value = strtok(NULL, " ");	/* share */
-     table_replacecurrentcell_alloc(tab, "shared", 
-				    util_i32toa(strtol(value, NULL, 10)
-							  *plinps_pagetokb));
-     value = strtok(NULL, " ");	/* text_size */
-#if 0
-     table_replacecurrentcell_alloc(tab, "text_size", 
-				    util_i32toa(strtol(value, NULL, 10)
-							  *plinps_pagetokb));
-#endif
-     value = strtok(NULL, " ");	/* data_size */
-#if 0
-     table_replacecurrentcell_alloc(tab, "data_size", 
-				    util_i32toa(strtol(value, NULL, 10)
-							  *plinps_pagetokb));
-#endif
-     value = strtok(NULL, " ");	/* library */
-#if 0
-     table_replacecurrentcell_alloc(tab, "library",
-				    util_i32toa(strtol(value, NULL, 10)
-							  *plinps_pagetokb));
-#endif
-     value = strtok(NULL, " ");	/* dirty */
-     table_replacecurrentcell_alloc(tab, "dirty", 
-				    util_i32toa(strtol(value, NULL, 10)
-							  *plinps_pagetokb));
+     if (sscanf(ps, "%*s %*s %ld %*s %*s %*s %ld", &shared, &dirty) != 2)
+	  return;
+     plinps_setcell(sc, PLINPS_SHARED, plinps_keepf(sc, "%ld", 
+				    (long) (shared * plinps_pagetokb)));
+     plinps_setcell(sc, PLINPS_DIRTY,  plinps_keepf(sc, "%ld", 
+				    (long) (dirty  * plinps_pagetokb)));
 }
 
 
 /* get boot time from system */
 time_t plinps_getboot_t() {
      time_t t;
-     char *data;
+     char *data, *tokpos;
 
      t = time(NULL);
      data = probe_readfile("/proc/uptime");
      if (data) {
-          t -= strtol(strtok(data, " "), NULL, 10);
+          t -= strtol(strtok_r(data, " ", &tokpos), NULL, 10);
      } else {
 	  elog_printf(ERROR, "unable to read uptime, setting ps boot to 0");
 	  t = 0;
@@ -872,7 +1380,7 @@ time_t plinps_getboot_t() {
 
 /* get total memory size */
 long plinps_gettotal_mem() {
-     char *data, *pt;
+     char *data, *pt, *tokpos;
      long mem;
 
      data = probe_readfile("/proc/meminfo");
@@ -892,7 +1400,7 @@ long plinps_gettotal_mem() {
      pt += 9;
      while (*pt && *pt == ' ')
           pt++;
-     mem = strtol(strtok(pt, " "), NULL, 10);
+     mem = strtol(strtok_r(pt, " ", &tokpos), NULL, 10);
      nfree(data);
      return mem;
 }
@@ -905,18 +1413,17 @@ char *plinps_getuser(int uid, ITREE *uidtoname)
      struct passwd *pwent;
 
      /* return name if in table */
+     pthread_mutex_lock(&plinps_lock);
      name = itree_find(uidtoname, uid);
-     if (name != ITREE_NOVAL)
-	  return name;
-
-     /* fetch pw entry and load name into table */
-     pwent = getpwuid(uid);
-     if (pwent)
-	  itree_add(uidtoname, uid, xnstrdup(pwent->pw_name));
-     else
-	  itree_add(uidtoname, uid, xnstrdup("unknown"));
+     if (name == ITREE_NOVAL) {
+	  /* fetch pw entry and load name into table */
+	  pwent = getpwuid(uid);
+	  name = xnstrdup(pwent ? pwent->pw_name : "unknown");
+	  itree_add(uidtoname, uid, name);
+     }
+     pthread_mutex_unlock(&plinps_lock);
 
-     return itree_find(uidtoname, uid);
+     return name;
 }
 
 /* get a test representation of the signal set */
@@ -937,27 +1444,103 @@ void plinps_derive(TABLE prev, TABLE cur) {}
 
 #if TEST
 
+#include "../iiab/iiab.h"
+
+/* Return the cell colname of the row for the process pid or NULL */
+char *plinps_test_cell(TABLE tab, int pid, char *colname)
+{
+     char *cell;
+
+     table_traverse(tab) {
+	  cell = table_getcurrentcell(tab, "pid");
+	  if (cell && strtol(cell, NULL, 10) == pid)
+	       return table_getcurrentcell(tab, colname);
+     }
+     return NULL;
+}
+
 /*
  * Main function
  */
-main(int argc, char *argv[]) {
-     char *buf;
-
-     iiab_start("", argc, argv, "", NULL);
-     plinps_init();
-     plinps_collect();
-     if (argc > 1)
-	  buf = table_outtable(plinps_tab);
-     else
-	  buf = table_print(plinps_tab);
-     if (buf)
-	  puts(buf);
-     else
-	  elog_die(FATAL, "plinps", 0, "no output produced");
-     nfree(buf);
-     table_destroy(plinps_tab);
+int main(int argc, char *argv[]) {
+     char *buf, *cell, args[50];
+     TABLE tab;
+     int i;
+
+     iiab_start("", argc, argv, "", "nmalloc 0\n");
+
+     /* [1] columns from stat alone should not read status, statm or 
+      * cmdline, so the status columns of this process stay blank */
+     plinps_init("-c process,pid,state,size,rss");
+     if (plinps_reads != 0)
+	  elog_die(FATAL, "[1] stat-only columns read files %d", 
+		   plinps_reads);
+     if (plinps_pub == NULL || strcmp(plinps_pub[1], "pid") != 0 ||
+	 plinps_pub[5] != NULL)
+	  elog_die(FATAL, "[1] column list not published");
+     tab = probe_tabinit(plinps_getcols());
+     plinps_collect(tab);
+     if ( ! plinps_test_cell(tab, getpid(), "state") )
+	  elog_die(FATAL, "[1] own process not found");
+     cell = plinps_test_cell(tab, getpid(), "pwname");
+     if (cell && *cell)
+	  elog_die(FATAL, "[1] status read for pwname (%s)", cell);
+     cell = plinps_test_cell(tab, getpid(), "args");
+     if (cell && *cell)
+	  elog_die(FATAL, "[1] cmdline read for args (%s)", cell);
+     table_destroy(tab);
      plinps_fini();
+
+     /* [2] a status column reads status and only that; unknown columns
+      * are ignored */
+     plinps_init("-t 2 -c process,nosuch,pwname");
+     if (plinps_reads != PLINPS_READSTATUS)
+	  elog_die(FATAL, "[2] pwname reads files %d", plinps_reads);
+     if (plinps_nthreads != 2)
+	  elog_die(FATAL, "[2] thread count not read with -c");
+     tab = probe_tabinit(plinps_getcols());
+     plinps_collect(tab);
+     cell = plinps_test_cell(tab, getpid(), "pwname");
+     if ( ! cell || ! *cell )
+	  elog_die(FATAL, "[2] status not read for pwname");
+     table_destroy(tab);
+     if (plinps_nrunning != 2)
+	  elog_die(FATAL, "[2] pool has %d threads", plinps_nrunning);
+     for (i=0; i < 20; i++) {
+	  /* the same pool serves every sample */
+	  tab = probe_tabinit(plinps_getcols());
+	  plinps_collect(tab);
+	  if ( ! plinps_test_cell(tab, getpid(), "state") )
+	       elog_die(FATAL, "[2] own process not found in sample %d", i);
+	  table_destroy(tab);
+     }
+     plinps_fini();
+     if (plinps_threads)
+	  elog_die(FATAL, "[2] pool not stopped");
+
+     /* [3] no column list reads everything */
+     snprintf(args, 50, "-t 1");
+     plinps_init(args);
+     if (plinps_reads != PLINPS_READALL || plinps_pub != NULL)
+	  elog_die(FATAL, "[3] all columns not read");
+     tab = probe_tabinit(plinps_getcols());
+     plinps_collect(tab);
+     cell = plinps_test_cell(tab, getpid(), "args");
+     if ( ! cell || ! *cell )
+	  elog_die(FATAL, "[3] cmdline not read for args");
+     if (argc > 1) {
+	  buf = table_outtable(tab);
+	  if (buf)
+	       puts(buf);
+	  else
+	       elog_die(FATAL, "plinps", 0, "no output produced");
+	  nfree(buf);
+     }
+     table_destroy(tab);
+     plinps_fini();
+
      iiab_stop();
+     printf("tests finished successfully\n");
      exit(0);
 }
 
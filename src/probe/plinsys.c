@@ -163,6 +163,31 @@ char                  **plinsys_getpub()     {return plinsys_pub;}
 /* Linux version; assume 3.x being the latest */
 int plinsys_linuxversion=30;
 
+/* /proc files kept open between samples */
+struct probe_procfile plinsys_loadavg = PROBE_PROCFILE("/proc/loadavg");
+struct probe_procfile plinsys_meminfo = PROBE_PROCFILE("/proc/meminfo");
+struct probe_procfile plinsys_stat    = PROBE_PROCFILE("/proc/stat");
+struct probe_procfile plinsys_uptime  = PROBE_PROCFILE("/proc/uptime");
+struct probe_procfile plinsys_vmstat  = PROBE_PROCFILE("/proc/vmstat");
+
+/* keys to columns in /proc/meminfo and /proc/vmstat */
+struct probe_prockey plinsys_meminfokeys[] = {
+     {"MemTotal",  "mem_tot"},
+     {"MemFree",   "mem_free"},
+     {"Buffers",   "mem_buf"},
+     {"Cached",    "mem_cache"},
+     {"SwapTotal", "swap_tot"},
+     {"SwapFree",  "swap_free"},
+     PROBE_ENDPROCKEY
+};
+struct probe_prockey plinsys_vmstatkeys[] = {
+     {"pgpgin",  "vm_pgpgin"},
+     {"pgpgout", "vm_pgpgout"},
+     {"pswpin",  "vm_pgswpin"},
+     {"pswpout", "vm_pgswpout"},
+     PROBE_ENDPROCKEY
+};
+
 /*
  * Initialise probe for linux system information
  */
@@ -189,8 +214,8 @@ void plinsys_init() {
           plinsys_linuxversion=24;
      } else if (strncmp(vpt, "2.5.", 4) == 0 || strncmp(vpt, "2.6.", 4) == 0) {
           plinsys_linuxversion=26;
-     } else if (strncmp(vpt, "3.", 2) == 0) {
-          plinsys_linuxversion=30;
+     } else if (atoi(vpt) >= 3) {
+          plinsys_linuxversion=30;	/* 3.x and later */
      } else {
           elog_printf(ERROR, "unsupported linux kernel version");
      }
@@ -204,6 +229,15 @@ void plinsys_init() {
 	  plinsys_hz = 100;
      }
 
+     /* from 2.6, keep the files open and re-read them each sample */
+     if (plinsys_linuxversion == 26 || plinsys_linuxversion == 30) {
+          probe_procopen(&plinsys_loadavg);
+          probe_procopen(&plinsys_meminfo);
+          probe_procopen(&plinsys_stat);
+          probe_procopen(&plinsys_uptime);
+          probe_procopen(&plinsys_vmstat);
+     }
+
      nfree(data);
 }
 
@@ -262,89 +296,77 @@ void plinsys_collect22(TABLE tab) {
 
 void plinsys_collect26(TABLE tab) {
      char *data;
-     ITREE *lines;
 
-     /* open and process the loadavg file */
-     data = probe_readfile("/proc/loadavg");
+     /* read and process the loadavg file */
+     data = probe_procread(&plinsys_loadavg);
      if (data) {
 	  table_addemptyrow(tab);
 	  plinsys_col_loadavg(tab, data);
-	  table_freeondestroy(tab, data);
      } else {
 	  elog_send(ERROR, "no data from loadavg; no further "
 		    "sampling will take place");
 	  return;
      }
 
-     /* open and process the meminfo file */
-     data = probe_readfile("/proc/meminfo");
-     if (data) {
-          util_scantext(data, " :\t", UTIL_MULTISEP, &lines);
-	  plinsys_col_meminfo26(tab, lines);
-	  util_scanfree(lines);
-	  table_freeondestroy(tab, data);
-     }
+     /* read and process the meminfo file */
+     data = probe_procread(&plinsys_meminfo);
+     if (data)
+	  plinsys_col_meminfo26(tab, data);
 
-     /* open and process the stat file */
-     data = probe_readfile("/proc/stat");
-     if (data) {
-          util_scantext(data, " ", UTIL_MULTISEP, &lines);
-	  plinsys_col_stat26(tab, lines);
-	  util_scanfree(lines);
-	  table_freeondestroy(tab, data);
-     }
+     /* read and process the stat file */
+     data = probe_procread(&plinsys_stat);
+     if (data)
+	  plinsys_col_stat26(tab, data);
 
-     /* open and process the uptime file */
-     data = probe_readfile("/proc/uptime");
-     if (data) {
+     /* read and process the uptime file */
+     data = probe_procread(&plinsys_uptime);
+     if (data)
           plinsys_col_uptime(tab, data);
-	  table_freeondestroy(tab, data);
-     }
 
-     /* open and process the vmstat file */
-     data = probe_readfile("/proc/vmstat");
-     if (data) {
-          util_scantext(data, " ", UTIL_MULTISEP, &lines);
-          plinsys_col_vmstat(tab, lines);
-	  util_scanfree(lines);
-	  table_freeondestroy(tab, data);
-     }
+     /* read and process the vmstat file */
+     data = probe_procread(&plinsys_vmstat);
+     if (data)
+          plinsys_col_vmstat(tab, data);
 }
 
 
 /* shut down probe */
 void plinsys_fini() {
+     probe_procclose(&plinsys_loadavg);
+     probe_procclose(&plinsys_meminfo);
+     probe_procclose(&plinsys_stat);
+     probe_procclose(&plinsys_uptime);
+     probe_procclose(&plinsys_vmstat);
 }
 
 
-/* interpret the data as a loadavg format and place it into plinsys_tab */
+/* interpret the data as a loadavg format and place it into plinsys_tab.
+ * Values are copied, so data is not kept or altered */
 void  plinsys_col_loadavg(TABLE tab, char *data)
 {
      /* load average looks like this:-
       *
       * 0.00 0.04 0.02 2/42 248
       */
-
-     char *value;
-
-     value = strtok(data, " ");
-     table_replacecurrentcell(tab, "load1", value);
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "load5", value);
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "load15", value);
-     value = strtok(NULL, "/");
-     table_replacecurrentcell(tab, "runque", value);
-     value = strtok(NULL, " ");
-     table_replacecurrentcell(tab, "nprocs", value);
-     value = strtok(NULL, " \n");
-     table_replacecurrentcell(tab, "lastproc", value);
+     char *cols[] = {"load1", "load5", "load15", "runque", "nprocs", 
+		     "lastproc", NULL};
+     char *value, *pt;
+     int i, len;
+
+     pt = data;
+     for (i=0; cols[i]; i++) {
+	  value = probe_proctok(&pt, " /", &len);
+	  if ( ! value )
+	       break;
+	  probe_proccell(tab, cols[i], value, len);
+     }
 }
 
 
 /* interpret the data as a meminfo format and place it into plinsys_tab */
 void  plinsys_col_meminfo(TABLE tab, char *data)
 {
+     char *tokpos;
      /* /proc/meminfo looks like this in 2.2:-
       *
       *    total:    used:    free:  shared: buffers:  cached:
@@ -367,66 +389,66 @@ void  plinsys_col_meminfo(TABLE tab, char *data)
      char *value, *linecheck, *kvalue;
 
      /* read cpu line */
-     linecheck = strtok(data, "\n");		/* skip header line */
-     linecheck = strtok(NULL, " ");		/* read Mem: word */
+     linecheck = strtok_r(data, "\n", &tokpos);		/* skip header line */
+     linecheck = strtok_r(NULL, " ", &tokpos);		/* read Mem: word */
      if (strcmp(linecheck, "Mem:")) {
           elog_printf(ERROR, "can't find Mem line; aborting probe");
 	  return;
      }
-     value = strtok(NULL, " ");
+     value = strtok_r(NULL, " ", &tokpos);
      kvalue = xnstrdup(util_i32toa(strtol(value, NULL, 10)/1024));
      table_replacecurrentcell(tab, "mem_tot", kvalue);
      table_freeondestroy(tab, kvalue);
 
-     value = strtok(NULL, " ");
+     value = strtok_r(NULL, " ", &tokpos);
      kvalue = xnstrdup(util_i32toa(strtol(value, NULL, 10)/1024));
      table_replacecurrentcell(tab, "mem_used", kvalue);
      table_freeondestroy(tab, kvalue);
 
-     value = strtok(NULL, " ");
+     value = strtok_r(NULL, " ", &tokpos);
      kvalue = xnstrdup(util_i32toa(strtol(value, NULL, 10)/1024));
      table_replacecurrentcell(tab, "mem_free", kvalue);
      table_freeondestroy(tab, kvalue);
 
-     value = strtok(NULL, " ");
+     value = strtok_r(NULL, " ", &tokpos);
      kvalue = xnstrdup(util_i32toa(strtol(value, NULL, 10)/1024));
      table_replacecurrentcell(tab, "mem_shared", kvalue);
      table_freeondestroy(tab, kvalue);
 
-     value = strtok(NULL, " ");
+     value = strtok_r(NULL, " ", &tokpos);
      kvalue = xnstrdup(util_i32toa(strtol(value, NULL, 10)/1024));
      table_replacecurrentcell(tab, "mem_buf", kvalue);
      table_freeondestroy(tab, kvalue);
 
-     value = strtok(NULL, " \n");
+     value = strtok_r(NULL, " \n", &tokpos);
      kvalue = xnstrdup(util_i32toa(strtol(value, NULL, 10)/1024));
      table_replacecurrentcell(tab, "mem_cache", kvalue);
      table_freeondestroy(tab, kvalue);
 
      /* read Swap line */
-     linecheck = strtok(NULL, " ");		/* read Swap: word */
+     linecheck = strtok_r(NULL, " ", &tokpos);		/* read Swap: word */
      if (strcmp(linecheck, "Swap:")) {
           elog_printf(ERROR, "can't find Swap line; aborting probe");
 	  return;
      }
-     value = strtok(NULL, " ");
+     value = strtok_r(NULL, " ", &tokpos);
      kvalue = xnstrdup(util_i32toa(strtol(value, NULL, 10)/1024));
      table_replacecurrentcell(tab, "swap_tot", kvalue);
      table_freeondestroy(tab, kvalue);
 
-     value = strtok(NULL, " ");
+     value = strtok_r(NULL, " ", &tokpos);
      kvalue = xnstrdup(util_i32toa(strtol(value, NULL, 10)/1024));
      table_replacecurrentcell(tab, "swap_used", kvalue);
      table_freeondestroy(tab, kvalue);
 
-     value = strtok(NULL, " \n");
+     value = strtok_r(NULL, " \n", &tokpos);
      kvalue = xnstrdup(util_i32toa(strtol(value, NULL, 10)/1024));
      table_replacecurrentcell(tab, "swap_free", kvalue);
      table_freeondestroy(tab, kvalue);
 }
 
 /* interpret the data as a meminfo format and place it into plinsys_tab */
-void  plinsys_col_meminfo26(TABLE tab, ITREE *lol)
+void  plinsys_col_meminfo26(TABLE tab, char *data)
 {
      /* /proc/meminfo in 2.6 is a set of key-value pairs, like this:-
       *
@@ -437,32 +459,10 @@ void  plinsys_col_meminfo26(TABLE tab, ITREE *lol)
       *   SwapCached:          0 kB
       *   ...etc...
       */
-     char *value, *attr;
-     ITREE *row;
      long result;
      struct sysinfo si;
 
-     itree_traverse(lol) {
-          row = itree_get(lol);
-	  attr = itree_find(row , 0);
-	  if (attr == ITREE_NOVAL)
-	       continue;
-	  itree_next(row);
-	  value = itree_get(row);
-
-	  if (strcmp(attr, "MemTotal") == 0)
-	      table_replacecurrentcell(tab, "mem_tot", value);
-	  if (strcmp(attr, "MemFree") == 0)
-	      table_replacecurrentcell(tab, "mem_free", value);
-	  if (strcmp(attr, "Buffers") == 0)
-	      table_replacecurrentcell(tab, "mem_buf", value);
-	  if (strcmp(attr, "Cached") == 0)
-	      table_replacecurrentcell(tab, "mem_cache", value);
-	  if (strcmp(attr, "SwapTotal") == 0)
-	      table_replacecurrentcell(tab, "swap_tot", value);
-	  if (strcmp(attr, "SwapFree") == 0)
-	      table_replacecurrentcell(tab, "swap_free", value);
-    }
+     probe_prockeys(tab, data, " :\t", plinsys_meminfokeys);
 
      /* calculate derived values */
      result = strtol(table_getcurrentcell(tab, "mem_tot"), NULL, 10) -
@@ -482,6 +482,7 @@ void  plinsys_col_meminfo26(TABLE tab, ITREE *lol)
 /* interpret the data as a stat format and place it into plinsys_tab */
 void  plinsys_col_stat(TABLE tab, char *data)
 {
+     char *tokpos;
      /* /proc/stat in 2.2 & 2.4 has a layout similar to this below:-
       *
       * cpu  2311 11281 8225 357467
@@ -509,7 +510,7 @@ void  plinsys_col_stat(TABLE tab, char *data)
      char *value, *linecheck;
 
      /* read cpu line */
-     linecheck = strtok(data, " ");
+     linecheck = strtok_r(data, " ", &tokpos);
      if (strcmp(linecheck, "cpu")) {
           elog_printf(ERROR,"can't find cpu line as first line in /proc/stat, "
 		      "have %s; aborting probe", linecheck);
@@ -517,16 +518,16 @@ void  plinsys_col_stat(TABLE tab, char *data)
      }
 
      /* collect cpu ticks to place into table and calculate the sum */
-     value = strtok(NULL, " ");
+     value = strtok_r(NULL, " ", &tokpos);
      table_replacecurrentcell(tab, "cpu_tick_user", value);
 
-     value = strtok(NULL, " ");
+     value = strtok_r(NULL, " ", &tokpos);
      table_replacecurrentcell(tab, "cpu_tick_nice", value);
 
-     value = strtok(NULL, " ");
+     value = strtok_r(NULL, " ", &tokpos);
      table_replacecurrentcell(tab, "cpu_tick_system", value);
 
-     value = strtok(NULL, " \n");
+     value = strtok_r(NULL, " \n", &tokpos);
      table_replacecurrentcell(tab, "cpu_tick_idle", value);
 
      table_replacecurrentcell(tab, "cpu_tick_wait", "0");
@@ -546,10 +547,10 @@ void  plinsys_col_stat(TABLE tab, char *data)
      /* read page line */
      /* NOTE: i probably want to convert this to bytes not pages to make
       * it consistant */
-     linecheck = strtok(linecheck, " ");	/* page word */
-     value = strtok(NULL, " ");
+     linecheck = strtok_r(linecheck, " ", &tokpos);	/* page word */
+     value = strtok_r(NULL, " ", &tokpos);
      table_replacecurrentcell(tab, "vm_pgpgin", value);
-     value = strtok(NULL, " \n");
+     value = strtok_r(NULL, " \n", &tokpos);
      table_replacecurrentcell(tab, "vm_pgpgout", value);
 
      /* skip over \0 from strtok and go to swap line */
@@ -561,10 +562,10 @@ void  plinsys_col_stat(TABLE tab, char *data)
 	  return;
      }
      /* read swap line */
-     linecheck = strtok(NULL, " ");		/* swap word */
-     value = strtok(NULL, " ");
+     linecheck = strtok_r(NULL, " ", &tokpos);		/* swap word */
+     value = strtok_r(NULL, " ", &tokpos);
      table_replacecurrentcell(tab, "vm_pgswpin", value);
-     value = strtok(NULL, " \n");
+     value = strtok_r(NULL, " \n", &tokpos);
      table_replacecurrentcell(tab, "vm_pgswpout", value);
 
      /* skip over \0 from strtok and go to intr line */
@@ -575,8 +576,8 @@ void  plinsys_col_stat(TABLE tab, char *data)
 	  return;
      }
      /* read intr line (only want the summary) */
-     linecheck = strtok(NULL, " ");		/* intr word */
-     value = strtok(NULL, " ");
+     linecheck = strtok_r(NULL, " ", &tokpos);		/* intr word */
+     value = strtok_r(NULL, " ", &tokpos);
      table_replacecurrentcell(tab, "nintr", value);
 
      /* skip over \0 from strtok and go to ctxt line */
@@ -588,8 +589,8 @@ void  plinsys_col_stat(TABLE tab, char *data)
 	  return;
      }
      /* read ctxt line */
-     linecheck = strtok(NULL, " ");		/* ctxt word */
-     value = strtok(NULL, " \n");
+     linecheck = strtok_r(NULL, " ", &tokpos);		/* ctxt word */
+     value = strtok_r(NULL, " \n", &tokpos);
      table_replacecurrentcell(tab, "ncontext", value);
 
      /* skip over \0 from strtok and go to processes line */
@@ -601,13 +602,13 @@ void  plinsys_col_stat(TABLE tab, char *data)
 	  return;
      }
      /* read processes line */
-     linecheck = strtok(NULL, " \n");		/* processes word */
-     value = strtok(NULL, " \n");
+     linecheck = strtok_r(NULL, " \n", &tokpos);		/* processes word */
+     value = strtok_r(NULL, " \n", &tokpos);
      table_replacecurrentcell(tab, "nforks", value);
 }
 
 /* interpret the data as a stat format and place it into plinsys_tab */
-void  plinsys_col_stat26(TABLE tab, ITREE *lol)
+void  plinsys_col_stat26(TABLE tab, char *data)
 {
      /* /proc/stat in 2.6 has a layout similar to this below:-
       *   cpu  11712 38 1358 104634 4200 81 0
@@ -622,82 +623,42 @@ void  plinsys_col_stat26(TABLE tab, ITREE *lol)
       * Added on to the cpu lines are:-
       *   In 2.6.18 Steal are the number of ticks spent in other VMs
       *   In 2.6.24 Guest is the time spent running guest VMs
+      *
+      * The intr line has a count for every interrupt, so is long on 
+      * large machines; only its total is taken and the rest skipped.
       */
-     char *value, *attr;
-     ITREE *row;
-
-     itree_traverse(lol) {
-          row = itree_get(lol);
-	  attr = itree_find(row , 0);
-	  if (attr == ITREE_NOVAL)
-	       continue;
-
-	  if (strcmp(attr, "cpu") == 0) {
-	       itree_next(row);		/* user cpu jiffies / ticks */
-	       value = itree_get(row);
-	       table_replacecurrentcell(tab, "cpu_tick_user", value);
-
-	       itree_next(row);		/* nice user cpu jiffies / ticks */
-	       value = itree_get(row);
-	       table_replacecurrentcell(tab, "cpu_tick_nice", value);
-
-	       itree_next(row);		/* system cpu jiffies / ticks */
-	       value = itree_get(row);
-	       table_replacecurrentcell(tab, "cpu_tick_system", value);
-
-	       itree_next(row);		/* idle cpu jiffies / ticks */
-	       value = itree_get(row);
-	       table_replacecurrentcell(tab, "cpu_tick_idle", value);
-
-	       itree_next(row);		/* iowait cpu jiffies / ticks */
-	       value = itree_get(row);
-	       table_replacecurrentcell(tab, "cpu_tick_wait", value);
-
-	       itree_next(row);		/* irq cpu jiffies / ticks */
-	       value = itree_get(row);
-	       table_replacecurrentcell(tab, "cpu_tick_irq", value);
-
-	       itree_next(row);		/* softirq cpu jiffies / ticks */
-	       value = itree_get(row);
-	       table_replacecurrentcell(tab, "cpu_tick_softirq", value);
-
-	       /* virtual machine figures if present */
-	       itree_next(row);		/* steal cpu jiffies / ticks */
-	       if (!itree_isbeyondend(row)) {
-		    value = itree_get(row);
-		    table_replacecurrentcell(tab, "cpu_tick_steal", value);
-	       } else
-		    table_replacecurrentcell(tab, "cpu_tick_steal", "0");
-
-	       itree_next(row);		/* guest cpu jiffies / ticks */
-	       if (!itree_isbeyondend(row)) {
-		 value = itree_get(row);
-		 table_replacecurrentcell(tab, "cpu_tick_guest", value);
-	       } else
-		 table_replacecurrentcell(tab, "cpu_tick_guest", "0");
-	  }
-
-	  if (strcmp(attr, "intr") == 0) {
-	       itree_next(row);		/* interrupts */
-	       value = itree_get(row);
-	       table_replacecurrentcell(tab, "nintr", value);
-	  }
-
-	  if (strcmp(attr, "ctxt") == 0) {
-	       itree_next(row);		/* number of contect switches */
-	       value = itree_get(row);
-	       table_replacecurrentcell(tab, "ncontext", value);
-	  }
-
-	  if (strcmp(attr, "processes") == 0) {
-	       itree_next(row);		/* number of process forks */
-	       value = itree_get(row);
-	       table_replacecurrentcell(tab, "nforks", value);
+     char *cpucols[] = {"cpu_tick_user", "cpu_tick_nice", "cpu_tick_system",
+			"cpu_tick_idle", "cpu_tick_wait", "cpu_tick_irq",
+			"cpu_tick_softirq", "cpu_tick_steal", 
+			"cpu_tick_guest", NULL};
+     struct probe_prockey counts[] = {
+	  {"intr",      "nintr"},		/* total interrupts */
+	  {"ctxt",      "ncontext"},	/* number of context switches */
+	  {"processes", "nforks"},		/* number of process forks */
+	  PROBE_ENDPROCKEY
+     };
+     char *pt, *value;
+     int i, len;
+
+     /* the total cpu line comes first, with steal and guest ticks 
+      * missing from older kernels */
+     pt = data;
+     value = probe_proctok(&pt, " ", &len);
+     if (value && len == 3 && strncmp(value, "cpu", 3) == 0) {
+	  for (i=0; cpucols[i]; i++) {
+	       value = probe_proctok(&pt, " ", &len);
+	       if (value)
+		    probe_proccell(tab, cpucols[i], value, len);
+	       else
+		    table_replacecurrentcell(tab, cpucols[i], "0");
 	  }
      }
+
+     probe_prockeys(tab, data, " ", counts);
 }
 
-/* interpret the data as a uptime format and place it into the table */
+/* interpret the data as a uptime format and place it into the table.
+ * Values are copied, so data is not kept or altered */
 void  plinsys_col_uptime(TABLE tab, char *data)
 {
      /* /proc/uptime looks like this:-
@@ -705,13 +666,16 @@ void  plinsys_col_uptime(TABLE tab, char *data)
       * 10105.01 10056.12
       * uptime   idle
       */
-
-     char *value;
-
-     value = strtok(data, " ");
-     table_replacecurrentcell(tab, "uptime", value);
-     value = strtok(NULL, " \n");
-     table_replacecurrentcell(tab, "idletime", value);
+     char *value, *pt;
+     int len;
+
+     pt = data;
+     value = probe_proctok(&pt, " ", &len);
+     if (value)
+	  probe_proccell(tab, "uptime", value, len);
+     value = probe_proctok(&pt, " ", &len);
+     if (value)
+	  probe_proccell(tab, "idletime", value, len);
 }
 
 
@@ -856,7 +820,7 @@ void plinsys_derive(TABLE prev, TABLE cur)
 
 
 /* collect the contents of /proc/vmstat */
-void  plinsys_col_vmstat(TABLE tab, ITREE *lol) {
+void  plinsys_col_vmstat(TABLE tab, char *data) {
      /*
       * /proc/vmstat in 2.6 has a layout similar to this below:-
       *   nr_dirty 14
@@ -885,26 +849,8 @@ void  plinsys_col_vmstat(TABLE tab, ITREE *lol) {
       *   allocstall 0
       *   pgrotated 0
       */
-     char *value, *attr;
-     ITREE *row;
-
-     itree_traverse(lol) {
-          row = itree_get(lol);
-	  attr = itree_find(row , 0);
-	  if (attr == ITREE_NOVAL)
-	       continue;
-	  itree_next(row);
-	  value = itree_get(row);
-
-	  if (strcmp(attr, "pgpgin") == 0)
-	       table_replacecurrentcell(tab, "vm_pgpgin", value);
-	  if (strcmp(attr, "pgpgout") == 0)
-	       table_replacecurrentcell(tab, "vm_pgpgout", value);
-	  if (strcmp(attr, "pswpin") == 0)
-	       table_replacecurrentcell(tab, "vm_pgswpin", value);
-	  if (strcmp(attr, "pswpout") == 0)
-	       table_replacecurrentcell(tab, "vm_pgswpout", value);
-     }
+
+     probe_prockeys(tab, data, " ", plinsys_vmstatkeys);
 }
 
 
@@ -87,6 +87,7 @@ void plinup_fini()
 /* interpret the data as an uptime format and place it into plinup_tab */
 void  plinup_col_uptime(TABLE tab, char *data)
 {
+     char *tokpos;
      /* uptime looks like this:-
       *
       * 22462.41 20636.43
@@ -99,7 +100,7 @@ void  plinup_col_uptime(TABLE tab, char *data)
      time_t now, down, boot;
 
      /* uptime, the number of seconds since boot */
-     uptime = strtok(data, " ");
+     uptime = strtok_r(data, " ", &tokpos);
      table_replacecurrentcell(tab, "uptime", uptime);
      
      /* boottime from utmp; if utmp is unreadable, use now-uptime.
@@ -132,6 +133,7 @@ void  plinup_col_uptime(TABLE tab, char *data)
  * current row of  plinup_tab */
 void  plinup_col_cpuinfo(TABLE tab, char *data)
 {
+     char *tokpos;
      /* /proc/cpuinfo looks like this:-
       *
       * processor	\t: 0
@@ -169,7 +171,7 @@ void  plinup_col_cpuinfo(TABLE tab, char *data)
       * so that the lines can be in any order */
      linecheck = data;
      while (linecheck != NULL) {
-	  linecheck = strtok(linecheck, "\t:");		/* read name */
+	  linecheck = strtok_r(linecheck, "\t:", &tokpos);		/* read name */
 	  if (linecheck == NULL)
 	       break;
 	  else if (strcmp(linecheck, "vendor_id") == 0)
@@ -188,7 +190,7 @@ void  plinup_col_cpuinfo(TABLE tab, char *data)
 		* the number seen */
 	       if (strcmp(linecheck, "processor") == 0)
 		    nproc++;
-	       linecheck = strtok(NULL, "\n");		/* read value */
+	       linecheck = strtok_r(NULL, "\n", &tokpos);		/* read value */
 	       if (linecheck == NULL)
 		    break;
 	       linecheck += strlen(linecheck)+1;	/* start next line */
@@ -196,7 +198,7 @@ void  plinup_col_cpuinfo(TABLE tab, char *data)
 	  }
 
 	  /* read value into table */
-	  linecheck = strtok(NULL, "\n");		/* read value */
+	  linecheck = strtok_r(NULL, "\n", &tokpos);		/* read value */
 	  while (!isalnum(*linecheck))			/* strip leading */
 	       linecheck++;
 
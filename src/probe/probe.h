@@ -45,6 +45,7 @@ struct probe_datainfo {
      struct probe_rowdiff *rowdiff;	/* row diff list */
      char **pub;			/* published column list */
      void (*derive)(TABLE,TABLE);	/* routine to derive new calcs */
+     struct probe_diffindex *oldindex;	/* index of old for differencing */
 };
 
 /* Difference calculation structure, terminated by PROBE_ENDROWDIFF */
@@ -54,6 +55,29 @@ struct probe_rowdiff {
 };
 #define PROBE_ENDROWDIFF {NULL, NULL}
 
+/* Types of value that may be differenced, from the `type' info row */
+enum probe_difftype {
+     PROBE_DIFF_I32,			/* signed 32 bit */
+     PROBE_DIFF_U32,			/* unsigned 32 bit counter */
+     PROBE_DIFF_I64,			/* signed 64 bit */
+     PROBE_DIFF_U64			/* unsigned 64 bit counter */
+};
+
+/* Index of a sample's keys and parsed source values, built as the sample 
+ * is differenced and kept until the next sample to be differenced 
+ * against it, so each table is searched by hash and parsed only once */
+struct probe_diffindex {
+     int    nrows;			/* rows in the sample */
+     int    ndiff;			/* number of row diffs (columns) */
+     char **keys;			/* key of each row (in the table) or
+					 * NULL if the sample has no key */
+     int   *htab;			/* open addressed hash of row indexes*/
+     int    hsize;			/* slots in htab, a power of 2 */
+     unsigned long long *vals;		/* values, nrows x ndiff */
+     char  *valid;			/* 1 if the value was present */
+};
+#define PROBE_DIFFLEN 24		/* space for a formatted difference */
+
 /* functions */
 TABLE probe_tabinit(struct probe_sampletab *hd);
 int   probe_init(char *command,ROUTE out,ROUTE err, struct meth_runset *rset);
@@ -63,12 +87,44 @@ enum exectype probe_type();
 int   probe_action(char *command,ROUTE out,ROUTE err,struct meth_runset *rset);
 int   probe_fini(char *command,ROUTE out,ROUTE err,struct meth_runset *rset);
 void  probe_rundiff(struct probe_datainfo *dinfo);
-void  probe_rowdiff(struct probe_datainfo *dinfo);
+enum probe_difftype probe_difftypeof(char *type);
+unsigned long long probe_diffval(enum probe_difftype type,
+				 unsigned long long oldval, 
+				 unsigned long long newval);
+int   probe_difflookup(struct probe_diffindex *idx, char *key);
+void  probe_freediffindex(struct probe_diffindex *idx);
 char *probe_readfile(char *fname);
 extern struct meth_info probe_cbinfo;
 
 #define PROBE_STATSZ 8192
 
+/* A /proc file that is opened once and read again from the start for 
+ * each sample, into a buffer that is kept between reads */
+struct probe_procfile {
+     char *fname;			/* name of file */
+     int   fd;				/* open descriptor or -1 if closed */
+     char *buf;				/* text of last read, '\0' terminated */
+     int   bufsz;			/* size of buf */
+};
+#define PROBE_PROCFILE(fname) {fname, -1, NULL, 0}
+
+/* Key names in a /proc file of 'key value' lines and the column their
+ * values are placed in. Terminate with PROBE_ENDPROCKEY */
+struct probe_prockey {
+     char *key;
+     char *colname;
+};
+#define PROBE_ENDPROCKEY {NULL, NULL}
+
+int   probe_procopen(struct probe_procfile *pf);
+char *probe_procread(struct probe_procfile *pf);
+void  probe_procclose(struct probe_procfile *pf);
+char *probe_proctok(char **pt, const char *sep, int *len);
+char *probe_procnextline(char *pt);
+int   probe_proccell(TABLE tab, char *colname, char *str, int len);
+int   probe_prockeys(TABLE tab, char *data, const char *sep, 
+		     struct probe_prockey *keys);
+
 #if __svr4__
 
 #include <kstat.h>		/* Solaris uses kstat */
@@ -136,18 +192,62 @@ void  psoldown_derive(TABLE prev, TABLE cur);
 #elif linux
 
 #include <signal.h>
+#include <pthread.h>
+
+/* Buffers used while scanning /proc for processes, one per thread */
+struct plinps_scanbuf {
+     char *rbuf;		/* file read buffer, reused for each file */
+     int   rbufsz;		/* size of rbuf */
+     char *blk;			/* current block of cell text */
+     int   blkused;		/* bytes used in blk */
+     TABLE tab;			/* table being collected, which owns blk */
+     int   procfd;		/* descriptor of open /proc */
+     int   reads;		/* PLINPS_READ* files to read */
+     int  *pids;		/* pids to scan */
+     int   npids;		/* number of pids */
+     char **rows;		/* cells of rows collected, by column number */
+     int   nrows;		/* number of rows collected */
+     int   rowalloc;		/* rows allocated */
+     char **row;		/* cells of current row */
+};
+
+/* Details remembered between samples for each process */
+struct plinps_pidinfo {
+     unsigned long long start;	/* start time in jiffies since boot */
+     char *args;		/* command line (nmalloc()ed) or NULL */
+     int   zombie;		/* process is a zombie */
+     int   seen;		/* sample number it was last seen in */
+};
 
 struct probe_sampletab *plinps_getcols();
 struct probe_rowdiff   *plinps_getrowdiff();
 char                  **plinps_getpub();
 void   plinps_init(char *probeargs);
 void   plinps_fini();
+void   plinps_setpub(char *cols, int len);
 void   plinps_collect(TABLE tab);
+void   plinps_scanpids(struct plinps_scanbuf *sc);
+void   plinps_threadstart();
+void   plinps_threadstop();
+void * plinps_scanthread(void *unused);
+int    plinps_cmppid(const void *a, const void *b);
+void   plinps_newrow(struct plinps_scanbuf *sc);
+void   plinps_addrows(struct plinps_scanbuf *sc, TABLE tab);
+char * plinps_readat(struct plinps_scanbuf *sc, int dirfd, char *fname);
+char * plinps_keep(struct plinps_scanbuf *sc, char *str, int len);
+char * plinps_keepf(struct plinps_scanbuf *sc, const char *fmt, ...);
+char * plinps_keepjiffy(struct plinps_scanbuf *sc, unsigned long long jiffies);
+int    plinps_needs(char **pub);
+struct plinps_pidinfo *plinps_getpidinfo(int pid, unsigned long long start);
+void   plinps_sweepcache();
+void   plinps_clearcache();
 void   plinps_col_fperm(TABLE tab, char *pfile, ITREE *uidtoname);
-void   plinps_col_cmd(TABLE tab, char *value);
-void   plinps_col_stat(TABLE tab, char *ps, ITREE *uidtoname);
-void   plinps_col_status(TABLE tab, char *ps, ITREE *uidtoname);
-void   plinps_col_statm(TABLE tab, char *ps, ITREE *uidtoname);
+void   plinps_col_cmd(struct plinps_scanbuf *sc, char *value);
+struct plinps_pidinfo *plinps_col_stat(struct plinps_scanbuf *sc, char *ps);
+void   plinps_col_status(struct plinps_scanbuf *sc, char *ps, 
+			 ITREE *uidtoname);
+char * plinps_statusval(struct plinps_scanbuf *sc, char *pt, char **end);
+void   plinps_col_statm(struct plinps_scanbuf *sc, char *ps);
 time_t plinps_getboot_t();
 long   plinps_gettotal_mem();
 char * plinps_getuser(int uid, ITREE *uidtoname);
@@ -158,8 +258,9 @@ struct probe_sampletab *plinintr_getcols();
 struct probe_rowdiff   *plinintr_getrowdiff();
 char                  **plinintr_getpub();
 void  plinintr_init();
+void  plinintr_fini();
 void  plinintr_collect(TABLE tab);
-void  plinintr_col_intr(TABLE tab, ITREE *idata);
+void  plinintr_col_intr(TABLE tab, char *line);
 void  plinintr_derive(TABLE prev, TABLE cur);
 
 struct probe_sampletab *plinnames_getcols();
@@ -181,19 +282,20 @@ void  plinsys_collect22(TABLE tab);
 void  plinsys_collect26(TABLE tab);
 void  plinsys_col_loadavg(TABLE tab, char *data);
 void  plinsys_col_meminfo(TABLE tab, char *data);
-void  plinsys_col_meminfo26(TABLE tab, ITREE *lol);
+void  plinsys_col_meminfo26(TABLE tab, char *data);
 void  plinsys_col_stat(TABLE tab, char *data);
-void  plinsys_col_stat26(TABLE tab, ITREE *data);
+void  plinsys_col_stat26(TABLE tab, char *data);
 void  plinsys_col_uptime(TABLE tab, char *data);
-void  plinsys_col_vmstat(TABLE tab, ITREE *data);
+void  plinsys_col_vmstat(TABLE tab, char *data);
 void  plinsys_derive(TABLE prev, TABLE cur);
 
 struct probe_sampletab *plinnet_getcols();
 struct probe_rowdiff   *plinnet_getrowdiff();
 char                  **plinnet_getpub();
 void  plinnet_init();
+void  plinnet_fini();
 void  plinnet_collect(TABLE tab);
-void  plinnet_col_netdev(TABLE tab, ITREE *idata);
+void  plinnet_col_netdev(TABLE tab, char *line);
 void  plinnet_derive(TABLE prev, TABLE cur);
 
 struct probe_sampletab *plinup_getcols();